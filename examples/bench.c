@@ -0,0 +1,640 @@
+/**
+ * \file bench.c
+ * Measures open, cache load, listing, small transaction latency and
+ * transfer throughput of a device and prints the results as JSON or
+ * CSV, so that they can be compared between devices and releases.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#include "common.h"
+#include "util.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#define MAX_RESULTS 64
+
+/* Transfer sizes, cut off at the -m size */
+static const uint64_t transfer_sizes[] = {
+  4ULL << 10,
+  64ULL << 10,
+  1ULL << 20,
+  16ULL << 20,
+  256ULL << 20,
+  1ULL << 30,
+  4ULL << 30,
+};
+
+typedef struct {
+  char name[32];
+  uint64_t size;    /* bytes moved per sample, 0 if not a transfer */
+  int samples;
+  uint64_t min;     /* usecs */
+  uint64_t max;
+  uint64_t sum;
+} result_t;
+
+static result_t results[MAX_RESULTS];
+static int nrofresults = 0;
+
+static uint64_t now_usecs(void)
+{
+#ifdef HAVE_SYS_TIME_H
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+  return (uint64_t) time(NULL) * 1000000;
+#endif
+}
+
+static result_t *get_result(char const * const name, uint64_t const size)
+{
+  int i;
+
+  for (i = 0; i < nrofresults; i++) {
+    if (results[i].size == size && !strcmp(results[i].name, name))
+      return &results[i];
+  }
+  if (nrofresults == MAX_RESULTS)
+    return NULL;
+  memset(&results[nrofresults], 0, sizeof(result_t));
+  strncpy(results[nrofresults].name, name, sizeof(results[nrofresults].name) - 1);
+  results[nrofresults].size = size;
+  return &results[nrofresults++];
+}
+
+static void add_sample(char const * const name, uint64_t const size,
+		       uint64_t const usecs)
+{
+  result_t *r = get_result(name, size);
+
+  if (r == NULL)
+    return;
+  if (r->samples == 0 || usecs < r->min)
+    r->min = usecs;
+  if (usecs > r->max)
+    r->max = usecs;
+  r->sum += usecs;
+  r->samples++;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: mtp-bench [-d <device>] [-f json|csv] [-i <iterations>]\n"
+	  "                 [-l <calls>] [-m <max size>] [-n] [-s]\n"
+	  "  -d  index of the raw device to use, default 0\n"
+	  "  -f  output format, default json\n"
+	  "  -i  iterations of each test, default 3\n"
+	  "  -l  property reads for the latency test, default 100\n"
+	  "  -m  largest transfer, with K, M or G suffix, default 64M\n"
+	  "  -n  do not transfer files (nothing is written to the device)\n"
+	  "  -s  also print the per operation statistics\n");
+  exit(1);
+}
+
+static uint64_t parse_size(char const * const str)
+{
+  char *rest;
+  uint64_t size = strtoull(str, &rest, 0);
+
+  switch (*rest) {
+  case 'k':
+  case 'K':
+    size <<= 10;
+    break;
+  case 'm':
+  case 'M':
+    size <<= 20;
+    break;
+  case 'g':
+  case 'G':
+    size <<= 30;
+    break;
+  default:
+    break;
+  }
+  return size;
+}
+
+/* Prints a string as a JSON string literal */
+static void print_json_string(FILE *out, char const *str)
+{
+  if (str == NULL) {
+    fputs("null", out);
+    return;
+  }
+  fputc('"', out);
+  for (; *str; str++) {
+    unsigned char c = (unsigned char) *str;
+
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+/* CSV fields are quoted only where needed */
+static void print_csv_string(FILE *out, char const *str)
+{
+  if (str == NULL)
+    return;
+  if (strpbrk(str, ",\"\n") == NULL) {
+    fputs(str, out);
+    return;
+  }
+  fputc('"', out);
+  for (; *str; str++) {
+    if (*str == '"')
+      fputc('"', out);
+    fputc(*str, out);
+  }
+  fputc('"', out);
+}
+
+/* Creates a local file of the given size to send */
+static int make_source_file(char *path, uint64_t size)
+{
+  unsigned char *buf;
+  uint64_t left = size;
+  int fd;
+  int i;
+
+#ifdef HAVE_MKSTEMP
+  fd = mkstemp(path);
+#else
+  fd = open(mktemp(path), O_RDWR|O_CREAT|O_TRUNC, S_IRWXU);
+#endif
+  if (fd < 0)
+    return -1;
+  buf = malloc(1 << 20);
+  if (buf == NULL) {
+    close(fd);
+    return -1;
+  }
+  // Not all zeroes, in case something along the way compresses
+  for (i = 0; i < (1 << 20); i++)
+    buf[i] = (unsigned char) (i * 7 + (i >> 8));
+  while (left > 0) {
+    size_t chunk = left < (1 << 20) ? (size_t) left : (1 << 20);
+    ssize_t n = write(fd, buf, chunk);
+
+    if (n <= 0) {
+      free(buf);
+      close(fd);
+      unlink(path);
+      return -1;
+    }
+    left -= n;
+  }
+  free(buf);
+  close(fd);
+  return 0;
+}
+
+static void bench_open(LIBMTP_raw_device_t *rawdevice, int iterations)
+{
+  int i;
+
+  for (i = 0; i < iterations; i++) {
+    LIBMTP_mtpdevice_t *device;
+    uint64_t start;
+
+    start = now_usecs();
+    device = LIBMTP_Open_Raw_Device_Uncached(rawdevice);
+    if (device == NULL) {
+      fprintf(stderr, "mtp-bench: could not open device\n");
+      return;
+    }
+    add_sample("open", 0, now_usecs() - start);
+    LIBMTP_Release_Device(device);
+
+    // A cached open also reads in the metadata of every object
+    start = now_usecs();
+    device = LIBMTP_Open_Raw_Device(rawdevice);
+    if (device == NULL) {
+      fprintf(stderr, "mtp-bench: could not open device\n");
+      return;
+    }
+    add_sample("open_cached", 0, now_usecs() - start);
+    LIBMTP_Release_Device(device);
+  }
+}
+
+static void free_files(LIBMTP_file_t *files)
+{
+  while (files != NULL) {
+    LIBMTP_file_t *tmp = files;
+
+    files = files->next;
+    LIBMTP_destroy_file_t(tmp);
+  }
+}
+
+static void bench_listing_cached(LIBMTP_mtpdevice_t *device, int iterations)
+{
+  int i;
+
+  for (i = 0; i < iterations; i++) {
+    uint64_t start = now_usecs();
+    LIBMTP_file_t *files = LIBMTP_Get_Filelisting_With_Callback(device, NULL, NULL);
+
+    add_sample("listing_cached", 0, now_usecs() - start);
+    free_files(files);
+  }
+  LIBMTP_Clear_Errorstack(device);
+}
+
+static void bench_listing_uncached(LIBMTP_mtpdevice_t *device, int iterations)
+{
+  int i;
+
+  if (device->storage == NULL)
+    return;
+  for (i = 0; i < iterations; i++) {
+    uint64_t start = now_usecs();
+    LIBMTP_file_t *files = LIBMTP_Get_Files_And_Folders(device, device->storage->id,
+							LIBMTP_FILES_AND_FOLDERS_ROOT);
+
+    add_sample("listing_root", 0, now_usecs() - start);
+    free_files(files);
+  }
+  LIBMTP_Clear_Errorstack(device);
+}
+
+/*
+ * One GetObjectPropValue per call: the uncached device has no
+ * properties cached for handles it only got from GetObjectHandles,
+ * as long as nothing was listed on it yet.
+ */
+static void bench_latency(LIBMTP_mtpdevice_t *uncached, int calls)
+{
+  uint32_t *children = NULL;
+  int nrofchildren;
+  int i;
+
+  nrofchildren = LIBMTP_Get_Children(uncached, 0, 0, &children);
+  if (nrofchildren <= 0) {
+    fprintf(stderr, "mtp-bench: no objects in the root folder, skipping latency test\n");
+    LIBMTP_Clear_Errorstack(uncached);
+    return;
+  }
+  for (i = 0; i < calls; i++) {
+    uint64_t start = now_usecs();
+
+    (void) LIBMTP_Get_u32_From_Object(uncached, children[0],
+				      LIBMTP_PROPERTY_StorageID, 0);
+    add_sample("getobjectpropvalue", 0, now_usecs() - start);
+  }
+  free(children);
+  LIBMTP_Clear_Errorstack(uncached);
+}
+
+static void bench_transfers(LIBMTP_mtpdevice_t *device, uint64_t maxsize,
+			    int iterations)
+{
+  unsigned int s;
+
+  for (s = 0; s < sizeof(transfer_sizes) / sizeof(transfer_sizes[0]); s++) {
+    uint64_t size = transfer_sizes[s];
+    char srcpath[] = "/tmp/mtp-bench-src-XXXXXX";
+    char dstpath[] = "/tmp/mtp-bench-dst-XXXXXX";
+    char filename[64];
+    int i;
+
+    if (size > maxsize)
+      break;
+    if (make_source_file(srcpath, size) != 0) {
+      fprintf(stderr, "mtp-bench: could not create a %llu byte file: %s\n",
+	      (long long unsigned int) size, strerror(errno));
+      return;
+    }
+#ifdef HAVE_MKSTEMP
+    {
+      int fd = mkstemp(dstpath);
+
+      if (fd >= 0)
+	close(fd);
+    }
+#else
+    mktemp(dstpath);
+#endif
+    sprintf(filename, "mtp-bench-%llu.bin", (long long unsigned int) size);
+
+    for (i = 0; i < iterations; i++) {
+      LIBMTP_file_t *file = LIBMTP_new_file_t();
+      uint64_t start;
+      int ret;
+
+      file->filename = strdup(filename);
+      file->filesize = size;
+      file->filetype = LIBMTP_FILETYPE_UNKNOWN;
+      file->parent_id = 0;
+      file->storage_id = 0;
+
+      fprintf(stderr, "mtp-bench: %llu bytes, run %d\n",
+	      (long long unsigned int) size, i + 1);
+      start = now_usecs();
+      ret = LIBMTP_Send_File_From_File(device, srcpath, file, NULL, NULL);
+      if (ret != 0) {
+	LIBMTP_Dump_Errorstack(device);
+	LIBMTP_Clear_Errorstack(device);
+	LIBMTP_destroy_file_t(file);
+	break;
+      }
+      add_sample("upload", size, now_usecs() - start);
+
+      start = now_usecs();
+      ret = LIBMTP_Get_File_To_File(device, file->item_id, dstpath, NULL, NULL);
+      if (ret == 0) {
+	add_sample("download", size, now_usecs() - start);
+      } else {
+	LIBMTP_Dump_Errorstack(device);
+	LIBMTP_Clear_Errorstack(device);
+      }
+
+      if (LIBMTP_Delete_Object(device, file->item_id) != 0) {
+	LIBMTP_Dump_Errorstack(device);
+	LIBMTP_Clear_Errorstack(device);
+      }
+      LIBMTP_destroy_file_t(file);
+      if (ret != 0)
+	break;
+    }
+    unlink(srcpath);
+    unlink(dstpath);
+  }
+}
+
+static void print_json(FILE *out, LIBMTP_raw_device_t *rawdevice,
+		       LIBMTP_mtpdevice_t *device,
+		       LIBMTP_op_stats_t *stats, uint32_t nrofstats)
+{
+  char *manufacturer = LIBMTP_Get_Manufacturername(device);
+  char *model = LIBMTP_Get_Modelname(device);
+  char *serial = LIBMTP_Get_Serialnumber(device);
+  char *version = LIBMTP_Get_Deviceversion(device);
+  uint32_t i;
+
+  fprintf(out, "{\n  \"libmtp\": \"%s\",\n  \"timestamp\": %lu,\n",
+	  LIBMTP_VERSION_STRING, (unsigned long) time(NULL));
+  fprintf(out, "  \"device\": {\n    \"vendor_id\": %u,\n    \"product_id\": %u,\n",
+	  rawdevice->device_entry.vendor_id, rawdevice->device_entry.product_id);
+  fputs("    \"manufacturer\": ", out);
+  print_json_string(out, manufacturer);
+  fputs(",\n    \"model\": ", out);
+  print_json_string(out, model);
+  fputs(",\n    \"serial\": ", out);
+  print_json_string(out, serial);
+  fputs(",\n    \"version\": ", out);
+  print_json_string(out, version);
+  fputs("\n  },\n  \"results\": [\n", out);
+  for (i = 0; i < (uint32_t) nrofresults; i++) {
+    result_t *r = &results[i];
+    uint64_t mean = r->samples ? r->sum / r->samples : 0;
+
+    fprintf(out, "    { \"test\": \"%s\", \"size\": %llu, \"samples\": %d, "
+	    "\"min_usecs\": %llu, \"mean_usecs\": %llu, \"max_usecs\": %llu",
+	    r->name, (long long unsigned int) r->size, r->samples,
+	    (long long unsigned int) r->min, (long long unsigned int) mean,
+	    (long long unsigned int) r->max);
+    if (r->size != 0 && mean != 0)
+      fprintf(out, ", \"bytes_per_sec\": %llu",
+	      (long long unsigned int) (r->size * 1000000 / mean));
+    fprintf(out, " }%s\n", i + 1 < (uint32_t) nrofresults ? "," : "");
+  }
+  fputs("  ]", out);
+  if (stats != NULL) {
+    fputs(",\n  \"operations\": [\n", out);
+    for (i = 0; i < nrofstats; i++) {
+      LIBMTP_op_stats_t *st = &stats[i];
+      int j;
+
+      fprintf(out, "    { \"opcode\": \"0x%04x\", \"count\": %u, \"errors\": %u, "
+	      "\"retries\": %u, \"cancels\": %u, \"bytes_in\": %llu, "
+	      "\"bytes_out\": %llu, \"first_byte_usecs\": %llu, "
+	      "\"data_usecs\": %llu, \"total_usecs\": %llu,\n"
+	      "      \"first_byte_histogram\": [",
+	      st->opcode, st->count, st->errors, st->retries, st->cancels,
+	      (long long unsigned int) st->bytes_in,
+	      (long long unsigned int) st->bytes_out,
+	      (long long unsigned int) st->first_byte_usecs,
+	      (long long unsigned int) st->data_usecs,
+	      (long long unsigned int) st->total_usecs);
+      for (j = 0; j < LIBMTP_STATS_BUCKETS; j++)
+	fprintf(out, "%s%u", j ? ", " : "", st->first_byte_histogram[j]);
+      fputs("],\n      \"data_histogram\": [", out);
+      for (j = 0; j < LIBMTP_STATS_BUCKETS; j++)
+	fprintf(out, "%s%u", j ? ", " : "", st->data_histogram[j]);
+      fprintf(out, "] }%s\n", i + 1 < nrofstats ? "," : "");
+    }
+    fputs("  ]", out);
+  }
+  fputs("\n}\n", out);
+
+  free(manufacturer);
+  free(model);
+  free(serial);
+  free(version);
+}
+
+static void print_csv(FILE *out, LIBMTP_mtpdevice_t *device,
+		      LIBMTP_op_stats_t *stats, uint32_t nrofstats)
+{
+  char *model = LIBMTP_Get_Modelname(device);
+  char *serial = LIBMTP_Get_Serialnumber(device);
+  uint32_t i;
+
+  fputs("libmtp,model,serial,test,size,samples,min_usecs,mean_usecs,"
+	"max_usecs,bytes_per_sec\n", out);
+  for (i = 0; i < (uint32_t) nrofresults; i++) {
+    result_t *r = &results[i];
+    uint64_t mean = r->samples ? r->sum / r->samples : 0;
+
+    fprintf(out, "%s,", LIBMTP_VERSION_STRING);
+    print_csv_string(out, model);
+    fputc(',', out);
+    print_csv_string(out, serial);
+    fprintf(out, ",%s,%llu,%d,%llu,%llu,%llu,", r->name,
+	    (long long unsigned int) r->size, r->samples,
+	    (long long unsigned int) r->min, (long long unsigned int) mean,
+	    (long long unsigned int) r->max);
+    if (r->size != 0 && mean != 0)
+      fprintf(out, "%llu", (long long unsigned int) (r->size * 1000000 / mean));
+    fputc('\n', out);
+  }
+  // Operations go in as tests of their own, the total time as mean
+  for (i = 0; i < nrofstats; i++) {
+    LIBMTP_op_stats_t *st = &stats[i];
+    uint64_t mean = st->count ? st->total_usecs / st->count : 0;
+
+    fprintf(out, "%s,", LIBMTP_VERSION_STRING);
+    print_csv_string(out, model);
+    fputc(',', out);
+    print_csv_string(out, serial);
+    fprintf(out, ",op_0x%04x,%llu,%u,,%llu,,\n", st->opcode,
+	    (long long unsigned int) (st->bytes_in + st->bytes_out),
+	    st->count, (long long unsigned int) mean);
+  }
+  free(model);
+  free(serial);
+}
+
+int main(int argc, char **argv)
+{
+  LIBMTP_raw_device_t *rawdevices;
+  LIBMTP_mtpdevice_t *cached;
+  LIBMTP_mtpdevice_t *uncached;
+  LIBMTP_op_stats_t *stats = NULL;
+  uint32_t nrofstats = 0;
+  LIBMTP_error_number_t err;
+  int numrawdevices;
+  int devindex = 0;
+  int iterations = 3;
+  int calls = 100;
+  uint64_t maxsize = 64ULL << 20;
+  int transfers = 1;
+  int want_stats = 0;
+  int csv = 0;
+  uint64_t start;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:f:hi:l:m:ns")) != -1) {
+    switch (opt) {
+    case 'd':
+      devindex = atoi(optarg);
+      break;
+    case 'f':
+      if (!strcmp(optarg, "csv"))
+	csv = 1;
+      else if (strcmp(optarg, "json"))
+	usage();
+      break;
+    case 'i':
+      iterations = atoi(optarg);
+      break;
+    case 'l':
+      calls = atoi(optarg);
+      break;
+    case 'm':
+      maxsize = parse_size(optarg);
+      break;
+    case 'n':
+      transfers = 0;
+      break;
+    case 's':
+      want_stats = 1;
+      break;
+    case 'h':
+    default:
+      usage();
+    }
+  }
+  if (iterations < 1)
+    iterations = 1;
+
+  LIBMTP_Init();
+  err = LIBMTP_Detect_Raw_Devices(&rawdevices, &numrawdevices);
+  if (err == LIBMTP_ERROR_NO_DEVICE_ATTACHED) {
+    fprintf(stderr, "mtp-bench: No Devices have been found\n");
+    return 1;
+  }
+  if (err != LIBMTP_ERROR_NONE) {
+    fprintf(stderr, "mtp-bench: Could not detect devices\n");
+    return 1;
+  }
+  if (devindex < 0 || devindex >= numrawdevices) {
+    fprintf(stderr, "mtp-bench: There is no device %d\n", devindex);
+    free(rawdevices);
+    return 1;
+  }
+
+  fprintf(stderr, "mtp-bench: timing open\n");
+  bench_open(&rawdevices[devindex], iterations);
+
+  // Only one of the devices can be open at a time, uncached goes first
+  uncached = LIBMTP_Open_Raw_Device_Uncached(&rawdevices[devindex]);
+  if (uncached == NULL) {
+    fprintf(stderr, "mtp-bench: Unable to open raw device %d\n", devindex);
+    free(rawdevices);
+    return 1;
+  }
+  // Before the listings, which fill the property cache
+  fprintf(stderr, "mtp-bench: timing small transactions\n");
+  bench_latency(uncached, calls);
+  fprintf(stderr, "mtp-bench: timing listings\n");
+  bench_listing_uncached(uncached, iterations);
+  LIBMTP_Release_Device(uncached);
+
+  start = now_usecs();
+  cached = LIBMTP_Open_Raw_Device_Flags(&rawdevices[devindex],
+					want_stats ? LIBMTP_OPEN_COLLECT_STATS : 0);
+  if (cached == NULL) {
+    fprintf(stderr, "mtp-bench: Unable to open raw device %d\n", devindex);
+    free(rawdevices);
+    return 1;
+  }
+  add_sample("open_cached", 0, now_usecs() - start);
+  bench_listing_cached(cached, iterations);
+
+  if (transfers) {
+    fprintf(stderr, "mtp-bench: timing transfers\n");
+    bench_transfers(cached, maxsize, iterations);
+  }
+
+  // The cost of reading in the metadata is what a cached open adds
+  {
+    result_t *open = get_result("open", 0);
+    result_t *open_cached = get_result("open_cached", 0);
+
+    if (open != NULL && open_cached != NULL &&
+	open->samples && open_cached->samples) {
+      uint64_t a = open->sum / open->samples;
+      uint64_t b = open_cached->sum / open_cached->samples;
+
+      add_sample("cache_load", 0, b > a ? b - a : 0);
+    }
+  }
+
+  if (want_stats && LIBMTP_Get_Stats(cached, &stats, &nrofstats) != 0) {
+    LIBMTP_Dump_Errorstack(cached);
+    LIBMTP_Clear_Errorstack(cached);
+  }
+
+  if (csv)
+    print_csv(stdout, cached, stats, nrofstats);
+  else
+    print_json(stdout, &rawdevices[devindex], cached, stats, nrofstats);
+
+  free(stats);
+  LIBMTP_Release_Device(cached);
+  free(rawdevices);
+  return 0;
+}
@@ -139,6 +139,7 @@ int main (int argc, char **argv)
     uint16_t filetypes_len;
     uint8_t maxbattlevel;
     uint8_t currbattlevel;
+    LIBMTP_open_timings_t timings;
     int ret;
 
     device = LIBMTP_Open_Raw_Device_Uncached(&rawdevices[i]);
@@ -151,6 +152,16 @@ int main (int argc, char **argv)
     LIBMTP_Clear_Errorstack(device);
     LIBMTP_Dump_Device_Info(device);
 
+    if (LIBMTP_Get_Open_Timings(device, &timings) == 0) {
+      printf("Time to open (ms):\n");
+      printf("   Session: %.1f\n", timings.session_usecs / 1000.0);
+      printf("   Device info: %.1f\n", timings.deviceinfo_usecs / 1000.0);
+      printf("   Object size probe: %.1f\n",
+	     timings.object_bitsize_usecs / 1000.0);
+      printf("   Battery level: %.1f\n", timings.battery_level_usecs / 1000.0);
+      printf("   Storage: %.1f\n", timings.storage_usecs / 1000.0);
+    }
+
     printf("MTP-specific device properties:\n");
     // The friendly name
     friendlyname = LIBMTP_Get_Friendlyname(device);
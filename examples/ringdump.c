@@ -0,0 +1,52 @@
+/**
+ * \file ringdump.c
+ * Example program that prints trace ring dumps as text.
+ *
+ * A library configured with --enable-trace-ring keeps the last
+ * transactions of each device in memory, and writes them out when a
+ * program calls LIBMTP_Dump_Trace_Ring() or when the device is
+ * released with LIBMTP_TRACE_RING set to a file name.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#include "common.h"
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: mtp-ringdump <dump> [<dump> ...]\n");
+  fprintf(stderr, "dumps are written with LIBMTP_TRACE_RING=<dump> by a libmtp\n");
+  fprintf(stderr, "configured with --enable-trace-ring\n");
+}
+
+int main (int argc, char **argv)
+{
+  int i;
+  int ret = 0;
+
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+  for (i = 1; i < argc; i++) {
+    if (argc > 2)
+      printf("%s:\n", argv[i]);
+    if (LIBMTP_Decode_Trace_Ring(argv[i], stdout) != 0) {
+      fprintf(stderr, "%s is not a trace ring dump\n", argv[i]);
+      ret = 1;
+    }
+  }
+  return ret;
+}
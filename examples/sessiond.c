@@ -0,0 +1,107 @@
+/**
+ * \file sessiond.c
+ * Example program that shares one open device between programs.
+ *
+ * The device is opened once and served on a unix socket. Any libmtp
+ * program started with LIBMTP_PTPIP_DEVICES=unix:<socket> then uses
+ * it through the daemon, at the same time as the others, and gets the
+ * listing the daemon already read instead of reading the device again.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: mtp-sessiond [-d <device>] <socket>\n"
+	  "  -d  index of the raw device to share, default 0\n"
+	  "Clients use the device with LIBMTP_PTPIP_DEVICES=unix:<socket>\n");
+  exit(1);
+}
+
+static void stop(int sig)
+{
+  // Only here to interrupt the daemon
+}
+
+int main (int argc, char **argv)
+{
+  LIBMTP_raw_device_t *rawdevices;
+  LIBMTP_mtpdevice_t *device;
+  LIBMTP_error_number_t err;
+  struct sigaction sa;
+  char *name;
+  int numrawdevices;
+  int devindex = 0;
+  int opt;
+  int ret;
+
+  while ((opt = getopt(argc, argv, "d:h")) != -1) {
+    switch (opt) {
+    case 'd':
+      devindex = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - 1)
+    usage();
+
+  LIBMTP_Init();
+  err = LIBMTP_Detect_Raw_Devices(&rawdevices, &numrawdevices);
+  if (err == LIBMTP_ERROR_NO_DEVICE_ATTACHED) {
+    fprintf(stderr, "mtp-sessiond: No Devices have been found\n");
+    return 1;
+  }
+  if (err != LIBMTP_ERROR_NONE) {
+    fprintf(stderr, "mtp-sessiond: Could not detect devices\n");
+    return 1;
+  }
+  if (devindex < 0 || devindex >= numrawdevices) {
+    fprintf(stderr, "mtp-sessiond: There is no device %d\n", devindex);
+    free(rawdevices);
+    return 1;
+  }
+  // The clients keep object caches of their own
+  device = LIBMTP_Open_Raw_Device_Uncached(&rawdevices[devindex]);
+  free(rawdevices);
+  if (device == NULL) {
+    fprintf(stderr, "mtp-sessiond: Unable to open raw device %d\n", devindex);
+    return 1;
+  }
+
+  // No SA_RESTART, so the signal gets the daemon out of accept()
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  name = LIBMTP_Get_Friendlyname(device);
+  printf("Sharing %s on %s\n", name ? name : "the device", argv[optind]);
+  free(name);
+  ret = LIBMTP_Serve_Device(device, argv[optind]);
+  if (ret != 0)
+    LIBMTP_Dump_Errorstack(device);
+  LIBMTP_Release_Device(device);
+  return ret != 0;
+}
@@ -0,0 +1,321 @@
+/**
+ * \file checksum.c
+ * Checksums computed over object data as it is transferred, so that
+ * copies can be verified without reading the data a second time.
+ *
+ * CRC32C uses the SSE 4.2 or ARMv8 CRC instructions where the CPU has
+ * them and a slicing-by-8 table otherwise.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "checksum.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_X86 1
+#endif
+
+/* Reflected CRC32C (Castagnoli) polynomial */
+#define CRC32C_POLY 0x82F63B78U
+
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init_table(void)
+{
+  uint32_t crc;
+  int i, j;
+
+  for (i = 0; i < 256; i++) {
+    crc = i;
+    for (j = 0; j < 8; j++)
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    crc32c_table[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++) {
+    crc = crc32c_table[0][i];
+    for (j = 1; j < 8; j++) {
+      crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+      crc32c_table[j][i] = crc;
+    }
+  }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, unsigned char const *p,
+			  unsigned long len)
+{
+  while (len > 0 && ((unsigned long) p & 7) != 0) {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  while (len >= 8) {
+    uint32_t lo = crc ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 |
+			 (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+    uint32_t hi = (uint32_t) p[4] | (uint32_t) p[5] << 8 |
+      (uint32_t) p[6] << 16 | (uint32_t) p[7] << 24;
+
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+      crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+      crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+      crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0)
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(CRC32C_X86)
+static uint32_t __attribute__((target("sse4.2")))
+crc32c_hw(uint32_t crc, unsigned char const *p, unsigned long len)
+{
+  while (len > 0 && ((unsigned long) p & 7) != 0) {
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+    len--;
+  }
+#if defined(__x86_64__)
+  while (len >= 8) {
+    uint64_t v;
+
+    memcpy(&v, p, 8);
+    crc = (uint32_t) __builtin_ia32_crc32di(crc, v);
+    p += 8;
+    len -= 8;
+  }
+#endif
+  while (len >= 4) {
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    crc = __builtin_ia32_crc32si(crc, v);
+    p += 4;
+    len -= 4;
+  }
+  while (len-- > 0)
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+  return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, unsigned char const *p,
+			  unsigned long len)
+{
+  while (len > 0 && ((unsigned long) p & 7) != 0) {
+    crc = __crc32cb(crc, *p++);
+    len--;
+  }
+  while (len >= 8) {
+    uint64_t v;
+
+    memcpy(&v, p, 8);
+    crc = __crc32cd(crc, v);
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0)
+    crc = __crc32cb(crc, *p++);
+  return crc;
+}
+#endif
+
+static uint32_t (*crc32c_func)(uint32_t crc, unsigned char const *p,
+			       unsigned long len) = crc32c_sw;
+
+static void crc32c_setup(void)
+{
+  crc32c_init_table();
+#if defined(CRC32C_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2"))
+    crc32c_func = crc32c_hw;
+#elif defined(__ARM_FEATURE_CRC32)
+  crc32c_func = crc32c_hw;
+#endif
+}
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *h, unsigned char const *p)
+{
+  uint32_t w[64];
+  uint32_t a, b, c, d, e, f, g, hh;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 |
+      (uint32_t) p[4 * i + 2] << 8 | (uint32_t) p[4 * i + 3];
+  for (i = 16; i < 64; i++) {
+    uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  a = h[0]; b = h[1]; c = h[2]; d = h[3];
+  e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+  for (i = 0; i < 64; i++) {
+    uint32_t t1 = hh + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+      ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+      ((a & b) ^ (a & c) ^ (b & c));
+
+    hh = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+  h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+/**
+ * Start a checksum.
+ * @param sum the checksum state.
+ * @param type the kind of checksum to compute.
+ */
+void checksum_init(mtp_checksum_t *sum, LIBMTP_checksum_t type)
+{
+  static const uint32_t sha256_h[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+#ifdef HAVE_PTHREAD_H
+  static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+#else
+  static int crc32c_once = 0;
+#endif
+
+  memset(sum, 0, sizeof(mtp_checksum_t));
+  sum->type = type;
+  switch (type) {
+  case LIBMTP_CHECKSUM_CRC32C:
+#ifdef HAVE_PTHREAD_H
+    pthread_once(&crc32c_once, crc32c_setup);
+#else
+    if (!crc32c_once) {
+      crc32c_setup();
+      crc32c_once = 1;
+    }
+#endif
+    sum->crc = 0xFFFFFFFFU;
+    break;
+  case LIBMTP_CHECKSUM_SHA256:
+    memcpy(sum->h, sha256_h, sizeof(sha256_h));
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * Add data to a checksum.
+ * @param sum the checksum state.
+ * @param data the data.
+ * @param len the number of bytes of data.
+ */
+void checksum_update(mtp_checksum_t *sum, unsigned char const *data,
+		     unsigned long len)
+{
+  sum->length += len;
+  switch (sum->type) {
+  case LIBMTP_CHECKSUM_CRC32C:
+    sum->crc = crc32c_func(sum->crc, data, len);
+    break;
+  case LIBMTP_CHECKSUM_SHA256:
+    if (sum->blockused > 0) {
+      unsigned int n = 64 - sum->blockused;
+
+      if (n > len)
+	n = len;
+      memcpy(sum->block + sum->blockused, data, n);
+      sum->blockused += n;
+      data += n;
+      len -= n;
+      if (sum->blockused < 64)
+	return;
+      sha256_block(sum->h, sum->block);
+      sum->blockused = 0;
+    }
+    while (len >= 64) {
+      sha256_block(sum->h, data);
+      data += 64;
+      len -= 64;
+    }
+    memcpy(sum->block, data, len);
+    sum->blockused = len;
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * Finish a checksum.
+ * @param sum the checksum state, which cannot be added to afterwards.
+ * @param digest where to store the digest, big endian, room for
+ *        LIBMTP_CHECKSUM_MAX_SIZE bytes.
+ * @return the size of the digest in bytes, 0 for no checksum.
+ */
+unsigned int checksum_final(mtp_checksum_t *sum, unsigned char *digest)
+{
+  uint64_t bits = sum->length * 8;
+  uint32_t crc;
+  int i;
+
+  switch (sum->type) {
+  case LIBMTP_CHECKSUM_CRC32C:
+    crc = sum->crc ^ 0xFFFFFFFFU;
+    for (i = 0; i < 4; i++)
+      digest[i] = crc >> (24 - 8 * i);
+    return 4;
+  case LIBMTP_CHECKSUM_SHA256:
+    sum->block[sum->blockused++] = 0x80;
+    if (sum->blockused > 56) {
+      memset(sum->block + sum->blockused, 0, 64 - sum->blockused);
+      sha256_block(sum->h, sum->block);
+      sum->blockused = 0;
+    }
+    memset(sum->block + sum->blockused, 0, 56 - sum->blockused);
+    for (i = 0; i < 8; i++)
+      sum->block[56 + i] = bits >> (56 - 8 * i);
+    sha256_block(sum->h, sum->block);
+    for (i = 0; i < 32; i++)
+      digest[i] = sum->h[i / 4] >> (24 - 8 * (i % 4));
+    return 32;
+  default:
+    return 0;
+  }
+}
@@ -0,0 +1,40 @@
+/**
+ * \file checksum.h
+ * Checksums computed over object data as it is transferred.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __MTP__CHECKSUM__H
+#define __MTP__CHECKSUM__H
+
+#include "libmtp.h"
+
+typedef struct {
+  LIBMTP_checksum_t type;
+  uint64_t length;
+  uint32_t crc;
+  uint32_t h[8];
+  unsigned char block[64];
+  unsigned int blockused;
+} mtp_checksum_t;
+
+void checksum_init(mtp_checksum_t *sum, LIBMTP_checksum_t type);
+void checksum_update(mtp_checksum_t *sum, unsigned char const *data,
+		     unsigned long len);
+unsigned int checksum_final(mtp_checksum_t *sum, unsigned char *digest);
+
+#endif //__MTP__CHECKSUM__H
@@ -41,6 +41,10 @@
 #include "libusb-glue.h"
 #include "device-flags.h"
 #include "playlist-spl.h"
+#include "metadata-cache.h"
+#include "checksum.h"
+#include "ptp-ring.h"
+#include "ptp-chdk-lv.h"
 #include "util.h"
 
 #include "mtpz.h"
@@ -56,6 +60,21 @@ int use_mtpz;
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_UTIME_H
+#include <utime.h>
+#endif
 #ifdef _MSC_VER // For MSVC++
 #define USE_WINDOWS_IO_H
 #include <io.h>
@@ -121,6 +140,7 @@ typedef struct propertymap_struct {
  * for parsing onwards to the usb_event_async function.
  */
 typedef struct event_cb_data_struct {
+  LIBMTP_mtpdevice_t *device;
   LIBMTP_event_cb_fn cb;
   void *user_data;
 } event_cb_data_t;
@@ -146,7 +166,9 @@ static void add_error_to_errorstack(LIBMTP_mtpdevice_t *device,
 static void add_ptp_error_to_errorstack(LIBMTP_mtpdevice_t *device,
 					uint16_t ptp_error,
 					char const * const error_text);
-static void flush_handles(LIBMTP_mtpdevice_t *device);
+static int flush_handles(LIBMTP_mtpdevice_t *device);
+static int emit_loaded_object(LIBMTP_mtpdevice_t *device, PTPObject *ob);
+static void locate_default_folders(LIBMTP_mtpdevice_t *device);
 static uint16_t get_handles_recursively(LIBMTP_mtpdevice_t *device,
 				    PTPParams *params,
 				    uint32_t storageid,
@@ -157,7 +179,10 @@ static uint32_t get_writeable_storageid(LIBMTP_mtpdevice_t *device,
 					uint64_t fitsize);
 static int get_storage_freespace(LIBMTP_mtpdevice_t *device,
 				 LIBMTP_devicestorage_t *storage,
+				 uint64_t fitsize,
 				 uint64_t *freespace);
+static int update_storage_info(LIBMTP_mtpdevice_t *device,
+			       uint32_t const storage_id);
 static int check_if_file_fits(LIBMTP_mtpdevice_t *device,
 			      LIBMTP_devicestorage_t *storage,
 			      uint64_t const filesize);
@@ -190,7 +215,9 @@ static int set_object_u8(LIBMTP_mtpdevice_t *device, uint32_t const object_id,
 			 uint16_t const attribute_id, uint8_t const value);
 static void get_track_metadata(LIBMTP_mtpdevice_t *device, uint16_t objectformat,
 			       LIBMTP_track_t *track);
-static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_t parent);
+static LIBMTP_folder_t *get_subfolders_for_folder(PTPParams *params,
+						  uint32_t const storage,
+						  uint32_t const parent);
 static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
 				    char const * const name,
 				    char const * const artist,
@@ -213,6 +240,10 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
 				uint32_t const * const tracks,
 				uint32_t const no_tracks);
 static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *filedata);
+static uint16_t get_partial_object(LIBMTP_mtpdevice_t *device, uint32_t const id,
+				   uint64_t const filesize, uint64_t offset,
+				   uint32_t maxbytes, unsigned char **data,
+				   unsigned int *size);
 static void add_object_to_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id);
 static void update_metadata_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id);
 static int set_object_filename(LIBMTP_mtpdevice_t *device,
@@ -221,8 +252,149 @@ static int set_object_filename(LIBMTP_mtpdevice_t *device,
                 const char **newname);
 static char *generate_unique_filename(PTPParams* params, char const * const filename);
 static int check_filename_exists(PTPParams* params, char const * const filename);
-static void LIBMTP_Handle_Event(PTPContainer *ptp_event,
+static void LIBMTP_Handle_Event(LIBMTP_mtpdevice_t *device,
+                                PTPContainer *ptp_event,
                                 LIBMTP_event_t *event, uint32_t *out1);
+static void update_cache_from_event(LIBMTP_mtpdevice_t *device,
+				    PTPContainer *ptp_event);
+static uint16_t mtpz_authenticate(PTPParams *params);
+
+/*
+ * Default and smallest bounds of a device opened with
+ * LIBMTP_OPEN_BOUNDED_CACHE, see LIBMTP_Set_Cache_Limits().
+ */
+#define BOUNDED_CACHE_OBJECTS 10000
+#define BOUNDED_CACHE_MIN_OBJECTS 64
+#define BOUNDED_CACHE_FOLDERS 256
+
+/*
+ * Most tracks LIBMTP_Update_Tracks_Metadata() puts in one property
+ * list, fewer if the device turns out to refuse lists that long.
+ */
+#define UPDATE_BATCH_TRACKS 128
+
+/*
+ * Seconds the free space of the storage list is trusted for by
+ * default, and how much room a file must leave on the storage for the
+ * local estimate of the free space to be taken as is.
+ */
+#define STORAGE_CACHE_TTL 30
+#define STORAGE_FREESPACE_MARGIN (16 * 1024 * 1024)
+
+/*
+ * Parts of the device setup that a device opened with LIBMTP_OPEN_LAZY
+ * puts off until first used.
+ */
+#define LAZY_OBJECT_BITSIZE 0x00000001
+#define LAZY_BATTERY_LEVEL 0x00000002
+#define LAZY_STORAGE 0x00000004
+
+/**
+ * The current time in microseconds, for timing things.
+ */
+static uint64_t usecs_now(void)
+{
+#ifdef HAVE_SYS_TIME_H
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+  return (uint64_t) time(NULL) * 1000000;
+#endif
+}
+
+/**
+ * The children of one folder as the device last listed them, kept by
+ * a device opened with LIBMTP_OPEN_BOUNDED_CACHE.
+ */
+typedef struct mtp_listing_struct mtp_listing_t;
+struct mtp_listing_struct {
+  uint32_t storage;
+  uint32_t parent;
+  uint32_t *handles;
+  uint32_t nrofhandles;
+  mtp_listing_t *prev;
+  mtp_listing_t *next;
+};
+
+/**
+ * The folder listings of a device, most recently used first.
+ */
+typedef struct {
+  mtp_listing_t *head;
+  mtp_listing_t *tail;
+  uint32_t nroflistings;
+  uint32_t max;
+} mtp_listing_cache_t;
+
+/*
+ * Read-ahead cache of LIBMTP_GetPartialObject(): block size, default
+ * memory bound, the largest read-ahead window and the number of
+ * objects whose access pattern is followed at the same time.
+ */
+#define PARTIAL_BLOCK_SIZE 0x10000
+#define PARTIAL_CACHE_DEFAULT 0x200000
+#define PARTIAL_READAHEAD_MAX 0x100000
+#define PARTIAL_STREAMS 4
+
+/**
+ * One block of object data read through LIBMTP_GetPartialObject().
+ * All blocks but the last one of an object are PARTIAL_BLOCK_SIZE long.
+ */
+typedef struct mtp_block_struct mtp_block_t;
+struct mtp_block_struct {
+  uint32_t oid;
+  uint64_t index;
+  uint32_t len;
+  unsigned char *data;
+  mtp_block_t *prev;
+  mtp_block_t *next;
+};
+
+/**
+ * How one object is being read: its size, where the next sequential
+ * read would start and how far to read ahead.
+ */
+typedef struct {
+  uint32_t oid;
+  uint64_t filesize;
+  uint64_t next;
+  uint32_t window;
+  unsigned long used;
+} mtp_stream_t;
+
+/**
+ * The blocks of a device, most recently used first.
+ */
+typedef struct {
+  mtp_block_t *head;
+  mtp_block_t *tail;
+  unsigned long bytes;
+  unsigned long max;
+  mtp_stream_t streams[PARTIAL_STREAMS];
+  unsigned long clock;
+} mtp_block_cache_t;
+
+static int bounded_cache_init(LIBMTP_mtpdevice_t *device);
+static void bounded_cache_free(LIBMTP_mtpdevice_t *device);
+static void update_listings_from_event(LIBMTP_mtpdevice_t *device,
+				       PTPContainer *ptp_event);
+static int listing_get(LIBMTP_mtpdevice_t *device, uint32_t const storage,
+		       uint32_t const parent, uint32_t **handles);
+static void listing_store(LIBMTP_mtpdevice_t *device, uint32_t const storage,
+			  uint32_t const parent, uint32_t const *handles,
+			  uint32_t const nrofhandles);
+static void listing_drop(LIBMTP_mtpdevice_t *device, uint32_t const parent);
+static void listing_drop_all(mtp_listing_cache_t *cache);
+static void listing_unlink(mtp_listing_cache_t *cache, mtp_listing_t *listing);
+static void listing_drop_object(LIBMTP_mtpdevice_t *device,
+				uint32_t const object_id);
+static void block_drop_object(LIBMTP_mtpdevice_t *device,
+			      uint32_t const object_id);
+static void block_cache_free(LIBMTP_mtpdevice_t *device);
+static void transfer_checksum_begin(LIBMTP_mtpdevice_t *device);
+static void transfer_checksum_end(LIBMTP_mtpdevice_t *device, int const ok);
 
 /**
  * These are to wrap the get/put handlers to convert from the MTP types to PTP types
@@ -281,6 +453,84 @@ static int has_flac_extension(char *name) {
   return 0;
 }
 
+/**
+ * Filename extensions of the filetypes that can be told from the name
+ * of a local file alone.
+ */
+static const struct {
+  char const *ext;
+  LIBMTP_filetype_t filetype;
+} extension_filetypes[] = {
+  { "wav", LIBMTP_FILETYPE_WAV },
+  { "mp3", LIBMTP_FILETYPE_MP3 },
+  { "mp2", LIBMTP_FILETYPE_MP2 },
+  { "wma", LIBMTP_FILETYPE_WMA },
+  { "ogg", LIBMTP_FILETYPE_OGG },
+  { "flac", LIBMTP_FILETYPE_FLAC },
+  { "aac", LIBMTP_FILETYPE_AAC },
+  { "m4a", LIBMTP_FILETYPE_M4A },
+  { "mp4", LIBMTP_FILETYPE_MP4 },
+  { "wmv", LIBMTP_FILETYPE_WMV },
+  { "avi", LIBMTP_FILETYPE_AVI },
+  { "mpeg", LIBMTP_FILETYPE_MPEG },
+  { "mpg", LIBMTP_FILETYPE_MPEG },
+  { "asf", LIBMTP_FILETYPE_ASF },
+  { "qt", LIBMTP_FILETYPE_QT },
+  { "mov", LIBMTP_FILETYPE_QT },
+  { "jpg", LIBMTP_FILETYPE_JPEG },
+  { "jpeg", LIBMTP_FILETYPE_JPEG },
+  { "jfif", LIBMTP_FILETYPE_JFIF },
+  { "jp2", LIBMTP_FILETYPE_JP2 },
+  { "jpx", LIBMTP_FILETYPE_JPX },
+  { "tif", LIBMTP_FILETYPE_TIFF },
+  { "tiff", LIBMTP_FILETYPE_TIFF },
+  { "bmp", LIBMTP_FILETYPE_BMP },
+  { "gif", LIBMTP_FILETYPE_GIF },
+  { "pic", LIBMTP_FILETYPE_PICT },
+  { "pict", LIBMTP_FILETYPE_PICT },
+  { "png", LIBMTP_FILETYPE_PNG },
+  { "wmf", LIBMTP_FILETYPE_WINDOWSIMAGEFORMAT },
+  { "ics", LIBMTP_FILETYPE_VCALENDAR2 },
+  { "vcf", LIBMTP_FILETYPE_VCARD3 },
+  { "txt", LIBMTP_FILETYPE_TEXT },
+  { "htm", LIBMTP_FILETYPE_HTML },
+  { "html", LIBMTP_FILETYPE_HTML },
+  { "xml", LIBMTP_FILETYPE_XML },
+  { "doc", LIBMTP_FILETYPE_DOC },
+  { "xls", LIBMTP_FILETYPE_XLS },
+  { "ppt", LIBMTP_FILETYPE_PPT },
+  { "mht", LIBMTP_FILETYPE_MHT },
+  { "exe", LIBMTP_FILETYPE_WINEXEC },
+  { "com", LIBMTP_FILETYPE_WINEXEC },
+  { "bat", LIBMTP_FILETYPE_WINEXEC },
+  { "dll", LIBMTP_FILETYPE_WINEXEC },
+  { "sys", LIBMTP_FILETYPE_WINEXEC },
+  { "bin", LIBMTP_FILETYPE_FIRMWARE },
+};
+
+/**
+ * Works out the filetype of a local file from its extension.
+ *
+ * @param name the name of the file.
+ * @return the filetype, <code>LIBMTP_FILETYPE_UNKNOWN</code> if the
+ *         extension is not known.
+ */
+static LIBMTP_filetype_t filetype_from_extension(char const * const name)
+{
+  char const *ptype;
+  unsigned int i;
+
+  ptype = strrchr(name, '.');
+  if (ptype == NULL)
+    return LIBMTP_FILETYPE_UNKNOWN;
+  ptype++;
+  for (i = 0; i < sizeof(extension_filetypes) / sizeof(extension_filetypes[0]); i++) {
+    if (!strcasecmp(ptype, extension_filetypes[i].ext))
+      return extension_filetypes[i].filetype;
+  }
+  return LIBMTP_FILETYPE_UNKNOWN;
+}
+
 
 
 /**
@@ -771,14 +1021,10 @@ void LIBMTP_Set_Debug(int level)
 
 
 /**
- * Initialize the library. You are only supposed to call this
- * one, before using the library for the first time in a program.
- * Never re-initialize libmtp!
- *
- * The only thing this does at the moment is to initialise the
- * filetype mapping table, as well as load MTPZ data if necessary.
+ * The one-time part of LIBMTP_Init(). Everything set up here is
+ * read-only afterwards, so it may be shared freely between threads.
  */
-void LIBMTP_Init(void)
+static void init_library(void)
 {
   const char *env_debug = getenv("LIBMTP_DEBUG");
   if (env_debug) {
@@ -804,6 +1050,39 @@ void LIBMTP_Init(void)
   return;
 }
 
+/**
+ * Initialize the library. You are only supposed to call this
+ * one, before using the library for the first time in a program.
+ *
+ * The only thing this does at the moment is to initialise the
+ * filetype mapping table, as well as load MTPZ data if necessary.
+ * Only the first call does anything, and with pthreads it is safe
+ * to call this from several threads at once.
+ *
+ * After this the global tables of libmtp are never modified, and
+ * different devices may be used from different threads at the same
+ * time. Operations on one device are serialised at the PTP transaction
+ * level, but the metadata cache of a device is not locked, so every
+ * device should only be driven by one thread at a time, e.g. by giving
+ * each worker thread of a pool its own devices. Call
+ * <code>LIBMTP_Set_Debug()</code> before starting any threads.
+ */
+void LIBMTP_Init(void)
+{
+#ifdef HAVE_PTHREAD_H
+  static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+  pthread_once(&init_once, init_library);
+#else
+  static int initialized = 0;
+
+  if (!initialized) {
+    initialized = 1;
+    init_library();
+  }
+#endif
+}
+
 
 /**
  * This helper function returns a textual description for a libmtp
@@ -950,10 +1229,17 @@ static char *get_iso8601_stamp(void)
 {
   time_t curtime;
   struct tm *loctime;
+#ifdef HAVE_LOCALTIME_R
+  struct tm loctime_buf;
+#endif
   char tmp[64];
 
   curtime = time(NULL);
+#ifdef HAVE_LOCALTIME_R
+  loctime = localtime_r(&curtime, &loctime_buf);
+#else
   loctime = localtime(&curtime);
+#endif
   strftime (tmp, sizeof(tmp), "%Y%m%dT%H%M%S.0%z", loctime);
   return strdup(tmp);
 }
@@ -974,7 +1260,7 @@ int LIBMTP_Get_Allowed_Property_Values(LIBMTP_mtpdevice_t *device, LIBMTP_proper
   PTPObjectPropDesc opd;
   uint16_t ret = 0;
 
-  ret = ptp_mtp_getobjectpropdesc(device->params, map_libmtp_property_to_ptp_property(property), map_libmtp_type_to_ptp_type(filetype), &opd);
+  ret = ptp_mtp_getobjectpropdesc_cached(device->params, map_libmtp_property_to_ptp_property(property), map_libmtp_type_to_ptp_type(filetype), &opd);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Allowed_Property_Values(): could not get property description.");
     return -1;
@@ -1051,7 +1337,6 @@ int LIBMTP_Get_Allowed_Property_Values(LIBMTP_mtpdevice_t *device, LIBMTP_proper
           break;
       }
     }
-    ptp_free_objectpropdesc(&opd);
     return 0;
   } else if (opd.FormFlag == PTP_OPFF_Range) {
     allowed_vals->is_range = 1;
@@ -1178,7 +1463,7 @@ int LIBMTP_Is_Property_Supported(LIBMTP_mtpdevice_t *device, LIBMTP_property_t c
   if (!ptp_operation_issupported(device->params, PTP_OC_MTP_GetObjectPropsSupported))
     return 0;
 
-  ret = ptp_mtp_getobjectpropssupported(device->params, map_libmtp_type_to_ptp_type(filetype), &propcnt, &props);
+  ret = ptp_mtp_getobjectpropssupported_cached(device->params, map_libmtp_type_to_ptp_type(filetype), &propcnt, &props);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "LIBMTP_Is_Property_Supported(): could not get properties supported.");
     return -1;
@@ -1921,17 +2206,150 @@ static void parse_extension_descriptor(LIBMTP_mtpdevice_t *mtpdevice,
 }
 
 /**
- * This function opens a device from a raw device. It is the
- * preferred way to access devices in the new interface where
- * several devices can come and go as the library is working
- * on a certain device.
+ * Determine if the object size supported is 32 or 64 bit wide.
+ * @param mtp_device the device to probe.
+ */
+static void probe_object_bitsize(LIBMTP_mtpdevice_t *mtp_device)
+{
+  PTPParams *current_params = (PTPParams *) mtp_device->params;
+  uint64_t start = usecs_now();
+  uint8_t bs = 0;
+  unsigned int i;
+
+  if (ptp_operation_issupported(current_params,PTP_OC_MTP_GetObjectPropsSupported)) {
+    for (i=0;i<current_params->deviceinfo.ImageFormats_len;i++) {
+      PTPObjectPropDesc opd;
+
+      if (ptp_mtp_getobjectpropdesc_cached(current_params,
+                                    PTP_OPC_ObjectSize,
+                                    current_params->deviceinfo.ImageFormats[i],
+                                    &opd) != PTP_RC_OK) {
+        LIBMTP_ERROR("LIBMTP PANIC: "
+                     "could not inspect object property description 0x%04x!\n", current_params->deviceinfo.ImageFormats[i]);
+      } else {
+        if (opd.DataType == PTP_DTC_UINT32) {
+          if (bs == 0) {
+            bs = 32;
+          } else if (bs != 32) {
+            LIBMTP_ERROR("LIBMTP PANIC: "
+                         "different objects support different object sizes!\n");
+            bs = 0;
+            break;
+          }
+        } else if (opd.DataType == PTP_DTC_UINT64) {
+          if (bs == 0) {
+            bs = 64;
+          } else if (bs != 64) {
+            LIBMTP_ERROR("LIBMTP PANIC: "
+                         "different objects support different object sizes!\n");
+            bs = 0;
+            break;
+          }
+        } else {
+          // Ignore if other size.
+          LIBMTP_ERROR("LIBMTP PANIC: "
+                       "awkward object size data type: %04x\n", opd.DataType);
+          bs = 0;
+          break;
+        }
+      }
+    }
+  }
+  if (bs == 0) {
+    // Could not detect object bitsize, assume 32 bits
+    bs = 32;
+  }
+  mtp_device->object_bitsize = bs;
+
+  mtp_device->lazy_pending &= ~LAZY_OBJECT_BITSIZE;
+  mtp_device->timings.object_bitsize_usecs = usecs_now() - start;
+}
+
+/**
+ * The object size of a device in bits, probed on first use when the
+ * device was opened with LIBMTP_OPEN_LAZY.
+ * @param device a pointer to the device.
+ * @return 32 or 64.
+ */
+static uint8_t device_object_bitsize(LIBMTP_mtpdevice_t *device)
+{
+  if (device->lazy_pending & LAZY_OBJECT_BITSIZE)
+    probe_object_bitsize(device);
+  return device->object_bitsize;
+}
+
+/**
+ * Read the maximum battery level of a device.
+ * @param mtp_device the device to read it from.
+ */
+static void probe_battery_level(LIBMTP_mtpdevice_t *mtp_device)
+{
+  PTPParams *current_params = (PTPParams *) mtp_device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) mtp_device->usbinfo;
+  uint64_t start = usecs_now();
+
+  /* Default Max Battery Level, we will adjust this if possible */
+  mtp_device->maximum_battery_level = 100;
+
+  /* Check if device supports reading maximum battery level */
+  if(!FLAG_BROKEN_BATTERY_LEVEL(ptp_usb) &&
+     ptp_property_issupported( current_params, PTP_DPC_BatteryLevel)) {
+    PTPDevicePropDesc dpd;
+
+    /* Try to read maximum battery level */
+    if(ptp_getdevicepropdesc(current_params,
+			     PTP_DPC_BatteryLevel,
+			     &dpd) != PTP_RC_OK) {
+      add_error_to_errorstack(mtp_device,
+			      LIBMTP_ERROR_CONNECTING,
+			      "Unable to read Maximum Battery Level for this "
+			      "device even though the device supposedly "
+			      "supports this functionality");
+    }
+
+    /* TODO: is this appropriate? */
+    /* If max battery level is 0 then leave the default, otherwise assign */
+    if (dpd.FORM.Range.MaximumValue.u8 != 0) {
+      mtp_device->maximum_battery_level = dpd.FORM.Range.MaximumValue.u8;
+    }
+
+    ptp_free_devicepropdesc(&dpd);
+  }
+
+  mtp_device->lazy_pending &= ~LAZY_BATTERY_LEVEL;
+  mtp_device->timings.battery_level_usecs = usecs_now() - start;
+}
+
+/**
+ * Read the storage list of a device if it was put off by
+ * LIBMTP_OPEN_LAZY.
+ * @param device a pointer to the device.
+ */
+static void want_storage(LIBMTP_mtpdevice_t *device)
+{
+  if (!(device->lazy_pending & LAZY_STORAGE))
+    return;
+  if (LIBMTP_Get_Storage(device, LIBMTP_STORAGE_SORTBY_NOTSORTED) == -1) {
+    add_error_to_errorstack(device,
+			    LIBMTP_ERROR_GENERAL,
+			    "Get Storage information failed.");
+    device->storage = NULL;
+  }
+}
+
+/**
+ * Open a device, reading the device info and unless
+ * <code>LIBMTP_OPEN_LAZY</code> is among the flags the object size,
+ * battery level range and storage list.
  * @param rawdevice the raw device to open a "real" device for.
+ * @param flags the <code>LIBMTP_OPEN_*</code> flags.
  * @return an open device.
  */
-LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevice)
+static LIBMTP_mtpdevice_t *open_raw_device(LIBMTP_raw_device_t *rawdevice,
+					   uint32_t const flags)
 {
   LIBMTP_mtpdevice_t *mtp_device;
-  uint8_t bs = 0;
+  uint64_t start;
   PTPParams *current_params;
   PTP_USB *ptp_usb;
   LIBMTP_error_number_t err;
@@ -1955,6 +2373,7 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
   memset(mtp_device, 0, sizeof(LIBMTP_mtpdevice_t));
   // Non-cached by default
   mtp_device->cached = 0;
+  mtp_device->storage_ttl = STORAGE_CACHE_TTL;
 
   /* Create PTP params */
   current_params = (PTPParams *) malloc(sizeof(PTPParams));
@@ -1977,6 +2396,8 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
   current_params->error_func = LIBMTP_ptp_error;
   /* TODO: Will this always be little endian? */
   current_params->byteorder = PTP_DL_LE;/*标记为小端*/
+  /* We always talk UTF-8 to the application, no need for iconv */
+  current_params->utf8_strings = 1;
 #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
   current_params->cd_locale_to_ucs2 = iconv_open("UTF-16LE", "UTF-8");
   current_params->cd_ucs2_to_locale = iconv_open("UTF-8", "UTF-16LE");
@@ -1992,20 +2413,36 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
 #endif
   mtp_device->params = current_params;/*设置设备参数*/
 
+  /* Serialise transactions in case the device is used from several threads */
+  if (ptp_init_transaction_lock(current_params) != PTP_RC_OK) {
+    LIBMTP_ERROR("LIBMTP PANIC: could not set up the device lock.\n");
+    free(current_params);
+    free(mtp_device);
+    return NULL;
+  }
+#ifdef ENABLE_TRACE_RING
+  if (ptp_ring_open(current_params) != PTP_RC_OK)
+    LIBMTP_ERROR("LIBMTP WARNING: could not set up the trace ring, continuing anyway\n");
+#endif
+
   /* Create usbinfo, this also opens the session */
+  start = usecs_now();
   err = configure_usb_device(rawdevice,
 			     current_params,
 			     &mtp_device->usbinfo);
   if (err != LIBMTP_ERROR_NONE) {
+    ptp_free_params(current_params);
     free(current_params);
     free(mtp_device);
     return NULL;
   }
+  mtp_device->timings.session_usecs = usecs_now() - start;
   ptp_usb = (PTP_USB*) mtp_device->usbinfo;
   /* Set pointer back to params */
   ptp_usb->params = current_params;
 
   /* Cache the device information for later use */
+  start = usecs_now();
   if (ptp_getdeviceinfo(current_params,
 			&current_params->deviceinfo) != PTP_RC_OK) {
     LIBMTP_ERROR("LIBMTP PANIC: Unable to read device information on device "
@@ -2034,6 +2471,8 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
 		 "Trying to continue anyway.");
   }
 
+  mtp_device->timings.deviceinfo_usecs = usecs_now() - start;
+
   parse_extension_descriptor(mtp_device,
                              current_params->deviceinfo.VendorExtensionDesc);
 
@@ -2110,142 +2549,420 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
     }
   }
 
-  /* Determine if the object size supported is 32 or 64 bit wide */
-  if (ptp_operation_issupported(current_params,PTP_OC_MTP_GetObjectPropsSupported)) {
-    for (i=0;i<current_params->deviceinfo.ImageFormats_len;i++) {
-      PTPObjectPropDesc opd;
-
-      if (ptp_mtp_getobjectpropdesc(current_params,
-                                    PTP_OPC_ObjectSize,
-                                    current_params->deviceinfo.ImageFormats[i],
-                                    &opd) != PTP_RC_OK) {
-        LIBMTP_ERROR("LIBMTP PANIC: "
-                     "could not inspect object property description 0x%04x!\n", current_params->deviceinfo.ImageFormats[i]);
-      } else {
-        if (opd.DataType == PTP_DTC_UINT32) {
-          if (bs == 0) {
-            bs = 32;
-          } else if (bs != 32) {
-            LIBMTP_ERROR("LIBMTP PANIC: "
-                         "different objects support different object sizes!\n");
-            bs = 0;
-            break;
-          }
-        } else if (opd.DataType == PTP_DTC_UINT64) {
-          if (bs == 0) {
-            bs = 64;
-          } else if (bs != 64) {
-            LIBMTP_ERROR("LIBMTP PANIC: "
-                         "different objects support different object sizes!\n");
-            bs = 0;
-            break;
-          }
-        } else {
-          // Ignore if other size.
-          LIBMTP_ERROR("LIBMTP PANIC: "
-                       "awkward object size data type: %04x\n", opd.DataType);
-          bs = 0;
-          break;
-        }
-      }
-    }
-  }
-  if (bs == 0) {
-    // Could not detect object bitsize, assume 32 bits
-    bs = 32;
-  }
-  mtp_device->object_bitsize = bs;
-
   /* No Errors yet for this device */
   mtp_device->errorstack = NULL;
 
-  /* Default Max Battery Level, we will adjust this if possible */
-  mtp_device->maximum_battery_level = 100;
+  /* Set all default folders to 0xffffffffU (root directory) */
+  mtp_device->default_music_folder = 0xffffffffU;
+  mtp_device->default_playlist_folder = 0xffffffffU;
+  mtp_device->default_picture_folder = 0xffffffffU;
+  mtp_device->default_video_folder = 0xffffffffU;
+  mtp_device->default_organizer_folder = 0xffffffffU;
+  mtp_device->default_zencast_folder = 0xffffffffU;
+  mtp_device->default_album_folder = 0xffffffffU;
+  mtp_device->default_text_folder = 0xffffffffU;
 
-  /* Check if device supports reading maximum battery level */
-  if(!FLAG_BROKEN_BATTERY_LEVEL(ptp_usb) &&
-     ptp_property_issupported( current_params, PTP_DPC_BatteryLevel)) {
-    PTPDevicePropDesc dpd;
+  /* No storage read yet */
+  mtp_device->storage = NULL;
 
-    /* Try to read maximum battery level */
-    if(ptp_getdevicepropdesc(current_params,
-			     PTP_DPC_BatteryLevel,
-			     &dpd) != PTP_RC_OK) {
-      add_error_to_errorstack(mtp_device,
-			      LIBMTP_ERROR_CONNECTING,
-			      "Unable to read Maximum Battery Level for this "
-			      "device even though the device supposedly "
-			      "supports this functionality");
-    }
-
-    /* TODO: is this appropriate? */
-    /* If max battery level is 0 then leave the default, otherwise assign */
-    if (dpd.FORM.Range.MaximumValue.u8 != 0) {
-      mtp_device->maximum_battery_level = dpd.FORM.Range.MaximumValue.u8;
-    }
-
-    ptp_free_devicepropdesc(&dpd);
+  /*
+   * Unless asked to put it off, find out the object size, the battery
+   * level range and the storages right away.
+   */
+  mtp_device->lazy_pending = LAZY_OBJECT_BITSIZE | LAZY_BATTERY_LEVEL |
+    LAZY_STORAGE;
+  if (!(flags & LIBMTP_OPEN_LAZY)) {
+    probe_object_bitsize(mtp_device);
+    probe_battery_level(mtp_device);
+    want_storage(mtp_device);
   }
 
-  /* Set all default folders to 0xffffffffU (root directory) */
-  mtp_device->default_music_folder = 0xffffffffU;
-  mtp_device->default_playlist_folder = 0xffffffffU;
-  mtp_device->default_picture_folder = 0xffffffffU;
-  mtp_device->default_video_folder = 0xffffffffU;
-  mtp_device->default_organizer_folder = 0xffffffffU;
-  mtp_device->default_zencast_folder = 0xffffffffU;
-  mtp_device->default_album_folder = 0xffffffffU;
-  mtp_device->default_text_folder = 0xffffffffU;
-
-  /* Set initial storage information */
-  mtp_device->storage = NULL;
-  if (LIBMTP_Get_Storage(mtp_device, LIBMTP_STORAGE_SORTBY_NOTSORTED) == -1) {
-    add_error_to_errorstack(mtp_device,
-			    LIBMTP_ERROR_GENERAL,
-			    "Get Storage information failed.");
-    mtp_device->storage = NULL;
-  }
+  return mtp_device;
+}
 
+/**
+ * This function opens a device from a raw device. It is the
+ * preferred way to access devices in the new interface where
+ * several devices can come and go as the library is working
+ * on a certain device.
+ * @param rawdevice the raw device to open a "real" device for.
+ * @return an open device.
+ */
+LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevice)
+{
+  return open_raw_device(rawdevice, 0);
+}
 
-  return mtp_device;
+/**
+ * Get the handles and try to locate the default folders. This has the
+ * desired side effect of caching all handles from the device which
+ * speeds up later operations.
+ * @param device a pointer to the cached device to load.
+ * @return 0 on success, -1 if a load callback cancelled the listing.
+ */
+static int load_cache(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint64_t start;
+  int ret = 0;
+
+  // The listing needs the storages
+  want_storage(device);
+  start = usecs_now();
+  if ((device->open_flags & LIBMTP_OPEN_PERSISTENT_CACHE) &&
+      params->nrofobjects == 0 &&
+      metadata_cache_load(device) == 0) {
+    uint32_t i;
+
+    for (i = 0; i < params->nrofobjects; i++) {
+      if (emit_loaded_object(device, params->objects[i]) != 0) {
+	ret = -1;
+	break;
+      }
+    }
+    locate_default_folders(device);
+  } else {
+    ret = flush_handles(device);
+  }
+  device->timings.listing_usecs = usecs_now() - start;
+  return ret;
 }
 
+/**
+ * This function opens a device from a raw device and reads in the
+ * metadata of all objects, like LIBMTP_Open_Raw_Device_Uncached()
+ * followed by a full listing.
+ * @param rawdevice the raw device to open a "real" device for.
+ * @return an open device.
+ * @see LIBMTP_Open_Raw_Device_Flags()
+ */
 LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device(LIBMTP_raw_device_t *rawdevice)
 {
-  LIBMTP_mtpdevice_t *mtp_device = LIBMTP_Open_Raw_Device_Uncached(rawdevice);
+  return LIBMTP_Open_Raw_Device_Flags(rawdevice, 0);
+}
+
+/**
+ * This function opens a cached device from a raw device, with
+ * options for how the object cache is set up.
+ *
+ * With <code>LIBMTP_OPEN_PERSISTENT_CACHE</code> the object cache is
+ * kept in a file named after the device serial number, in
+ * <code>$LIBMTP_CACHE_DIR</code> or else
+ * <code>$XDG_CACHE_HOME/libmtp</code> or
+ * <code>$HOME/.cache/libmtp</code>. The file is written by
+ * LIBMTP_Release_Device() and used instead of reading all metadata
+ * on the next open, provided the storages of the device report the
+ * same IDs, capacity and free space as when it was written. Changes
+ * made to the device elsewhere that keep all of these (such as a
+ * rename) are not detected, call
+ * LIBMTP_Invalidate_Persistent_Cache() if that is a concern.
+ *
+ * With <code>LIBMTP_OPEN_TRACK_EVENTS</code> events read with
+ * LIBMTP_Read_Event() or LIBMTP_Read_Event_Async() also update the
+ * object cache and the storage list: added, removed and changed
+ * objects and storages are read in or dropped one by one instead of
+ * requiring a full reload. The cache is then modified from the
+ * context the event is read in, so the application must not use the
+ * device from another thread at the same time.
+ *
+ * With <code>LIBMTP_OPEN_COLLECT_STATS</code> per operation statistics
+ * are collected from the start, see LIBMTP_Get_Stats().
+ *
+ * With <code>LIBMTP_OPEN_BOUNDED_CACHE</code> the device is opened like
+ * with LIBMTP_Open_Raw_Device_Uncached(), so nothing is listed up
+ * front, but the metadata of the objects and the children of the
+ * folders used are kept in caches of bounded size, and the least
+ * recently used entries are dropped to stay within them. Folders
+ * listed before with LIBMTP_Get_Files_And_Folders() or
+ * LIBMTP_Get_Children() are then served without I/O as long as all
+ * their children are still cached. Events read with
+ * LIBMTP_Read_Event() or LIBMTP_Read_Event_Async() drop the entries
+ * they make stale. <code>LIBMTP_OPEN_PERSISTENT_CACHE</code> and
+ * <code>LIBMTP_OPEN_TRACK_EVENTS</code> are ignored in this mode, see
+ * LIBMTP_Set_Cache_Limits() for the bounds.
+ *
+ * With <code>LIBMTP_OPEN_LAZY</code> only the session is opened and
+ * the device info read before this returns. The object size probe,
+ * which takes a round trip for every object format the device
+ * supports, the battery level range and the storage list are read
+ * when first needed. Applications using
+ * <code>device-&gt;storage</code> directly must call
+ * LIBMTP_Get_Storage() first, and
+ * <code>device-&gt;object_bitsize</code> stays 0 until the first
+ * operation that needs it. This is most useful together with
+ * <code>LIBMTP_OPEN_BOUNDED_CACHE</code>, as otherwise the storages
+ * are needed for the initial listing right away. See
+ * LIBMTP_Get_Open_Timings() for how long each part took.
+ *
+ * With <code>LIBMTP_OPEN_DEFER_LOAD</code> the object cache is set up
+ * but left empty, so that callbacks can be set before the metadata is
+ * read with LIBMTP_Load_Cache(), e.g. from a thread of its own.
+ *
+ * @param rawdevice the raw device to open a "real" device for.
+ * @param flags a bitwise OR of <code>LIBMTP_OPEN_*</code> flags,
+ *        0 makes this behave like LIBMTP_Open_Raw_Device().
+ * @return an open device.
+ */
+LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Flags(LIBMTP_raw_device_t *rawdevice,
+						 uint32_t const flags)
+{
+  LIBMTP_mtpdevice_t *mtp_device = open_raw_device(rawdevice, flags);
 
   if (mtp_device == NULL)
     return NULL;
+  mtp_device->open_flags = flags;
 
-  /* Check for MTPZ devices. */
+  /*
+   * Check for MTPZ devices. The handshake takes a while, so it is put
+   * off until the first operation that may need it.
+   */
   if (use_mtpz) {
     LIBMTP_device_extension_t *tmpext = mtp_device->extensions;
 
     while (tmpext != NULL) {
       if (!strcmp(tmpext->name, "microsoft.com/MTPZ")) {
-	LIBMTP_INFO("MTPZ device detected. Authenticating...\n");
-        if (PTP_RC_OK == ptp_mtpz_handshake(mtp_device->params)) {
-	  LIBMTP_INFO ("(MTPZ) Successfully authenticated with device.\n");
-        } else {
-          LIBMTP_INFO ("(MTPZ) Failure - could not authenticate with device.\n");
-        }
+	LIBMTP_INFO("MTPZ device detected.\n");
+	((PTPParams *) mtp_device->params)->authenticate = mtpz_authenticate;
 	break;
       }
       tmpext = tmpext->next;
     }
   }
 
+  // Collect statistics from here on, the initial listing included
+  if (flags & LIBMTP_OPEN_COLLECT_STATS)
+    LIBMTP_Reset_Stats(mtp_device);
+
+  // Nothing is read up front, objects and folders are kept as used
+  if (flags & LIBMTP_OPEN_BOUNDED_CACHE) {
+    if (bounded_cache_init(mtp_device) != 0) {
+      LIBMTP_ERROR("LIBMTP PANIC: could not allocate the folder listing cache\n");
+      LIBMTP_Release_Device(mtp_device);
+      return NULL;
+    }
+    return mtp_device;
+  }
+
   // Set up this device as cached
   mtp_device->cached = 1;
-  /*
-   * Then get the handles and try to locate the default folders.
-   * This has the desired side effect of caching all handles from
-   * the device which speeds up later operations.
-   */
-  flush_handles(mtp_device);
+  if (!(flags & LIBMTP_OPEN_DEFER_LOAD))
+    (void) load_cache(mtp_device);
   return mtp_device;
 }
 
+/**
+ * This reads the metadata of all objects of a device opened with
+ * <code>LIBMTP_OPEN_DEFER_LOAD</code> into the object cache, or reads
+ * it again on any other cached device. The load view callback set
+ * with LIBMTP_Set_Load_View_Callback() is handed every object as soon
+ * as it has been read, so the first results can be shown long before
+ * a big device has been read completely, and the load callback set
+ * with LIBMTP_Set_Load_Callback() is told the progress. Either can
+ * stop the load, which leaves the cache with what was read until then.
+ *
+ * The callbacks run in the thread calling this function, and must not
+ * use the device themselves.
+ * @param device a pointer to the device to load.
+ * @return 0 on success, any other value means failure or that the
+ *         load was cancelled.
+ */
+int LIBMTP_Load_Cache(LIBMTP_mtpdevice_t *device)
+{
+  if (!device->cached) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Load_Cache(): "
+			    "device was not opened with a full object cache.");
+    return -1;
+  }
+  return load_cache(device);
+}
+
+/**
+ * Run the MTPZ handshake with a device, called by the PTP layer before
+ * the first operation that may need it.
+ * @param params the PTP parameters of the device.
+ * @return the PTP result of the handshake.
+ */
+static uint16_t mtpz_authenticate(PTPParams *params)
+{
+  uint16_t ret;
+
+  LIBMTP_INFO("(MTPZ) Authenticating...\n");
+  ret = ptp_mtpz_handshake(params);
+  if (ret == PTP_RC_OK) {
+    LIBMTP_INFO("(MTPZ) Successfully authenticated with device.\n");
+  } else {
+    LIBMTP_INFO("(MTPZ) Failure - could not authenticate with device.\n");
+  }
+  return ret;
+}
+
+/**
+ * This sets a callback that is told how far a full load of the object
+ * cache has come, e.g. when a cached device reloads all metadata. On
+ * devices that cannot list all objects in one go, <code>sent</code>
+ * is the number of folders listed so far and <code>total</code> the
+ * number of folders found so far. If the callback returns anything
+ * else than 0 the load stops, and the cache holds whatever was read
+ * until then.
+ * @param device a pointer to the device to set the callback for.
+ * @param callback the callback, or NULL to not be told.
+ * @param data a user-defined pointer that is passed along to the
+ *        callback.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Load_Callback(LIBMTP_mtpdevice_t *device,
+			     LIBMTP_progressfunc_t const callback,
+			     void const * const data)
+{
+  device->load_callback = callback;
+  device->load_callback_data = data;
+  return 0;
+}
+
+/**
+ * This sets a callback that is handed every object as soon as it is
+ * read into the object cache by a full load, in the order the device
+ * sends them, folders included. The view points into the cache and is
+ * only valid until the callback returns. If the callback returns
+ * anything else than 0 the load stops, and the cache holds whatever
+ * was read until then.
+ * @param device a pointer to the device to set the callback for.
+ * @param callback the callback, or NULL to not be told.
+ * @param data a user-defined pointer that is passed along to the
+ *        callback.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Load_Cache()
+ */
+int LIBMTP_Set_Load_View_Callback(LIBMTP_mtpdevice_t *device,
+				  LIBMTP_loadviewfunc_t const callback,
+				  void const * const data)
+{
+  device->load_view_callback = callback;
+  device->load_view_data = data;
+  return 0;
+}
+
+/**
+ * This retrieves how long each phase of opening a device took, to
+ * tell which devices are slow to open and why. Phases put off by
+ * <code>LIBMTP_OPEN_LAZY</code> are filled in when they run.
+ * @param device a pointer to the device to get the timings for.
+ * @param timings the timings are copied here.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Get_Open_Timings(LIBMTP_mtpdevice_t *device,
+			    LIBMTP_open_timings_t * const timings)
+{
+  if (timings == NULL)
+    return -1;
+  *timings = device->timings;
+  return 0;
+}
+
+/**
+ * This writes the binary trace ring of a device to a file. The ring
+ * holds the last few thousand requests, responses, events and USB
+ * chunks with their timestamps, and is only there when libmtp was
+ * configured with <code>--enable-trace-ring</code>. Setting the
+ * LIBMTP_TRACE_RING environment variable to a file name dumps the ring
+ * there when the device is released, for programs that do not call
+ * this themselves.
+ * @param device a pointer to the device to dump the ring of.
+ * @param path the file to write.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Decode_Trace_Ring()
+ */
+int LIBMTP_Dump_Trace_Ring(LIBMTP_mtpdevice_t *device,
+			   char const * const path)
+{
+#ifdef ENABLE_TRACE_RING
+  PTPParams *params = (PTPParams *) device->params;
+
+  if (ptp_ring_dump(params, path) != PTP_RC_OK) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Dump_Trace_Ring(): "
+			    "could not write the trace ring.");
+    return -1;
+  }
+  return 0;
+#else
+  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Dump_Trace_Ring(): "
+			  "libmtp was built without the trace ring.");
+  return -1;
+#endif
+}
+
+/**
+ * How long the shared device is polled for events at a time, in ms.
+ * Clients wait meanwhile.
+ */
+#define SERVE_EVENT_POLL_MS 100
+
+/**
+ * Polls for an event of a shared device, briefly so the transactions
+ * of the programs sharing it are not held up.
+ */
+static uint16_t serve_event_check(PTPParams *params, PTPContainer *event)
+{
+  PTP_USB *ptp_usb = (PTP_USB *) params->data;
+  uint16_t ret;
+  int timeout;
+
+  get_usb_device_timeout(ptp_usb, &timeout);
+  set_usb_device_timeout(ptp_usb, SERVE_EVENT_POLL_MS);
+  ret = ptp_usb_event_check(params, event);
+  set_usb_device_timeout(ptp_usb, timeout);
+  return ret;
+}
+
+/**
+ * This lets other programs use a device at the same time as this one,
+ * sharing its session instead of each opening the device on its own.
+ * They reach it through the PTP/IP transport by listing
+ * <code>unix:</code> and the path in LIBMTP_PTPIP_DEVICES, e.g.
+ * <code>LIBMTP_PTPIP_DEVICES=unix:/run/libmtp.sock</code>, and see
+ * it as a network device. Their transactions take turns on the
+ * device, listing and metadata go before object transfers that are
+ * waiting, and the answers to listing operations are kept so the
+ * next program to open the device gets them without asking it. Events
+ * of the device go to every program.
+ *
+ * The device is best opened with LIBMTP_Open_Raw_Device_Uncached(),
+ * nothing here uses its object cache. This serves until a signal
+ * interrupts it, so install a handler without SA_RESTART to stop it.
+ * @param device a pointer to the device to share.
+ * @param path the unix socket to listen on, a socket left there is
+ *        replaced.
+ * @return 0 when interrupted by a signal, any other value means
+ *         failure.
+ */
+int LIBMTP_Serve_Device(LIBMTP_mtpdevice_t *device, char const * const path)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  // Events are polled with a timeout, so a signal can stop us
+  if (ptp_ptpip_serve(params, path, serve_event_check) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Serve_Device(): "
+			    "could not share the device.");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * This prints a dump written by LIBMTP_Dump_Trace_Ring() as text, one
+ * line per record, naming operations, responses and events like the
+ * debug output does. This works whether or not the library records a
+ * trace ring itself.
+ * @param path the dump to read.
+ * @param out where to print.
+ * @return 0 on success, any other value means the file could not be
+ *         read or is not a trace ring dump.
+ */
+int LIBMTP_Decode_Trace_Ring(char const * const path, FILE *out)
+{
+  return ptp_ring_decode(path, out);
+}
+
 /**
  * To read events sent by the device, repeatedly call this function from a secondary
  * thread until the return value is < 0.
@@ -2256,6 +2973,8 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device(LIBMTP_raw_device_t *rawdevice)
  * @param out1 contains the param1 value from the raw event.
  * @return 0 on success, any other value means the polling loop shall be
  * terminated immediately for this session.
+ * @see LIBMTP_OPEN_TRACK_EVENTS for keeping the object cache up to date
+ *      from the events read.
  */
 int LIBMTP_Read_Event(LIBMTP_mtpdevice_t *device, LIBMTP_event_t *event, uint32_t *out1)
 {
@@ -2275,11 +2994,12 @@ int LIBMTP_Read_Event(LIBMTP_mtpdevice_t *device, LIBMTP_event_t *event, uint32_
     /* Device is closing down or other fatal stuff, exit thread */
     return -1;
   }
-  LIBMTP_Handle_Event(&ptp_event, event, out1);
+  LIBMTP_Handle_Event(device, &ptp_event, event, out1);
   return 0;
 }
 
-void LIBMTP_Handle_Event(PTPContainer *ptp_event,
+void LIBMTP_Handle_Event(LIBMTP_mtpdevice_t *device,
+                         PTPContainer *ptp_event,
                          LIBMTP_event_t *event, uint32_t *out1) {
   uint16_t code;
   uint32_t session_id;
@@ -2287,6 +3007,42 @@ void LIBMTP_Handle_Event(PTPContainer *ptp_event,
 
   *event = LIBMTP_EVENT_NONE;
 
+  if (device->cached && (device->open_flags & LIBMTP_OPEN_TRACK_EVENTS)) {
+    update_cache_from_event(device, ptp_event);
+  } else if (device->listings != NULL) {
+    update_listings_from_event(device, ptp_event);
+  }
+  // Cached playlist and album references are read again when asked for,
+  // the free space of the storage list before the next file is sent
+  switch (ptp_event->Code) {
+  case PTP_EC_StorageInfoChanged:
+  case PTP_EC_StoreFull:
+  case PTP_EC_StoreAdded:
+    device->storage_refreshed = 0;
+    break;
+  case PTP_EC_DevicePropChanged:
+    ptp_invalidate_deviceprop((PTPParams *) device->params,
+			      ptp_event->Param1);
+    break;
+  case PTP_EC_ObjectInfoChanged:
+    block_drop_object(device, ptp_event->Param1);
+    // Fall through
+  case PTP_EC_MTP_ObjectReferencesChanged:
+    ptp_object_forget_references((PTPParams *) device->params,
+				 ptp_event->Param1);
+    break;
+  case PTP_EC_ObjectRemoved:
+    block_drop_object(device, ptp_event->Param1);
+    ((PTPParams *) device->params)->objectreferences_gen++;
+    break;
+  case PTP_EC_StoreRemoved:
+    device->storage_refreshed = 0;
+    ((PTPParams *) device->params)->objectreferences_gen++;
+    break;
+  default:
+    break;
+  }
+
   /* Process the event */
   code = ptp_event->Code;
   session_id = ptp_event->SessionID;
@@ -2311,13 +3067,11 @@ void LIBMTP_Handle_Event(PTPContainer *ptp_event,
       break;
     case PTP_EC_StoreAdded:
       LIBMTP_INFO("Received event PTP_EC_StoreAdded in session %u\n", session_id);
-      /* TODO: rescan storages */
       *event = LIBMTP_EVENT_STORE_ADDED;
       *out1 = param1;
       break;
     case PTP_EC_StoreRemoved:
       LIBMTP_INFO("Received event PTP_EC_StoreRemoved in session %u\n", session_id);
-      /* TODO: rescan storages */
       *event = LIBMTP_EVENT_STORE_REMOVED;
       *out1 = param1;
       break;
@@ -2329,7 +3083,6 @@ void LIBMTP_Handle_Event(PTPContainer *ptp_event,
       break;
     case PTP_EC_ObjectInfoChanged:
       LIBMTP_INFO("Received event PTP_EC_ObjectInfoChanged in session %u\n", session_id);
-      /* TODO: rescan object cache or just for this one object */
       break;
     case PTP_EC_DeviceInfoChanged:
       LIBMTP_INFO("Received event PTP_EC_DeviceInfoChanged in session %u\n", session_id);
@@ -2346,7 +3099,6 @@ void LIBMTP_Handle_Event(PTPContainer *ptp_event,
       break;
     case PTP_EC_StorageInfoChanged :
       LIBMTP_INFO( "Received event PTP_EC_StorageInfoChanged in session %u\n", session_id);
-     /* TODO: update storage info */
       break;
     case PTP_EC_CaptureComplete :
       LIBMTP_INFO( "Received event PTP_EC_CaptureComplete in session %u\n", session_id);
@@ -2370,7 +3122,7 @@ static void LIBMTP_Read_Event_Cb(PTPParams *params, uint16_t ret_code,
   switch (ret_code) {
   case PTP_RC_OK:
     handler_ret = LIBMTP_HANDLER_RETURN_OK;
-    LIBMTP_Handle_Event(ptp_event, &event, &param1);
+    LIBMTP_Handle_Event(data->device, ptp_event, &event, &param1);
     break;
   case PTP_ERROR_CANCEL:
     handler_ret = LIBMTP_HANDLER_RETURN_CANCEL;
@@ -2387,7 +3139,11 @@ static void LIBMTP_Read_Event_Cb(PTPParams *params, uint16_t ret_code,
 /**
  * This function reads events sent by the device, in a non-blocking manner.
  * The callback function will be called when an event is received, but for the function
- * to make progress, polling must take place, using LIBMTP_Handle_Events_Timeout_Completed.
+ * to make progress, polling must take place, using LIBMTP_Handle_Events_Timeout_Completed,
+ * or LIBMTP_Handle_Ready_Events() from a loop watching the file descriptors of
+ * LIBMTP_Get_Pollfds(), which serves any number of devices from one thread.
+ * The callback is called once libusb is done handling events, so it
+ * may use the device, and the object cache is already up to date.
  *
  * After an event is received, this function should be called again to listen for the next
  * event.
@@ -2407,6 +3163,7 @@ int LIBMTP_Read_Event_Async(LIBMTP_mtpdevice_t *device, LIBMTP_event_cb_fn cb, v
   event_cb_data_t *data =  malloc(sizeof(event_cb_data_t));
   uint16_t ret;
 
+  data->device = device;
   data->cb = cb;
   data->user_data = user_data;
 
@@ -2527,7 +3284,22 @@ void LIBMTP_Release_Device(LIBMTP_mtpdevice_t *device)
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
+  if (device->cached && (device->open_flags & LIBMTP_OPEN_PERSISTENT_CACHE)) {
+    // Record the storages as they are now, after our own changes
+    if (LIBMTP_Get_Storage(device, LIBMTP_STORAGE_SORTBY_NOTSORTED) == 0) {
+      metadata_cache_save(device);
+    } else {
+      metadata_cache_remove(device);
+    }
+  }
   close_device(ptp_usb, params);
+#ifdef ENABLE_TRACE_RING
+  ptp_ring_close(params);
+#endif
+  bounded_cache_free(device);
+  block_cache_free(device);
+  free(device->checksum);
+  device->checksum = NULL;
   // Clear error stack
   LIBMTP_Clear_Errorstack(device);
 #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
@@ -2687,23 +3459,209 @@ void LIBMTP_Dump_Errorstack(LIBMTP_mtpdevice_t *device)
   }
 }
 
+/**
+ * Private data of the streaming property list decoder used by
+ * get_all_metadata_fast() and get_folder_metadata_fast(). The extra
+ * properties of the object being filled are collected in a scratch
+ * array and handed to the object with a single allocation once the
+ * next object starts. For the full listing strings and the property
+ * lists go to the object cache arena, so equal strings are stored once
+ * and the whole lot is freed along with the cache. Single folders are
+ * re-read piecemeal and would only pile up in the arena, so they stay
+ * on the heap.
+ */
+typedef struct {
+  LIBMTP_mtpdevice_t *device;
+  PTPObject *ob;
+  MTPProperties *props;
+  unsigned int nrofprops;
+  unsigned int allocprops;
+  int arena; /**< allocate from the object cache arena */
+  int refresh; /**< replace objects cached outside of parent */
+  uint32_t parent; /**< the folder being listed when refreshing */
+  int emit; /**< hand each object to the load view callback */
+  int cancelled; /**< the load view callback asked to stop */
+} MTPMetadataStreamPrivate;
+
+/**
+ * Completes the object currently being filled from the property list.
+ */
+static void finish_streamed_object(PTPParams *params,
+				   MTPMetadataStreamPrivate *priv)
+{
+  PTPObject *ob = priv->ob;
+
+  if (ob == NULL)
+    return;
+  if (priv->nrofprops != 0) {
+    MTPProperties *newprops;
+    unsigned int i;
+
+    // Properties of an object the device did not send in one go are merged
+    if (priv->arena) {
+      newprops = ptp_arena_alloc(&params->objectarena,
+				 (ob->nrofmtpprops + priv->nrofprops) * sizeof(MTPProperties));
+    } else {
+      newprops = malloc((ob->nrofmtpprops + priv->nrofprops) * sizeof(MTPProperties));
+    }
+    if (newprops != NULL) {
+      if (ob->nrofmtpprops != 0) {
+	memcpy(newprops, ob->mtpprops, ob->nrofmtpprops * sizeof(MTPProperties));
+      }
+      if (ob->mtpprops != NULL &&
+	  !ptp_arena_owns(&params->objectarena, ob->mtpprops)) {
+	free(ob->mtpprops);
+      }
+      memcpy(&newprops[ob->nrofmtpprops], priv->props,
+	     priv->nrofprops * sizeof(MTPProperties));
+      ob->mtpprops = newprops;
+      ob->nrofmtpprops += priv->nrofprops;
+      ob->flags |= PTPOBJECT_MTPPROPLIST_LOADED;
+    } else {
+      for (i = 0; i < priv->nrofprops; i++) {
+	if (priv->props[i].datatype == PTP_DTC_STR) {
+	  ptp_object_free_string(params, ob, priv->props[i].propval.str);
+	} else {
+	  ptp_destroy_object_prop(&priv->props[i]);
+	}
+      }
+    }
+    priv->nrofprops = 0;
+  }
+  ob->flags |= PTPOBJECT_OBJECTINFO_LOADED;
+  if (!PTP_OB_NAME(params, ob)) {
+    /* I have one such file on my Creative (Marcus) */
+    if (priv->arena) {
+      PTP_OB_NAME(params, ob) = ptp_arena_intern(&params->objectarena, "<null>");
+    } else {
+      PTP_OB_NAME(params, ob) = strdup("<null>");
+    }
+  }
+  ptp_object_reindex(params, ob);
+  priv->ob = NULL;
+  if (priv->emit && emit_loaded_object(priv->device, ob) != 0)
+    priv->cancelled = 1;
+}
+
+/**
+ * Called for every property of the property list as it is decoded.
+ */
+static uint16_t stream_metadata_property(PTPParams *params, void *private,
+					 MTPProperties *prop)
+{
+  MTPMetadataStreamPrivate *priv = (MTPMetadataStreamPrivate *) private;
+  PTPObject *ob;
+
+  /*
+   * Whenever the ObjectHandle changes we get a new object, when it's
+   * the same, it is just different properties of the same object.
+   */
+  if (priv->ob == NULL || priv->ob->oid != prop->ObjectHandle) {
+    finish_streamed_object(params, priv);
+    if (priv->cancelled) {
+      ptp_destroy_object_prop(prop);
+      return PTP_ERROR_CANCEL;
+    }
+    // Drop what we knew about objects that were elsewhere before, so the
+    // fresh properties are not merged with stale ones
+    if (priv->refresh &&
+	ptp_object_find(params, prop->ObjectHandle, &ob) == PTP_RC_OK &&
+	PTP_OB_PARENT(params, ob) != priv->parent) {
+      ptp_remove_object_from_cache(params, prop->ObjectHandle);
+    }
+    if (ptp_object_find_or_insert(params, prop->ObjectHandle, &priv->ob) != PTP_RC_OK) {
+      priv->ob = NULL;
+      ptp_destroy_object_prop(prop);
+      return PTP_RC_OK;
+    }
+    if (priv->arena) {
+      priv->ob->flags |= PTPOBJECT_ARENA;
+    }
+  }
+  ob = priv->ob;
+
+  // Move decoded strings into the arena, sharing equal ones
+  if (priv->arena &&
+      prop->datatype == PTP_DTC_STR && prop->propval.str != NULL) {
+    char *interned = ptp_arena_intern(&params->objectarena, prop->propval.str);
+
+    if (interned != NULL) {
+      free(prop->propval.str);
+      prop->propval.str = interned;
+    }
+  }
+
+  switch (prop->property) {
+  case PTP_OPC_ParentObject:
+    PTP_OB_PARENT(params, ob) = prop->propval.u32;
+    ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
+    break;
+  case PTP_OPC_ObjectFormat:
+    PTP_OB_FORMAT(params, ob) = prop->propval.u16;
+    break;
+  case PTP_OPC_ObjectSize:
+    // We loose precision here, up to 32 bits! However the commands that
+    // retrieve metadata for files and tracks will make sure that the
+    // PTP_OPC_ObjectSize is read in and duplicated again.
+    if (device_object_bitsize(priv->device) == 64) {
+      PTP_OB_SIZE(params, ob) = (uint32_t) prop->propval.u64;
+    } else {
+      PTP_OB_SIZE(params, ob) = prop->propval.u32;
+    }
+    break;
+  case PTP_OPC_StorageID:
+    PTP_OB_STORAGE(params, ob) = prop->propval.u32;
+    ob->flags |= PTPOBJECT_STORAGEID_LOADED;
+    break;
+  case PTP_OPC_ObjectFileName:
+    if (prop->propval.str != NULL) {
+      // Take over the decoded string
+      ptp_object_free_string(params, ob, PTP_OB_NAME(params, ob));
+      PTP_OB_NAME(params, ob) = prop->propval.str;
+    }
+    break;
+  default:
+    /* Keep all of the other MTP properties for the per-object proplist */
+    if (priv->nrofprops == priv->allocprops) {
+      unsigned int newalloc = priv->allocprops ? priv->allocprops * 2 : 32;
+      MTPProperties *newprops;
+
+      newprops = realloc(priv->props, newalloc * sizeof(MTPProperties));
+      if (newprops == NULL) {
+	// Drop the property rather than failing the whole listing
+	if (prop->datatype == PTP_DTC_STR) {
+	  ptp_object_free_string(params, ob, prop->propval.str);
+	} else {
+	  ptp_destroy_object_prop(prop);
+	}
+	break;
+      }
+      priv->props = newprops;
+      priv->allocprops = newalloc;
+    }
+    memcpy(&priv->props[priv->nrofprops++], prop, sizeof(MTPProperties));
+    break;
+  }
+  return PTP_RC_OK;
+}
+
 /**
  * This command gets all handles and stuff by FAST directory retrieveal
  * which is available by getting all metadata for object
  * <code>0xffffffff</code> which simply means "all metadata for all objects".
  * This works on the vast majority of MTP devices (there ARE exceptions!)
- * and is quite quick. Check the error stack to see if there were
- * problems getting the metadata.
- * @return 0 if all was OK, -1 on failure.
+ * and is quite quick. The property list is decoded into the object
+ * cache while it is being received, and each object is handed to the
+ * load view callback as soon as it is complete. Check the error stack
+ * to see if there were problems getting the metadata.
+ * @return 0 if all was OK, 1 if the load view callback cancelled,
+ *         -1 on failure.
  */
+
 static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
 {
   PTPParams      *params = (PTPParams *) device->params;
-  int		 cnt = 0;
-  int            i, j, nrofprops;
-  uint32_t	 lasthandle = 0xffffffff;
-  MTPProperties  *props = NULL;
-  MTPProperties  *prop;
+  MTPMetadataStreamPrivate priv;
   uint16_t       ret;
   int            oldtimeout;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
@@ -2724,9 +3682,26 @@ static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
   get_usb_device_timeout(ptp_usb, &oldtimeout);
   set_usb_device_timeout(ptp_usb, 60000);
 
-  ret = ptp_mtp_getobjectproplist(params, 0xffffffff, &props, &nrofprops);
+  memset(&priv, 0, sizeof(priv));
+  priv.device = device;
+  priv.arena = 1;
+  priv.emit = 1;
+  ret = ptp_mtp_getobjectproplist_stream(params, 0xffffffff,
+					 0x00000000U, 0xFFFFFFFFU, 0,
+					 0xFFFFFFFFU,
+					 stream_metadata_property, &priv);
   set_usb_device_timeout(ptp_usb, oldtimeout);
 
+  /* mark last entry also */
+  finish_streamed_object(params, &priv);
+  free(priv.props);
+
+  if (priv.cancelled) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED,
+			    "get_all_metadata_fast(): "
+			    "loading the device was cancelled.");
+    return 1;
+  }
   if (ret == PTP_RC_MTP_Specification_By_Group_Unsupported) {
     // What's the point in the device implementing this command if
     // you cannot use it to get all props for AT LEAST one object?
@@ -2740,151 +3715,166 @@ static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
     "could not get proplist of all objects.");
     return -1;
   }
-  if (props == NULL && nrofprops != 0) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "get_all_metadata_fast(): "
-			    "call to ptp_mtp_getobjectproplist() returned "
-			    "inconsistent results.");
-    return -1;
-  }
-  /*
-   * We count the number of objects by counting the ObjectHandle
-   * references, whenever it changes we get a new object, when it's
-   * the same, it is just different properties of the same object.
-   */
-  prop = props;
-  for (i=0;i<nrofprops;i++) {
-      if (lasthandle != prop->ObjectHandle) {
-	cnt++;
-	lasthandle = prop->ObjectHandle;
-      }
-      prop++;
-  }
-  lasthandle = 0xffffffff;
-  params->objects = calloc (cnt, sizeof(PTPObject));
-  prop = props;
-  i = -1;
-  for (j=0;j<nrofprops;j++) {
-    if (lasthandle != prop->ObjectHandle) {
-      if (i >= 0) {
-        params->objects[i].flags |= PTPOBJECT_OBJECTINFO_LOADED;
-	if (!params->objects[i].oi.Filename) {
-	  /* I have one such file on my Creative (Marcus) */
-	  params->objects[i].oi.Filename = strdup("<null>");
-	}
-      }
-      i++;
-      lasthandle = prop->ObjectHandle;
-      params->objects[i].oid = prop->ObjectHandle;
-    }
-    switch (prop->property) {
-    case PTP_OPC_ParentObject:
-      params->objects[i].oi.ParentObject = prop->propval.u32;
-      params->objects[i].flags |= PTPOBJECT_PARENTOBJECT_LOADED;
-      break;
-    case PTP_OPC_ObjectFormat:
-      params->objects[i].oi.ObjectFormat = prop->propval.u16;
-      break;
-    case PTP_OPC_ObjectSize:
-      // We loose precision here, up to 32 bits! However the commands that
-      // retrieve metadata for files and tracks will make sure that the
-      // PTP_OPC_ObjectSize is read in and duplicated again.
-      if (device->object_bitsize == 64) {
-	params->objects[i].oi.ObjectCompressedSize = (uint32_t) prop->propval.u64;
-      } else {
-	params->objects[i].oi.ObjectCompressedSize = prop->propval.u32;
-      }
-      break;
-    case PTP_OPC_StorageID:
-      params->objects[i].oi.StorageID = prop->propval.u32;
-      params->objects[i].flags |= PTPOBJECT_STORAGEID_LOADED;
-      break;
-    case PTP_OPC_ObjectFileName:
-      if (prop->propval.str != NULL)
-        params->objects[i].oi.Filename = strdup(prop->propval.str);
-      break;
-    default: {
-      MTPProperties *newprops;
+  return 0;
+}
 
-      /* Copy all of the other MTP oprierties into the per-object proplist */
-      if (params->objects[i].nrofmtpprops) {
-        newprops = realloc(params->objects[i].mtpprops,
-		(params->objects[i].nrofmtpprops+1)*sizeof(MTPProperties));
-      } else {
-        newprops = calloc(1,sizeof(MTPProperties));
-      }
-      if (!newprops) return 0; /* FIXME: error handling? */
-      params->objects[i].mtpprops = newprops;
-      memcpy(&params->objects[i].mtpprops[params->objects[i].nrofmtpprops],
-	     &props[j],sizeof(props[j]));
-      params->objects[i].nrofmtpprops++;
-      params->objects[i].flags |= PTPOBJECT_MTPPROPLIST_LOADED;
-      break;
-    }
-    }
-    prop++;
+/**
+ * This gets the metadata of all objects in one folder with a single
+ * property list request at depth 1, instead of asking for every
+ * object one by one. Objects of the folder that were cached before are
+ * dropped first so that the listing reflects the device. Any object
+ * missing from the reply is simply left for the caller to fetch on its
+ * own, so failures are not reported.
+ * @return 0 if the property list was retrieved, -1 otherwise.
+ */
+static int get_folder_metadata_fast(LIBMTP_mtpdevice_t *device,
+				    uint32_t const parent)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  MTPMetadataStreamPrivate priv;
+  PTPObject *ob;
+  uint16_t ret;
+  int oldtimeout;
+
+  if (!ptp_operation_issupported(params, PTP_OC_MTP_GetObjPropList) ||
+      FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)) {
+    return -1;
   }
-  /* mark last entry also */
-  if (i >= 0) {
-    params->objects[i].flags |= PTPOBJECT_OBJECTINFO_LOADED;
-    params->nrofobjects = i+1;
-  } else {
-    params->nrofobjects = 0;
+
+  while ((ob = ptp_objects_next_by_parent(params, parent, NULL)) != NULL) {
+    ptp_remove_object_from_cache(params, ob->oid);
   }
-  free (props);
-  /* The device might not give the list in linear ascending order */
-  ptp_objects_sort (params);
-  return 0;
+
+  memset(&priv, 0, sizeof(priv));
+  priv.device = device;
+  priv.refresh = 1;
+  priv.parent = parent;
+  // Big folders take a while to list, just like the whole device
+  get_usb_device_timeout(ptp_usb, &oldtimeout);
+  set_usb_device_timeout(ptp_usb, 60000);
+  ret = ptp_mtp_getobjectproplist_stream(params, parent,
+					 0x00000000U, 0xFFFFFFFFU, 0,
+					 1, stream_metadata_property, &priv);
+  set_usb_device_timeout(ptp_usb, oldtimeout);
+  finish_streamed_object(params, &priv);
+  free(priv.props);
+  return (ret == PTP_RC_OK) ? 0 : -1;
 }
 
 /**
- * This function will recurse through all the directories on the device,
- * starting at the root directory, gathering metadata as it moves along.
+ * This function walks through all the directories on a storage,
+ * starting at the given folder, gathering metadata as it moves along.
  * It works better on some devices that will only return data for a
  * certain directory and does not respect the option to get all metadata
- * for all objects.
+ * for all objects. Folders are listed breadth first, and the metadata
+ * of the children of each folder is asked for with one property list
+ * request where the device can do that, so only devices without it
+ * take a GetObjectInfo for every object. The load callback of the
+ * device is told about every folder listed and the load view callback
+ * about every object found, either can cancel the walk.
+ * @return PTP_RC_OK if the starting folder could be listed,
+ *         PTP_ERROR_CANCEL if the load callback cancelled.
  */
 static uint16_t get_handles_recursively(LIBMTP_mtpdevice_t *device,
 				    PTPParams *params,
 				    uint32_t storageid,
 				    uint32_t parent)
 {
-  PTPObjectHandles currentHandles;
-  unsigned int i = 0;
-  uint16_t ret = ptp_getobjecthandles(params,
-                                      storageid,
-                                      PTP_GOH_ALL_FORMATS,
-                                      parent,
-                                      &currentHandles);
+  uint32_t *folders;
+  uint32_t nroffolders = 1;
+  uint32_t allocfolders = 64;
+  uint32_t done = 0;
+  int fast = 1;
+  uint16_t ret = PTP_RC_OK;
+
+  folders = malloc(allocfolders * sizeof(uint32_t));
+  if (folders == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "get_handles_recursively(): out of memory.");
+    return PTP_RC_GeneralError;
+  }
+  folders[0] = parent;
+
+  while (done < nroffolders) {
+    PTPObjectHandles currentHandles;
+    uint32_t folder = folders[done++];
+    unsigned int i;
+
+    ret = ptp_getobjecthandles(params,
+			       storageid,
+			       PTP_GOH_ALL_FORMATS,
+			       folder,
+			       &currentHandles);
+    if (ret != PTP_RC_OK) {
+      char buf[80];
+      sprintf(buf,"get_handles_recursively(): could not get object handles of %08x", folder);
+      add_ptp_error_to_errorstack(device, ret, buf);
+      // Only give up if not even the first folder can be listed
+      if (folder == parent)
+	break;
+      ret = PTP_RC_OK;
+      continue;
+    }
 
-  if (ret != PTP_RC_OK) {
-    char buf[80];
-    sprintf(buf,"get_handles_recursively(): could not get object handles of %08x", parent);
-    add_ptp_error_to_errorstack(device, ret, buf);
-    return ret;
-  }
+    /*
+     * The root folder is no object of its own, so that has to go the
+     * slow way. If a folder cannot be listed in one go, the device will
+     * not do it for the others either.
+     */
+    if (fast && currentHandles.n > 1 &&
+	folder != PTP_GOH_ROOT_PARENT && folder != 0 &&
+	get_folder_metadata_fast(device, folder) != 0) {
+      fast = 0;
+    }
 
-  if (currentHandles.Handler == NULL || currentHandles.n == 0)
-    return PTP_RC_OK;
+    // Queue any subdirectories found
+    for (i = 0; i < currentHandles.n; i++) {
+      PTPObject *ob;
 
-  // Now descend into any subdirectories found
-  for (i = 0; i < currentHandles.n; i++) {
-    PTPObject *ob;
-    ret = ptp_object_want(params,currentHandles.Handler[i],
-			  PTPOBJECT_OBJECTINFO_LOADED, &ob);
-    if (ret == PTP_RC_OK) {
-      if (ob->oi.ObjectFormat == PTP_OFC_Association)
-        get_handles_recursively(device, params,
-				storageid, currentHandles.Handler[i]);
-    } else {
-      add_error_to_errorstack(device,
-			      LIBMTP_ERROR_CONNECTING,
-			      "Found a bad handle, trying to ignore it.");
-      return ret;
+      if (ptp_object_want(params,currentHandles.Handler[i],
+			  PTPOBJECT_OBJECTINFO_LOADED, &ob) != PTP_RC_OK) {
+	add_error_to_errorstack(device,
+				LIBMTP_ERROR_CONNECTING,
+				"Found a bad handle, trying to ignore it.");
+	continue;
+      }
+      if (emit_loaded_object(device, ob) != 0) {
+	ret = PTP_ERROR_CANCEL;
+	break;
+      }
+      if (PTP_OB_FORMAT(params, ob) != PTP_OFC_Association)
+	continue;
+      if (nroffolders == allocfolders) {
+	uint32_t *newfolders = realloc(folders,
+				       allocfolders * 2 * sizeof(uint32_t));
+
+	if (newfolders == NULL) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+				  "get_handles_recursively(): out of memory, "
+				  "skipping a folder.");
+	  continue;
+	}
+	folders = newfolders;
+	allocfolders *= 2;
+      }
+      folders[nroffolders++] = currentHandles.Handler[i];
+    }
+    free(currentHandles.Handler);
+
+    if (ret == PTP_ERROR_CANCEL ||
+	(device->load_callback != NULL &&
+	 device->load_callback(done, nroffolders,
+			       device->load_callback_data) != 0)) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED,
+			      "get_handles_recursively(): "
+			      "loading the device was cancelled.");
+      ret = PTP_ERROR_CANCEL;
+      break;
     }
   }
-  free(currentHandles.Handler);
-  return PTP_RC_OK;
+  free(folders);
+  return ret;
 }
 
 /**
@@ -2893,121 +3883,138 @@ static uint16_t get_handles_recursively(LIBMTP_mtpdevice_t *device,
  * that do not add or remove objects, this is typically not
  * called.
  * @param device a pointer to the MTP device to flush handles for.
+ * @return 0 on success, -1 if a load callback cancelled the listing.
  */
-static void flush_handles(LIBMTP_mtpdevice_t *device)
+static int flush_handles(LIBMTP_mtpdevice_t *device)
 {
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  int ret;
-  uint32_t i;
+  int cancelled = 0;
 
   if (!device->cached) {
-    return;
+    return 0;
   }
 
-  if (params->objects != NULL) {
-    for (i=0;i<params->nrofobjects;i++)
-      ptp_free_object (&params->objects[i]);
-    free(params->objects);
-    params->objects = NULL;
-    params->nrofobjects = 0;
-  }
+  ptp_objects_clear(params);
 
   if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)
       && !FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)
       && !FLAG_BROKEN_MTPGETOBJPROPLIST_ALL(ptp_usb)) {
-    // Use the fast method. Ignore return value for now.
-    ret = get_all_metadata_fast(device);
+    // Use the fast method. Ignore failures, the fallback follows.
+    cancelled = (get_all_metadata_fast(device) == 1);
   }
 
   // If the previous failed or returned no objects, use classic
   // methods instead.
-  if (params->nrofobjects == 0) {
+  if (!cancelled && params->nrofobjects == 0) {
     // Get all the handles using just standard commands.
+    want_storage(device);
     if (device->storage == NULL) {
-      get_handles_recursively(device, params,
-			      PTP_GOH_ALL_STORAGE,
-			      PTP_GOH_ROOT_PARENT);
+      cancelled = (get_handles_recursively(device, params,
+					   PTP_GOH_ALL_STORAGE,
+					   PTP_GOH_ROOT_PARENT) == PTP_ERROR_CANCEL);
     } else {
       // Get handles for each storage in turn.
       LIBMTP_devicestorage_t *storage = device->storage;
       while(storage != NULL) {
-	get_handles_recursively(device, params,
-				storage->id,
-				PTP_GOH_ROOT_PARENT);
+	if (get_handles_recursively(device, params,
+				    storage->id,
+				    PTP_GOH_ROOT_PARENT) == PTP_ERROR_CANCEL) {
+	  cancelled = 1;
+	  break;
+	}
 	storage = storage->next;
       }
     }
   }
 
-  /*
-   * Loop over the handles, fix up any NULL filenames or
-   * keywords, then attempt to locate some default folders
-   * in the root directory of the primary storage.
-   */
+  locate_default_folders(device);
+  return cancelled ? -1 : 0;
+}
+
+/**
+ * Loop over the handles, fix up any NULL filenames or
+ * keywords, then attempt to locate some default folders
+ * in the root directory of the primary storage.
+ * @param device a pointer to the MTP device to scan.
+ */
+static void locate_default_folders(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  int ret;
+  uint32_t i;
+
   for(i = 0; i < params->nrofobjects; i++) {
     PTPObject *ob, *xob;
 
-    ob = &params->objects[i];
-    ret = ptp_object_want(params,params->objects[i].oid,
+    uint32_t oid;
+
+    ob = params->objects[i];
+    oid = ob->oid;
+    ret = ptp_object_want(params, oid,
 			  PTPOBJECT_OBJECTINFO_LOADED, &xob);
     if (ret != PTP_RC_OK) {
-	LIBMTP_ERROR("broken! %x not found\n", params->objects[i].oid);
+      LIBMTP_ERROR("broken! %x not found\n", oid);
+      // A failing object is dropped, another one took its place
+      if (ptp_object_find(params, oid, &xob) != PTP_RC_OK) {
+	i--;
+	continue;
+      }
+    }
+    if (PTP_OB_NAME(params, ob) == NULL) {
+      PTP_OB_NAME(params, ob) = strdup("<null>");
+      ptp_object_reindex(params, ob);
     }
-    if (ob->oi.Filename == NULL)
-      ob->oi.Filename = strdup("<null>");
-    if (ob->oi.Keywords == NULL)
-      ob->oi.Keywords = strdup("<null>");
 
     /* Ignore handles that point to non-folders */
-    if(ob->oi.ObjectFormat != PTP_OFC_Association)
+    if(PTP_OB_FORMAT(params, ob) != PTP_OFC_Association)
       continue;
     /* Only look in the root folder */
-    if (ob->oi.ParentObject == 0xffffffffU) {
+    if (PTP_OB_PARENT(params, ob) == 0xffffffffU) {
       LIBMTP_ERROR("object %x has parent 0xffffffff (-1) continuing anyway\n",
 		   ob->oid);
-    } else if (ob->oi.ParentObject != 0x00000000U)
+    } else if (PTP_OB_PARENT(params, ob) != 0x00000000U)
       continue;
     /* Only look in the primary storage */
-    if (device->storage != NULL && ob->oi.StorageID != device->storage->id)
+    if (device->storage != NULL && PTP_OB_STORAGE(params, ob) != device->storage->id)
       continue;
 
     /* Is this the Music Folder */
-    if (!strcasecmp(ob->oi.Filename, "My Music") ||
-	!strcasecmp(ob->oi.Filename, "My_Music") ||
-	!strcasecmp(ob->oi.Filename, "Music")) {
+    if (!strcasecmp(PTP_OB_NAME(params, ob), "My Music") ||
+	!strcasecmp(PTP_OB_NAME(params, ob), "My_Music") ||
+	!strcasecmp(PTP_OB_NAME(params, ob), "Music")) {
       device->default_music_folder = ob->oid;
     }
-    else if (!strcasecmp(ob->oi.Filename, "My Playlists") ||
-	     !strcasecmp(ob->oi.Filename, "My_Playlists") ||
-	     !strcasecmp(ob->oi.Filename, "Playlists")) {
+    else if (!strcasecmp(PTP_OB_NAME(params, ob), "My Playlists") ||
+	     !strcasecmp(PTP_OB_NAME(params, ob), "My_Playlists") ||
+	     !strcasecmp(PTP_OB_NAME(params, ob), "Playlists")) {
       device->default_playlist_folder = ob->oid;
     }
-    else if (!strcasecmp(ob->oi.Filename, "My Pictures") ||
-	     !strcasecmp(ob->oi.Filename, "My_Pictures") ||
-	     !strcasecmp(ob->oi.Filename, "Pictures")) {
+    else if (!strcasecmp(PTP_OB_NAME(params, ob), "My Pictures") ||
+	     !strcasecmp(PTP_OB_NAME(params, ob), "My_Pictures") ||
+	     !strcasecmp(PTP_OB_NAME(params, ob), "Pictures")) {
       device->default_picture_folder = ob->oid;
     }
-    else if (!strcasecmp(ob->oi.Filename, "My Video") ||
-	     !strcasecmp(ob->oi.Filename, "My_Video") ||
-	     !strcasecmp(ob->oi.Filename, "Video")) {
+    else if (!strcasecmp(PTP_OB_NAME(params, ob), "My Video") ||
+	     !strcasecmp(PTP_OB_NAME(params, ob), "My_Video") ||
+	     !strcasecmp(PTP_OB_NAME(params, ob), "Video")) {
 	device->default_video_folder = ob->oid;
     }
-    else if (!strcasecmp(ob->oi.Filename, "My Organizer") ||
-	     !strcasecmp(ob->oi.Filename, "My_Organizer")) {
+    else if (!strcasecmp(PTP_OB_NAME(params, ob), "My Organizer") ||
+	     !strcasecmp(PTP_OB_NAME(params, ob), "My_Organizer")) {
       device->default_organizer_folder = ob->oid;
     }
-    else if (!strcasecmp(ob->oi.Filename, "ZENcast") ||
-	     !strcasecmp(ob->oi.Filename, "Datacasts")) {
+    else if (!strcasecmp(PTP_OB_NAME(params, ob), "ZENcast") ||
+	     !strcasecmp(PTP_OB_NAME(params, ob), "Datacasts")) {
       device->default_zencast_folder = ob->oid;
     }
-    else if (!strcasecmp(ob->oi.Filename, "My Albums") ||
-	     !strcasecmp(ob->oi.Filename, "My_Albums") ||
-	     !strcasecmp(ob->oi.Filename, "Albums")) {
+    else if (!strcasecmp(PTP_OB_NAME(params, ob), "My Albums") ||
+	     !strcasecmp(PTP_OB_NAME(params, ob), "My_Albums") ||
+	     !strcasecmp(PTP_OB_NAME(params, ob), "Albums")) {
       device->default_album_folder = ob->oid;
     }
-    else if (!strcasecmp(ob->oi.Filename, "Text") ||
-	     !strcasecmp(ob->oi.Filename, "Texts")) {
+    else if (!strcasecmp(PTP_OB_NAME(params, ob), "Text") ||
+	     !strcasecmp(PTP_OB_NAME(params, ob), "Texts")) {
       device->default_text_folder = ob->oid;
     }
   }
@@ -3126,6 +4133,7 @@ static uint32_t get_writeable_storageid(LIBMTP_mtpdevice_t *device,
   int subcall_ret;
 
   // See if there is some storage we can fit this file on.
+  want_storage(device);
   storage = device->storage;
   if (storage == NULL) {
     // Sometimes the storage just cannot be detected.
@@ -3187,58 +4195,82 @@ static int get_suggested_storage_id(LIBMTP_mtpdevice_t *device,
   uint16_t ret;
 
   ret = ptp_object_want(params, parent_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
-  if ((ret != PTP_RC_OK) || (ob->oi.StorageID == 0)) {
+  if ((ret != PTP_RC_OK) || (PTP_OB_STORAGE(params, ob) == 0)) {
     add_ptp_error_to_errorstack(device, ret, "get_suggested_storage_id(): "
 				"could not get storage id from parent id.");
     return get_writeable_storageid(device, fitsize);
   } else {
     /* OK we know the parent storage, then use that */
-    return ob->oi.StorageID;
+    return PTP_OB_STORAGE(params, ob);
+  }
+}
+
+/**
+ * Reads the storage info of every storage in the storage list again.
+ * @param device a pointer to the device to refresh the storage list of.
+ * @return 0 on success, any other value means failure.
+ */
+static int refresh_storage_freespace(LIBMTP_mtpdevice_t *device)
+{
+  LIBMTP_devicestorage_t *storage;
+
+  for (storage = device->storage; storage != NULL; storage = storage->next) {
+    if (update_storage_info(device, storage->id) != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+		"refresh_storage_freespace(): could not get storage info.");
+      return -1;
+    }
   }
+  device->storage_refreshed = time(NULL);
+  return 0;
 }
 
 /**
  * This function grabs the freespace from a certain storage in
  * device storage list.
+ *
+ * The free space read from the device is trusted for
+ * <code>storage_ttl</code> seconds, less what was sent since, and is
+ * read again sooner when the device tells the storage changed or
+ * filled up, or when the file would leave less than
+ * STORAGE_FREESPACE_MARGIN of it.
  * @param device a pointer to the MTP device to free the storage
  * list for.
  * @param storageid the storage ID for the storage to flush and
  * get free space for.
+ * @param fitsize the size of the file about to be sent.
  * @param freespace the free space on this storage will be returned
  * in this variable.
  */
 static int get_storage_freespace(LIBMTP_mtpdevice_t *device,
 				 LIBMTP_devicestorage_t *storage,
+				 uint64_t fitsize,
 				 uint64_t *freespace)
 {
   PTPParams *params = (PTPParams *) device->params;
 
-  // Always query the device about this, since some models explicitly
-  // needs that. We flush all data on queries storage here.
   if (ptp_operation_issupported(params,PTP_OC_GetStorageInfo)) {
-    PTPStorageInfo storageInfo;
-    uint16_t ret;
+    time_t now = time(NULL);
 
-    ret = ptp_getstorageinfo(params, storage->id, &storageInfo);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret,
+    if (device->storage_ttl <= 0) {
+      // Always query the device about this, since some models explicitly
+      // needs that.
+      if (update_storage_info(device, storage->id) != 0) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
 		"get_storage_freespace(): could not get storage info.");
-      return -1;
-    }
-    if (storage->StorageDescription != NULL) {
-      free(storage->StorageDescription);
-    }
-    if (storage->VolumeIdentifier != NULL) {
-      free(storage->VolumeIdentifier);
+	return -1;
+      }
+    } else if (device->storage_refreshed == 0 ||
+	now - device->storage_refreshed >= device->storage_ttl ||
+	now < device->storage_refreshed ||
+	storage->FreeSpaceInBytes == (uint64_t) -1 ||
+	storage->FreeSpaceInBytes < fitsize + STORAGE_FREESPACE_MARGIN) {
+      if (refresh_storage_freespace(device) != 0) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+		"get_storage_freespace(): could not get storage info.");
+	return -1;
+      }
     }
-    storage->StorageType = storageInfo.StorageType;
-    storage->FilesystemType = storageInfo.FilesystemType;
-    storage->AccessCapability = storageInfo.AccessCapability;
-    storage->MaxCapacity = storageInfo.MaxCapability;
-    storage->FreeSpaceInBytes = storageInfo.FreeSpaceInBytes;
-    storage->FreeSpaceInObjects = storageInfo.FreeSpaceInImages;
-    storage->StorageDescription = storageInfo.StorageDescription;
-    storage->VolumeIdentifier = storageInfo.VolumeLabel;
   }
   if(storage->FreeSpaceInBytes == (uint64_t) -1)
     return -1;
@@ -3246,6 +4278,57 @@ static int get_storage_freespace(LIBMTP_mtpdevice_t *device,
   return 0;
 }
 
+/**
+ * Takes what was just sent off the free space of a storage, so the
+ * next file can be checked without asking the device.
+ * @param device a pointer to the device.
+ * @param storage_id the storage the object was created on.
+ * @param size the size of the object.
+ */
+static void storage_commit_bytes(LIBMTP_mtpdevice_t *device,
+				 uint32_t const storage_id,
+				 uint64_t const size)
+{
+  LIBMTP_devicestorage_t *storage;
+
+  for (storage = device->storage; storage != NULL; storage = storage->next) {
+    if (storage->id != storage_id)
+      continue;
+    if (storage->FreeSpaceInBytes != (uint64_t) -1)
+      storage->FreeSpaceInBytes -= size < storage->FreeSpaceInBytes ?
+	size : storage->FreeSpaceInBytes;
+    if (storage->FreeSpaceInObjects != (uint64_t) -1 &&
+	storage->FreeSpaceInObjects > 0)
+      storage->FreeSpaceInObjects--;
+    break;
+  }
+}
+
+/**
+ * This sets for how long the free space of the storage list is
+ * trusted when checking whether a file fits before it is sent. In
+ * between, the size of every file sent is taken off the free space
+ * last read, and it is read again when the device reports that a
+ * storage changed or filled up, or when the file would come close to
+ * filling the storage. Call this with 0 for devices that have to be
+ * asked about every file.
+ * @param device a pointer to the device to set the time for.
+ * @param seconds the time to trust the free space for, 0 to read it
+ *        for every file. The default is 30 seconds.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Storage_Cache_TTL(LIBMTP_mtpdevice_t *device,
+				 int const seconds)
+{
+  if (seconds < 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Set_Storage_Cache_TTL(): "
+			    "negative time.");
+    return -1;
+  }
+  device->storage_ttl = seconds;
+  return 0;
+}
+
 /**
  * This function dumps out a large chunk of textual information
  * provided from the PTP protocol and additionally some extra
@@ -3257,9 +4340,12 @@ void LIBMTP_Dump_Device_Info(LIBMTP_mtpdevice_t *device)
   unsigned int i;
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  LIBMTP_devicestorage_t *storage = device->storage;
+  LIBMTP_devicestorage_t *storage;
   LIBMTP_device_extension_t *tmpext = device->extensions;
 
+  want_storage(device);
+  storage = device->storage;
+
   printf("USB low-level info:\n");
   dump_usbinfo(ptp_usb);
   /* Print out some verbose information */
@@ -3273,7 +4359,7 @@ void LIBMTP_Dump_Device_Info(LIBMTP_mtpdevice_t *device)
   printf("   Vendor extension description: %s\n",
 	 params->deviceinfo.VendorExtensionDesc);
   printf("   Detected object size: %d bits\n",
-	 device->object_bitsize);
+	 device_object_bitsize(device));
   printf("   Extensions:\n");
   while (tmpext != NULL) {
     printf("        %s: %d.%d\n",
@@ -3320,7 +4406,7 @@ void LIBMTP_Dump_Device_Info(LIBMTP_mtpdevice_t *device)
 			     sizeof(txt), txt);
       printf("   %04x: %s\n", params->deviceinfo.ImageFormats[i], txt);
 
-      ret = ptp_mtp_getobjectpropssupported (params,
+      ret = ptp_mtp_getobjectpropssupported_cached(params,
 			params->deviceinfo.ImageFormats[i], &propcnt, &props);
       if (ret != PTP_RC_OK) {
 	add_ptp_error_to_errorstack(device, ret, "LIBMTP_Dump_Device_Info(): "
@@ -3333,7 +4419,7 @@ void LIBMTP_Dump_Device_Info(LIBMTP_mtpdevice_t *device)
 	  printf("      %04x: %s", props[j],
 		 LIBMTP_Get_Property_Description(map_ptp_property_to_libmtp_property(props[j])));
 	  // Get a more verbose description
-	  ret = ptp_mtp_getobjectpropdesc(params, props[j],
+	  ret = ptp_mtp_getobjectpropdesc_cached(params, props[j],
 					  params->deviceinfo.ImageFormats[i],
 					  &opd);
 	  if (ret != PTP_RC_OK) {
@@ -3548,7 +4634,6 @@ void LIBMTP_Dump_Device_Info(LIBMTP_mtpdevice_t *device)
 	  printf(" GROUP 0x%x", opd.GroupCode);
 
 	  printf("\n");
-	  ptp_free_objectpropdesc(&opd);
 	}
 	free(props);
       }
@@ -3671,125 +4756,550 @@ int LIBMTP_Reset_Device(LIBMTP_mtpdevice_t *device)
 }
 
 /**
- * This retrieves the manufacturer name of an MTP device.
- * @param device a pointer to the device to get the manufacturer name for.
- * @return a newly allocated UTF-8 string representing the manufacturer name.
- *         The string must be freed by the caller after use. If the call
- *         was unsuccessful this will contain NULL.
+ * This enables or disables pipelined bulk transfers for a device.
+ * With pipelining enabled, large transfers are split into chunks and
+ * several of them are kept queued in the USB stack at the same time,
+ * which hides the per-transfer turnaround and gives considerably higher
+ * throughput on fast devices. Not all USB backends support this.
+ * @param device a pointer to the device to configure.
+ * @param depth the number of transfers to keep in flight. 0 or 1
+ *        restores the default, synchronous behaviour.
+ * @param chunksize the size of each transfer in bytes, 0 selects a
+ *        sensible default. The value is rounded to whole USB packets.
+ * @return 0 on success, any other value means failure.
  */
-char *LIBMTP_Get_Manufacturername(LIBMTP_mtpdevice_t *device)
+int LIBMTP_Set_Transfer_Pipelining(LIBMTP_mtpdevice_t *device,
+				   int const depth,
+				   uint32_t const chunksize)
 {
-  char *retmanuf = NULL;
-  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
-  if (params->deviceinfo.Manufacturer != NULL) {
-    retmanuf = strdup(params->deviceinfo.Manufacturer);
+  if (set_usb_device_pipelining(ptp_usb, depth, chunksize) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Set_Transfer_Pipelining(): "
+			    "pipelined transfers not supported.");
+    return -1;
   }
-  return retmanuf;
+  return 0;
 }
 
 /**
- * This retrieves the model name (often equal to product name)
- * of an MTP device.
- * @param device a pointer to the device to get the model name for.
- * @return a newly allocated UTF-8 string representing the model name.
- *         The string must be freed by the caller after use. If the call
- *         was unsuccessful this will contain NULL.
+ * This gets the bulk transfer tuning of a device, with the values
+ * picked automatically filled in.
+ * @param device a pointer to the device.
+ * @param tuning returns the tuning in effect.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Set_Transfer_Tuning()
  */
-char *LIBMTP_Get_Modelname(LIBMTP_mtpdevice_t *device)
+int LIBMTP_Get_Transfer_Tuning(LIBMTP_mtpdevice_t *device,
+			       LIBMTP_transfer_tuning_t *tuning)
 {
-  char *retmodel = NULL;
-  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
-  if (params->deviceinfo.Model != NULL) {
-    retmodel = strdup(params->deviceinfo.Model);
-  }
-  return retmodel;
+  get_usb_device_tuning(ptp_usb, tuning);
+  return 0;
 }
 
 /**
- * This retrieves the serial number of an MTP device.
- * @param device a pointer to the device to get the serial number for.
- * @return a newly allocated UTF-8 string representing the serial number.
- *         The string must be freed by the caller after use. If the call
- *         was unsuccessful this will contain NULL.
+ * This sets the bulk transfer tuning of a device. When a device is
+ * opened the chunk size, the number of transfers kept in flight and
+ * the timeouts are picked from the negotiated link speed and the
+ * endpoint packet and burst sizes: SuperSpeed links get a deep
+ * pipeline of large transfers, slower links keep the synchronous
+ * transfers all the device quirks were worked out with. Any field
+ * set to 0 here is still picked automatically, and the quirks of
+ * iRiver and Samsung devices are honoured whatever the values.
+ * @param device a pointer to the device to configure.
+ * @param tuning the tuning to use, or NULL to go back to the
+ *        automatic values.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_Transfer_Tuning()
+ * @see LIBMTP_Set_Transfer_Pipelining()
  */
-char *LIBMTP_Get_Serialnumber(LIBMTP_mtpdevice_t *device)
+int LIBMTP_Set_Transfer_Tuning(LIBMTP_mtpdevice_t *device,
+			       LIBMTP_transfer_tuning_t const * const tuning)
 {
-  char *retnumber = NULL;
-  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
-  if (params->deviceinfo.SerialNumber != NULL) {
-    retnumber = strdup(params->deviceinfo.SerialNumber);
+  if (set_usb_device_tuning(ptp_usb, tuning) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Set_Transfer_Tuning(): "
+			    "tuning not supported by this USB backend.");
+    return -1;
   }
-  return retnumber;
+  return 0;
 }
 
 /**
- * This retrieves the device version (hardware and firmware version) of an
- * MTP device.
- * @param device a pointer to the device to get the device version for.
- * @return a newly allocated UTF-8 string representing the device version.
- *         The string must be freed by the caller after use. If the call
- *         was unsuccessful this will contain NULL.
+ * The checksum state of a device, see LIBMTP_Set_Transfer_Checksum().
  */
-char *LIBMTP_Get_Deviceversion(LIBMTP_mtpdevice_t *device)
+typedef struct {
+  LIBMTP_checksum_t type;
+  mtp_checksum_t sum;
+  unsigned char digest[LIBMTP_CHECKSUM_MAX_SIZE];
+  unsigned int size;
+} mtp_transfer_checksum_t;
+
+static void checksum_tee(void *priv, unsigned char const *data,
+			 unsigned long len)
 {
-  char *retversion = NULL;
+  checksum_update((mtp_checksum_t *) priv, data, len);
+}
+
+/**
+ * Start computing the checksum of the object data about to be
+ * transferred, if the device is set up for it.
+ * @param device the device.
+ */
+static void transfer_checksum_begin(LIBMTP_mtpdevice_t *device)
+{
+  mtp_transfer_checksum_t *c = (mtp_transfer_checksum_t *) device->checksum;
   PTPParams *params = (PTPParams *) device->params;
 
-  if (params->deviceinfo.DeviceVersion != NULL) {
-    retversion = strdup(params->deviceinfo.DeviceVersion);
-  }
-  return retversion;
+  if (c == NULL)
+    return;
+  c->size = 0;
+  checksum_init(&c->sum, c->type);
+  params->tee_func = checksum_tee;
+  params->tee_priv = &c->sum;
 }
 
-
 /**
- * This retrieves the "friendly name" of an MTP device. Usually
- * this is simply the name of the owner or something like
- * "John Doe's Digital Audio Player". This property should be supported
- * by all MTP devices.
- * @param device a pointer to the device to get the friendly name for.
- * @return a newly allocated UTF-8 string representing the friendly name.
- *         The string must be freed by the caller after use.
- * @see LIBMTP_Set_Friendlyname()
+ * Stop computing the checksum of a transfer.
+ * @param device the device.
+ * @param ok whether the whole object was transferred, else no digest is
+ *        kept.
  */
-char *LIBMTP_Get_Friendlyname(LIBMTP_mtpdevice_t *device)
+static void transfer_checksum_end(LIBMTP_mtpdevice_t *device, int const ok)
 {
-  PTPPropertyValue propval;
-  char *retstring = NULL;
+  mtp_transfer_checksum_t *c = (mtp_transfer_checksum_t *) device->checksum;
   PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
 
-  if (!ptp_property_issupported(params, PTP_DPC_MTP_DeviceFriendlyName)) {
-    return NULL;
-  }
+  if (c == NULL)
+    return;
+  params->tee_func = NULL;
+  params->tee_priv = NULL;
+  c->size = 0;
+  if (ok)
+    c->size = checksum_final(&c->sum, c->digest);
+}
+
+/**
+ * This makes the library compute a checksum of the file data moved
+ * by the <code>LIBMTP_Get_File_To_*()</code>,
+ * <code>LIBMTP_Get_Track_To_*()</code>,
+ * <code>LIBMTP_Send_File_From_*()</code> and
+ * <code>LIBMTP_Send_Track_From_*()</code> functions. The checksum is
+ * computed as the data passes, so verifying a copy needs no second
+ * pass over it. The resumable transfers, which may be split over
+ * several calls, are not covered.
+ * CRC32C uses the CRC instructions of the CPU where it has them.
+ * @param device a pointer to the device.
+ * @param type the checksum to compute, or
+ *        <code>LIBMTP_CHECKSUM_NONE</code> to stop computing one.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_Transfer_Checksum()
+ */
+int LIBMTP_Set_Transfer_Checksum(LIBMTP_mtpdevice_t *device,
+				 LIBMTP_checksum_t const type)
+{
+  mtp_transfer_checksum_t *c = (mtp_transfer_checksum_t *) device->checksum;
 
-  ret = ptp_getdevicepropvalue(params,
-			       PTP_DPC_MTP_DeviceFriendlyName,
-			       &propval,
-			       PTP_DTC_STR);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "Error getting friendlyname.");
-    return NULL;
+  if (type == LIBMTP_CHECKSUM_NONE) {
+    free(c);
+    device->checksum = NULL;
+    return 0;
   }
-  if (propval.str != NULL) {
-    retstring = strdup(propval.str);
-    free(propval.str);
+  if (type != LIBMTP_CHECKSUM_CRC32C && type != LIBMTP_CHECKSUM_SHA256) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Set_Transfer_Checksum(): unknown checksum.");
+    return -1;
   }
-  return retstring;
+  if (c == NULL) {
+    c = calloc(1, sizeof(mtp_transfer_checksum_t));
+    if (c == NULL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			      "LIBMTP_Set_Transfer_Checksum(): out of memory.");
+      return -1;
+    }
+    device->checksum = c;
+  }
+  c->type = type;
+  c->size = 0;
+  return 0;
 }
 
 /**
- * Sets the "friendly name" of an MTP device.
- * @param device a pointer to the device to set the friendly name for.
- * @param friendlyname the new friendly name for the device.
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Get_Friendlyname()
+ * This retrieves the checksum of the last file transferred in full
+ * since LIBMTP_Set_Transfer_Checksum() was called. For several files
+ * sent in one call this is the checksum of the last one.
+ * @param device a pointer to the device.
+ * @param digest where to store the digest, big endian, with room for
+ *        <code>LIBMTP_CHECKSUM_MAX_SIZE</code> bytes: 4 bytes for
+ *        CRC32C and 32 bytes for SHA-256.
+ * @param size the size of the digest is returned here.
+ * @return 0 on success, any other value means that no checksum is
+ *         at hand, because none is computed or the last transfer
+ *         failed.
  */
-int LIBMTP_Set_Friendlyname(LIBMTP_mtpdevice_t *device,
-			 char const * const friendlyname)
+int LIBMTP_Get_Transfer_Checksum(LIBMTP_mtpdevice_t *device,
+				 unsigned char * const digest,
+				 unsigned int * const size)
+{
+  mtp_transfer_checksum_t *c = (mtp_transfer_checksum_t *) device->checksum;
+
+  if (c == NULL || c->size == 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Get_Transfer_Checksum(): no checksum available.");
+    return -1;
+  }
+  memcpy(digest, c->digest, c->size);
+  *size = c->size;
+  return 0;
+}
+
+/**
+ * This discards the persistent metadata cache of a device opened with
+ * <code>LIBMTP_OPEN_PERSISTENT_CACHE</code> and reads in the metadata
+ * of all objects from the device again. Use this when the device may
+ * have been changed elsewhere in a way the cheap checks done on open
+ * cannot tell.
+ * @param device a pointer to the device to invalidate the cache for.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Open_Raw_Device_Flags()
+ */
+int LIBMTP_Invalidate_Persistent_Cache(LIBMTP_mtpdevice_t *device)
+{
+  if (metadata_cache_remove(device) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Invalidate_Persistent_Cache(): "
+			    "could not remove the metadata cache file.");
+    return -1;
+  }
+  flush_handles(device);
+  return 0;
+}
+
+/**
+ * This starts collecting per operation statistics on a device, or
+ * clears the ones collected so far. Devices opened with
+ * <code>LIBMTP_OPEN_COLLECT_STATS</code> collect them from the start.
+ * For every operation code the number of transactions, errors,
+ * retries and cancels, the bytes moved, the time from the request to
+ * the first byte back and the time spent in the data phase are
+ * kept, the latter two also as histograms. When not collecting the
+ * cost is a pointer check per transaction.
+ * @param device a pointer to the device to collect statistics for.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_Stats()
+ */
+int LIBMTP_Reset_Stats(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+
+  ret = ptp_init_stats(params);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Reset_Stats(): "
+				"could not set up statistics.");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * This gets a snapshot of the statistics collected on a device since
+ * LIBMTP_Reset_Stats() or the device was opened with
+ * <code>LIBMTP_OPEN_COLLECT_STATS</code>, one entry for every
+ * operation code used.
+ * @param device a pointer to the device to get statistics for.
+ * @param stats a pointer to a variable that will hold a newly
+ *        allocated array of statistics, which the caller must free
+ *        after use.
+ * @param count a pointer to a variable that will hold the number of
+ *        entries in the array.
+ * @return 0 on success, any other value means failure, for example
+ *         that statistics are not being collected.
+ */
+int LIBMTP_Get_Stats(LIBMTP_mtpdevice_t *device,
+		     LIBMTP_op_stats_t ** const stats,
+		     uint32_t * const count)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPOpStats *ops;
+  unsigned int nrofops;
+  unsigned int i;
+  uint16_t ret;
+
+  *stats = NULL;
+  *count = 0;
+  ret = ptp_get_stats(params, &ops, &nrofops);
+  if (ret == PTP_ERROR_BADPARAM) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Stats(): "
+			    "statistics are not being collected.");
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Stats(): "
+				"could not get statistics.");
+    return -1;
+  }
+  if (nrofops == 0)
+    return 0;
+
+  *stats = calloc(nrofops, sizeof(LIBMTP_op_stats_t));
+  if (*stats == NULL) {
+    free(ops);
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION, "LIBMTP_Get_Stats(): "
+			    "could not allocate statistics.");
+    return -1;
+  }
+  for (i = 0; i < nrofops; i++) {
+    LIBMTP_op_stats_t *st = &(*stats)[i];
+    unsigned int j;
+
+    st->opcode = ops[i].opcode;
+    st->count = ops[i].count;
+    st->errors = ops[i].errors;
+    st->retries = ops[i].retries;
+    st->cancels = ops[i].cancels;
+    st->bytes_in = ops[i].bytes_in;
+    st->bytes_out = ops[i].bytes_out;
+    st->first_byte_usecs = ops[i].first_byte_usecs;
+    st->data_usecs = ops[i].data_usecs;
+    st->total_usecs = ops[i].total_usecs;
+    for (j = 0; j < LIBMTP_STATS_BUCKETS && j < PTP_STATS_BUCKETS; j++) {
+      st->first_byte_histogram[j] = ops[i].first_byte_hist[j];
+      st->data_histogram[j] = ops[i].data_hist[j];
+    }
+  }
+  *count = nrofops;
+  free(ops);
+  return 0;
+}
+
+/**
+ * This sets the bounds of the caches of a device opened with
+ * <code>LIBMTP_OPEN_BOUNDED_CACHE</code>. Both are counts rather than
+ * sizes in bytes: an object record costs about the same whatever the
+ * object, and the count is what the least recently used entry is
+ * dropped by. If the caches hold more already, the oldest entries are
+ * dropped right away.
+ * @param device a pointer to the device to set the bounds for.
+ * @param max_objects the most objects to keep the metadata of. Values
+ *        below 64 are raised to 64.
+ * @param max_folders the most folder listings to keep, 0 keeps none.
+ * @return 0 on success, any other value means failure, for example
+ *         that the device was not opened with a bounded cache.
+ */
+int LIBMTP_Set_Cache_Limits(LIBMTP_mtpdevice_t *device,
+			    uint32_t const max_objects,
+			    uint32_t const max_folders)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  mtp_listing_cache_t *cache = (mtp_listing_cache_t *) device->listings;
+
+  if (cache == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Set_Cache_Limits(): "
+			    "device was not opened with a bounded cache.");
+    return -1;
+  }
+  ptp_objects_set_limit(params, max_objects < BOUNDED_CACHE_MIN_OBJECTS ?
+			BOUNDED_CACHE_MIN_OBJECTS : max_objects);
+  cache->max = max_folders;
+  while (cache->nroflistings > cache->max)
+    listing_unlink(cache, cache->tail);
+  return 0;
+}
+
+/**
+ * This retrieves the manufacturer name of an MTP device.
+ * @param device a pointer to the device to get the manufacturer name for.
+ * @return a newly allocated UTF-8 string representing the manufacturer name.
+ *         The string must be freed by the caller after use. If the call
+ *         was unsuccessful this will contain NULL.
+ */
+char *LIBMTP_Get_Manufacturername(LIBMTP_mtpdevice_t *device)
+{
+  char *retmanuf = NULL;
+  PTPParams *params = (PTPParams *) device->params;
+
+  if (params->deviceinfo.Manufacturer != NULL) {
+    retmanuf = strdup(params->deviceinfo.Manufacturer);
+  }
+  return retmanuf;
+}
+
+/**
+ * This retrieves the model name (often equal to product name)
+ * of an MTP device.
+ * @param device a pointer to the device to get the model name for.
+ * @return a newly allocated UTF-8 string representing the model name.
+ *         The string must be freed by the caller after use. If the call
+ *         was unsuccessful this will contain NULL.
+ */
+char *LIBMTP_Get_Modelname(LIBMTP_mtpdevice_t *device)
+{
+  char *retmodel = NULL;
+  PTPParams *params = (PTPParams *) device->params;
+
+  if (params->deviceinfo.Model != NULL) {
+    retmodel = strdup(params->deviceinfo.Model);
+  }
+  return retmodel;
+}
+
+/**
+ * This retrieves the serial number of an MTP device.
+ * @param device a pointer to the device to get the serial number for.
+ * @return a newly allocated UTF-8 string representing the serial number.
+ *         The string must be freed by the caller after use. If the call
+ *         was unsuccessful this will contain NULL.
+ */
+char *LIBMTP_Get_Serialnumber(LIBMTP_mtpdevice_t *device)
+{
+  char *retnumber = NULL;
+  PTPParams *params = (PTPParams *) device->params;
+
+  if (params->deviceinfo.SerialNumber != NULL) {
+    retnumber = strdup(params->deviceinfo.SerialNumber);
+  }
+  return retnumber;
+}
+
+/**
+ * This retrieves the device version (hardware and firmware version) of an
+ * MTP device.
+ * @param device a pointer to the device to get the device version for.
+ * @return a newly allocated UTF-8 string representing the device version.
+ *         The string must be freed by the caller after use. If the call
+ *         was unsuccessful this will contain NULL.
+ */
+char *LIBMTP_Get_Deviceversion(LIBMTP_mtpdevice_t *device)
+{
+  char *retversion = NULL;
+  PTPParams *params = (PTPParams *) device->params;
+
+  if (params->deviceinfo.DeviceVersion != NULL) {
+    retversion = strdup(params->deviceinfo.DeviceVersion);
+  }
+  return retversion;
+}
+
+
+/**
+ * This sets for how long the value of a device property is kept after
+ * it was read, so that e.g. polling the battery level or the friendly
+ * name of a device does not take a round trip to the device every
+ * time. A <code>PTP_EC_DevicePropChanged</code> event from the device
+ * drops the kept value, as does setting the property through libmtp.
+ * @param device a pointer to the device to set the cache time for.
+ * @param property the PTP device property code, e.g. 0x5001 for the
+ *        battery level, or 0 to set the default of all properties.
+ * @param seconds the time to keep the property for. 0 means the
+ *        default for this property, a negative value means it is
+ *        read from the device every time.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Refresh_Device_Properties()
+ */
+int LIBMTP_Set_Device_Property_Cache_Time(LIBMTP_mtpdevice_t *device,
+					  uint16_t const property,
+					  int const seconds)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  if (ptp_set_deviceprop_cachetime(params, property, seconds) != PTP_RC_OK) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Set_Device_Property_Cache_Time(): "
+			    "could not allocate the cache entry.");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * This reads a number of device properties from the device in one go
+ * and keeps their values as if they had just been asked for, so that
+ * the calls reading them afterwards need not talk to the device. This
+ * is useful for bringing all properties of interest up to date while
+ * no transfer is running.
+ * @param device a pointer to the device to refresh the properties of.
+ * @param properties an array of PTP device property codes. Codes that
+ *        the device does not support are skipped.
+ * @param count the number of codes in <code>properties</code>.
+ * @return 0 on success, any other value means that one or more of the
+ *         properties could not be read.
+ * @see LIBMTP_Set_Device_Property_Cache_Time()
+ */
+int LIBMTP_Refresh_Device_Properties(LIBMTP_mtpdevice_t *device,
+				     uint16_t const * const properties,
+				     int const count)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  int retval = 0;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    uint16_t ret;
+
+    if (!ptp_property_issupported(params, properties[i]))
+      continue;
+    ret = ptp_refresh_deviceprop(params, properties[i]);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret,
+				  "LIBMTP_Refresh_Device_Properties(): "
+				  "could not get device property description.");
+      retval = -1;
+    }
+  }
+  return retval;
+}
+
+/**
+ * This retrieves the "friendly name" of an MTP device. Usually
+ * this is simply the name of the owner or something like
+ * "John Doe's Digital Audio Player". This property should be supported
+ * by all MTP devices.
+ * @param device a pointer to the device to get the friendly name for.
+ * @return a newly allocated UTF-8 string representing the friendly name.
+ *         The string must be freed by the caller after use.
+ * @see LIBMTP_Set_Friendlyname()
+ */
+char *LIBMTP_Get_Friendlyname(LIBMTP_mtpdevice_t *device)
+{
+  PTPPropertyValue propval;
+  char *retstring = NULL;
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+
+  if (!ptp_property_issupported(params, PTP_DPC_MTP_DeviceFriendlyName)) {
+    return NULL;
+  }
+
+  ret = ptp_getdevicepropvalue_cached(params,
+				      PTP_DPC_MTP_DeviceFriendlyName,
+				      &propval,
+				      PTP_DTC_STR);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "Error getting friendlyname.");
+    return NULL;
+  }
+  if (propval.str != NULL) {
+    retstring = strdup(propval.str);
+    free(propval.str);
+  }
+  return retstring;
+}
+
+/**
+ * Sets the "friendly name" of an MTP device.
+ * @param device a pointer to the device to set the friendly name for.
+ * @param friendlyname the new friendly name for the device.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_Friendlyname()
+ */
+int LIBMTP_Set_Friendlyname(LIBMTP_mtpdevice_t *device,
+			 char const * const friendlyname)
 {
   PTPPropertyValue propval;
   PTPParams *params = (PTPParams *) device->params;
@@ -3803,6 +5313,7 @@ int LIBMTP_Set_Friendlyname(LIBMTP_mtpdevice_t *device,
 			       PTP_DPC_MTP_DeviceFriendlyName,
 			       &propval,
 			       PTP_DTC_STR);
+  ptp_invalidate_deviceprop(params, PTP_DPC_MTP_DeviceFriendlyName);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "Error setting friendlyname.");
     return -1;
@@ -3829,10 +5340,10 @@ char *LIBMTP_Get_Syncpartner(LIBMTP_mtpdevice_t *device)
     return NULL;
   }
 
-  ret = ptp_getdevicepropvalue(params,
-			       PTP_DPC_MTP_SynchronizationPartner,
-			       &propval,
-			       PTP_DTC_STR);
+  ret = ptp_getdevicepropvalue_cached(params,
+				      PTP_DPC_MTP_SynchronizationPartner,
+				      &propval,
+				      PTP_DTC_STR);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "Error getting syncpartner.");
     return NULL;
@@ -3871,6 +5382,7 @@ int LIBMTP_Set_Syncpartner(LIBMTP_mtpdevice_t *device,
 			       PTP_DPC_MTP_SynchronizationPartner,
 			       &propval,
 			       PTP_DTC_STR);
+  ptp_invalidate_deviceprop(params, PTP_DPC_MTP_SynchronizationPartner);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "Error setting syncpartner.");
     return -1;
@@ -3898,7 +5410,7 @@ static int check_if_file_fits(LIBMTP_mtpdevice_t *device,
     return 0;
   }
 
-  ret = get_storage_freespace(device, storage, &freebytes);
+  ret = get_storage_freespace(device, storage, filesize, &freebytes);
   if (ret != 0) {
     add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
 			    "check_if_file_fits(): error checking free storage.");
@@ -3942,8 +5454,8 @@ int LIBMTP_Get_Batterylevel(LIBMTP_mtpdevice_t *device,
     return -1;
   }
 
-  ret = ptp_getdevicepropvalue(params, PTP_DPC_BatteryLevel,
-			       &propval, PTP_DTC_UINT8);
+  ret = ptp_getdevicepropvalue_cached(params, PTP_DPC_BatteryLevel,
+				      &propval, PTP_DTC_UINT8);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret,
 				"LIBMTP_Get_Batterylevel(): "
@@ -3951,6 +5463,8 @@ int LIBMTP_Get_Batterylevel(LIBMTP_mtpdevice_t *device,
     return -1;
   }
 
+  if (device->lazy_pending & LAZY_BATTERY_LEVEL)
+    probe_battery_level(device);
   *maximum_level = device->maximum_battery_level;
   *current_level = propval.u8;
 
@@ -4012,10 +5526,10 @@ static int get_device_unicode_property(LIBMTP_mtpdevice_t *device,
   }
 
   // Unicode strings are 16bit unsigned integer arrays.
-  ret = ptp_getdevicepropvalue(params,
-			       property,
-			       &propval,
-			       PTP_DTC_AUINT16);
+  ret = ptp_getdevicepropvalue_cached(params,
+				      property,
+				      &propval,
+				      PTP_DTC_AUINT16);
   if (ret != PTP_RC_OK) {
     // TODO: add a note on WHICH property that we failed to get.
     *unicstring = NULL;
@@ -4211,7 +5725,9 @@ int LIBMTP_Get_Storage(LIBMTP_mtpdevice_t *device, int const sortby)
   PTPStorageIDs storageIDs;
   LIBMTP_devicestorage_t *storage = NULL;
   LIBMTP_devicestorage_t *storageprev = NULL;
+  uint64_t start = usecs_now();
 
+  device->lazy_pending &= ~LAZY_STORAGE;
   if (device->storage != NULL)
     free_storage_list(device);
 
@@ -4247,6 +5763,7 @@ int LIBMTP_Get_Storage(LIBMTP_mtpdevice_t *device, int const sortby)
       storageprev = storage;
     }
     free(storageIDs.Storage);
+    device->timings.storage_usecs = usecs_now() - start;
     return 1;
   } else {
     for (i = 0; i < storageIDs.n; i++) {
@@ -4288,6 +5805,8 @@ int LIBMTP_Get_Storage(LIBMTP_mtpdevice_t *device, int const sortby)
 
     sort_storage_by(device,sortby);
     free(storageIDs.Storage);
+    device->storage_refreshed = time(NULL);
+    device->timings.storage_usecs = usecs_now() - start;
     return 0;
   }
 }
@@ -4345,28 +5864,17 @@ void LIBMTP_destroy_file_t(LIBMTP_file_t *file)
 }
 
 /**
- * Helper function that takes one PTP object and creates a
- * LIBMTP_file_t metadata entry.
+ * Helper function that works out the libmtp filetype of one PTP
+ * object, including the quirks for devices that mistype their files.
  */
-static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob)
+static LIBMTP_filetype_t object_filetype(LIBMTP_mtpdevice_t *device,
+					 PTPObject *ob)
 {
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  LIBMTP_file_t *file;
-  unsigned int i;
-
-  // Allocate a new file type
-  file = LIBMTP_new_file_t();
+  LIBMTP_filetype_t filetype;
 
-  file->parent_id = ob->oi.ParentObject;
-  file->storage_id = ob->oi.StorageID;
-
-  if (ob->oi.Filename != NULL) {
-    file->filename = strdup(ob->oi.Filename);
-  }
-
-  // Set the filetype
-  file->filetype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
+  filetype = map_ptp_type_to_libmtp_type(PTP_OB_FORMAT(params, ob));
 
   /*
    * A special quirk for devices that doesn't quite
@@ -4376,68 +5884,106 @@ static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob)
    * and fall back on this heuristic approach in that case,
    * for these bugged devices only.
    */
-  if (file->filetype == LIBMTP_FILETYPE_UNKNOWN) {
+  if (filetype == LIBMTP_FILETYPE_UNKNOWN && PTP_OB_NAME(params, ob) != NULL) {
     if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
         FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
-        has_ogg_extension(file->filename)) {
-      file->filetype = LIBMTP_FILETYPE_OGG;
+        has_ogg_extension(PTP_OB_NAME(params, ob))) {
+      filetype = LIBMTP_FILETYPE_OGG;
     }
 
-    if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && has_flac_extension(file->filename)) {
-        file->filetype = LIBMTP_FILETYPE_FLAC;
+    if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && has_flac_extension(PTP_OB_NAME(params, ob))) {
+        filetype = LIBMTP_FILETYPE_FLAC;
     }
   }
+  return filetype;
+}
 
-  // Set the modification date
-  file->modificationdate = ob->oi.ModificationDate;
-
-  // We only have 32-bit file size here; later we use the PTP_OPC_ObjectSize property
-  file->filesize = ob->oi.ObjectCompressedSize;
-
-  // This is a unique ID so we can keep track of the file.
-  file->item_id = ob->oid;
+/**
+ * Helper function that returns the size of one PTP object as far as
+ * the cache knows it, without any USB traffic.
+ */
+static uint64_t object_cached_filesize(LIBMTP_mtpdevice_t *device,
+				       PTPObject *ob)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  MTPProperties *prop = ob->mtpprops;
+  unsigned int i;
 
   /*
    * If we have a cached, large set of metadata, then use it!
    */
-  if (ob->mtpprops) {
-    MTPProperties *prop = ob->mtpprops;
-
-    for (i=0; i < ob->nrofmtpprops; i++, prop++) {
-      // Pick ObjectSize here...
-      if (prop->property == PTP_OPC_ObjectSize) {
-	// This may already be set, but this 64bit precision value
-	// is better than the PTP 32bit value, so let it override.
-	if (device->object_bitsize == 64) {
-	  file->filesize = prop->propval.u64;
-	} else {
-	  file->filesize = prop->propval.u32;
-	}
-	break;
+  for (i = 0; prop != NULL && i < ob->nrofmtpprops; i++, prop++) {
+    // Pick ObjectSize here...
+    if (prop->property == PTP_OPC_ObjectSize) {
+      // This 64bit precision value is better than the PTP 32bit value,
+      // so let it override.
+      if (device_object_bitsize(device) == 64) {
+	return prop->propval.u64;
+      } else {
+	return prop->propval.u32;
       }
     }
-  } else if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjectPropsSupported)) {
-    uint16_t *props = NULL;
-    uint32_t propcnt = 0;
-    int ret;
+  }
+  // We only have 32-bit file size here
+  return PTP_OB_SIZE(params, ob);
+}
 
-    // First see which properties can be retrieved for this object format
-    ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(file->filetype), &propcnt, &props);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "obj2file: call to ptp_mtp_getobjectpropssupported() failed.");
-      // Silently fall through.
-    } else {
-      for (i = 0; i < propcnt; i++) {
-	switch (props[i]) {
-	case PTP_OPC_ObjectSize:
-	  if (device->object_bitsize == 64) {
-	    file->filesize = get_u64_from_object(device, file->item_id, PTP_OPC_ObjectSize, 0);
-	  } else {
-	    file->filesize = get_u32_from_object(device, file->item_id, PTP_OPC_ObjectSize, 0);
-	  }
-	  break;
-	default:
-	  break;
+/**
+ * Helper function that takes one PTP object and creates a
+ * LIBMTP_file_t metadata entry.
+ */
+static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_file_t *file;
+  unsigned int i;
+
+  // Allocate a new file type
+  file = LIBMTP_new_file_t();
+
+  file->parent_id = PTP_OB_PARENT(params, ob);
+  file->storage_id = PTP_OB_STORAGE(params, ob);
+
+  if (PTP_OB_NAME(params, ob) != NULL) {
+    file->filename = strdup(PTP_OB_NAME(params, ob));
+  }
+
+  // Set the filetype
+  file->filetype = object_filetype(device, ob);
+
+  // Set the modification date
+  file->modificationdate = ob->ModificationDate;
+
+  // Prefer the 64-bit PTP_OPC_ObjectSize property if it is cached
+  file->filesize = object_cached_filesize(device, ob);
+
+  // This is a unique ID so we can keep track of the file.
+  file->item_id = ob->oid;
+
+  // Without a cached property list, ask the device for the 64-bit size
+  if (ob->mtpprops == NULL &&
+      ptp_operation_issupported(params,PTP_OC_MTP_GetObjectPropsSupported)) {
+    uint16_t *props = NULL;
+    uint32_t propcnt = 0;
+    int ret;
+
+    // First see which properties can be retrieved for this object format
+    ret = ptp_mtp_getobjectpropssupported_cached(params, map_libmtp_type_to_ptp_type(file->filetype), &propcnt, &props);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "obj2file: call to ptp_mtp_getobjectpropssupported() failed.");
+      // Silently fall through.
+    } else {
+      for (i = 0; i < propcnt; i++) {
+	switch (props[i]) {
+	case PTP_OPC_ObjectSize:
+	  if (device_object_bitsize(device) == 64) {
+	    file->filesize = get_u64_from_object(device, file->item_id, PTP_OPC_ObjectSize, 0);
+	  } else {
+	    file->filesize = get_u32_from_object(device, file->item_id, PTP_OPC_ObjectSize, 0);
+	  }
+	  break;
+	default:
+	  break;
 	}
       }
       free(props);
@@ -4559,15 +6105,14 @@ LIBMTP_file_t *LIBMTP_Get_Filelisting_With_Callback(LIBMTP_mtpdevice_t *device,
     if (callback != NULL)
       callback(i, params->nrofobjects, data);
 
-    ob = &params->objects[i];
-
-    if (ob->oi.ObjectFormat == PTP_OFC_Association) {
+    if (params->obcols.format[i] == PTP_OFC_Association) {
       // MTP use this object format for folders which means
       // these "files" will turn up on a folder listing instead.
       continue;
     }
 
     // Look up metadata
+    ob = params->objects[i];
     file = obj2file(device, ob);
     if (file == NULL) {
       continue;
@@ -4589,14 +6134,299 @@ LIBMTP_file_t *LIBMTP_Get_Filelisting_With_Callback(LIBMTP_mtpdevice_t *device,
   return retfiles;
 }
 
+/**
+ * The state of a file listing cursor, filled in by
+ * <code>LIBMTP_Open_File_Iterator()</code>. The cursor only remembers
+ * the handle of the last object it visited, and looks it up again on
+ * each step, so no pointers into the cache are held between calls.
+ */
+struct LIBMTP_file_iter_struct {
+  LIBMTP_mtpdevice_t *device; /**< The device whose cache is walked */
+  uint32_t storage; /**< Storage filter, 0 for all storages */
+  uint32_t parent; /**< Parent filter or LIBMTP_FILE_ITER_ANY_PARENT */
+  LIBMTP_filetype_t *filetypes; /**< Filetype filter, NULL for all types */
+  int nroftypes; /**< Number of entries in filetypes */
+  uint32_t last; /**< Handle of the object last returned */
+  int started; /**< Set once last is valid */
+  int done; /**< Set at the end of the listing */
+  LIBMTP_file_view_t view; /**< Backing store for LIBMTP_Next_File_View() */
+};
+
+/**
+ * Helper function that steps a file iterator to the next object
+ * matching its filters, or returns NULL at the end of the listing.
+ */
+static PTPObject *file_iter_next(LIBMTP_file_iter_t *iter)
+{
+  PTPParams *params = (PTPParams *) iter->device->params;
+  PTPObject *ob = NULL;
+
+  if (iter->done) {
+    return NULL;
+  }
+  if (iter->started &&
+      ptp_object_find(params, iter->last, &ob) != PTP_RC_OK) {
+    // The cache changed under our feet, we cannot tell where to go on.
+    add_error_to_errorstack(iter->device, LIBMTP_ERROR_GENERAL,
+			    "file_iter_next(): object cache changed during iteration.");
+    iter->done = 1;
+    return NULL;
+  }
+
+  for (;;) {
+    int i;
+
+    // Walk the narrowest index we have a key for.
+    if (iter->parent != LIBMTP_FILE_ITER_ANY_PARENT) {
+      ob = ptp_objects_next_by_parent(params, iter->parent, ob);
+    } else if (iter->storage != 0) {
+      ob = ptp_objects_next_by_storage(params, iter->storage, ob);
+    } else {
+      unsigned int idx = (ob == NULL) ? 0 : ob->objindex + 1;
+
+      // Skip the folders on the format column alone
+      while (idx < params->nrofobjects &&
+	     params->obcols.format[idx] == PTP_OFC_Association)
+	idx++;
+      ob = (idx < params->nrofobjects) ? params->objects[idx] : NULL;
+    }
+    if (ob == NULL) {
+      iter->done = 1;
+      return NULL;
+    }
+    iter->last = ob->oid;
+    iter->started = 1;
+
+    // Folders turn up on the folder listing instead.
+    if (PTP_OB_FORMAT(params, ob) == PTP_OFC_Association) {
+      continue;
+    }
+    if (iter->storage != 0 && PTP_OB_STORAGE(params, ob) != iter->storage) {
+      continue;
+    }
+    if (iter->filetypes == NULL) {
+      return ob;
+    }
+    for (i = 0; i < iter->nroftypes; i++) {
+      if (iter->filetypes[i] == object_filetype(iter->device, ob)) {
+	return ob;
+      }
+    }
+  }
+}
+
+/**
+ * Helper function that fills in a file view from a cached object.
+ */
+static void obj2view(LIBMTP_mtpdevice_t *device, PTPObject *ob,
+		     LIBMTP_file_view_t *view)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  view->item_id = ob->oid;
+  view->parent_id = PTP_OB_PARENT(params, ob);
+  view->storage_id = PTP_OB_STORAGE(params, ob);
+  view->filename = PTP_OB_NAME(params, ob);
+  view->filesize = object_cached_filesize(device, ob);
+  view->modificationdate = ob->ModificationDate;
+  view->filetype = object_filetype(device, ob);
+}
+
+/**
+ * Hand an object that was just read into the cache to the load view
+ * callback of the device, if there is one.
+ * @return nonzero if the callback wants the load to stop.
+ */
+static int emit_loaded_object(LIBMTP_mtpdevice_t *device, PTPObject *ob)
+{
+  LIBMTP_file_view_t view;
+
+  if (device->load_view_callback == NULL)
+    return 0;
+  obj2view(device, ob, &view);
+  return device->load_view_callback(&view, device->load_view_data);
+}
+
+/**
+ * This opens a cursor over the files in the metadata cache of a
+ * device. Unlike <code>LIBMTP_Get_Filelisting_With_Callback()</code>
+ * this does not build a list of freshly allocated
+ * <code>LIBMTP_file_t</code> entries: files are handed out one at a
+ * time or one page at a time as read-only views into the cache, and
+ * only the filters given here are applied. Typical usage:
+ *
+ * <pre>
+ * LIBMTP_file_iter_t *iter;
+ * LIBMTP_file_view_t page[64];
+ * int n;
+ *
+ * iter = LIBMTP_Open_File_Iterator(device, 0, LIBMTP_FILE_ITER_ANY_PARENT,
+ *                                  NULL, 0);
+ * while ((n = LIBMTP_Next_File_Views(iter, page, 64)) > 0) {
+ *   // Do something on each of the n views here...
+ * }
+ * LIBMTP_Close_File_Iterator(iter);
+ * </pre>
+ *
+ * The views, and the strings they point to, stay valid until the
+ * metadata cache is next modified, e.g. by sending, deleting or
+ * renaming a file, or by handling a device event. Copy what you need
+ * to keep, or use <code>LIBMTP_Get_Filemetadata()</code> to get a
+ * full copy of a certain file. If the cache changes so that the
+ * cursor loses its place, the listing ends early and an error is
+ * put on the error stack.
+ *
+ * Like the other listing functions, folders are not returned. The
+ * device must have been opened with a metadata cache, i.e. not with
+ * <code>LIBMTP_Open_Raw_Device_Uncached()</code>.
+ *
+ * @param device a pointer to the device to list files on.
+ * @param storage only list files on this storage, or 0 to list files
+ *        on all storages.
+ * @param parent only list files directly in this folder, use
+ *        <code>LIBMTP_FILES_AND_FOLDERS_ROOT</code> for the root folder
+ *        or <code>LIBMTP_FILE_ITER_ANY_PARENT</code> to list files in
+ *        all folders.
+ * @param filetypes an array of filetypes to list, or NULL to list files
+ *        of any type. The array is copied.
+ * @param nroftypes the number of entries in <code>filetypes</code>.
+ * @return a new iterator, to be freed with
+ *         <code>LIBMTP_Close_File_Iterator()</code>, or NULL on failure.
+ * @see LIBMTP_Next_File_View()
+ * @see LIBMTP_Next_File_Views()
+ */
+LIBMTP_file_iter_t *LIBMTP_Open_File_Iterator(LIBMTP_mtpdevice_t *device,
+					      uint32_t const storage,
+					      uint32_t const parent,
+					      LIBMTP_filetype_t const * const filetypes,
+					      int const nroftypes)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_file_iter_t *iter;
+
+  if (!device->cached) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Open_File_Iterator(): device has no metadata cache.");
+    return NULL;
+  }
+
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0) {
+    flush_handles(device);
+  }
+
+  iter = (LIBMTP_file_iter_t *) calloc(1, sizeof(LIBMTP_file_iter_t));
+  if (iter == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Open_File_Iterator(): out of memory.");
+    return NULL;
+  }
+  iter->device = device;
+  iter->storage = storage;
+  // The root folder is parent 0 in the cache
+  if (parent == LIBMTP_FILES_AND_FOLDERS_ROOT) {
+    iter->parent = 0;
+  } else {
+    iter->parent = parent;
+  }
+  if (filetypes != NULL && nroftypes > 0) {
+    iter->filetypes = (LIBMTP_filetype_t *)
+      malloc(nroftypes * sizeof(LIBMTP_filetype_t));
+    if (iter->filetypes == NULL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			      "LIBMTP_Open_File_Iterator(): out of memory.");
+      free(iter);
+      return NULL;
+    }
+    memcpy(iter->filetypes, filetypes, nroftypes * sizeof(LIBMTP_filetype_t));
+    iter->nroftypes = nroftypes;
+  }
+  return iter;
+}
+
+/**
+ * This steps a file iterator one file forward.
+ *
+ * @param iter the iterator to step.
+ * @return a view of the next file, or NULL at the end of the listing.
+ *         The view belongs to the iterator and is overwritten by the
+ *         next call; the strings it points to are borrowed from the
+ *         metadata cache, see <code>LIBMTP_Open_File_Iterator()</code>.
+ * @see LIBMTP_Next_File_Views()
+ */
+LIBMTP_file_view_t const *LIBMTP_Next_File_View(LIBMTP_file_iter_t *iter)
+{
+  PTPObject *ob;
+
+  if (iter == NULL) {
+    return NULL;
+  }
+  ob = file_iter_next(iter);
+  if (ob == NULL) {
+    return NULL;
+  }
+  obj2view(iter->device, ob, &iter->view);
+  return &iter->view;
+}
+
+/**
+ * This fills a caller-owned page of file views from a file iterator.
+ *
+ * @param iter the iterator to read from.
+ * @param views an array of at least <code>maxviews</code> views to fill.
+ *        The strings in the views are borrowed from the metadata
+ *        cache, see <code>LIBMTP_Open_File_Iterator()</code>.
+ * @param maxviews the size of the <code>views</code> array.
+ * @return the number of views filled in, 0 at the end of the listing
+ *         or -1 on failure.
+ * @see LIBMTP_Next_File_View()
+ */
+int LIBMTP_Next_File_Views(LIBMTP_file_iter_t *iter,
+			   LIBMTP_file_view_t *views,
+			   int const maxviews)
+{
+  int n = 0;
+
+  if (iter == NULL || views == NULL || maxviews < 0) {
+    return -1;
+  }
+  while (n < maxviews) {
+    PTPObject *ob = file_iter_next(iter);
+
+    if (ob == NULL) {
+      break;
+    }
+    obj2view(iter->device, ob, &views[n]);
+    n++;
+  }
+  return n;
+}
+
+/**
+ * This frees a file iterator. The view last returned by
+ * <code>LIBMTP_Next_File_View()</code> goes with it.
+ *
+ * @param iter the iterator to free.
+ */
+void LIBMTP_Close_File_Iterator(LIBMTP_file_iter_t *iter)
+{
+  if (iter == NULL) {
+    return;
+  }
+  free(iter->filetypes);
+  free(iter);
+}
+
 /**
  * This function retrieves the contents of a certain folder
  * with id parent on a certain storage on a certain device.
  * The result contains both files and folders.
  * The device used with this operations must have been opened with
- * LIBMTP_Open_Raw_Device_Uncached() or it will fail.
+ * LIBMTP_Open_Raw_Device_Uncached() or with
+ * <code>LIBMTP_OPEN_BOUNDED_CACHE</code> or it will fail.
  *
- * NOTE: the request will always perform I/O with the device.
+ * NOTE: the request will always perform I/O with the device, unless
+ * it was opened with a bounded cache and still holds the folder.
  * @param device a pointer to the MTP device to report info from.
  * @param storage a storage on the device to report info from. If
  *        0 is passed in, the files for the given parent will be
@@ -4614,6 +6444,7 @@ LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device,
   uint32_t storageid;
   uint16_t ret;
   unsigned int i = 0;
+  int n;
 
   if (device->cached) {
     // This function is only supposed to be used by devices
@@ -4628,22 +6459,47 @@ LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device,
   else
     storageid = storage;
 
-  ret = ptp_getobjecthandles(params,
-			     storageid,
-			     PTP_GOH_ALL_FORMATS,
-			     parent,
-			     &currentHandles);
+  n = listing_get(device, storageid, parent, &currentHandles.Handler);
+  if (n >= 0) {
+    currentHandles.n = n;
+  } else {
+    ret = ptp_getobjecthandles(params,
+			       storageid,
+			       PTP_GOH_ALL_FORMATS,
+			       parent,
+			       &currentHandles);
 
-  if (ret != PTP_RC_OK) {
-    char buf[80];
-    sprintf(buf,"LIBMTP_Get_Files_And_Folders(): could not get object handles of %08x.", parent);
-    add_ptp_error_to_errorstack(device, ret, buf);
-    return NULL;
+    if (ret != PTP_RC_OK) {
+      char buf[80];
+      sprintf(buf,"LIBMTP_Get_Files_And_Folders(): could not get object handles of %08x.", parent);
+      add_ptp_error_to_errorstack(device, ret, buf);
+      return NULL;
+    }
+    listing_store(device, storageid, parent, currentHandles.Handler,
+		  currentHandles.n);
   }
 
   if (currentHandles.Handler == NULL || currentHandles.n == 0)
     return NULL;
 
+  /*
+   * Fetch the metadata of the whole folder in one go if we can, then
+   * LIBMTP_Get_Filemetadata() only asks the device about objects that
+   * were missing from the property list. The root folder is no object
+   * of its own, so that has to go the slow way. With a bounded cache
+   * this is only needed if some children were dropped.
+   */
+  if (parent != LIBMTP_FILES_AND_FOLDERS_ROOT && parent != 0) {
+    PTPObject *ob;
+
+    for (i = 0; device->listings != NULL && i < currentHandles.n; i++) {
+      if (ptp_object_find(params, currentHandles.Handler[i], &ob) != PTP_RC_OK)
+	break;
+    }
+    if (i < currentHandles.n)
+      (void) get_folder_metadata_fast(device, parent);
+  }
+
   for (i = 0; i < currentHandles.n; i++) {
     LIBMTP_file_t *file;
 
@@ -4674,9 +6530,11 @@ LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device,
  * This function retrieves the list of ids of files and folders in a certain
  * folder with id parent on a certain storage on a certain device.
  * The device used with this operations must have been opened with
- * LIBMTP_Open_Raw_Device_Uncached() or it will fail.
+ * LIBMTP_Open_Raw_Device_Uncached() or with
+ * <code>LIBMTP_OPEN_BOUNDED_CACHE</code> or it will fail.
  *
- * NOTE: the request will always perform I/O with the device.
+ * NOTE: the request will always perform I/O with the device, unless
+ * it was opened with a bounded cache and still holds the folder.
  * @param device a pointer to the MTP device to report info from.
  * @param storage a storage on the device to report info from. If
  *        0 is passed in, the files for the given parent will be
@@ -4699,6 +6557,7 @@ int LIBMTP_Get_Children(LIBMTP_mtpdevice_t *device,
   PTPObjectHandles currentHandles;
   uint32_t storageid;
   uint16_t ret;
+  int n;
 
   if (device->cached) {
     // This function is only supposed to be used by devices
@@ -4712,6 +6571,13 @@ int LIBMTP_Get_Children(LIBMTP_mtpdevice_t *device,
   else
     storageid = storage;
 
+  n = listing_get(device, storageid, parent, &currentHandles.Handler);
+  if (n >= 0) {
+    if (n > 0)
+      *out = currentHandles.Handler;
+    return n;
+  }
+
   ret = ptp_getobjecthandles(params,
                              storageid,
                              PTP_GOH_ALL_FORMATS,
@@ -4723,6 +6589,8 @@ int LIBMTP_Get_Children(LIBMTP_mtpdevice_t *device,
         "LIBMTP_Get_Children(): could not get object handles.");
     return -1;
   }
+  listing_store(device, storageid, parent, currentHandles.Handler,
+                currentHandles.n);
 
   if (currentHandles.Handler == NULL || currentHandles.n == 0)
     return 0;
@@ -4880,7 +6748,7 @@ static void pick_property_to_track_metadata(LIBMTP_mtpdevice_t *device, MTPPrope
     track->usecount = prop->propval.u32;
     break;
   case PTP_OPC_ObjectSize:
-    if (device->object_bitsize == 64) {
+    if (device_object_bitsize(device) == 64) {
       track->filesize = prop->propval.u64;
     } else {
       track->filesize = prop->propval.u32;
@@ -4891,6 +6759,102 @@ static void pick_property_to_track_metadata(LIBMTP_mtpdevice_t *device, MTPPrope
   }
 }
 
+/**
+ * This fetches the properties of one object with one property list
+ * request per property group. Devices that refuse to hand out all
+ * properties of an object in one go usually accept this, and a track
+ * typically has all its metadata in one or two groups. The result is
+ * kept as the object's cached property list.
+ * @param device a pointer to the device.
+ * @param ob the object to get the properties for.
+ * @param ofc the object format of the object.
+ * @param props the properties supported for this object format.
+ * @param propcnt the number of entries in props.
+ * @return 0 if the property list of ob was filled in, -1 otherwise.
+ */
+static int get_object_props_by_group(LIBMTP_mtpdevice_t *device,
+				     PTPObject *ob, uint16_t ofc,
+				     uint16_t const *props, uint32_t propcnt)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint32_t groups[8];
+  unsigned int nrofgroups = 0;
+  MTPProperties *allprops = NULL;
+  int nrofallprops = 0;
+  unsigned int i, j;
+
+  if (!ptp_operation_issupported(params, PTP_OC_MTP_GetObjPropList) ||
+      FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb) ||
+      !ptp_operation_issupported(params, PTP_OC_MTP_GetObjectPropDesc)) {
+    return -1;
+  }
+
+  // Which groups do the properties we are interested in belong to?
+  for (i = 0; i < propcnt; i++) {
+    PTPObjectPropDesc opd;
+
+    if (ptp_mtp_getobjectpropdesc_cached(params, props[i], ofc, &opd) != PTP_RC_OK)
+      return -1;
+    // Group 0 means the property is not in any group
+    if (opd.GroupCode == 0)
+      return -1;
+    for (j = 0; j < nrofgroups; j++) {
+      if (groups[j] == opd.GroupCode)
+	break;
+    }
+    if (j == nrofgroups) {
+      // Too many groups to be worth it
+      if (nrofgroups == sizeof(groups)/sizeof(groups[0]))
+	return -1;
+      groups[nrofgroups++] = opd.GroupCode;
+    }
+  }
+  if (nrofgroups == 0)
+    return -1;
+
+  for (i = 0; i < nrofgroups; i++) {
+    MTPProperties *groupprops = NULL;
+    MTPProperties *newprops;
+    int nrofgroupprops = 0;
+    uint16_t ret;
+
+    ret = ptp_mtp_getobjectproplist_generic(params, ob->oid, 0x00000000U,
+					    0x00000000U, groups[i], 0,
+					    &groupprops, &nrofgroupprops);
+    if (ret != PTP_RC_OK) {
+      for (j = 0; j < (unsigned int) nrofallprops; j++)
+	ptp_destroy_object_prop(&allprops[j]);
+      free(allprops);
+      return -1;
+    }
+    if (nrofgroupprops == 0) {
+      free(groupprops);
+      continue;
+    }
+    newprops = realloc(allprops, (nrofallprops + nrofgroupprops) * sizeof(MTPProperties));
+    if (newprops == NULL) {
+      // A partial list must not pass for the whole one
+      for (j = 0; j < (unsigned int) nrofgroupprops; j++)
+	ptp_destroy_object_prop(&groupprops[j]);
+      free(groupprops);
+      for (j = 0; j < (unsigned int) nrofallprops; j++)
+	ptp_destroy_object_prop(&allprops[j]);
+      free(allprops);
+      return -1;
+    }
+    allprops = newprops;
+    memcpy(&allprops[nrofallprops], groupprops, nrofgroupprops * sizeof(MTPProperties));
+    nrofallprops += nrofgroupprops;
+    free(groupprops);
+  }
+
+  ob->mtpprops = allprops;
+  ob->nrofmtpprops = nrofallprops;
+  ob->flags |= PTPOBJECT_MTPPROPLIST_LOADED;
+  return 0;
+}
+
 /**
  * This function retrieves the track metadata for a track
  * given by a unique ID.
@@ -4912,6 +6876,11 @@ static void get_track_metadata(LIBMTP_mtpdevice_t *device, uint16_t objectformat
    * If we have a cached, large set of metadata, then use it!
    */
   ret = ptp_object_want(params, track->item_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
+  // A failing property list still leaves us the object to work with
+  if (ob == NULL) {
+    add_ptp_error_to_errorstack(device, ret, "get_track_metadata(): could not get object.");
+    return;
+  }
   if (ob->mtpprops) {
     prop = ob->mtpprops;
     for (i=0;i<ob->nrofmtpprops;i++,prop++)
@@ -4919,14 +6888,22 @@ static void get_track_metadata(LIBMTP_mtpdevice_t *device, uint16_t objectformat
   } else {
     uint16_t *props = NULL;
     uint32_t propcnt = 0;
+    uint16_t ofc = map_libmtp_type_to_ptp_type(track->filetype);
 
     // First see which properties can be retrieved for this object format
-    ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(track->filetype), &propcnt, &props);
+    ret = ptp_mtp_getobjectpropssupported_cached(params, ofc, &propcnt, &props);
     if (ret != PTP_RC_OK) {
       add_ptp_error_to_errorstack(device, ret, "get_track_metadata(): call to ptp_mtp_getobjectpropssupported() failed.");
       // Just bail out for now, nothing is ever set.
       return;
+    } else if (get_object_props_by_group(device, ob, ofc, props, propcnt) == 0) {
+      // Got them all in a few requests, and cached for the next time
+      prop = ob->mtpprops;
+      for (i=0;i<ob->nrofmtpprops;i++,prop++)
+	pick_property_to_track_metadata(device, prop, track);
+      free(props);
     } else {
+      // One request per property it is then
       for (i=0;i<propcnt;i++) {
 	switch (props[i]) {
 	case PTP_OPC_Name:
@@ -4976,7 +6953,7 @@ static void get_track_metadata(LIBMTP_mtpdevice_t *device, uint16_t objectformat
 	  track->usecount = get_u32_from_object(device, track->item_id, PTP_OPC_UseCount, 0);
 	  break;
 	case PTP_OPC_ObjectSize:
-	  if (device->object_bitsize == 64) {
+	  if (device_object_bitsize(device) == 64) {
 	    track->filesize = get_u64_from_object(device, track->item_id, PTP_OPC_ObjectSize, 0);
 	  } else {
 	    track->filesize = (uint64_t) get_u32_from_object(device, track->item_id, PTP_OPC_ObjectSize, 0);
@@ -5115,8 +7092,7 @@ LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback_For_Storage(LIBMTP_mtpdevi
     if (callback != NULL)
       callback(i, params->nrofobjects, data);
 
-    ob = &params->objects[i];
-    mtptype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
+    mtptype = map_ptp_type_to_libmtp_type(params->obcols.format[i]);
 
     // Ignore stuff we don't know how to handle...
     // TODO: get this list as an intersection of the sets
@@ -5124,7 +7100,7 @@ LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback_For_Storage(LIBMTP_mtpdevi
     // all known track files?
     if (!LIBMTP_FILETYPE_IS_TRACK(mtptype) &&
 	// This row lets through undefined files for examination since they may be forgotten OGG files.
-	(ob->oi.ObjectFormat != PTP_OFC_Undefined ||
+	(params->obcols.format[i] != PTP_OFC_Undefined ||
 	 (!FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) &&
 	  !FLAG_OGG_IS_UNKNOWN(ptp_usb) &&
 	  !FLAG_FLAC_IS_UNKNOWN(ptp_usb)))
@@ -5134,27 +7110,29 @@ LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback_For_Storage(LIBMTP_mtpdevi
     }
 
 	// Ignore stuff that isn't into the storage device
-	if ((storage_id != 0) && (ob->oi.StorageID != storage_id ))
+	if ((storage_id != 0) && (params->obcols.storage[i] != storage_id ))
 		continue;
 
+    ob = params->objects[i];
+
     // Allocate a new track type
     track = LIBMTP_new_track_t();
 
     // This is some sort of unique ID so we can keep track of the track.
     track->item_id = ob->oid;
-    track->parent_id = ob->oi.ParentObject;
-    track->storage_id = ob->oi.StorageID;
-    track->modificationdate = ob->oi.ModificationDate;
+    track->parent_id = PTP_OB_PARENT(params, ob);
+    track->storage_id = PTP_OB_STORAGE(params, ob);
+    track->modificationdate = ob->ModificationDate;
 
     track->filetype = mtptype;
 
     // Original file-specific properties
-    track->filesize = ob->oi.ObjectCompressedSize;
-    if (ob->oi.Filename != NULL) {
-      track->filename = strdup(ob->oi.Filename);
+    track->filesize = PTP_OB_SIZE(params, ob);
+    if (PTP_OB_NAME(params, ob) != NULL) {
+      track->filename = strdup(PTP_OB_NAME(params, ob));
     }
 
-    get_track_metadata(device, ob->oi.ObjectFormat, track);
+    get_track_metadata(device, PTP_OB_FORMAT(params, ob), track);
 
     /*
      * A special quirk for iriver devices that doesn't quite
@@ -5227,7 +7205,7 @@ LIBMTP_track_t *LIBMTP_Get_Trackmetadata(LIBMTP_mtpdevice_t *device, uint32_t co
   if (ret != PTP_RC_OK)
     return NULL;
 
-  mtptype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
+  mtptype = map_ptp_type_to_libmtp_type(PTP_OB_FORMAT(params, ob));
 
   // Ignore stuff we don't know how to handle...
   if (!LIBMTP_FILETYPE_IS_TRACK(mtptype) &&
@@ -5235,7 +7213,7 @@ LIBMTP_track_t *LIBMTP_Get_Trackmetadata(LIBMTP_mtpdevice_t *device, uint32_t co
        * This row lets through undefined files for examination
        * since they may be forgotten OGG or FLAC files.
        */
-      (ob->oi.ObjectFormat != PTP_OFC_Undefined ||
+      (PTP_OB_FORMAT(params, ob) != PTP_OFC_Undefined ||
        (!FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) &&
 	!FLAG_OGG_IS_UNKNOWN(ptp_usb) &&
 	!FLAG_FLAC_IS_UNKNOWN(ptp_usb)))
@@ -5249,16 +7227,16 @@ LIBMTP_track_t *LIBMTP_Get_Trackmetadata(LIBMTP_mtpdevice_t *device, uint32_t co
 
   // This is some sort of unique ID so we can keep track of the track.
   track->item_id = ob->oid;
-  track->parent_id = ob->oi.ParentObject;
-  track->storage_id = ob->oi.StorageID;
-  track->modificationdate = ob->oi.ModificationDate;
+  track->parent_id = PTP_OB_PARENT(params, ob);
+  track->storage_id = PTP_OB_STORAGE(params, ob);
+  track->modificationdate = ob->ModificationDate;
 
   track->filetype = mtptype;
 
   // Original file-specific properties
-  track->filesize = ob->oi.ObjectCompressedSize;
-  if (ob->oi.Filename != NULL) {
-    track->filename = strdup(ob->oi.Filename);
+  track->filesize = PTP_OB_SIZE(params, ob);
+  if (PTP_OB_NAME(params, ob) != NULL) {
+    track->filename = strdup(PTP_OB_NAME(params, ob));
   }
 
   /*
@@ -5284,7 +7262,7 @@ LIBMTP_track_t *LIBMTP_Get_Trackmetadata(LIBMTP_mtpdevice_t *device, uint32_t co
       return NULL;
     }
   }
-  get_track_metadata(device, ob->oi.ObjectFormat, track);
+  get_track_metadata(device, PTP_OB_FORMAT(params, ob), track);
   return track;
 }
 
@@ -5446,7 +7424,9 @@ int LIBMTP_Get_File_To_File_Descriptor(LIBMTP_mtpdevice_t *device,
   // Don't need mtpfile anymore
   LIBMTP_destroy_file_t(mtpfile);
 
+  transfer_checksum_begin(device);
   ret = ptp_getobject_tofd(params, id, fd);
+  transfer_checksum_end(device, ret == PTP_RC_OK);
 
   ptp_usb->callback_active = 0;
   ptp_usb->current_transfer_callback = NULL;
@@ -5465,69 +7445,281 @@ int LIBMTP_Get_File_To_File_Descriptor(LIBMTP_mtpdevice_t *device,
 }
 
 /**
- * This gets a file off the device and calls put_func
- * with chunks of data
+ * Resumable transfers move the data in chunks of this size, each one
+ * a transaction of its own. Whatever was completed before a failure
+ * is kept, so the worst a broken transfer costs is one chunk.
+ */
+#define RESUMABLE_CHUNK_SIZE (4 * 1024 * 1024)
+
+/**
+ * This gets a file off the device to a file descriptor in a way
+ * that can be picked up again if it breaks. The data is read in
+ * chunks with GetPartialObject (the 64bit Android variant where
+ * available) and the number of bytes safely written to the
+ * descriptor is kept in <code>offset</code> as it goes.
+ *
+ * If the transfer fails or is cancelled, call this again with the
+ * same descriptor and offset and only the missing bytes are moved.
+ * Devices without GetPartialObject can only start at offset 0, and
+ * then get the file in one go like
+ * <code>LIBMTP_Get_File_To_File_Descriptor()</code>.
  *
  * @param device a pointer to the device to get the file from.
  * @param id the file ID of the file to retrieve.
- * @param put_func the function to call when we have data.
- * @param priv the user-defined pointer that is passed to
- *             <code>put_func</code>.
+ * @param fd a local file descriptor to write the file to. It has to
+ *        be positioned at <code>offset</code>.
+ * @param offset the number of bytes of the file already transferred,
+ *        0 for a new transfer. On return this holds the number of
+ *        bytes completed, also when the transfer failed.
  * @param callback a progress indicator function or NULL to ignore.
+ *        Returning non-zero from it cancels the transfer after the
+ *        current chunk.
  * @param data a user-defined pointer that is passed along to
  *             the <code>progress</code> function in order to
  *             pass along some user defined data to the progress
  *             updates. If not used, set this to NULL.
  * @return 0 if the transfer was successful, any other value means
  *           failure.
+ * @see LIBMTP_Get_File_To_File_Resumable()
  */
-int LIBMTP_Get_File_To_Handler(LIBMTP_mtpdevice_t *device,
-					uint32_t const id,
-					MTPDataPutFunc put_func,
-          void * priv,
-					LIBMTP_progressfunc_t const callback,
-					void const * const data)
+int LIBMTP_Get_File_To_File_Descriptor_Resumable(LIBMTP_mtpdevice_t *device,
+						 uint32_t const id,
+						 int const fd,
+						 uint64_t * const offset,
+						 LIBMTP_progressfunc_t const callback,
+						 void const * const data)
 {
-  uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_file_t *mtpfile;
+  uint64_t filesize;
+  uint16_t ret;
 
-  LIBMTP_file_t *mtpfile = LIBMTP_Get_Filemetadata(device, id);
+  // Chunks may come from several calls, this is not checksummed
+  transfer_checksum_end(device, 0);
+  if (offset == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor_Resumable(): Bad arguments, offset was NULL.");
+    return -1;
+  }
+
+  mtpfile = LIBMTP_Get_Filemetadata(device, id);
   if (mtpfile == NULL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Could not get object info.");
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor_Resumable(): Could not get object info.");
     return -1;
   }
   if (mtpfile->filetype == LIBMTP_FILETYPE_FOLDER) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Bad object format.");
-    LIBMTP_destroy_file_t (mtpfile);
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor_Resumable(): Bad object format.");
+    LIBMTP_destroy_file_t(mtpfile);
     return -1;
   }
-
-  // Callbacks
-  ptp_usb->callback_active = 1;
-  ptp_usb->current_transfer_total = mtpfile->filesize +
-    PTP_USB_BULK_HDR_LEN+sizeof(uint32_t); // Request length, one parameter
-  ptp_usb->current_transfer_complete = 0;
-  ptp_usb->current_transfer_callback = callback;
-  ptp_usb->current_transfer_callback_data = data;
-
-  // Don't need mtpfile anymore
+  filesize = mtpfile->filesize;
   LIBMTP_destroy_file_t(mtpfile);
 
-  MTPDataHandler mtp_handler;
-  mtp_handler.getfunc = NULL;
-  mtp_handler.putfunc = put_func;
-  mtp_handler.priv = priv;
+  if (*offset > filesize) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor_Resumable(): "
+			    "Offset is beyond the end of the file, has it changed on the device?");
+    return -1;
+  }
 
-  PTPDataHandler handler;
-  handler.getfunc = NULL;
-  handler.putfunc = put_func_wrapper;
-  handler.priv = &mtp_handler;
+  // Without partial reads all we can do is get the whole file.
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64) &&
+      !ptp_operation_issupported(params, PTP_OC_GetPartialObject)) {
+    if (*offset != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor_Resumable(): "
+			      "Device cannot resume transfers.");
+      return -1;
+    }
+    if (LIBMTP_Get_File_To_File_Descriptor(device, id, fd, callback, data) != 0) {
+      return -1;
+    }
+    *offset = filesize;
+    return 0;
+  }
 
-  ret = ptp_getobject_to_handler(params, id, &handler);
+  while (*offset < filesize) {
+    unsigned char *chunk = NULL;
+    unsigned int chunklen = 0;
+    unsigned int written = 0;
+    uint32_t maxbytes = RESUMABLE_CHUNK_SIZE;
 
-  ptp_usb->callback_active = 0;
-  ptp_usb->current_transfer_callback = NULL;
+    if (filesize - *offset < maxbytes) {
+      maxbytes = filesize - *offset;
+    }
+    ret = get_partial_object(device, id, filesize, *offset, maxbytes,
+			     &chunk, &chunklen);
+    if (ret != PTP_RC_OK) {
+      free(chunk);
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_File_To_File_Descriptor_Resumable(): "
+				  "Could not get file from device.");
+      return -1;
+    }
+    // A device that stops giving us data would have us loop forever.
+    if (chunklen == 0) {
+      free(chunk);
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor_Resumable(): "
+			      "Device returned no data.");
+      return -1;
+    }
+    while (written < chunklen) {
+      ssize_t n = write(fd, chunk + written, chunklen - written);
+
+      if (n < 0 && errno == EINTR) {
+	continue;
+      }
+      if (n <= 0) {
+	free(chunk);
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor_Resumable(): "
+				"Could not write to file.");
+	return -1;
+      }
+      written += n;
+    }
+    free(chunk);
+    *offset += chunklen;
+
+    if (callback != NULL && callback(*offset, filesize, data) != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Get_File_To_File_Descriptor_Resumable(): Cancelled transfer.");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * This gets a file off the device to a local file in a way that can
+ * be picked up again if it breaks. Whatever is already in the local
+ * file is taken as the start of the object, so calling this again
+ * after a failure or cancellation only gets the missing part. Unlike
+ * <code>LIBMTP_Get_File_To_File()</code> a partial file is left in
+ * place when the transfer fails.
+ *
+ * @param device a pointer to the device to get the file from.
+ * @param id the file ID of the file to retrieve.
+ * @param path a filename to use for the retrieved file.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Get_File_To_File_Descriptor_Resumable()
+ */
+int LIBMTP_Get_File_To_File_Resumable(LIBMTP_mtpdevice_t *device,
+				      uint32_t const id,
+				      char const * const path,
+				      LIBMTP_progressfunc_t const callback,
+				      void const * const data)
+{
+  uint64_t offset;
+  off_t end;
+  int fd = -1;
+  int ret;
+
+  // Sanity check
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Bad arguments, path was NULL.");
+    return -1;
+  }
+
+  // Open file, keeping what is already there
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  if ( (fd = _open(path, O_RDWR|O_CREAT|O_BINARY,_S_IREAD)) == -1 ) {
+#else
+  if ( (fd = open(path, O_RDWR|O_CREAT|O_BINARY,S_IRWXU)) == -1 ) {
+#endif
+#else
+  if ( (fd = open(path, O_RDWR|O_CREAT,S_IRWXU|S_IRGRP)) == -1) {
+#endif
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not create file.");
+    return -1;
+  }
+
+  end = lseek(fd, 0, SEEK_END);
+  if (end < 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not seek in file.");
+    close(fd);
+    return -1;
+  }
+  offset = end;
+
+  ret = LIBMTP_Get_File_To_File_Descriptor_Resumable(device, id, fd, &offset,
+						     callback, data);
+
+  // Close file
+  close(fd);
+
+  return ret;
+}
+
+/**
+ * This gets a file off the device and calls put_func
+ * with chunks of data
+ *
+ * @param device a pointer to the device to get the file from.
+ * @param id the file ID of the file to retrieve.
+ * @param put_func the function to call when we have data.
+ * @param priv the user-defined pointer that is passed to
+ *             <code>put_func</code>.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ */
+int LIBMTP_Get_File_To_Handler(LIBMTP_mtpdevice_t *device,
+					uint32_t const id,
+					MTPDataPutFunc put_func,
+          void * priv,
+					LIBMTP_progressfunc_t const callback,
+					void const * const data)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+
+  LIBMTP_file_t *mtpfile = LIBMTP_Get_Filemetadata(device, id);
+  if (mtpfile == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Could not get object info.");
+    return -1;
+  }
+  if (mtpfile->filetype == LIBMTP_FILETYPE_FOLDER) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Bad object format.");
+    LIBMTP_destroy_file_t (mtpfile);
+    return -1;
+  }
+
+  // Callbacks
+  ptp_usb->callback_active = 1;
+  ptp_usb->current_transfer_total = mtpfile->filesize +
+    PTP_USB_BULK_HDR_LEN+sizeof(uint32_t); // Request length, one parameter
+  ptp_usb->current_transfer_complete = 0;
+  ptp_usb->current_transfer_callback = callback;
+  ptp_usb->current_transfer_callback_data = data;
+
+  // Don't need mtpfile anymore
+  LIBMTP_destroy_file_t(mtpfile);
+
+  MTPDataHandler mtp_handler;
+  mtp_handler.getfunc = NULL;
+  mtp_handler.putfunc = put_func;
+  mtp_handler.priv = priv;
+
+  PTPDataHandler handler;
+  handler.getfunc = NULL;
+  handler.putfunc = put_func_wrapper;
+  handler.getbuffunc = NULL;
+  handler.priv = &mtp_handler;
+
+  transfer_checksum_begin(device);
+  ret = ptp_getobject_to_handler(params, id, &handler);
+  transfer_checksum_end(device, ret == PTP_RC_OK);
+
+  ptp_usb->callback_active = 0;
+  ptp_usb->current_transfer_callback = NULL;
   ptp_usb->current_transfer_callback_data = NULL;
 
   if (ret == PTP_ERROR_CANCEL) {
@@ -5542,6 +7734,252 @@ int LIBMTP_Get_File_To_Handler(LIBMTP_mtpdevice_t *device,
   return 0;
 }
 
+/* Private data for receiving an object into a fixed memory region */
+typedef struct {
+  unsigned char *data;
+  uint64_t size;
+  uint64_t offset;
+} MTPBufferHandlerPrivate;
+
+static unsigned char *buffer_getbuffunc(PTPParams *params, void *priv,
+					unsigned long offset,
+					unsigned long wantlen)
+{
+  MTPBufferHandlerPrivate *b = (MTPBufferHandlerPrivate *) priv;
+
+  if (b->offset + offset + wantlen > b->size)
+    return NULL;
+  return b->data + b->offset + offset;
+}
+
+static uint16_t buffer_putfunc(PTPParams *params, void *priv,
+			       unsigned long sendlen, unsigned char *data)
+{
+  MTPBufferHandlerPrivate *b = (MTPBufferHandlerPrivate *) priv;
+
+  if (b->offset + sendlen > b->size)
+    return PTP_ERROR_IO;
+  // Data read straight into place need not be copied
+  if (data != b->data + b->offset)
+    memcpy(b->data + b->offset, data, sendlen);
+  b->offset += sendlen;
+  return PTP_RC_OK;
+}
+
+/**
+ * Find out the size of an object for downloading it. The cached
+ * ObjectCompressedSize is used unless it is the 32 bit overflow
+ * marker, in which case 64 bit devices are asked for the real size.
+ * @param device a pointer to the device.
+ * @param ob the object in the object cache.
+ * @param size the size is returned here.
+ * @return 0 if the size is known, -1 otherwise.
+ */
+static int get_object_download_size(LIBMTP_mtpdevice_t *device,
+				    PTPObject *ob, uint64_t *size)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  if (PTP_OB_SIZE(params, ob) != 0xFFFFFFFFU) {
+    *size = PTP_OB_SIZE(params, ob);
+    return 0;
+  }
+  if (device_object_bitsize(device) == 64) {
+    *size = get_u64_from_object(device, ob->oid, PTP_OPC_ObjectSize, 0);
+    if (*size != 0)
+      return 0;
+  }
+  return -1;
+}
+
+/**
+ * This gets a file off the device into a memory buffer supplied by
+ * the caller. Where the USB backend supports it the data is read
+ * straight into the buffer without being copied.
+ *
+ * @param device a pointer to the device to get the file from.
+ * @param id the file ID of the file to retrieve.
+ * @param buffer the memory to store the file in.
+ * @param size the size of <code>buffer</code>. If the file is known
+ *             to be larger than this, the call fails without any
+ *             transfer.
+ * @param received if not NULL, the number of bytes stored in
+ *             <code>buffer</code> is returned here.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Get_File_To_Mapped_File()
+ */
+int LIBMTP_Get_File_To_Buffer(LIBMTP_mtpdevice_t *device,
+			      uint32_t const id,
+			      unsigned char * const buffer,
+			      uint64_t const size,
+			      uint64_t * const received,
+			      LIBMTP_progressfunc_t const callback,
+			      void const * const data)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPObject *ob;
+  PTPDataHandler handler;
+  MTPBufferHandlerPrivate priv;
+  uint64_t filesize;
+
+  if (buffer == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_Buffer(): Bad arguments, buffer was NULL.");
+    return -1;
+  }
+  ret = ptp_object_want(params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_File_To_Buffer(): Could not get object info.");
+    return -1;
+  }
+  if (PTP_OB_FORMAT(params, ob) == PTP_OFC_Association) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_Buffer(): Bad object format.");
+    return -1;
+  }
+  if (get_object_download_size(device, ob, &filesize) == 0) {
+    if (filesize > size) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_Buffer(): Buffer too small for file.");
+      return -1;
+    }
+  } else {
+    // Unknown size, report progress against the buffer size
+    filesize = size;
+  }
+
+  // Callbacks
+  ptp_usb->callback_active = 1;
+  ptp_usb->current_transfer_total = filesize +
+    PTP_USB_BULK_HDR_LEN+sizeof(uint32_t); // Request length, one parameter
+  ptp_usb->current_transfer_complete = 0;
+  ptp_usb->current_transfer_callback = callback;
+  ptp_usb->current_transfer_callback_data = data;
+
+  priv.data = buffer;
+  priv.size = size;
+  priv.offset = 0;
+  handler.getfunc = NULL;
+  handler.putfunc = buffer_putfunc;
+  handler.getbuffunc = buffer_getbuffunc;
+  handler.priv = &priv;
+
+  transfer_checksum_begin(device);
+  ret = ptp_getobject_to_handler(params, id, &handler);
+  transfer_checksum_end(device, ret == PTP_RC_OK);
+
+  ptp_usb->callback_active = 0;
+  ptp_usb->current_transfer_callback = NULL;
+  ptp_usb->current_transfer_callback_data = NULL;
+
+  if (received != NULL)
+    *received = priv.offset;
+
+  if (ret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Get_File_To_Buffer(): Cancelled transfer.");
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_File_To_Buffer(): Could not get file from device.");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * This gets a file off the device to a local file identified by a
+ * filename, like <code>LIBMTP_Get_File_To_File()</code>. The file is
+ * created at its final size and memory mapped, and the data is
+ * received straight into the mapping, avoiding the copy through
+ * <code>write()</code>. If the size of the object is not known or
+ * the file cannot be mapped this falls back to a normal download.
+ *
+ * @param device a pointer to the device to get the file from.
+ * @param id the file ID of the file to retrieve.
+ * @param path a filename to use for the retrieved file.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Get_File_To_File()
+ * @see LIBMTP_Get_File_To_Buffer()
+ */
+int LIBMTP_Get_File_To_Mapped_File(LIBMTP_mtpdevice_t *device,
+				   uint32_t const id,
+				   char const * const path,
+				   LIBMTP_progressfunc_t const callback,
+				   void const * const data)
+{
+#ifdef HAVE_SYS_MMAN_H
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObject *ob;
+  uint64_t filesize;
+  uint64_t received = 0;
+  unsigned char *map;
+  int fd;
+  int ret;
+
+  // Sanity check
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_Mapped_File(): Bad arguments, path was NULL.");
+    return -1;
+  }
+  if (ptp_object_want(params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob) != PTP_RC_OK ||
+      get_object_download_size(device, ob, &filesize) != 0 ||
+      filesize == 0 || filesize > (uint64_t) SIZE_MAX) {
+    // Let the ordinary code path deal with it
+    return LIBMTP_Get_File_To_File(device, id, path, callback, data);
+  }
+
+  if ( (fd = open(path, O_RDWR|O_CREAT|O_TRUNC,S_IRWXU|S_IRGRP)) == -1) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_Mapped_File(): Could not create file.");
+    return -1;
+  }
+  if (ftruncate(fd, (off_t) filesize) == -1) {
+    close(fd);
+    unlink(path);
+    add_error_to_errorstack(device, LIBMTP_ERROR_STORAGE_FULL, "LIBMTP_Get_File_To_Mapped_File(): Could not allocate file.");
+    return -1;
+  }
+  map = mmap(NULL, (size_t) filesize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    // Not mappable (e.g. some network file systems), just write it
+    ret = ftruncate(fd, 0);
+    if (ret == 0)
+      ret = LIBMTP_Get_File_To_File_Descriptor(device, id, fd, callback, data);
+  } else {
+    ret = LIBMTP_Get_File_To_Buffer(device, id, map, filesize, &received,
+				    callback, data);
+    munmap(map, (size_t) filesize);
+    // The device may have sent less than announced
+    if (ret == 0 && received < filesize && ftruncate(fd, (off_t) received) == -1)
+      ret = -1;
+  }
+
+  // Close file
+  close(fd);
+
+  // Delete partial file.
+  if (ret != 0) {
+    unlink(path);
+    return -1;
+  }
+
+  return 0;
+#else
+  return LIBMTP_Get_File_To_File(device, id, path, callback, data);
+#endif
+}
+
 
 /**
  * This gets a track off the device to a file identified
@@ -5708,14 +8146,10 @@ int LIBMTP_Send_Track_From_File(LIBMTP_mtpdevice_t *device,
  */
 static int check_filename_exists(PTPParams* params, char const * const filename)
 {
-  unsigned int i;
+  PTPObject *ob;
 
-  for (i = 0; i < params->nrofobjects; i++) {
-    char *fname = params->objects[i].oi.Filename;
-    if ((fname != NULL) && (strcmp(filename, fname) == 0))
-    {
-      return -1;
-    }
+  if (ptp_object_find_by_name(params, PTP_HANDLER_SPECIAL, filename, &ob) == PTP_RC_OK) {
+    return -1;
   }
 
   return 0;
@@ -6033,6 +8467,55 @@ int LIBMTP_Send_File_From_File(LIBMTP_mtpdevice_t *device,
   return ret;
 }
 
+/**
+ * This sends the data of a file from a file descriptor, once
+ * send_file_object_info() has created the object. It takes care of
+ * the progress callback and of raising the timeout for large files.
+ * @return the PTP return code of the transfer.
+ */
+static uint16_t send_file_data_from_fd(LIBMTP_mtpdevice_t *device,
+				       int const fd,
+				       LIBMTP_file_t const * const filedata,
+				       LIBMTP_progressfunc_t const callback,
+				       void const * const data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  int oldtimeout;
+  int timeout;
+  uint16_t ret;
+
+  // Callbacks
+  ptp_usb->callback_active = 1;
+  // The callback will deactivate itself after this amount of data has been sent
+  // One BULK header for the request, one for the data phase. No parameters to the request.
+  ptp_usb->current_transfer_total = filedata->filesize+PTP_USB_BULK_HDR_LEN*2;
+  ptp_usb->current_transfer_complete = 0;
+  ptp_usb->current_transfer_callback = callback;
+  ptp_usb->current_transfer_callback_data = data;
+
+  /*
+   * We might need to increase the timeout here, files can be pretty
+   * large. Take the default timeout and add the calculated time for
+   * this transfer
+   */
+  get_usb_device_timeout(ptp_usb, &oldtimeout);
+  timeout = oldtimeout +
+    (ptp_usb->current_transfer_total / guess_usb_speed(ptp_usb)) * 1000;
+  set_usb_device_timeout(ptp_usb, timeout);
+
+  transfer_checksum_begin(device);
+  ret = ptp_sendobject_fromfd(params, fd, filedata->filesize);
+  transfer_checksum_end(device, ret == PTP_RC_OK);
+
+  ptp_usb->callback_active = 0;
+  ptp_usb->current_transfer_callback = NULL;
+  ptp_usb->current_transfer_callback_data = NULL;
+  set_usb_device_timeout(ptp_usb, oldtimeout);
+
+  return ret;
+}
+
 /**
  * This function sends a generic file from a file descriptor to an
  * MTP device. A filename and a set of metadata must be
@@ -6077,11 +8560,7 @@ int LIBMTP_Send_File_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
 			 void const * const data)
 {
   uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
   LIBMTP_file_t *newfilemeta;
-  int oldtimeout;
-  int timeout;
 
   if (send_file_object_info(device, filedata))
   {
@@ -6089,32 +8568,7 @@ int LIBMTP_Send_File_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
     return -1;
   }
 
-  // Callbacks
-  ptp_usb->callback_active = 1;
-  // The callback will deactivate itself after this amount of data has been sent
-  // One BULK header for the request, one for the data phase. No parameters to the request.
-  ptp_usb->current_transfer_total = filedata->filesize+PTP_USB_BULK_HDR_LEN*2;
-  ptp_usb->current_transfer_complete = 0;
-  ptp_usb->current_transfer_callback = callback;
-  ptp_usb->current_transfer_callback_data = data;
-
-  /*
-   * We might need to increase the timeout here, files can be pretty
-   * large. Take the default timeout and add the calculated time for
-   * this transfer
-   */
-  get_usb_device_timeout(ptp_usb, &oldtimeout);
-  timeout = oldtimeout +
-    (ptp_usb->current_transfer_total / guess_usb_speed(ptp_usb)) * 1000;
-  set_usb_device_timeout(ptp_usb, timeout);
-
-  ret = ptp_sendobject_fromfd(params, fd, filedata->filesize);
-
-  ptp_usb->callback_active = 0;
-  ptp_usb->current_transfer_callback = NULL;
-  ptp_usb->current_transfer_callback_data = NULL;
-  set_usb_device_timeout(ptp_usb, oldtimeout);
-
+  ret = send_file_data_from_fd(device, fd, filedata, callback, data);
   if (ret == PTP_ERROR_CANCEL) {
     add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_File_From_File_Descriptor(): Cancelled transfer.");
     return -1;
@@ -6148,6 +8602,240 @@ int LIBMTP_Send_File_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
   return 0;
 }
 
+/**
+ * This sends a file from a file descriptor to the device in a way
+ * that can be picked up again if it breaks. On devices with the
+ * Android edit extensions the object is created empty and the data
+ * is then written in chunks with SendPartialObject inside a
+ * BeginEditObject/EndEditObject session, keeping the number of
+ * bytes the device has acknowledged in <code>offset</code>.
+ *
+ * If the transfer fails or is cancelled, call this again with the
+ * same <code>filedata</code> (its item_id now names the object on
+ * the device) and offset, and only the missing bytes are sent.
+ * Devices without the edit extensions can only start a new transfer,
+ * which is then done in one go like
+ * <code>LIBMTP_Send_File_From_File_Descriptor()</code>.
+ *
+ * @param device a pointer to the device to send the file to.
+ * @param fd the filedescriptor for a local file which will be sent.
+ *        It has to be seekable.
+ * @param filedata a file metadata set to be written along with the
+ *        file, as for <code>LIBMTP_Send_File_From_File_Descriptor()</code>.
+ *        Set <code>filedata-&gt;item_id</code> to 0 to start a new
+ *        transfer.
+ * @param offset the number of bytes of the file already transferred,
+ *        0 for a new transfer. On return this holds the number of
+ *        bytes completed, also when the transfer failed.
+ * @param callback a progress indicator function or NULL to ignore.
+ *        Returning non-zero from it cancels the transfer after the
+ *        current chunk.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_File_From_File_Resumable()
+ */
+int LIBMTP_Send_File_From_File_Descriptor_Resumable(LIBMTP_mtpdevice_t *device,
+						    int const fd,
+						    LIBMTP_file_t * const filedata,
+						    uint64_t * const offset,
+						    LIBMTP_progressfunc_t const callback,
+						    void const * const data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  unsigned char *chunk;
+  int ret = 0;
+
+  // Chunks may come from several calls, this is not checksummed
+  transfer_checksum_end(device, 0);
+  if (offset == NULL || filedata == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File_Descriptor_Resumable(): Bad arguments.");
+    return -1;
+  }
+
+  // Without the edit extensions all we can do is send the whole file.
+  if (!LIBMTP_Check_Capability(device, LIBMTP_DEVICECAP_SendPartialObject) ||
+      !LIBMTP_Check_Capability(device, LIBMTP_DEVICECAP_EditObjects)) {
+    if (filedata->item_id != 0 || *offset != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File_Descriptor_Resumable(): "
+			      "Device cannot resume transfers.");
+      return -1;
+    }
+    if (LIBMTP_Send_File_From_File_Descriptor(device, fd, filedata, callback, data) != 0) {
+      return -1;
+    }
+    *offset = filedata->filesize;
+    return 0;
+  }
+
+  if (filedata->item_id == 0) {
+    uint64_t const filesize = filedata->filesize;
+    unsigned char dummy = 0;
+    uint16_t rc;
+
+    /*
+     * The storage has to be picked for the real size, but the
+     * object itself is created empty: the data all goes in through
+     * the edit session below.
+     */
+    if (filedata->storage_id == 0) {
+      int store = get_suggested_storage_id(device, filesize, filedata->parent_id);
+
+      if (store == -1) {
+	return -1;
+      }
+      filedata->storage_id = store;
+    }
+    filedata->filesize = 0;
+    ret = send_file_object_info(device, filedata);
+    filedata->filesize = filesize;
+    if (ret != 0) {
+      // no need to output an error since send_file_object_info will already have done so
+      return -1;
+    }
+    rc = ptp_sendobject(params, &dummy, 0);
+    if (rc != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, rc, "LIBMTP_Send_File_From_File_Descriptor_Resumable(): "
+				  "Could not create object.");
+      return -1;
+    }
+    add_object_to_cache(device, filedata->item_id);
+    *offset = 0;
+  } else if (*offset > filedata->filesize) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File_Descriptor_Resumable(): "
+			    "Offset is beyond the end of the file.");
+    return -1;
+  }
+
+  if (lseek(fd, *offset, SEEK_SET) < 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File_Descriptor_Resumable(): "
+			    "Could not seek in source file.");
+    return -1;
+  }
+  chunk = malloc(RESUMABLE_CHUNK_SIZE);
+  if (chunk == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION, "LIBMTP_Send_File_From_File_Descriptor_Resumable(): "
+			    "Could not allocate transfer buffer.");
+    return -1;
+  }
+
+  if (LIBMTP_BeginEditObject(device, filedata->item_id) != 0) {
+    free(chunk);
+    return -1;
+  }
+  // Drop whatever got past the last completed chunk before it broke.
+  if (LIBMTP_TruncateObject(device, filedata->item_id, *offset) != 0) {
+    ret = -1;
+  }
+
+  while (ret == 0 && *offset < filedata->filesize) {
+    ssize_t n;
+    size_t want = RESUMABLE_CHUNK_SIZE;
+
+    if (filedata->filesize - *offset < want) {
+      want = filedata->filesize - *offset;
+    }
+    n = read(fd, chunk, want);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File_Descriptor_Resumable(): "
+			      "Could not read source file.");
+      ret = -1;
+      break;
+    }
+    if (LIBMTP_SendPartialObject(device, filedata->item_id, *offset,
+				 chunk, n) != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File_Descriptor_Resumable(): "
+			      "Could not send object.");
+      ret = -1;
+      break;
+    }
+    *offset += n;
+
+    if (callback != NULL && callback(*offset, filedata->filesize, data) != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_File_From_File_Descriptor_Resumable(): Cancelled transfer.");
+      ret = -1;
+    }
+  }
+  free(chunk);
+
+  // Close the edit session also after a failure so the object is usable
+  if (LIBMTP_EndEditObject(device, filedata->item_id) != 0) {
+    ret = -1;
+  }
+  return ret;
+}
+
+/**
+ * This sends a local file to the device in a way that can be picked
+ * up again if it breaks. See
+ * <code>LIBMTP_Send_File_From_File_Descriptor_Resumable()</code>.
+ *
+ * @param device a pointer to the device to send the file to.
+ * @param path the filename of a local file which will be sent.
+ * @param filedata a file metadata set to be written along with the
+ *        file. Set <code>filedata-&gt;item_id</code> to 0 to start a
+ *        new transfer.
+ * @param offset the number of bytes of the file already transferred,
+ *        0 for a new transfer. On return this holds the number of
+ *        bytes completed, also when the transfer failed.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_File_From_File_Descriptor_Resumable()
+ */
+int LIBMTP_Send_File_From_File_Resumable(LIBMTP_mtpdevice_t *device,
+					 char const * const path,
+					 LIBMTP_file_t * const filedata,
+					 uint64_t * const offset,
+					 LIBMTP_progressfunc_t const callback,
+					 void const * const data)
+{
+  int fd;
+  int ret;
+
+  // Sanity check
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File_Resumable(): Bad arguments, path was NULL.");
+    return -1;
+  }
+
+  // Open file
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  if ( (fd = _open(path, O_RDONLY|O_BINARY)) == -1 ) {
+#else
+  if ( (fd = open(path, O_RDONLY|O_BINARY)) == -1 ) {
+#endif
+#else
+  if ( (fd = open(path, O_RDONLY)) == -1) {
+#endif
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File_Resumable(): Could not open source file.");
+    return -1;
+  }
+
+  ret = LIBMTP_Send_File_From_File_Descriptor_Resumable(device, fd, filedata,
+							offset, callback, data);
+
+  // Close file.
+#ifdef USE_WINDOWS_IO_H
+  _close(fd);
+#else
+  close(fd);
+#endif
+
+  return ret;
+}
+
 /**
  * This function sends a generic file from a handler function to an
  * MTP device. A filename and a set of metadata must be
@@ -6220,9 +8908,12 @@ int LIBMTP_Send_File_From_Handler(LIBMTP_mtpdevice_t *device,
   PTPDataHandler handler;
   handler.getfunc = get_func_wrapper;
   handler.putfunc = NULL;
+  handler.getbuffunc = NULL;
   handler.priv = &mtp_handler;
 
+  transfer_checksum_begin(device);
   ret = ptp_sendobject_from_handler(params, &handler, filedata->filesize);
+  transfer_checksum_end(device, ret == PTP_RC_OK);
 
   ptp_usb->callback_active = 0;
   ptp_usb->current_transfer_callback = NULL;
@@ -6262,3121 +8953,6576 @@ int LIBMTP_Send_File_From_Handler(LIBMTP_mtpdevice_t *device,
 }
 
 /**
- * This function sends the file object info, ready for sendobject
- * @param device a pointer to the device to send the file to.
- * @param filedata a file metadata set to be written along with the file.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
+ * The object format a file of this type is sent with, some devices
+ * only take Ogg and FLAC as undefined files.
  */
-static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *filedata)
+static uint16_t map_send_filetype(LIBMTP_mtpdevice_t *device,
+				  LIBMTP_filetype_t const filetype)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint16_t of = map_libmtp_type_to_ptp_type(filetype);
+
+  if (FLAG_OGG_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_OGG) {
+    of = PTP_OFC_Undefined;
+  }
+  if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_FLAC) {
+    of = PTP_OFC_Undefined;
+  }
+  return of;
+}
+
+/**
+ * Progress state of LIBMTP_Send_Files_From_Files(), so the progress
+ * of every single file is reported as progress of the whole batch.
+ */
+typedef struct {
+  LIBMTP_progressfunc_t callback;
+  void const *data;
+  uint64_t done;
+  uint64_t total;
+} MTPBatchProgress;
+
+static int batch_progress(uint64_t const sent, uint64_t const total,
+			  void const * const data)
+{
+  MTPBatchProgress const *batch = (MTPBatchProgress const *) data;
+
+  (void) total;
+  return batch->callback(batch->done + sent, batch->total, batch->data);
+}
+
+/**
+ * Puts a file that was just sent into the object cache, from what was
+ * sent and what the device answered, without asking the device again.
+ * @param device a pointer to the device.
+ * @param file the file as updated by send_file_object_info().
+ * @return 0 on success, -1 if that is not enough to go on.
+ */
+static int cache_sent_file(LIBMTP_mtpdevice_t *device,
+			   LIBMTP_file_t const * const file)
 {
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  uint32_t store;
-  int use_primary_storage = 1;
-  uint16_t of = map_libmtp_type_to_ptp_type(filedata->filetype);
-  LIBMTP_devicestorage_t *storage;
-  uint32_t localph = filedata->parent_id;
-  uint16_t ret;
-  unsigned int i;
+  PTPObjectInfo oi;
+  PTPObject *ob;
 
-#if 0
-  // Sanity check: no zerolength files on some devices?
-  // If the zerolength files cause problems on some devices,
-  // then add a bug flag for this.
-  if (filedata->filesize == 0) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "send_file_object_info(): "
-			    "File of zero size.");
+  // Whether the root folder is 0 or 0xFFFFFFFF only the device knows
+  if (file->filename == NULL || file->storage_id == 0 ||
+      file->parent_id == 0 || file->parent_id == 0xFFFFFFFFU)
+    return -1;
+
+  memset(&oi, 0, sizeof(oi));
+  oi.Filename = strdup(file->filename);
+  if (oi.Filename == NULL)
+    return -1;
+  // The name the device was given
+  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb))
+    strip_7bit_from_utf8(oi.Filename);
+  oi.ObjectFormat = map_send_filetype(device, file->filetype);
+  oi.ObjectCompressedSize = file->filesize;
+  oi.StorageID = file->storage_id;
+  oi.ParentObject = file->parent_id;
+  oi.ModificationDate = file->modificationdate;
+  if (ptp_object_find_or_insert(params, file->item_id, &ob) != PTP_RC_OK) {
+    free(oi.Filename);
     return -1;
   }
-#endif
-  if (filedata->storage_id != 0) {
-    store = filedata->storage_id;
-  } else {
-    store = get_suggested_storage_id(device, filedata->filesize, localph);
-  }
+  ptp_object_set_objectinfo(params, ob, &oi);
+  ob->flags |= PTPOBJECT_OBJECTINFO_LOADED | PTPOBJECT_PARENTOBJECT_LOADED |
+    PTPOBJECT_STORAGEID_LOADED;
+  ptp_object_reindex(params, ob);
+  // The folder it went into has a new child
+  listing_drop_object(device, file->item_id);
+  return 0;
+}
 
-  // Detect if something non-primary is in use.
-  storage = device->storage;
-  if (storage != NULL && store != storage->id) {
-    use_primary_storage = 0;
+/**
+ * Brings the object cache up to date after a batch of files has been
+ * sent, and picks up the parent and storage the device assigned.
+ */
+static void add_sent_files_to_cache(LIBMTP_mtpdevice_t *device,
+				    LIBMTP_file_t * const * const files,
+				    uint32_t const count)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    PTPObject *ob;
+
+    if (files[i]->item_id == 0)
+      continue;
+    if (ptp_object_find(params, files[i]->item_id, &ob) != PTP_RC_OK ||
+	!(ob->flags & PTPOBJECT_OBJECTINFO_LOADED)) {
+      // Only fetched when what we sent does not tell enough
+      if (cache_sent_file(device, files[i]) != 0)
+	add_object_to_cache(device, files[i]->item_id);
+      if (ptp_object_find(params, files[i]->item_id, &ob) != PTP_RC_OK)
+	continue;
+    }
+    files[i]->parent_id = PTP_OB_PARENT(params, ob);
+    files[i]->storage_id = PTP_OB_STORAGE(params, ob);
   }
+}
 
-  /*
-   * If no destination folder was given, look up a default
-   * folder if possible. Perhaps there is some way of retrieveing
-   * the default folder for different forms of content, what
-   * do I know, we use a fixed list in lack of any better method.
-   * Some devices obviously need to have their files in certain
-   * folders in order to find/display them at all (hello Creative),
-   * so we have to have a method for this. We only do this if the
-   * primary storage is in use.
-   */
+/**
+ * This function sends a batch of local files to an MTP device. It
+ * does the same as calling <code>LIBMTP_Send_File_From_File()</code>
+ * for every file, but with less overhead per file: the storage for
+ * every destination folder is looked up once, and the object cache
+ * is updated in one pass after all files have been sent instead of
+ * after each of them. This makes a big difference when sending many
+ * small files.
+ *
+ * The files are sent in order. If one of them fails the error is put
+ * on the error stack, its <code>item_id</code> is set to 0 and the
+ * batch goes on with the next file. Cancelling through the progress
+ * callback stops the whole batch.
+ *
+ * @param device a pointer to the device to send the files to.
+ * @param paths the filenames of the local files to send.
+ * @param files a file metadata set for each of the files, see
+ *        <code>LIBMTP_Send_File_From_File()</code>. After this call the
+ *        <code>item_id</code>, <code>parent_id</code> and
+ *        <code>storage_id</code> fields are updated for each file that
+ *        was sent.
+ * @param count the number of entries in <code>paths</code> and
+ *        <code>files</code>.
+ * @param callback a progress indicator function or NULL to ignore.
+ *        It is called with the number of bytes sent so far and the
+ *        total size of the whole batch.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if all files were sent, any other value means that some
+ *           or all of the files failed.
+ * @see LIBMTP_Send_File_From_File()
+ */
+int LIBMTP_Send_Files_From_Files(LIBMTP_mtpdevice_t *device,
+				 char const * const * const paths,
+				 LIBMTP_file_t * const * const files,
+				 uint32_t const count,
+				 LIBMTP_progressfunc_t const callback,
+				 void const * const data)
+{
+  MTPBatchProgress batch;
+  uint32_t lastparent = 0;
+  uint32_t laststore = 0;
+  int havestore = 0;
+  int failed = 0;
+  uint32_t i;
 
-  if (localph == 0 && use_primary_storage) {
-    if (LIBMTP_FILETYPE_IS_AUDIO(filedata->filetype)) {
-      localph = device->default_music_folder;
-    } else if (LIBMTP_FILETYPE_IS_VIDEO(filedata->filetype)) {
-      localph = device->default_video_folder;
-    } else if (of == PTP_OFC_EXIF_JPEG ||
-	       of == PTP_OFC_JP2 ||
-	       of == PTP_OFC_JPX ||
-	       of == PTP_OFC_JFIF ||
-	       of == PTP_OFC_TIFF ||
-	       of == PTP_OFC_TIFF_IT ||
-	       of == PTP_OFC_BMP ||
-	       of == PTP_OFC_GIF ||
-	       of == PTP_OFC_PICT ||
-	       of == PTP_OFC_PNG ||
-	       of == PTP_OFC_MTP_WindowsImageFormat) {
-      localph = device->default_picture_folder;
-    } else if (of == PTP_OFC_MTP_vCalendar1 ||
-	       of == PTP_OFC_MTP_vCalendar2 ||
-	       of == PTP_OFC_MTP_UndefinedContact ||
-	       of == PTP_OFC_MTP_vCard2 ||
-	       of == PTP_OFC_MTP_vCard3 ||
-	       of == PTP_OFC_MTP_UndefinedCalendarItem) {
-      localph = device->default_organizer_folder;
-    } else if (of == PTP_OFC_Text) {
-      localph = device->default_text_folder;
-    }
+  if (paths == NULL || files == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Files_From_Files(): Bad arguments.");
+    return -1;
   }
 
-  // Here we wire the type to unknown on bugged, but
-  // Ogg or FLAC-supportive devices.
-  if (FLAG_OGG_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_OGG) {
-    of = PTP_OFC_Undefined;
+  memset(&batch, 0, sizeof(batch));
+  batch.callback = callback;
+  batch.data = data;
+  for (i = 0; i < count; i++) {
+    batch.total += files[i]->filesize;
   }
-  if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_FLAC) {
-    of = PTP_OFC_Undefined;
-  }
-
-  if (ptp_operation_issupported(params, PTP_OC_MTP_SendObjectPropList) &&
-      !FLAG_BROKEN_SEND_OBJECT_PROPLIST(ptp_usb)) {
-    /*
-     * MTP enhanched does it this way (from a sniff):
-     * -> PTP_OC_MTP_SendObjectPropList (0x9808):
-     *    20 00 00 00 01 00 08 98 1B 00 00 00 01 00 01 00
-     *    FF FF FF FF 00 30 00 00 00 00 00 00 12 5E 00 00
-     *    Length: 0x00000020
-     *    Type:   0x0001 PTP_USB_CONTAINER_COMMAND
-     *    Code:   0x9808
-     *    Transaction ID: 0x0000001B
-     *    Param1: 0x00010001 <- store
-     *    Param2: 0xffffffff <- parent handle (-1 ?)
-     *    Param3: 0x00003000 <- file type PTP_OFC_Undefined - we don't know about PDF files
-     *    Param4: 0x00000000 <- file length MSB (-0x0c header len)
-     *    Param5: 0x00005e12 <- file length LSB (-0x0c header len)
-     *
-     * -> PTP_OC_MTP_SendObjectPropList (0x9808):
-     *    46 00 00 00 02 00 08 98 1B 00 00 00 03 00 00 00
-     *    00 00 00 00 07 DC FF FF 0D 4B 00 53 00 30 00 36 - dc07 = file name
-     *    00 30 00 33 00 30 00 36 00 2E 00 70 00 64 00 66
-     *    00 00 00 00 00 00 00 03 DC 04 00 00 00 00 00 00 - dc03 = protection status
-     *    00 4F DC 02 00 01                               - dc4f = non consumable
-     *    Length: 0x00000046
-     *    Type:   0x0002 PTP_USB_CONTAINER_DATA
-     *    Code:   0x9808
-     *    Transaction ID: 0x0000001B
-     *    Metadata....
-     *    0x00000003 <- Number of metadata items
-     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
-     *    0xdc07     <- metadata type: file name
-     *    0xffff     <- metadata type: string
-     *    0x0d       <- number of (uint16_t) characters
-     *    4b 53 30 36 30 33 30 36 2e 50 64 66 00 "KS060306.pdf", null terminated
-     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
-     *    0xdc03     <- metadata type: protection status
-     *    0x0004     <- metadata type: uint16_t
-     *    0x0000     <- not protected
-     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
-     *    0xdc4f     <- non consumable
-     *    0x0002     <- metadata type: uint8_t
-     *    0x01       <- non-consumable (this device cannot display PDF)
-     *
-     * <- Read 0x18 bytes back
-     *    18 00 00 00 03 00 01 20 1B 00 00 00 01 00 01 00
-     *    00 00 00 00 01 40 00 00
-     *    Length: 0x000000018
-     *    Type:   0x0003 PTP_USB_CONTAINER_RESPONSE
-     *    Code:   0x2001 PTP_OK
-     *    Transaction ID: 0x0000001B
-     *    Param1: 0x00010001 <- store
-     *    Param2: 0x00000000 <- parent handle
-     *    Param3: 0x00004001 <- new file/object ID
-     *
-     * -> PTP_OC_SendObject (0x100d)
-     *    0C 00 00 00 01 00 0D 10 1C 00 00 00
-     * -> ... all the bytes ...
-     * <- Read 0x0c bytes back
-     *    0C 00 00 00 03 00 01 20 1C 00 00 00
-     *    ... Then update metadata one-by one, actually (instead of sending it first!) ...
-     */
-    MTPProperties *props = NULL;
-    int nrofprops = 0;
-    MTPProperties *prop = NULL;
-    uint16_t *properties = NULL;
-    uint32_t propcnt = 0;
-
-    // default parent handle
-    if (localph == 0)
-      localph = 0xFFFFFFFFU; // Set to -1
-
-    // Must be 0x00000000U for new objects
-    filedata->item_id = 0x00000000U;
-
-    ret = ptp_mtp_getobjectpropssupported(params, of, &propcnt, &properties);
 
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
+  for (i = 0; i < count; i++) {
+    LIBMTP_file_t *filedata = files[i];
+    int fd;
+    uint16_t ret;
 
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], of, &opd);
-      if (ret != PTP_RC_OK) {
-	add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
-				"could not get property description.");
-      } else if (opd.GetSet) {
-	switch (properties[i]) {
-	case PTP_OPC_ObjectFileName:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = filedata->item_id;
-	  prop->property = PTP_OPC_ObjectFileName;
-	  prop->datatype = PTP_DTC_STR;
-	  if (filedata->filename != NULL) {
-	    prop->propval.str = strdup(filedata->filename);
-	    if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-	      strip_7bit_from_utf8(prop->propval.str);
-	    }
-	  }
-	  break;
-	case PTP_OPC_ProtectionStatus:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = filedata->item_id;
-	  prop->property = PTP_OPC_ProtectionStatus;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = 0x0000U; /* Not protected */
-	  break;
-	case PTP_OPC_NonConsumable:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = filedata->item_id;
-	  prop->property = PTP_OPC_NonConsumable;
-	  prop->datatype = PTP_DTC_UINT8;
-	  prop->propval.u8 = 0x00; /* It is supported, then it is consumable */
-	  break;
-	case PTP_OPC_Name:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = filedata->item_id;
-	  prop->property = PTP_OPC_Name;
-	  prop->datatype = PTP_DTC_STR;
-	  if (filedata->filename != NULL)
-	    prop->propval.str = strdup(filedata->filename);
-	  break;
-	case PTP_OPC_DateModified:
-	  // Tag with current time if that is supported
-	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = filedata->item_id;
-	    prop->property = PTP_OPC_DateModified;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = get_iso8601_stamp();
-	    filedata->modificationdate = time(NULL);
-	  }
-	  break;
-	}
+    // Resolve the storage once for every run of files to the same folder
+    if (filedata->storage_id == 0) {
+      if (!havestore || filedata->parent_id != lastparent) {
+	lastparent = filedata->parent_id;
+	laststore = get_suggested_storage_id(device, filedata->filesize, lastparent);
+	havestore = 1;
       }
-      ptp_free_objectpropdesc(&opd);
+      filedata->storage_id = laststore;
     }
-    free(properties);
-
-    ret = ptp_mtp_sendobjectproplist(params, &store, &localph, &filedata->item_id,
-				     of, filedata->filesize, props, nrofprops);
 
-    /* Free property list */
-    ptp_destroy_object_prop_list(props, nrofprops);
-
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "send_file_object_info():"
-				  "Could not send object property list.");
-      if (ret == PTP_RC_AccessDenied) {
-	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
-      }
-      return -1;
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+    fd = _open(paths[i], O_RDONLY|O_BINARY);
+#else
+    fd = open(paths[i], O_RDONLY|O_BINARY);
+#endif
+#else
+    fd = open(paths[i], O_RDONLY);
+#endif
+    if (fd == -1) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Files_From_Files(): Could not open source file.");
+      filedata->item_id = 0;
+      failed = 1;
+      batch.done += filedata->filesize;
+      continue;
     }
-  } else if (ptp_operation_issupported(params,PTP_OC_SendObjectInfo)) {
-    PTPObjectInfo new_file;
-
-    memset(&new_file, 0, sizeof(PTPObjectInfo));
 
-    new_file.Filename = filedata->filename;
-    if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-      strip_7bit_from_utf8(new_file.Filename);
-    }
-    if (filedata->filesize > 0xFFFFFFFFL) {
-      // This is a kludge in the MTP standard for large files.
-      new_file.ObjectCompressedSize = (uint32_t) 0xFFFFFFFF;
+    if (send_file_object_info(device, filedata)) {
+      // send_file_object_info() has put the error on the stack
+      ret = PTP_RC_GeneralError;
     } else {
-      new_file.ObjectCompressedSize = (uint32_t) filedata->filesize;
+      ret = send_file_data_from_fd(device, fd, filedata,
+				   callback != NULL ? batch_progress : NULL,
+				   &batch);
+      if (ret == PTP_ERROR_CANCEL) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_Files_From_Files(): Cancelled transfer.");
+      } else if (ret != PTP_RC_OK) {
+	add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_Files_From_Files(): "
+				    "Could not send object.");
+      }
     }
-    new_file.ObjectFormat = of;
-    new_file.StorageID = store;
-    new_file.ParentObject = localph;
-    new_file.ModificationDate = time(NULL);
 
-    // Create the object
-    ret = ptp_sendobjectinfo(params, &store, &localph, &filedata->item_id, &new_file);
+#ifdef USE_WINDOWS_IO_H
+    _close(fd);
+#else
+    close(fd);
+#endif
 
+    batch.done += filedata->filesize;
     if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
-				  "Could not send object info.");
-      if (ret == PTP_RC_AccessDenied) {
-	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
-      }
-      return -1;
+      filedata->item_id = 0;
+      failed = 1;
+      if (ret == PTP_ERROR_CANCEL)
+	break;
     }
-    // NOTE: the char* pointers inside new_file are not copies so don't
-    // try to destroy this objectinfo!
   }
 
-  // Now there IS an object with this parent handle.
-  filedata->parent_id = localph;
-
-  return 0;
+  add_sent_files_to_cache(device, files, i);
+  return failed ? -1 : 0;
 }
 
 /**
- * This function updates the MTP track object metadata on a
- * single file identified by an object ID.
- * @param device a pointer to the device to update the track
- *        metadata on.
- * @param metadata a track metadata set to be written to the file.
- *        notice that the <code>track_id</code> field of the
- *        metadata structure must be correct so that the
- *        function can update the right file. If some properties
- *        of this metadata are set to NULL (strings) or 0
- *        (numerical values) they will be discarded and the
- *        track will not be tagged with these blank values.
- * @return 0 on success, any other value means failure. If some
- *        or all of the properties fail to update we will still
- *        return success. On some devices (notably iRiver T30)
- *        properties that exist cannot be updated.
+ * State of one LIBMTP_Sync_Diff() run.
  */
-int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
-				 LIBMTP_track_t const * const metadata)
+typedef struct {
+  LIBMTP_mtpdevice_t *device;
+  uint32_t storage;
+  int flags;
+  LIBMTP_sync_entry_t *first;
+  LIBMTP_sync_entry_t *last;
+} MTPSyncDiff;
+
+/**
+ * A local directory entry, as compared by LIBMTP_Sync_Diff().
+ */
+typedef struct {
+  char *name;
+  int is_folder;
+  uint64_t size;
+  time_t mtime;
+} MTPSyncLocal;
+
+static int sync_local_cmp(const void *a, const void *b)
 {
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  uint32_t i;
-  uint16_t *properties = NULL;
-  uint32_t propcnt = 0;
+  return strcasecmp(((MTPSyncLocal const *) a)->name,
+		    ((MTPSyncLocal const *) b)->name);
+}
 
-  // First see which properties can be set on this file format and apply accordingly
-  // i.e only try to update this metadata for object tags that exist on the current player.
-  ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(metadata->filetype), &propcnt, &properties);
-  if (ret != PTP_RC_OK) {
-    // Just bail out for now, nothing is ever set.
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-			    "could not retrieve supported object properties.");
-    return -1;
+/**
+ * A device object, as compared by LIBMTP_Sync_Diff().
+ */
+typedef struct {
+  char const *name;
+  PTPObject *ob;
+} MTPSyncObject;
+
+static int sync_object_cmp(const void *a, const void *b)
+{
+  return strcasecmp(((MTPSyncObject const *) a)->name,
+		    ((MTPSyncObject const *) b)->name);
+}
+
+/**
+ * Append an entry to the result of a diff.
+ * @return the new entry, NULL if out of memory.
+ */
+static LIBMTP_sync_entry_t *sync_add_entry(MTPSyncDiff *diff,
+					   LIBMTP_sync_action_t action,
+					   char const * const relpath,
+					   char const * const name,
+					   int is_folder)
+{
+  LIBMTP_sync_entry_t *entry;
+
+  entry = (LIBMTP_sync_entry_t *) calloc(1, sizeof(LIBMTP_sync_entry_t));
+  if (entry == NULL)
+    return NULL;
+  entry->path = malloc(strlen(relpath) + strlen(name) + 2);
+  if (entry->path == NULL) {
+    free(entry);
+    return NULL;
   }
-  if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
-      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
-    MTPProperties *props = NULL;
-    MTPProperties *prop = NULL;
-    int nrofprops = 0;
+  if (relpath[0] != '\0')
+    sprintf(entry->path, "%s/%s", relpath, name);
+  else
+    strcpy(entry->path, name);
+  entry->action = action;
+  entry->is_folder = is_folder;
+  entry->filetype = is_folder ? LIBMTP_FILETYPE_FOLDER :
+    filetype_from_extension(name);
+  if (diff->last != NULL)
+    diff->last->next = entry;
+  else
+    diff->first = entry;
+  diff->last = entry;
+  return entry;
+}
 
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
+/**
+ * Read a local directory into an array sorted by name, skipping
+ * anything that is neither a regular file nor a directory. Symbolic
+ * links to directories are skipped too so a link loop can't make the
+ * walk endless.
+ * @return the number of entries or -1 on failure.
+ */
+static int sync_read_local(char const * const path, MTPSyncLocal **out)
+{
+#ifdef HAVE_DIRENT_H
+  DIR *dir;
+  struct dirent *de;
+  MTPSyncLocal *ents = NULL;
+  int n = 0, allocated = 0;
 
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], map_libmtp_type_to_ptp_type(metadata->filetype), &opd);
-      if (ret != PTP_RC_OK) {
-	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				"could not get property description.");
-      } else if (opd.GetSet) {
-	switch (properties[i]) {
-	case PTP_OPC_Name:
-	  if (metadata->title == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Name;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->title);
-	  break;
-	case PTP_OPC_AlbumName:
-	  if (metadata->album == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_AlbumName;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->album);
-	  break;
-	case PTP_OPC_Artist:
-	  if (metadata->artist == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Artist;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->artist);
-	  break;
-	case PTP_OPC_Composer:
-	  if (metadata->composer == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Composer;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->composer);
-	  break;
-	case PTP_OPC_Genre:
-	  if (metadata->genre == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Genre;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->genre);
-	  break;
-	case PTP_OPC_Duration:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Duration;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->duration, &opd);
-	  break;
-	case PTP_OPC_Track:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Track;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->tracknumber, &opd);
-	  break;
-	case PTP_OPC_OriginalReleaseDate:
-	  if (metadata->date == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_OriginalReleaseDate;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->date);
-	  break;
-	case PTP_OPC_SampleRate:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_SampleRate;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->samplerate, &opd);
-	  break;
-	case PTP_OPC_NumberOfChannels:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_NumberOfChannels;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->nochannels, &opd);
-	  break;
-	case PTP_OPC_AudioWAVECodec:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_AudioWAVECodec;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->wavecodec, &opd);
-	  break;
-	case PTP_OPC_AudioBitRate:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_AudioBitRate;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->bitrate, &opd);
-	  break;
-	case PTP_OPC_BitRateType:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_BitRateType;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->bitratetype, &opd);
-	  break;
-	case PTP_OPC_Rating:
-	  // TODO: shall this be set for rating 0?
-	  if (metadata->rating == 0)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Rating;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->rating, &opd);
-	  break;
-	case PTP_OPC_UseCount:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_UseCount;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->usecount, &opd);
-	  break;
-	case PTP_OPC_DateModified:
-	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    // Tag with current time if that is supported
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	    prop->ObjectHandle = metadata->item_id;
-	    prop->property = PTP_OPC_DateModified;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = get_iso8601_stamp();
-	  }
-	  break;
-	default:
-	  break;
-	}
+  *out = NULL;
+  dir = opendir(path);
+  if (dir == NULL)
+    return -1;
+  while ((de = readdir(dir)) != NULL) {
+    struct stat st;
+    char *full;
+
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+    full = malloc(strlen(path) + strlen(de->d_name) + 2);
+    if (full == NULL)
+      goto fail;
+    sprintf(full, "%s/%s", path, de->d_name);
+#ifdef S_ISLNK
+    if (lstat(full, &st) != 0) {
+      free(full);
+      continue;
+    }
+    // A link to a file is sent as the file, a link to a folder is skipped
+    if (S_ISLNK(st.st_mode) &&
+	(stat(full, &st) != 0 || S_ISDIR(st.st_mode))) {
+      free(full);
+      continue;
+    }
+#else
+    if (stat(full, &st) != 0) {
+      free(full);
+      continue;
+    }
+#endif
+    if (!(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+      free(full);
+      continue;
+    }
+    free(full);
+    if (n == allocated) {
+      MTPSyncLocal *tmp;
+
+      allocated = allocated ? allocated * 2 : 32;
+      tmp = realloc(ents, allocated * sizeof(MTPSyncLocal));
+      if (tmp == NULL)
+	goto fail;
+      ents = tmp;
+    }
+    ents[n].name = strdup(de->d_name);
+    if (ents[n].name == NULL)
+      goto fail;
+    ents[n].is_folder = S_ISDIR(st.st_mode) ? 1 : 0;
+    ents[n].size = st.st_size;
+    ents[n].mtime = st.st_mtime;
+    n++;
+  }
+  closedir(dir);
+  qsort(ents, n, sizeof(MTPSyncLocal), sync_local_cmp);
+  *out = ents;
+  return n;
+
+ fail:
+  closedir(dir);
+  while (n > 0)
+    free(ents[--n].name);
+  free(ents);
+  return -1;
+#else
+  *out = NULL;
+  return -1;
+#endif
+}
+
+/**
+ * Collect the cached children of a device folder sorted by name.
+ * @return the number of objects or -1 if out of memory.
+ */
+static int sync_read_device(MTPSyncDiff *diff, uint32_t const parent,
+			    MTPSyncObject **out)
+{
+  PTPParams *params = (PTPParams *) diff->device->params;
+  PTPObject *ob = NULL;
+  MTPSyncObject *obs = NULL;
+  int n = 0, allocated = 0;
+
+  *out = NULL;
+  while ((ob = ptp_objects_next_by_parent(params, parent, ob)) != NULL) {
+    if (diff->storage != 0 && PTP_OB_STORAGE(params, ob) != diff->storage)
+      continue;
+    if (PTP_OB_NAME(params, ob) == NULL)
+      continue;
+    if (n == allocated) {
+      MTPSyncObject *tmp;
+
+      allocated = allocated ? allocated * 2 : 32;
+      tmp = realloc(obs, allocated * sizeof(MTPSyncObject));
+      if (tmp == NULL) {
+	free(obs);
+	return -1;
       }
-      ptp_free_objectpropdesc(&opd);
+      obs = tmp;
     }
+    obs[n].name = PTP_OB_NAME(params, ob);
+    obs[n].ob = ob;
+    n++;
+  }
+  if (n > 1)
+    qsort(obs, n, sizeof(MTPSyncObject), sync_object_cmp);
+  *out = obs;
+  return n;
+}
 
-    // NOTE: File size is not updated, this should not change anyway.
-    // neither will we change the filename.
+static int sync_diff_folder(MTPSyncDiff *diff, char const * const localpath,
+			    char const * const relpath, uint32_t const parent,
+			    LIBMTP_sync_entry_t *parententry);
 
-    ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
+/**
+ * Add delete entries for a device object and, for a folder, everything
+ * below it, innermost first so that every folder is empty by the time
+ * it is deleted.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int sync_diff_delete(MTPSyncDiff *diff, char const * const relpath,
+			    PTPObject *ob)
+{
+  PTPParams *params = (PTPParams *) diff->device->params;
+  LIBMTP_sync_entry_t *entry;
+  int is_folder = (PTP_OB_FORMAT(params, ob) == PTP_OFC_Association);
+  uint32_t oid = ob->oid;
+  uint32_t parent = PTP_OB_PARENT(params, ob);
 
-    ptp_destroy_object_prop_list(props, nrofprops);
+  if (is_folder) {
+    MTPSyncObject *children;
+    char *path;
+    int n, i;
 
-    if (ret != PTP_RC_OK) {
-      // TODO: return error of which property we couldn't set
-      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-			      "could not set object property list.");
-      free(properties);
+    n = sync_read_device(diff, oid, &children);
+    if (n < 0)
       return -1;
+    path = malloc(strlen(relpath) + strlen(PTP_OB_NAME(params, ob)) + 2);
+    if (path == NULL) {
+      free(children);
+      return -1;
+    }
+    if (relpath[0] != '\0')
+      sprintf(path, "%s/%s", relpath, PTP_OB_NAME(params, ob));
+    else
+      strcpy(path, PTP_OB_NAME(params, ob));
+    for (i = 0; i < n; i++) {
+      if (sync_diff_delete(diff, path, children[i].ob) != 0) {
+	free(path);
+	free(children);
+	return -1;
+      }
     }
+    free(path);
+    free(children);
+  }
+  entry = sync_add_entry(diff, LIBMTP_SYNC_DELETE, relpath, PTP_OB_NAME(params, ob),
+			 is_folder);
+  if (entry == NULL)
+    return -1;
+  entry->item_id = oid;
+  entry->parent_id = parent;
+  return 0;
+}
 
-  } else if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjectPropValue)) {
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
+/**
+ * Add entries for a local file or directory missing on the device.
+ * @return 0 on success, -1 on failure.
+ */
+static int sync_diff_add(MTPSyncDiff *diff, char const * const localpath,
+			 char const * const relpath, MTPSyncLocal const *local,
+			 uint32_t const parent, LIBMTP_sync_entry_t *parententry)
+{
+  LIBMTP_sync_entry_t *entry;
+  char *sublocal;
+  int ret;
 
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], map_libmtp_type_to_ptp_type(metadata->filetype), &opd);
-      if (ret != PTP_RC_OK) {
-	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				"could not get property description.");
-      } else if (opd.GetSet) {
-	switch (properties[i]) {
-	case PTP_OPC_Name:
-	  // Update title
-	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Name, metadata->title);
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set track title.");
-	  }
-	  break;
-	case PTP_OPC_AlbumName:
-	  // Update album
-	  ret = set_object_string(device, metadata->item_id, PTP_OPC_AlbumName, metadata->album);
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set track album name.");
-	  }
-	  break;
-	case PTP_OPC_Artist:
-	  // Update artist
-	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Artist, metadata->artist);
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set track artist name.");
-	  }
-	  break;
-	case PTP_OPC_Composer:
-	  // Update composer
-	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Composer, metadata->composer);
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set track composer name.");
-	  }
-	  break;
-	case PTP_OPC_Genre:
-	  // Update genre (but only if valid)
-	  if (metadata->genre) {
-	    ret = set_object_string(device, metadata->item_id, PTP_OPC_Genre, metadata->genre);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				      "could not set genre.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_Duration:
-	  // Update duration
-	  if (metadata->duration != 0) {
-	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_Duration, adjust_u32(metadata->duration, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set track duration.");
-	    }
+  entry = sync_add_entry(diff, LIBMTP_SYNC_ADD, relpath, local->name,
+			 local->is_folder);
+  if (entry == NULL)
+    return -1;
+  entry->parent_id = parententry ? 0 : parent;
+  entry->parent = parententry;
+  entry->filesize = local->is_folder ? 0 : local->size;
+  entry->modificationdate = local->mtime;
+  if (!local->is_folder)
+    return 0;
+
+  // Everything below a new folder is new as well
+  sublocal = malloc(strlen(localpath) + strlen(local->name) + 2);
+  if (sublocal == NULL)
+    return -1;
+  sprintf(sublocal, "%s/%s", localpath, local->name);
+  ret = sync_diff_folder(diff, sublocal, entry->path, 0, entry);
+  free(sublocal);
+  return ret;
+}
+
+/**
+ * Compare one local directory with one device folder and recurse into
+ * the folders found in both. With parententry set the device folder is
+ * yet to be created, so everything local is added.
+ * @return 0 on success, -1 on failure.
+ */
+static int sync_diff_folder(MTPSyncDiff *diff, char const * const localpath,
+			    char const * const relpath, uint32_t const parent,
+			    LIBMTP_sync_entry_t *parententry)
+{
+  PTPParams *params = (PTPParams *) diff->device->params;
+  MTPSyncLocal *locals;
+  MTPSyncObject *obs = NULL;
+  int nlocal, nobs = 0;
+  int i = 0, j = 0;
+  int ret = 0;
+
+  nlocal = sync_read_local(localpath, &locals);
+  if (nlocal < 0) {
+    add_error_to_errorstack(diff->device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Sync_Diff(): could not read local directory.");
+    return -1;
+  }
+  if (parententry == NULL) {
+    nobs = sync_read_device(diff, parent, &obs);
+    if (nobs < 0) {
+      ret = -1;
+      goto out;
+    }
+  }
+
+  // Both lists are sorted by name, so walk them side by side
+  while (ret == 0 && (i < nlocal || j < nobs)) {
+    MTPSyncLocal *local = (i < nlocal) ? &locals[i] : NULL;
+    PTPObject *ob = (j < nobs) ? obs[j].ob : NULL;
+    int cmp;
+
+    if (local == NULL)
+      cmp = 1;
+    else if (ob == NULL)
+      cmp = -1;
+    else
+      cmp = strcasecmp(local->name, obs[j].name);
+
+    if (cmp < 0) {
+      ret = sync_diff_add(diff, localpath, relpath, local, parent, parententry);
+      i++;
+    } else if (cmp > 0) {
+      if (!(diff->flags & LIBMTP_SYNC_NO_DELETE))
+	ret = sync_diff_delete(diff, relpath, ob);
+      j++;
+    } else {
+      int ob_is_folder = (PTP_OB_FORMAT(params, ob) == PTP_OFC_Association);
+
+      if (local->is_folder && ob_is_folder) {
+	char *sublocal = malloc(strlen(localpath) + strlen(local->name) + 2);
+	char *subrel = malloc(strlen(relpath) + strlen(PTP_OB_NAME(params, ob)) + 2);
+
+	if (sublocal == NULL || subrel == NULL) {
+	  ret = -1;
+	} else {
+	  sprintf(sublocal, "%s/%s", localpath, local->name);
+	  if (relpath[0] != '\0')
+	    sprintf(subrel, "%s/%s", relpath, PTP_OB_NAME(params, ob));
+	  else
+	    strcpy(subrel, PTP_OB_NAME(params, ob));
+	  ret = sync_diff_folder(diff, sublocal, subrel, ob->oid, NULL);
+	}
+	free(sublocal);
+	free(subrel);
+      } else if (local->is_folder != ob_is_folder) {
+	// A file where there should be a folder or the other way round
+	ret = sync_diff_delete(diff, relpath, ob);
+	if (ret == 0)
+	  ret = sync_diff_add(diff, localpath, relpath, local, parent, NULL);
+      } else {
+	uint64_t size = object_cached_filesize(diff->device, ob);
+	int changed = (size != local->size);
+
+	// Devices keep times with a granularity of a second or two
+	if (!changed && !(diff->flags & LIBMTP_SYNC_SIZE_ONLY) &&
+	    ob->ModificationDate != 0 &&
+	    local->mtime > ob->ModificationDate + 2)
+	  changed = 1;
+	if (changed) {
+	  LIBMTP_sync_entry_t *entry;
+
+	  entry = sync_add_entry(diff, LIBMTP_SYNC_UPDATE, relpath,
+				 PTP_OB_NAME(params, ob), 0);
+	  if (entry == NULL) {
+	    ret = -1;
+	  } else {
+	    entry->item_id = ob->oid;
+	    entry->parent_id = parent;
+	    entry->filesize = local->size;
+	    entry->modificationdate = local->mtime;
 	  }
-	  break;
-	case PTP_OPC_Track:
-	  // Update track number.
-	  if (metadata->tracknumber != 0) {
-	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_Track, adjust_u16(metadata->tracknumber, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set track tracknumber.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_OriginalReleaseDate:
-	  // Update creation datetime
-	  // The date can be zero, but some devices do not support setting zero
-	  // dates (and it seems that a zero date should never be set anyway)
-	  if (metadata->date) {
-	    ret = set_object_string(device, metadata->item_id, PTP_OPC_OriginalReleaseDate, metadata->date);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set track release date.");
-	    }
-	  }
-	  break;
-	  // These are, well not so important.
-	case PTP_OPC_SampleRate:
-	  // Update sample rate
-	  if (metadata->samplerate != 0) {
-	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_SampleRate, adjust_u32(metadata->samplerate, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set samplerate.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_NumberOfChannels:
-	  // Update number of channels
-	  if (metadata->nochannels != 0) {
-	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_NumberOfChannels, adjust_u16(metadata->nochannels, &opd));
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set number of channels.");
-	  }
-	}
-	  break;
-	case PTP_OPC_AudioWAVECodec:
-	  // Update WAVE codec
-	  if (metadata->wavecodec != 0) {
-	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_AudioWAVECodec, adjust_u32(metadata->wavecodec, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set WAVE codec.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_AudioBitRate:
-	  // Update bitrate
-	  if (metadata->bitrate != 0) {
-	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_AudioBitRate, adjust_u32(metadata->bitrate, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set bitrate.");
-	  }
-	  }
-	  break;
-	case PTP_OPC_BitRateType:
-	  // Update bitrate type
-	  if (metadata->bitratetype != 0) {
-	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_BitRateType, adjust_u16(metadata->bitratetype, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set bitratetype.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_Rating:
-	  // Update user rating
-	  // TODO: shall this be set for rating 0?
-	  if (metadata->rating != 0) {
-	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_Rating, adjust_u16(metadata->rating, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set user rating.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_UseCount:
-	  // Update use count, set even to zero if desired.
-	  ret = set_object_u32(device, metadata->item_id, PTP_OPC_UseCount, adjust_u32(metadata->usecount, &opd));
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				  "could not set use count.");
-	  }
-	  break;
-	case PTP_OPC_DateModified:
-	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    // Update modification time if supported
-	    char *tmpstamp = get_iso8601_stamp();
-	    ret = set_object_string(device, metadata->item_id, PTP_OPC_DateModified, tmpstamp);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set modification date.");
-	    }
-	    free(tmpstamp);
-	  }
-	  break;
-
-	  // NOTE: File size is not updated, this should not change anyway.
-	  // neither will we change the filename.
-	default:
-	  break;
 	}
       }
-      ptp_free_objectpropdesc(&opd);
+      i++;
+      j++;
     }
-  } else {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-                            "Your device doesn't seem to support any known way of setting metadata.");
-    free(properties);
-    return -1;
   }
 
-  // update cached object properties if metadata cache exists
-  update_metadata_cache(device, metadata->item_id);
-
-  free(properties);
-
-  return 0;
+ out:
+  for (i = 0; i < nlocal; i++)
+    free(locals[i].name);
+  free(locals);
+  free(obs);
+  return ret;
 }
 
 /**
- * This function deletes a single file, track, playlist, folder or
- * any other object off the MTP device, identified by the object ID.
- *
- * If you delete a folder, there is no guarantee that the device will
- * really delete all the files that were in that folder, rather it is
- * expected that they will not be deleted, and will turn up in object
- * listings with parent set to a non-existant object ID. The safe way
- * to do this is to recursively delete all files (and folders) contained
- * in the folder, then the folder itself.
- *
- * @param device a pointer to the device to delete the object from.
- * @param object_id the object to delete.
- * @return 0 on success, any other value means failure.
+ * The storage a sync works on when none is given: the primary storage
+ * for the root folder, which spans all storages.
+ * @return the storage ID, 0 if the device has none.
  */
-int LIBMTP_Delete_Object(LIBMTP_mtpdevice_t *device,
-			 uint32_t object_id)
+static uint32_t sync_root_storage(LIBMTP_mtpdevice_t *device)
 {
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-
-  ret = ptp_deleteobject(params, object_id, 0);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Delete_Object(): could not delete object.");
-    return -1;
-  }
-
-  return 0;
+  want_storage(device);
+  return (device->storage != NULL) ? device->storage->id : 0;
 }
 
 /**
- * The function moves an object from one location on a device to another
- * location.
- *
- * The semantics of moving a folder are not defined in the spec, but it
- * appears to do the right thing when tested (but devices that implement
- * this operation are rare).
+ * This compares a local directory tree with a folder on the device
+ * and works out what has to be sent and deleted to make the device
+ * folder the same as the local one. Only the metadata cache is
+ * looked at, so nothing is read from the device, and paths are
+ * matched one folder at a time through the cached parent links, in
+ * the same case insensitive way as the device filesystems do.
  *
- * Note that moving an object may take a significant amount of time,
- * particularly if being moved between storages. MTP does not provide
- * any kind of progress mechanism, so the operation will simply block
- * for the duration.
+ * A file is considered changed if its size differs, or if the local
+ * file was modified later than the copy on the device (unless
+ * <code>LIBMTP_SYNC_SIZE_ONLY</code> is given). Entries are listed
+ * in an order in which they can be carried out: every folder to add
+ * comes before its contents, every folder to delete after them.
+ * Hand the list to <code>LIBMTP_Sync_Apply()</code> to carry it out,
+ * after adjusting it if you like, e.g. correcting the filetypes that
+ * were guessed from the filename extensions.
  *
- * @param device a pointer to the device where the object exists.
- * @param object_id the object to move.
- * @param storage_id the id of the destination storage.
- * @param parent_id the id of the destination parent object (folder).
- *	  If the destination is the root of the storage, pass '0'.
+ * @param device a pointer to the device to compare with. It must have
+ *        been opened with a metadata cache.
+ * @param localdir the local directory.
+ * @param storage the storage the device folder is on, or 0 for the
+ *        storage of the folder, the primary storage for the root.
+ *        Nothing on other storages is compared or deleted.
+ * @param folder the device folder, or
+ *        <code>LIBMTP_FILES_AND_FOLDERS_ROOT</code> for the root.
+ * @param flags <code>LIBMTP_SYNC_NO_DELETE</code> to leave objects
+ *        missing locally alone, <code>LIBMTP_SYNC_SIZE_ONLY</code> to
+ *        compare files by size only.
+ * @param entries returns the list of entries, NULL if the folders
+ *        are the same. Free it with
+ *        <code>LIBMTP_destroy_sync_entry_t()</code>.
  * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Sync_Apply()
  */
-int LIBMTP_Move_Object(LIBMTP_mtpdevice_t *device,
-		       uint32_t object_id,
-		       uint32_t storage_id,
-		       uint32_t parent_id)
+int LIBMTP_Sync_Diff(LIBMTP_mtpdevice_t *device,
+		     char const * const localdir,
+		     uint32_t const storage,
+		     uint32_t const folder,
+		     int const flags,
+		     LIBMTP_sync_entry_t **entries)
 {
-  uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
+  MTPSyncDiff diff;
 
-  ret = ptp_moveobject(params, object_id, storage_id, parent_id);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Move_Object(): could not move object.");
+  *entries = NULL;
+  if (!device->cached) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Sync_Diff(): device has no metadata cache.");
     return -1;
   }
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0) {
+    flush_handles(device);
+  }
+
+  memset(&diff, 0, sizeof(diff));
+  diff.device = device;
+  diff.storage = storage;
+  diff.flags = flags;
+  if (storage == 0) {
+    PTPObject *ob;
 
+    // The root lists every storage, keep to one of them
+    if (folder == 0 || folder == LIBMTP_FILES_AND_FOLDERS_ROOT)
+      diff.storage = sync_root_storage(device);
+    else if (ptp_object_find(params, folder, &ob) == PTP_RC_OK)
+      diff.storage = PTP_OB_STORAGE(params, ob);
+  }
+  // The root folder is parent 0 in the cache
+  if (sync_diff_folder(&diff, localdir, "",
+		       (folder == LIBMTP_FILES_AND_FOLDERS_ROOT) ? 0 : folder,
+		       NULL) != 0) {
+    LIBMTP_destroy_sync_entry_t(diff.first);
+    return -1;
+  }
+  *entries = diff.first;
   return 0;
 }
 
 /**
- * The function copies an object from one location on a device to another
- * location.
- *
- * The semantics of copying a folder are not defined in the spec, but it
- * appears to do the right thing when tested (but devices that implement
- * this operation are rare).
+ * This carries out a list of entries from
+ * <code>LIBMTP_Sync_Diff()</code>. Objects are deleted first, then
+ * the new folders are created, and then all files to add or update
+ * are sent in one batch with
+ * <code>LIBMTP_Send_Files_From_Files()</code>. Updated files are
+ * deleted on the device before being sent again, as MTP cannot
+ * overwrite an object.
  *
- * Note that copying an object may take a significant amount of time.
- * MTP does not provide any kind of progress mechanism, so the operation
- * will simply block for the duration.
+ * The <code>item_id</code> of every entry added is set to the new
+ * object, or left 0 if that failed; anything in a folder that could
+ * not be created is skipped. Errors are put on the error stack.
  *
- * @param device a pointer to the device where the object exists.
- * @param object_id the object to copy.
- * @param storage_id the id of the destination storage.
- * @param parent_id the id of the destination parent object (folder).
- *	  If the destination is the root of the storage, pass '0'.
- * @return 0 on success, any other value means failure.
- */
-int LIBMTP_Copy_Object(LIBMTP_mtpdevice_t *device,
-		       uint32_t object_id,
-		       uint32_t storage_id,
-		       uint32_t parent_id)
-{
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
+ * @param device a pointer to the device to change.
+ * @param localdir the local directory given to LIBMTP_Sync_Diff().
+ * @param storage the storage given to LIBMTP_Sync_Diff(). With 0
+ *        entries in the root go to the primary storage and all
+ *        others to the storage of their folder.
+ * @param entries the list of entries.
+ * @param callback a progress indicator function or NULL to ignore,
+ *        called for the batch of files sent.
+ * @param data a user-defined pointer that is passed along to
+ *        the <code>progress</code> function.
+ * @return 0 if all entries were carried out, any other value means
+ *         that some or all of them failed.
+ */
+int LIBMTP_Sync_Apply(LIBMTP_mtpdevice_t *device,
+		      char const * const localdir,
+		      uint32_t const storage,
+		      LIBMTP_sync_entry_t *entries,
+		      LIBMTP_progressfunc_t const callback,
+		      void const * const data)
+{
+  LIBMTP_sync_entry_t *entry;
+  LIBMTP_sync_entry_t **owners = NULL;
+  LIBMTP_file_t **files = NULL;
+  char **paths = NULL;
+  uint32_t rootstorage = storage ? storage : sync_root_storage(device);
+  uint32_t nroffiles = 0;
+  uint32_t i;
+  int failed = 0;
 
-  ret = ptp_copyobject(params, object_id, storage_id, parent_id);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Copy_Object(): could not copy object.");
-    return -1;
+  // Deletes first, which also makes room for what is sent
+  for (entry = entries; entry != NULL; entry = entry->next) {
+    if (entry->action == LIBMTP_SYNC_DELETE &&
+	LIBMTP_Delete_Object(device, entry->item_id) != 0)
+      failed = 1;
+    if (entry->action != LIBMTP_SYNC_DELETE && !entry->is_folder)
+      nroffiles++;
   }
 
-  return 0;
-}
-
-/**
- * Internal function to update an object filename property.
- */
-static int set_object_filename(LIBMTP_mtpdevice_t *device,
-			       uint32_t object_id, uint16_t ptp_type,
-			       const char **newname_ptr)
-{
-  PTPParams             *params = (PTPParams *) device->params;
-  PTP_USB               *ptp_usb = (PTP_USB*) device->usbinfo;
-  PTPObjectPropDesc     opd;
-  uint16_t              ret;
-  char                  *newname;
+  // Then the folders, outermost first as listed
+  for (entry = entries; entry != NULL; entry = entry->next) {
+    uint32_t parent;
+    char *name;
 
-  // See if we can modify the filename on this kind of files.
-  ret = ptp_mtp_getobjectpropdesc(params, PTP_OPC_ObjectFileName, ptp_type, &opd);
-  if (ret != PTP_RC_OK) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
-			    "could not get property description.");
+    if (entry->action != LIBMTP_SYNC_ADD || !entry->is_folder)
+      continue;
+    if (entry->parent != NULL && entry->parent->item_id == 0) {
+      failed = 1;
+      continue;
+    }
+    parent = entry->parent ? entry->parent->item_id : entry->parent_id;
+    name = strrchr(entry->path, '/');
+    name = strdup(name ? name + 1 : entry->path);
+    if (name == NULL) {
+      failed = 1;
+      continue;
+    }
+    entry->item_id = LIBMTP_Create_Folder(device, name,
+					  parent ? parent : LIBMTP_FILES_AND_FOLDERS_ROOT,
+					  parent ? storage : rootstorage);
+    free(name);
+    if (entry->item_id == 0)
+      failed = 1;
+  }
+
+  if (nroffiles == 0)
+    return failed ? -1 : 0;
+
+  // And all files in one batch
+  files = (LIBMTP_file_t **) calloc(nroffiles, sizeof(LIBMTP_file_t *));
+  paths = (char **) calloc(nroffiles, sizeof(char *));
+  owners = (LIBMTP_sync_entry_t **) calloc(nroffiles,
+					   sizeof(LIBMTP_sync_entry_t *));
+  if (files == NULL || paths == NULL || owners == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Sync_Apply(): out of memory.");
+    free(files);
+    free(paths);
+    free(owners);
     return -1;
   }
+  nroffiles = 0;
+  for (entry = entries; entry != NULL; entry = entry->next) {
+    LIBMTP_file_t *file;
+    char *name;
 
-  if (!opd.GetSet) {
-    ptp_free_objectpropdesc(&opd);
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
-            " property is not settable.");
-    // TODO: we COULD actually upload/download the object here, if we feel
-    //       like wasting time for the user.
-    return -1;
+    if (entry->action == LIBMTP_SYNC_DELETE || entry->is_folder)
+      continue;
+    if (entry->parent != NULL && entry->parent->item_id == 0) {
+      failed = 1;
+      continue;
+    }
+    file = LIBMTP_new_file_t();
+    paths[nroffiles] = malloc(strlen(localdir) + strlen(entry->path) + 2);
+    name = strrchr(entry->path, '/');
+    if (file == NULL || paths[nroffiles] == NULL ||
+	(file->filename = strdup(name ? name + 1 : entry->path)) == NULL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			      "LIBMTP_Sync_Apply(): out of memory.");
+      if (file != NULL)
+	LIBMTP_destroy_file_t(file);
+      free(paths[nroffiles]);
+      failed = 1;
+      continue;
+    }
+    sprintf(paths[nroffiles], "%s/%s", localdir, entry->path);
+    if (entry->action == LIBMTP_SYNC_UPDATE) {
+      if (LIBMTP_Delete_Object(device, entry->item_id) != 0) {
+	LIBMTP_destroy_file_t(file);
+	free(paths[nroffiles]);
+	failed = 1;
+	continue;
+      }
+      entry->item_id = 0;
+    }
+    file->parent_id = entry->parent ? entry->parent->item_id : entry->parent_id;
+    // Parent 0 would have the file moved to a default folder
+    if (file->parent_id == 0) {
+      file->parent_id = LIBMTP_FILES_AND_FOLDERS_ROOT;
+      file->storage_id = rootstorage;
+    } else {
+      file->storage_id = storage;
+    }
+    file->filesize = entry->filesize;
+    file->modificationdate = entry->modificationdate;
+    file->filetype = entry->filetype;
+    owners[nroffiles] = entry;
+    files[nroffiles++] = file;
   }
 
-  newname = strdup(*newname_ptr);
+  if (nroffiles != 0 &&
+      LIBMTP_Send_Files_From_Files(device, (char const * const *) paths, files,
+				   nroffiles, callback, data) != 0)
+    failed = 1;
 
-  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-    strip_7bit_from_utf8(newname);
+  // Hand the new object IDs back
+  for (i = 0; i < nroffiles; i++) {
+    owners[i]->item_id = files[i]->item_id;
+    LIBMTP_destroy_file_t(files[i]);
+    free(paths[i]);
   }
+  free(files);
+  free(paths);
+  free(owners);
+  return failed ? -1 : 0;
+}
 
-  if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
-      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
-    MTPProperties *props = NULL;
-    MTPProperties *prop = NULL;
-    int nrofprops = 0;
+/**
+ * This destroys a list of entries returned by
+ * <code>LIBMTP_Sync_Diff()</code>, all of it.
+ * @param entries the first entry of the list.
+ */
+void LIBMTP_destroy_sync_entry_t(LIBMTP_sync_entry_t *entries)
+{
+  while (entries != NULL) {
+    LIBMTP_sync_entry_t *next = entries->next;
 
-    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-    prop->ObjectHandle = object_id;
-    prop->property = PTP_OPC_ObjectFileName;
-    prop->datatype = PTP_DTC_STR;
-    prop->propval.str = newname;
+    free(entries->path);
+    free(entries);
+    entries = next;
+  }
+}
 
-    ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
+/**
+ * Bytes of file data LIBMTP_Get_Tree() lets queue up for the disk
+ * before the transfers wait for the writer to catch up.
+ */
+#define TREE_WRITE_QUEUE 0x400000
 
-    ptp_destroy_object_prop_list(props, nrofprops);
+/**
+ * One file or folder of a tree copied by LIBMTP_Get_Tree() or
+ * LIBMTP_Send_Tree().
+ */
+typedef struct {
+  char *path; // below the root, separated by '/'
+  uint32_t id;
+  uint32_t parent; // device folder, only used when sending
+  uint32_t storage;
+  uint64_t size;
+  time_t mtime;
+  int is_folder;
+} MTPTreeItem;
 
-    if (ret != PTP_RC_OK) {
-        add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
-              " could not set object property list.");
-        ptp_free_objectpropdesc(&opd);
-        return -1;
-    }
-  } else if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjectPropValue)) {
-    ret = set_object_string(device, object_id, PTP_OPC_ObjectFileName, newname);
-    if (ret != 0) {
-      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
-              " could not set object filename.");
-      ptp_free_objectpropdesc(&opd);
-      return -1;
-    }
-  } else {
-    free(newname);
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
-              " your device doesn't seem to support any known way of setting metadata.");
-    ptp_free_objectpropdesc(&opd);
-    return -1;
-  }
+/**
+ * State of one tree copy. The items are both the result of the walk
+ * and the queue of folders still to be listed, so the tree is walked
+ * breadth first without recursion.
+ */
+typedef struct {
+  LIBMTP_mtpdevice_t *device;
+  MTPTreeItem *items;
+  int nitems;
+  int allocated;
+  MTPTreeItem **files; // in the order they are copied
+  int nfiles;
+  int current; // index into files of the file being copied
+  uint64_t done; // bytes of the files before the current one
+  uint64_t start;
+  LIBMTP_tree_progress_t progress;
+  LIBMTP_treeprogressfunc_t callback;
+  void const *data;
+} MTPTree;
 
-  ptp_free_objectpropdesc(&opd);
+/**
+ * Pass the progress on to the caller, with the throughput so far.
+ * @return nonzero if the caller wants to cancel.
+ */
+static int tree_report(MTPTree *tree)
+{
+  uint64_t elapsed;
 
-  // update cached object properties if metadata cache exists
-  update_metadata_cache(device, object_id);
+  if (tree->callback == NULL)
+    return 0;
+  elapsed = usecs_now() - tree->start;
+  tree->progress.bytes_per_second = elapsed ?
+    tree->progress.bytes_done * 1000000 / elapsed : 0;
+  return tree->callback(&tree->progress, tree->data);
+}
 
-  return 0;
+/**
+ * Device filenames end up in local paths, so anything that could step
+ * out of the target directory is skipped.
+ */
+static int tree_name_ok(char const * const name)
+{
+  return name != NULL && name[0] != '\0' &&
+    strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+    strchr(name, '/') == NULL && strchr(name, '\\') == NULL;
 }
 
 /**
- * This function renames a single file.
- * This simply means that the PTP_OPC_ObjectFileName property
- * is updated, if this is supported by the device.
- *
- * @param device a pointer to the device that contains the file.
- * @param file the file metadata of the file to rename.
- *        On success, the filename member is updated. Be aware, that
- *        this name can be different than newname depending of device restrictions.
- * @param newname the new filename for this object.
- * @return 0 on success, any other value means failure.
+ * Append an item to a tree, in the folder item at index parent or at
+ * the root if parent is -1.
+ * @return the new item, NULL if out of memory.
  */
-int LIBMTP_Set_File_Name(LIBMTP_mtpdevice_t *device,
-                   LIBMTP_file_t *file, const char *newname)
+static MTPTreeItem *tree_add(MTPTree *tree, int const parent,
+			     char const * const name)
 {
-  int         ret;
+  char const *relpath;
+  MTPTreeItem *item;
 
-  ret = set_object_filename(device, file->item_id,
-			    map_libmtp_type_to_ptp_type(file->filetype),
-			    &newname);
+  if (tree->nitems == tree->allocated) {
+    int allocated = tree->allocated ? tree->allocated * 2 : 64;
+    MTPTreeItem *tmp;
 
-  if (ret != 0) {
-    return ret;
-  }
+    tmp = realloc(tree->items, allocated * sizeof(MTPTreeItem));
+    if (tmp == NULL)
+      return NULL;
+    tree->items = tmp;
+    tree->allocated = allocated;
+  }
+  relpath = (parent >= 0) ? tree->items[parent].path : "";
+  item = &tree->items[tree->nitems];
+  memset(item, 0, sizeof(MTPTreeItem));
+  item->path = malloc(strlen(relpath) + strlen(name) + 2);
+  if (item->path == NULL)
+    return NULL;
+  if (relpath[0] != '\0')
+    sprintf(item->path, "%s/%s", relpath, name);
+  else
+    strcpy(item->path, name);
+  tree->nitems++;
+  return item;
+}
 
-  free(file->filename);
-  file->filename = strdup(newname);
-  return ret;
+static void tree_free(MTPTree *tree)
+{
+  int i;
+
+  for (i = 0; i < tree->nitems; i++)
+    free(tree->items[i].path);
+  free(tree->items);
+  free(tree->files);
 }
 
 /**
- * This function renames a single folder.
- * This simply means that the PTP_OPC_ObjectFileName property
- * is updated, if this is supported by the device.
- *
- * @param device a pointer to the device that contains the file.
- * @param folder the folder metadata of the folder to rename.
- *        On success, the name member is updated. Be aware, that
- *        this name can be different than newname depending of device restrictions.
- * @param newname the new name for this object.
- * @return 0 on success, any other value means failure.
+ * @return a newly allocated local path for a path below the root,
+ *         NULL if out of memory.
  */
-int LIBMTP_Set_Folder_Name(LIBMTP_mtpdevice_t *device,
-                   LIBMTP_folder_t *folder, const char* newname)
+static char *tree_local_path(char const * const localdir,
+			     char const * const path)
 {
-  int ret;
-
-  ret = set_object_filename(device, folder->folder_id,
-			    PTP_OFC_Association,
-			    &newname);
+  char *full = malloc(strlen(localdir) + strlen(path) + 2);
 
-  if (ret != 0) {
-    return ret;
-    }
+  if (full == NULL)
+    return NULL;
+  if (path[0] != '\0')
+    sprintf(full, "%s/%s", localdir, path);
+  else
+    strcpy(full, localdir);
+  return full;
+}
 
-  free(folder->name);
-  folder->name = strdup(newname);
-  return ret;
+/**
+ * Creates a local directory, it is fine if it is already there.
+ */
+static int tree_make_dir(char const * const path)
+{
+#ifdef __WIN32__
+  if (mkdir(path) == 0 || errno == EEXIST)
+#else
+  if (mkdir(path, 0777) == 0 || errno == EEXIST)
+#endif
+    return 0;
+  return -1;
 }
 
 /**
- * This function renames a single track.
- * This simply means that the PTP_OPC_ObjectFileName property
- * is updated, if this is supported by the device.
- *
- * @param device a pointer to the device that contains the file.
- * @param track the track metadata of the track to rename.
- *        On success, the filename member is updated. Be aware, that
- *        this name can be different than newname depending of device restrictions.
- * @param newname the new filename for this object.
- * @return 0 on success, any other value means failure.
+ * Add the children of one device folder to a tree to download, from
+ * the metadata cache if there is one, otherwise asking the device.
+ * @return 0 on success, -1 if out of memory.
  */
-int LIBMTP_Set_Track_Name(LIBMTP_mtpdevice_t *device,
-                   LIBMTP_track_t *track, const char* newname)
+static int tree_list_device(MTPTree *tree, uint32_t const storage,
+			    int const parent, uint32_t const folder)
 {
-  int         ret;
+  LIBMTP_mtpdevice_t *device = tree->device;
+  MTPTreeItem *item;
 
-  ret = set_object_filename(device, track->item_id,
-			    map_libmtp_type_to_ptp_type(track->filetype),
-			    &newname);
+  if (device->cached) {
+    PTPParams *params = (PTPParams *) device->params;
+    PTPObject *ob = NULL;
+    // The root folder is parent 0 in the cache
+    uint32_t cacheparent = (folder == LIBMTP_FILES_AND_FOLDERS_ROOT) ? 0 : folder;
 
-  if (ret != 0) {
-    return ret;
+    while ((ob = ptp_objects_next_by_parent(params, cacheparent, ob)) != NULL) {
+      if (storage != 0 && PTP_OB_STORAGE(params, ob) != storage)
+	continue;
+      if (!tree_name_ok(PTP_OB_NAME(params, ob)))
+	continue;
+      item = tree_add(tree, parent, PTP_OB_NAME(params, ob));
+      if (item == NULL)
+	return -1;
+      item->id = ob->oid;
+      item->storage = PTP_OB_STORAGE(params, ob);
+      item->is_folder = (PTP_OB_FORMAT(params, ob) == PTP_OFC_Association);
+      item->size = item->is_folder ? 0 : object_cached_filesize(device, ob);
+      item->mtime = ob->ModificationDate;
+    }
+  } else {
+    LIBMTP_file_t *files = LIBMTP_Get_Files_And_Folders(device, storage, folder);
+
+    while (files != NULL) {
+      LIBMTP_file_t *file = files;
+
+      files = file->next;
+      if (tree_name_ok(file->filename)) {
+	item = tree_add(tree, parent, file->filename);
+	if (item == NULL) {
+	  while (file != NULL) {
+	    files = file->next;
+	    LIBMTP_destroy_file_t(file);
+	    file = files;
+	  }
+	  return -1;
+	}
+	item->id = file->item_id;
+	item->storage = file->storage_id;
+	item->is_folder = (file->filetype == LIBMTP_FILETYPE_FOLDER);
+	item->size = item->is_folder ? 0 : file->filesize;
+	item->mtime = file->modificationdate;
+      }
+      LIBMTP_destroy_file_t(file);
+    }
   }
+  return 0;
+}
 
-  free(track->filename);
-  track->filename = strdup(newname);
-  return ret;
+static int tree_transfer_cmp(const void *a, const void *b)
+{
+  MTPTreeItem const *x = *(MTPTreeItem * const *) a;
+  MTPTreeItem const *y = *(MTPTreeItem * const *) b;
+
+  if (x->storage != y->storage)
+    return (x->storage < y->storage) ? -1 : 1;
+  if (x->id != y->id)
+    return (x->id < y->id) ? -1 : 1;
+  return 0;
 }
 
+#define TREE_OPEN 0
+#define TREE_WRITE 1
+#define TREE_CLOSE 2
+
 /**
- * This function renames a single playlist object file holder.
- * This simply means that the <code>PTP_OPC_ObjectFileName</code>
- * property is updated, if this is supported by the device.
- * The playlist filename should nominally end with an extension
- * like ".pla".
- *
- * NOTE: if you want to change the metadata the device display
- * about a playlist you must <i>not</i> use this function,
- * use <code>LIBMTP_Update_Playlist()</code> instead!
- *
- * @param device a pointer to the device that contains the file.
- * @param playlist the playlist metadata of the playlist to rename.
- *        On success, the name member is updated. Be aware, that
- *        this name can be different than newname depending of device restrictions.
- * @param newname the new name for this object.
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Update_Playlist()
+ * Something the disk writer of LIBMTP_Get_Tree() is asked to do.
  */
-int LIBMTP_Set_Playlist_Name(LIBMTP_mtpdevice_t *device,
-                   LIBMTP_playlist_t *playlist, const char* newname)
+typedef struct tree_write_struct {
+  int op;
+  char *path; // TREE_OPEN
+  time_t mtime; // TREE_OPEN
+  int ok; // TREE_CLOSE, whether the transfer succeeded
+  unsigned char *data; // TREE_WRITE
+  unsigned long len; // TREE_WRITE
+  struct tree_write_struct *next;
+} MTPTreeWrite;
+
+/**
+ * Writes the files of LIBMTP_Get_Tree() to disk. With threads this is
+ * done by a thread of its own, so opening, writing and closing the
+ * local files overlaps with the USB transfers, otherwise it is done
+ * in line. All but the queue is only touched by the writer.
+ */
+typedef struct {
+  int fd;
+  char *path;
+  time_t mtime;
+  int failed; // the current file could not be written
+  int errors; // files that could not be written
+#ifdef HAVE_PTHREAD_H
+  int threaded;
+  int stop;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  MTPTreeWrite *first;
+  MTPTreeWrite *last;
+  unsigned long queued;
+#endif
+} MTPTreeWriter;
+
+static void tree_write_free(MTPTreeWrite *op)
 {
-  int ret;
+  free(op->path);
+  free(op->data);
+  free(op);
+}
 
-  ret = set_object_filename(device, playlist->playlist_id,
-			    PTP_OFC_MTP_AbstractAudioVideoPlaylist,
-			    &newname);
+static void tree_write_apply(MTPTreeWriter *w, MTPTreeWrite *op)
+{
+  unsigned char *p;
+  unsigned long left;
 
-  if (ret != 0) {
-    return ret;
-  }
+  switch (op->op) {
+  case TREE_OPEN:
+    w->path = op->path;
+    op->path = NULL;
+    w->mtime = op->mtime;
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+    w->fd = _open(w->path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,_S_IREAD);
+#else
+    w->fd = open(w->path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,S_IRWXU);
+#endif
+#else
+    w->fd = open(w->path, O_RDWR|O_CREAT|O_TRUNC,S_IRWXU|S_IRGRP);
+#endif
+    w->failed = (w->fd == -1);
+    if (w->failed) {
+      // Nothing of ours to clean up on close, the path may be someone else's
+      free(w->path);
+      w->path = NULL;
+    }
+    break;
+  case TREE_WRITE:
+    p = op->data;
+    left = op->len;
+    while (!w->failed && left > 0) {
+#ifdef USE_WINDOWS_IO_H
+      int n = _write(w->fd, p, left);
+#else
+      ssize_t n = write(w->fd, p, left);
+#endif
 
-  free(playlist->name);
-  playlist->name = strdup(newname);
-  return ret;
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0) {
+	w->failed = 1;
+	break;
+      }
+      p += n;
+      left -= n;
+    }
+    break;
+  case TREE_CLOSE:
+    if (w->fd != -1) {
+#ifdef USE_WINDOWS_IO_H
+      if (_close(w->fd) != 0)
+#else
+      if (close(w->fd) != 0)
+#endif
+	w->failed = 1;
+      w->fd = -1;
+    }
+    if (w->failed || !op->ok) {
+      // A failed transfer is reported by the caller
+      if (op->ok)
+	w->errors++;
+      if (w->path != NULL)
+	unlink(w->path);
+    } else {
+#ifdef HAVE_UTIME_H
+      if (w->mtime != 0) {
+	struct utimbuf times;
+
+	times.actime = w->mtime;
+	times.modtime = w->mtime;
+	(void) utime(w->path, &times);
+      }
+#endif
+    }
+    free(w->path);
+    w->path = NULL;
+    w->failed = 0;
+    break;
+  }
 }
 
-/**
- * This function renames a single album.
- * This simply means that the <code>PTP_OPC_ObjectFileName</code>
- * property is updated, if this is supported by the device.
- * The album filename should nominally end with an extension
- * like ".alb".
- *
- * NOTE: if you want to change the metadata the device display
- * about a playlist you must <i>not</i> use this function,
- * use <code>LIBMTP_Update_Album()</code> instead!
- *
- * @param device a pointer to the device that contains the file.
- * @param album the album metadata of the album to rename.
- *        On success, the name member is updated. Be aware, that
- *        this name can be different than newname depending of device restrictions.
- * @param newname the new name for this object.
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Update_Album()
- */
-int LIBMTP_Set_Album_Name(LIBMTP_mtpdevice_t *device,
-                   LIBMTP_album_t *album, const char* newname)
+#ifdef HAVE_PTHREAD_H
+static void *tree_writer_thread(void *arg)
 {
-  int ret;
+  MTPTreeWriter *w = (MTPTreeWriter *) arg;
 
-  ret = set_object_filename(device, album->album_id,
-			    PTP_OFC_MTP_AbstractAudioAlbum,
-			    &newname);
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    MTPTreeWrite *op;
 
-  if (ret != 0) {
-    return ret;
+    while (w->first == NULL && !w->stop)
+      pthread_cond_wait(&w->cond, &w->lock);
+    op = w->first;
+    if (op == NULL)
+      break;
+    w->first = op->next;
+    if (w->first == NULL)
+      w->last = NULL;
+    pthread_mutex_unlock(&w->lock);
+
+    tree_write_apply(w, op);
+
+    pthread_mutex_lock(&w->lock);
+    w->queued -= op->len;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    tree_write_free(op);
+    pthread_mutex_lock(&w->lock);
   }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+#endif
 
-  free(album->name);
-  album->name = strdup(newname);
-  return ret;
+static void tree_writer_start(MTPTreeWriter *w)
+{
+  memset(w, 0, sizeof(MTPTreeWriter));
+  w->fd = -1;
+#ifdef HAVE_PTHREAD_H
+  // Without a thread everything is simply written in line
+  if (pthread_mutex_init(&w->lock, NULL) != 0)
+    return;
+  if (pthread_cond_init(&w->cond, NULL) != 0) {
+    pthread_mutex_destroy(&w->lock);
+    return;
+  }
+  if (pthread_create(&w->thread, NULL, tree_writer_thread, w) != 0) {
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    return;
+  }
+  w->threaded = 1;
+#endif
 }
 
 /**
- * THIS FUNCTION IS DEPRECATED. PLEASE UPDATE YOUR CODE IN ORDER
- * NOT TO USE IT.
- *
- * @see LIBMTP_Set_File_Name()
- * @see LIBMTP_Set_Track_Name()
- * @see LIBMTP_Set_Folder_Name()
- * @see LIBMTP_Set_Playlist_Name()
- * @see LIBMTP_Set_Album_Name()
+ * Waits for everything queued to be written.
+ * @return the number of files that could not be written.
  */
-int LIBMTP_Set_Object_Filename(LIBMTP_mtpdevice_t *device,
-                   uint32_t object_id, char* newname)
+static int tree_writer_stop(MTPTreeWriter *w)
 {
-  int             ret;
-  LIBMTP_file_t   *file;
-
-  file = LIBMTP_Get_Filemetadata(device, object_id);
+#ifdef HAVE_PTHREAD_H
+  if (w->threaded) {
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    w->threaded = 0;
+  }
+#endif
+  return w->errors;
+}
 
-  if (file == NULL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Set_Object_Filename(): "
-			    "could not get file metadata for target object.");
-    return -1;
+/**
+ * Hands an operation to the writer, which frees it once done. Waits
+ * while too much data is queued.
+ */
+static void tree_write_submit(MTPTreeWriter *w, MTPTreeWrite *op)
+{
+#ifdef HAVE_PTHREAD_H
+  if (w->threaded) {
+    pthread_mutex_lock(&w->lock);
+    while (w->queued > TREE_WRITE_QUEUE)
+      pthread_cond_wait(&w->cond, &w->lock);
+    op->next = NULL;
+    if (w->last != NULL)
+      w->last->next = op;
+    else
+      w->first = op;
+    w->last = op;
+    w->queued += op->len;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return;
   }
+#endif
+  tree_write_apply(w, op);
+  tree_write_free(op);
+}
 
-  ret = set_object_filename(device, object_id, map_libmtp_type_to_ptp_type(file->filetype), (const char **) &newname);
+static uint16_t tree_put_func(PTPParams *params, void *priv,
+			      unsigned long sendlen, unsigned char *data)
+{
+  MTPTreeWriter *w = (MTPTreeWriter *) priv;
+  MTPTreeWrite op;
 
-  free(file);
+  (void) params;
+  if (sendlen == 0)
+    return PTP_RC_OK;
+#ifdef HAVE_PTHREAD_H
+  if (w->threaded) {
+    MTPTreeWrite *copy = (MTPTreeWrite *) calloc(1, sizeof(MTPTreeWrite));
 
-  return ret;
+    if (copy == NULL)
+      return PTP_ERROR_IO;
+    copy->data = malloc(sendlen);
+    if (copy->data == NULL) {
+      free(copy);
+      return PTP_ERROR_IO;
+    }
+    memcpy(copy->data, data, sendlen);
+    copy->op = TREE_WRITE;
+    copy->len = sendlen;
+    tree_write_submit(w, copy);
+    return PTP_RC_OK;
+  }
+#endif
+  // In line there is no need to copy the data
+  memset(&op, 0, sizeof(op));
+  op.op = TREE_WRITE;
+  op.data = data;
+  op.len = sendlen;
+  tree_write_apply(w, &op);
+  return w->failed ? PTP_ERROR_IO : PTP_RC_OK;
 }
 
-/**
- * Helper function. This indicates if a track exists on the device
- * @param device a pointer to the device to get the track from.
- * @param id the track ID of the track to retrieve.
- * @return TRUE (!=0) if the track exists, FALSE (0) if not
- */
-int LIBMTP_Track_Exists(LIBMTP_mtpdevice_t *device,
-           uint32_t const id)
+static int tree_get_progress(uint64_t const sent, uint64_t const total,
+			     void const * const data)
 {
-  PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
-  PTPObject *ob;
+  MTPTree *tree = (MTPTree *) data;
+  uint64_t size = tree->files[tree->current]->size;
 
-  ret = ptp_object_want (params, id, 0, &ob);
-  if (ret == PTP_RC_OK)
-      return -1;
-  return 0;
+  (void) total;
+  // The transfer counts the request header as well
+  tree->progress.bytes_done = tree->done + ((sent < size) ? sent : size);
+  return tree_report(tree);
 }
 
 /**
- * This creates a new folder structure and allocates memory
- * for it. Notice that if you add strings to this structure they
- * will be freed by the corresponding <code>LIBMTP_folder_track_t</code>
- * operation later, so be careful of using strdup() when assigning
- * strings, e.g.:
+ * This copies a folder on the device, with everything below it, to a
+ * local directory. All folders are listed first, breadth first, from
+ * the metadata cache if the device has one and otherwise by asking
+ * the device one folder at a time, so the totals are known before the
+ * first transfer, and the local directories are created as they are
+ * found. The files are then fetched in object ID order, which on most
+ * devices is the order they were written in, while a writer thread
+ * creates and writes the local files so the disk does not hold up the
+ * transfers.
  *
- * @return a pointer to the newly allocated folder structure.
- * @see LIBMTP_destroy_folder_t()
- */
-LIBMTP_folder_t *LIBMTP_new_folder_t(void)
-{
-  LIBMTP_folder_t *new = (LIBMTP_folder_t *) malloc(sizeof(LIBMTP_folder_t));
-  if (new == NULL) {
-    return NULL;
-  }
-  new->folder_id = 0;
-  new->parent_id = 0;
-  new->storage_id = 0;
-  new->name = NULL;
-  new->sibling = NULL;
-  new->child = NULL;
-  return new;
-}
-
-/**
- * This recursively deletes the memory for a folder structure.
- * This shall typically be called on a top-level folder list to
- * destroy the entire folder tree.
+ * Existing local files are overwritten. Files that fail are removed
+ * again and skipped, and names that could step outside of
+ * <code>localdir</code> are ignored. Errors are put on the error stack.
  *
- * @param folder folder structure to destroy
- * @see LIBMTP_new_folder_t()
- */
-void LIBMTP_destroy_folder_t(LIBMTP_folder_t *folder)
+ * @param device a pointer to the device to copy from.
+ * @param storage the storage to copy from, or 0 for all.
+ * @param folder the device folder to copy, or
+ *        <code>LIBMTP_FILES_AND_FOLDERS_ROOT</code> for the root.
+ * @param localdir the local directory to copy to, created if missing.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *        the <code>progress</code> function.
+ * @return 0 if every file was copied, any other value means that some
+ *         or all of them failed.
+ * @see LIBMTP_Send_Tree()
+ */
+int LIBMTP_Get_Tree(LIBMTP_mtpdevice_t *device,
+		    uint32_t const storage,
+		    uint32_t const folder,
+		    char const * const localdir,
+		    LIBMTP_treeprogressfunc_t const callback,
+		    void const * const data)
 {
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPDataHandler handler;
+  MTPTreeWriter writer;
+  MTPTree tree;
+  int failed = 0;
+  int i;
 
-  if(folder == NULL) {
-     return;
-  }
+  memset(&tree, 0, sizeof(tree));
+  tree.device = device;
+  tree.callback = callback;
+  tree.data = data;
+  tree.start = usecs_now();
 
-  //Destroy from the bottom up
-  if(folder->child != NULL) {
-     LIBMTP_destroy_folder_t(folder->child);
-  }
+  // Get all the handles if we haven't already done that
+  if (device->cached && params->nrofobjects == 0)
+    flush_handles(device);
 
-  if(folder->sibling != NULL) {
-    LIBMTP_destroy_folder_t(folder->sibling);
+  if (tree_make_dir(localdir) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Get_Tree(): could not create local directory.");
+    return -1;
   }
+  if (tree_list_device(&tree, storage, -1, folder) != 0)
+    goto nomem;
+  for (i = 0; i < tree.nitems; i++) {
+    char *local;
 
-  if(folder->name != NULL) {
-    free(folder->name);
+    if (!tree.items[i].is_folder) {
+      tree.progress.files_total++;
+      tree.progress.bytes_total += tree.items[i].size;
+      continue;
+    }
+    local = tree_local_path(localdir, tree.items[i].path);
+    if (local == NULL)
+      goto nomem;
+    if (tree_make_dir(local) != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			      "LIBMTP_Get_Tree(): could not create local directory.");
+      free(local);
+      tree_free(&tree);
+      return -1;
+    }
+    free(local);
+    if (tree_list_device(&tree, storage, i, tree.items[i].id) != 0)
+      goto nomem;
   }
-
-  free(folder);
-}
-
-/**
- * Helper function. Returns a folder structure for a
- * specified id.
- *
- * @param folderlist list of folders to search
- * @id id of folder to look for
- * @return a folder or NULL if not found
- */
-LIBMTP_folder_t *LIBMTP_Find_Folder(LIBMTP_folder_t *folderlist, uint32_t id)
-{
-  LIBMTP_folder_t *ret = NULL;
-
-  if(folderlist == NULL) {
-    return NULL;
+  if (tree.progress.files_total == 0) {
+    tree_free(&tree);
+    return 0;
   }
 
-  if(folderlist->folder_id == id) {
-    return folderlist;
+  tree.files = (MTPTreeItem **) malloc(tree.progress.files_total *
+				       sizeof(MTPTreeItem *));
+  if (tree.files == NULL)
+    goto nomem;
+  for (i = 0; i < tree.nitems; i++) {
+    if (!tree.items[i].is_folder)
+      tree.files[tree.nfiles++] = &tree.items[i];
   }
+  qsort(tree.files, tree.nfiles, sizeof(MTPTreeItem *), tree_transfer_cmp);
 
-  if(folderlist->sibling) {
-    ret = LIBMTP_Find_Folder(folderlist->sibling, id);
+  if (tree_report(&tree)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED,
+			    "LIBMTP_Get_Tree(): Cancelled transfer.");
+    tree_free(&tree);
+    return -1;
   }
 
-  if(folderlist->child && ret == NULL) {
-    ret = LIBMTP_Find_Folder(folderlist->child, id);
+  handler.getfunc = NULL;
+  handler.putfunc = tree_put_func;
+  handler.getbuffunc = NULL;
+  handler.priv = &writer;
+  tree_writer_start(&writer);
+  for (i = 0; i < tree.nfiles; i++) {
+    MTPTreeItem *item = tree.files[i];
+    MTPTreeWrite *open_op = (MTPTreeWrite *) calloc(1, sizeof(MTPTreeWrite));
+    MTPTreeWrite *close_op = (MTPTreeWrite *) calloc(1, sizeof(MTPTreeWrite));
+    uint16_t ret;
+
+    if (open_op == NULL || close_op == NULL ||
+	(open_op->path = tree_local_path(localdir, item->path)) == NULL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			      "LIBMTP_Get_Tree(): out of memory.");
+      free(open_op);
+      free(close_op);
+      failed = 1;
+      break;
+    }
+    open_op->op = TREE_OPEN;
+    open_op->mtime = item->mtime;
+    tree_write_submit(&writer, open_op);
+
+    tree.current = i;
+    tree.progress.path = item->path;
+    ptp_usb->callback_active = 1;
+    ptp_usb->current_transfer_total = item->size +
+      PTP_USB_BULK_HDR_LEN+sizeof(uint32_t); // Request length, one parameter
+    ptp_usb->current_transfer_complete = 0;
+    ptp_usb->current_transfer_callback = tree_get_progress;
+    ptp_usb->current_transfer_callback_data = &tree;
+
+    transfer_checksum_begin(device);
+    ret = ptp_getobject_to_handler(params, item->id, &handler);
+    transfer_checksum_end(device, ret == PTP_RC_OK);
+
+    ptp_usb->callback_active = 0;
+    ptp_usb->current_transfer_callback = NULL;
+    ptp_usb->current_transfer_callback_data = NULL;
+
+    close_op->op = TREE_CLOSE;
+    close_op->ok = (ret == PTP_RC_OK);
+    tree_write_submit(&writer, close_op);
+
+    if (ret == PTP_ERROR_CANCEL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED,
+			      "LIBMTP_Get_Tree(): Cancelled transfer.");
+      failed = 1;
+      break;
+    }
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Tree(): "
+				  "Could not get file from device.");
+      failed = 1;
+    }
+    tree.done += item->size;
+    tree.progress.bytes_done = tree.done;
+    tree.progress.files_done++;
+    if (tree_report(&tree)) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED,
+			      "LIBMTP_Get_Tree(): Cancelled transfer.");
+      failed = 1;
+      break;
+    }
+  }
+  if (tree_writer_stop(&writer) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Get_Tree(): Could not write to file.");
+    failed = 1;
   }
+  tree_free(&tree);
+  return failed ? -1 : 0;
 
-  return ret;
+ nomem:
+  add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			  "LIBMTP_Get_Tree(): out of memory.");
+  tree_free(&tree);
+  return -1;
 }
 
 /**
- * Function used to recursively get subfolders from params.
+ * Add the contents of one local directory to a tree to send, in the
+ * folder item at index parent or at the root if parent is -1.
+ * @return 0 on success, -1 on failure.
  */
-static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_t parent)
+static int tree_list_local(MTPTree *tree, char const * const localdir,
+			   int const parent, uint32_t const folder)
 {
-  LIBMTP_folder_t *retfolders = NULL;
-  LIBMTP_folder_t *children, *iter, *curr;
-
-  iter = list->sibling;
-  while(iter != list) {
-    if (iter->parent_id != parent) {
-      iter = iter->sibling;
-      continue;
-    }
-
-    /* We know that iter is a child of 'parent', therefore we can safely
-     * hold on to 'iter' locally since no one else will steal it
-     * from the 'list' as we recurse. */
-    children = get_subfolders_for_folder(list, iter->folder_id);
+  MTPSyncLocal *locals;
+  char *path;
+  int n, i;
+  int ret = 0;
 
-    curr = iter;
-    iter = iter->sibling;
+  path = tree_local_path(localdir, (parent >= 0) ? tree->items[parent].path : "");
+  if (path == NULL)
+    return -1;
+  n = sync_read_local(path, &locals);
+  free(path);
+  if (n < 0)
+    return -1;
+  for (i = 0; i < n; i++) {
+    MTPTreeItem *item = tree_add(tree, parent, locals[i].name);
 
-    // Remove curr from the list.
-    curr->child->sibling = curr->sibling;
-    curr->sibling->child = curr->child;
+    if (item == NULL) {
+      ret = -1;
+      break;
+    }
+    item->parent = folder;
+    item->is_folder = locals[i].is_folder;
+    item->size = locals[i].is_folder ? 0 : locals[i].size;
+    item->mtime = locals[i].mtime;
+  }
+  for (i = 0; i < n; i++)
+    free(locals[i].name);
+  free(locals);
+  return ret;
+}
 
-    // Attach the children to curr.
-    curr->child = children;
+static int tree_send_progress(uint64_t const sent, uint64_t const total,
+			      void const * const data)
+{
+  MTPTree *tree = (MTPTree *) data;
 
-    // Put this folder into the list of siblings.
-    curr->sibling = retfolders;
-    retfolders = curr;
+  (void) total;
+  // The batch only reports bytes, work out which file they are in
+  while (tree->current < tree->nfiles &&
+	 tree->done + tree->files[tree->current]->size <= sent) {
+    tree->done += tree->files[tree->current]->size;
+    tree->current++;
   }
-
-  return retfolders;
+  tree->progress.files_done = tree->current;
+  tree->progress.bytes_done = (sent < tree->progress.bytes_total) ?
+    sent : tree->progress.bytes_total;
+  if (tree->current < tree->nfiles)
+    tree->progress.path = tree->files[tree->current]->path;
+  return tree_report(tree);
 }
 
 /**
- * This returns a list of all folders available
- * on the current MTP device.
+ * This copies a local directory, with everything below it, into a
+ * folder on the device. The local tree is walked breadth first and
+ * every folder is created with <code>LIBMTP_Create_Folder()</code>
+ * as soon as it is found, then all files are sent in one batch with
+ * <code>LIBMTP_Send_Files_From_Files()</code>, folder by folder, so
+ * the metadata of each folder is brought up to date in one go.
  *
- * @param device a pointer to the device to get the folder listing for.
- * @param storage a storage ID to get the folder list from
- * @return a list of folders
- */
- LIBMTP_folder_t *LIBMTP_Get_Folder_List_For_Storage(LIBMTP_mtpdevice_t *device,
-						    uint32_t const storage)
-{
-  PTPParams *params = (PTPParams *) device->params;
-  LIBMTP_folder_t head, *rv;
-  unsigned int i;
+ * Anything in a folder that could not be created is skipped. Errors
+ * are put on the error stack.
+ *
+ * @param device a pointer to the device to copy to.
+ * @param localdir the local directory to copy.
+ * @param storage the storage to copy to, or 0 for the primary storage.
+ * @param folder the device folder to copy into, or
+ *        <code>LIBMTP_FILES_AND_FOLDERS_ROOT</code> for the root.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *        the <code>progress</code> function.
+ * @return 0 if everything was copied, any other value means that some
+ *         or all of it failed.
+ * @see LIBMTP_Get_Tree()
+ */
+int LIBMTP_Send_Tree(LIBMTP_mtpdevice_t *device,
+		     char const * const localdir,
+		     uint32_t const storage,
+		     uint32_t const folder,
+		     LIBMTP_treeprogressfunc_t const callback,
+		     void const * const data)
+{
+  MTPTree tree;
+  LIBMTP_file_t **files = NULL;
+  char **paths = NULL;
+  uint32_t root = (folder == 0) ? LIBMTP_FILES_AND_FOLDERS_ROOT : folder;
+  uint32_t rootstorage = storage ? storage : sync_root_storage(device);
+  int failed = 0;
+  int i;
 
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
-  }
+  memset(&tree, 0, sizeof(tree));
+  tree.device = device;
+  tree.callback = callback;
+  tree.data = data;
+  tree.start = usecs_now();
 
-  /*
-   * This creates a temporary list of the folders, this is in a
-   * reverse order and uses the Folder pointers that are already
-   * in the Folder structure. From this we can then build up the
-   * folder hierarchy with only looking at this temporary list,
-   * and removing the folders from this temporary list as we go.
-   * This significantly reduces the number of operations that we
-   * have to do in building the folder hierarchy. Also since the
-   * temp list is in reverse order, when we prepend to the sibling
-   * list things are in the same order as they were originally
-   * in the handle list.
-   */
-  head.sibling = &head;
-  head.child = &head;
-  for (i = 0; i < params->nrofobjects; i++) {
-    LIBMTP_folder_t *folder;
-    PTPObject *ob;
+  if (tree_list_local(&tree, localdir, -1, root) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_Tree(): could not read local directory.");
+    tree_free(&tree);
+    return -1;
+  }
+  for (i = 0; i < tree.nitems; i++) {
+    char *name;
 
-    ob = &params->objects[i];
-    if (ob->oi.ObjectFormat != PTP_OFC_Association) {
+    if (!tree.items[i].is_folder) {
+      tree.progress.files_total++;
+      tree.progress.bytes_total += tree.items[i].size;
       continue;
     }
-
-    if (storage != PTP_GOH_ALL_STORAGE && storage != ob->oi.StorageID) {
+    name = strrchr(tree.items[i].path, '/');
+    name = strdup(name ? name + 1 : tree.items[i].path);
+    if (name == NULL) {
+      failed = 1;
       continue;
     }
-
-    /*
-     * Do we know how to handle these? They are part
-     * of the MTP 1.0 specification paragraph 3.6.4.
-     * For AssociationDesc 0x00000001U ptp_mtp_getobjectreferences()
-     * should be called on these to get the contained objects, but
-     * we basically don't care. Hopefully parent_id is maintained for all
-     * children, because we rely on that instead.
-     */
-    if (ob->oi.AssociationDesc != 0x00000000U) {
-      LIBMTP_INFO("MTP extended association type 0x%08x encountered\n", ob->oi.AssociationDesc);
+    tree.items[i].id = LIBMTP_Create_Folder(device, name,
+					    tree.items[i].parent,
+					    (tree.items[i].parent == LIBMTP_FILES_AND_FOLDERS_ROOT) ?
+					    rootstorage : storage);
+    free(name);
+    if (tree.items[i].id == 0) {
+      failed = 1;
+      continue;
     }
+    if (tree_list_local(&tree, localdir, i, tree.items[i].id) != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			      "LIBMTP_Send_Tree(): could not read local directory.");
+      failed = 1;
+    }
+  }
+  if (tree.progress.files_total == 0) {
+    tree_free(&tree);
+    return failed ? -1 : 0;
+  }
+
+  tree.files = (MTPTreeItem **) calloc(tree.progress.files_total,
+				       sizeof(MTPTreeItem *));
+  files = (LIBMTP_file_t **) calloc(tree.progress.files_total,
+				    sizeof(LIBMTP_file_t *));
+  paths = (char **) calloc(tree.progress.files_total, sizeof(char *));
+  if (tree.files == NULL || files == NULL || paths == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Send_Tree(): out of memory.");
+    free(files);
+    free(paths);
+    tree_free(&tree);
+    return -1;
+  }
+  // Files were listed a folder at a time, so that is the order they go in
+  for (i = 0; i < tree.nitems; i++) {
+    MTPTreeItem *item = &tree.items[i];
+    LIBMTP_file_t *file;
+    char *name;
 
-    // Create a folder struct...
-    folder = LIBMTP_new_folder_t();
-    if (folder == NULL) {
-      // malloc failure or so.
-      return NULL;
+    if (item->is_folder)
+      continue;
+    file = LIBMTP_new_file_t();
+    paths[tree.nfiles] = tree_local_path(localdir, item->path);
+    name = strrchr(item->path, '/');
+    if (file == NULL || paths[tree.nfiles] == NULL ||
+	(file->filename = strdup(name ? name + 1 : item->path)) == NULL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			      "LIBMTP_Send_Tree(): out of memory.");
+      if (file != NULL)
+	LIBMTP_destroy_file_t(file);
+      free(paths[tree.nfiles]);
+      paths[tree.nfiles] = NULL;
+      failed = 1;
+      continue;
     }
-    folder->folder_id = ob->oid;
-    folder->parent_id = ob->oi.ParentObject;
-    folder->storage_id = ob->oi.StorageID;
-    folder->name = (ob->oi.Filename) ? (char *)strdup(ob->oi.Filename) : NULL;
-
-    // pretend sibling says next, and child says prev.
-    folder->sibling = head.sibling;
-    folder->child = &head;
-    head.sibling->child = folder;
-    head.sibling = folder;
+    // Parent 0 would have the file moved to a default folder
+    file->parent_id = item->parent;
+    file->storage_id = (item->parent == LIBMTP_FILES_AND_FOLDERS_ROOT) ?
+      rootstorage : storage;
+    file->filesize = item->size;
+    file->modificationdate = item->mtime;
+    file->filetype = filetype_from_extension(file->filename);
+    tree.files[tree.nfiles] = item;
+    files[tree.nfiles++] = file;
   }
 
-  // We begin at the given root folder and get them all recursively
-  rv = get_subfolders_for_folder(&head, 0x00000000U);
-
-  // Some buggy devices may have some files in the "root folder"
-  // 0xffffffff so if 0x00000000 didn't return any folders,
-  // look for children of the root 0xffffffffU
-  if (rv == NULL) {
-    rv = get_subfolders_for_folder(&head, 0xffffffffU);
-    if (rv != NULL)
-      LIBMTP_ERROR("Device have files in \"root folder\" 0xffffffffU - "
-		   "this is a firmware bug (but continuing)\n");
+  if (tree.nfiles != 0) {
+    if (tree_report(&tree)) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED,
+			      "LIBMTP_Send_Tree(): Cancelled transfer.");
+      failed = 1;
+    } else if (LIBMTP_Send_Files_From_Files(device, (char const * const *) paths,
+					    files, tree.nfiles,
+					    tree_send_progress, &tree) != 0) {
+      failed = 1;
+    }
   }
-
-  // The temp list should be empty. Clean up any orphans just in case.
-  while(head.sibling != &head) {
-    LIBMTP_folder_t *curr = head.sibling;
-
-    LIBMTP_INFO("Orphan folder with ID: 0x%08x name: \"%s\" encountered.\n",
-	   curr->folder_id,
-	   curr->name);
-    curr->sibling->child = curr->child;
-    curr->child->sibling = curr->sibling;
-    curr->child = NULL;
-    curr->sibling = NULL;
-    LIBMTP_destroy_folder_t(curr);
+  for (i = 0; i < tree.nfiles; i++) {
+    LIBMTP_destroy_file_t(files[i]);
+    free(paths[i]);
   }
-
-  return rv;
-}
-
-/**
- * This returns a list of all folders available
- * on the current MTP device.
- *
- * @param device a pointer to the device to get the folder listing for.
- * @return a list of folders
- */
-LIBMTP_folder_t *LIBMTP_Get_Folder_List(LIBMTP_mtpdevice_t *device)
-{
-  return LIBMTP_Get_Folder_List_For_Storage(device, PTP_GOH_ALL_STORAGE);
+  free(files);
+  free(paths);
+  tree_free(&tree);
+  return failed ? -1 : 0;
 }
 
 /**
- * This create a folder on the current MTP device. The PTP name
- * for a folder is "association". The PTP/MTP devices does not
- * have an internal "folder" concept really, it contains a flat
- * list of all files and some file are "associations" that other
- * files and folders may refer to as its "parent".
- *
- * @param device a pointer to the device to create the folder on.
- * @param name the name of the new folder. Note this can be modified
- *        if the device does not support all the characters in the
- *        name.
- * @param parent_id id of parent folder to add the new folder to,
- *        or 0xFFFFFFFF to put it in the root directory.
- * @param storage_id id of the storage to add this new folder to.
- *        notice that you cannot mismatch storage id and parent id:
- *        they must both be on the same storage! Pass in 0 if you
- *        want to create this folder on the default storage.
- * @return id to new folder or 0 if an error occurred
+ * This function sends the file object info, ready for sendobject
+ * @param device a pointer to the device to send the file to.
+ * @param filedata a file metadata set to be written along with the file.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
  */
-uint32_t LIBMTP_Create_Folder(LIBMTP_mtpdevice_t *device, char *name,
-			      uint32_t parent_id, uint32_t storage_id)
+static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *filedata)
 {
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  uint32_t parenthandle = 0;
   uint32_t store;
-  PTPObjectInfo new_folder;
+  int use_primary_storage = 1;
+  uint16_t of = map_libmtp_type_to_ptp_type(filedata->filetype);
+  LIBMTP_devicestorage_t *storage;
+  uint32_t localph = filedata->parent_id;
   uint16_t ret;
-  uint32_t new_id = 0;
+  unsigned int i;
 
-  if (storage_id == 0) {
-    // I'm just guessing that a folder may require 512 bytes
-    store = get_suggested_storage_id(device, 512, parent_id);
+#if 0
+  // Sanity check: no zerolength files on some devices?
+  // If the zerolength files cause problems on some devices,
+  // then add a bug flag for this.
+  if (filedata->filesize == 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "send_file_object_info(): "
+			    "File of zero size.");
+    return -1;
+  }
+#endif
+  if (filedata->storage_id != 0) {
+    store = filedata->storage_id;
   } else {
-    store = storage_id;
+    store = get_suggested_storage_id(device, filedata->filesize, localph);
   }
-  parenthandle = parent_id;
 
-  memset(&new_folder, 0, sizeof(new_folder));
-  new_folder.Filename = name;
-  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-    strip_7bit_from_utf8(new_folder.Filename);
+  // Detect if something non-primary is in use.
+  want_storage(device);
+  storage = device->storage;
+  if (storage != NULL && store != storage->id) {
+    use_primary_storage = 0;
   }
-  new_folder.ObjectCompressedSize = 0;
-  new_folder.ObjectFormat = PTP_OFC_Association;
-  new_folder.ProtectionStatus = PTP_PS_NoProtection;
-  new_folder.AssociationType = PTP_AT_GenericFolder;
-  new_folder.ParentObject = parent_id;
-  new_folder.StorageID = store;
 
-  // Create the object
-  if (!(params->device_flags & DEVICE_FLAG_BROKEN_SEND_OBJECT_PROPLIST) &&
-	ptp_operation_issupported(params,PTP_OC_MTP_SendObjectPropList)) {
-	MTPProperties *props = (MTPProperties*)calloc(2,sizeof(MTPProperties));
-
-	props[0].property = PTP_OPC_ObjectFileName;
-	props[0].datatype = PTP_DTC_STR;
-	props[0].propval.str = name;
-
-	props[1].property = PTP_OPC_Name;
-	props[1].datatype = PTP_DTC_STR;
-	props[1].propval.str = name;
-
-	ret = ptp_mtp_sendobjectproplist(params, &store, &parenthandle, &new_id, PTP_OFC_Association,
-			0, props, 1);
-	free(props);
-  } else {
-	ret = ptp_sendobjectinfo(params, &store, &parenthandle, &new_id, &new_folder);
-  }
+  /*
+   * If no destination folder was given, look up a default
+   * folder if possible. Perhaps there is some way of retrieveing
+   * the default folder for different forms of content, what
+   * do I know, we use a fixed list in lack of any better method.
+   * Some devices obviously need to have their files in certain
+   * folders in order to find/display them at all (hello Creative),
+   * so we have to have a method for this. We only do this if the
+   * primary storage is in use.
+   */
 
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Create_Folder: Could not send object info.");
-    if (ret == PTP_RC_AccessDenied) {
-      add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
+  if (localph == 0 && use_primary_storage) {
+    if (LIBMTP_FILETYPE_IS_AUDIO(filedata->filetype)) {
+      localph = device->default_music_folder;
+    } else if (LIBMTP_FILETYPE_IS_VIDEO(filedata->filetype)) {
+      localph = device->default_video_folder;
+    } else if (of == PTP_OFC_EXIF_JPEG ||
+	       of == PTP_OFC_JP2 ||
+	       of == PTP_OFC_JPX ||
+	       of == PTP_OFC_JFIF ||
+	       of == PTP_OFC_TIFF ||
+	       of == PTP_OFC_TIFF_IT ||
+	       of == PTP_OFC_BMP ||
+	       of == PTP_OFC_GIF ||
+	       of == PTP_OFC_PICT ||
+	       of == PTP_OFC_PNG ||
+	       of == PTP_OFC_MTP_WindowsImageFormat) {
+      localph = device->default_picture_folder;
+    } else if (of == PTP_OFC_MTP_vCalendar1 ||
+	       of == PTP_OFC_MTP_vCalendar2 ||
+	       of == PTP_OFC_MTP_UndefinedContact ||
+	       of == PTP_OFC_MTP_vCard2 ||
+	       of == PTP_OFC_MTP_vCard3 ||
+	       of == PTP_OFC_MTP_UndefinedCalendarItem) {
+      localph = device->default_organizer_folder;
+    } else if (of == PTP_OFC_Text) {
+      localph = device->default_text_folder;
     }
-    return 0;
-  }
-  // NOTE: don't destroy the new_folder objectinfo, because it is statically referencing
-  // several strings.
-
-  add_object_to_cache(device, new_id);
-
-  return new_id;
-}
-
-/**
- * This creates a new playlist metadata structure and allocates memory
- * for it. Notice that if you add strings to this structure they
- * will be freed by the corresponding <code>LIBMTP_destroy_playlist_t</code>
- * operation later, so be careful of using strdup() when assigning
- * strings, e.g.:
- *
- * <pre>
- * LIBMTP_playlist_t *pl = LIBMTP_new_playlist_t();
- * pl->name = strdup(str);
- * ....
- * LIBMTP_destroy_playlist_t(pl);
- * </pre>
- *
- * @return a pointer to the newly allocated metadata structure.
- * @see LIBMTP_destroy_playlist_t()
- */
-LIBMTP_playlist_t *LIBMTP_new_playlist_t(void)
-{
-  LIBMTP_playlist_t *new = (LIBMTP_playlist_t *) malloc(sizeof(LIBMTP_playlist_t));
-  if (new == NULL) {
-    return NULL;
-  }
-  new->playlist_id = 0;
-  new->parent_id = 0;
-  new->storage_id = 0;
-  new->name = NULL;
-  new->tracks = NULL;
-  new->no_tracks = 0;
-  new->next = NULL;
-  return new;
-}
-
-/**
- * This destroys a playlist metadata structure and deallocates the memory
- * used by it, including any strings. Never use a track metadata
- * structure again after calling this function on it.
- * @param playlist the playlist metadata to destroy.
- * @see LIBMTP_new_playlist_t()
- */
-void LIBMTP_destroy_playlist_t(LIBMTP_playlist_t *playlist)
-{
-  if (playlist == NULL) {
-    return;
   }
-  if (playlist->name != NULL)
-    free(playlist->name);
-  if (playlist->tracks != NULL)
-    free(playlist->tracks);
-  free(playlist);
-  return;
-}
-
-/**
- * This function returns a list of the playlists available on the
- * device. Typical usage:
- *
- * <pre>
- * </pre>
- *
- * @param device a pointer to the device to get the playlist listing from.
- * @return a playlist list on success, else NULL. If there are no playlists
- *         on the device, NULL will be returned as well.
- * @see LIBMTP_Get_Playlist()
- */
-LIBMTP_playlist_t *LIBMTP_Get_Playlist_List(LIBMTP_mtpdevice_t *device)
-{
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  const int REQ_SPL = FLAG_PLAYLIST_SPL(ptp_usb);
-  PTPParams *params = (PTPParams *) device->params;
-  LIBMTP_playlist_t *retlists = NULL;
-  LIBMTP_playlist_t *curlist = NULL;
-  uint32_t i;
 
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
-  }
+  // Here we wire the type to unknown on bugged, but
+  // Ogg or FLAC-supportive devices.
+  of = map_send_filetype(device, filedata->filetype);
 
-  for (i = 0; i < params->nrofobjects; i++) {
-    LIBMTP_playlist_t *pl;
-    PTPObject *ob;
-    uint16_t ret;
+  if (ptp_operation_issupported(params, PTP_OC_MTP_SendObjectPropList) &&
+      !FLAG_BROKEN_SEND_OBJECT_PROPLIST(ptp_usb)) {
+    /*
+     * MTP enhanched does it this way (from a sniff):
+     * -> PTP_OC_MTP_SendObjectPropList (0x9808):
+     *    20 00 00 00 01 00 08 98 1B 00 00 00 01 00 01 00
+     *    FF FF FF FF 00 30 00 00 00 00 00 00 12 5E 00 00
+     *    Length: 0x00000020
+     *    Type:   0x0001 PTP_USB_CONTAINER_COMMAND
+     *    Code:   0x9808
+     *    Transaction ID: 0x0000001B
+     *    Param1: 0x00010001 <- store
+     *    Param2: 0xffffffff <- parent handle (-1 ?)
+     *    Param3: 0x00003000 <- file type PTP_OFC_Undefined - we don't know about PDF files
+     *    Param4: 0x00000000 <- file length MSB (-0x0c header len)
+     *    Param5: 0x00005e12 <- file length LSB (-0x0c header len)
+     *
+     * -> PTP_OC_MTP_SendObjectPropList (0x9808):
+     *    46 00 00 00 02 00 08 98 1B 00 00 00 03 00 00 00
+     *    00 00 00 00 07 DC FF FF 0D 4B 00 53 00 30 00 36 - dc07 = file name
+     *    00 30 00 33 00 30 00 36 00 2E 00 70 00 64 00 66
+     *    00 00 00 00 00 00 00 03 DC 04 00 00 00 00 00 00 - dc03 = protection status
+     *    00 4F DC 02 00 01                               - dc4f = non consumable
+     *    Length: 0x00000046
+     *    Type:   0x0002 PTP_USB_CONTAINER_DATA
+     *    Code:   0x9808
+     *    Transaction ID: 0x0000001B
+     *    Metadata....
+     *    0x00000003 <- Number of metadata items
+     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
+     *    0xdc07     <- metadata type: file name
+     *    0xffff     <- metadata type: string
+     *    0x0d       <- number of (uint16_t) characters
+     *    4b 53 30 36 30 33 30 36 2e 50 64 66 00 "KS060306.pdf", null terminated
+     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
+     *    0xdc03     <- metadata type: protection status
+     *    0x0004     <- metadata type: uint16_t
+     *    0x0000     <- not protected
+     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
+     *    0xdc4f     <- non consumable
+     *    0x0002     <- metadata type: uint8_t
+     *    0x01       <- non-consumable (this device cannot display PDF)
+     *
+     * <- Read 0x18 bytes back
+     *    18 00 00 00 03 00 01 20 1B 00 00 00 01 00 01 00
+     *    00 00 00 00 01 40 00 00
+     *    Length: 0x000000018
+     *    Type:   0x0003 PTP_USB_CONTAINER_RESPONSE
+     *    Code:   0x2001 PTP_OK
+     *    Transaction ID: 0x0000001B
+     *    Param1: 0x00010001 <- store
+     *    Param2: 0x00000000 <- parent handle
+     *    Param3: 0x00004001 <- new file/object ID
+     *
+     * -> PTP_OC_SendObject (0x100d)
+     *    0C 00 00 00 01 00 0D 10 1C 00 00 00
+     * -> ... all the bytes ...
+     * <- Read 0x0c bytes back
+     *    0C 00 00 00 03 00 01 20 1C 00 00 00
+     *    ... Then update metadata one-by one, actually (instead of sending it first!) ...
+     */
+    MTPProperties *props = NULL;
+    int nrofprops = 0;
+    MTPProperties *prop = NULL;
+    uint16_t *properties = NULL;
+    uint32_t propcnt = 0;
 
-    ob = &params->objects[i];
+    // default parent handle
+    if (localph == 0)
+      localph = 0xFFFFFFFFU; // Set to -1
 
-    // Ignore stuff that isn't playlists
+    // Must be 0x00000000U for new objects
+    filedata->item_id = 0x00000000U;
 
-    // For Samsung players we must look for the .spl extension explicitly since
-    // playlists are not stored as playlist objects.
-    if ( REQ_SPL && is_spl_playlist(&ob->oi) ) {
-      // Allocate a new playlist type
-      pl = LIBMTP_new_playlist_t();
-      spl_to_playlist_t(device, &ob->oi, ob->oid, pl);
-    }
-    else if ( ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioVideoPlaylist ) {
-      continue;
-    }
-    else {
-      // Allocate a new playlist type
-      pl = LIBMTP_new_playlist_t();
+    ret = ptp_mtp_getobjectpropssupported_cached(params, of, &propcnt, &properties);
 
-      // Try to look up proper name, else use the oi->Filename field.
-      pl->name = get_string_from_object(device, ob->oid, PTP_OPC_Name);
-      if (pl->name == NULL) {
-	pl->name = strdup(ob->oi.Filename);
-      }
-      pl->playlist_id = ob->oid;
-      pl->parent_id = ob->oi.ParentObject;
-      pl->storage_id = ob->oi.StorageID;
+    for (i=0;i<propcnt;i++) {
+      PTPObjectPropDesc opd;
 
-      // Then get the track listing for this playlist
-      ret = ptp_mtp_getobjectreferences(params, pl->playlist_id, &pl->tracks, &pl->no_tracks);
+      ret = ptp_mtp_getobjectpropdesc_cached(params, properties[i], of, &opd);
       if (ret != PTP_RC_OK) {
-        add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Playlist_List(): "
-				    "could not get object references.");
-        pl->tracks = NULL;
-        pl->no_tracks = 0;
-      }
-    }
-
-    // Add playlist to a list that will be returned afterwards.
-    if (retlists == NULL) {
-      retlists = pl;
-      curlist = pl;
-    } else {
-      curlist->next = pl;
-      curlist = pl;
-    }
-
-    // Call callback here if we decide to add that possibility...
-  }
-  return retlists;
-}
-
-
-/**
- * This function retrieves an individual playlist from the device.
- * @param device a pointer to the device to get the playlist from.
- * @param plid the unique ID of the playlist to retrieve.
- * @return a valid playlist metadata post or NULL on failure.
- * @see LIBMTP_Get_Playlist_List()
- */
-LIBMTP_playlist_t *LIBMTP_Get_Playlist(LIBMTP_mtpdevice_t *device, uint32_t const plid)
-{
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  const int REQ_SPL = FLAG_PLAYLIST_SPL(ptp_usb);
-  PTPParams *params = (PTPParams *) device->params;
-  PTPObject *ob;
-  LIBMTP_playlist_t *pl;
-  uint16_t ret;
-
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
-  }
-
-  ret = ptp_object_want (params, plid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
-  if (ret != PTP_RC_OK)
-    return NULL;
-
-  // For Samsung players we must look for the .spl extension explicitly since
-  // playlists are not stored as playlist objects.
-  if ( REQ_SPL && is_spl_playlist(&ob->oi) ) {
-    // Allocate a new playlist type
-    pl = LIBMTP_new_playlist_t();
-    spl_to_playlist_t(device, &ob->oi, ob->oid, pl);
-    return pl;
-  }
-
-  // Ignore stuff that isn't playlists
-  else if ( ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioVideoPlaylist ) {
-    return NULL;
-  }
-
-  // Allocate a new playlist type
-  pl = LIBMTP_new_playlist_t();
-
-  pl->name = get_string_from_object(device, ob->oid, PTP_OPC_Name);
-  if (pl->name == NULL) {
-    pl->name = strdup(ob->oi.Filename);
-  }
-  pl->playlist_id = ob->oid;
-  pl->parent_id = ob->oi.ParentObject;
-  pl->storage_id = ob->oi.StorageID;
-
-  // Then get the track listing for this playlist
-  ret = ptp_mtp_getobjectreferences(params, pl->playlist_id, &pl->tracks, &pl->no_tracks);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Playlist(): Could not get object references.");
-    pl->tracks = NULL;
-    pl->no_tracks = 0;
-  }
-
-  return pl;
-}
-
-/**
- * This function creates a new abstract list such as a playlist
- * or an album.
- *
- * @param device a pointer to the device to create the new abstract list
- *        on.
- * @param name the name of the new abstract list.
- * @param artist the artist of the new abstract list or NULL.
- * @param genre the genre of the new abstract list or NULL.
- * @param parenthandle the handle of the parent or 0 for no parent
- *        i.e. the root folder.
- * @param objectformat the abstract list type to create.
- * @param suffix the ".foo" (4 characters) suffix to use for the virtual
- *        "file" created by this operation.
- * @param newid a pointer to a variable that will hold the new object
- *        ID if this call is successful.
- * @param tracks an array of tracks to associate with this list.
- * @param no_tracks the number of tracks in the list.
- * @return 0 on success, any other value means failure.
- */
-static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
-				    char const * const name,
-				    char const * const artist,
-				    char const * const composer,
-				    char const * const genre,
-				    uint32_t const parenthandle,
-				    uint32_t const storageid,
-				    uint16_t const objectformat,
-				    char const * const suffix,
-				    uint32_t * const newid,
-				    uint32_t const * const tracks,
-				    uint32_t const no_tracks)
-
-{
-  unsigned int i;
-  int supported = 0;
-  uint16_t ret;
-  uint16_t *properties = NULL;
-  uint32_t propcnt = 0;
-  uint32_t store;
-  uint32_t localph = parenthandle;
-  uint8_t nonconsumable = 0x00U; /* By default it is consumable */
-  PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  char fname[256];
-  //uint8_t data[2];
-
-  // NULL check
-  if (!name) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): list name was NULL, using default name \"Unknown\"");
-    return -1;
-  }
-
-  if (storageid == 0) {
-    // I'm just guessing that an abstract list may require 512 bytes
-    store = get_suggested_storage_id(device, 512, localph);
-  } else {
-    store = storageid;
-  }
-
-  // Check if we can create an object of this type
-  for ( i=0; i < params->deviceinfo.ImageFormats_len; i++ ) {
-    if (params->deviceinfo.ImageFormats[i] == objectformat) {
-      supported = 1;
-      break;
-    }
-  }
-  if (!supported) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): player does not support this abstract type");
-    LIBMTP_ERROR("Unsupported abstract list type: %04x\n", objectformat);
-    return -1;
-  }
-
-  // add the new suffix if it isn't there
-  fname[0] = '\0';
-  if (strlen(name) > strlen(suffix)) {
-    char const * const suff = &name[strlen(name)-strlen(suffix)];
-    if (!strcmp(suff, suffix)) {
-      // Home free.
-      strncpy(fname, name, sizeof(fname));
-    }
-  }
-  // If it didn't end with "<suffix>" then add that here.
-  if (fname[0] == '\0') {
-    strncpy(fname, name, sizeof(fname)-strlen(suffix)-1);
-    strcat(fname, suffix);
-    fname[sizeof(fname)-1] = '\0';
-  }
-
-  if (ptp_operation_issupported(params, PTP_OC_MTP_SendObjectPropList) &&
-      !FLAG_BROKEN_SEND_OBJECT_PROPLIST(ptp_usb)) {
-    MTPProperties *props = NULL;
-    MTPProperties *prop = NULL;
-    int nrofprops = 0;
-
-    *newid = 0x00000000U;
-
-    ret = ptp_mtp_getobjectpropssupported(params, objectformat, &propcnt, &properties);
-
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
-
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], objectformat, &opd);
-      if (ret != PTP_RC_OK) {
-	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): "
+	add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
 				"could not get property description.");
       } else if (opd.GetSet) {
 	switch (properties[i]) {
 	case PTP_OPC_ObjectFileName:
 	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = *newid;
+	  prop->ObjectHandle = filedata->item_id;
 	  prop->property = PTP_OPC_ObjectFileName;
 	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(fname);
-	  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-	    strip_7bit_from_utf8(prop->propval.str);
+	  if (filedata->filename != NULL) {
+	    prop->propval.str = strdup(filedata->filename);
+	    if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+	      strip_7bit_from_utf8(prop->propval.str);
+	    }
 	  }
 	  break;
 	case PTP_OPC_ProtectionStatus:
 	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = *newid;
+	  prop->ObjectHandle = filedata->item_id;
 	  prop->property = PTP_OPC_ProtectionStatus;
 	  prop->datatype = PTP_DTC_UINT16;
 	  prop->propval.u16 = 0x0000U; /* Not protected */
 	  break;
 	case PTP_OPC_NonConsumable:
 	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = *newid;
+	  prop->ObjectHandle = filedata->item_id;
 	  prop->property = PTP_OPC_NonConsumable;
 	  prop->datatype = PTP_DTC_UINT8;
-	  prop->propval.u8 = nonconsumable;
+	  prop->propval.u8 = 0x00; /* It is supported, then it is consumable */
 	  break;
 	case PTP_OPC_Name:
-	  if (name != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = *newid;
-	    prop->property = PTP_OPC_Name;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(name);
-	  }
-	  break;
-	case PTP_OPC_AlbumArtist:
-	  if (artist != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = *newid;
-	    prop->property = PTP_OPC_AlbumArtist;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(artist);
-	  }
-	  break;
-	case PTP_OPC_Artist:
-	  if (artist != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = *newid;
-	    prop->property = PTP_OPC_Artist;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(artist);
-	  }
-	  break;
-	case PTP_OPC_Composer:
-	  if (composer != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = *newid;
-	    prop->property = PTP_OPC_Composer;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(composer);
-	  }
-	  break;
-	case PTP_OPC_Genre:
-	  if (genre != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = *newid;
-	    prop->property = PTP_OPC_Genre;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(genre);
-	  }
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = filedata->item_id;
+	  prop->property = PTP_OPC_Name;
+	  prop->datatype = PTP_DTC_STR;
+	  if (filedata->filename != NULL)
+	    prop->propval.str = strdup(filedata->filename);
 	  break;
- 	case PTP_OPC_DateModified:
+	case PTP_OPC_DateModified:
 	  // Tag with current time if that is supported
 	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
 	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = *newid;
+	    prop->ObjectHandle = filedata->item_id;
 	    prop->property = PTP_OPC_DateModified;
 	    prop->datatype = PTP_DTC_STR;
 	    prop->propval.str = get_iso8601_stamp();
+	    filedata->modificationdate = time(NULL);
 	  }
 	  break;
 	}
       }
-      ptp_free_objectpropdesc(&opd);
     }
     free(properties);
 
-    ret = ptp_mtp_sendobjectproplist(params, &store, &localph, newid,
-				     objectformat, 0, props, nrofprops);
+    ret = ptp_mtp_sendobjectproplist(params, &store, &localph, &filedata->item_id,
+				     of, filedata->filesize, props, nrofprops);
 
     /* Free property list */
     ptp_destroy_object_prop_list(props, nrofprops);
 
     if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send object property list.");
+      add_ptp_error_to_errorstack(device, ret, "send_file_object_info():"
+				  "Could not send object property list.");
       if (ret == PTP_RC_AccessDenied) {
 	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
       }
       return -1;
     }
-
-    // now send the blank object
-    ret = ptp_sendobject(params, NULL, 0);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send blank object data.");
-      return -1;
-    }
-
   } else if (ptp_operation_issupported(params,PTP_OC_SendObjectInfo)) {
-    PTPObjectInfo new_object;
+    PTPObjectInfo new_file;
 
-    new_object.Filename = fname;
+    memset(&new_file, 0, sizeof(PTPObjectInfo));
+
+    new_file.Filename = filedata->filename;
     if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-      strip_7bit_from_utf8(new_object.Filename);
+      strip_7bit_from_utf8(new_file.Filename);
     }
-    // At one point this had to be one
-    new_object.ObjectCompressedSize = 0;
-    new_object.ObjectFormat = objectformat;
-
+    if (filedata->filesize > 0xFFFFFFFFL) {
+      // This is a kludge in the MTP standard for large files.
+      new_file.ObjectCompressedSize = (uint32_t) 0xFFFFFFFF;
+    } else {
+      new_file.ObjectCompressedSize = (uint32_t) filedata->filesize;
+    }
+    new_file.ObjectFormat = of;
+    new_file.StorageID = store;
+    new_file.ParentObject = localph;
+    new_file.ModificationDate = time(NULL);
+
     // Create the object
-    ret = ptp_sendobjectinfo(params, &store, &localph, newid, &new_object);
+    ret = ptp_sendobjectinfo(params, &store, &localph, &filedata->item_id, &new_file);
+
     if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send object info (the playlist itself).");
+      add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
+				  "Could not send object info.");
       if (ret == PTP_RC_AccessDenied) {
 	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
       }
       return -1;
     }
-    // NOTE: don't destroy new_object objectinfo afterwards - the strings it contains are
-    // not copies.
+    // NOTE: the char* pointers inside new_file are not copies so don't
+    // try to destroy this objectinfo!
+  }
 
-#if 0
-    /*
-     * At one time we had to send this one blank data byte.
-     * If we didn't, the handle will not be created and thus there is
-     * no playlist. Possibly this was masking some bug, so removing it
-     * now.
-     */
-    data[0] = '\0';
-    data[1] = '\0';
-    ret = ptp_sendobject(params, data, 1);
+  // Now there IS an object with this parent handle.
+  filedata->parent_id = localph;
+  // and the storage the device put it on
+  if (store != 0)
+    filedata->storage_id = store;
+  storage_commit_bytes(device, store, filedata->filesize);
+
+  return 0;
+}
+
+/**
+ * Appends the properties of a track that can be set on the device to
+ * a property list for SetObjPropList, see LIBMTP_Update_Track_Metadata().
+ */
+static void add_track_proplist(LIBMTP_mtpdevice_t *device,
+			       LIBMTP_track_t const * const metadata,
+			       uint16_t const * const properties,
+			       uint32_t const propcnt,
+			       MTPProperties **propsp, int *nrofpropsp)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint32_t i;
+  MTPProperties *props = *propsp;
+  MTPProperties *prop = NULL;
+  int nrofprops = *nrofpropsp;
+
+  for (i=0;i<propcnt;i++) {
+    PTPObjectPropDesc opd;
+
+    ret = ptp_mtp_getobjectpropdesc_cached(params, properties[i], map_libmtp_type_to_ptp_type(metadata->filetype), &opd);
     if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send blank object data.");
-      return -1;
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+			      "could not get property description.");
+    } else if (opd.GetSet) {
+      switch (properties[i]) {
+      case PTP_OPC_Name:
+	if (metadata->title == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Name;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->title);
+	break;
+      case PTP_OPC_AlbumName:
+	if (metadata->album == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_AlbumName;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->album);
+	break;
+      case PTP_OPC_Artist:
+	if (metadata->artist == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Artist;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->artist);
+	break;
+      case PTP_OPC_Composer:
+	if (metadata->composer == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Composer;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->composer);
+	break;
+      case PTP_OPC_Genre:
+	if (metadata->genre == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Genre;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->genre);
+	break;
+      case PTP_OPC_Duration:
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Duration;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->duration, &opd);
+	break;
+      case PTP_OPC_Track:
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Track;
+	prop->datatype = PTP_DTC_UINT16;
+	prop->propval.u16 = adjust_u16(metadata->tracknumber, &opd);
+	break;
+      case PTP_OPC_OriginalReleaseDate:
+	if (metadata->date == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_OriginalReleaseDate;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->date);
+	break;
+      case PTP_OPC_SampleRate:
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_SampleRate;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->samplerate, &opd);
+	break;
+      case PTP_OPC_NumberOfChannels:
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_NumberOfChannels;
+	prop->datatype = PTP_DTC_UINT16;
+	prop->propval.u16 = adjust_u16(metadata->nochannels, &opd);
+	break;
+      case PTP_OPC_AudioWAVECodec:
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_AudioWAVECodec;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->wavecodec, &opd);
+	break;
+      case PTP_OPC_AudioBitRate:
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_AudioBitRate;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->bitrate, &opd);
+	break;
+      case PTP_OPC_BitRateType:
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_BitRateType;
+	prop->datatype = PTP_DTC_UINT16;
+	prop->propval.u16 = adjust_u16(metadata->bitratetype, &opd);
+	break;
+      case PTP_OPC_Rating:
+	// TODO: shall this be set for rating 0?
+	if (metadata->rating == 0)
+	  break;
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Rating;
+	prop->datatype = PTP_DTC_UINT16;
+	prop->propval.u16 = adjust_u16(metadata->rating, &opd);
+	break;
+      case PTP_OPC_UseCount:
+	prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_UseCount;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->usecount, &opd);
+	break;
+      case PTP_OPC_DateModified:
+	if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	  // Tag with current time if that is supported
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_DateModified;
+	  prop->datatype = PTP_DTC_STR;
+	  prop->propval.str = get_iso8601_stamp();
+	}
+	break;
+      default:
+	break;
+      }
     }
-#endif
+  }
 
-    // set the properties one by one
-    ret = ptp_mtp_getobjectpropssupported(params, objectformat, &propcnt, &properties);
+  // NOTE: File size is not updated, this should not change anyway.
+  // neither will we change the filename.
+  *propsp = props;
+  *nrofpropsp = nrofprops;
+}
 
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
+/**
+ * Sets the properties of a track that can be set on the device one
+ * SetObjectPropValue at a time, see LIBMTP_Update_Track_Metadata().
+ */
+static void set_track_props(LIBMTP_mtpdevice_t *device,
+			    LIBMTP_track_t const * const metadata,
+			    uint16_t const * const properties,
+			    uint32_t const propcnt)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint32_t i;
 
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], objectformat, &opd);
-      if (ret != PTP_RC_OK) {
-	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): "
-				"could not get property description.");
-      } else if (opd.GetSet) {
-	switch (properties[i]) {
-	case PTP_OPC_Name:
-	  if (name != NULL) {
-	    ret = set_object_string(device, *newid, PTP_OPC_Name, name);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity name.");
-	      return -1;
-	    }
+  for (i=0;i<propcnt;i++) {
+    PTPObjectPropDesc opd;
+
+    ret = ptp_mtp_getobjectpropdesc_cached(params, properties[i], map_libmtp_type_to_ptp_type(metadata->filetype), &opd);
+    if (ret != PTP_RC_OK) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+			      "could not get property description.");
+    } else if (opd.GetSet) {
+      switch (properties[i]) {
+      case PTP_OPC_Name:
+	// Update title
+	ret = set_object_string(device, metadata->item_id, PTP_OPC_Name, metadata->title);
+	if (ret != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				  "could not set track title.");
+	}
+	break;
+      case PTP_OPC_AlbumName:
+	// Update album
+	ret = set_object_string(device, metadata->item_id, PTP_OPC_AlbumName, metadata->album);
+	if (ret != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				  "could not set track album name.");
+	}
+	break;
+      case PTP_OPC_Artist:
+	// Update artist
+	ret = set_object_string(device, metadata->item_id, PTP_OPC_Artist, metadata->artist);
+	if (ret != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				  "could not set track artist name.");
+	}
+	break;
+      case PTP_OPC_Composer:
+	// Update composer
+	ret = set_object_string(device, metadata->item_id, PTP_OPC_Composer, metadata->composer);
+	if (ret != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				  "could not set track composer name.");
+	}
+	break;
+      case PTP_OPC_Genre:
+	// Update genre (but only if valid)
+	if (metadata->genre) {
+	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Genre, metadata->genre);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				    "could not set genre.");
 	  }
-	  break;
-	case PTP_OPC_AlbumArtist:
-	  if (artist != NULL) {
-	    ret = set_object_string(device, *newid, PTP_OPC_AlbumArtist, artist);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity album artist.");
-	      return -1;
-	    }
+	}
+	break;
+      case PTP_OPC_Duration:
+	// Update duration
+	if (metadata->duration != 0) {
+	  ret = set_object_u32(device, metadata->item_id, PTP_OPC_Duration, adjust_u32(metadata->duration, &opd));
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set track duration.");
 	  }
-	  break;
-	case PTP_OPC_Artist:
-	  if (artist != NULL) {
-	    ret = set_object_string(device, *newid, PTP_OPC_Artist, artist);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity artist.");
-	      return -1;
-	    }
+	}
+	break;
+      case PTP_OPC_Track:
+	// Update track number.
+	if (metadata->tracknumber != 0) {
+	  ret = set_object_u16(device, metadata->item_id, PTP_OPC_Track, adjust_u16(metadata->tracknumber, &opd));
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set track tracknumber.");
 	  }
-	  break;
-	case PTP_OPC_Composer:
-	  if (composer != NULL) {
-	    ret = set_object_string(device, *newid, PTP_OPC_Composer, composer);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity composer.");
-	      return -1;
-	    }
+	}
+	break;
+      case PTP_OPC_OriginalReleaseDate:
+	// Update creation datetime
+	// The date can be zero, but some devices do not support setting zero
+	// dates (and it seems that a zero date should never be set anyway)
+	if (metadata->date) {
+	  ret = set_object_string(device, metadata->item_id, PTP_OPC_OriginalReleaseDate, metadata->date);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set track release date.");
 	  }
-	  break;
-	case PTP_OPC_Genre:
-	  if (genre != NULL) {
-	    ret = set_object_string(device, *newid, PTP_OPC_Genre, genre);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity genre.");
-	      return -1;
-	    }
+	}
+	break;
+	// These are, well not so important.
+      case PTP_OPC_SampleRate:
+	// Update sample rate
+	if (metadata->samplerate != 0) {
+	  ret = set_object_u32(device, metadata->item_id, PTP_OPC_SampleRate, adjust_u32(metadata->samplerate, &opd));
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set samplerate.");
 	  }
-	  break;
- 	case PTP_OPC_DateModified:
-	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    ret = set_object_string(device, *newid, PTP_OPC_DateModified, get_iso8601_stamp());
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set date modified.");
-	      return -1;
-	    }
+	}
+	break;
+      case PTP_OPC_NumberOfChannels:
+	// Update number of channels
+	if (metadata->nochannels != 0) {
+	  ret = set_object_u16(device, metadata->item_id, PTP_OPC_NumberOfChannels, adjust_u16(metadata->nochannels, &opd));
+	if (ret != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				  "could not set number of channels.");
+	}
+      }
+	break;
+      case PTP_OPC_AudioWAVECodec:
+	// Update WAVE codec
+	if (metadata->wavecodec != 0) {
+	  ret = set_object_u32(device, metadata->item_id, PTP_OPC_AudioWAVECodec, adjust_u32(metadata->wavecodec, &opd));
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set WAVE codec.");
 	  }
-	  break;
 	}
+	break;
+      case PTP_OPC_AudioBitRate:
+	// Update bitrate
+	if (metadata->bitrate != 0) {
+	  ret = set_object_u32(device, metadata->item_id, PTP_OPC_AudioBitRate, adjust_u32(metadata->bitrate, &opd));
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set bitrate.");
+	}
+	}
+	break;
+      case PTP_OPC_BitRateType:
+	// Update bitrate type
+	if (metadata->bitratetype != 0) {
+	  ret = set_object_u16(device, metadata->item_id, PTP_OPC_BitRateType, adjust_u16(metadata->bitratetype, &opd));
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set bitratetype.");
+	  }
+	}
+	break;
+      case PTP_OPC_Rating:
+	// Update user rating
+	// TODO: shall this be set for rating 0?
+	if (metadata->rating != 0) {
+	  ret = set_object_u16(device, metadata->item_id, PTP_OPC_Rating, adjust_u16(metadata->rating, &opd));
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set user rating.");
+	  }
+	}
+	break;
+      case PTP_OPC_UseCount:
+	// Update use count, set even to zero if desired.
+	ret = set_object_u32(device, metadata->item_id, PTP_OPC_UseCount, adjust_u32(metadata->usecount, &opd));
+	if (ret != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				"could not set use count.");
+	}
+	break;
+      case PTP_OPC_DateModified:
+	if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	  // Update modification time if supported
+	  char *tmpstamp = get_iso8601_stamp();
+	  ret = set_object_string(device, metadata->item_id, PTP_OPC_DateModified, tmpstamp);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set modification date.");
+	  }
+	  free(tmpstamp);
+	}
+	break;
+
+	// NOTE: File size is not updated, this should not change anyway.
+	// neither will we change the filename.
+      default:
+	break;
       }
-      ptp_free_objectpropdesc(&opd);
     }
-    free(properties);
   }
+}
+
+
+/**
+ * This function updates the MTP track object metadata on a
+ * single file identified by an object ID.
+ * @param device a pointer to the device to update the track
+ *        metadata on.
+ * @param metadata a track metadata set to be written to the file.
+ *        notice that the <code>track_id</code> field of the
+ *        metadata structure must be correct so that the
+ *        function can update the right file. If some properties
+ *        of this metadata are set to NULL (strings) or 0
+ *        (numerical values) they will be discarded and the
+ *        track will not be tagged with these blank values.
+ * @return 0 on success, any other value means failure. If some
+ *        or all of the properties fail to update we will still
+ *        return success. On some devices (notably iRiver T30)
+ *        properties that exist cannot be updated.
+ */
+int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
+				 LIBMTP_track_t const * const metadata)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint16_t *properties = NULL;
+  uint32_t propcnt = 0;
+
+  // First see which properties can be set on this file format and apply accordingly
+  // i.e only try to update this metadata for object tags that exist on the current player.
+  ret = ptp_mtp_getobjectpropssupported_cached(params, map_libmtp_type_to_ptp_type(metadata->filetype), &propcnt, &properties);
+  if (ret != PTP_RC_OK) {
+    // Just bail out for now, nothing is ever set.
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+			    "could not retrieve supported object properties.");
+    return -1;
+  }
+  if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
+      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
+    MTPProperties *props = NULL;
+    int nrofprops = 0;
+
+    add_track_proplist(device, metadata, properties, propcnt, &props, &nrofprops);
+
+    ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
+
+    ptp_destroy_object_prop_list(props, nrofprops);
+
+    if (ret != PTP_RC_OK) {
+      // TODO: return error of which property we couldn't set
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+			      "could not set object property list.");
+      free(properties);
+      return -1;
+    }
+
+  } else if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjectPropValue)) {
+    set_track_props(device, metadata, properties, propcnt);
+  } else {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+                            "Your device doesn't seem to support any known way of setting metadata.");
+    free(properties);
+    return -1;
+  }
+
+  // update cached object properties if metadata cache exists
+  update_metadata_cache(device, metadata->item_id);
+
+  free(properties);
+
+  return 0;
+}
+
+/**
+ * Writes a property that was just set on the device into the cached
+ * object, so that objects with their properties cached need not be
+ * fetched again after an update.
+ */
+static void patch_cached_prop(LIBMTP_mtpdevice_t *device,
+			      MTPProperties const * const prop)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  MTPProperties *cached = NULL;
+  PTPObject *ob;
+  unsigned int i;
+
+  if (ptp_object_find(params, prop->ObjectHandle, &ob) != PTP_RC_OK ||
+      !(ob->flags & PTPOBJECT_MTPPROPLIST_LOADED))
+    return;
+  for (i = 0; i < ob->nrofmtpprops; i++) {
+    if (ob->mtpprops[i].property == prop->property) {
+      cached = &ob->mtpprops[i];
+      break;
+    }
+  }
+  if (cached == NULL) {
+    MTPProperties *newprops;
+
+    // The array may live in the object arena, so it is never realloc():ed
+    newprops = malloc((ob->nrofmtpprops + 1) * sizeof(MTPProperties));
+    if (newprops == NULL) {
+      update_metadata_cache(device, prop->ObjectHandle);
+      return;
+    }
+    if (ob->nrofmtpprops != 0) {
+      memcpy(newprops, ob->mtpprops, ob->nrofmtpprops * sizeof(MTPProperties));
+    }
+    if (ob->mtpprops != NULL &&
+	!ptp_arena_owns(&params->objectarena, ob->mtpprops)) {
+      free(ob->mtpprops);
+    }
+    ob->mtpprops = newprops;
+    cached = &newprops[ob->nrofmtpprops++];
+    cached->ObjectHandle = prop->ObjectHandle;
+    cached->property = prop->property;
+    cached->datatype = PTP_DTC_UNDEF;
+    cached->propval.str = NULL;
+  }
+  if (cached->datatype == PTP_DTC_STR) {
+    ptp_object_free_string(params, ob, cached->propval.str);
+  }
+  cached->datatype = prop->datatype;
+  if (prop->datatype == PTP_DTC_STR) {
+    cached->propval.str = prop->propval.str ? strdup(prop->propval.str) : NULL;
+  } else {
+    cached->propval = prop->propval;
+  }
+  // The object keeps its own copy of the date, parsed from this one
+  if (prop->property == PTP_OPC_DateModified &&
+      prop->datatype == PTP_DTC_STR) {
+    ob->ModificationDate = ptp_object_parse_time(prop->propval.str);
+  }
+}
+
+/**
+ * Tell if a PTP error means the device cannot be talked to any more,
+ * so the rest of a batch is better not sent.
+ * @param ret the PTP return code.
+ * @return 1 if the transport failed, 0 otherwise.
+ */
+static int transport_failed(uint16_t const ret)
+{
+  return ret == PTP_ERROR_IO || ret == PTP_ERROR_TIMEOUT ||
+    ret == PTP_ERROR_NODEVICE || ret == PTP_ERROR_CANCEL;
+}
+
+/**
+ * Sends the properties of the tracks <code>first</code> to
+ * <code>first + n - 1</code> of a batch update in one SetObjPropList.
+ * If the device refuses them the range is halved until the tracks it
+ * refuses are found, and those are set one property at a time. When a
+ * refused range goes through as two halves the device most likely has
+ * a limit on the size of the list, so the batches are cut down to that
+ * for the rest of the update.
+ * @return 0 if the range went through in one transaction, 1 if it had
+ *         to be split, -1 if some track could not be updated and -2 if
+ *         the device stopped responding.
+ */
+static int send_track_batch(LIBMTP_mtpdevice_t *device,
+			    MTPProperties *props, int const *starts,
+			    LIBMTP_track_t const **batch,
+			    int const first, int const n, int *chunk)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t *properties = NULL;
+  uint32_t propcnt = 0;
+  uint16_t ret;
+  int half, a, b, i;
+
+  if (starts[first + n] == starts[first])
+    return 0;
+  ret = ptp_mtp_setobjectproplist(params, &props[starts[first]],
+				  starts[first + n] - starts[first]);
+  if (ret == PTP_RC_OK) {
+    for (i = starts[first]; i < starts[first + n]; i++) {
+      patch_cached_prop(device, &props[i]);
+    }
+    return 0;
+  }
+  if (transport_failed(ret)) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Update_Tracks_Metadata(): "
+				"could not set object property list.");
+    return -2;
+  }
+  if (n > 1) {
+    half = n / 2;
+    a = send_track_batch(device, props, starts, batch, first, half, chunk);
+    if (a == -2)
+      return -2;
+    b = send_track_batch(device, props, starts, batch, first + half, n - half, chunk);
+    if (b == -2)
+      return -2;
+    if (a == 0 && b == 0 && *chunk > half)
+      *chunk = half;
+    return (a < 0 || b < 0) ? -1 : 1;
+  }
+
+  // This one track is refused, try it property by property
+  if (!ptp_operation_issupported(params, PTP_OC_MTP_SetObjectPropValue)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Tracks_Metadata(): "
+			    "could not set object property list.");
+    return -1;
+  }
+  ret = ptp_mtp_getobjectpropssupported_cached(params, map_libmtp_type_to_ptp_type(batch[first]->filetype), &propcnt, &properties);
+  if (ret != PTP_RC_OK) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Tracks_Metadata(): "
+			    "could not retrieve supported object properties.");
+    return -1;
+  }
+  set_track_props(device, batch[first], properties, propcnt);
+  free(properties);
+  update_metadata_cache(device, batch[first]->item_id);
+  return 1;
+}
+
+/**
+ * This function updates the MTP track object metadata of many tracks
+ * at once. The changes are packed into as few SetObjPropList
+ * transactions as the device accepts, instead of one or more
+ * transactions per track, and objects in the cache are patched with
+ * the new values instead of being fetched again. Tracks the device
+ * refuses in a list are updated one property at a time. Devices that
+ * cannot take property lists get one LIBMTP_Update_Track_Metadata()
+ * per track.
+ * @param device a pointer to the device to update the tracks on.
+ * @param tracks a linked list of track metadata sets to write, see
+ *        LIBMTP_Update_Track_Metadata() for how each is used.
+ * @return 0 on success, any other value means that some of the
+ *        tracks could not be updated, see the error stack.
+ * @see LIBMTP_Update_Track_Metadata()
+ */
+int LIBMTP_Update_Tracks_Metadata(LIBMTP_mtpdevice_t *device,
+				  LIBMTP_track_t const * const tracks)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_track_t const *track;
+  LIBMTP_track_t const **batch;
+  MTPProperties *props = NULL;
+  int nrofprops = 0;
+  int *starts;
+  int ntracks = 0;
+  int n = 0;
+  int first, count, r;
+  int chunk = UPDATE_BATCH_TRACKS;
+  int retval = 0;
+
+  if (!ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) ||
+      FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
+    for (track = tracks; track != NULL; track = track->next) {
+      if (LIBMTP_Update_Track_Metadata(device, track) != 0)
+	retval = -1;
+    }
+    return retval;
+  }
+
+  for (track = tracks; track != NULL; track = track->next)
+    ntracks++;
+  if (ntracks == 0)
+    return 0;
+  batch = malloc(ntracks * sizeof(LIBMTP_track_t const *));
+  starts = malloc((ntracks + 1) * sizeof(int));
+  if (batch == NULL || starts == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION, "LIBMTP_Update_Tracks_Metadata(): "
+			    "out of memory.");
+    free(batch);
+    free(starts);
+    return -1;
+  }
+
+  // One property list for all the tracks, starts[] says where each begins
+  for (track = tracks; track != NULL; track = track->next) {
+    uint16_t *properties = NULL;
+    uint32_t propcnt = 0;
+
+    if (ptp_mtp_getobjectpropssupported_cached(params, map_libmtp_type_to_ptp_type(track->filetype), &propcnt, &properties) != PTP_RC_OK) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Tracks_Metadata(): "
+			      "could not retrieve supported object properties.");
+      retval = -1;
+      continue;
+    }
+    batch[n] = track;
+    starts[n] = nrofprops;
+    add_track_proplist(device, track, properties, propcnt, &props, &nrofprops);
+    free(properties);
+    n++;
+  }
+  starts[n] = nrofprops;
+
+  for (first = 0; first < n; first += count) {
+    count = (n - first < chunk) ? n - first : chunk;
+    r = send_track_batch(device, props, starts, batch, first, count, &chunk);
+    if (r == -2) {
+      retval = -1;
+      break;
+    }
+    if (r < 0)
+      retval = -1;
+  }
+
+  ptp_destroy_object_prop_list(props, nrofprops);
+  free(batch);
+  free(starts);
+  return retval;
+}
+
+/**
+ * This function deletes a single file, track, playlist, folder or
+ * any other object off the MTP device, identified by the object ID.
+ *
+ * If you delete a folder, there is no guarantee that the device will
+ * really delete all the files that were in that folder, rather it is
+ * expected that they will not be deleted, and will turn up in object
+ * listings with parent set to a non-existant object ID. The safe way
+ * to do this is to recursively delete all files (and folders) contained
+ * in the folder, then the folder itself.
+ *
+ * @param device a pointer to the device to delete the object from.
+ * @param object_id the object to delete.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Delete_Object(LIBMTP_mtpdevice_t *device,
+			 uint32_t object_id)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+
+  listing_drop_object(device, object_id);
+  block_drop_object(device, object_id);
+  ret = ptp_deleteobject(params, object_id, 0);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Delete_Object(): could not delete object.");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * The function moves an object from one location on a device to another
+ * location.
+ *
+ * The semantics of moving a folder are not defined in the spec, but it
+ * appears to do the right thing when tested (but devices that implement
+ * this operation are rare).
+ *
+ * Note that moving an object may take a significant amount of time,
+ * particularly if being moved between storages. MTP does not provide
+ * any kind of progress mechanism, so the operation will simply block
+ * for the duration.
+ *
+ * @param device a pointer to the device where the object exists.
+ * @param object_id the object to move.
+ * @param storage_id the id of the destination storage.
+ * @param parent_id the id of the destination parent object (folder).
+ *	  If the destination is the root of the storage, pass '0'.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Move_Object(LIBMTP_mtpdevice_t *device,
+		       uint32_t object_id,
+		       uint32_t storage_id,
+		       uint32_t parent_id)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+
+  listing_drop_object(device, object_id);
+  ret = ptp_moveobject(params, object_id, storage_id, parent_id);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Move_Object(): could not move object.");
+    return -1;
+  }
+  listing_drop(device, parent_id);
+
+  return 0;
+}
+
+/**
+ * The function copies an object from one location on a device to another
+ * location.
+ *
+ * The semantics of copying a folder are not defined in the spec, but it
+ * appears to do the right thing when tested (but devices that implement
+ * this operation are rare).
+ *
+ * Note that copying an object may take a significant amount of time.
+ * MTP does not provide any kind of progress mechanism, so the operation
+ * will simply block for the duration.
+ *
+ * @param device a pointer to the device where the object exists.
+ * @param object_id the object to copy.
+ * @param storage_id the id of the destination storage.
+ * @param parent_id the id of the destination parent object (folder).
+ *	  If the destination is the root of the storage, pass '0'.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Copy_Object(LIBMTP_mtpdevice_t *device,
+		       uint32_t object_id,
+		       uint32_t storage_id,
+		       uint32_t parent_id)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+
+  ret = ptp_copyobject(params, object_id, storage_id, parent_id);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Copy_Object(): could not copy object.");
+    return -1;
+  }
+  listing_drop(device, parent_id);
+
+  return 0;
+}
+
+static int compare_oids(const void *a, const void *b)
+{
+  uint32_t const x = *(uint32_t const *) a;
+  uint32_t const y = *(uint32_t const *) b;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * Find an object ID in a sorted set of IDs.
+ * @return the position of the ID in the set, or -1 if it is not there.
+ */
+static int oid_set_find(uint32_t const *set, uint32_t const n,
+			uint32_t const oid)
+{
+  uint32_t const *found;
+
+  found = bsearch(&oid, set, n, sizeof(uint32_t), compare_oids);
+  return found == NULL ? -1 : (int) (found - set);
+}
+
+/**
+ * Tell if every object in a folder, and in its folders, is in a set
+ * of IDs, going by the object cache.
+ * @param params the PTP parameters.
+ * @param set the sorted set of IDs.
+ * @param n the number of IDs in the set.
+ * @param state per ID state, 0 not looked at, 1 whole, 2 not whole.
+ * @param pos the position of the folder in the set.
+ * @return 1 if the whole folder is in the set, 0 otherwise.
+ */
+static int oid_set_has_folder(PTPParams *params, uint32_t const *set,
+			      uint32_t const n, uint8_t *state, int const pos)
+{
+  PTPObject *ob;
+  PTPObject *child = NULL;
+  int j;
+
+  if (state[pos] != 0)
+    return state[pos] == 1;
+  // Taken as not whole until proven, so a looping tree ends here
+  state[pos] = 2;
+  if (ptp_object_find(params, set[pos], &ob) != PTP_RC_OK ||
+      PTP_OB_FORMAT(params, ob) != PTP_OFC_Association)
+    return 0;
+  while ((child = ptp_objects_next_by_parent(params, set[pos], child)) != NULL) {
+    j = oid_set_find(set, n, child->oid);
+    if (j < 0)
+      return 0;
+    if (PTP_OB_FORMAT(params, child) == PTP_OFC_Association &&
+	!oid_set_has_folder(params, set, n, state, j))
+      return 0;
+  }
+  state[pos] = 1;
+  return 1;
+}
+
+/**
+ * This function deletes many objects off the MTP device. The delete
+ * operations are sent back to back and the object cache is compacted
+ * once in the end.
+ *
+ * When the device keeps a full object cache and a folder is deleted
+ * along with everything in it, only the folder itself is deleted and
+ * the device takes its contents with it. Otherwise the objects are
+ * deleted one by one in the order given, so list the contents of a
+ * folder before the folder, see LIBMTP_Delete_Object().
+ *
+ * An object that cannot be deleted is skipped, the rest are still
+ * deleted unless the device stops responding.
+ *
+ * @param device a pointer to the device to delete the objects from.
+ * @param object_ids the objects to delete.
+ * @param count the number of objects.
+ * @return 0 on success, any other value means that some of the
+ *         objects could not be deleted, see the error stack.
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Delete_Objects(LIBMTP_mtpdevice_t *device,
+			  uint32_t const * const object_ids,
+			  uint32_t const count)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t *set;
+  uint32_t *send;
+  uint32_t *sendpos;
+  uint32_t *covered = NULL;
+  uint8_t *state;
+  uint8_t *deleted;
+  uint32_t nsend = 0;
+  uint32_t ncovered = 0;
+  uint32_t first;
+  unsigned int done;
+  uint32_t i;
+  uint16_t ret;
+  int retval = 0;
+
+  if (count == 0)
+    return 0;
+  set = malloc(count * sizeof(uint32_t));
+  send = malloc(count * sizeof(uint32_t));
+  sendpos = malloc(count * sizeof(uint32_t));
+  state = calloc(count, sizeof(uint8_t));
+  deleted = calloc(count, sizeof(uint8_t));
+  if (set == NULL || send == NULL || sendpos == NULL || state == NULL ||
+      deleted == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION, "LIBMTP_Delete_Objects(): "
+			    "out of memory.");
+    free(set);
+    free(send);
+    free(sendpos);
+    free(state);
+    free(deleted);
+    return -1;
+  }
+  memcpy(set, object_ids, count * sizeof(uint32_t));
+  qsort(set, count, sizeof(uint32_t), compare_oids);
+  for (i = 0; i < count; i++)
+    sendpos[i] = UINT32_MAX;
+
+  // Only a full cache tells if all of a folder is being deleted
+  if (device->cached && device->listings == NULL)
+    covered = malloc(count * 2 * sizeof(uint32_t));
+
+  for (i = 0; i < count; i++) {
+    uint32_t oid = object_ids[i];
+    int pos = oid_set_find(set, count, oid);
+    int top = -1;
+    PTPObject *ob;
+
+    if (sendpos[pos] != UINT32_MAX)
+      continue;
+    listing_drop_object(device, oid);
+    block_drop_object(device, oid);
+    // Look for the outermost folder deleted as a whole around it
+    while (covered != NULL && ptp_object_find(params, oid, &ob) == PTP_RC_OK) {
+      int j = oid_set_find(set, count, PTP_OB_PARENT(params, ob));
+
+      if (j < 0 || !oid_set_has_folder(params, set, count, state, j))
+	break;
+      top = j;
+      oid = PTP_OB_PARENT(params, ob);
+    }
+    if (top >= 0) {
+      covered[ncovered * 2] = object_ids[i];
+      covered[ncovered * 2 + 1] = (uint32_t) top;
+      ncovered++;
+      continue;
+    }
+    sendpos[pos] = nsend;
+    send[nsend++] = object_ids[i];
+  }
+
+  first = 0;
+  while (first < nsend) {
+    ret = ptp_deleteobjects(params, send + first, nsend - first, &done);
+    for (i = first; i < first + done; i++)
+      deleted[i] = 1;
+    first += done;
+    if (ret == PTP_RC_OK)
+      break;
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Delete_Objects(): could not delete object.");
+    retval = -1;
+    if (transport_failed(ret))
+      break;
+    // Skip the one refused and carry on
+    first++;
+  }
+
+  // What was inside the deleted folders went with them
+  if (ncovered) {
+    uint32_t n = 0;
+
+    for (i = 0; i < ncovered; i++) {
+      if (deleted[sendpos[covered[i * 2 + 1]]])
+	covered[n++] = covered[i * 2];
+    }
+    ptp_remove_objects_from_cache(params, covered, n);
+  }
+
+  free(covered);
+  free(deleted);
+  free(state);
+  free(sendpos);
+  free(send);
+  free(set);
+  return retval;
+}
+
+/**
+ * The function moves many objects into one folder. The move
+ * operations are sent back to back and the object cache is compacted
+ * once in the end. Objects that cannot be moved are skipped, the rest
+ * are still moved unless the device stops responding.
+ *
+ * @param device a pointer to the device where the objects exist.
+ * @param object_ids the objects to move.
+ * @param count the number of objects.
+ * @param storage_id the id of the destination storage.
+ * @param parent_id the id of the destination parent object (folder).
+ *	  If the destination is the root of the storage, pass '0'.
+ * @return 0 on success, any other value means that some of the
+ *         objects could not be moved, see the error stack.
+ * @see LIBMTP_Move_Object()
+ */
+int LIBMTP_Move_Objects(LIBMTP_mtpdevice_t *device,
+			uint32_t const * const object_ids,
+			uint32_t const count,
+			uint32_t storage_id,
+			uint32_t parent_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  unsigned int done;
+  uint32_t first = 0;
+  uint32_t i;
+  uint16_t ret;
+  int retval = 0;
+
+  for (i = 0; i < count; i++)
+    listing_drop_object(device, object_ids[i]);
+  while (first < count) {
+    ret = ptp_moveobjects(params, object_ids + first, count - first,
+			  storage_id, parent_id, &done);
+    first += done;
+    if (ret == PTP_RC_OK)
+      break;
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Move_Objects(): could not move object.");
+    retval = -1;
+    if (transport_failed(ret))
+      break;
+    first++;
+  }
+  listing_drop(device, parent_id);
+
+  return retval;
+}
+
+/**
+ * The function copies many objects into one folder, sending the copy
+ * operations back to back. Objects that cannot be copied are skipped,
+ * the rest are still copied unless the device stops responding.
+ *
+ * @param device a pointer to the device where the objects exist.
+ * @param object_ids the objects to copy.
+ * @param count the number of objects.
+ * @param storage_id the id of the destination storage.
+ * @param parent_id the id of the destination parent object (folder).
+ *	  If the destination is the root of the storage, pass '0'.
+ * @return 0 on success, any other value means that some of the
+ *         objects could not be copied, see the error stack.
+ * @see LIBMTP_Copy_Object()
+ */
+int LIBMTP_Copy_Objects(LIBMTP_mtpdevice_t *device,
+			uint32_t const * const object_ids,
+			uint32_t const count,
+			uint32_t storage_id,
+			uint32_t parent_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t i;
+  uint16_t ret;
+  int retval = 0;
+
+  for (i = 0; i < count; i++) {
+    ret = ptp_copyobject(params, object_ids[i], storage_id, parent_id);
+    if (ret == PTP_RC_OK)
+      continue;
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Copy_Objects(): could not copy object.");
+    retval = -1;
+    if (transport_failed(ret))
+      break;
+  }
+  listing_drop(device, parent_id);
+
+  return retval;
+}
+
+/**
+ * Internal function to update an object filename property.
+ */
+static int set_object_filename(LIBMTP_mtpdevice_t *device,
+			       uint32_t object_id, uint16_t ptp_type,
+			       const char **newname_ptr)
+{
+  PTPParams             *params = (PTPParams *) device->params;
+  PTP_USB               *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPObjectPropDesc     opd;
+  uint16_t              ret;
+  char                  *newname;
+
+  // See if we can modify the filename on this kind of files.
+  ret = ptp_mtp_getobjectpropdesc_cached(params, PTP_OPC_ObjectFileName, ptp_type, &opd);
+  if (ret != PTP_RC_OK) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
+			    "could not get property description.");
+    return -1;
+  }
+
+  if (!opd.GetSet) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
+            " property is not settable.");
+    // TODO: we COULD actually upload/download the object here, if we feel
+    //       like wasting time for the user.
+    return -1;
+  }
+
+  newname = strdup(*newname_ptr);
+
+  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+    strip_7bit_from_utf8(newname);
+  }
+
+  if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
+      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
+    MTPProperties *props = NULL;
+    MTPProperties *prop = NULL;
+    int nrofprops = 0;
+
+    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+    prop->ObjectHandle = object_id;
+    prop->property = PTP_OPC_ObjectFileName;
+    prop->datatype = PTP_DTC_STR;
+    prop->propval.str = newname;
+
+    ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
+
+    ptp_destroy_object_prop_list(props, nrofprops);
+
+    if (ret != PTP_RC_OK) {
+        add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
+              " could not set object property list.");
+        return -1;
+    }
+  } else if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjectPropValue)) {
+    ret = set_object_string(device, object_id, PTP_OPC_ObjectFileName, newname);
+    if (ret != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
+              " could not set object filename.");
+      return -1;
+    }
+  } else {
+    free(newname);
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "set_object_filename(): "
+              " your device doesn't seem to support any known way of setting metadata.");
+    return -1;
+  }
+
+
+  // update cached object properties if metadata cache exists
+  update_metadata_cache(device, object_id);
+
+  return 0;
+}
+
+/**
+ * This function renames a single file.
+ * This simply means that the PTP_OPC_ObjectFileName property
+ * is updated, if this is supported by the device.
+ *
+ * @param device a pointer to the device that contains the file.
+ * @param file the file metadata of the file to rename.
+ *        On success, the filename member is updated. Be aware, that
+ *        this name can be different than newname depending of device restrictions.
+ * @param newname the new filename for this object.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_File_Name(LIBMTP_mtpdevice_t *device,
+                   LIBMTP_file_t *file, const char *newname)
+{
+  int         ret;
+
+  ret = set_object_filename(device, file->item_id,
+			    map_libmtp_type_to_ptp_type(file->filetype),
+			    &newname);
+
+  if (ret != 0) {
+    return ret;
+  }
+
+  free(file->filename);
+  file->filename = strdup(newname);
+  return ret;
+}
+
+/**
+ * This function renames a single folder.
+ * This simply means that the PTP_OPC_ObjectFileName property
+ * is updated, if this is supported by the device.
+ *
+ * @param device a pointer to the device that contains the file.
+ * @param folder the folder metadata of the folder to rename.
+ *        On success, the name member is updated. Be aware, that
+ *        this name can be different than newname depending of device restrictions.
+ * @param newname the new name for this object.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Folder_Name(LIBMTP_mtpdevice_t *device,
+                   LIBMTP_folder_t *folder, const char* newname)
+{
+  int ret;
+
+  ret = set_object_filename(device, folder->folder_id,
+			    PTP_OFC_Association,
+			    &newname);
+
+  if (ret != 0) {
+    return ret;
+    }
+
+  free(folder->name);
+  folder->name = strdup(newname);
+  return ret;
+}
+
+/**
+ * This function renames a single track.
+ * This simply means that the PTP_OPC_ObjectFileName property
+ * is updated, if this is supported by the device.
+ *
+ * @param device a pointer to the device that contains the file.
+ * @param track the track metadata of the track to rename.
+ *        On success, the filename member is updated. Be aware, that
+ *        this name can be different than newname depending of device restrictions.
+ * @param newname the new filename for this object.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Track_Name(LIBMTP_mtpdevice_t *device,
+                   LIBMTP_track_t *track, const char* newname)
+{
+  int         ret;
+
+  ret = set_object_filename(device, track->item_id,
+			    map_libmtp_type_to_ptp_type(track->filetype),
+			    &newname);
+
+  if (ret != 0) {
+    return ret;
+  }
+
+  free(track->filename);
+  track->filename = strdup(newname);
+  return ret;
+}
+
+/**
+ * This function renames a single playlist object file holder.
+ * This simply means that the <code>PTP_OPC_ObjectFileName</code>
+ * property is updated, if this is supported by the device.
+ * The playlist filename should nominally end with an extension
+ * like ".pla".
+ *
+ * NOTE: if you want to change the metadata the device display
+ * about a playlist you must <i>not</i> use this function,
+ * use <code>LIBMTP_Update_Playlist()</code> instead!
+ *
+ * @param device a pointer to the device that contains the file.
+ * @param playlist the playlist metadata of the playlist to rename.
+ *        On success, the name member is updated. Be aware, that
+ *        this name can be different than newname depending of device restrictions.
+ * @param newname the new name for this object.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Update_Playlist()
+ */
+int LIBMTP_Set_Playlist_Name(LIBMTP_mtpdevice_t *device,
+                   LIBMTP_playlist_t *playlist, const char* newname)
+{
+  int ret;
+
+  ret = set_object_filename(device, playlist->playlist_id,
+			    PTP_OFC_MTP_AbstractAudioVideoPlaylist,
+			    &newname);
+
+  if (ret != 0) {
+    return ret;
+  }
+
+  free(playlist->name);
+  playlist->name = strdup(newname);
+  return ret;
+}
+
+/**
+ * This function renames a single album.
+ * This simply means that the <code>PTP_OPC_ObjectFileName</code>
+ * property is updated, if this is supported by the device.
+ * The album filename should nominally end with an extension
+ * like ".alb".
+ *
+ * NOTE: if you want to change the metadata the device display
+ * about a playlist you must <i>not</i> use this function,
+ * use <code>LIBMTP_Update_Album()</code> instead!
+ *
+ * @param device a pointer to the device that contains the file.
+ * @param album the album metadata of the album to rename.
+ *        On success, the name member is updated. Be aware, that
+ *        this name can be different than newname depending of device restrictions.
+ * @param newname the new name for this object.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Update_Album()
+ */
+int LIBMTP_Set_Album_Name(LIBMTP_mtpdevice_t *device,
+                   LIBMTP_album_t *album, const char* newname)
+{
+  int ret;
+
+  ret = set_object_filename(device, album->album_id,
+			    PTP_OFC_MTP_AbstractAudioAlbum,
+			    &newname);
+
+  if (ret != 0) {
+    return ret;
+  }
+
+  free(album->name);
+  album->name = strdup(newname);
+  return ret;
+}
+
+/**
+ * THIS FUNCTION IS DEPRECATED. PLEASE UPDATE YOUR CODE IN ORDER
+ * NOT TO USE IT.
+ *
+ * @see LIBMTP_Set_File_Name()
+ * @see LIBMTP_Set_Track_Name()
+ * @see LIBMTP_Set_Folder_Name()
+ * @see LIBMTP_Set_Playlist_Name()
+ * @see LIBMTP_Set_Album_Name()
+ */
+int LIBMTP_Set_Object_Filename(LIBMTP_mtpdevice_t *device,
+                   uint32_t object_id, char* newname)
+{
+  int             ret;
+  LIBMTP_file_t   *file;
+
+  file = LIBMTP_Get_Filemetadata(device, object_id);
+
+  if (file == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Set_Object_Filename(): "
+			    "could not get file metadata for target object.");
+    return -1;
+  }
+
+  ret = set_object_filename(device, object_id, map_libmtp_type_to_ptp_type(file->filetype), (const char **) &newname);
+
+  free(file);
+
+  return ret;
+}
+
+/**
+ * Helper function. This indicates if a track exists on the device
+ * @param device a pointer to the device to get the track from.
+ * @param id the track ID of the track to retrieve.
+ * @return TRUE (!=0) if the track exists, FALSE (0) if not
+ */
+int LIBMTP_Track_Exists(LIBMTP_mtpdevice_t *device,
+           uint32_t const id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+  PTPObject *ob;
+
+  ret = ptp_object_want (params, id, 0, &ob);
+  if (ret == PTP_RC_OK)
+      return -1;
+  return 0;
+}
+
+/**
+ * This creates a new folder structure and allocates memory
+ * for it. Notice that if you add strings to this structure they
+ * will be freed by the corresponding <code>LIBMTP_folder_track_t</code>
+ * operation later, so be careful of using strdup() when assigning
+ * strings, e.g.:
+ *
+ * @return a pointer to the newly allocated folder structure.
+ * @see LIBMTP_destroy_folder_t()
+ */
+LIBMTP_folder_t *LIBMTP_new_folder_t(void)
+{
+  LIBMTP_folder_t *new = (LIBMTP_folder_t *) malloc(sizeof(LIBMTP_folder_t));
+  if (new == NULL) {
+    return NULL;
+  }
+  new->folder_id = 0;
+  new->parent_id = 0;
+  new->storage_id = 0;
+  new->name = NULL;
+  new->sibling = NULL;
+  new->child = NULL;
+  return new;
+}
+
+/**
+ * This recursively deletes the memory for a folder structure.
+ * This shall typically be called on a top-level folder list to
+ * destroy the entire folder tree.
+ *
+ * @param folder folder structure to destroy
+ * @see LIBMTP_new_folder_t()
+ */
+void LIBMTP_destroy_folder_t(LIBMTP_folder_t *folder)
+{
+
+  if(folder == NULL) {
+     return;
+  }
+
+  //Destroy from the bottom up
+  if(folder->child != NULL) {
+     LIBMTP_destroy_folder_t(folder->child);
+  }
+
+  if(folder->sibling != NULL) {
+    LIBMTP_destroy_folder_t(folder->sibling);
+  }
+
+  if(folder->name != NULL) {
+    free(folder->name);
+  }
+
+  free(folder);
+}
+
+/**
+ * Helper function. Returns a folder structure for a
+ * specified id.
+ *
+ * @param folderlist list of folders to search
+ * @id id of folder to look for
+ * @return a folder or NULL if not found
+ */
+LIBMTP_folder_t *LIBMTP_Find_Folder(LIBMTP_folder_t *folderlist, uint32_t id)
+{
+  LIBMTP_folder_t *ret = NULL;
+
+  if(folderlist == NULL) {
+    return NULL;
+  }
+
+  if(folderlist->folder_id == id) {
+    return folderlist;
+  }
+
+  if(folderlist->sibling) {
+    ret = LIBMTP_Find_Folder(folderlist->sibling, id);
+  }
+
+  if(folderlist->child && ret == NULL) {
+    ret = LIBMTP_Find_Folder(folderlist->child, id);
+  }
+
+  return ret;
+}
+
+/**
+ * qsort() helper putting objects back in object cache order.
+ */
+static int compare_object_index(const void *a, const void *b)
+{
+  PTPObject const *oa = *(PTPObject * const *) a;
+  PTPObject const *ob = *(PTPObject * const *) b;
+
+  if (oa->objindex > ob->objindex)
+    return 1;
+  if (oa->objindex < ob->objindex)
+    return -1;
+  return 0;
+}
+
+/**
+ * Function used to recursively get subfolders from params. The
+ * children of each folder are looked up in the parent index of the
+ * object cache and come out in object cache order.
+ */
+static LIBMTP_folder_t *get_subfolders_for_folder(PTPParams *params,
+						  uint32_t const storage,
+						  uint32_t const parent)
+{
+  LIBMTP_folder_t *retfolders = NULL;
+  PTPObject **children = NULL;
+  PTPObject *ob = NULL;
+  unsigned int nrofchildren = 0;
+  unsigned int allocated = 0;
+  unsigned int i;
+
+  while ((ob = ptp_objects_next_by_parent(params, parent, ob)) != NULL) {
+    if (PTP_OB_FORMAT(params, ob) != PTP_OFC_Association || ob->oid == parent) {
+      continue;
+    }
+    if (storage != PTP_GOH_ALL_STORAGE && storage != PTP_OB_STORAGE(params, ob)) {
+      continue;
+    }
+    if (nrofchildren == allocated) {
+      PTPObject **tmp;
+
+      allocated = allocated ? allocated * 2 : 16;
+      tmp = realloc(children, allocated * sizeof(PTPObject *));
+      if (tmp == NULL) {
+	break;
+      }
+      children = tmp;
+    }
+    children[nrofchildren++] = ob;
+  }
+  if (nrofchildren > 1) {
+    qsort(children, nrofchildren, sizeof(PTPObject *), compare_object_index);
+  }
+
+  // Prepend backwards, so the siblings end up in cache order.
+  for (i = nrofchildren; i > 0; i--) {
+    LIBMTP_folder_t *folder;
+
+    ob = children[i - 1];
+
+    /*
+     * Do we know how to handle these? They are part
+     * of the MTP 1.0 specification paragraph 3.6.4.
+     * For AssociationDesc 0x00000001U ptp_mtp_getobjectreferences()
+     * should be called on these to get the contained objects, but
+     * we basically don't care. Hopefully parent_id is maintained for all
+     * children, because we rely on that instead.
+     */
+    if (PTP_OB_EXT(ob, AssociationDesc) != 0x00000000U) {
+      LIBMTP_INFO("MTP extended association type 0x%08x encountered\n", PTP_OB_EXT(ob, AssociationDesc));
+    }
+
+    // Create a folder struct...
+    folder = LIBMTP_new_folder_t();
+    if (folder == NULL) {
+      // malloc failure or so.
+      break;
+    }
+    folder->folder_id = ob->oid;
+    folder->parent_id = PTP_OB_PARENT(params, ob);
+    folder->storage_id = PTP_OB_STORAGE(params, ob);
+    folder->name = (PTP_OB_NAME(params, ob)) ? (char *)strdup(PTP_OB_NAME(params, ob)) : NULL;
+    folder->child = get_subfolders_for_folder(params, storage, ob->oid);
+
+    // Put this folder into the list of siblings.
+    folder->sibling = retfolders;
+    retfolders = folder;
+  }
+  free(children);
+
+  return retfolders;
+}
+
+/**
+ * This returns a list of all folders available
+ * on the current MTP device.
+ *
+ * @param device a pointer to the device to get the folder listing for.
+ * @param storage a storage ID to get the folder list from
+ * @return a list of folders
+ */
+ LIBMTP_folder_t *LIBMTP_Get_Folder_List_For_Storage(LIBMTP_mtpdevice_t *device,
+						    uint32_t const storage)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_folder_t *rv;
+
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0) {
+    flush_handles(device);
+  }
+
+  /*
+   * Walk the folder hierarchy from the root down through the parent
+   * index of the object cache. Folders that cannot be reached from
+   * the root (orphans) are not part of the returned tree.
+   */
+  rv = get_subfolders_for_folder(params, storage, 0x00000000U);
+
+  // Some buggy devices may have some files in the "root folder"
+  // 0xffffffff so if 0x00000000 didn't return any folders,
+  // look for children of the root 0xffffffffU
+  if (rv == NULL) {
+    rv = get_subfolders_for_folder(params, storage, 0xffffffffU);
+    if (rv != NULL)
+      LIBMTP_ERROR("Device have files in \"root folder\" 0xffffffffU - "
+		   "this is a firmware bug (but continuing)\n");
+  }
+
+  return rv;
+}
+
+/**
+ * This returns a list of all folders available
+ * on the current MTP device.
+ *
+ * @param device a pointer to the device to get the folder listing for.
+ * @return a list of folders
+ */
+LIBMTP_folder_t *LIBMTP_Get_Folder_List(LIBMTP_mtpdevice_t *device)
+{
+  return LIBMTP_Get_Folder_List_For_Storage(device, PTP_GOH_ALL_STORAGE);
+}
+
+/**
+ * This create a folder on the current MTP device. The PTP name
+ * for a folder is "association". The PTP/MTP devices does not
+ * have an internal "folder" concept really, it contains a flat
+ * list of all files and some file are "associations" that other
+ * files and folders may refer to as its "parent".
+ *
+ * @param device a pointer to the device to create the folder on.
+ * @param name the name of the new folder. Note this can be modified
+ *        if the device does not support all the characters in the
+ *        name.
+ * @param parent_id id of parent folder to add the new folder to,
+ *        or 0xFFFFFFFF to put it in the root directory.
+ * @param storage_id id of the storage to add this new folder to.
+ *        notice that you cannot mismatch storage id and parent id:
+ *        they must both be on the same storage! Pass in 0 if you
+ *        want to create this folder on the default storage.
+ * @return id to new folder or 0 if an error occurred
+ */
+uint32_t LIBMTP_Create_Folder(LIBMTP_mtpdevice_t *device, char *name,
+			      uint32_t parent_id, uint32_t storage_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint32_t parenthandle = 0;
+  uint32_t store;
+  PTPObjectInfo new_folder;
+  uint16_t ret;
+  uint32_t new_id = 0;
+
+  if (storage_id == 0) {
+    // I'm just guessing that a folder may require 512 bytes
+    store = get_suggested_storage_id(device, 512, parent_id);
+  } else {
+    store = storage_id;
+  }
+  parenthandle = parent_id;
+
+  memset(&new_folder, 0, sizeof(new_folder));
+  new_folder.Filename = name;
+  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+    strip_7bit_from_utf8(new_folder.Filename);
+  }
+  new_folder.ObjectCompressedSize = 0;
+  new_folder.ObjectFormat = PTP_OFC_Association;
+  new_folder.ProtectionStatus = PTP_PS_NoProtection;
+  new_folder.AssociationType = PTP_AT_GenericFolder;
+  new_folder.ParentObject = parent_id;
+  new_folder.StorageID = store;
+
+  // Create the object
+  if (!(params->device_flags & DEVICE_FLAG_BROKEN_SEND_OBJECT_PROPLIST) &&
+	ptp_operation_issupported(params,PTP_OC_MTP_SendObjectPropList)) {
+	MTPProperties *props = (MTPProperties*)calloc(2,sizeof(MTPProperties));
+
+	props[0].property = PTP_OPC_ObjectFileName;
+	props[0].datatype = PTP_DTC_STR;
+	props[0].propval.str = name;
+
+	props[1].property = PTP_OPC_Name;
+	props[1].datatype = PTP_DTC_STR;
+	props[1].propval.str = name;
+
+	ret = ptp_mtp_sendobjectproplist(params, &store, &parenthandle, &new_id, PTP_OFC_Association,
+			0, props, 1);
+	free(props);
+  } else {
+	ret = ptp_sendobjectinfo(params, &store, &parenthandle, &new_id, &new_folder);
+  }
+
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Create_Folder: Could not send object info.");
+    if (ret == PTP_RC_AccessDenied) {
+      add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
+    }
+    return 0;
+  }
+  // NOTE: don't destroy the new_folder objectinfo, because it is statically referencing
+  // several strings.
+
+  add_object_to_cache(device, new_id);
+
+  return new_id;
+}
+
+/**
+ * This creates a new playlist metadata structure and allocates memory
+ * for it. Notice that if you add strings to this structure they
+ * will be freed by the corresponding <code>LIBMTP_destroy_playlist_t</code>
+ * operation later, so be careful of using strdup() when assigning
+ * strings, e.g.:
+ *
+ * <pre>
+ * LIBMTP_playlist_t *pl = LIBMTP_new_playlist_t();
+ * pl->name = strdup(str);
+ * ....
+ * LIBMTP_destroy_playlist_t(pl);
+ * </pre>
+ *
+ * @return a pointer to the newly allocated metadata structure.
+ * @see LIBMTP_destroy_playlist_t()
+ */
+LIBMTP_playlist_t *LIBMTP_new_playlist_t(void)
+{
+  LIBMTP_playlist_t *new = (LIBMTP_playlist_t *) malloc(sizeof(LIBMTP_playlist_t));
+  if (new == NULL) {
+    return NULL;
+  }
+  new->playlist_id = 0;
+  new->parent_id = 0;
+  new->storage_id = 0;
+  new->name = NULL;
+  new->tracks = NULL;
+  new->no_tracks = 0;
+  new->next = NULL;
+  return new;
+}
+
+/**
+ * This destroys a playlist metadata structure and deallocates the memory
+ * used by it, including any strings. Never use a track metadata
+ * structure again after calling this function on it.
+ * @param playlist the playlist metadata to destroy.
+ * @see LIBMTP_new_playlist_t()
+ */
+void LIBMTP_destroy_playlist_t(LIBMTP_playlist_t *playlist)
+{
+  if (playlist == NULL) {
+    return;
+  }
+  if (playlist->name != NULL)
+    free(playlist->name);
+  if (playlist->tracks != NULL)
+    free(playlist->tracks);
+  free(playlist);
+  return;
+}
+
+/**
+ * This gets the track references of a playlist or album, from the
+ * object cache if the device has one and they were read before.
+ * @param device a pointer to the device.
+ * @param id the playlist or album.
+ * @param tracks returns the tracks, to be freed by the caller.
+ * @param no_tracks returns the number of tracks.
+ * @return the PTP return code.
+ */
+static uint16_t get_object_references(LIBMTP_mtpdevice_t *device,
+				      uint32_t const id, uint32_t **tracks,
+				      uint32_t *no_tracks)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  if (device->cached)
+    return ptp_mtp_getobjectreferences_cached(params, id, tracks, no_tracks);
+  return ptp_mtp_getobjectreferences(params, id, tracks, no_tracks);
+}
+
+/**
+ * Read the references of all cached objects of a format in one pass,
+ * so that building a playlist or album list does not issue one
+ * separate lookup per list later on.
+ * @param device a pointer to the device.
+ * @param ofc the object format of the lists.
+ * @param storage_id the storage to look at, or 0 for all.
+ */
+static void load_references_for_format(LIBMTP_mtpdevice_t *device,
+				       uint16_t const ofc,
+				       uint32_t const storage_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t *ids;
+  uint32_t nrofids = 0;
+  uint32_t i;
+
+  if (!device->cached || params->nrofobjects == 0)
+    return;
+  ids = (uint32_t *) malloc(params->nrofobjects * sizeof(uint32_t));
+  if (ids == NULL)
+    return;
+  // Only the format and storage columns are read here
+  for (i = 0; i < params->nrofobjects; i++) {
+    if (params->obcols.format[i] != ofc)
+      continue;
+    if (storage_id != 0 && params->obcols.storage[i] != storage_id)
+      continue;
+    ids[nrofids++] = params->obcols.oid[i];
+  }
+  if (nrofids != 0)
+    ptp_mtp_loadobjectreferences(params, ids, nrofids);
+  free(ids);
+}
+
+/**
+ * This gets the name of a playlist. A name that was read along with
+ * the rest of the object properties is used as is, and if the object
+ * properties are cached but have no name the filename is used without
+ * asking the device again.
+ * @param device a pointer to the device.
+ * @param ob the playlist object.
+ * @return a newly allocated name, or NULL.
+ */
+static char *get_list_name(LIBMTP_mtpdevice_t *device, PTPObject *ob)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  MTPProperties *prop;
+  char *name = NULL;
+
+  prop = ptp_find_object_prop_in_cache(params, ob->oid, PTP_OPC_Name);
+  if (prop != NULL) {
+    if (prop->propval.str != NULL)
+      name = strdup(prop->propval.str);
+  } else if (!(ob->flags & PTPOBJECT_MTPPROPLIST_LOADED)) {
+    name = get_string_from_object(device, ob->oid, PTP_OPC_Name);
+  }
+  if (name == NULL && PTP_OB_NAME(params, ob) != NULL)
+    name = strdup(PTP_OB_NAME(params, ob));
+  return name;
+}
+
+/**
+ * This reads the track references of a number of playlists or albums
+ * in one pass and keeps them in the metadata cache, so that
+ * subsequent calls to <code>LIBMTP_Get_Playlist()</code>,
+ * <code>LIBMTP_Get_Album()</code> and the list functions need not
+ * ask the device again. The references are dropped again when the
+ * device reports a change to them or when a referenced object is
+ * removed. This does nothing for devices opened without a cache.
+ * @param device a pointer to the device.
+ * @param ids the playlists or albums.
+ * @param nrofids the number of IDs.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Load_Object_References(LIBMTP_mtpdevice_t *device,
+				  uint32_t const * const ids,
+				  uint32_t const nrofids)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+
+  if (!device->cached)
+    return 0;
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0) {
+    flush_handles(device);
+  }
+  ret = ptp_mtp_loadobjectreferences(params, ids, nrofids);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Load_Object_References(): "
+				"could not get object references.");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * This function returns a list of the playlists available on the
+ * device. Typical usage:
+ *
+ * <pre>
+ * </pre>
+ *
+ * @param device a pointer to the device to get the playlist listing from.
+ * @return a playlist list on success, else NULL. If there are no playlists
+ *         on the device, NULL will be returned as well.
+ * @see LIBMTP_Get_Playlist()
+ */
+LIBMTP_playlist_t *LIBMTP_Get_Playlist_List(LIBMTP_mtpdevice_t *device)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  const int REQ_SPL = FLAG_PLAYLIST_SPL(ptp_usb);
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_playlist_t *retlists = NULL;
+  LIBMTP_playlist_t *curlist = NULL;
+  uint32_t i;
+
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0) {
+    flush_handles(device);
+  }
+  load_references_for_format(device, PTP_OFC_MTP_AbstractAudioVideoPlaylist, 0);
+
+  for (i = 0; i < params->nrofobjects; i++) {
+    LIBMTP_playlist_t *pl;
+    PTPObject *ob;
+    PTPObjectInfo oi;
+    uint16_t ret;
+
+    // Ignore stuff that isn't playlists
+    if (!REQ_SPL &&
+	params->obcols.format[i] != PTP_OFC_MTP_AbstractAudioVideoPlaylist)
+      continue;
+
+    ob = params->objects[i];
+
+    // For Samsung players we must look for the .spl extension explicitly since
+    // playlists are not stored as playlist objects.
+    if (REQ_SPL)
+      ptp_object_get_objectinfo(params, ob, &oi);
+    if ( REQ_SPL && is_spl_playlist(&oi) ) {
+      // Allocate a new playlist type
+      pl = LIBMTP_new_playlist_t();
+      spl_to_playlist_t(device, &oi, ob->oid, pl);
+    }
+    else if ( PTP_OB_FORMAT(params, ob) != PTP_OFC_MTP_AbstractAudioVideoPlaylist ) {
+      continue;
+    }
+    else {
+      // Allocate a new playlist type
+      pl = LIBMTP_new_playlist_t();
+
+      // Try to look up proper name, else use the oi->Filename field.
+      pl->name = get_list_name(device, ob);
+      pl->playlist_id = ob->oid;
+      pl->parent_id = PTP_OB_PARENT(params, ob);
+      pl->storage_id = PTP_OB_STORAGE(params, ob);
+
+      // Then get the track listing for this playlist
+      ret = get_object_references(device, pl->playlist_id, &pl->tracks, &pl->no_tracks);
+      if (ret != PTP_RC_OK) {
+        add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Playlist_List(): "
+				    "could not get object references.");
+        pl->tracks = NULL;
+        pl->no_tracks = 0;
+      }
+    }
+
+    // Add playlist to a list that will be returned afterwards.
+    if (retlists == NULL) {
+      retlists = pl;
+      curlist = pl;
+    } else {
+      curlist->next = pl;
+      curlist = pl;
+    }
+
+    // Call callback here if we decide to add that possibility...
+  }
+  return retlists;
+}
+
+
+/**
+ * This function retrieves an individual playlist from the device.
+ * @param device a pointer to the device to get the playlist from.
+ * @param plid the unique ID of the playlist to retrieve.
+ * @return a valid playlist metadata post or NULL on failure.
+ * @see LIBMTP_Get_Playlist_List()
+ */
+LIBMTP_playlist_t *LIBMTP_Get_Playlist(LIBMTP_mtpdevice_t *device, uint32_t const plid)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  const int REQ_SPL = FLAG_PLAYLIST_SPL(ptp_usb);
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObject *ob;
+  PTPObjectInfo oi;
+  LIBMTP_playlist_t *pl;
+  uint16_t ret;
+
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0) {
+    flush_handles(device);
+  }
+
+  ret = ptp_object_want (params, plid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK)
+    return NULL;
+
+  // For Samsung players we must look for the .spl extension explicitly since
+  // playlists are not stored as playlist objects.
+  ptp_object_get_objectinfo(params, ob, &oi);
+  if ( REQ_SPL && is_spl_playlist(&oi) ) {
+    // Allocate a new playlist type
+    pl = LIBMTP_new_playlist_t();
+    spl_to_playlist_t(device, &oi, ob->oid, pl);
+    return pl;
+  }
+
+  // Ignore stuff that isn't playlists
+  else if ( PTP_OB_FORMAT(params, ob) != PTP_OFC_MTP_AbstractAudioVideoPlaylist ) {
+    return NULL;
+  }
+
+  // Allocate a new playlist type
+  pl = LIBMTP_new_playlist_t();
+
+  pl->name = get_list_name(device, ob);
+  pl->playlist_id = ob->oid;
+  pl->parent_id = PTP_OB_PARENT(params, ob);
+  pl->storage_id = PTP_OB_STORAGE(params, ob);
+
+  // Then get the track listing for this playlist
+  ret = get_object_references(device, pl->playlist_id, &pl->tracks, &pl->no_tracks);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Playlist(): Could not get object references.");
+    pl->tracks = NULL;
+    pl->no_tracks = 0;
+  }
+
+  return pl;
+}
+
+/**
+ * This function creates a new abstract list such as a playlist
+ * or an album.
+ *
+ * @param device a pointer to the device to create the new abstract list
+ *        on.
+ * @param name the name of the new abstract list.
+ * @param artist the artist of the new abstract list or NULL.
+ * @param genre the genre of the new abstract list or NULL.
+ * @param parenthandle the handle of the parent or 0 for no parent
+ *        i.e. the root folder.
+ * @param objectformat the abstract list type to create.
+ * @param suffix the ".foo" (4 characters) suffix to use for the virtual
+ *        "file" created by this operation.
+ * @param newid a pointer to a variable that will hold the new object
+ *        ID if this call is successful.
+ * @param tracks an array of tracks to associate with this list.
+ * @param no_tracks the number of tracks in the list.
+ * @return 0 on success, any other value means failure.
+ */
+static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
+				    char const * const name,
+				    char const * const artist,
+				    char const * const composer,
+				    char const * const genre,
+				    uint32_t const parenthandle,
+				    uint32_t const storageid,
+				    uint16_t const objectformat,
+				    char const * const suffix,
+				    uint32_t * const newid,
+				    uint32_t const * const tracks,
+				    uint32_t const no_tracks)
+
+{
+  unsigned int i;
+  int supported = 0;
+  uint16_t ret;
+  uint16_t *properties = NULL;
+  uint32_t propcnt = 0;
+  uint32_t store;
+  uint32_t localph = parenthandle;
+  uint8_t nonconsumable = 0x00U; /* By default it is consumable */
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  char fname[256];
+  //uint8_t data[2];
+
+  // NULL check
+  if (!name) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): list name was NULL, using default name \"Unknown\"");
+    return -1;
+  }
+
+  if (storageid == 0) {
+    // I'm just guessing that an abstract list may require 512 bytes
+    store = get_suggested_storage_id(device, 512, localph);
+  } else {
+    store = storageid;
+  }
+
+  // Check if we can create an object of this type
+  for ( i=0; i < params->deviceinfo.ImageFormats_len; i++ ) {
+    if (params->deviceinfo.ImageFormats[i] == objectformat) {
+      supported = 1;
+      break;
+    }
+  }
+  if (!supported) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): player does not support this abstract type");
+    LIBMTP_ERROR("Unsupported abstract list type: %04x\n", objectformat);
+    return -1;
+  }
+
+  // add the new suffix if it isn't there
+  fname[0] = '\0';
+  if (strlen(name) > strlen(suffix)) {
+    char const * const suff = &name[strlen(name)-strlen(suffix)];
+    if (!strcmp(suff, suffix)) {
+      // Home free.
+      strncpy(fname, name, sizeof(fname));
+    }
+  }
+  // If it didn't end with "<suffix>" then add that here.
+  if (fname[0] == '\0') {
+    strncpy(fname, name, sizeof(fname)-strlen(suffix)-1);
+    strcat(fname, suffix);
+    fname[sizeof(fname)-1] = '\0';
+  }
+
+  if (ptp_operation_issupported(params, PTP_OC_MTP_SendObjectPropList) &&
+      !FLAG_BROKEN_SEND_OBJECT_PROPLIST(ptp_usb)) {
+    MTPProperties *props = NULL;
+    MTPProperties *prop = NULL;
+    int nrofprops = 0;
+
+    *newid = 0x00000000U;
+
+    ret = ptp_mtp_getobjectpropssupported_cached(params, objectformat, &propcnt, &properties);
+
+    for (i=0;i<propcnt;i++) {
+      PTPObjectPropDesc opd;
+
+      ret = ptp_mtp_getobjectpropdesc_cached(params, properties[i], objectformat, &opd);
+      if (ret != PTP_RC_OK) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): "
+				"could not get property description.");
+      } else if (opd.GetSet) {
+	switch (properties[i]) {
+	case PTP_OPC_ObjectFileName:
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = *newid;
+	  prop->property = PTP_OPC_ObjectFileName;
+	  prop->datatype = PTP_DTC_STR;
+	  prop->propval.str = strdup(fname);
+	  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+	    strip_7bit_from_utf8(prop->propval.str);
+	  }
+	  break;
+	case PTP_OPC_ProtectionStatus:
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = *newid;
+	  prop->property = PTP_OPC_ProtectionStatus;
+	  prop->datatype = PTP_DTC_UINT16;
+	  prop->propval.u16 = 0x0000U; /* Not protected */
+	  break;
+	case PTP_OPC_NonConsumable:
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = *newid;
+	  prop->property = PTP_OPC_NonConsumable;
+	  prop->datatype = PTP_DTC_UINT8;
+	  prop->propval.u8 = nonconsumable;
+	  break;
+	case PTP_OPC_Name:
+	  if (name != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop->ObjectHandle = *newid;
+	    prop->property = PTP_OPC_Name;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(name);
+	  }
+	  break;
+	case PTP_OPC_AlbumArtist:
+	  if (artist != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop->ObjectHandle = *newid;
+	    prop->property = PTP_OPC_AlbumArtist;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(artist);
+	  }
+	  break;
+	case PTP_OPC_Artist:
+	  if (artist != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop->ObjectHandle = *newid;
+	    prop->property = PTP_OPC_Artist;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(artist);
+	  }
+	  break;
+	case PTP_OPC_Composer:
+	  if (composer != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop->ObjectHandle = *newid;
+	    prop->property = PTP_OPC_Composer;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(composer);
+	  }
+	  break;
+	case PTP_OPC_Genre:
+	  if (genre != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop->ObjectHandle = *newid;
+	    prop->property = PTP_OPC_Genre;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(genre);
+	  }
+	  break;
+ 	case PTP_OPC_DateModified:
+	  // Tag with current time if that is supported
+	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop->ObjectHandle = *newid;
+	    prop->property = PTP_OPC_DateModified;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = get_iso8601_stamp();
+	  }
+	  break;
+	}
+      }
+    }
+    free(properties);
+
+    ret = ptp_mtp_sendobjectproplist(params, &store, &localph, newid,
+				     objectformat, 0, props, nrofprops);
+
+    /* Free property list */
+    ptp_destroy_object_prop_list(props, nrofprops);
+
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send object property list.");
+      if (ret == PTP_RC_AccessDenied) {
+	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
+      }
+      return -1;
+    }
+
+    // now send the blank object
+    ret = ptp_sendobject(params, NULL, 0);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send blank object data.");
+      return -1;
+    }
+
+  } else if (ptp_operation_issupported(params,PTP_OC_SendObjectInfo)) {
+    PTPObjectInfo new_object;
+
+    new_object.Filename = fname;
+    if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+      strip_7bit_from_utf8(new_object.Filename);
+    }
+    // At one point this had to be one
+    new_object.ObjectCompressedSize = 0;
+    new_object.ObjectFormat = objectformat;
+
+    // Create the object
+    ret = ptp_sendobjectinfo(params, &store, &localph, newid, &new_object);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send object info (the playlist itself).");
+      if (ret == PTP_RC_AccessDenied) {
+	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
+      }
+      return -1;
+    }
+    // NOTE: don't destroy new_object objectinfo afterwards - the strings it contains are
+    // not copies.
+
+#if 0
+    /*
+     * At one time we had to send this one blank data byte.
+     * If we didn't, the handle will not be created and thus there is
+     * no playlist. Possibly this was masking some bug, so removing it
+     * now.
+     */
+    data[0] = '\0';
+    data[1] = '\0';
+    ret = ptp_sendobject(params, data, 1);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): Could not send blank object data.");
+      return -1;
+    }
+#endif
+
+    // set the properties one by one
+    ret = ptp_mtp_getobjectpropssupported_cached(params, objectformat, &propcnt, &properties);
+
+    for (i=0;i<propcnt;i++) {
+      PTPObjectPropDesc opd;
+
+      ret = ptp_mtp_getobjectpropdesc_cached(params, properties[i], objectformat, &opd);
+      if (ret != PTP_RC_OK) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): "
+				"could not get property description.");
+      } else if (opd.GetSet) {
+	switch (properties[i]) {
+	case PTP_OPC_Name:
+	  if (name != NULL) {
+	    ret = set_object_string(device, *newid, PTP_OPC_Name, name);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity name.");
+	      return -1;
+	    }
+	  }
+	  break;
+	case PTP_OPC_AlbumArtist:
+	  if (artist != NULL) {
+	    ret = set_object_string(device, *newid, PTP_OPC_AlbumArtist, artist);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity album artist.");
+	      return -1;
+	    }
+	  }
+	  break;
+	case PTP_OPC_Artist:
+	  if (artist != NULL) {
+	    ret = set_object_string(device, *newid, PTP_OPC_Artist, artist);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity artist.");
+	      return -1;
+	    }
+	  }
+	  break;
+	case PTP_OPC_Composer:
+	  if (composer != NULL) {
+	    ret = set_object_string(device, *newid, PTP_OPC_Composer, composer);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity composer.");
+	      return -1;
+	    }
+	  }
+	  break;
+	case PTP_OPC_Genre:
+	  if (genre != NULL) {
+	    ret = set_object_string(device, *newid, PTP_OPC_Genre, genre);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set entity genre.");
+	      return -1;
+	    }
+	  }
+	  break;
+ 	case PTP_OPC_DateModified:
+	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	    ret = set_object_string(device, *newid, PTP_OPC_DateModified, get_iso8601_stamp());
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "create_new_abstract_list(): could not set date modified.");
+	      return -1;
+	    }
+	  }
+	  break;
+	}
+      }
+    }
+    free(properties);
+  }
+
+  if (no_tracks > 0) {
+    // Add tracks to the list as object references.
+    ret = ptp_mtp_setobjectreferences (params, *newid, (uint32_t *) tracks, no_tracks);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): could not add tracks as object references.");
+      return -1;
+    }
+  }
+
+  add_object_to_cache(device, *newid);
+
+  return 0;
+}
+
+/**
+ * This updates the metadata and track listing
+ * for an abstract list.
+ * @param device a pointer to the device that the abstract list
+ *        resides on.
+ * @param name the name of the abstract list.
+ * @param artist the artist of the abstract list or NULL.
+ * @param genre the genre of the abstract list or NULL.
+ * @param objecthandle the object to be updated.
+ * @param objectformat the abstract list type to update.
+ * @param tracks an array of tracks to associate with this list.
+ * @param no_tracks the number of tracks in the list.
+ * @return 0 on success, any other value means failure.
+ */
+static int update_abstract_list(LIBMTP_mtpdevice_t *device,
+				char const * const name,
+				char const * const artist,
+				char const * const composer,
+				char const * const genre,
+				uint32_t const objecthandle,
+				uint16_t const objectformat,
+				uint32_t const * const tracks,
+				uint32_t const no_tracks)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint16_t *properties = NULL;
+  uint32_t propcnt = 0;
+  unsigned int i;
+
+  // First see which properties can be set
+  // i.e only try to update this metadata for object tags that exist on the current player.
+  ret = ptp_mtp_getobjectpropssupported_cached(params, objectformat, &propcnt, &properties);
+  if (ret != PTP_RC_OK) {
+    // Just bail out for now, nothing is ever set.
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+			    "could not retrieve supported object properties.");
+    return -1;
+  }
+  if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjPropList) &&
+      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
+    MTPProperties *props = NULL;
+    MTPProperties *prop = NULL;
+    int nrofprops = 0;
+
+    for (i=0;i<propcnt;i++) {
+      PTPObjectPropDesc opd;
+
+      ret = ptp_mtp_getobjectpropdesc_cached(params, properties[i], objectformat, &opd);
+      if (ret != PTP_RC_OK) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				"could not get property description.");
+      } else if (opd.GetSet) {
+	switch (properties[i]) {
+	case PTP_OPC_Name:
+	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	  prop->ObjectHandle = objecthandle;
+	  prop->property = PTP_OPC_Name;
+	  prop->datatype = PTP_DTC_STR;
+	  if (name != NULL)
+	    prop->propval.str = strdup(name);
+	  break;
+	case PTP_OPC_AlbumArtist:
+	  if (artist != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop->ObjectHandle = objecthandle;
+	    prop->property = PTP_OPC_AlbumArtist;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(artist);
+	  }
+	  break;
+	case PTP_OPC_Artist:
+	  if (artist != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop->ObjectHandle = objecthandle;
+	    prop->property = PTP_OPC_Artist;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(artist);
+	  }
+	  break;
+	case PTP_OPC_Composer:
+	  if (composer != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop->ObjectHandle = objecthandle;
+	    prop->property = PTP_OPC_Composer;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(composer);
+	  }
+	  break;
+	case PTP_OPC_Genre:
+	  if (genre != NULL) {
+	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop->ObjectHandle = objecthandle;
+	    prop->property = PTP_OPC_Genre;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = strdup(genre);
+	  }
+	  break;
+ 	case PTP_OPC_DateModified:
+	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	    // Tag with current time if that is supported
+	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+	    prop->ObjectHandle = objecthandle;
+	    prop->property = PTP_OPC_DateModified;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = get_iso8601_stamp();
+	  }
+	  break;
+	default:
+	  break;
+	}
+      }
+    }
+
+    // proplist could be NULL if we can't write any properties
+    if (props != NULL) {
+      ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
+
+      ptp_destroy_object_prop_list(props, nrofprops);
+
+      if (ret != PTP_RC_OK) {
+        // TODO: return error of which property we couldn't set
+        add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+                                "could not set object property list.");
+        free(properties);
+        return -1;
+      }
+    }
+
+  } else if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjectPropValue)) {
+    for (i=0;i<propcnt;i++) {
+      switch (properties[i]) {
+      case PTP_OPC_Name:
+	// Update title
+	ret = set_object_string(device, objecthandle, PTP_OPC_Name, name);
+	if (ret != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				  "could not set title.");
+	}
+	break;
+      case PTP_OPC_AlbumArtist:
+	// Update album artist
+	ret = set_object_string(device, objecthandle, PTP_OPC_AlbumArtist, artist);
+	if (ret != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				  "could not set album artist name.");
+	}
+	break;
+      case PTP_OPC_Artist:
+	// Update artist
+	ret = set_object_string(device, objecthandle, PTP_OPC_Artist, artist);
+	if (ret != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				  "could not set artist name.");
+	}
+	break;
+      case PTP_OPC_Composer:
+	// Update composer
+	ret = set_object_string(device, objecthandle, PTP_OPC_Composer, composer);
+	if (ret != 0) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				  "could not set composer name.");
+	}
+	break;
+      case PTP_OPC_Genre:
+	// Update genre (but only if valid)
+	if(genre) {
+	  ret = set_object_string(device, objecthandle, PTP_OPC_Genre, genre);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				    "could not set genre.");
+	  }
+        }
+	break;
+      case PTP_OPC_DateModified:
+	// Update date modified
+	if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	  char *tmpdate = get_iso8601_stamp();
+	  ret = set_object_string(device, objecthandle, PTP_OPC_DateModified, tmpdate);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				    "could not set modification date.");
+	  }
+	  free(tmpdate);
+	}
+	break;
+      default:
+	break;
+      }
+    }
+  } else {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+                            "Your device doesn't seem to support any known way of setting metadata.");
+    free(properties);
+    return -1;
+  }
+
+  // Then the object references...
+  ret = ptp_mtp_setobjectreferences (params, objecthandle, (uint32_t *) tracks, no_tracks);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "update_abstract_list(): could not add tracks as object references.");
+    free(properties);
+    return -1;
+  }
+
+  free(properties);
+
+  update_metadata_cache(device, objecthandle);
+
+  return 0;
+}
+
+
+/**
+ * This routine creates a new playlist based on the metadata
+ * supplied. If the <code>tracks</code> field of the metadata
+ * contains a track listing, these tracks will be added to the
+ * playlist.
+ * @param device a pointer to the device to create the new playlist on.
+ * @param metadata the metadata for the new playlist. If the function
+ *        exits with success, the <code>playlist_id</code> field of this
+ *        struct will contain the new playlist ID of the playlist.
+ *        <ul>
+ *        <li><code>metadata-&gt;parent_id</code> should be set to the parent 
+ *        (e.g. folder) to store this track in. Since some 
+ *        devices are a bit picky about where files
+ *        are placed, a default folder will be chosen if libmtp
+ *        has detected one for the current filetype and this
+ *        parameter is set to 0. If this is 0 and no default folder
+ *        can be found, the file will be stored in the root folder.
+ *        <li><code>metadata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this track in. Setting this to 0 will store
+ *        the track on the primary storage.
+ *        </ul>
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Update_Playlist()
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Create_New_Playlist(LIBMTP_mtpdevice_t *device,
+			       LIBMTP_playlist_t * const metadata)
+{
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint32_t localph = metadata->parent_id;
+
+  // Use a default folder if none given
+  if (localph == 0) {
+    if (device->default_playlist_folder != 0)
+      localph = device->default_playlist_folder;
+    else
+      localph = device->default_music_folder;
+  }
+  metadata->parent_id = localph;
+
+  // Samsung needs its own special type of playlists
+  if(FLAG_PLAYLIST_SPL(ptp_usb)) {
+    return playlist_t_to_spl(device, metadata);
+  }
+
+  // Just create a new abstract audio/video playlist...
+  return create_new_abstract_list(device,
+				  metadata->name,
+				  NULL,
+				  NULL,
+				  NULL,
+				  localph,
+				  metadata->storage_id,
+				  PTP_OFC_MTP_AbstractAudioVideoPlaylist,
+				  get_playlist_extension(ptp_usb),
+				  &metadata->playlist_id,
+				  metadata->tracks,
+				  metadata->no_tracks);
+}
+
+/**
+ * This routine updates a playlist based on the metadata
+ * supplied. If the <code>tracks</code> field of the metadata
+ * contains a track listing, these tracks will be added to the
+ * playlist in place of those already present, i.e. the
+ * previous track listing will be deleted. For Samsung devices the
+ * playlist id (metadata->playlist_id) is likely to change.
+ * @param device a pointer to the device to create the new playlist on.
+ * @param metadata the metadata for the playlist to be updated.
+ *                 notice that the field <code>playlist_id</code>
+ *                 must contain the appropriate playlist ID. Playlist ID
+ *                 be modified to a new playlist ID by the time the
+ *                 function returns since edit-in-place is not always possible.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Create_New_Playlist()
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Update_Playlist(LIBMTP_mtpdevice_t *device,
+			   LIBMTP_playlist_t * const metadata)
+{
+
+  // Samsung needs its own special type of playlists
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  if(FLAG_PLAYLIST_SPL(ptp_usb)) {
+    return update_spl_playlist(device, metadata);
+  }
+
+  return update_abstract_list(device,
+			      metadata->name,
+			      NULL,
+			      NULL,
+			      NULL,
+			      metadata->playlist_id,
+			      PTP_OFC_MTP_AbstractAudioVideoPlaylist,
+			      metadata->tracks,
+			      metadata->no_tracks);
+}
+
+/**
+ * This creates a new album metadata structure and allocates memory
+ * for it. Notice that if you add strings to this structure they
+ * will be freed by the corresponding <code>LIBMTP_destroy_album_t</code>
+ * operation later, so be careful of using strdup() when assigning
+ * strings.
+ *
+ * @return a pointer to the newly allocated metadata structure.
+ * @see LIBMTP_destroy_album_t()
+ */
+LIBMTP_album_t *LIBMTP_new_album_t(void)
+{
+  LIBMTP_album_t *new = (LIBMTP_album_t *) malloc(sizeof(LIBMTP_album_t));
+  if (new == NULL) {
+    return NULL;
+  }
+  new->album_id = 0;
+  new->parent_id = 0;
+  new->storage_id = 0;
+  new->name = NULL;
+  new->artist = NULL;
+  new->composer = NULL;
+  new->genre = NULL;
+  new->tracks = NULL;
+  new->no_tracks = 0;
+  new->next = NULL;
+  return new;
+}
+
+/**
+ * This recursively deletes the memory for an album structure
+ *
+ * @param album structure to destroy
+ * @see LIBMTP_new_album_t()
+ */
+void LIBMTP_destroy_album_t(LIBMTP_album_t *album)
+{
+  if (album == NULL) {
+    return;
+  }
+  if (album->name != NULL)
+    free(album->name);
+  if (album->artist != NULL)
+    free(album->artist);
+  if (album->composer != NULL)
+    free(album->composer);
+  if (album->genre != NULL)
+    free(album->genre);
+  if (album->tracks != NULL)
+    free(album->tracks);
+  free(album);
+  return;
+}
+
+/**
+ * This function maps and copies a property onto the album metadata if applicable.
+ */
+static void pick_property_to_album_metadata(LIBMTP_mtpdevice_t *device,
+					    MTPProperties *prop, LIBMTP_album_t *alb)
+{
+  switch (prop->property) {
+  case PTP_OPC_Name:
+    if (prop->propval.str != NULL)
+      alb->name = strdup(prop->propval.str);
+    else
+      alb->name = NULL;
+    break;
+  case PTP_OPC_AlbumArtist:
+    if (prop->propval.str != NULL) {
+      // This should take precedence over plain "Artist"
+      if (alb->artist != NULL)
+	free(alb->artist);
+      alb->artist = strdup(prop->propval.str);
+    } else
+      alb->artist = NULL;
+    break;
+  case PTP_OPC_Artist:
+    if (prop->propval.str != NULL) {
+      // Only use of AlbumArtist is not set
+      if (alb->artist == NULL)
+	alb->artist = strdup(prop->propval.str);
+    } else
+      alb->artist = NULL;
+    break;
+  case PTP_OPC_Composer:
+    if (prop->propval.str != NULL)
+      alb->composer = strdup(prop->propval.str);
+    else
+      alb->composer = NULL;
+    break;
+  case PTP_OPC_Genre:
+    if (prop->propval.str != NULL)
+      alb->genre = strdup(prop->propval.str);
+    else
+      alb->genre = NULL;
+    break;
+  }
+}
+
+/**
+ * This function retrieves the album metadata for an album
+ * given by a unique ID.
+ * @param device a pointer to the device to get the track metadata off.
+ * @param alb an album metadata metadata set to fill in.
+ */
+static void get_album_metadata(LIBMTP_mtpdevice_t *device,
+			       LIBMTP_album_t *alb)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t i;
+  MTPProperties *prop;
+  PTPObject *ob;
+
+  /*
+   * If we have a cached, large set of metadata, then use it!
+   */
+  ret = ptp_object_want(params, alb->album_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
+  if (ob->mtpprops) {
+    prop = ob->mtpprops;
+    for (i=0;i<ob->nrofmtpprops;i++,prop++)
+      pick_property_to_album_metadata(device, prop, alb);
+  } else {
+    uint16_t *props = NULL;
+    uint32_t propcnt = 0;
+
+    // First see which properties can be retrieved for albums
+    ret = ptp_mtp_getobjectpropssupported_cached(params, PTP_OFC_MTP_AbstractAudioAlbum, &propcnt, &props);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "get_album_metadata(): call to ptp_mtp_getobjectpropssupported() failed.");
+      // Just bail out for now, nothing is ever set.
+      return;
+    } else {
+      for (i=0;i<propcnt;i++) {
+	switch (props[i]) {
+	case PTP_OPC_Name:
+	  alb->name = get_string_from_object(device, ob->oid, PTP_OPC_Name);
+	  break;
+	case PTP_OPC_AlbumArtist:
+	  if (alb->artist != NULL)
+	    free(alb->artist);
+	  alb->artist = get_string_from_object(device, ob->oid, PTP_OPC_AlbumArtist);
+	  break;
+	case PTP_OPC_Artist:
+	  if (alb->artist == NULL)
+	    alb->artist = get_string_from_object(device, ob->oid, PTP_OPC_Artist);
+	  break;
+	case PTP_OPC_Composer:
+	  alb->composer = get_string_from_object(device, ob->oid, PTP_OPC_Composer);
+	  break;
+	case PTP_OPC_Genre:
+	  alb->genre = get_string_from_object(device, ob->oid, PTP_OPC_Genre);
+	  break;
+	default:
+	  break;
+	}
+      }
+      free(props);
+    }
+  }
+}
+
+
+/**
+ * This function returns a list of the albums available on the
+ * device.
+ *
+ * @param device a pointer to the device to get the album listing from.
+ * @return an album list on success, else NULL. If there are no albums
+ *         on the device, NULL will be returned as well.
+ * @see LIBMTP_Get_Album()
+ */
+LIBMTP_album_t *LIBMTP_Get_Album_List(LIBMTP_mtpdevice_t *device)
+{
+	// Read all storage devices
+	return LIBMTP_Get_Album_List_For_Storage(device, 0);
+}
+
+
+/**
+ * This function returns a list of the albums available on the
+ * device. You can filter on the storage ID.
+ *
+ * @param device a pointer to the device to get the album listing from.
+ * @param storage_id ID of device storage (if null, all storages)
+ *
+ * @return an album list on success, else NULL. If there are no albums
+ *         on the device, NULL will be returned as well.
+ * @see LIBMTP_Get_Album()
+ */
+LIBMTP_album_t *LIBMTP_Get_Album_List_For_Storage(LIBMTP_mtpdevice_t *device, uint32_t const storage_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_album_t *retalbums = NULL;
+  LIBMTP_album_t *curalbum = NULL;
+  uint32_t i;
+
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0)
+    flush_handles(device);
+  load_references_for_format(device, PTP_OFC_MTP_AbstractAudioAlbum, storage_id);
+
+  for (i = 0; i < params->nrofobjects; i++) {
+    LIBMTP_album_t *alb;
+    PTPObject *ob;
+    uint16_t ret;
+
+    // Ignore stuff that isn't an album
+    if ( params->obcols.format[i] != PTP_OFC_MTP_AbstractAudioAlbum )
+      continue;
+
+	// Ignore stuff that isn't into the storage device
+	if ((storage_id != 0) && (params->obcols.storage[i] != storage_id ))
+		continue;
+
+    ob = params->objects[i];
+
+    // Allocate a new album type
+    alb = LIBMTP_new_album_t();
+    alb->album_id = ob->oid;
+    alb->parent_id = PTP_OB_PARENT(params, ob);
+    alb->storage_id = PTP_OB_STORAGE(params, ob);
+
+    // Fetch supported metadata
+    get_album_metadata(device, alb);
+
+    // Then get the track listing for this album
+    ret = get_object_references(device, alb->album_id, &alb->tracks, &alb->no_tracks);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Album_List(): Could not get object references.");
+      alb->tracks = NULL;
+      alb->no_tracks = 0;
+    }
+
+    // Add album to a list that will be returned afterwards.
+    if (retalbums == NULL) {
+      retalbums = alb;
+      curalbum = alb;
+    } else {
+      curalbum->next = alb;
+      curalbum = alb;
+    }
+
+  }
+  return retalbums;
+}
+
+/**
+ * This function retrieves an individual album from the device.
+ * @param device a pointer to the device to get the album from.
+ * @param albid the unique ID of the album to retrieve.
+ * @return a valid album metadata or NULL on failure.
+ * @see LIBMTP_Get_Album_List()
+ */
+LIBMTP_album_t *LIBMTP_Get_Album(LIBMTP_mtpdevice_t *device, uint32_t const albid)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+  PTPObject *ob;
+  LIBMTP_album_t *alb;
+
+  // Get all the handles if we haven't already done that
+  if (params->nrofobjects == 0)
+    flush_handles(device);
+
+  ret = ptp_object_want(params, albid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK)
+    return NULL;
+
+  // Ignore stuff that isn't an album
+  if (PTP_OB_FORMAT(params, ob) != PTP_OFC_MTP_AbstractAudioAlbum)
+    return NULL;
+
+  // Allocate a new album type
+  alb = LIBMTP_new_album_t();
+  alb->album_id = ob->oid;
+  alb->parent_id = PTP_OB_PARENT(params, ob);
+  alb->storage_id = PTP_OB_STORAGE(params, ob);
+
+  // Fetch supported metadata
+  get_album_metadata(device, alb);
+
+  // Then get the track listing for this album
+  ret = get_object_references(device, alb->album_id, &alb->tracks, &alb->no_tracks);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Album: Could not get object references.");
+    alb->tracks = NULL;
+    alb->no_tracks = 0;
+  }
+
+  return alb;
+}
+
+/**
+ * This routine creates a new album based on the metadata
+ * supplied. If the <code>tracks</code> field of the metadata
+ * contains a track listing, these tracks will be added to the
+ * album.
+ * @param device a pointer to the device to create the new album on.
+ * @param metadata the metadata for the new album. If the function
+ *        exits with success, the <code>album_id</code> field of this
+ *        struct will contain the new ID of the album.
+ *        <ul>
+ *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this track in. Since some
+ *        devices are a bit picky about where files
+ *        are placed, a default folder will be chosen if libmtp
+ *        has detected one for the current filetype and this
+ *        parameter is set to 0. If this is 0 and no default folder
+ *        can be found, the file will be stored in the root folder.
+ *        <li><code>metadata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this track in. Setting this to 0 will store
+ *        the track on the primary storage.
+ *        </ul>
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Update_Album()
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Create_New_Album(LIBMTP_mtpdevice_t *device,
+			    LIBMTP_album_t * const metadata)
+{
+  uint32_t localph = metadata->parent_id;
+
+  // Use a default folder if none given
+  if (localph == 0) {
+    if (device->default_album_folder != 0)
+      localph = device->default_album_folder;
+    else
+      localph = device->default_music_folder;
+  }
+  metadata->parent_id = localph;
+
+  // Just create a new abstract album...
+  return create_new_abstract_list(device,
+				  metadata->name,
+				  metadata->artist,
+				  metadata->composer,
+				  metadata->genre,
+				  localph,
+				  metadata->storage_id,
+				  PTP_OFC_MTP_AbstractAudioAlbum,
+				  ".alb",
+				  &metadata->album_id,
+				  metadata->tracks,
+				  metadata->no_tracks);
+}
+
+/**
+ * This creates a new sample data metadata structure and allocates memory
+ * for it. Notice that if you add strings to this structure they
+ * will be freed by the corresponding <code>LIBMTP_destroy_sampledata_t</code>
+ * operation later, so be careful of using strdup() when assigning
+ * strings.
+ *
+ * @return a pointer to the newly allocated metadata structure.
+ * @see LIBMTP_destroy_sampledata_t()
+ */
+LIBMTP_filesampledata_t *LIBMTP_new_filesampledata_t(void)
+{
+  LIBMTP_filesampledata_t *new = (LIBMTP_filesampledata_t *) malloc(sizeof(LIBMTP_filesampledata_t));
+  if (new == NULL) {
+    return NULL;
+  }
+  new->height=0;
+  new->width = 0;
+  new->data = NULL;
+  new->duration = 0;
+  new->size = 0;
+  return new;
+}
+
+/**
+ * This destroys a file sample metadata type.
+ * @param sample the file sample metadata to be destroyed.
+ */
+void LIBMTP_destroy_filesampledata_t(LIBMTP_filesampledata_t * sample)
+{
+  if (sample == NULL) {
+    return;
+  }
+  if (sample->data != NULL) {
+    free(sample->data);
+  }
+  free(sample);
+}
+
+/**
+ * This routine figures out whether a certain filetype supports
+ * representative samples (small thumbnail images) or not. This
+ * typically applies to JPEG files, MP3 files and Album abstract
+ * playlists, but in theory any filetype could support representative
+ * samples.
+ * @param device a pointer to the device which is to be examined.
+ * @param filetype the fileype to examine, and return the representative sample
+ *        properties for.
+ * @param sample this will contain a new sample type with the fields
+ *        filled in with suitable default values. For example, the
+ *        supported sample type will be set, the supported height and
+ *        width will be set to max values if it is an image sample,
+ *        and duration will also be given some suitable default value
+ *        which should not be exceeded on audio samples. If the
+ *        device does not support samples for this filetype, this
+ *        pointer will be NULL. If it is not NULL, the user must
+ *        destroy this struct with <code>LIBMTP_destroy_filesampledata_t()</code>
+ *        after use.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Send_Representative_Sample()
+ * @see LIBMTP_Create_New_Album()
+ */
+int LIBMTP_Get_Representative_Sample_Format(LIBMTP_mtpdevice_t *device,
+					    LIBMTP_filetype_t const filetype,
+					    LIBMTP_filesampledata_t ** sample)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t *props = NULL;
+  uint32_t propcnt = 0;
+  unsigned int i;
+  // TODO: Get rid of these when we can properly query the device.
+  int support_data = 0;
+  int support_format = 0;
+  int support_height = 0;
+  int support_width = 0;
+  int support_duration = 0;
+  int support_size = 0;
+
+  PTPObjectPropDesc opd_height;
+  PTPObjectPropDesc opd_width;
+  PTPObjectPropDesc opd_format;
+  PTPObjectPropDesc opd_duration;
+  PTPObjectPropDesc opd_size;
+
+  // Default to no type supported.
+  *sample = NULL;
+
+  ret = ptp_mtp_getobjectpropssupported_cached(params, map_libmtp_type_to_ptp_type(filetype), &propcnt, &props);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Representative_Sample_Format(): could not get object properties.");
+    return -1;
+  }
+  /*
+   * TODO: when walking through these object properties, make calls to
+   * a new function in ptp.h/ptp.c that can send the command
+   * PTP_OC_MTP_GetObjectPropDesc to get max/min values of the properties
+   * supported.
+   */
+  for (i = 0; i < propcnt; i++) {
+    switch(props[i]) {
+    case PTP_OPC_RepresentativeSampleData:
+      support_data = 1;
+      break;
+    case PTP_OPC_RepresentativeSampleFormat:
+      support_format = 1;
+      break;
+    case PTP_OPC_RepresentativeSampleSize:
+      support_size = 1;
+      break;
+    case PTP_OPC_RepresentativeSampleHeight:
+      support_height = 1;
+      break;
+    case PTP_OPC_RepresentativeSampleWidth:
+      support_width = 1;
+      break;
+    case PTP_OPC_RepresentativeSampleDuration:
+      support_duration = 1;
+      break;
+    default:
+      break;
+    }
+  }
+  free(props);
 
-  if (no_tracks > 0) {
-    // Add tracks to the list as object references.
-    ret = ptp_mtp_setobjectreferences (params, *newid, (uint32_t *) tracks, no_tracks);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "create_new_abstract_list(): could not add tracks as object references.");
-      return -1;
+  if (support_data && support_format && support_height && support_width && !support_duration) {
+    // Something that supports height and width and not duration is likely to be JPEG
+    LIBMTP_filesampledata_t *retsam = LIBMTP_new_filesampledata_t();
+    /*
+     * Populate the sample format with the first supported format
+     *
+     * TODO: figure out how to pass back more than one format if more are
+     * supported by the device.
+     */
+    ptp_mtp_getobjectpropdesc_cached(params, PTP_OPC_RepresentativeSampleFormat, map_libmtp_type_to_ptp_type(filetype), &opd_format);
+    retsam->filetype = map_ptp_type_to_libmtp_type(opd_format.FORM.Enum.SupportedValue[0].u16);
+    /* Populate the maximum image height */
+    ptp_mtp_getobjectpropdesc_cached(params, PTP_OPC_RepresentativeSampleWidth, map_libmtp_type_to_ptp_type(filetype), &opd_width);
+    retsam->width = opd_width.FORM.Range.MaximumValue.u32;
+    /* Populate the maximum image width */
+    ptp_mtp_getobjectpropdesc_cached(params, PTP_OPC_RepresentativeSampleHeight, map_libmtp_type_to_ptp_type(filetype), &opd_height);
+    retsam->height = opd_height.FORM.Range.MaximumValue.u32;
+    /* Populate the maximum size */
+    if (support_size) {
+      ptp_mtp_getobjectpropdesc_cached(params, PTP_OPC_RepresentativeSampleSize, map_libmtp_type_to_ptp_type(filetype), &opd_size);
+      retsam->size = opd_size.FORM.Range.MaximumValue.u32;
+    }
+    *sample = retsam;
+  } else if (support_data && support_format && !support_height && !support_width && support_duration) {
+    // Another qualified guess
+    LIBMTP_filesampledata_t *retsam = LIBMTP_new_filesampledata_t();
+    /*
+     * Populate the sample format with the first supported format
+     *
+     * TODO: figure out how to pass back more than one format if more are
+     * supported by the device.
+     */
+    ptp_mtp_getobjectpropdesc_cached(params, PTP_OPC_RepresentativeSampleFormat, map_libmtp_type_to_ptp_type(filetype), &opd_format);
+    retsam->filetype = map_ptp_type_to_libmtp_type(opd_format.FORM.Enum.SupportedValue[0].u16);
+    /* Populate the maximum duration */
+    ptp_mtp_getobjectpropdesc_cached(params, PTP_OPC_RepresentativeSampleDuration, map_libmtp_type_to_ptp_type(filetype), &opd_duration);
+    retsam->duration = opd_duration.FORM.Range.MaximumValue.u32;
+    /* Populate the maximum size */
+    if (support_size) {
+      ptp_mtp_getobjectpropdesc_cached(params, PTP_OPC_RepresentativeSampleSize, map_libmtp_type_to_ptp_type(filetype), &opd_size);
+      retsam->size = opd_size.FORM.Range.MaximumValue.u32;
     }
+    *sample = retsam;
   }
-
-  add_object_to_cache(device, *newid);
-
   return 0;
 }
 
 /**
- * This updates the metadata and track listing
- * for an abstract list.
- * @param device a pointer to the device that the abstract list
- *        resides on.
- * @param name the name of the abstract list.
- * @param artist the artist of the abstract list or NULL.
- * @param genre the genre of the abstract list or NULL.
- * @param objecthandle the object to be updated.
- * @param objectformat the abstract list type to update.
- * @param tracks an array of tracks to associate with this list.
- * @param no_tracks the number of tracks in the list.
+ * This routine sends representative sample data for an object.
+ * This uses the RepresentativeSampleData property of the album,
+ * if the device supports it. The data should be of a format acceptable
+ * to the player (for iRiver and Creative, this seems to be JPEG) and
+ * must not be too large. (for a Creative, max seems to be about 20KB.)
+ * Check by calling LIBMTP_Get_Representative_Sample_Format() to get
+ * maximum size, dimensions, etc..
+ * @param device a pointer to the device which the object is on.
+ * @param id unique id of the object to set artwork for.
+ * @param pointer to LIBMTP_filesampledata_t struct containing data
  * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_Representative_Sample()
+ * @see LIBMTP_Get_Representative_Sample_Format()
+ * @see LIBMTP_Create_New_Album()
  */
-static int update_abstract_list(LIBMTP_mtpdevice_t *device,
-				char const * const name,
-				char const * const artist,
-				char const * const composer,
-				char const * const genre,
-				uint32_t const objecthandle,
-				uint16_t const objectformat,
-				uint32_t const * const tracks,
-				uint32_t const no_tracks)
+int LIBMTP_Send_Representative_Sample(LIBMTP_mtpdevice_t *device,
+                          uint32_t const id,
+                          LIBMTP_filesampledata_t *sampledata)
 {
   uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  uint16_t *properties = NULL;
+  PTPPropertyValue propval;
+  PTPObject *ob;
+  uint32_t i;
+  uint16_t *props = NULL;
   uint32_t propcnt = 0;
-  unsigned int i;
+  int supported = 0;
 
-  // First see which properties can be set
-  // i.e only try to update this metadata for object tags that exist on the current player.
-  ret = ptp_mtp_getobjectpropssupported(params, objectformat, &propcnt, &properties);
+  // get the file format for the object we're going to send representative data for
+  ret = ptp_object_want (params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
   if (ret != PTP_RC_OK) {
-    // Just bail out for now, nothing is ever set.
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-			    "could not retrieve supported object properties.");
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Representative_Sample(): could not get object info.");
     return -1;
   }
-  if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjPropList) &&
-      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
-    MTPProperties *props = NULL;
-    MTPProperties *prop = NULL;
-    int nrofprops = 0;
-
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
-
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], objectformat, &opd);
-      if (ret != PTP_RC_OK) {
-	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				"could not get property description.");
-      } else if (opd.GetSet) {
-	switch (properties[i]) {
-	case PTP_OPC_Name:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = objecthandle;
-	  prop->property = PTP_OPC_Name;
-	  prop->datatype = PTP_DTC_STR;
-	  if (name != NULL)
-	    prop->propval.str = strdup(name);
-	  break;
-	case PTP_OPC_AlbumArtist:
-	  if (artist != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	    prop->ObjectHandle = objecthandle;
-	    prop->property = PTP_OPC_AlbumArtist;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(artist);
-	  }
-	  break;
-	case PTP_OPC_Artist:
-	  if (artist != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	    prop->ObjectHandle = objecthandle;
-	    prop->property = PTP_OPC_Artist;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(artist);
-	  }
-	  break;
-	case PTP_OPC_Composer:
-	  if (composer != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	    prop->ObjectHandle = objecthandle;
-	    prop->property = PTP_OPC_Composer;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(composer);
-	  }
-	  break;
-	case PTP_OPC_Genre:
-	  if (genre != NULL) {
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	    prop->ObjectHandle = objecthandle;
-	    prop->property = PTP_OPC_Genre;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = strdup(genre);
-	  }
-	  break;
- 	case PTP_OPC_DateModified:
-	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    // Tag with current time if that is supported
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	    prop->ObjectHandle = objecthandle;
-	    prop->property = PTP_OPC_DateModified;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = get_iso8601_stamp();
-	  }
-	  break;
-	default:
-	  break;
-	}
-      }
-      ptp_free_objectpropdesc(&opd);
-    }
-
-    // proplist could be NULL if we can't write any properties
-    if (props != NULL) {
-      ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
-
-      ptp_destroy_object_prop_list(props, nrofprops);
-
-      if (ret != PTP_RC_OK) {
-        // TODO: return error of which property we couldn't set
-        add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-                                "could not set object property list.");
-        free(properties);
-        return -1;
-      }
-    }
 
-  } else if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjectPropValue)) {
-    for (i=0;i<propcnt;i++) {
-      switch (properties[i]) {
-      case PTP_OPC_Name:
-	// Update title
-	ret = set_object_string(device, objecthandle, PTP_OPC_Name, name);
-	if (ret != 0) {
-	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				  "could not set title.");
-	}
-	break;
-      case PTP_OPC_AlbumArtist:
-	// Update album artist
-	ret = set_object_string(device, objecthandle, PTP_OPC_AlbumArtist, artist);
-	if (ret != 0) {
-	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				  "could not set album artist name.");
-	}
-	break;
-      case PTP_OPC_Artist:
-	// Update artist
-	ret = set_object_string(device, objecthandle, PTP_OPC_Artist, artist);
-	if (ret != 0) {
-	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				  "could not set artist name.");
-	}
-	break;
-      case PTP_OPC_Composer:
-	// Update composer
-	ret = set_object_string(device, objecthandle, PTP_OPC_Composer, composer);
-	if (ret != 0) {
-	  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				  "could not set composer name.");
-	}
-	break;
-      case PTP_OPC_Genre:
-	// Update genre (but only if valid)
-	if(genre) {
-	  ret = set_object_string(device, objecthandle, PTP_OPC_Genre, genre);
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				    "could not set genre.");
-	  }
-        }
-	break;
-      case PTP_OPC_DateModified:
-	// Update date modified
-	if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	  char *tmpdate = get_iso8601_stamp();
-	  ret = set_object_string(device, objecthandle, PTP_OPC_DateModified, tmpdate);
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				    "could not set modification date.");
-	  }
-	  free(tmpdate);
-	}
-	break;
-      default:
-	break;
-      }
+  // check that we can send representative sample data for this object format
+  ret = ptp_mtp_getobjectpropssupported_cached(params, PTP_OB_FORMAT(params, ob), &propcnt, &props);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_Representative_Sample(): could not get object properties.");
+    return -1;
+  }
+
+  for (i = 0; i < propcnt; i++) {
+    if (props[i] == PTP_OPC_RepresentativeSampleData) {
+      supported = 1;
+      break;
     }
-  } else {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-                            "Your device doesn't seem to support any known way of setting metadata.");
-    free(properties);
+  }
+  if (!supported) {
+    free(props);
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Representative_Sample(): object type doesn't support RepresentativeSampleData.");
     return -1;
   }
+  free(props);
+
+  // Go ahead and send the data
+  propval.a.count = sampledata->size;
+  propval.a.v = malloc(sizeof(PTPPropertyValue) * sampledata->size);
+  for (i = 0; i < sampledata->size; i++) {
+    propval.a.v[i].u8 = sampledata->data[i];
+  }
 
-  // Then the object references...
-  ret = ptp_mtp_setobjectreferences (params, objecthandle, (uint32_t *) tracks, no_tracks);
+  ret = ptp_mtp_setobjectpropvalue(params,id,PTP_OPC_RepresentativeSampleData,
+				   &propval,PTP_DTC_AUINT8);
   if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "update_abstract_list(): could not add tracks as object references.");
-    free(properties);
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_Representative_Sample(): could not send sample data.");
+    free(propval.a.v);
     return -1;
   }
+  free(propval.a.v);
 
-  free(properties);
-
-  update_metadata_cache(device, objecthandle);
+  /* Set the height and width if the sample is an image, otherwise just
+   * set the duration and size */
+  switch(sampledata->filetype) {
+  case LIBMTP_FILETYPE_JPEG:
+  case LIBMTP_FILETYPE_JFIF:
+  case LIBMTP_FILETYPE_TIFF:
+  case LIBMTP_FILETYPE_BMP:
+  case LIBMTP_FILETYPE_GIF:
+  case LIBMTP_FILETYPE_PICT:
+  case LIBMTP_FILETYPE_PNG:
+    if (!FLAG_BROKEN_SET_SAMPLE_DIMENSIONS(ptp_usb)) {
+      // For images, set the height and width
+      set_object_u32(device, id, PTP_OPC_RepresentativeSampleHeight, sampledata->height);
+      set_object_u32(device, id, PTP_OPC_RepresentativeSampleWidth, sampledata->width);
+    }
+    break;
+  default:
+    // For anything not an image, set the duration and size
+    set_object_u32(device, id, PTP_OPC_RepresentativeSampleDuration, sampledata->duration);
+    set_object_u32(device, id, PTP_OPC_RepresentativeSampleSize, sampledata->size);
+    break;
+  }
 
   return 0;
 }
 
-
 /**
- * This routine creates a new playlist based on the metadata
- * supplied. If the <code>tracks</code> field of the metadata
- * contains a track listing, these tracks will be added to the
- * playlist.
- * @param device a pointer to the device to create the new playlist on.
- * @param metadata the metadata for the new playlist. If the function
- *        exits with success, the <code>playlist_id</code> field of this
- *        struct will contain the new playlist ID of the playlist.
- *        <ul>
- *        <li><code>metadata-&gt;parent_id</code> should be set to the parent 
- *        (e.g. folder) to store this track in. Since some 
- *        devices are a bit picky about where files
- *        are placed, a default folder will be chosen if libmtp
- *        has detected one for the current filetype and this
- *        parameter is set to 0. If this is 0 and no default folder
- *        can be found, the file will be stored in the root folder.
- *        <li><code>metadata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this track in. Setting this to 0 will store
- *        the track on the primary storage.
- *        </ul>
+ * This routine gets representative sample data for an object.
+ * This uses the RepresentativeSampleData property of the album,
+ * if the device supports it.
+ * @param device a pointer to the device which the object is on.
+ * @param id unique id of the object to get data for.
+ * @param pointer to LIBMTP_filesampledata_t struct to receive data
  * @return 0 on success, any other value means failure.
- * @see LIBMTP_Update_Playlist()
- * @see LIBMTP_Delete_Object()
+ * @see LIBMTP_Send_Representative_Sample()
+ * @see LIBMTP_Get_Representative_Sample_Format()
+ * @see LIBMTP_Create_New_Album()
  */
-int LIBMTP_Create_New_Playlist(LIBMTP_mtpdevice_t *device,
-			       LIBMTP_playlist_t * const metadata)
+int LIBMTP_Get_Representative_Sample(LIBMTP_mtpdevice_t *device,
+                          uint32_t const id,
+                          LIBMTP_filesampledata_t *sampledata)
 {
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  uint32_t localph = metadata->parent_id;
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTPPropertyValue propval;
+  PTPObject *ob;
+  uint32_t i;
+  uint16_t *props = NULL;
+  uint32_t propcnt = 0;
+  int supported = 0;
 
-  // Use a default folder if none given
-  if (localph == 0) {
-    if (device->default_playlist_folder != 0)
-      localph = device->default_playlist_folder;
-    else
-      localph = device->default_music_folder;
+  // get the file format for the object we're going to send representative data for
+  ret = ptp_object_want (params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Representative_Sample(): could not get object info.");
+    return -1;
   }
-  metadata->parent_id = localph;
 
-  // Samsung needs its own special type of playlists
-  if(FLAG_PLAYLIST_SPL(ptp_usb)) {
-    return playlist_t_to_spl(device, metadata);
+  // check that we can store representative sample data for this object format
+  ret = ptp_mtp_getobjectpropssupported_cached(params, PTP_OB_FORMAT(params, ob), &propcnt, &props);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Representative_Sample(): could not get object properties.");
+    return -1;
   }
 
-  // Just create a new abstract audio/video playlist...
-  return create_new_abstract_list(device,
-				  metadata->name,
-				  NULL,
-				  NULL,
-				  NULL,
-				  localph,
-				  metadata->storage_id,
-				  PTP_OFC_MTP_AbstractAudioVideoPlaylist,
-				  get_playlist_extension(ptp_usb),
-				  &metadata->playlist_id,
-				  metadata->tracks,
-				  metadata->no_tracks);
-}
-
-/**
- * This routine updates a playlist based on the metadata
- * supplied. If the <code>tracks</code> field of the metadata
- * contains a track listing, these tracks will be added to the
- * playlist in place of those already present, i.e. the
- * previous track listing will be deleted. For Samsung devices the
- * playlist id (metadata->playlist_id) is likely to change.
- * @param device a pointer to the device to create the new playlist on.
- * @param metadata the metadata for the playlist to be updated.
- *                 notice that the field <code>playlist_id</code>
- *                 must contain the appropriate playlist ID. Playlist ID
- *                 be modified to a new playlist ID by the time the
- *                 function returns since edit-in-place is not always possible.
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Create_New_Playlist()
- * @see LIBMTP_Delete_Object()
- */
-int LIBMTP_Update_Playlist(LIBMTP_mtpdevice_t *device,
-			   LIBMTP_playlist_t * const metadata)
-{
-
-  // Samsung needs its own special type of playlists
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  if(FLAG_PLAYLIST_SPL(ptp_usb)) {
-    return update_spl_playlist(device, metadata);
+  for (i = 0; i < propcnt; i++) {
+    if (props[i] == PTP_OPC_RepresentativeSampleData) {
+      supported = 1;
+      break;
+    }
   }
+  if (!supported) {
+    free(props);
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Representative_Sample(): object type doesn't support RepresentativeSampleData.");
+    return -1;
+  }
+  free(props);
 
-  return update_abstract_list(device,
-			      metadata->name,
-			      NULL,
-			      NULL,
-			      NULL,
-			      metadata->playlist_id,
-			      PTP_OFC_MTP_AbstractAudioVideoPlaylist,
-			      metadata->tracks,
-			      metadata->no_tracks);
-}
-
-/**
- * This creates a new album metadata structure and allocates memory
- * for it. Notice that if you add strings to this structure they
- * will be freed by the corresponding <code>LIBMTP_destroy_album_t</code>
- * operation later, so be careful of using strdup() when assigning
- * strings.
- *
- * @return a pointer to the newly allocated metadata structure.
- * @see LIBMTP_destroy_album_t()
- */
-LIBMTP_album_t *LIBMTP_new_album_t(void)
-{
-  LIBMTP_album_t *new = (LIBMTP_album_t *) malloc(sizeof(LIBMTP_album_t));
-  if (new == NULL) {
-    return NULL;
+  // Get the data
+  ret = ptp_mtp_getobjectpropvalue(params,id,PTP_OPC_RepresentativeSampleData,
+				   &propval,PTP_DTC_AUINT8);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Representative_Sample(): could not get sample data.");
+    return -1;
   }
-  new->album_id = 0;
-  new->parent_id = 0;
-  new->storage_id = 0;
-  new->name = NULL;
-  new->artist = NULL;
-  new->composer = NULL;
-  new->genre = NULL;
-  new->tracks = NULL;
-  new->no_tracks = 0;
-  new->next = NULL;
-  return new;
-}
 
-/**
- * This recursively deletes the memory for an album structure
- *
- * @param album structure to destroy
- * @see LIBMTP_new_album_t()
- */
-void LIBMTP_destroy_album_t(LIBMTP_album_t *album)
-{
-  if (album == NULL) {
-    return;
+  // Store it
+  sampledata->size = propval.a.count;
+  sampledata->data = malloc(sizeof(PTPPropertyValue) * propval.a.count);
+  for (i = 0; i < propval.a.count; i++) {
+    sampledata->data[i] = propval.a.v[i].u8;
   }
-  if (album->name != NULL)
-    free(album->name);
-  if (album->artist != NULL)
-    free(album->artist);
-  if (album->composer != NULL)
-    free(album->composer);
-  if (album->genre != NULL)
-    free(album->genre);
-  if (album->tracks != NULL)
-    free(album->tracks);
-  free(album);
-  return;
+  free(propval.a.v);
+
+  // Get the other properties
+  sampledata->width = get_u32_from_object(device, id, PTP_OPC_RepresentativeSampleWidth, 0);
+  sampledata->height = get_u32_from_object(device, id, PTP_OPC_RepresentativeSampleHeight, 0);
+  sampledata->duration = get_u32_from_object(device, id, PTP_OPC_RepresentativeSampleDuration, 0);
+  sampledata->filetype = map_ptp_type_to_libmtp_type(
+        get_u16_from_object(device, id, PTP_OPC_RepresentativeSampleFormat, LIBMTP_FILETYPE_UNKNOWN));
+
+  return 0;
 }
 
 /**
- * This function maps and copies a property onto the album metadata if applicable.
+ * Retrieve the thumbnail for a file.
+ * @param device a pointer to the device to get the thumbnail from.
+ * @param id the object ID of the file to retrieve the thumbnail for.
+ * @return 0 on success, any other value means failure.
  */
-static void pick_property_to_album_metadata(LIBMTP_mtpdevice_t *device,
-					    MTPProperties *prop, LIBMTP_album_t *alb)
+int LIBMTP_Get_Thumbnail(LIBMTP_mtpdevice_t *device, uint32_t const id,
+                         unsigned char **data, unsigned int *size)
 {
-  switch (prop->property) {
-  case PTP_OPC_Name:
-    if (prop->propval.str != NULL)
-      alb->name = strdup(prop->propval.str);
-    else
-      alb->name = NULL;
-    break;
-  case PTP_OPC_AlbumArtist:
-    if (prop->propval.str != NULL) {
-      // This should take precedence over plain "Artist"
-      if (alb->artist != NULL)
-	free(alb->artist);
-      alb->artist = strdup(prop->propval.str);
-    } else
-      alb->artist = NULL;
-    break;
-  case PTP_OPC_Artist:
-    if (prop->propval.str != NULL) {
-      // Only use of AlbumArtist is not set
-      if (alb->artist == NULL)
-	alb->artist = strdup(prop->propval.str);
-    } else
-      alb->artist = NULL;
-    break;
-  case PTP_OPC_Composer:
-    if (prop->propval.str != NULL)
-      alb->composer = strdup(prop->propval.str);
-    else
-      alb->composer = NULL;
-    break;
-  case PTP_OPC_Genre:
-    if (prop->propval.str != NULL)
-      alb->genre = strdup(prop->propval.str);
-    else
-      alb->genre = NULL;
-    break;
-  }
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+
+  ret = ptp_getthumb(params, id, data, size);
+  if (ret == PTP_RC_OK)
+      return 0;
+  return -1;
 }
 
 /**
- * This function retrieves the album metadata for an album
- * given by a unique ID.
- * @param device a pointer to the device to get the track metadata off.
- * @param alb an album metadata metadata set to fill in.
+ * Largest cached thumbnail size used to size the receive buffer of a
+ * batch up front, so that a bogus ThumbCompressedSize cannot make us
+ * allocate silly amounts of memory.
  */
-static void get_album_metadata(LIBMTP_mtpdevice_t *device,
-			       LIBMTP_album_t *alb)
+#define THUMBNAIL_PRESIZE_MAX (1024 * 1024)
+
+/**
+ * Fetch the thumbnail or the representative sample of each object in
+ * a list into one receive buffer that is reused for the whole batch.
+ * @return 0 if all objects were retrieved, -1 otherwise.
+ */
+static int get_object_data_batch(LIBMTP_mtpdevice_t *device,
+				 uint32_t const * const ids,
+				 uint32_t const nrofids, int const samples,
+				 LIBMTP_objectdata_cb_fn const callback,
+				 void * const user_data)
 {
-  uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
+  unsigned char *buf = NULL;
+  unsigned long alloc = 0;
+  uint16_t lastformat = 0;
+  int lastsupported = 0;
+  int failed = 0;
   uint32_t i;
-  MTPProperties *prop;
-  PTPObject *ob;
 
-  /*
-   * If we have a cached, large set of metadata, then use it!
-   */
-  ret = ptp_object_want(params, alb->album_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
-  if (ob->mtpprops) {
-    prop = ob->mtpprops;
-    for (i=0;i<ob->nrofmtpprops;i++,prop++)
-      pick_property_to_album_metadata(device, prop, alb);
-  } else {
-    uint16_t *props = NULL;
-    uint32_t propcnt = 0;
+  if (!samples) {
+    // Size the buffer for the largest thumbnail we already know about
+    for (i = 0; i < nrofids; i++) {
+      PTPObject *ob;
 
-    // First see which properties can be retrieved for albums
-    ret = ptp_mtp_getobjectpropssupported(params, PTP_OFC_MTP_AbstractAudioAlbum, &propcnt, &props);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "get_album_metadata(): call to ptp_mtp_getobjectpropssupported() failed.");
-      // Just bail out for now, nothing is ever set.
-      return;
-    } else {
-      for (i=0;i<propcnt;i++) {
-	switch (props[i]) {
-	case PTP_OPC_Name:
-	  alb->name = get_string_from_object(device, ob->oid, PTP_OPC_Name);
-	  break;
-	case PTP_OPC_AlbumArtist:
-	  if (alb->artist != NULL)
-	    free(alb->artist);
-	  alb->artist = get_string_from_object(device, ob->oid, PTP_OPC_AlbumArtist);
-	  break;
-	case PTP_OPC_Artist:
-	  if (alb->artist == NULL)
-	    alb->artist = get_string_from_object(device, ob->oid, PTP_OPC_Artist);
-	  break;
-	case PTP_OPC_Composer:
-	  alb->composer = get_string_from_object(device, ob->oid, PTP_OPC_Composer);
-	  break;
-	case PTP_OPC_Genre:
-	  alb->genre = get_string_from_object(device, ob->oid, PTP_OPC_Genre);
-	  break;
-	default:
+      if (ptp_object_find(params, ids[i], &ob) == PTP_RC_OK &&
+	  (ob->flags & PTPOBJECT_OBJECTINFO_LOADED) &&
+	  PTP_OB_EXT(ob, ThumbCompressedSize) > alloc &&
+	  PTP_OB_EXT(ob, ThumbCompressedSize) <= THUMBNAIL_PRESIZE_MAX)
+	alloc = PTP_OB_EXT(ob, ThumbCompressedSize);
+    }
+    if (alloc != 0) {
+      buf = malloc(alloc);
+      if (buf == NULL)
+	alloc = 0;
+    }
+  }
+
+  for (i = 0; i < nrofids; i++) {
+    unsigned int size = 0;
+    uint16_t ret;
+
+    if (samples) {
+      PTPObject *ob;
+
+      ret = ptp_object_want(params, ids[i], PTPOBJECT_OBJECTINFO_LOADED, &ob);
+      if (ret != PTP_RC_OK) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Representative_Samples(): could not get object info.");
+	failed = 1;
+	if (callback(ids[i], -1, NULL, 0, user_data) != 0)
 	  break;
+	continue;
+      }
+      // Objects in a batch are mostly of the same few formats
+      if (i == 0 || PTP_OB_FORMAT(params, ob) != lastformat) {
+	uint16_t *props = NULL;
+	uint32_t propcnt = 0;
+	uint32_t j;
+
+	lastformat = PTP_OB_FORMAT(params, ob);
+	lastsupported = 0;
+	if (ptp_mtp_getobjectpropssupported_cached(params, lastformat, &propcnt, &props) == PTP_RC_OK) {
+	  for (j = 0; j < propcnt; j++) {
+	    if (props[j] == PTP_OPC_RepresentativeSampleData) {
+	      lastsupported = 1;
+	      break;
+	    }
+	  }
+	  free(props);
 	}
       }
-      free(props);
+      if (!lastsupported) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Representative_Samples(): object type doesn't support RepresentativeSampleData.");
+	failed = 1;
+	if (callback(ids[i], -1, NULL, 0, user_data) != 0)
+	  break;
+	continue;
+      }
+      ret = ptp_mtp_getobjectpropvalue_bytes(params, ids[i],
+					     PTP_OPC_RepresentativeSampleData,
+					     &buf, &alloc, &size);
+    } else {
+      ret = ptp_getthumb_reuse(params, ids[i], &buf, &alloc, &size);
     }
-  }
-}
 
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, samples ?
+				  "LIBMTP_Get_Representative_Samples(): could not get sample data." :
+				  "LIBMTP_Get_Thumbnails(): could not get thumbnail.");
+      failed = 1;
+      if (callback(ids[i], -1, NULL, 0, user_data) != 0)
+	break;
+      // No point in going on if the device is gone
+      if (ret == PTP_ERROR_IO)
+	break;
+      continue;
+    }
+    if (callback(ids[i], 0, buf, size, user_data) != 0)
+      break;
+  }
 
-/**
- * This function returns a list of the albums available on the
- * device.
- *
- * @param device a pointer to the device to get the album listing from.
- * @return an album list on success, else NULL. If there are no albums
- *         on the device, NULL will be returned as well.
- * @see LIBMTP_Get_Album()
+  free(buf);
+  return failed ? -1 : 0;
+}
+
+/**
+ * Retrieve the thumbnails for a list of files. This is much faster
+ * than calling <code>LIBMTP_Get_Thumbnail()</code> for each file, as
+ * the data is received into one buffer that is sized from the cached
+ * thumbnail sizes and reused throughout, and each thumbnail is handed
+ * to the callback as soon as it has arrived.
+ * @param device a pointer to the device to get the thumbnails from.
+ * @param ids the object IDs of the files to retrieve thumbnails for.
+ * @param nrofids the number of object IDs.
+ * @param callback a function called for each file in turn, with the
+ *        thumbnail or a failure.
+ * @param user_data a user-defined pointer that is passed along to
+ *        the <code>callback</code>.
+ * @return 0 if all thumbnails were retrieved, any other value means
+ *         that some or all of them failed.
+ * @see LIBMTP_Get_Thumbnail()
+ */
+int LIBMTP_Get_Thumbnails(LIBMTP_mtpdevice_t *device,
+			  uint32_t const * const ids,
+			  uint32_t const nrofids,
+			  LIBMTP_objectdata_cb_fn const callback,
+			  void * const user_data)
+{
+  return get_object_data_batch(device, ids, nrofids, 0, callback, user_data);
+}
+
+/**
+ * Retrieve the representative sample data for a list of objects, in
+ * the same way as <code>LIBMTP_Get_Thumbnails()</code>. Only the
+ * sample data is retrieved, use
+ * <code>LIBMTP_Get_Representative_Sample()</code> if you also need
+ * its dimensions and format.
+ * @param device a pointer to the device which the objects are on.
+ * @param ids the object IDs to retrieve sample data for.
+ * @param nrofids the number of object IDs.
+ * @param callback a function called for each object in turn, with
+ *        the sample data or a failure.
+ * @param user_data a user-defined pointer that is passed along to
+ *        the <code>callback</code>.
+ * @return 0 if all samples were retrieved, any other value means
+ *         that some or all of them failed.
+ * @see LIBMTP_Get_Representative_Sample()
  */
-LIBMTP_album_t *LIBMTP_Get_Album_List(LIBMTP_mtpdevice_t *device)
+int LIBMTP_Get_Representative_Samples(LIBMTP_mtpdevice_t *device,
+				      uint32_t const * const ids,
+				      uint32_t const nrofids,
+				      LIBMTP_objectdata_cb_fn const callback,
+				      void * const user_data)
 {
-	// Read all storage devices
-	return LIBMTP_Get_Album_List_For_Storage(device, 0);
+  return get_object_data_batch(device, ids, nrofids, 1, callback, user_data);
 }
 
 
 /**
- * This function returns a list of the albums available on the
- * device. You can filter on the storage ID.
- *
- * @param device a pointer to the device to get the album listing from.
- * @param storage_id ID of device storage (if null, all storages)
- *
- * @return an album list on success, else NULL. If there are no albums
- *         on the device, NULL will be returned as well.
- * @see LIBMTP_Get_Album()
+ * This checks a partial read of an object whose size is already known
+ * against the size and what the device can do.
+ * @param device the device to read from.
+ * @param filesize the size of the object.
+ * @param offset where to start reading.
+ * @param maxbytes the number of bytes to read, lowered to what can be
+ *        read in one go. Set to 0 if there is nothing to read.
+ * @return PTP_RC_OK if the read can be done, else a PTP error code.
  */
-LIBMTP_album_t *LIBMTP_Get_Album_List_For_Storage(LIBMTP_mtpdevice_t *device, uint32_t const storage_id)
+static uint16_t check_partial_object(LIBMTP_mtpdevice_t *device,
+				     uint64_t const filesize, uint64_t offset,
+				     uint32_t *maxbytes)
 {
-  PTPParams *params = (PTPParams *) device->params;
-  LIBMTP_album_t *retalbums = NULL;
-  LIBMTP_album_t *curalbum = NULL;
-  uint32_t i;
-
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0)
-    flush_handles(device);
-
-  for (i = 0; i < params->nrofobjects; i++) {
-    LIBMTP_album_t *alb;
-    PTPObject *ob;
-    uint16_t ret;
-
-    ob = &params->objects[i];
-
-    // Ignore stuff that isn't an album
-    if ( ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioAlbum )
-      continue;
-
-	// Ignore stuff that isn't into the storage device
-	if ((storage_id != 0) && (ob->oi.StorageID != storage_id ))
-		continue;
+  PTPParams	*params = (PTPParams *) device->params;
 
-    // Allocate a new album type
-    alb = LIBMTP_new_album_t();
-    alb->album_id = ob->oid;
-    alb->parent_id = ob->oi.ParentObject;
-    alb->storage_id = ob->oi.StorageID;
+  /* Some devices do not like reading over the end and hang instead of progressing */
+  if (offset >= filesize) {
+    *maxbytes = 0;
+    return PTP_RC_OK;
+  }
+  if (offset + *maxbytes > filesize) {
+    *maxbytes = filesize - offset;
+  }
 
-    // Fetch supported metadata
-    get_album_metadata(device, alb);
+  /* The MTP stack of Samsung Galaxy devices has a mysterious bug in
+   * GetPartialObject. When GetPartialObject is invoked to read the
+   * last bytes of a file and the amount of data to read is such that
+   * the last USB packet sent in the reply matches exactly the USB 2.0
+   * packet size, then the Samsung Galaxy device hangs, resulting in a
+   * timeout error.
+   * As a workaround, we read one less byte instead of reaching the
+   * end of the file, forcing the caller to perform an additional read
+   * to get the last byte (i.e. the final read that would fail is
+   * replaced with two partial reads that succeed).
+   */
+  if ((params->device_flags & DEVICE_FLAG_SAMSUNG_OFFSET_BUG) &&
+      (*maxbytes % PTP_USB_BULK_HS_MAX_PACKET_LEN_READ) == (PTP_USB_BULK_HS_MAX_PACKET_LEN_READ - PTP_USB_BULK_HDR_LEN)) {
+    (*maxbytes)--;
+  }
 
-    // Then get the track listing for this album
-    ret = ptp_mtp_getobjectreferences(params, alb->album_id, &alb->tracks, &alb->no_tracks);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Album_List(): Could not get object references.");
-      alb->tracks = NULL;
-      alb->no_tracks = 0;
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64)) {
+    if  (!ptp_operation_issupported(params, PTP_OC_GetPartialObject)) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+        "LIBMTP_GetPartialObject: PTP_OC_GetPartialObject not supported");
+      return PTP_RC_OperationNotSupported;
     }
 
-    // Add album to a list that will be returned afterwards.
-    if (retalbums == NULL) {
-      retalbums = alb;
-      curalbum = alb;
-    } else {
-      curalbum->next = alb;
-      curalbum = alb;
+    if (offset >> 32 != 0) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+        "LIBMTP_GetPartialObject: PTP_OC_GetPartialObject only supports 32bit offsets");
+      return PTP_RC_InvalidParameter;
     }
-
   }
-  return retalbums;
+  return PTP_RC_OK;
 }
 
 /**
- * This function retrieves an individual album from the device.
- * @param device a pointer to the device to get the album from.
- * @param albid the unique ID of the album to retrieve.
- * @return a valid album metadata or NULL on failure.
- * @see LIBMTP_Get_Album_List()
+ * This reads a part of an object whose size is already known, so
+ * that resumable transfers need not look the metadata up again for
+ * every chunk.
+ * @return the PTP return code of the read.
  */
-LIBMTP_album_t *LIBMTP_Get_Album(LIBMTP_mtpdevice_t *device, uint32_t const albid)
+static uint16_t get_partial_object(LIBMTP_mtpdevice_t *device, uint32_t const id,
+				   uint64_t const filesize, uint64_t offset,
+				   uint32_t maxbytes, unsigned char **data,
+				   unsigned int *size)
 {
-  PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
-  PTPObject *ob;
-  LIBMTP_album_t *alb;
-
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0)
-    flush_handles(device);
+  PTPParams	*params = (PTPParams *) device->params;
+  uint16_t	ret;
 
-  ret = ptp_object_want(params, albid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  ret = check_partial_object(device, filesize, offset, &maxbytes);
   if (ret != PTP_RC_OK)
-    return NULL;
-
-  // Ignore stuff that isn't an album
-  if (ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioAlbum)
-    return NULL;
+    return ret;
+  if (maxbytes == 0) {
+    *size = 0;
+    return PTP_RC_OK;
+  }
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64))
+    return ptp_getpartialobject(params, id, (uint32_t)offset, maxbytes, data, size);
+  return ptp_android_getpartialobject64(params, id, offset, maxbytes, data, size);
+}
 
-  // Allocate a new album type
-  alb = LIBMTP_new_album_t();
-  alb->album_id = ob->oid;
-  alb->parent_id = ob->oi.ParentObject;
-  alb->storage_id = ob->oi.StorageID;
+/**
+ * Where the data of a block read lands: consecutive blocks, filled in
+ * the order the device sends them.
+ */
+typedef struct {
+  mtp_block_t **blocks;
+  uint32_t nrofblocks;
+  uint64_t got;
+} mtp_block_read_t;
 
-  // Fetch supported metadata
-  get_album_metadata(device, alb);
+static uint16_t
+put_block_data(PTPParams* params, void* priv, unsigned long sendlen,
+	       unsigned char *data)
+{
+  mtp_block_read_t *rd = (mtp_block_read_t *) priv;
 
-  // Then get the track listing for this album
-  ret = ptp_mtp_getobjectreferences(params, alb->album_id, &alb->tracks, &alb->no_tracks);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Album: Could not get object references.");
-    alb->tracks = NULL;
-    alb->no_tracks = 0;
+  while (sendlen > 0) {
+    uint64_t i = rd->got / PARTIAL_BLOCK_SIZE;
+    uint32_t boff = rd->got % PARTIAL_BLOCK_SIZE;
+    unsigned long n;
+
+    if (i >= rd->nrofblocks || boff >= rd->blocks[i]->len) {
+      // More than asked for, drop it
+      break;
+    }
+    n = rd->blocks[i]->len - boff;
+    if (n > sendlen)
+      n = sendlen;
+    memcpy(rd->blocks[i]->data + boff, data, n);
+    rd->got += n;
+    data += n;
+    sendlen -= n;
   }
+  return PTP_RC_OK;
+}
 
-  return alb;
+/**
+ * Unlink one block from the cache and free it.
+ * @param cache the block cache.
+ * @param block the block to drop.
+ */
+static void block_unlink(mtp_block_cache_t *cache, mtp_block_t *block)
+{
+  if (block->prev != NULL)
+    block->prev->next = block->next;
+  else
+    cache->head = block->next;
+  if (block->next != NULL)
+    block->next->prev = block->prev;
+  else
+    cache->tail = block->prev;
+  cache->bytes -= block->len;
+  free(block->data);
+  free(block);
 }
 
 /**
- * This routine creates a new album based on the metadata
- * supplied. If the <code>tracks</code> field of the metadata
- * contains a track listing, these tracks will be added to the
- * album.
- * @param device a pointer to the device to create the new album on.
- * @param metadata the metadata for the new album. If the function
- *        exits with success, the <code>album_id</code> field of this
- *        struct will contain the new ID of the album.
- *        <ul>
- *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this track in. Since some
- *        devices are a bit picky about where files
- *        are placed, a default folder will be chosen if libmtp
- *        has detected one for the current filetype and this
- *        parameter is set to 0. If this is 0 and no default folder
- *        can be found, the file will be stored in the root folder.
- *        <li><code>metadata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this track in. Setting this to 0 will store
- *        the track on the primary storage.
- *        </ul>
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Update_Album()
- * @see LIBMTP_Delete_Object()
+ * Look up a cached block of an object.
+ * @param cache the block cache.
+ * @param oid the object.
+ * @param index the block number within the object.
+ * @param touch whether to mark a block found as recently used.
+ * @return the block, or NULL if it is not cached.
  */
-int LIBMTP_Create_New_Album(LIBMTP_mtpdevice_t *device,
-			    LIBMTP_album_t * const metadata)
+static mtp_block_t *block_find(mtp_block_cache_t *cache, uint32_t const oid,
+			       uint64_t const index, int const touch)
 {
-  uint32_t localph = metadata->parent_id;
+  mtp_block_t *block;
 
-  // Use a default folder if none given
-  if (localph == 0) {
-    if (device->default_album_folder != 0)
-      localph = device->default_album_folder;
-    else
-      localph = device->default_music_folder;
+  for (block = cache->head; block != NULL; block = block->next) {
+    if (block->oid == oid && block->index == index)
+      break;
   }
-  metadata->parent_id = localph;
-
-  // Just create a new abstract album...
-  return create_new_abstract_list(device,
-				  metadata->name,
-				  metadata->artist,
-				  metadata->composer,
-				  metadata->genre,
-				  localph,
-				  metadata->storage_id,
-				  PTP_OFC_MTP_AbstractAudioAlbum,
-				  ".alb",
-				  &metadata->album_id,
-				  metadata->tracks,
-				  metadata->no_tracks);
+  if (block == NULL || !touch || block == cache->head)
+    return block;
+  // Move it to the front
+  block->prev->next = block->next;
+  if (block->next != NULL)
+    block->next->prev = block->prev;
+  else
+    cache->tail = block->prev;
+  block->prev = NULL;
+  block->next = cache->head;
+  cache->head->prev = block;
+  cache->head = block;
+  return block;
 }
 
 /**
- * This creates a new sample data metadata structure and allocates memory
- * for it. Notice that if you add strings to this structure they
- * will be freed by the corresponding <code>LIBMTP_destroy_sampledata_t</code>
- * operation later, so be careful of using strdup() when assigning
- * strings.
- *
- * @return a pointer to the newly allocated metadata structure.
- * @see LIBMTP_destroy_sampledata_t()
+ * Add a block to the front of the cache, dropping the least recently
+ * used blocks to stay within the memory bound.
+ * @param cache the block cache.
+ * @param block the block, which the cache owns from now on.
  */
-LIBMTP_filesampledata_t *LIBMTP_new_filesampledata_t(void)
+static void block_insert(mtp_block_cache_t *cache, mtp_block_t *block)
 {
-  LIBMTP_filesampledata_t *new = (LIBMTP_filesampledata_t *) malloc(sizeof(LIBMTP_filesampledata_t));
-  if (new == NULL) {
-    return NULL;
-  }
-  new->height=0;
-  new->width = 0;
-  new->data = NULL;
-  new->duration = 0;
-  new->size = 0;
-  return new;
+  while (cache->tail != NULL && cache->bytes + block->len > cache->max)
+    block_unlink(cache, cache->tail);
+  block->prev = NULL;
+  block->next = cache->head;
+  if (cache->head != NULL)
+    cache->head->prev = block;
+  else
+    cache->tail = block;
+  cache->head = block;
+  cache->bytes += block->len;
 }
 
 /**
- * This destroys a file sample metadata type.
- * @param sample the file sample metadata to be destroyed.
+ * Return the block cache of a device, setting it up with the default
+ * bound the first time.
+ * @param device the device.
+ * @return the cache, or NULL if out of memory.
  */
-void LIBMTP_destroy_filesampledata_t(LIBMTP_filesampledata_t * sample)
+static mtp_block_cache_t *block_cache_get(LIBMTP_mtpdevice_t *device)
 {
-  if (sample == NULL) {
-    return;
-  }
-  if (sample->data != NULL) {
-    free(sample->data);
+  mtp_block_cache_t *cache = (mtp_block_cache_t *) device->blocks;
+
+  if (cache == NULL) {
+    cache = calloc(1, sizeof(mtp_block_cache_t));
+    if (cache == NULL)
+      return NULL;
+    cache->max = PARTIAL_CACHE_DEFAULT;
+    device->blocks = cache;
   }
-  free(sample);
+  return cache;
 }
 
 /**
- * This routine figures out whether a certain filetype supports
- * representative samples (small thumbnail images) or not. This
- * typically applies to JPEG files, MP3 files and Album abstract
- * playlists, but in theory any filetype could support representative
- * samples.
- * @param device a pointer to the device which is to be examined.
- * @param filetype the fileype to examine, and return the representative sample
- *        properties for.
- * @param sample this will contain a new sample type with the fields
- *        filled in with suitable default values. For example, the
- *        supported sample type will be set, the supported height and
- *        width will be set to max values if it is an image sample,
- *        and duration will also be given some suitable default value
- *        which should not be exceeded on audio samples. If the
- *        device does not support samples for this filetype, this
- *        pointer will be NULL. If it is not NULL, the user must
- *        destroy this struct with <code>LIBMTP_destroy_filesampledata_t()</code>
- *        after use.
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Send_Representative_Sample()
- * @see LIBMTP_Create_New_Album()
+ * Free the block cache of a device, if it has one.
+ * @param device the device being released.
  */
-int LIBMTP_Get_Representative_Sample_Format(LIBMTP_mtpdevice_t *device,
-					    LIBMTP_filetype_t const filetype,
-					    LIBMTP_filesampledata_t ** sample)
+static void block_cache_free(LIBMTP_mtpdevice_t *device)
 {
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-  uint16_t *props = NULL;
-  uint32_t propcnt = 0;
-  unsigned int i;
-  // TODO: Get rid of these when we can properly query the device.
-  int support_data = 0;
-  int support_format = 0;
-  int support_height = 0;
-  int support_width = 0;
-  int support_duration = 0;
-  int support_size = 0;
+  mtp_block_cache_t *cache = (mtp_block_cache_t *) device->blocks;
 
-  PTPObjectPropDesc opd_height;
-  PTPObjectPropDesc opd_width;
-  PTPObjectPropDesc opd_format;
-  PTPObjectPropDesc opd_duration;
-  PTPObjectPropDesc opd_size;
+  if (cache == NULL)
+    return;
+  while (cache->head != NULL)
+    block_unlink(cache, cache->head);
+  free(cache);
+  device->blocks = NULL;
+}
 
-  // Default to no type supported.
-  *sample = NULL;
+/**
+ * Forget the cached data and the size of an object, because it was
+ * written to, changed or deleted.
+ * @param device the device.
+ * @param object_id the object.
+ */
+static void block_drop_object(LIBMTP_mtpdevice_t *device,
+			      uint32_t const object_id)
+{
+  mtp_block_cache_t *cache = (mtp_block_cache_t *) device->blocks;
+  mtp_block_t *block;
+  mtp_block_t *next;
+  int i;
 
-  ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(filetype), &propcnt, &props);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Representative_Sample_Format(): could not get object properties.");
-    return -1;
-  }
-  /*
-   * TODO: when walking through these object properties, make calls to
-   * a new function in ptp.h/ptp.c that can send the command
-   * PTP_OC_MTP_GetObjectPropDesc to get max/min values of the properties
-   * supported.
-   */
-  for (i = 0; i < propcnt; i++) {
-    switch(props[i]) {
-    case PTP_OPC_RepresentativeSampleData:
-      support_data = 1;
-      break;
-    case PTP_OPC_RepresentativeSampleFormat:
-      support_format = 1;
-      break;
-    case PTP_OPC_RepresentativeSampleSize:
-      support_size = 1;
-      break;
-    case PTP_OPC_RepresentativeSampleHeight:
-      support_height = 1;
-      break;
-    case PTP_OPC_RepresentativeSampleWidth:
-      support_width = 1;
-      break;
-    case PTP_OPC_RepresentativeSampleDuration:
-      support_duration = 1;
-      break;
-    default:
-      break;
-    }
+  if (cache == NULL)
+    return;
+  for (block = cache->head; block != NULL; block = next) {
+    next = block->next;
+    if (block->oid == object_id)
+      block_unlink(cache, block);
   }
-  free(props);
-
-  if (support_data && support_format && support_height && support_width && !support_duration) {
-    // Something that supports height and width and not duration is likely to be JPEG
-    LIBMTP_filesampledata_t *retsam = LIBMTP_new_filesampledata_t();
-    /*
-     * Populate the sample format with the first supported format
-     *
-     * TODO: figure out how to pass back more than one format if more are
-     * supported by the device.
-     */
-    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleFormat, map_libmtp_type_to_ptp_type(filetype), &opd_format);
-    retsam->filetype = map_ptp_type_to_libmtp_type(opd_format.FORM.Enum.SupportedValue[0].u16);
-    ptp_free_objectpropdesc(&opd_format);
-    /* Populate the maximum image height */
-    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleWidth, map_libmtp_type_to_ptp_type(filetype), &opd_width);
-    retsam->width = opd_width.FORM.Range.MaximumValue.u32;
-    ptp_free_objectpropdesc(&opd_width);
-    /* Populate the maximum image width */
-    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleHeight, map_libmtp_type_to_ptp_type(filetype), &opd_height);
-    retsam->height = opd_height.FORM.Range.MaximumValue.u32;
-    ptp_free_objectpropdesc(&opd_height);
-    /* Populate the maximum size */
-    if (support_size) {
-      ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleSize, map_libmtp_type_to_ptp_type(filetype), &opd_size);
-      retsam->size = opd_size.FORM.Range.MaximumValue.u32;
-      ptp_free_objectpropdesc(&opd_size);
-    }
-    *sample = retsam;
-  } else if (support_data && support_format && !support_height && !support_width && support_duration) {
-    // Another qualified guess
-    LIBMTP_filesampledata_t *retsam = LIBMTP_new_filesampledata_t();
-    /*
-     * Populate the sample format with the first supported format
-     *
-     * TODO: figure out how to pass back more than one format if more are
-     * supported by the device.
-     */
-    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleFormat, map_libmtp_type_to_ptp_type(filetype), &opd_format);
-    retsam->filetype = map_ptp_type_to_libmtp_type(opd_format.FORM.Enum.SupportedValue[0].u16);
-    ptp_free_objectpropdesc(&opd_format);
-    /* Populate the maximum duration */
-    ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleDuration, map_libmtp_type_to_ptp_type(filetype), &opd_duration);
-    retsam->duration = opd_duration.FORM.Range.MaximumValue.u32;
-    ptp_free_objectpropdesc(&opd_duration);
-    /* Populate the maximum size */
-    if (support_size) {
-      ptp_mtp_getobjectpropdesc (params, PTP_OPC_RepresentativeSampleSize, map_libmtp_type_to_ptp_type(filetype), &opd_size);
-      retsam->size = opd_size.FORM.Range.MaximumValue.u32;
-      ptp_free_objectpropdesc(&opd_size);
-    }
-    *sample = retsam;
+  for (i = 0; i < PARTIAL_STREAMS; i++) {
+    if (cache->streams[i].oid == object_id)
+      memset(&cache->streams[i], 0, sizeof(mtp_stream_t));
   }
-  return 0;
 }
 
 /**
- * This routine sends representative sample data for an object.
- * This uses the RepresentativeSampleData property of the album,
- * if the device supports it. The data should be of a format acceptable
- * to the player (for iRiver and Creative, this seems to be JPEG) and
- * must not be too large. (for a Creative, max seems to be about 20KB.)
- * Check by calling LIBMTP_Get_Representative_Sample_Format() to get
- * maximum size, dimensions, etc..
- * @param device a pointer to the device which the object is on.
- * @param id unique id of the object to set artwork for.
- * @param pointer to LIBMTP_filesampledata_t struct containing data
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Get_Representative_Sample()
- * @see LIBMTP_Get_Representative_Sample_Format()
- * @see LIBMTP_Create_New_Album()
+ * Look up the size of an object, from the object cache when it is
+ * there and on the device otherwise.
+ * @param device the device.
+ * @param id the object.
+ * @param filesize set to the size.
+ * @return 0 on success, -1 if the object could not be found.
  */
-int LIBMTP_Send_Representative_Sample(LIBMTP_mtpdevice_t *device,
-                          uint32_t const id,
-                          LIBMTP_filesampledata_t *sampledata)
+static int object_filesize(LIBMTP_mtpdevice_t *device, uint32_t const id,
+			   uint64_t *filesize)
 {
-  uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  PTPPropertyValue propval;
+  LIBMTP_file_t *mtpfile;
   PTPObject *ob;
-  uint32_t i;
-  uint16_t *props = NULL;
-  uint32_t propcnt = 0;
-  int supported = 0;
 
-  // get the file format for the object we're going to send representative data for
-  ret = ptp_object_want (params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
-  if (ret != PTP_RC_OK) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Representative_Sample(): could not get object info.");
-    return -1;
+  if (ptp_object_find(params, id, &ob) == PTP_RC_OK &&
+      (ob->flags & PTPOBJECT_OBJECTINFO_LOADED) &&
+      (ob->mtpprops != NULL || PTP_OB_SIZE(params, ob) != 0xFFFFFFFFU)) {
+    *filesize = object_cached_filesize(device, ob);
+    return 0;
   }
-
-  // check that we can send representative sample data for this object format
-  ret = ptp_mtp_getobjectpropssupported(params, ob->oi.ObjectFormat, &propcnt, &props);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_Representative_Sample(): could not get object properties.");
+  mtpfile = LIBMTP_Get_Filemetadata(device, id);
+  if (mtpfile == NULL)
     return -1;
+  *filesize = mtpfile->filesize;
+  LIBMTP_destroy_file_t(mtpfile);
+  return 0;
+}
+
+/**
+ * Find how an object is being read, or start following it in place
+ * of the object read least recently.
+ * @param device the device.
+ * @param cache the block cache.
+ * @param id the object.
+ * @return the stream, or NULL if the object could not be found.
+ */
+static mtp_stream_t *block_stream(LIBMTP_mtpdevice_t *device,
+				  mtp_block_cache_t *cache, uint32_t const id)
+{
+  mtp_stream_t *stream = &cache->streams[0];
+  int i;
+
+  for (i = 0; i < PARTIAL_STREAMS; i++) {
+    if (cache->streams[i].oid == id && cache->streams[i].used != 0) {
+      stream = &cache->streams[i];
+      stream->used = ++cache->clock;
+      return stream;
+    }
+    if (cache->streams[i].used < stream->used)
+      stream = &cache->streams[i];
   }
 
-  for (i = 0; i < propcnt; i++) {
-    if (props[i] == PTP_OPC_RepresentativeSampleData) {
-      supported = 1;
+  memset(stream, 0, sizeof(mtp_stream_t));
+  if (object_filesize(device, id, &stream->filesize) != 0)
+    return NULL;
+  stream->oid = id;
+  stream->used = ++cache->clock;
+  return stream;
+}
+
+/**
+ * Read consecutive blocks of an object from the device in one
+ * request and copy the part of them from pos up to end into dest. The
+ * blocks that arrived in full are then cached.
+ * @param device the device.
+ * @param cache the block cache.
+ * @param id the object.
+ * @param filesize the size of the object.
+ * @param index the first block to read.
+ * @param nrofblocks the number of blocks to read.
+ * @param pos the first byte wanted, within the first block.
+ * @param end the byte after the last one wanted.
+ * @param dest where to copy the bytes wanted to.
+ * @param copied set to the number of bytes copied.
+ * @return the PTP return code of the read.
+ */
+static uint16_t block_read(LIBMTP_mtpdevice_t *device,
+			   mtp_block_cache_t *cache, uint32_t const id,
+			   uint64_t const filesize, uint64_t const index,
+			   uint32_t const nrofblocks, uint64_t const pos,
+			   uint64_t const end, unsigned char *dest,
+			   uint64_t *copied)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint64_t start = index * PARTIAL_BLOCK_SIZE;
+  uint32_t maxbytes;
+  mtp_block_read_t rd;
+  PTPDataHandler handler;
+  uint16_t ret;
+  uint32_t i;
+
+  *copied = 0;
+  rd.blocks = calloc(nrofblocks, sizeof(mtp_block_t *));
+  if (rd.blocks == NULL)
+    return PTP_ERROR_IO;
+  rd.nrofblocks = 0;
+  rd.got = 0;
+  for (i = 0; i < nrofblocks; i++) {
+    mtp_block_t *block = calloc(1, sizeof(mtp_block_t));
+    uint64_t left = filesize - (start + (uint64_t) i * PARTIAL_BLOCK_SIZE);
+
+    if (block == NULL)
+      break;
+    block->oid = id;
+    block->index = index + i;
+    block->len = left < PARTIAL_BLOCK_SIZE ? left : PARTIAL_BLOCK_SIZE;
+    block->data = malloc(block->len);
+    if (block->data == NULL) {
+      free(block);
       break;
     }
+    rd.blocks[rd.nrofblocks++] = block;
   }
-  if (!supported) {
-    free(props);
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Representative_Sample(): object type doesn't support RepresentativeSampleData.");
-    return -1;
+  if (rd.nrofblocks == 0) {
+    free(rd.blocks);
+    return PTP_ERROR_IO;
   }
-  free(props);
 
-  // Go ahead and send the data
-  propval.a.count = sampledata->size;
-  propval.a.v = malloc(sizeof(PTPPropertyValue) * sampledata->size);
-  for (i = 0; i < sampledata->size; i++) {
-    propval.a.v[i].u8 = sampledata->data[i];
+  maxbytes = (rd.nrofblocks - 1) * PARTIAL_BLOCK_SIZE +
+    rd.blocks[rd.nrofblocks - 1]->len;
+  ret = check_partial_object(device, filesize, start, &maxbytes);
+  if (ret == PTP_RC_OK) {
+    handler.getfunc = NULL;
+    handler.putfunc = put_block_data;
+    handler.getbuffunc = NULL;
+    handler.priv = &rd;
+    if (!ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64))
+      ret = ptp_getpartialobject_to_handler(params, id, (uint32_t) start,
+					    maxbytes, &handler);
+    else
+      ret = ptp_android_getpartialobject64_to_handler(params, id, start,
+						      maxbytes, &handler);
   }
 
-  ret = ptp_mtp_setobjectpropvalue(params,id,PTP_OPC_RepresentativeSampleData,
-				   &propval,PTP_DTC_AUINT8);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_Representative_Sample(): could not send sample data.");
-    free(propval.a.v);
-    return -1;
-  }
-  free(propval.a.v);
+  if (ret == PTP_RC_OK && start + rd.got > pos) {
+    uint64_t last = start + rd.got < end ? start + rd.got : end;
 
-  /* Set the height and width if the sample is an image, otherwise just
-   * set the duration and size */
-  switch(sampledata->filetype) {
-  case LIBMTP_FILETYPE_JPEG:
-  case LIBMTP_FILETYPE_JFIF:
-  case LIBMTP_FILETYPE_TIFF:
-  case LIBMTP_FILETYPE_BMP:
-  case LIBMTP_FILETYPE_GIF:
-  case LIBMTP_FILETYPE_PICT:
-  case LIBMTP_FILETYPE_PNG:
-    if (!FLAG_BROKEN_SET_SAMPLE_DIMENSIONS(ptp_usb)) {
-      // For images, set the height and width
-      set_object_u32(device, id, PTP_OPC_RepresentativeSampleHeight, sampledata->height);
-      set_object_u32(device, id, PTP_OPC_RepresentativeSampleWidth, sampledata->width);
+    for (i = (pos - start) / PARTIAL_BLOCK_SIZE;
+	 start + (uint64_t) i * PARTIAL_BLOCK_SIZE < last; i++) {
+      uint64_t bstart = start + (uint64_t) i * PARTIAL_BLOCK_SIZE;
+      uint64_t from = bstart > pos ? bstart : pos;
+      uint64_t to = bstart + rd.blocks[i]->len < last ?
+	bstart + rd.blocks[i]->len : last;
+
+      memcpy(dest + (from - pos), rd.blocks[i]->data + (from - bstart),
+	     to - from);
+      *copied += to - from;
     }
-    break;
-  default:
-    // For anything not an image, set the duration and size
-    set_object_u32(device, id, PTP_OPC_RepresentativeSampleDuration, sampledata->duration);
-    set_object_u32(device, id, PTP_OPC_RepresentativeSampleSize, sampledata->size);
-    break;
   }
+  for (i = 0; i < rd.nrofblocks; i++) {
+    uint64_t bend = (uint64_t) i * PARTIAL_BLOCK_SIZE + rd.blocks[i]->len;
 
-  return 0;
+    if (ret == PTP_RC_OK && rd.got >= bend && rd.blocks[i]->len <= cache->max) {
+      block_insert(cache, rd.blocks[i]);
+    } else {
+      free(rd.blocks[i]->data);
+      free(rd.blocks[i]);
+    }
+  }
+  free(rd.blocks);
+  return ret;
 }
 
 /**
- * This routine gets representative sample data for an object.
- * This uses the RepresentativeSampleData property of the album,
- * if the device supports it.
- * @param device a pointer to the device which the object is on.
- * @param id unique id of the object to get data for.
- * @param pointer to LIBMTP_filesampledata_t struct to receive data
+ * This reads a part of an object. The data is read in blocks which
+ * are cached, and when the object is read front to back the blocks
+ * after the part asked for are read along with it, in a window that
+ * doubles with every sequential read up to 1 MiB and is dropped as
+ * soon as the reads jump around. The size of the object is only
+ * looked up once. See LIBMTP_Set_Partial_Read_Cache() for the
+ * memory used.
+ * @param device a pointer to the device to read from.
+ * @param id the object to read.
+ * @param offset where to start reading.
+ * @param maxbytes the most bytes to read.
+ * @param data set to a newly allocated buffer with the data, which the
+ *        caller must free, or NULL if nothing was read.
+ * @param size set to the number of bytes read. This is less than
+ *        maxbytes near the end of the object.
  * @return 0 on success, any other value means failure.
- * @see LIBMTP_Send_Representative_Sample()
- * @see LIBMTP_Get_Representative_Sample_Format()
- * @see LIBMTP_Create_New_Album()
  */
-int LIBMTP_Get_Representative_Sample(LIBMTP_mtpdevice_t *device,
-                          uint32_t const id,
-                          LIBMTP_filesampledata_t *sampledata)
+int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
+                            uint64_t offset, uint32_t maxbytes,
+                            unsigned char **data, unsigned int *size)
 {
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-  PTPPropertyValue propval;
-  PTPObject *ob;
-  uint32_t i;
-  uint16_t *props = NULL;
-  uint32_t propcnt = 0;
-  int supported = 0;
+  mtp_block_cache_t *cache = block_cache_get(device);
+  mtp_stream_t	*stream;
+  unsigned char	*dest;
+  uint64_t	pos;
+  uint64_t	end;
+  uint16_t	ret;
 
-  // get the file format for the object we're going to send representative data for
-  ret = ptp_object_want (params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
-  if (ret != PTP_RC_OK) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Representative_Sample(): could not get object info.");
+  *data = NULL;
+  *size = 0;
+  if (cache == NULL)
     return -1;
-  }
-
-  // check that we can store representative sample data for this object format
-  ret = ptp_mtp_getobjectpropssupported(params, ob->oi.ObjectFormat, &propcnt, &props);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Representative_Sample(): could not get object properties.");
+  stream = block_stream(device, cache, id);
+  if (stream == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+      "LIBMTP_GetPartialObject: could not find mtpfile");
     return -1;
   }
 
-  for (i = 0; i < propcnt; i++) {
-    if (props[i] == PTP_OPC_RepresentativeSampleData) {
-      supported = 1;
-      break;
-    }
+  if (cache->max == 0) {
+    ret = get_partial_object(device, id, stream->filesize, offset, maxbytes,
+			     data, size);
+    return ret == PTP_RC_OK ? 0 : -1;
   }
-  if (!supported) {
-    free(props);
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_Representative_Sample(): object type doesn't support RepresentativeSampleData.");
-    return -1;
+
+  // Widen the read-ahead for sequential reads, drop it for seeks
+  if (offset != 0 && offset == stream->next) {
+    if (stream->window == 0)
+      stream->window = PARTIAL_BLOCK_SIZE;
+    else if (stream->window < PARTIAL_READAHEAD_MAX &&
+	     stream->window * 2 <= cache->max / 2)
+      stream->window *= 2;
+  } else {
+    stream->window = 0;
   }
-  free(props);
 
-  // Get the data
-  ret = ptp_mtp_getobjectpropvalue(params,id,PTP_OPC_RepresentativeSampleData,
-				   &propval,PTP_DTC_AUINT8);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Representative_Sample(): could not get sample data.");
+  if (offset >= stream->filesize)
+    return 0;
+  end = offset + maxbytes;
+  if (end > stream->filesize)
+    end = stream->filesize;
+  dest = malloc(end - offset);
+  if (dest == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+      "LIBMTP_GetPartialObject: out of memory");
     return -1;
   }
 
-  // Store it
-  sampledata->size = propval.a.count;
-  sampledata->data = malloc(sizeof(PTPPropertyValue) * propval.a.count);
-  for (i = 0; i < propval.a.count; i++) {
-    sampledata->data[i] = propval.a.v[i].u8;
-  }
-  free(propval.a.v);
+  pos = offset;
+  while (pos < end) {
+    uint64_t index = pos / PARTIAL_BLOCK_SIZE;
+    uint64_t last;
+    uint64_t copied;
+    mtp_block_t *block = block_find(cache, id, index, 1);
+    uint32_t n;
 
-  // Get the other properties
-  sampledata->width = get_u32_from_object(device, id, PTP_OPC_RepresentativeSampleWidth, 0);
-  sampledata->height = get_u32_from_object(device, id, PTP_OPC_RepresentativeSampleHeight, 0);
-  sampledata->duration = get_u32_from_object(device, id, PTP_OPC_RepresentativeSampleDuration, 0);
-  sampledata->filetype = map_ptp_type_to_libmtp_type(
-        get_u16_from_object(device, id, PTP_OPC_RepresentativeSampleFormat, LIBMTP_FILETYPE_UNKNOWN));
+    if (block != NULL) {
+      uint64_t boff = pos - index * PARTIAL_BLOCK_SIZE;
+      uint64_t len = block->len - boff;
+
+      if (len > end - pos)
+	len = end - pos;
+      memcpy(dest + (pos - offset), block->data + boff, len);
+      pos += len;
+      continue;
+    }
+
+    // Read up to the next cached block, but no further than the window
+    last = (end - 1 + stream->window) / PARTIAL_BLOCK_SIZE;
+    if (last > (stream->filesize - 1) / PARTIAL_BLOCK_SIZE)
+      last = (stream->filesize - 1) / PARTIAL_BLOCK_SIZE;
+    for (n = 1; index + n <= last && n < 0xFFFFFFFFU / PARTIAL_BLOCK_SIZE &&
+	   block_find(cache, id, index + n, 0) == NULL; n++)
+      ;
+    ret = block_read(device, cache, id, stream->filesize, index, n, pos, end,
+		     dest + (pos - offset), &copied);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_GetPartialObject: "
+				  "could not read object data.");
+      free(dest);
+      return -1;
+    }
+    pos += copied;
+    // A short read ends the call, the caller asks for the rest
+    if (copied == 0 || pos < end)
+      break;
+  }
 
+  stream->next = pos;
+  if (pos == offset) {
+    free(dest);
+    return 0;
+  }
+  *data = dest;
+  *size = pos - offset;
   return 0;
 }
 
 /**
- * Retrieve the thumbnail for a file.
- * @param device a pointer to the device to get the thumbnail from.
- * @param id the object ID of the file to retrieve the thumbnail for.
+ * This sets the memory bound of the block cache used by
+ * LIBMTP_GetPartialObject(). The cache is on with a bound of 2 MiB
+ * unless set otherwise. The read-ahead window is kept to half of the
+ * bound.
+ * @param device a pointer to the device.
+ * @param max_bytes the most bytes of object data to keep. 0 turns
+ *        the cache off, so that every call reads just what is asked
+ *        for.
  * @return 0 on success, any other value means failure.
  */
-int LIBMTP_Get_Thumbnail(LIBMTP_mtpdevice_t *device, uint32_t const id,
-                         unsigned char **data, unsigned int *size)
+int LIBMTP_Set_Partial_Read_Cache(LIBMTP_mtpdevice_t *device,
+				  uint32_t const max_bytes)
+{
+  mtp_block_cache_t *cache = block_cache_get(device);
+
+  if (cache == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Set_Partial_Read_Cache(): out of memory.");
+    return -1;
+  }
+  cache->max = max_bytes;
+  while (cache->tail != NULL && cache->bytes > cache->max)
+    block_unlink(cache, cache->tail);
+  return 0;
+}
+
+
+int LIBMTP_SendPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
+                             uint64_t offset, unsigned char *data, unsigned int size)
 {
   PTPParams *params = (PTPParams *) device->params;
   uint16_t ret;
 
-  ret = ptp_getthumb(params, id, data, size);
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_SendPartialObject)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+      "LIBMTP_SendPartialObject: PTP_OC_ANDROID_SendPartialObject not supported");
+    return -1;
+  }
+
+  block_drop_object(device, id);
+  ret = ptp_android_sendpartialobject(params, id, offset, data, size);
   if (ret == PTP_RC_OK)
       return 0;
   return -1;
 }
 
 
-int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
-                            uint64_t offset, uint32_t maxbytes,
-                            unsigned char **data, unsigned int *size)
+int LIBMTP_BeginEditObject(LIBMTP_mtpdevice_t *device, uint32_t const id)
 {
-  PTPParams	*params = (PTPParams *) device->params;
-  uint16_t	ret;
-  LIBMTP_file_t	*mtpfile = LIBMTP_Get_Filemetadata(device, id);
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
 
-  if (!mtpfile) {
-      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-        "LIBMTP_GetPartialObject: could not find mtpfile");
-    *size = 0;
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_BeginEditObject)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+      "LIBMTP_BeginEditObject: PTP_OC_ANDROID_BeginEditObject not supported");
     return -1;
   }
 
-  /* Some devices do not like reading over the end and hang instead of progressing */
-  if (offset >= mtpfile->filesize) {
-    *size = 0;
-    LIBMTP_destroy_file_t (mtpfile);
-    return 0;
-  }
-  if (offset + maxbytes > mtpfile->filesize) {
-    maxbytes = mtpfile->filesize - offset;
-  }
-
-  /* do not need it anymore */
-  LIBMTP_destroy_file_t (mtpfile);
-
-  /* The MTP stack of Samsung Galaxy devices has a mysterious bug in
-   * GetPartialObject. When GetPartialObject is invoked to read the
-   * last bytes of a file and the amount of data to read is such that
-   * the last USB packet sent in the reply matches exactly the USB 2.0
-   * packet size, then the Samsung Galaxy device hangs, resulting in a
-   * timeout error.
-   * As a workaround, we read one less byte instead of reaching the
-   * end of the file, forcing the caller to perform an additional read
-   * to get the last byte (i.e. the final read that would fail is
-   * replaced with two partial reads that succeed).
-   */
-  if ((params->device_flags & DEVICE_FLAG_SAMSUNG_OFFSET_BUG) &&
-      (maxbytes % PTP_USB_BULK_HS_MAX_PACKET_LEN_READ) == (PTP_USB_BULK_HS_MAX_PACKET_LEN_READ - PTP_USB_BULK_HDR_LEN)) {
-    maxbytes--;
-  }
+  ret = ptp_android_begineditobject(params, id);
+  if (ret == PTP_RC_OK)
+      return 0;
+  return -1;
+}
 
-  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64)) {
-    if  (!ptp_operation_issupported(params, PTP_OC_GetPartialObject)) {
-      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-        "LIBMTP_GetPartialObject: PTP_OC_GetPartialObject not supported");
-      return -1;
-    }
 
-    if (offset >> 32 != 0) {
-      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-        "LIBMTP_GetPartialObject: PTP_OC_GetPartialObject only supports 32bit offsets");
-      return -1;
-    }
+int LIBMTP_EndEditObject(LIBMTP_mtpdevice_t *device, uint32_t const id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
 
-    ret = ptp_getpartialobject(params, id, (uint32_t)offset, maxbytes, data, size);
-  } else {
-    ret = ptp_android_getpartialobject64(params, id, offset, maxbytes, data, size);
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_EndEditObject)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+      "LIBMTP_EndEditObject: PTP_OC_ANDROID_EndEditObject not supported");
+    return -1;
   }
-  if (ret == PTP_RC_OK)
+
+  block_drop_object(device, id);
+  ret = ptp_android_endeditobject(params, id);
+  if (ret == PTP_RC_OK) {
+      // update cached object properties if metadata cache exists
+      update_metadata_cache(device, id);
       return 0;
+  }
   return -1;
 }
 
 
-int LIBMTP_SendPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
-                             uint64_t offset, unsigned char *data, unsigned int size)
+int LIBMTP_TruncateObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
+                          uint64_t offset)
 {
   PTPParams *params = (PTPParams *) device->params;
   uint16_t ret;
 
-  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_SendPartialObject)) {
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_TruncateObject)) {
     add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-      "LIBMTP_SendPartialObject: PTP_OC_ANDROID_SendPartialObject not supported");
+      "LIBMTP_TruncateObject: PTP_OC_ANDROID_TruncateObject not supported");
     return -1;
   }
 
-  ret = ptp_android_sendpartialobject(params, id, offset, data, size);
+  block_drop_object(device, id);
+  ret = ptp_android_truncate(params, id, offset);
   if (ret == PTP_RC_OK)
       return 0;
   return -1;
 }
 
+/*
+ * Defaults of an edit session: how much written data to hold back
+ * and for how many seconds.
+ */
+#define EDIT_SESSION_BUFFER 0x100000
+#define EDIT_SESSION_AGE 2
+
+/**
+ * One run of written data not yet sent to the device.
+ */
+typedef struct mtp_extent_struct mtp_extent_t;
+struct mtp_extent_struct {
+  uint64_t offset;
+  uint32_t len;
+  uint32_t alloc;
+  unsigned char *data;
+  mtp_extent_t *next;
+};
+
+struct LIBMTP_edit_session_struct {
+  LIBMTP_mtpdevice_t *device;
+  uint32_t id;
+  /** Written data in offset order, never overlapping or touching */
+  mtp_extent_t *extents;
+  uint32_t buffered;
+  uint32_t max_buffer;
+  unsigned int max_age;
+  time_t oldest;
+  /** Size of the object on the device, and after the edits so far */
+  uint64_t devsize;
+  uint64_t size;
+  int failed;
+};
+
+/**
+ * Send all buffered data of an edit session to the device, lowest
+ * offset first. Data that could not be sent stays buffered.
+ * @param session the edit session.
+ * @return 0 on success, -1 on failure.
+ */
+static int edit_session_flush(LIBMTP_edit_session_t *session)
+{
+  PTPParams *params = (PTPParams *) session->device->params;
+  mtp_extent_t *extent;
+  uint16_t ret;
 
-int LIBMTP_BeginEditObject(LIBMTP_mtpdevice_t *device, uint32_t const id)
+  if (session->extents != NULL)
+    block_drop_object(session->device, session->id);
+  while ((extent = session->extents) != NULL) {
+    ret = ptp_android_sendpartialobject(params, session->id, extent->offset,
+					extent->data, extent->len);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(session->device, ret,
+				  "LIBMTP_Edit_Session_Flush(): could not send data.");
+      return -1;
+    }
+    if (extent->offset + extent->len > session->devsize)
+      session->devsize = extent->offset + extent->len;
+    session->buffered -= extent->len;
+    session->extents = extent->next;
+    free(extent->data);
+    free(extent);
+  }
+  session->oldest = 0;
+  return 0;
+}
+
+/**
+ * This starts editing an object in place on an Android device. Writes
+ * and size changes are collected in the returned session: writes that
+ * touch or overlap are merged, and the data is sent in large pieces
+ * when more than <code>max_buffer</code> bytes are held, when the
+ * oldest of them is <code>max_age</code> seconds old at the next
+ * write, on LIBMTP_Edit_Session_Flush() and on
+ * LIBMTP_End_Edit_Session(). The object size is followed so that the
+ * object is only truncated once, at the end, unless data already on
+ * the device has to be cut off. The whole session is one
+ * BeginEditObject/EndEditObject pair.
+ * @param device a pointer to the device the object is on.
+ * @param id the object to edit.
+ * @param max_buffer the most bytes to hold back, 0 for 1 MiB.
+ * @param max_age the most seconds to hold data back, 0 for 2.
+ * @return a session to pass to the other edit session functions and
+ *         to close with LIBMTP_End_Edit_Session(), or NULL on failure.
+ * @see LIBMTP_Check_Capability() with LIBMTP_DEVICECAP_EditObjects
+ */
+LIBMTP_edit_session_t *LIBMTP_Begin_Edit_Session(LIBMTP_mtpdevice_t *device,
+						 uint32_t const id,
+						 uint32_t const max_buffer,
+						 unsigned int const max_age)
 {
   PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_edit_session_t *session;
+  uint64_t filesize;
   uint16_t ret;
 
-  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_BeginEditObject)) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-      "LIBMTP_BeginEditObject: PTP_OC_ANDROID_BeginEditObject not supported");
-    return -1;
+  if (!LIBMTP_Check_Capability(device, LIBMTP_DEVICECAP_SendPartialObject) ||
+      !LIBMTP_Check_Capability(device, LIBMTP_DEVICECAP_EditObjects)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Begin_Edit_Session(): "
+			    "device cannot edit objects.");
+    return NULL;
+  }
+  if (object_filesize(device, id, &filesize) != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Begin_Edit_Session(): "
+			    "could not find object.");
+    return NULL;
+  }
+  session = calloc(1, sizeof(LIBMTP_edit_session_t));
+  if (session == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION, "LIBMTP_Begin_Edit_Session(): "
+			    "out of memory.");
+    return NULL;
+  }
+  ret = ptp_android_begineditobject(params, id);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Begin_Edit_Session(): "
+				"could not begin editing.");
+    free(session);
+    return NULL;
   }
+  session->device = device;
+  session->id = id;
+  session->max_buffer = max_buffer ? max_buffer : EDIT_SESSION_BUFFER;
+  session->max_age = max_age ? max_age : EDIT_SESSION_AGE;
+  session->devsize = filesize;
+  session->size = filesize;
+  return session;
+}
+
+/**
+ * This writes data into an object being edited. The data is copied
+ * and may be sent to the device later.
+ * @param session the edit session.
+ * @param offset where in the object to write.
+ * @param data the data to write.
+ * @param size the number of bytes to write.
+ * @return 0 on success, any other value means failure. A failure to
+ *         send data written before is reported here too.
+ */
+int LIBMTP_Edit_Session_Write(LIBMTP_edit_session_t *session,
+			      uint64_t const offset,
+			      unsigned char const * const data,
+			      uint32_t const size)
+{
+  mtp_extent_t **prevp = &session->extents;
+  mtp_extent_t *extent;
+  uint64_t start = offset;
+  uint64_t end = offset + size;
+  uint32_t merged = 0;
+
+  if (size == 0)
+    return 0;
+  // Skip the runs which end before this one starts
+  while (*prevp != NULL && (*prevp)->offset + (*prevp)->len < offset)
+    prevp = &(*prevp)->next;
+
+  extent = *prevp;
+  if (extent != NULL && extent->offset <= offset &&
+      (extent->next == NULL || extent->next->offset > end)) {
+    // Only this run is touched, write into it
+    uint64_t newend = extent->offset + extent->len > end ?
+      extent->offset + extent->len : end;
+
+    if (newend - extent->offset > 0xFFFFFFFFU)
+      goto separate;
+    if (newend - extent->offset > extent->alloc) {
+      uint64_t alloc = extent->alloc * 2;
+      unsigned char *tmp;
+
+      if (alloc < newend - extent->offset)
+	alloc = newend - extent->offset;
+      if (alloc > 0xFFFFFFFFU)
+	alloc = 0xFFFFFFFFU;
+      tmp = realloc(extent->data, alloc);
+      if (tmp == NULL)
+	goto nomem;
+      extent->data = tmp;
+      extent->alloc = alloc;
+    }
+    memcpy(extent->data + (offset - extent->offset), data, size);
+    session->buffered += (newend - extent->offset) - extent->len;
+    extent->len = newend - extent->offset;
+  } else {
+    mtp_extent_t *next;
+    unsigned char *buf;
+
+    // Merge all runs which touch or overlap this one into a new run
+  separate:
+    for (extent = *prevp; extent != NULL && extent->offset <= end;
+	 extent = extent->next) {
+      if (extent->offset < start)
+	start = extent->offset;
+      if (extent->offset + extent->len > end)
+	end = extent->offset + extent->len;
+    }
+    if (end - start > 0xFFFFFFFFU) {
+      // Too large to merge, send out what is there first
+      if (edit_session_flush(session) != 0)
+	return -1;
+      // The runs are freed by the flush, find our place again
+      prevp = &session->extents;
+      while (*prevp != NULL && (*prevp)->offset + (*prevp)->len < offset)
+	prevp = &(*prevp)->next;
+      start = offset;
+      end = offset + size;
+    }
+    next = *prevp;
+    buf = malloc(end - start);
+    if (buf == NULL)
+      goto nomem;
+    for (extent = *prevp; extent != NULL && extent->offset <= end;
+	 extent = next) {
+      next = extent->next;
+      memcpy(buf + (extent->offset - start), extent->data, extent->len);
+      merged += extent->len;
+      free(extent->data);
+      free(extent);
+    }
+    memcpy(buf + (offset - start), data, size);
+    extent = malloc(sizeof(mtp_extent_t));
+    if (extent == NULL) {
+      // The runs merged are gone, so this is fatal for the session
+      free(buf);
+      *prevp = next;
+      session->buffered -= merged;
+      session->failed = 1;
+      goto nomem;
+    }
+    extent->offset = start;
+    extent->len = end - start;
+    extent->alloc = end - start;
+    extent->data = buf;
+    extent->next = next;
+    *prevp = extent;
+    session->buffered += extent->len - merged;
+  }
+
+  if (offset + size > session->size)
+    session->size = offset + size;
+  if (session->oldest == 0)
+    session->oldest = time(NULL);
+  if (session->buffered > session->max_buffer ||
+      time(NULL) - session->oldest >= (time_t) session->max_age)
+    return edit_session_flush(session);
+  return 0;
 
-  ret = ptp_android_begineditobject(params, id);
-  if (ret == PTP_RC_OK)
-      return 0;
+ nomem:
+  add_error_to_errorstack(session->device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			  "LIBMTP_Edit_Session_Write(): out of memory.");
   return -1;
 }
 
-
-int LIBMTP_EndEditObject(LIBMTP_mtpdevice_t *device, uint32_t const id)
+/**
+ * This sets the size of an object being edited. Cutting off data that
+ * is already on the device is done right away, anything else only
+ * when the session ends.
+ * @param session the edit session.
+ * @param size the new size of the object.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Edit_Session_Truncate(LIBMTP_edit_session_t *session,
+				 uint64_t const size)
 {
-  PTPParams *params = (PTPParams *) device->params;
+  PTPParams *params = (PTPParams *) session->device->params;
+  mtp_extent_t **prevp = &session->extents;
+  mtp_extent_t *extent;
   uint16_t ret;
 
-  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_EndEditObject)) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-      "LIBMTP_EndEditObject: PTP_OC_ANDROID_EndEditObject not supported");
-    return -1;
+  // Drop what was written past the new end
+  while ((extent = *prevp) != NULL) {
+    if (extent->offset >= size) {
+      *prevp = extent->next;
+      session->buffered -= extent->len;
+      free(extent->data);
+      free(extent);
+      continue;
+    }
+    if (extent->offset + extent->len > size) {
+      session->buffered -= extent->offset + extent->len - size;
+      extent->len = size - extent->offset;
+    }
+    prevp = &extent->next;
   }
+  session->size = size;
+  if (size >= session->devsize)
+    return 0;
 
-  ret = ptp_android_endeditobject(params, id);
-  if (ret == PTP_RC_OK) {
-      // update cached object properties if metadata cache exists
-      update_metadata_cache(device, id);
-      return 0;
+  // Later writes past the new end must not show the old data
+  if (edit_session_flush(session) != 0)
+    return -1;
+  ret = ptp_android_truncate(params, session->id, size);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(session->device, ret,
+				"LIBMTP_Edit_Session_Truncate(): could not truncate object.");
+    return -1;
   }
-  return -1;
+  session->devsize = size;
+  return 0;
 }
 
+/**
+ * This sends all data written to an object being edited to the device.
+ * @param session the edit session.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Edit_Session_Flush(LIBMTP_edit_session_t *session)
+{
+  return edit_session_flush(session);
+}
 
-int LIBMTP_TruncateObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
-                          uint64_t offset)
+/**
+ * This ends editing an object: the data still held back is sent, the
+ * object is given its final size, and the edit is committed. The
+ * session is freed in any case.
+ * @param session the edit session.
+ * @return 0 on success, any other value means that some edits did not
+ *         make it to the device.
+ */
+int LIBMTP_End_Edit_Session(LIBMTP_edit_session_t *session)
 {
+  LIBMTP_mtpdevice_t *device = session->device;
   PTPParams *params = (PTPParams *) device->params;
+  mtp_extent_t *extent;
+  int result = session->failed ? -1 : 0;
   uint16_t ret;
 
-  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_TruncateObject)) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-      "LIBMTP_TruncateObject: PTP_OC_ANDROID_TruncateObject not supported");
-    return -1;
+  if (edit_session_flush(session) != 0)
+    result = -1;
+  if (result == 0 && session->size != session->devsize) {
+    ret = ptp_android_truncate(params, session->id, session->size);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_End_Edit_Session(): "
+				  "could not set object size.");
+      result = -1;
+    }
+  }
+  block_drop_object(device, session->id);
+  ret = ptp_android_endeditobject(params, session->id);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_End_Edit_Session(): "
+				"could not end editing.");
+    result = -1;
+  } else {
+    update_metadata_cache(device, session->id);
   }
 
-  ret = ptp_android_truncate(params, id, offset);
-  if (ret == PTP_RC_OK)
-      return 0;
-  return -1;
+  while ((extent = session->extents) != NULL) {
+    session->extents = extent->next;
+    free(extent->data);
+    free(extent);
+  }
+  free(session);
+  return result;
 }
 
 
@@ -9430,6 +15576,8 @@ static void add_object_to_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id)
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "add_object_to_cache(): couldn't add object to cache");
   }
+  // The folder it went into has a new child
+  listing_drop_object(device, object_id);
 }
 
 
@@ -9442,10 +15590,542 @@ static void update_metadata_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id
 {
   PTPParams *params = (PTPParams *)device->params;
 
+  listing_drop_object(device, object_id);
   ptp_remove_object_from_cache(params, object_id);
   add_object_to_cache(device, object_id);
 }
 
+/**
+ * Re-read the info of one storage into the storage list.
+ * @param device the device the storage belongs to.
+ * @param storage_id the storage to update.
+ * @return 0 on success, any other value means failure.
+ */
+static int update_storage_info(LIBMTP_mtpdevice_t *device,
+			       uint32_t const storage_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_devicestorage_t *storage;
+  PTPStorageInfo storageInfo;
+  uint16_t ret;
+
+  for (storage = device->storage; storage != NULL; storage = storage->next) {
+    if (storage->id == storage_id)
+      break;
+  }
+  if (storage == NULL) {
+    // Not one we know about, take the whole list again
+    return LIBMTP_Get_Storage(device, LIBMTP_STORAGE_SORTBY_NOTSORTED) < 0 ? -1 : 0;
+  }
+  if (!ptp_operation_issupported(params,PTP_OC_GetStorageInfo))
+    return 0;
+
+  ret = ptp_getstorageinfo(params, storage_id, &storageInfo);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "update_storage_info(): "
+				"Could not get storage info.");
+    return -1;
+  }
+  storage->StorageType = storageInfo.StorageType;
+  storage->FilesystemType = storageInfo.FilesystemType;
+  storage->AccessCapability = storageInfo.AccessCapability;
+  storage->MaxCapacity = storageInfo.MaxCapability;
+  storage->FreeSpaceInBytes = storageInfo.FreeSpaceInBytes;
+  storage->FreeSpaceInObjects = storageInfo.FreeSpaceInImages;
+  free(storage->StorageDescription);
+  storage->StorageDescription = storageInfo.StorageDescription;
+  free(storage->VolumeIdentifier);
+  storage->VolumeIdentifier = storageInfo.VolumeLabel;
+  return 0;
+}
+
+/**
+ * Drop all objects on one storage from the cache.
+ * @param device the device the storage belonged to.
+ * @param storage_id the storage that went away.
+ */
+static void remove_storage_from_cache(LIBMTP_mtpdevice_t *device,
+				      uint32_t const storage_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObject *ob = NULL;
+  uint32_t *oids = NULL;
+  uint32_t nrofoids = 0;
+  uint32_t allocated = 0;
+
+  // Collect first, the storage index must not change while walking it
+  while ((ob = ptp_objects_next_by_storage(params, storage_id, ob)) != NULL) {
+    if (nrofoids == allocated) {
+      uint32_t *tmp;
+
+      allocated = allocated ? allocated * 2 : 64;
+      tmp = realloc(oids, allocated * sizeof(uint32_t));
+      if (tmp == NULL) {
+	// Better a full reload than a cache with stale objects
+	free(oids);
+	flush_handles(device);
+	return;
+      }
+      oids = tmp;
+    }
+    oids[nrofoids++] = ob->oid;
+  }
+  ptp_remove_objects_from_cache(params, oids, nrofoids);
+  free(oids);
+}
+
+/**
+ * Set up the caches of a device opened with LIBMTP_OPEN_BOUNDED_CACHE.
+ * @param device the device to set up.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int bounded_cache_init(LIBMTP_mtpdevice_t *device)
+{
+  mtp_listing_cache_t *cache;
+
+  cache = calloc(1, sizeof(mtp_listing_cache_t));
+  if (cache == NULL)
+    return -1;
+  cache->max = BOUNDED_CACHE_FOLDERS;
+  device->listings = cache;
+  ptp_objects_set_limit((PTPParams *) device->params, BOUNDED_CACHE_OBJECTS);
+  return 0;
+}
+
+/**
+ * Unlink one folder listing from the cache and free it.
+ * @param cache the listing cache.
+ * @param listing the listing to drop.
+ */
+static void listing_unlink(mtp_listing_cache_t *cache, mtp_listing_t *listing)
+{
+  if (listing->prev != NULL)
+    listing->prev->next = listing->next;
+  else
+    cache->head = listing->next;
+  if (listing->next != NULL)
+    listing->next->prev = listing->prev;
+  else
+    cache->tail = listing->prev;
+  cache->nroflistings--;
+  free(listing->handles);
+  free(listing);
+}
+
+/**
+ * Drop all cached folder listings.
+ * @param cache the listing cache.
+ */
+static void listing_drop_all(mtp_listing_cache_t *cache)
+{
+  while (cache->head != NULL)
+    listing_unlink(cache, cache->head);
+}
+
+/**
+ * Free the folder listings of a device, if it has any.
+ * @param device the device being released.
+ */
+static void bounded_cache_free(LIBMTP_mtpdevice_t *device)
+{
+  mtp_listing_cache_t *cache = (mtp_listing_cache_t *) device->listings;
+
+  if (cache == NULL)
+    return;
+  listing_drop_all(cache);
+  free(cache);
+  device->listings = NULL;
+}
+
+/**
+ * Look up a cached folder listing and mark it as recently used.
+ * @param device the device the folder is on.
+ * @param storage the storage ID the folder was listed with.
+ * @param parent the folder.
+ * @param handles a pointer that is set to a newly allocated copy of
+ *        the children, which the caller must free, if there are any.
+ * @return the number of children, or -1 if the folder is not cached.
+ */
+static int listing_get(LIBMTP_mtpdevice_t *device, uint32_t const storage,
+		       uint32_t const parent, uint32_t **handles)
+{
+  mtp_listing_cache_t *cache = (mtp_listing_cache_t *) device->listings;
+  mtp_listing_t *listing;
+
+  *handles = NULL;
+  if (cache == NULL)
+    return -1;
+  for (listing = cache->head; listing != NULL; listing = listing->next) {
+    if (listing->storage == storage && listing->parent == parent)
+      break;
+  }
+  if (listing == NULL)
+    return -1;
+  if (listing->nrofhandles != 0) {
+    *handles = malloc(listing->nrofhandles * sizeof(uint32_t));
+    if (*handles == NULL)
+      return -1;
+    memcpy(*handles, listing->handles, listing->nrofhandles * sizeof(uint32_t));
+  }
+  // Move it to the front
+  if (listing != cache->head) {
+    listing->prev->next = listing->next;
+    if (listing->next != NULL)
+      listing->next->prev = listing->prev;
+    else
+      cache->tail = listing->prev;
+    listing->prev = NULL;
+    listing->next = cache->head;
+    cache->head->prev = listing;
+    cache->head = listing;
+  }
+  return listing->nrofhandles;
+}
+
+/**
+ * Remember the children of a folder as just listed by the device,
+ * dropping the least recently used listing if the cache is full.
+ * Failures are not reported, the folder is simply listed again the
+ * next time.
+ * @param device the device the folder is on.
+ * @param storage the storage ID the folder was listed with.
+ * @param parent the folder.
+ * @param handles the children.
+ * @param nrofhandles the number of children.
+ */
+static void listing_store(LIBMTP_mtpdevice_t *device, uint32_t const storage,
+			  uint32_t const parent, uint32_t const *handles,
+			  uint32_t const nrofhandles)
+{
+  mtp_listing_cache_t *cache = (mtp_listing_cache_t *) device->listings;
+  mtp_listing_t *listing;
+
+  if (cache == NULL || cache->max == 0)
+    return;
+  for (listing = cache->head; listing != NULL; listing = listing->next) {
+    if (listing->storage == storage && listing->parent == parent) {
+      listing_unlink(cache, listing);
+      break;
+    }
+  }
+  while (cache->nroflistings >= cache->max)
+    listing_unlink(cache, cache->tail);
+
+  listing = calloc(1, sizeof(mtp_listing_t));
+  if (listing == NULL)
+    return;
+  if (nrofhandles != 0) {
+    listing->handles = malloc(nrofhandles * sizeof(uint32_t));
+    if (listing->handles == NULL) {
+      free(listing);
+      return;
+    }
+    memcpy(listing->handles, handles, nrofhandles * sizeof(uint32_t));
+  }
+  listing->storage = storage;
+  listing->parent = parent;
+  listing->nrofhandles = nrofhandles;
+  listing->next = cache->head;
+  if (cache->head != NULL)
+    cache->head->prev = listing;
+  else
+    cache->tail = listing;
+  cache->head = listing;
+  cache->nroflistings++;
+}
+
+/**
+ * Drop the cached listings a change to the children of a folder
+ * makes stale. Listing parent 0 returns all objects of a storage on
+ * most devices, so those always go.
+ * @param device the device the folder is on.
+ * @param parent the folder whose children changed.
+ */
+static void listing_drop(LIBMTP_mtpdevice_t *device, uint32_t const parent)
+{
+  mtp_listing_cache_t *cache = (mtp_listing_cache_t *) device->listings;
+  mtp_listing_t *listing;
+  mtp_listing_t *next;
+
+  if (cache == NULL)
+    return;
+  for (listing = cache->head; listing != NULL; listing = next) {
+    next = listing->next;
+    if (listing->parent == parent || listing->parent == 0 ||
+	(parent == 0 && listing->parent == LIBMTP_FILES_AND_FOLDERS_ROOT))
+      listing_unlink(cache, listing);
+  }
+}
+
+/**
+ * Drop the cached listing of the folder an object is in, or all
+ * listings if the object is not cached, so its folder is unknown.
+ * @param device the device the object is on.
+ * @param object_id the object that is added, removed or changed.
+ */
+static void listing_drop_object(LIBMTP_mtpdevice_t *device,
+				uint32_t const object_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  mtp_listing_cache_t *cache = (mtp_listing_cache_t *) device->listings;
+  PTPObject *ob;
+
+  if (cache == NULL)
+    return;
+  if (ptp_object_find(params, object_id, &ob) == PTP_RC_OK) {
+    listing_drop(device, PTP_OB_PARENT(params, ob));
+    return;
+  }
+  listing_drop_all(cache);
+}
+
+/**
+ * Drop what an event from a device opened with
+ * LIBMTP_OPEN_BOUNDED_CACHE makes stale. Nothing is read from the
+ * device, the objects and folders are fetched again when asked for.
+ * @param device the device the event came from.
+ * @param ptp_event the event.
+ */
+static void update_listings_from_event(LIBMTP_mtpdevice_t *device,
+				       PTPContainer *ptp_event)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t param1 = ptp_event->Param1;
+
+  switch (ptp_event->Code) {
+  case PTP_EC_ObjectAdded:
+    listing_drop_object(device, param1);
+    break;
+  case PTP_EC_ObjectRemoved:
+  case PTP_EC_ObjectInfoChanged:
+    listing_drop_object(device, param1);
+    ptp_remove_object_from_cache(params, param1);
+    break;
+  case PTP_EC_StoreAdded:
+  case PTP_EC_StoreRemoved:
+    if (device->listings != NULL)
+      listing_drop_all((mtp_listing_cache_t *) device->listings);
+    remove_storage_from_cache(device, param1);
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * Patch the object cache and the storage list after an event from a
+ * device opened with LIBMTP_OPEN_TRACK_EVENTS. Only the object or
+ * storage the event is about is read from the device again.
+ * @param device the device the event came from.
+ * @param ptp_event the event.
+ */
+static void update_cache_from_event(LIBMTP_mtpdevice_t *device,
+				    PTPContainer *ptp_event)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t param1 = ptp_event->Param1;
+  PTPObject *ob;
+
+  switch (ptp_event->Code) {
+  case PTP_EC_ObjectAdded:
+    // We may already have it, if we created it ourselves
+    if (ptp_object_find(params, param1, &ob) != PTP_RC_OK)
+      add_object_to_cache(device, param1);
+    break;
+  case PTP_EC_ObjectRemoved:
+    ptp_remove_object_from_cache(params, param1);
+    break;
+  case PTP_EC_ObjectInfoChanged:
+    update_metadata_cache(device, param1);
+    break;
+  case PTP_EC_StorageInfoChanged:
+    update_storage_info(device, param1);
+    break;
+  case PTP_EC_StoreAdded:
+    if (LIBMTP_Get_Storage(device, LIBMTP_STORAGE_SORTBY_NOTSORTED) < 0)
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			      "update_cache_from_event(): "
+			      "could not read the storage list.");
+    // Drop anything already seen on this storage, then list it
+    remove_storage_from_cache(device, param1);
+    get_handles_recursively(device, params, param1, PTP_GOH_ROOT_PARENT);
+    break;
+  case PTP_EC_StoreRemoved:
+    remove_storage_from_cache(device, param1);
+    if (LIBMTP_Get_Storage(device, LIBMTP_STORAGE_SORTBY_NOTSORTED) < 0)
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			      "update_cache_from_event(): "
+			      "could not read the storage list.");
+    break;
+  default:
+    break;
+  }
+}
+
+
+/**
+ * A live view stream of a CHDK camera.
+ */
+struct LIBMTP_live_view_struct {
+  LIBMTP_mtpdevice_t *device;
+  PTPChdkLvStream *stream;
+};
+
+static int live_view_layer(int const layer)
+{
+  return (layer == LIBMTP_LIVE_BITMAP) ? PTP_CHDK_LV_BITMAP :
+    PTP_CHDK_LV_VIEWPORT;
+}
+
+/**
+ * This starts streaming the live view of a camera running CHDK. The
+ * frames are read into a ring of frame buffers that are allocated at
+ * the size of the first frame and then reused. Where threads are
+ * available the next frame is fetched while the program works on the
+ * last one, so the camera is kept busy; frames the program was too
+ * slow to take are dropped, see LIBMTP_Live_View_Dropped().
+ *
+ * The stream uses the device like any other call, so other operations
+ * may be done on the device while it runs.
+ *
+ * @param device a pointer to the device.
+ * @param layers the layers to transfer, a combination of
+ *        LIBMTP_LIVE_VIEWPORT and LIBMTP_LIVE_BITMAP.
+ * @param frames the number of frame buffers to keep, 2 to 8, or 0 for
+ *        the default of 3. Frames held by the program count too.
+ * @return the stream, or NULL on failure. Close it with
+ *         LIBMTP_Live_View_Close().
+ * @see LIBMTP_Live_View_Next()
+ */
+LIBMTP_live_view_t *LIBMTP_Live_View_Open(LIBMTP_mtpdevice_t *device,
+					  int const layers,
+					  unsigned int const frames)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_live_view_t *lv;
+  unsigned flags = 0;
+  uint16_t ret;
+
+  if (layers & LIBMTP_LIVE_VIEWPORT)
+    flags |= LV_TFR_VIEWPORT;
+  if (layers & LIBMTP_LIVE_BITMAP)
+    flags |= LV_TFR_BITMAP | LV_TFR_PALETTE | LV_TFR_BITMAP_OPACITY;
+
+  lv = (LIBMTP_live_view_t *) malloc(sizeof(LIBMTP_live_view_t));
+  if (lv == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION, "LIBMTP_Live_View_Open(): "
+			    "out of memory.");
+    return NULL;
+  }
+  ret = ptp_chdk_lv_open(params, flags, frames, &lv->stream);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Live_View_Open(): "
+				"could not get live view data.");
+    free(lv);
+    return NULL;
+  }
+  lv->device = device;
+  return lv;
+}
+
+/**
+ * This hands out the newest live view frame, waiting for one if none
+ * came in since the last call.
+ * @param lv the live view stream.
+ * @return the frame, or NULL if the stream failed. The frame stays
+ *         valid until it is given back with LIBMTP_Live_View_Release().
+ */
+LIBMTP_live_frame_t *LIBMTP_Live_View_Next(LIBMTP_live_view_t *lv)
+{
+  PTPChdkLvFrame *frame;
+  uint16_t ret;
+
+  ret = ptp_chdk_lv_next(lv->stream, &frame);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(lv->device, ret, "LIBMTP_Live_View_Next(): "
+				"could not get live view data.");
+    return NULL;
+  }
+  return (LIBMTP_live_frame_t *) frame;
+}
+
+/**
+ * This gives a frame from LIBMTP_Live_View_Next() back to the stream,
+ * so its buffer can take another frame.
+ * @param lv the live view stream.
+ * @param frame the frame.
+ */
+void LIBMTP_Live_View_Release(LIBMTP_live_view_t *lv,
+			      LIBMTP_live_frame_t *frame)
+{
+  ptp_chdk_lv_release(lv->stream, (PTPChdkLvFrame *) frame);
+}
+
+/**
+ * This tells how many frames the camera sent that were never handed
+ * out, because a newer frame was there when the program asked.
+ * @param lv the live view stream.
+ * @return the number of frames dropped since the stream was opened.
+ */
+uint32_t LIBMTP_Live_View_Dropped(LIBMTP_live_view_t *lv)
+{
+  return ptp_chdk_lv_dropped(lv->stream);
+}
+
+/**
+ * This stops a live view stream and frees it, along with any frames
+ * not given back yet.
+ * @param lv the live view stream.
+ */
+void LIBMTP_Live_View_Close(LIBMTP_live_view_t *lv)
+{
+  if (lv == NULL)
+    return;
+  ptp_chdk_lv_close(lv->stream);
+  free(lv);
+}
+
+/**
+ * This gives the size of the visible part of one layer of a frame.
+ * @param frame the frame.
+ * @param layer LIBMTP_LIVE_VIEWPORT or LIBMTP_LIVE_BITMAP.
+ * @param width the width in pixels is returned here.
+ * @param height the height in pixels is returned here.
+ * @return 0 on success, -1 if the camera did not send the layer.
+ */
+int LIBMTP_Live_Frame_Size(LIBMTP_live_frame_t const *frame,
+			   int const layer, int *width, int *height)
+{
+  return ptp_chdk_lv_size((PTPChdkLvFrame const *) frame,
+			  live_view_layer(layer), width, height);
+}
+
+/**
+ * This converts one layer of a frame to RGBA, four bytes per pixel.
+ * The viewport comes out opaque, the bitmap overlay with the alpha of
+ * its palette or opacity buffer. The YUV formats of newer cameras are
+ * converted with SSE2 or NEON where the library was built for it.
+ * @param frame the frame.
+ * @param layer LIBMTP_LIVE_VIEWPORT or LIBMTP_LIVE_BITMAP.
+ * @param rgba the image, large enough for the size given by
+ *        LIBMTP_Live_Frame_Size().
+ * @param stride the number of bytes from one row of the image to the
+ *        next, at least four times the width.
+ * @return 0 on success, -1 if the layer was not sent, is in a format
+ *         that is not known or the stride is too small.
+ */
+int LIBMTP_Live_Frame_To_RGBA(LIBMTP_live_frame_t const *frame,
+			      int const layer, unsigned char *rgba,
+			      int const stride)
+{
+  if (stride < 0)
+    return -1;
+  if (ptp_chdk_lv_to_rgba((PTPChdkLvFrame const *) frame,
+			  live_view_layer(layer), rgba,
+			  (unsigned int) stride) != PTP_RC_OK)
+    return -1;
+  return 0;
+}
 
 /**
  * Issue custom (e.g. vendor specific) operation (without data phase)
@@ -590,6 +590,20 @@ int LIBMTP_Check_Specific_Device(int busno, int devno)
   return 0;
 }
 
+LIBMTP_error_number_t LIBMTP_Register_Hotplug(int flags,
+					      LIBMTP_hotplug_cb_fn cb,
+					      void *user_data,
+					      int *handle)
+{
+  /* Unsupported */
+  return LIBMTP_ERROR_USB_LAYER;
+}
+
+void LIBMTP_Unregister_Hotplug(int handle)
+{
+  /* Unsupported */
+}
+
 /**
  * Detect the raw MTP device descriptors and return a list of
  * of the devices found.
@@ -1098,6 +1112,7 @@ ptp_init_recv_memory_handler(PTPDataHandler *handler) {
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->getbuffunc = NULL;
 	priv->data = NULL;
 	priv->size = 0;
 	priv->curoff = 0;
@@ -1118,6 +1133,7 @@ ptp_init_send_memory_handler(PTPDataHandler *handler,
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->getbuffunc = NULL;
 	priv->data = data;
 	priv->size = len;
 	priv->curoff = 0;
@@ -1641,6 +1657,29 @@ int LIBMTP_Handle_Events_Timeout_Completed(struct timeval *tv, int *completed) {
 	return -12;
 }
 
+LIBMTP_error_number_t LIBMTP_Get_Pollfds(LIBMTP_pollfd_t **fds, int *count) {
+	/* Unsupported */
+	*fds = NULL;
+	*count = 0;
+	return LIBMTP_ERROR_USB_LAYER;
+}
+
+void LIBMTP_Set_Pollfd_Notifiers(LIBMTP_pollfd_added_cb_fn added,
+				 LIBMTP_pollfd_removed_cb_fn removed,
+				 void *user_data) {
+	/* Unsupported */
+}
+
+int LIBMTP_Get_Next_Timeout(struct timeval *tv) {
+	/* Unsupported */
+	return -12;
+}
+
+int LIBMTP_Handle_Ready_Events(void) {
+	/* Unsupported */
+	return -12;
+}
+
 uint16_t
 ptp_usb_control_cancel_request (PTPParams *params, uint32_t transactionid) {
 	PTP_USB *ptp_usb = (PTP_USB *)(params->data);
@@ -2102,10 +2141,47 @@ void get_usb_device_timeout(PTP_USB *ptp_usb, int *timeout)
   *timeout = ptp_usb->timeout;
 }
 
+int set_usb_device_pipelining(PTP_USB *ptp_usb, int depth,
+			      unsigned long chunk_size)
+{
+  /* Unsupported */
+  if (depth > 1)
+    return -1;
+  return 0;
+}
+
+int set_usb_device_tuning(PTP_USB *ptp_usb,
+			  LIBMTP_transfer_tuning_t const * const tuning)
+{
+  /* Only the timeouts can be tuned */
+  if (tuning == NULL) {
+    memset(&ptp_usb->tuning, 0, sizeof(ptp_usb->tuning));
+    return 0;
+  }
+  if (tuning->depth > 1 || tuning->timeout < 0)
+    return -1;
+  ptp_usb->tuning = *tuning;
+  ptp_usb->bytes_per_second = tuning->bytes_per_second;
+  if (tuning->timeout > 0)
+    ptp_usb->timeout = tuning->timeout;
+  return 0;
+}
+
+void get_usb_device_tuning(PTP_USB *ptp_usb, LIBMTP_transfer_tuning_t *tuning)
+{
+  memset(tuning, 0, sizeof(*tuning));
+  tuning->depth = 1;
+  tuning->timeout = ptp_usb->timeout;
+  tuning->bytes_per_second = guess_usb_speed(ptp_usb);
+}
+
 int guess_usb_speed(PTP_USB *ptp_usb)
 {
   int bytes_per_second;
 
+  if (ptp_usb->bytes_per_second > 0)
+    return ptp_usb->bytes_per_second;
+
   /*
    * We don't know the actual speeds so these are rough guesses
    * from the info you can find here:
@@ -76,6 +76,21 @@ extern "C" {
 #define USB_BULK_WRITE openusb_bulk_xfer
 #endif
 
+/**
+ * Number of idle transfer buffers kept around for reuse by each device.
+ */
+#define PTP_USB_BUFFER_POOL_SIZE 8
+
+/**
+ * A transfer buffer, possibly allocated as DMA-capable device memory.
+ */
+typedef struct _PTP_USB_Buffer PTP_USB_Buffer;
+struct _PTP_USB_Buffer {
+  unsigned char *data;
+  unsigned long size;
+  int devmem;
+};
+
 /**
  * Internal USB struct.
  */
@@ -107,6 +122,32 @@ struct _PTP_USB {
   uint64_t current_transfer_complete;
   LIBMTP_progressfunc_t current_transfer_callback;
   void const * current_transfer_callback_data;
+  /** Asynchronous bulk pipeline: transfers in flight, 0 or 1 = synchronous */
+  int async_depth;
+  /** Size of each asynchronous bulk transfer in bytes */
+  unsigned long async_chunk_size;
+  /** Negotiated link speed in Mbit/s, 0 if unknown */
+  uint32_t link_speed;
+  /** Packets per burst on the IN endpoint, 1 below SuperSpeed */
+  int inep_maxburst;
+  /** Sustained rate used to scale timeouts, 0 = guess from bcdUSB */
+  unsigned long bytes_per_second;
+  /** Tuning asked for by the application, 0 fields are automatic */
+  LIBMTP_transfer_tuning_t tuning;
+  /** A cancelled transfer still awaits the device to settle */
+  int cancel_pending;
+  /** Bulk read path picked for the device quirks when configured */
+  short (*read_func)(unsigned long size, PTPDataHandler *handler,
+		     void *data, unsigned long *readbytes, int readzero);
+  /** iRiver device wanting its reads split in alternating block sizes */
+  int quirk_iriver;
+  /** Idle transfer buffers available for reuse and pool counters */
+  PTP_USB_Buffer buffer_pool[PTP_USB_BUFFER_POOL_SIZE];
+  int buffer_pool_count;
+  unsigned long buffer_pool_hits;
+  unsigned long buffer_pool_misses;
+  /** Reached over PTP/IP rather than USB, see ptpip.c */
+  int ptpip;
   /** Any special device flags, only used internally */
   LIBMTP_raw_device_t rawdevice;
 };
@@ -119,6 +160,11 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
 					   void **usbinfo);
 void set_usb_device_timeout(PTP_USB *ptp_usb, int timeout);
 void get_usb_device_timeout(PTP_USB *ptp_usb, int *timeout);
+int set_usb_device_pipelining(PTP_USB *ptp_usb, int depth,
+			      unsigned long chunk_size);
+int set_usb_device_tuning(PTP_USB *ptp_usb,
+			  LIBMTP_transfer_tuning_t const * const tuning);
+void get_usb_device_tuning(PTP_USB *ptp_usb, LIBMTP_transfer_tuning_t *tuning);
 int guess_usb_speed(PTP_USB *ptp_usb);
 
 /* Flag check macros */
@@ -35,12 +35,22 @@
 #include "device-flags.h"
 #include "util.h"
 #include "ptp.h"
+#include "ptp-trace.h"
+#include "ptp-ring.h"
 
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#else
+#include <time.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "ptp-pack.c"
 
@@ -57,12 +67,21 @@
 #define USB_TIMEOUT_LONG        60000
 static inline int get_timeout(PTP_USB* ptp_usb)
 {
+  if (ptp_usb->tuning.timeout > 0) {
+    return ptp_usb->tuning.timeout;
+  }
   if (FLAG_LONG_TIMEOUT(ptp_usb)) {
     return USB_TIMEOUT_LONG;
   }
   return USB_TIMEOUT_DEFAULT;
 }
 
+/*
+ * Bus location of raw devices reached over PTP/IP. These are listed in
+ * LIBMTP_PTPIP_DEVICES and the device number is the position in that list.
+ */
+#define PTPIP_BUS_LOCATION 0xffffffffU
+
 /* USB Feature selector HALT */
 #ifndef USB_FEATURE_HALT
 #define USB_FEATURE_HALT	0x00
@@ -84,6 +103,10 @@ struct ptp_event_cb_data {
   PTPEventCbFn cb;
   void *user_data;
   PTPParams *params;
+  /* the outcome, kept until the callback can be called */
+  uint16_t code;
+  PTPContainer event;
+  struct ptp_event_cb_data *next;
 };
 
 /*mtp设备列表*/
@@ -94,8 +117,45 @@ static const LIBMTP_device_entry_t mtp_device_table[] = {
 static const int mtp_device_table_size =
   sizeof(mtp_device_table) / sizeof(LIBMTP_device_entry_t);
 
+/*
+ * The table is in the order people added devices to it, which makes it
+ * easy to maintain but slow to search. This index over it is sorted by
+ * VID/PID and built once, when libusb is initialized. Where the table
+ * lists the same VID/PID twice, the first entry wins as it always did.
+ */
+static int *mtp_device_index;
+
+/*
+ * Devices not in the table are probed for an MTP OS descriptor, which
+ * means opening them. The outcome is remembered per position on the
+ * bus and descriptor, so polling for devices does not open the same
+ * keyboards and hubs over and over. A device plugged in again gets a
+ * new address and is probed again.
+ */
+#define PROBE_CACHE_SIZE 64
+#define PROBE_CACHE_PORTS 7
+typedef struct {
+  uint8_t bus;
+  uint8_t address;
+  uint8_t nports;
+  uint8_t ports[PROBE_CACHE_PORTS];
+  uint16_t vendor_id;
+  uint16_t product_id;
+  uint16_t bcd_device;
+  int is_mtp;
+} probe_cache_entry_t;
+static probe_cache_entry_t probe_cache[PROBE_CACHE_SIZE];
+static int probe_cache_count;
+static int probe_cache_next;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t probe_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 // Local functions
 static LIBMTP_error_number_t init_usb();
+static const LIBMTP_device_entry_t *find_device_entry(uint16_t vendor_id,
+						      uint16_t product_id);
+static int probe_device_descriptor_cached(libusb_device *dev);
 static void close_usb(PTP_USB* ptp_usb);
 static int find_interface_and_endpoints(libusb_device *dev,
 					uint8_t *conf,
@@ -107,6 +167,7 @@ static int find_interface_and_endpoints(libusb_device *dev,
 					int* outep_maxpacket,
 					int* intep);
 static void clear_stall(PTP_USB* ptp_usb);
+static void probe_usb_link(PTP_USB *ptp_usb, libusb_device *ldevice);
 static int init_ptp_usb(PTPParams* params,
 		PTP_USB* ptp_usb, libusb_device* dev);
 static short ptp_write_func(unsigned long,
@@ -145,24 +206,119 @@ int LIBMTP_Get_Supported_Devices_List(LIBMTP_device_entry_t ** const devices,
 }
 
 
+static int compare_device_index(const void *a, const void *b)
+{
+  const LIBMTP_device_entry_t *ea = &mtp_device_table[*(const int *) a];
+  const LIBMTP_device_entry_t *eb = &mtp_device_table[*(const int *) b];
+
+  if (ea->vendor_id != eb->vendor_id)
+    return ea->vendor_id < eb->vendor_id ? -1 : 1;
+  if (ea->product_id != eb->product_id)
+    return ea->product_id < eb->product_id ? -1 : 1;
+  // Keep duplicates in table order
+  return *(const int *) a - *(const int *) b;
+}
+
+/**
+ * Builds the sorted index over mtp_device_table. If that fails for
+ * lack of memory find_device_entry() searches the table linearly.
+ */
+static void build_device_index(void)
+{
+  int i;
+
+  if (mtp_device_index != NULL)
+    return;
+  mtp_device_index = (int *) malloc(mtp_device_table_size * sizeof(int));
+  if (mtp_device_index == NULL)
+    return;
+  for (i = 0; i < mtp_device_table_size; i++)
+    mtp_device_index[i] = i;
+  qsort(mtp_device_index, mtp_device_table_size, sizeof(int),
+	compare_device_index);
+}
+
+/**
+ * Look up a device in the table of known devices.
+ * @param vendor_id the USB vendor ID.
+ * @param product_id the USB product ID.
+ * @return the first table entry for this device, or NULL if the
+ *         device is not in the table.
+ */
+static const LIBMTP_device_entry_t *find_device_entry(uint16_t vendor_id,
+						      uint16_t product_id)
+{
+  int lo = 0;
+  int hi = mtp_device_table_size;
+  int i;
+
+  if (mtp_device_index == NULL) {
+    for (i = 0; i < mtp_device_table_size; i++) {
+      if (mtp_device_table[i].vendor_id == vendor_id &&
+	  mtp_device_table[i].product_id == product_id)
+	return &mtp_device_table[i];
+    }
+    return NULL;
+  }
+  // Find the first entry not below vendor_id/product_id
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    const LIBMTP_device_entry_t *e = &mtp_device_table[mtp_device_index[mid]];
+
+    if (e->vendor_id < vendor_id ||
+	(e->vendor_id == vendor_id && e->product_id < product_id))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < mtp_device_table_size) {
+    const LIBMTP_device_entry_t *e = &mtp_device_table[mtp_device_index[lo]];
+
+    if (e->vendor_id == vendor_id && e->product_id == product_id)
+      return e;
+  }
+  return NULL;
+}
+
+/*
+ * The libusb context is shared by all devices, libusb itself is
+ * thread safe so only setting it up needs a lock.
+ */
 static LIBMTP_error_number_t init_usb()
 {
   static int libusb1_initialized = 0;
+#ifdef HAVE_PTHREAD_H
+  static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
   /*
    * Some additional libusb debugging please.
    * We use the same level debug between MTP and USB.
    */
-  if (libusb1_initialized)
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&init_lock);
+#endif
+  if (libusb1_initialized) {
 	  /*重复初始化*/
-     return LIBMTP_ERROR_NONE;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&init_lock);
+#endif
+    return LIBMTP_ERROR_NONE;
+  }
 
   if (libusb_init(&libmtp_libusb_context) < 0) {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&init_lock);
+#endif
     LIBMTP_ERROR("Libusb1 init failed\n");
     return LIBMTP_ERROR_USB_LAYER;
   }
 
+  build_device_index();
   libusb1_initialized = 1;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&init_lock);
+#endif
 
   if ((LIBMTP_debug & LIBMTP_DEBUG_USB) != 0)
     /*libusb_set_debug(libmtp_libusb_context,9);*/
@@ -510,6 +666,71 @@ static int probe_device_descriptor(libusb_device *dev, FILE *dumpfile)
   return 0;
 }
 
+/**
+ * Like probe_device_descriptor() without a dump file, but remembers the
+ * outcome for this device so it is only opened the first time.
+ * @param dev the device to probe.
+ * @return 1 if the device looks like an MTP device, else 0.
+ */
+static int probe_device_descriptor_cached(libusb_device *dev)
+{
+  struct libusb_device_descriptor desc;
+  probe_cache_entry_t key;
+  int i;
+  int ret = -1;
+
+  if (libusb_get_device_descriptor(dev, &desc) != LIBUSB_SUCCESS)
+    return 0;
+  memset(&key, 0, sizeof(key));
+  key.bus = libusb_get_bus_number(dev);
+  key.address = libusb_get_device_address(dev);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+  {
+    int n = libusb_get_port_numbers(dev, key.ports, PROBE_CACHE_PORTS);
+
+    key.nports = n > 0 ? n : 0;
+  }
+#endif
+  key.vendor_id = desc.idVendor;
+  key.product_id = desc.idProduct;
+  key.bcd_device = desc.bcdDevice;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&probe_cache_lock);
+#endif
+  for (i = 0; i < probe_cache_count; i++) {
+    probe_cache_entry_t *e = &probe_cache[i];
+
+    if (e->bus == key.bus && e->address == key.address &&
+	e->nports == key.nports &&
+	!memcmp(e->ports, key.ports, key.nports) &&
+	e->vendor_id == key.vendor_id && e->product_id == key.product_id &&
+	e->bcd_device == key.bcd_device) {
+      ret = e->is_mtp;
+      break;
+    }
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&probe_cache_lock);
+#endif
+  if (ret >= 0)
+    return ret;
+
+  key.is_mtp = probe_device_descriptor(dev, NULL);
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&probe_cache_lock);
+#endif
+  // When full, overwrite the oldest entry
+  probe_cache[probe_cache_next] = key;
+  probe_cache_next = (probe_cache_next + 1) % PROBE_CACHE_SIZE;
+  if (probe_cache_count < PROBE_CACHE_SIZE)
+    probe_cache_count++;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&probe_cache_lock);
+#endif
+  return key.is_mtp;
+}
+
 /**
  * This function scans through the connected usb devices on a machine and
  * if they match known Vendor and Product identifiers appends them to the
@@ -544,28 +765,19 @@ static LIBMTP_error_number_t get_mtp_usb_device_list(mtpdevice_list_t ** mtp_dev
       if (ret != LIBUSB_SUCCESS) continue;/*忽略掉没有拿到descript的设备*/
 
       if (desc.bDeviceClass != LIBUSB_CLASS_HUB) {
-	int i;
-        int found = 0;
-
 	// First check if we know about the device already.
 	// Devices well known to us will not have their descriptors
 	// probed, it caused problems with some devices.
-        for(i = 0; i < mtp_device_table_size; i++) {
-          if(desc.idVendor == mtp_device_table[i].vendor_id &&
-            desc.idProduct == mtp_device_table[i].product_id) {
-        	  /*vendor与product匹配，添加进mtp devcie中*/
-            /* Append this usb device to the MTP device list */
-            *mtp_device_list = append_to_mtpdevice_list(*mtp_device_list,
-							dev,
-							libusb_get_bus_number(dev));
-            found = 1;
-            break;
-          }
-        }
-	// If we didn't know it, try probing the "OS Descriptor".
-        if (!found) {
-        	/*在mtp_device_table中查询失败，在设备上进行检查*/
-          if (probe_device_descriptor(dev, NULL)) {
+        if (find_device_entry(desc.idVendor, desc.idProduct) != NULL) {
+          /*vendor与product匹配，添加进mtp devcie中*/
+          /* Append this usb device to the MTP device list */
+          *mtp_device_list = append_to_mtpdevice_list(*mtp_device_list,
+						      dev,
+						      libusb_get_bus_number(dev));
+        } else {
+	  // If we didn't know it, try probing the "OS Descriptor".
+          /*在mtp_device_table中查询失败，在设备上进行检查*/
+          if (probe_device_descriptor_cached(dev)) {
             /* Append this usb device to the MTP USB Device List */
             *mtp_device_list = append_to_mtpdevice_list(*mtp_device_list,
 							dev,
@@ -620,36 +832,129 @@ int LIBMTP_Check_Specific_Device(int busno, int devno)
 	continue;
     if (libusb_get_device_address(devs[i]) != devno)
 	continue;
-    if (probe_device_descriptor(devs[i], NULL))
+    if (probe_device_descriptor_cached(devs[i]))
 	return 1;
   }
   return 0;
 }
 
 /**
- * Detect the raw MTP device descriptors and return a list of
- * of the devices found.
- *
- * @param devices a pointer to a variable that will hold
- *        the list of raw devices found. This may be NULL
- *        on return if the number of detected devices is zero.
- *        The user shall simply <code>free()</code> this
- *        variable when finished with the raw devices,
- *        in order to release memory.
- * @param numdevs a pointer to an integer that will hold
- *        the number of devices in the list. This may
- *        be 0.
- * @return 0 if successful, any other value means failure.
+ * Presents the device a trace named by LIBMTP_REPLAY_TRACE was
+ * recorded from as the one device attached, see ptp-trace.c.
  */
-LIBMTP_error_number_t LIBMTP_Detect_Raw_Devices(LIBMTP_raw_device_t ** devices/*出参，返回所有mtp usb设备*/,
-			      int * numdevs)
+static LIBMTP_error_number_t detect_replay_device(LIBMTP_raw_device_t **devices,
+						  int *numdevs)
+{
+  LIBMTP_raw_device_t *retdev;
+  const LIBMTP_device_entry_t *entry;
+  PTPTraceDevice dev;
+
+  *devices = NULL;
+  *numdevs = 0;
+  if (ptp_trace_read_device(getenv("LIBMTP_REPLAY_TRACE"), &dev) < 0) {
+    LIBMTP_ERROR("LIBMTP PANIC: %s is not a readable trace file\n",
+		 getenv("LIBMTP_REPLAY_TRACE"));
+    return LIBMTP_ERROR_NO_DEVICE_ATTACHED;
+  }
+  retdev = (LIBMTP_raw_device_t *) malloc(sizeof(LIBMTP_raw_device_t));
+  if (retdev == NULL)
+    return LIBMTP_ERROR_MEMORY_ALLOCATION;
+  memset(retdev, 0, sizeof(LIBMTP_raw_device_t));
+  retdev->device_entry.vendor_id = dev.vendor_id;
+  retdev->device_entry.product_id = dev.product_id;
+  // The flags in effect while recording, whatever the table says now
+  retdev->device_entry.device_flags = dev.device_flags;
+  entry = find_device_entry(dev.vendor_id, dev.product_id);
+  if (entry != NULL) {
+    retdev->device_entry.vendor = entry->vendor;
+    retdev->device_entry.product = entry->product;
+  }
+  LIBMTP_INFO("Replaying a session with VID=%04x and PID=%04x from %s.\n",
+	      dev.vendor_id, dev.product_id, getenv("LIBMTP_REPLAY_TRACE"));
+  *devices = retdev;
+  *numdevs = 1;
+  return LIBMTP_ERROR_NONE;
+}
+
+/**
+ * Returns entry number index of LIBMTP_PTPIP_DEVICES, a list of
+ * addresses separated by commas or white space.
+ * @return a newly allocated address, or NULL if there is no such entry.
+ */
+static char *ptpip_address(int index)
+{
+  char const *list = getenv("LIBMTP_PTPIP_DEVICES");
+  static char const separators[] = ", \t\n";
+
+  if (list == NULL)
+    return NULL;
+  list += strspn(list, separators);
+  while (*list != '\0') {
+    size_t len = strcspn(list, separators);
+
+    if (index-- == 0) {
+      char *address = malloc(len + 1);
+
+      if (address != NULL) {
+	memcpy(address, list, len);
+	address[len] = '\0';
+      }
+      return address;
+    }
+    list += len;
+    list += strspn(list, separators);
+  }
+  return NULL;
+}
+
+/**
+ * Adds the devices listed in LIBMTP_PTPIP_DEVICES to the list of raw
+ * devices. They are told apart from USB devices by bus location
+ * PTPIP_BUS_LOCATION, and the device number is their position in the
+ * list. Nothing is connected to until the device is opened.
+ */
+static LIBMTP_error_number_t detect_ptpip_devices(LIBMTP_raw_device_t **devices,
+						  int *numdevs,
+						  LIBMTP_error_number_t usbret)
+{
+  LIBMTP_raw_device_t *retdevs;
+  char *address;
+  int n = 0;
+  int i;
+
+  while (n < 256 && (address = ptpip_address(n)) != NULL) {
+    free(address);
+    n++;
+  }
+  if (n == 0)
+    return usbret;
+  retdevs = (LIBMTP_raw_device_t *) realloc(*devices,
+					    sizeof(LIBMTP_raw_device_t) * (*numdevs + n));
+  if (retdevs == NULL)
+    return LIBMTP_ERROR_MEMORY_ALLOCATION;
+  for (i = 0; i < n; i++) {
+    LIBMTP_raw_device_t *retdev = &retdevs[*numdevs + i];
+
+    memset(retdev, 0, sizeof(LIBMTP_raw_device_t));
+    retdev->device_entry.vendor = "PTP/IP";
+    retdev->device_entry.product = "Network device";
+    retdev->bus_location = PTPIP_BUS_LOCATION;
+    retdev->devnum = i;
+  }
+  *devices = retdevs;
+  *numdevs += n;
+  return LIBMTP_ERROR_NONE;
+}
+
+static LIBMTP_error_number_t detect_usb_devices(LIBMTP_raw_device_t **devices,
+						int *numdevs)
 {
   mtpdevice_list_t *devlist = NULL;
   mtpdevice_list_t *dev;
   LIBMTP_error_number_t ret;
   LIBMTP_raw_device_t *retdevs;
   int devs = 0;
-  int i, j;
+  int i;
 
   /*取所有mtp use devices*/
   ret = get_mtp_usb_device_list(&devlist);
@@ -686,7 +991,7 @@ LIBMTP_error_number_t LIBMTP_Detect_Raw_Devices(LIBMTP_raw_device_t ** devices/*
   dev = devlist;
   i = 0;
   while (dev != NULL) {
-    int device_known = 0;
+    const LIBMTP_device_entry_t *entry;
     struct libusb_device_descriptor desc;
 
     libusb_get_device_descriptor (dev->device, &desc/*出参，设备描述信息*/);
@@ -697,25 +1002,20 @@ LIBMTP_error_number_t LIBMTP_Detect_Raw_Devices(LIBMTP_raw_device_t ** devices/*
     retdevs[i].device_entry.product_id = desc.idProduct;
     retdevs[i].device_entry.device_flags = 0x00000000U;
     // See if we can locate some additional vendor info and device flags
-    for(j = 0; j < mtp_device_table_size; j++) {
-      if(desc.idVendor == mtp_device_table[j].vendor_id &&
-	 desc.idProduct == mtp_device_table[j].product_id) {
-	device_known = 1;
-	retdevs[i].device_entry.vendor = mtp_device_table[j].vendor;/*设置vendor id*/
-	retdevs[i].device_entry.product = mtp_device_table[j].product;
-	retdevs[i].device_entry.device_flags = mtp_device_table[j].device_flags;
-
-	// This device is known to the developers
-	LIBMTP_INFO("Device %d (VID=%04x and PID=%04x) is a %s %s.\n",
-		i,
-		desc.idVendor,
-		desc.idProduct,
-		mtp_device_table[j].vendor,
-		mtp_device_table[j].product);
-	break;
-      }
-    }
-    if (!device_known) {
+    entry = find_device_entry(desc.idVendor, desc.idProduct);
+    if (entry != NULL) {
+      retdevs[i].device_entry.vendor = entry->vendor;/*设置vendor id*/
+      retdevs[i].device_entry.product = entry->product;
+      retdevs[i].device_entry.device_flags = entry->device_flags;
+
+      // This device is known to the developers
+      LIBMTP_INFO("Device %d (VID=%04x and PID=%04x) is a %s %s.\n",
+		  i,
+		  desc.idVendor,
+		  desc.idProduct,
+		  entry->vendor,
+		  entry->product);
+    } else {
       device_unknown(i, desc.idVendor, desc.idProduct);
     }
     // Save the location on the bus
@@ -731,124 +1031,1020 @@ LIBMTP_error_number_t LIBMTP_Detect_Raw_Devices(LIBMTP_raw_device_t ** devices/*
 }
 
 /**
- * This routine just dumps out low-level
- * USB information about the current device.
- * @param ptp_usb the USB device to get information from.
+ * Detect the raw MTP device descriptors and return a list of
+ * of the devices found.
+ *
+ * @param devices a pointer to a variable that will hold
+ *        the list of raw devices found. This may be NULL
+ *        on return if the number of detected devices is zero.
+ *        The user shall simply <code>free()</code> this
+ *        variable when finished with the raw devices,
+ *        in order to release memory.
+ * @param numdevs a pointer to an integer that will hold
+ *        the number of devices in the list. This may
+ *        be 0.
+ * @return 0 if successful, any other value means failure.
+ *
+ * The devices listed in <code>LIBMTP_PTPIP_DEVICES</code>, as
+ * <code>host</code> or <code>host:port</code> separated by commas,
+ * are reported as well, and are reached over PTP/IP when opened.
  */
-void dump_usbinfo(PTP_USB *ptp_usb)
+LIBMTP_error_number_t LIBMTP_Detect_Raw_Devices(LIBMTP_raw_device_t ** devices/*出参，返回所有mtp usb设备*/,
+			      int * numdevs)
 {
-  libusb_device *dev;
-  struct libusb_device_descriptor desc;
+  LIBMTP_error_number_t ret;
 
-  if (libusb_kernel_driver_active(ptp_usb->handle, ptp_usb->interface))
-    LIBMTP_INFO("   Interface has a kernel driver attached.\n");
+  if (getenv("LIBMTP_REPLAY_TRACE") != NULL)
+    return detect_replay_device(devices, numdevs);
+  ret = detect_usb_devices(devices, numdevs);
+  if (ret != LIBMTP_ERROR_NONE && ret != LIBMTP_ERROR_NO_DEVICE_ATTACHED)
+    return ret;
+  return detect_ptpip_devices(devices, numdevs, ret);
+}
 
-  dev = libusb_get_device (ptp_usb->handle);
-  libusb_get_device_descriptor (dev, &desc);
+/*
+ * Hotplug. libusb calls hotplug_callback() from within event handling,
+ * where it is not safe to open the device for probing, or to let the
+ * application open it. So the callback only queues the event, and
+ * LIBMTP_Handle_Events_Timeout_Completed() sorts out which devices are
+ * MTP devices and tells the application once libusb has returned.
+ * Like the rest of the event API this is meant to be driven from one
+ * thread.
+ */
+typedef struct hotplug_registration_struct {
+  int handle;
+  LIBMTP_hotplug_cb_fn cb; /* NULL once unregistered */
+  void *user_data;
+  int enumerate; /* wants to hear about devices already attached */
+  struct hotplug_registration_struct *next;
+} hotplug_registration_t;
+
+typedef struct hotplug_event_struct {
+  libusb_device *device; /* referenced while queued */
+  int attached;
+  int existing; /* found when we started listening */
+  struct hotplug_event_struct *next;
+} hotplug_event_t;
+
+/* MTP devices attached now, so a detach can say which one went */
+typedef struct hotplug_device_struct {
+  libusb_device *device; /* referenced while listed */
+  LIBMTP_raw_device_t rawdevice;
+  struct hotplug_device_struct *next;
+} hotplug_device_t;
+
+static hotplug_registration_t *hotplug_registrations;
+static hotplug_event_t *hotplug_queue;
+static hotplug_event_t **hotplug_queue_tail = &hotplug_queue;
+static hotplug_device_t *hotplug_devices;
+static libusb_hotplug_callback_handle hotplug_libusb_handle;
+static int hotplug_listening;
+static int hotplug_enumerating;
+static int hotplug_next_handle = 1;
+static int hotplug_dispatching;
+static int hotplug_stop_pending; /* unregistered while dispatching */
+#ifdef HAVE_PTHREAD_H
+/* hotplug_callback() runs on whichever thread handles USB events */
+static pthread_mutex_t hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-  LIBMTP_INFO("   bcdUSB: %d\n", desc.bcdUSB);
-  LIBMTP_INFO("   bDeviceClass: %d\n", desc.bDeviceClass);
-  LIBMTP_INFO("   bDeviceSubClass: %d\n", desc.bDeviceSubClass);
-  LIBMTP_INFO("   bDeviceProtocol: %d\n", desc.bDeviceProtocol);
-  LIBMTP_INFO("   idVendor: %04x\n", desc.idVendor);
-  LIBMTP_INFO("   idProduct: %04x\n", desc.idProduct);
-  LIBMTP_INFO("   IN endpoint maxpacket: %d bytes\n", ptp_usb->inep_maxpacket);
-  LIBMTP_INFO("   OUT endpoint maxpacket: %d bytes\n", ptp_usb->outep_maxpacket);
-  LIBMTP_INFO("   Raw device info:\n");
-  LIBMTP_INFO("      Bus location: %d\n", ptp_usb->rawdevice.bus_location);
-  LIBMTP_INFO("      Device number: %d\n", ptp_usb->rawdevice.devnum);
-  LIBMTP_INFO("      Device entry info:\n");
-  LIBMTP_INFO("         Vendor: %s\n", ptp_usb->rawdevice.device_entry.vendor);
-  LIBMTP_INFO("         Vendor id: 0x%04x\n", ptp_usb->rawdevice.device_entry.vendor_id);
-  LIBMTP_INFO("         Product: %s\n", ptp_usb->rawdevice.device_entry.product);
-  LIBMTP_INFO("         Vendor id: 0x%04x\n", ptp_usb->rawdevice.device_entry.product_id);
-  LIBMTP_INFO("         Device flags: 0x%08x\n", ptp_usb->rawdevice.device_entry.device_flags);
-  (void) probe_device_descriptor(dev, stdout);
+static void hotplug_queue_lock(void)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&hotplug_lock);
+#endif
 }
 
-/**
- * Retrieve the appropriate playlist extension for this
- * device. Rather hacky at the moment. This is probably
- * desired by the managing software, but when creating
- * lists on the device itself you notice certain preferences.
- * @param ptp_usb the USB device to get suggestion for.
- * @return the suggested playlist extension.
- */
-const char *get_playlist_extension(PTP_USB *ptp_usb)
+static void hotplug_queue_unlock(void)
 {
-  libusb_device *dev;
-  struct libusb_device_descriptor desc;
-  static char creative_pl_extension[] = ".zpl";
-  static char default_pl_extension[] = ".pla";
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&hotplug_lock);
+#endif
+}
 
-  dev = libusb_get_device(ptp_usb->handle);
-  libusb_get_device_descriptor (dev, &desc);
-  if (desc.idVendor == 0x041e)
-    return creative_pl_extension;
-  return default_pl_extension;
+/* Takes the oldest queued event, or NULL */
+static hotplug_event_t *hotplug_queue_pop(void)
+{
+  hotplug_event_t *e;
+
+  hotplug_queue_lock();
+  e = hotplug_queue;
+  if (e != NULL) {
+    hotplug_queue = e->next;
+    if (hotplug_queue == NULL)
+      hotplug_queue_tail = &hotplug_queue;
+  }
+  hotplug_queue_unlock();
+  return e;
 }
 
-static void
-libusb_glue_debug (PTPParams *params, const char *format, ...)
+static int LIBUSB_CALL hotplug_callback(libusb_context *ctx,
+					libusb_device *device,
+					libusb_hotplug_event event,
+					void *user_data)
 {
-        va_list args;
+  hotplug_event_t *e = (hotplug_event_t *) malloc(sizeof(hotplug_event_t));
 
-        va_start (args, format);
-        if (params->debug_func!=NULL)
-                params->debug_func (params->data, format, args);
-        else
-	{
-                vfprintf (stderr, format, args);
-		fprintf (stderr,"\n");
-		fflush (stderr);
-	}
-        va_end (args);
+  if (e == NULL)
+    return 0;
+  e->device = libusb_ref_device(device);
+  e->attached = (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+  e->existing = hotplug_enumerating;
+  e->next = NULL;
+  hotplug_queue_lock();
+  *hotplug_queue_tail = e;
+  hotplug_queue_tail = &e->next;
+  hotplug_queue_unlock();
+  return 0;
 }
 
-static void
-libusb_glue_error (PTPParams *params, const char *format, ...)
+static void hotplug_notify(LIBMTP_hotplug_event_t event,
+			   LIBMTP_raw_device_t *rawdevice,
+			   int existing)
 {
-        va_list args;
+  hotplug_registration_t *reg;
 
-        va_start (args, format);
-        if (params->error_func!=NULL)
-                params->error_func (params->data, format, args);
-        else
-	{
-                vfprintf (stderr, format, args);
-		fprintf (stderr,"\n");
-		fflush (stderr);
-	}
-        va_end (args);
+  for (reg = hotplug_registrations; reg != NULL; reg = reg->next) {
+    if (reg->cb == NULL)
+      continue;
+    if (existing && !reg->enumerate)
+      continue;
+    reg->cb(event, rawdevice, reg->user_data);
+  }
 }
 
+static void hotplug_prune_registrations(void)
+{
+  hotplug_registration_t **regp = &hotplug_registrations;
 
-/*
- * ptp_read_func() and ptp_write_func() are
- * based on same functions usb.c in libgphoto2.
- * Much reading packet logs and having fun with trials and errors
- * reveals that WMP / Windows is probably using an algorithm like this
- * for large transfers:
- *
- * 1. Send the command (0x0c bytes) if headers are split, else, send
- *    command plus sizeof(endpoint) - 0x0c bytes.
- * 2. Send first packet, max size to be sizeof(endpoint) but only when using
- *    split headers. Else goto 3.
- * 3. REPEAT send 0x10000 byte chunks UNTIL remaining bytes < 0x10000
- *    We call 0x10000 CONTEXT_BLOCK_SIZE.
- * 4. Send remaining bytes MOD sizeof(endpoint)
- * 5. Send remaining bytes. If this happens to be exactly sizeof(endpoint)
- *    then also send a zero-length package.
- *
- * Further there is some special quirks to handle zero reads from the
- * device, since some devices can't do them at all due to shortcomings
- * of the USB slave controller in the device.
- */
-#define CONTEXT_BLOCK_SIZE_1	0x3e00
+  while (*regp != NULL) {
+    hotplug_registration_t *reg = *regp;
+
+    if (reg->cb == NULL) {
+      *regp = reg->next;
+      free(reg);
+    } else {
+      regp = &reg->next;
+    }
+  }
+}
+
+static void hotplug_attach(libusb_device *device, int existing)
+{
+  struct libusb_device_descriptor desc;
+  const LIBMTP_device_entry_t *entry;
+  hotplug_device_t *hd;
+
+  for (hd = hotplug_devices; hd != NULL; hd = hd->next)
+    if (hd->device == device)
+      return;
+  if (libusb_get_device_descriptor(device, &desc) != LIBUSB_SUCCESS)
+    return;
+  if (desc.bDeviceClass == LIBUSB_CLASS_HUB)
+    return;
+  // The same tests as get_mtp_usb_device_list()
+  entry = find_device_entry(desc.idVendor, desc.idProduct);
+  if (entry == NULL && !probe_device_descriptor_cached(device))
+    return;
+
+  hd = (hotplug_device_t *) malloc(sizeof(hotplug_device_t));
+  if (hd == NULL)
+    return;
+  memset(hd, 0, sizeof(hotplug_device_t));
+  hd->device = libusb_ref_device(device);
+  hd->rawdevice.device_entry.vendor_id = desc.idVendor;
+  hd->rawdevice.device_entry.product_id = desc.idProduct;
+  if (entry != NULL) {
+    hd->rawdevice.device_entry.vendor = entry->vendor;
+    hd->rawdevice.device_entry.product = entry->product;
+    hd->rawdevice.device_entry.device_flags = entry->device_flags;
+  }
+  hd->rawdevice.bus_location = libusb_get_bus_number(device);
+  hd->rawdevice.devnum = libusb_get_device_address(device);
+  hd->next = hotplug_devices;
+  hotplug_devices = hd;
+  hotplug_notify(LIBMTP_HOTPLUG_ATTACHED, &hd->rawdevice, existing);
+}
+
+static void hotplug_detach(libusb_device *device)
+{
+  hotplug_device_t **hdp;
+
+  for (hdp = &hotplug_devices; *hdp != NULL; hdp = &(*hdp)->next) {
+    hotplug_device_t *hd = *hdp;
+
+    if (hd->device == device) {
+      *hdp = hd->next;
+      hotplug_notify(LIBMTP_HOTPLUG_DETACHED, &hd->rawdevice, 0);
+      libusb_unref_device(hd->device);
+      free(hd);
+      return;
+    }
+  }
+}
+
+static void hotplug_stop(void);
+
+/**
+ * Delivers the queued hotplug events, and tells registrations that
+ * asked for it about the devices that were already there. A callback
+ * dropping the last registration only marks the listener for
+ * stopping, the device list is freed once we are done walking it.
+ */
+static void hotplug_dispatch(void)
+{
+  hotplug_registration_t *reg;
+  hotplug_device_t *hd;
+  hotplug_event_t *e;
+
+  hotplug_queue_lock();
+  if (hotplug_dispatching) {
+    hotplug_queue_unlock();
+    return;
+  }
+  hotplug_dispatching = 1;
+  hotplug_queue_unlock();
+  for (reg = hotplug_registrations; reg != NULL; reg = reg->next) {
+    // Registered after we started listening, catch up
+    if (reg->cb != NULL && reg->enumerate > 1) {
+      reg->enumerate = 1;
+      for (hd = hotplug_devices; hd != NULL; hd = hd->next)
+	reg->cb(LIBMTP_HOTPLUG_ATTACHED, &hd->rawdevice, reg->user_data);
+    }
+  }
+  while (!hotplug_stop_pending && (e = hotplug_queue_pop()) != NULL) {
+    if (e->attached)
+      hotplug_attach(e->device, e->existing);
+    else
+      hotplug_detach(e->device);
+    libusb_unref_device(e->device);
+    free(e);
+  }
+  hotplug_prune_registrations();
+  if (hotplug_stop_pending) {
+    hotplug_stop_pending = 0;
+    // Unless a callback registered again after dropping the last one
+    if (hotplug_registrations == NULL && hotplug_listening)
+      hotplug_stop();
+  }
+  hotplug_queue_lock();
+  hotplug_dispatching = 0;
+  hotplug_queue_unlock();
+}
+
+static void hotplug_stop(void)
+{
+  hotplug_event_t *e;
+
+  libusb_hotplug_deregister_callback(libmtp_libusb_context,
+				     hotplug_libusb_handle);
+  hotplug_listening = 0;
+  while ((e = hotplug_queue_pop()) != NULL) {
+    libusb_unref_device(e->device);
+    free(e);
+  }
+  while (hotplug_devices != NULL) {
+    hotplug_device_t *hd = hotplug_devices;
+
+    hotplug_devices = hd->next;
+    libusb_unref_device(hd->device);
+    free(hd);
+  }
+}
+
+/**
+ * Get told when MTP devices are plugged in or removed, instead of
+ * polling LIBMTP_Detect_Raw_Devices(). The callback is called from
+ * LIBMTP_Handle_Events_Timeout_Completed(), so keep calling that. A
+ * device is reported attached if it would be detected by
+ * LIBMTP_Detect_Raw_Devices(), and it is safe to open it from the
+ * callback.
+ *
+ * @param flags LIBMTP_HOTPLUG_ENUMERATE to also get attach events for
+ *        the MTP devices already plugged in, 0 for new ones only.
+ * @param cb the callback.
+ * @param user_data passed on to the callback.
+ * @param handle returns a handle for LIBMTP_Unregister_Hotplug().
+ * @return LIBMTP_ERROR_NONE on success, LIBMTP_ERROR_USB_LAYER if
+ *         hotplug is not supported on this platform.
+ */
+LIBMTP_error_number_t LIBMTP_Register_Hotplug(int flags,
+					      LIBMTP_hotplug_cb_fn cb,
+					      void *user_data,
+					      int *handle)
+{
+  hotplug_registration_t *reg;
+  LIBMTP_error_number_t init_usb_ret;
+
+  init_usb_ret = init_usb();
+  if (init_usb_ret != LIBMTP_ERROR_NONE)
+    return init_usb_ret;
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    LIBMTP_ERROR("LIBMTP: hotplug is not supported by libusb on this platform\n");
+    return LIBMTP_ERROR_USB_LAYER;
+  }
+
+  reg = (hotplug_registration_t *) malloc(sizeof(hotplug_registration_t));
+  if (reg == NULL)
+    return LIBMTP_ERROR_MEMORY_ALLOCATION;
+  reg->handle = hotplug_next_handle++;
+  reg->cb = cb;
+  reg->user_data = user_data;
+  reg->enumerate = (flags & LIBMTP_HOTPLUG_ENUMERATE) ? 1 : 0;
+
+  if (!hotplug_listening) {
+    int ret;
+
+    /*
+     * Always enumerate, so we know which MTP devices are there when
+     * they are removed. Those go only to registrations that asked.
+     */
+    hotplug_enumerating = 1;
+    ret = libusb_hotplug_register_callback(libmtp_libusb_context,
+					   LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+					   LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					   LIBUSB_HOTPLUG_ENUMERATE,
+					   LIBUSB_HOTPLUG_MATCH_ANY,
+					   LIBUSB_HOTPLUG_MATCH_ANY,
+					   LIBUSB_HOTPLUG_MATCH_ANY,
+					   hotplug_callback, NULL,
+					   &hotplug_libusb_handle);
+    hotplug_enumerating = 0;
+    if (ret != LIBUSB_SUCCESS) {
+      LIBMTP_ERROR("LIBMTP: libusb_hotplug_register_callback() failed: %d\n",
+		   ret);
+      free(reg);
+      return LIBMTP_ERROR_USB_LAYER;
+    }
+    hotplug_listening = 1;
+  } else if (reg->enumerate) {
+    // Ours to tell about the devices we already know of
+    reg->enumerate = 2;
+  }
+  reg->next = hotplug_registrations;
+  hotplug_registrations = reg;
+  if (handle != NULL)
+    *handle = reg->handle;
+  return LIBMTP_ERROR_NONE;
+}
+
+/**
+ * Stop getting hotplug events. It is safe to call this from within
+ * the hotplug callback.
+ * @param handle the handle returned by LIBMTP_Register_Hotplug().
+ */
+void LIBMTP_Unregister_Hotplug(int handle)
+{
+  hotplug_registration_t *reg;
+  int active = 0;
+
+  for (reg = hotplug_registrations; reg != NULL; reg = reg->next) {
+    if (reg->handle == handle)
+      reg->cb = NULL;
+    else if (reg->cb != NULL)
+      active = 1;
+  }
+  if (hotplug_dispatching) {
+    // hotplug_dispatch() is walking the lists, it stops us when done
+    if (!active && hotplug_listening)
+      hotplug_stop_pending = 1;
+    return;
+  }
+  hotplug_prune_registrations();
+  if (!active && hotplug_listening)
+    hotplug_stop();
+}
+
+/**
+ * This routine just dumps out low-level
+ * USB information about the current device.
+ * @param ptp_usb the USB device to get information from.
+ */
+void dump_usbinfo(PTP_USB *ptp_usb)
+{
+  libusb_device *dev;
+  struct libusb_device_descriptor desc;
+
+  if (ptp_usb->ptpip) {
+    LIBMTP_INFO("   PTP/IP device: %s\n",
+		ptp_usb->params->cameraname ? ptp_usb->params->cameraname : "(unknown)");
+    return;
+  }
+  if (ptp_usb->handle == NULL) {
+    LIBMTP_INFO("   Replayed from %s\n", getenv("LIBMTP_REPLAY_TRACE"));
+    LIBMTP_INFO("   bcdUSB: %d\n", ptp_usb->bcdusb);
+    LIBMTP_INFO("   Vendor id: 0x%04x\n", ptp_usb->rawdevice.device_entry.vendor_id);
+    LIBMTP_INFO("   Product id: 0x%04x\n", ptp_usb->rawdevice.device_entry.product_id);
+    LIBMTP_INFO("   Device flags: 0x%08x\n", ptp_usb->rawdevice.device_entry.device_flags);
+    return;
+  }
+  if (libusb_kernel_driver_active(ptp_usb->handle, ptp_usb->interface))
+    LIBMTP_INFO("   Interface has a kernel driver attached.\n");
+
+  dev = libusb_get_device (ptp_usb->handle);
+  libusb_get_device_descriptor (dev, &desc);
+
+  LIBMTP_INFO("   bcdUSB: %d\n", desc.bcdUSB);
+  LIBMTP_INFO("   bDeviceClass: %d\n", desc.bDeviceClass);
+  LIBMTP_INFO("   bDeviceSubClass: %d\n", desc.bDeviceSubClass);
+  LIBMTP_INFO("   bDeviceProtocol: %d\n", desc.bDeviceProtocol);
+  LIBMTP_INFO("   idVendor: %04x\n", desc.idVendor);
+  LIBMTP_INFO("   idProduct: %04x\n", desc.idProduct);
+  LIBMTP_INFO("   IN endpoint maxpacket: %d bytes\n", ptp_usb->inep_maxpacket);
+  LIBMTP_INFO("   OUT endpoint maxpacket: %d bytes\n", ptp_usb->outep_maxpacket);
+  LIBMTP_INFO("   Transfer buffer pool: %lu hits, %lu misses\n",
+	      ptp_usb->buffer_pool_hits, ptp_usb->buffer_pool_misses);
+  LIBMTP_INFO("   Raw device info:\n");
+  LIBMTP_INFO("      Bus location: %d\n", ptp_usb->rawdevice.bus_location);
+  LIBMTP_INFO("      Device number: %d\n", ptp_usb->rawdevice.devnum);
+  LIBMTP_INFO("      Device entry info:\n");
+  LIBMTP_INFO("         Vendor: %s\n", ptp_usb->rawdevice.device_entry.vendor);
+  LIBMTP_INFO("         Vendor id: 0x%04x\n", ptp_usb->rawdevice.device_entry.vendor_id);
+  LIBMTP_INFO("         Product: %s\n", ptp_usb->rawdevice.device_entry.product);
+  LIBMTP_INFO("         Vendor id: 0x%04x\n", ptp_usb->rawdevice.device_entry.product_id);
+  LIBMTP_INFO("         Device flags: 0x%08x\n", ptp_usb->rawdevice.device_entry.device_flags);
+  (void) probe_device_descriptor(dev, stdout);
+}
+
+/**
+ * Retrieve the appropriate playlist extension for this
+ * device. Rather hacky at the moment. This is probably
+ * desired by the managing software, but when creating
+ * lists on the device itself you notice certain preferences.
+ * @param ptp_usb the USB device to get suggestion for.
+ * @return the suggested playlist extension.
+ */
+const char *get_playlist_extension(PTP_USB *ptp_usb)
+{
+  static char creative_pl_extension[] = ".zpl";
+  static char default_pl_extension[] = ".pla";
+
+  // The raw device has the vendor, also when replaying a trace
+  if (ptp_usb->rawdevice.device_entry.vendor_id == 0x041e)
+    return creative_pl_extension;
+  return default_pl_extension;
+}
+
+static void
+libusb_glue_debug (PTPParams *params, const char *format, ...)
+{
+        va_list args;
+
+        va_start (args, format);
+        if (params->debug_func!=NULL)
+                params->debug_func (params->data, format, args);
+        else
+	{
+                vfprintf (stderr, format, args);
+		fprintf (stderr,"\n");
+		fflush (stderr);
+	}
+        va_end (args);
+}
+
+static void
+libusb_glue_error (PTPParams *params, const char *format, ...)
+{
+        va_list args;
+
+        va_start (args, format);
+        if (params->error_func!=NULL)
+                params->error_func (params->data, format, args);
+        else
+	{
+                vfprintf (stderr, format, args);
+		fprintf (stderr,"\n");
+		fflush (stderr);
+	}
+        va_end (args);
+}
+
+
+/*
+ * ptp_read_func() and ptp_write_func() are
+ * based on same functions usb.c in libgphoto2.
+ * Much reading packet logs and having fun with trials and errors
+ * reveals that WMP / Windows is probably using an algorithm like this
+ * for large transfers:
+ *
+ * 1. Send the command (0x0c bytes) if headers are split, else, send
+ *    command plus sizeof(endpoint) - 0x0c bytes.
+ * 2. Send first packet, max size to be sizeof(endpoint) but only when using
+ *    split headers. Else goto 3.
+ * 3. REPEAT send 0x10000 byte chunks UNTIL remaining bytes < 0x10000
+ *    We call 0x10000 CONTEXT_BLOCK_SIZE.
+ * 4. Send remaining bytes MOD sizeof(endpoint)
+ * 5. Send remaining bytes. If this happens to be exactly sizeof(endpoint)
+ *    then also send a zero-length package.
+ *
+ * Further there is some special quirks to handle zero reads from the
+ * device, since some devices can't do them at all due to shortcomings
+ * of the USB slave controller in the device.
+ */
+#define CONTEXT_BLOCK_SIZE_1	0x3e00
 #define CONTEXT_BLOCK_SIZE_2  0x200
 #define CONTEXT_BLOCK_SIZE    CONTEXT_BLOCK_SIZE_1+CONTEXT_BLOCK_SIZE_2
+
+/*
+ * Transfer buffer pool. Buffers are handed out by ptp_usb_get_buffer()
+ * and given back with ptp_usb_put_buffer(), which keeps a few of them
+ * around so that consecutive transactions do not go through the
+ * allocator. Where libusb and the kernel support it the buffers are
+ * DMA-capable device memory, saving a copy in the kernel.
+ */
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define HAVE_LIBUSB_DEV_MEM 1
+#endif
+
+static void
+ptp_usb_free_buffer (PTP_USB *ptp_usb, PTP_USB_Buffer *buf)
+{
+#ifdef HAVE_LIBUSB_DEV_MEM
+  if (buf->devmem) {
+    libusb_dev_mem_free(ptp_usb->handle, buf->data, buf->size);
+    buf->data = NULL;
+    return;
+  }
+#endif
+  free(buf->data);
+  buf->data = NULL;
+}
+
+static int
+ptp_usb_get_buffer (PTP_USB *ptp_usb, unsigned long size, PTP_USB_Buffer *buf)
+{
+  int best = -1;
+  int i;
+
+  // Pick the smallest idle buffer which is large enough
+  for (i = 0; i < ptp_usb->buffer_pool_count; i++) {
+    if (ptp_usb->buffer_pool[i].size >= size &&
+	(best < 0 || ptp_usb->buffer_pool[i].size < ptp_usb->buffer_pool[best].size))
+      best = i;
+  }
+  if (best >= 0) {
+    *buf = ptp_usb->buffer_pool[best];
+    ptp_usb->buffer_pool[best] = ptp_usb->buffer_pool[--ptp_usb->buffer_pool_count];
+    ptp_usb->buffer_pool_hits++;
+    return 0;
+  }
+
+  ptp_usb->buffer_pool_misses++;
+  buf->size = size;
+  buf->devmem = 0;
+#ifdef HAVE_LIBUSB_DEV_MEM
+  buf->data = libusb_dev_mem_alloc(ptp_usb->handle, size);
+  if (buf->data != NULL) {
+    buf->devmem = 1;
+    return 0;
+  }
+#endif
+  buf->data = malloc(size);
+  if (buf->data == NULL)
+    return -1;
+  return 0;
+}
+
+static void
+ptp_usb_put_buffer (PTP_USB *ptp_usb, PTP_USB_Buffer *buf)
+{
+  if (buf->data == NULL)
+    return;
+  if (ptp_usb->buffer_pool_count < PTP_USB_BUFFER_POOL_SIZE) {
+    ptp_usb->buffer_pool[ptp_usb->buffer_pool_count++] = *buf;
+  } else {
+    int smallest = 0;
+    int i;
+
+    // Pool is full, keep the larger buffers
+    for (i = 1; i < PTP_USB_BUFFER_POOL_SIZE; i++) {
+      if (ptp_usb->buffer_pool[i].size < ptp_usb->buffer_pool[smallest].size)
+	smallest = i;
+    }
+    if (ptp_usb->buffer_pool[smallest].size < buf->size) {
+      ptp_usb_free_buffer(ptp_usb, &ptp_usb->buffer_pool[smallest]);
+      ptp_usb->buffer_pool[smallest] = *buf;
+    } else {
+      ptp_usb_free_buffer(ptp_usb, buf);
+    }
+  }
+  buf->data = NULL;
+}
+
+/* Release all idle buffers, must happen before the handle is closed */
+static void
+ptp_usb_drain_buffer_pool (PTP_USB *ptp_usb)
+{
+  while (ptp_usb->buffer_pool_count > 0)
+    ptp_usb_free_buffer(ptp_usb, &ptp_usb->buffer_pool[--ptp_usb->buffer_pool_count]);
+}
+
+/*
+ * Asynchronous bulk pipeline. Instead of doing one synchronous
+ * libusb_bulk_transfer() at a time, we keep up to ptp_usb->async_depth
+ * transfers queued on the endpoint so that the bus does not sit idle
+ * while a completed chunk is handed over to the data handler. Chunks
+ * are always consumed in the order they were submitted.
+ */
+#define PTP_ASYNC_MAX_DEPTH	32
+#define PTP_ASYNC_DEFAULT_CHUNK	0x20000
+
+struct ptp_async_xfer {
+  struct libusb_transfer *transfer;
+  PTP_USB_Buffer buf;
+  unsigned char *buffer;
+  int expect_terminator_byte;
+  int completed;
+};
+
+static void
+ptp_async_xfer_cb (struct libusb_transfer *t)
+{
+  struct ptp_async_xfer *x = (struct ptp_async_xfer *) t->user_data;
+
+  x->completed = 1;
+}
+
+/* Wait for one queued transfer, returns 0 if it completed */
+static int
+ptp_async_xfer_wait (struct ptp_async_xfer *x)
+{
+  while (!x->completed) {
+    int ret = libusb_handle_events_completed(libmtp_libusb_context,
+					     &x->completed);
+    if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Cancel the inflight transfers starting at head and wait until libusb
+ * has handed all of them back. Returns -1 if the event loop is dead,
+ * then libusb still owns the transfers and they must be leaked rather
+ * than freed.
+ */
+static int
+ptp_async_abort (struct ptp_async_xfer *xfers, int depth, int head, int inflight)
+{
+  int i;
+
+  for (i = 0; i < inflight; i++)
+    libusb_cancel_transfer(xfers[(head + i) % depth].transfer);
+  for (i = 0; i < inflight; i++)
+    if (ptp_async_xfer_wait(&xfers[(head + i) % depth]) < 0)
+      return -1;
+  return 0;
+}
+
+static void
+ptp_async_free_xfers (PTP_USB *ptp_usb, struct ptp_async_xfer *xfers, int depth)
+{
+  int i;
+
+  for (i = 0; i < depth; i++) {
+    if (xfers[i].transfer != NULL)
+      libusb_free_transfer(xfers[i].transfer);
+    ptp_usb_put_buffer(ptp_usb, &xfers[i].buf);
+  }
+  free(xfers);
+}
+
+static struct ptp_async_xfer *
+ptp_async_alloc_xfers (PTP_USB *ptp_usb, int depth, unsigned long bufsize)
+{
+  struct ptp_async_xfer *xfers;
+  int i;
+
+  xfers = calloc(depth, sizeof(struct ptp_async_xfer));
+  if (xfers == NULL)
+    return NULL;
+  for (i = 0; i < depth; i++) {
+    xfers[i].transfer = libusb_alloc_transfer(0);
+    if (xfers[i].transfer == NULL ||
+	ptp_usb_get_buffer(ptp_usb, bufsize, &xfers[i].buf) != 0) {
+      ptp_async_free_xfers(ptp_usb, xfers, depth);
+      return NULL;
+    }
+    xfers[i].buffer = xfers[i].buf.data;
+  }
+  return xfers;
+}
+
+/*
+ * Account for transferred bytes and call the progress callback.
+ * Returns non-zero if the user cancelled the transfer.
+ */
+static int
+ptp_usb_update_progress (PTP_USB *ptp_usb, unsigned long bytes)
+{
+  if (!ptp_usb->callback_active)
+    return 0;
+  ptp_usb->current_transfer_complete += bytes;
+  if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
+    // send last update and disable callback.
+    ptp_usb->current_transfer_complete = ptp_usb->current_transfer_total;
+    ptp_usb->callback_active = 0;
+  }
+  if (ptp_usb->current_transfer_callback != NULL)
+    return ptp_usb->current_transfer_callback(ptp_usb->current_transfer_complete,
+					      ptp_usb->current_transfer_total,
+					      ptp_usb->current_transfer_callback_data);
+  return 0;
+}
+
+/*
+ * Read in a zero-length packet terminating a transfer that ended on
+ * an endpoint boundary, unless the device is known not to send them.
+ */
+static void
+ptp_read_zero_packet (PTP_USB *ptp_usb, unsigned long curread)
+{
+  unsigned char temp;
+  int zeroresult = 0, xread;
+
+  if (FLAG_NO_ZERO_READS(ptp_usb) ||
+      curread % ptp_usb->inep_maxpacket != 0)
+    return;
+
+  LIBMTP_USB_DEBUG("<==USB IN\n");
+  LIBMTP_USB_DEBUG("Zero Read\n");
+
+  zeroresult = USB_BULK_READ(ptp_usb->handle,
+			     ptp_usb->inep,
+			     &temp,
+			     0,
+			     &xread,
+			     ptp_usb->timeout);
+  if (zeroresult != LIBUSB_SUCCESS)
+    LIBMTP_INFO("LIBMTP panic: unable to read in zero packet, response 0x%04x", zeroresult);
+}
+
+/*
+ * Pipelined version of ptp_read_func(), used for reads of a known
+ * size. The iRiver block size alternation and the extra terminating
+ * byte of DEVICE_FLAG_NO_ZERO_READS devices are applied to the queued
+ * chunks exactly like the synchronous code does.
+ */
 static short
-ptp_read_func (
+ptp_read_func_async (
+	unsigned long size, PTPDataHandler *handler, PTP_USB *ptp_usb,
+	unsigned long *readbytes
+) {
+  struct ptp_async_xfer *xfers;
+  int depth = ptp_usb->async_depth;
+  unsigned long chunk = ptp_usb->async_chunk_size;
+  unsigned long submitted = 0;
+  unsigned long curread = 0;
+  unsigned long toread = 0;
+  int head = 0;
+  int inflight = 0;
+  int stop = 0;
+  short ret = PTP_RC_OK;
+  int iriver = ptp_usb->quirk_iriver;
+  unsigned long context_block_size_1 = CONTEXT_BLOCK_SIZE_1;
+  unsigned long context_block_size_2 = CONTEXT_BLOCK_SIZE_2;
+
+  //"iRiver" device special handling
+  if (iriver && ptp_usb->inep_maxpacket == 0x400) {
+    context_block_size_1 = CONTEXT_BLOCK_SIZE_1 - 0x200;
+    context_block_size_2 = CONTEXT_BLOCK_SIZE_2 + 0x200;
+  }
+
+  // Room for the largest chunk plus a terminating byte
+  xfers = ptp_async_alloc_xfers(ptp_usb, depth, chunk + 1);
+  if (xfers == NULL)
+    return PTP_ERROR_IO;
+
+  while (1) {
+    struct ptp_async_xfer *x;
+    struct libusb_transfer *t;
+    unsigned long xread;
+
+    // Keep the pipeline full
+    while (!stop && inflight < depth && submitted < size) {
+      x = &xfers[(head + inflight) % depth];
+      x->expect_terminator_byte = 0;
+      x->completed = 0;
+
+      if (iriver && size - submitted >= CONTEXT_BLOCK_SIZE) {
+	if (submitted == 0 || toread == context_block_size_2)
+	  toread = context_block_size_1;
+	else
+	  toread = context_block_size_2;
+      } else if (size - submitted > chunk) {
+	toread = chunk;
+      } else {
+	// this is the last packet
+	toread = size - submitted;
+	// this is equivalent to zero read for these devices
+	if (FLAG_NO_ZERO_READS(ptp_usb) && (toread % ptp_usb->inep_maxpacket) == 0)
+	  x->expect_terminator_byte = 1;
+      }
+
+      LIBMTP_USB_DEBUG("Queueing read of 0x%04lx bytes\n", toread);
+
+      // Read straight into the destination if the handler allows
+      x->buffer = NULL;
+      if (handler && handler->getbuffunc)
+	x->buffer = handler->getbuffunc(NULL, handler->priv, submitted - curread,
+					toread + x->expect_terminator_byte);
+      if (x->buffer == NULL)
+	x->buffer = x->buf.data;
+
+      libusb_fill_bulk_transfer(x->transfer, ptp_usb->handle, ptp_usb->inep,
+				x->buffer, toread + x->expect_terminator_byte,
+				ptp_async_xfer_cb, x, ptp_usb->timeout);
+      if (libusb_submit_transfer(x->transfer) != LIBUSB_SUCCESS) {
+	ret = PTP_ERROR_IO;
+	stop = 1;
+	break;
+      }
+      submitted += toread;
+      inflight++;
+    }
+    if (inflight == 0)
+      break;
+
+    // Reap the oldest transfer, data must reach the handler in order
+    x = &xfers[head];
+    t = x->transfer;
+    if (ptp_async_xfer_wait(x) < 0) {
+      ret = PTP_ERROR_IO;
+      if (ptp_async_abort(xfers, depth, head, inflight) < 0) {
+	LIBMTP_ERROR("LIBMTP panic: USB event handling failed, leaking %d queued transfers\n", inflight);
+	xfers = NULL;
+      }
+      break;
+    }
+    head = (head + 1) % depth;
+    inflight--;
+
+    if (stop) {
+      /*
+       * Draining after a short read: anything that still arrived
+       * in a queued transfer is the response phase, buffer it the
+       * same way ptp_usb_getdata() buffers surplus packets.
+       */
+      if (ret == PTP_RC_OK && t->actual_length >= PTP_USB_BULK_HDR_LEN &&
+	  ptp_usb->params != NULL && ptp_usb->params->response_packet == NULL) {
+	ptp_usb->params->response_packet = malloc(t->actual_length);
+	if (ptp_usb->params->response_packet != NULL) {
+	  memcpy(ptp_usb->params->response_packet, t->buffer, t->actual_length);
+	  ptp_usb->params->response_packet_size = t->actual_length;
+	}
+      }
+      continue;
+    }
+
+    if (t->status == LIBUSB_TRANSFER_TIMED_OUT) {
+      ret = PTP_ERROR_TIMEOUT;
+    } else if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+      ret = PTP_ERROR_IO;
+    } else {
+      xread = t->actual_length;
+      LIBMTP_USB_DEBUG("<==USB IN\n");
+      if (xread == 0)
+	LIBMTP_USB_DEBUG("Zero Read\n");
+      else
+	LIBMTP_USB_DATA(t->buffer, xread, 16);
+      PTP_RING(ptp_usb->params, PTP_RING_READ, 0,
+	       ptp_usb->params->transaction_id - 1, 0, xread);
+
+      // want to discard extra byte
+      if (x->expect_terminator_byte && xread == t->length) {
+	LIBMTP_USB_DEBUG("<==USB IN\nDiscarding extra byte\n");
+	xread--;
+      }
+
+      if (handler &&
+	  handler->putfunc(NULL, handler->priv, xread, t->buffer) != PTP_RC_OK) {
+	LIBMTP_ERROR("LIBMTP error writing to fd or memory by handler."
+		     "Not enough memory or temp/destination free space?");
+	ret = PTP_ERROR_CANCEL;
+      } else {
+	curread += xread;
+	if (ptp_usb_update_progress(ptp_usb, xread)) {
+	  LIBMTP_USB_DEBUG("ptp_read_func cancelled by user callback\n");
+	  ret = PTP_ERROR_CANCEL;
+	}
+      }
+      /* short reads are common */
+      if (ret == PTP_RC_OK && t->actual_length == t->length)
+	continue;
+    }
+
+    // Error, cancellation or short read: stop and drain the pipeline
+    stop = 1;
+    {
+      int i;
+
+      for (i = 0; i < inflight; i++)
+	libusb_cancel_transfer(xfers[(head + i) % depth].transfer);
+    }
+  }
+
+  if (xfers != NULL)
+    ptp_async_free_xfers(ptp_usb, xfers, depth);
+  if (ret != PTP_RC_OK)
+    return ret;
+
+  if (readbytes)
+    *readbytes = curread;
+
+  // there might be a zero packet waiting for us...
+  ptp_read_zero_packet(ptp_usb, curread);
+
+  return PTP_RC_OK;
+}
+
+/*
+ * Read path for devices without read quirks, picked by
+ * select_usb_transport(): whole blocks, no terminating byte and no
+ * iRiver block size alternation.
+ */
+static short
+ptp_read_func_generic (
+	unsigned long size, PTPDataHandler *handler, void *data,
+	unsigned long *readbytes,
+	int readzero
+) {
+  PTP_USB *ptp_usb = (PTP_USB *)data;
+  unsigned long toread = 0;
+  unsigned long curread = 0;
+  unsigned char *dest;
+  PTP_USB_Buffer buf;
+  int ret;
+  int xread;
+
+  // Large reads of a known size go through the pipeline if enabled
+  if (readzero && ptp_usb->async_depth > 1 &&
+      size > ptp_usb->async_chunk_size)
+    return ptp_read_func_async(size, handler, ptp_usb, readbytes);
+
+  if (ptp_usb_get_buffer(ptp_usb, CONTEXT_BLOCK_SIZE, &buf) != 0)
+    return PTP_ERROR_IO;
+  while (curread < size) {
+    toread = size - curread;
+    if (toread > CONTEXT_BLOCK_SIZE)
+      toread = CONTEXT_BLOCK_SIZE;
+
+    // Read straight into the destination if the handler allows
+    dest = NULL;
+    if (handler && handler->getbuffunc)
+      dest = handler->getbuffunc(NULL, handler->priv, 0, toread);
+    if (dest == NULL)
+      dest = buf.data;
+
+    ret = USB_BULK_READ(ptp_usb->handle,
+                        ptp_usb->inep,
+                        dest,
+                        toread,
+                        &xread,
+                        ptp_usb->timeout);
+    LIBMTP_USB_DEBUG("Result of read: 0x%04x (%d bytes)\n", ret, xread);
+    if (ret != LIBUSB_SUCCESS) {
+      ptp_usb_put_buffer(ptp_usb, &buf);
+      return ret == LIBUSB_ERROR_TIMEOUT ? PTP_ERROR_TIMEOUT : PTP_ERROR_IO;
+    }
+    LIBMTP_USB_DATA(dest, xread, 16);
+    PTP_RING(ptp_usb->params, PTP_RING_READ, 0,
+	     ptp_usb->params->transaction_id - 1, 0, xread);
+
+    if (handler &&
+	handler->putfunc(NULL, handler->priv, xread, dest) != PTP_RC_OK) {
+      LIBMTP_ERROR("LIBMTP error writing to fd or memory by handler."
+		   "Not enough memory or temp/destination free space?");
+      ptp_usb_put_buffer(ptp_usb, &buf);
+      return PTP_ERROR_CANCEL;
+    }
+    curread += xread;
+    if (ptp_usb_update_progress(ptp_usb, xread)) {
+      LIBMTP_USB_DEBUG("ptp_read_func cancelled by user callback\n");
+      ptp_usb_put_buffer(ptp_usb, &buf);
+      return PTP_ERROR_CANCEL;
+    }
+    if (xread < toread) /* short reads are common */
+      break;
+  }
+
+  if (readbytes)
+    *readbytes = curread;
+  ptp_usb_put_buffer(ptp_usb, &buf);
+
+  // there might be a zero packet waiting for us...
+  if (readzero)
+    ptp_read_zero_packet(ptp_usb, curread);
+
+  return PTP_RC_OK;
+}
+
+/*
+ * Read path for DEVICE_FLAG_NO_ZERO_READS devices and the iRiver
+ * devices, which want their reads split in alternating block sizes.
+ */
+static short
+ptp_read_func_quirks (
 	unsigned long size, PTPDataHandler *handler,void *data,
 	unsigned long *readbytes,
 	int readzero
@@ -860,26 +2056,30 @@ ptp_read_func (
   int xread;
   unsigned long curread = 0;
   unsigned char *bytes;
+  unsigned char *dest;
+  PTP_USB_Buffer buf;
   int expect_terminator_byte = 0;
   unsigned long usb_inep_maxpacket_size;
-  unsigned long context_block_size_1;
-  unsigned long context_block_size_2;
-  uint16_t ptp_dev_vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
+  unsigned long context_block_size_1 = CONTEXT_BLOCK_SIZE_1;
+  unsigned long context_block_size_2 = CONTEXT_BLOCK_SIZE_2;
+
+  // Large reads of a known size go through the pipeline if enabled
+  if (readzero && ptp_usb->async_depth > 1 &&
+      size > ptp_usb->async_chunk_size)
+    return ptp_read_func_async(size, handler, ptp_usb, readbytes);
 
   //"iRiver" device special handling
-  if (ptp_dev_vendor_id == 0x4102 || ptp_dev_vendor_id == 0x1006) {
+  if (ptp_usb->quirk_iriver) {
 	  usb_inep_maxpacket_size = ptp_usb->inep_maxpacket;
 	  if (usb_inep_maxpacket_size == 0x400) {
 		  context_block_size_1 = CONTEXT_BLOCK_SIZE_1 - 0x200;
 		  context_block_size_2 = CONTEXT_BLOCK_SIZE_2 + 0x200;
 	  }
-	  else {
-		  context_block_size_1 = CONTEXT_BLOCK_SIZE_1;
-		  context_block_size_2 = CONTEXT_BLOCK_SIZE_2;
-	  }
   }
   // This is the largest block we'll need to read in.
-  bytes = malloc(CONTEXT_BLOCK_SIZE);
+  if (ptp_usb_get_buffer(ptp_usb, CONTEXT_BLOCK_SIZE, &buf) != 0)
+    return PTP_ERROR_IO;
+  bytes = buf.data;
   while (curread < size) {
     LIBMTP_USB_DEBUG("Remaining size to read: 0x%04lx bytes\n", size - curread);
 
@@ -894,7 +2094,7 @@ ptp_read_func (
         expect_terminator_byte = 1;
       }
     }
-    else if (ptp_dev_vendor_id == 0x4102 || ptp_dev_vendor_id == 0x1006) {
+    else if (ptp_usb->quirk_iriver) {
 	    //"iRiver" device special handling
 	    if (curread == 0)
 		    // we are first packet, but not last packet
@@ -912,9 +2112,16 @@ ptp_read_func (
 
     LIBMTP_USB_DEBUG("Reading in 0x%04lx bytes\n", toread);
 
+    // Read straight into the destination if the handler allows
+    dest = NULL;
+    if (handler && handler->getbuffunc)
+      dest = handler->getbuffunc(NULL, handler->priv, 0, toread);
+    if (dest == NULL)
+      dest = bytes;
+
     ret = USB_BULK_READ(ptp_usb->handle,
                         ptp_usb->inep,
-                        bytes,
+                        dest,
                         toread,
                         &xread,
                         ptp_usb->timeout);
@@ -922,9 +2129,11 @@ ptp_read_func (
     LIBMTP_USB_DEBUG("Result of read: 0x%04x (%d bytes)\n", ret, xread);
 
     if (ret == LIBUSB_ERROR_TIMEOUT) {
+      ptp_usb_put_buffer(ptp_usb, &buf);
       return PTP_ERROR_TIMEOUT;
     }
     else if (ret != LIBUSB_SUCCESS){
+      ptp_usb_put_buffer(ptp_usb, &buf);
       return PTP_ERROR_IO;
     }
 
@@ -932,7 +2141,9 @@ ptp_read_func (
     if (xread == 0)
       LIBMTP_USB_DEBUG("Zero Read\n");
     else
-      LIBMTP_USB_DATA(bytes, xread, 16);
+      LIBMTP_USB_DATA(dest, xread, 16);
+    PTP_RING(ptp_usb->params, PTP_RING_READ, 0,
+	     ptp_usb->params->transaction_id - 1, 0, xread);
 
     // want to discard extra byte
     if (expect_terminator_byte && xread == toread)
@@ -942,11 +2153,11 @@ ptp_read_func (
     }
 
     if (handler) {
-        handler_ret = handler->putfunc(NULL, handler->priv, xread, bytes);
+        handler_ret = handler->putfunc(NULL, handler->priv, xread, dest);
         if (handler_ret != PTP_RC_OK) {
             LIBMTP_ERROR("LIBMTP error writing to fd or memory by handler."
                          "Not enough memory or temp/destination free space?");
-            free (bytes);
+            ptp_usb_put_buffer(ptp_usb, &buf);
             return PTP_ERROR_CANCEL;
         }
     }
@@ -968,7 +2179,7 @@ ptp_read_func (
                                                  ptp_usb->current_transfer_callback_data);
         if (ret != 0) {
           LIBMTP_USB_DEBUG("ptp_read_func cancelled by user callback\n");
-          free (bytes);
+          ptp_usb_put_buffer(ptp_usb, &buf);
           return PTP_ERROR_CANCEL;
         }
       }
@@ -980,36 +2191,153 @@ ptp_read_func (
 
   if (readbytes)
     *readbytes = curread;
-  free (bytes);
+  ptp_usb_put_buffer(ptp_usb, &buf);
 
   // there might be a zero packet waiting for us...
-  if (readzero &&
-    !FLAG_NO_ZERO_READS(ptp_usb) &&
-    curread % ptp_usb->inep_maxpacket == 0) {
-    unsigned char temp;
-    int zeroresult = 0, xread;
+  if (readzero)
+    ptp_read_zero_packet(ptp_usb, curread);
 
-    LIBMTP_USB_DEBUG("<==USB IN\n");
-    LIBMTP_USB_DEBUG("Zero Read\n");
+  return PTP_RC_OK;
+}
+
+static short
+ptp_read_func (
+	unsigned long size, PTPDataHandler *handler, void *data,
+	unsigned long *readbytes,
+	int readzero
+) {
+  PTP_USB *ptp_usb = (PTP_USB *)data;
 
-    zeroresult = USB_BULK_READ(ptp_usb->handle,
-                               ptp_usb->inep,
-                               &temp,
-                               0,
-                               &xread,
-                               ptp_usb->timeout);
-    if (zeroresult != LIBUSB_SUCCESS)
-      LIBMTP_INFO("LIBMTP panic: unable to read in zero packet, response 0x%04x", zeroresult);
+  return ptp_usb->read_func(size, handler, data, readbytes, readzero);
+}
+
+/*
+ * Pick the bulk read path once for the quirks of a device, so that
+ * well-behaved devices never go through the quirk checks per block.
+ */
+static void
+select_usb_transport (PTP_USB *ptp_usb)
+{
+  uint16_t vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
+
+  ptp_usb->quirk_iriver = (vendor_id == 0x4102 || vendor_id == 0x1006);
+  if (ptp_usb->quirk_iriver || FLAG_NO_ZERO_READS(ptp_usb))
+    ptp_usb->read_func = ptp_read_func_quirks;
+  else
+    ptp_usb->read_func = ptp_read_func_generic;
+}
+
+/*
+ * Cancel timing, in milliseconds. The read timeout of the drain doubles
+ * as the backoff delay, so the first steps are short and the delay only
+ * grows while nothing comes in. The IN pipe counts as quiet once
+ * nothing came in for USB_CANCEL_QUIET, as devices pause between
+ * packets for longer than the first steps.
+ */
+#define USB_CANCEL_STEP_MIN	2
+#define USB_CANCEL_STEP_MAX	128
+#define USB_CANCEL_QUIET	300
+#define USB_CANCEL_BUDGET	500
+#define USB_CANCEL_FINISH_BUDGET 5000
+#define USB_CANCEL_DRAIN_SIZE	0x10000
+
+static unsigned long
+usb_now_ms (void)
+{
+#ifdef HAVE_SYS_TIME_H
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (unsigned long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#else
+  return (unsigned long) time(NULL) * 1000;
+#endif
+}
+
+/*
+ * Wait for the device to leave the busy state and read away whatever it
+ * still sends after a cancel. Returns 0 once the device is idle and the
+ * IN pipe has gone quiet, 1 if the budget ran out first.
+ */
+static int
+ptp_usb_cancel_settle (PTPParams* params, unsigned long budget)
+{
+  PTP_USB *ptp_usb = (PTP_USB *) params->data;
+  PTP_USB_Buffer buf;
+  unsigned long start = usb_now_ms();
+  unsigned long lastdata = start;
+  unsigned int step = USB_CANCEL_STEP_MIN;
+  int busy = 1;
+  int ret;
+
+  if (ptp_usb_get_buffer(ptp_usb, USB_CANCEL_DRAIN_SIZE, &buf) != 0)
+    return 1;
+
+  while (1) {
+    int xread = 0;
+
+    if (busy)
+      busy = (params->devstatreq_func(params) == PTP_RC_DeviceBusy);
+
+    ret = USB_BULK_READ(ptp_usb->handle,
+			ptp_usb->inep,
+			buf.data,
+			USB_CANCEL_DRAIN_SIZE,
+			&xread,
+			step);
+    if (ret == LIBUSB_SUCCESS || xread > 0) {
+      // Still sending, keep polling quickly
+      LIBMTP_USB_DEBUG("Discarded %d bytes after cancel\n", xread);
+      step = USB_CANCEL_STEP_MIN;
+      lastdata = usb_now_ms();
+    } else if (ret == LIBUSB_ERROR_TIMEOUT) {
+      if (!busy && usb_now_ms() - lastdata >= USB_CANCEL_QUIET)
+	break;
+      step *= 2;
+      if (step > USB_CANCEL_STEP_MAX)
+	step = USB_CANCEL_STEP_MAX;
+    } else {
+      // The pipe is stalled or gone, nothing more will come in
+      break;
+    }
+    if (usb_now_ms() - start >= budget) {
+      ptp_usb_put_buffer(ptp_usb, &buf);
+      return 1;
+    }
   }
+  ptp_usb_put_buffer(ptp_usb, &buf);
+  return 0;
+}
 
-  return PTP_RC_OK;
+/*
+ * Complete a cancel that was left for later by ptp_read_cancel_func(),
+ * called before the next request goes out.
+ */
+static void
+ptp_usb_cancel_finish (PTPParams* params)
+{
+  PTP_USB *ptp_usb = (PTP_USB *) params->data;
+  PTPContainer MyEvent;
+  int oldtimeout = 60000;
+
+  get_usb_device_timeout(ptp_usb, &oldtimeout);
+  set_usb_device_timeout(ptp_usb, 300);
+  if (ptp_usb_cancel_settle(params, USB_CANCEL_FINISH_BUDGET))
+    LIBMTP_INFO("Device is still busy after cancelling a transfer\n");
+  memset(&MyEvent,0,sizeof(MyEvent));
+  ptp_usb_event_check(params, &MyEvent);
+  set_usb_device_timeout(ptp_usb, oldtimeout);
+  ptp_usb->cancel_pending = 0;
 }
 
 /*
  * When cancelling a read from device.
  * The device can take time to really stop sending in data, so we have to
- * read and discard it.
- * Stop when we encounter a timeout (so no more data in after 300ms).
+ * read and discard it. In-flight asynchronous transfers have already been
+ * cancelled by ptp_read_func_async() at this point.
+ * The drain uses short, growing timeouts and gives up after
+ * USB_CANCEL_BUDGET ms so that the caller gets control back quickly; the
+ * rest of the cleanup is then done before the next request is sent.
  * Corner case: Lets imagine that the cancel will arrive just for the last bytes
  * of a file, and so that the transfer would still complete. The current code
  * will also discard the "reply status" frame. That makes sense because from
@@ -1022,9 +2350,7 @@ ptp_read_cancel_func (
     uint32_t transactionid
 ) {
   PTP_USB *ptp_usb = (PTP_USB *) params->data;
-  uint16_t ret = 0;
   PTPContainer MyEvent;
-  unsigned long xread = 0;
   int old_callback_active = ptp_usb->callback_active;
   int oldtimeout = 60000;
 
@@ -1037,35 +2363,180 @@ ptp_read_cancel_func (
 
   params->cancelreq_func(params, transactionid);
 
+  if (ptp_usb_cancel_settle(params, USB_CANCEL_BUDGET)) {
+    LIBMTP_USB_DEBUG("Deferring the end of the cancel to the next request\n");
+    ptp_usb->cancel_pending = 1;
+  } else {
+    // Probably a "transfert cancelled" event will be raised.
+    // We have to clear it or a device like the "GoPro" will not reply anymore after
+    memset(&MyEvent,0,sizeof(MyEvent));
+    ptp_usb_event_check(params, &MyEvent);
+  }
 
-  ret = params->devstatreq_func(params);
-  while (ret == PTP_RC_DeviceBusy) {
-    usleep(200000);
-    ret = params->devstatreq_func(params);
+  /* Restore previous values */
+  ptp_usb->callback_active = old_callback_active;
+  set_usb_device_timeout(ptp_usb, oldtimeout);
+
+
+  return PTP_ERROR_CANCEL;
+}
+
+/*
+ * If this is the last transfer, send a zero write if the last block
+ * ended on a packet boundary.
+ */
+static short
+ptp_write_zero_packet (PTP_USB *ptp_usb, unsigned long lastwrite)
+{
+  int ret = LIBUSB_SUCCESS;
+
+  if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
+    if ((lastwrite % ptp_usb->outep_maxpacket) == 0) {
+      int xwritten;
+
+      LIBMTP_USB_DEBUG("USB OUT==>\n");
+      LIBMTP_USB_DEBUG("Zero Write\n");
+
+      ret =USB_BULK_WRITE(ptp_usb->handle,
+			    ptp_usb->outep,
+			    (unsigned char *) "x",
+			    0,
+                            &xwritten,
+			    ptp_usb->timeout);
+    }
   }
 
+  if (ret != LIBUSB_SUCCESS)
+    return PTP_ERROR_IO;
+  return PTP_RC_OK;
+}
+
+/*
+ * Pipelined version of ptp_write_func(): while earlier blocks are
+ * still on the wire, the next one is fetched from the data handler
+ * into a free buffer and queued behind them.
+ */
+static short
+ptp_write_func_async (
+	unsigned long size, PTPDataHandler *handler, PTP_USB *ptp_usb,
+	unsigned long *written
+) {
+  struct ptp_async_xfer *xfers;
+  int depth = ptp_usb->async_depth;
+  unsigned long chunk = ptp_usb->async_chunk_size;
+  unsigned long queued = 0;
+  unsigned long curwrite = 0;
+  unsigned long towrite = 0;
+  unsigned long lastwrite = 0;
+  int head = 0;
+  int inflight = 0;
+  int stop = 0;
+  int eof = 0;
+  short ret = PTP_RC_OK;
+
+  xfers = ptp_async_alloc_xfers(ptp_usb, depth, chunk);
+  if (xfers == NULL)
+    return PTP_ERROR_IO;
+
   while (1) {
-    ret = ptp_read_func(ptp_usb->inep_maxpacket,
-                        NULL,
-                        params->data,
-                        &xread,
-                        0);
+    struct ptp_async_xfer *x;
+    struct libusb_transfer *t;
+
+    // Fill and queue free buffers
+    while (!stop && !eof && inflight < depth && queued < size) {
+      uint16_t getfunc_ret;
+
+      x = &xfers[(head + inflight) % depth];
+      x->completed = 0;
+
+      towrite = size - queued;
+      if (towrite > chunk) {
+	towrite = chunk;
+      } else {
+	// This magic makes packets the same size that WMP send them.
+	if (towrite > ptp_usb->outep_maxpacket && towrite % ptp_usb->outep_maxpacket != 0) {
+	  towrite -= towrite % ptp_usb->outep_maxpacket;
+	}
+      }
+      getfunc_ret = handler->getfunc(NULL, handler->priv, towrite, x->buffer, &towrite);
+      if (getfunc_ret != PTP_RC_OK) {
+	ret = getfunc_ret;
+	stop = 1;
+	break;
+      }
+      if (towrite == 0) {
+	eof = 1;
+	break;
+      }
 
-    if (ret != PTP_RC_OK)
+      libusb_fill_bulk_transfer(x->transfer, ptp_usb->handle, ptp_usb->outep,
+				x->buffer, towrite,
+				ptp_async_xfer_cb, x, ptp_usb->timeout);
+      if (libusb_submit_transfer(x->transfer) != LIBUSB_SUCCESS) {
+	ret = PTP_ERROR_IO;
+	stop = 1;
+	break;
+      }
+      queued += towrite;
+      lastwrite = towrite;
+      inflight++;
+    }
+    if (inflight == 0)
       break;
-  }
 
-  // Probably a "transfert cancelled" event will be raised.
-  // We have to clear it or a device like the "GoPro" will not reply anymore after
-  memset(&MyEvent,0,sizeof(MyEvent));
-  ptp_usb_event_check(params, &MyEvent);
+    x = &xfers[head];
+    t = x->transfer;
+    if (ptp_async_xfer_wait(x) < 0) {
+      ret = PTP_ERROR_IO;
+      if (ptp_async_abort(xfers, depth, head, inflight) < 0) {
+	LIBMTP_ERROR("LIBMTP panic: USB event handling failed, leaking %d queued transfers\n", inflight);
+	xfers = NULL;
+      }
+      break;
+    }
+    head = (head + 1) % depth;
+    inflight--;
+    if (stop)
+      continue;
 
-  /* Restore previous values */
-  ptp_usb->callback_active = old_callback_active;
-  set_usb_device_timeout(ptp_usb, oldtimeout);
+    LIBMTP_USB_DEBUG("USB OUT==>\n");
+    if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+      ret = PTP_ERROR_IO;
+    } else {
+      LIBMTP_USB_DATA(t->buffer, t->actual_length, 16);
+      PTP_RING(ptp_usb->params, PTP_RING_WRITE, 0,
+	       ptp_usb->params->transaction_id - 1, 0, t->actual_length);
+      // Increase counters
+      ptp_usb->current_transfer_complete += t->actual_length;
+      curwrite += t->actual_length;
+      if (ptp_usb_update_progress(ptp_usb, 0))
+	ret = PTP_ERROR_CANCEL;
+      else if (t->actual_length < t->length)
+	// Later blocks are already queued, a hole cannot be refilled
+	ret = PTP_ERROR_IO;
+      else
+	continue;
+    }
+
+    // Error or cancellation: stop and drain the pipeline
+    stop = 1;
+    {
+      int i;
 
+      for (i = 0; i < inflight; i++)
+	libusb_cancel_transfer(xfers[(head + i) % depth].transfer);
+    }
+  }
 
-  return PTP_ERROR_CANCEL;
+  if (xfers != NULL)
+    ptp_async_free_xfers(ptp_usb, xfers, depth);
+  if (ret != PTP_RC_OK)
+    return ret;
+  if (written) {
+    *written = curwrite;
+  }
+
+  return ptp_write_zero_packet(ptp_usb, lastwrite);
 }
 
 static short
@@ -1080,12 +2551,17 @@ ptp_write_func (
   int ret = 0;
   unsigned long curwrite = 0;
   unsigned char *bytes;
+  PTP_USB_Buffer buf;
+
+  // Large writes go through the pipeline if enabled
+  if (ptp_usb->async_depth > 1 && size > ptp_usb->async_chunk_size)
+    return ptp_write_func_async(size, handler, ptp_usb, written);
 
   // This is the largest block we'll need to read in.
-  bytes = malloc(CONTEXT_BLOCK_SIZE);
-  if (!bytes) {
+  if (ptp_usb_get_buffer(ptp_usb, CONTEXT_BLOCK_SIZE, &buf) != 0) {
     return PTP_ERROR_IO;
   }
+  bytes = buf.data;
   while (curwrite < size) {
     unsigned long usbwritten = 0;
     int xwritten = 0;
@@ -1101,7 +2577,7 @@ ptp_write_func (
     }
     int getfunc_ret = handler->getfunc(NULL, handler->priv,towrite,bytes,&towrite);
     if (getfunc_ret != PTP_RC_OK) {
-      free(bytes);
+      ptp_usb_put_buffer(ptp_usb, &buf);
       return getfunc_ret;
     }
     while (usbwritten < towrite) {
@@ -1115,10 +2591,12 @@ ptp_write_func (
 	    LIBMTP_USB_DEBUG("USB OUT==>\n");
 
 	    if (ret != LIBUSB_SUCCESS) {
-              free(bytes);
+              ptp_usb_put_buffer(ptp_usb, &buf);
 	      return PTP_ERROR_IO;
 	    }
 	    LIBMTP_USB_DATA(bytes+usbwritten, xwritten, 16);
+	    PTP_RING(ptp_usb->params, PTP_RING_WRITE, 0,
+		     ptp_usb->params->transaction_id - 1, 0, xwritten);
 	    // check for result == 0 perhaps too.
 	    // Increase counters
 	    ptp_usb->current_transfer_complete += xwritten;
@@ -1138,7 +2616,7 @@ ptp_write_func (
 						 ptp_usb->current_transfer_total,
 						 ptp_usb->current_transfer_callback_data);
 	if (ret != 0) {
-          free(bytes);
+          ptp_usb_put_buffer(ptp_usb, &buf);
 	  return PTP_ERROR_CANCEL;
 	}
       }
@@ -1146,37 +2624,22 @@ ptp_write_func (
     if (xwritten < towrite) /* short writes happen */
       break;
   }
-  free (bytes);
+  ptp_usb_put_buffer(ptp_usb, &buf);
   if (written) {
     *written = curwrite;
   }
 
   // If this is the last transfer send a zero write if required
-  if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
-    if ((towrite % ptp_usb->outep_maxpacket) == 0) {
-      int xwritten;
-
-      LIBMTP_USB_DEBUG("USB OUT==>\n");
-      LIBMTP_USB_DEBUG("Zero Write\n");
-
-      ret =USB_BULK_WRITE(ptp_usb->handle,
-			    ptp_usb->outep,
-			    (unsigned char *) "x",
-			    0,
-                            &xwritten,
-			    ptp_usb->timeout);
-    }
-  }
-
-  if (ret != LIBUSB_SUCCESS)
-    return PTP_ERROR_IO;
-  return PTP_RC_OK;
+  return ptp_write_zero_packet(ptp_usb, towrite);
 }
 
 /* memory data get/put handler */
 typedef struct {
 	unsigned char	*data;
 	unsigned long	size, curoff;
+	/* receive buffers come from the device buffer pool */
+	PTP_USB		*ptp_usb;
+	PTP_USB_Buffer	buf;
 } PTPMemHandlerPrivate;
 
 static uint16_t
@@ -1202,24 +2665,45 @@ memory_putfunc(PTPParams* params, void* private,
 	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)private;
 
 	if (priv->curoff + sendlen > priv->size) {
-		priv->data = realloc (priv->data, priv->curoff+sendlen);
-		priv->size = priv->curoff + sendlen;
+		PTP_USB_Buffer newbuf;
+		unsigned long newsize = priv->size * 2;
+
+		/* grow geometrically to avoid a reallocation per chunk */
+		if (newsize < priv->curoff + sendlen)
+			newsize = priv->curoff + sendlen;
+		if (ptp_usb_get_buffer(priv->ptp_usb, newsize, &newbuf) != 0)
+			return PTP_RC_GeneralError;
+		memcpy (newbuf.data, priv->data, priv->curoff);
+		ptp_usb_put_buffer(priv->ptp_usb, &priv->buf);
+		priv->buf = newbuf;
+		priv->data = newbuf.data;
+		priv->size = newbuf.size;
 	}
 	memcpy (priv->data + priv->curoff, data, sendlen);
 	priv->curoff += sendlen;
 	return PTP_RC_OK;
 }
 
-/* init private struct for receiving data. */
+/* init private struct for receiving data, expecting about len bytes. */
 static uint16_t
-ptp_init_recv_memory_handler(PTPDataHandler *handler) {
+ptp_init_recv_memory_handler(PTPDataHandler *handler,
+	PTP_USB *ptp_usb, unsigned long len
+) {
 	PTPMemHandlerPrivate* priv;
 	priv = malloc (sizeof(PTPMemHandlerPrivate));
+	if (!priv)
+		return PTP_RC_GeneralError;
+	if (ptp_usb_get_buffer(ptp_usb, len, &priv->buf) != 0) {
+		free (priv);
+		return PTP_RC_GeneralError;
+	}
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
-	priv->data = NULL;
-	priv->size = 0;
+	handler->getbuffunc = NULL;
+	priv->ptp_usb = ptp_usb;
+	priv->data = priv->buf.data;
+	priv->size = priv->buf.size;
 	priv->curoff = 0;
 	return PTP_RC_OK;
 }
@@ -1238,6 +2722,9 @@ ptp_init_send_memory_handler(PTPDataHandler *handler,
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->getbuffunc = NULL;
+	priv->ptp_usb = NULL;
+	priv->buf.data = NULL;
 	priv->data = data;
 	priv->size = len;
 	priv->curoff = 0;
@@ -1253,14 +2740,15 @@ ptp_exit_send_memory_handler (PTPDataHandler *handler) {
 	return PTP_RC_OK;
 }
 
-/* hand over our internal data to caller */
+/* copy the received data to caller and recycle our buffer */
 static uint16_t
 ptp_exit_recv_memory_handler (PTPDataHandler *handler,
-	unsigned char **data, unsigned long *size
+	unsigned char *data, unsigned long *size
 ) {
 	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)handler->priv;
-	*data = priv->data;
-	*size = priv->size;
+	memcpy (data, priv->data, priv->curoff);
+	*size = priv->curoff;
+	ptp_usb_put_buffer(priv->ptp_usb, &priv->buf);
 	free (priv);
 	return PTP_RC_OK;
 }
@@ -1275,9 +2763,13 @@ ptp_usb_sendreq (PTPParams* params, PTPContainer* req, int dataphase)
 	PTPDataHandler	memhandler;
 	unsigned long written = 0;
 	unsigned long towrite;
+	PTP_USB *ptp_usb = (PTP_USB *) params->data;
 
         LIBMTP_USB_DEBUG("REQUEST: 0x%04x, %s\n", req->Code, ptp_get_opcode_name(params, req->Code));
 
+	if (ptp_usb->cancel_pending)
+		ptp_usb_cancel_finish (params);
+
 	/* build appropriate USB container */
 	usbreq.length=htod32(PTP_USB_BULK_REQ_LEN-
 		(sizeof(uint32_t)*(5-req->Nparam)));
@@ -1393,7 +2885,6 @@ static uint16_t ptp_usb_getpacket(PTPParams *params,
 {
 	PTPDataHandler	memhandler;
 	uint16_t	ret;
-	unsigned char	*x = NULL;
 	unsigned long packet_size;
 	PTP_USB *ptp_usb = (PTP_USB *) params->data;
 
@@ -1410,13 +2901,11 @@ static uint16_t ptp_usb_getpacket(PTPParams *params,
 		/* Here this signifies a "virtual read" */
 		return PTP_RC_OK;
 	}
-	ptp_init_recv_memory_handler (&memhandler);
+	ret = ptp_init_recv_memory_handler (&memhandler, ptp_usb, packet_size);
+	if (ret != PTP_RC_OK)
+		return PTP_ERROR_IO;
 	ret = ptp_read_func(packet_size, &memhandler, params->data, rlen, 0);
-	ptp_exit_recv_memory_handler (&memhandler, &x, rlen);
-	if (x) {
-		memcpy (packet, x, *rlen);
-		free (x);
-	}
+	ptp_exit_recv_memory_handler (&memhandler, (unsigned char *) packet, rlen);
 	return ret;
 }
 
@@ -1439,10 +2928,16 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 			ret = PTP_ERROR_IO;
 			break;
 		}
+		ptp_stats_first_byte(params);
 		if (dtoh16(usbdata.type)!=PTP_USB_CONTAINER_DATA) {
 			ret = PTP_ERROR_DATA_EXPECTED;
 			break;
 		}
+		/* Streams of unknown length are counted as they come in */
+		if (dtoh32(usbdata.length) == 0xffffffffU)
+			ptp_stats_bytes_in(params, rlen - PTP_USB_BULK_HDR_LEN);
+		else if (dtoh32(usbdata.length) >= PTP_USB_BULK_HDR_LEN)
+			ptp_stats_bytes_in(params, dtoh32(usbdata.length) - PTP_USB_BULK_HDR_LEN);
 		if (dtoh16(usbdata.code)!=ptp->Code) {
 			if (FLAG_IGNORE_HEADER_ERRORS(ptp_usb)) {
 				libusb_glue_debug (params, "ptp2/ptp_usb_getdata: detected a broken "
@@ -1479,6 +2974,25 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 		if (rlen == usbdata.length)
 			return PTP_RC_OK;
 
+		/*
+		 * If the total length is known, read the rest in one go so
+		 * that it can be pipelined.
+		 */
+		if (ptp_usb->async_depth > 1 &&
+		    dtoh32(usbdata.length) != 0xffffffffU &&
+		    dtoh32(usbdata.length) > rlen) {
+		    unsigned long readdata;
+
+		    ret = ptp_read_func(dtoh32(usbdata.length) - rlen,
+					handler,
+					params->data,
+					&readdata,
+					1);
+		    if (ret == PTP_ERROR_CANCEL)
+			return ptp_read_cancel_func(params, ptp->Transaction_ID);
+		    return ret;
+		}
+
 		  /* stuff data directly to passed data handler */
 		  while (1) {
 		    unsigned long readdata;
@@ -1493,6 +3007,8 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 				return ptp_read_cancel_func(params, ptp->Transaction_ID);
 			if (ret != PTP_RC_OK)
 				return ret;
+			if (dtoh32(usbdata.length) == 0xffffffffU)
+				ptp_stats_bytes_in(params, readdata);
 			if (readdata < 0x20000000)
 				break;
 		  }
@@ -1626,6 +3142,7 @@ ptp_usb_getresp (PTPParams* params, PTPContainer* resp)
 	  libusb_glue_debug (params, "ptp_usb_getresp: detected short response "
 		     "of %d bytes, expect problems! (re-reading "
 		     "response), rlen");
+	  ptp_stats_retry(params);
 	  ret = ptp_usb_getpacket(params, &usbresp, &rlen);
 	}
 
@@ -1746,19 +3263,55 @@ ptp_usb_event (PTPParams* params, PTPContainer* event, int wait)
 	event->Param1=dtoh32(usbevent.param1);
 	event->Param2=dtoh32(usbevent.param2);
 	event->Param3=dtoh32(usbevent.param3);
+	PTP_RING(params, PTP_RING_EVENT, event->Code, event->Transaction_ID,
+		 event->Param1, 3);
 	return ret;
 }
 
 uint16_t
 ptp_usb_event_check (PTPParams* params, PTPContainer* event) {
 
-	return ptp_usb_event (params, event, PTP_EVENT_CHECK_FAST);
+	if (((PTP_USB *) params->data)->ptpip)
+		return ptp_ptpip_event_check (params, event);
+	if (ptp_trace_replaying (params))
+		return ptp_trace_replay_event (params, event);
+	return ptp_trace_record_event (params, event,
+		ptp_usb_event (params, event, PTP_EVENT_CHECK_FAST));
 }
 
 uint16_t
 ptp_usb_event_wait (PTPParams* params, PTPContainer* event) {
 
-	return ptp_usb_event (params, event, PTP_EVENT_CHECK);
+	if (((PTP_USB *) params->data)->ptpip)
+		return ptp_ptpip_event_wait (params, event);
+	if (ptp_trace_replaying (params))
+		return ptp_trace_replay_event (params, event);
+	return ptp_trace_record_event (params, event,
+		ptp_usb_event (params, event, PTP_EVENT_CHECK));
+}
+
+/*
+ * Event reads completed while libusb handled events, which may have been
+ * for a synchronous transfer, waiting for their callbacks to be called.
+ */
+static struct ptp_event_cb_data *event_done;
+static struct ptp_event_cb_data **event_done_tail = &event_done;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t event_done_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void
+event_done_lock (void) {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&event_done_mutex);
+#endif
+}
+
+static void
+event_done_unlock (void) {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&event_done_mutex);
+#endif
 }
 
 static void
@@ -1807,8 +3360,48 @@ ptp_usb_event_cb (struct libusb_transfer *t) {
 			"PTP: reading event an error 0x%02x occurred\n",
 			t->status);
 	}
-	data->cb(params, code, &event, data->user_data);
-	free(data);
+	/*
+	 * We may be inside the event handling of a synchronous transfer,
+	 * the callback gets to run transactions of its own only once
+	 * libusb is done, see ptp_usb_event_dispatch().
+	 */
+	data->code = code;
+	data->event = event;
+	data->next = NULL;
+	event_done_lock();
+	*event_done_tail = data;
+	event_done_tail = &data->next;
+	event_done_unlock();
+}
+
+/* Takes the oldest completed event read of params, or any if NULL */
+static struct ptp_event_cb_data *
+ptp_usb_event_pop (PTPParams *params) {
+	struct ptp_event_cb_data **datap, *data;
+
+	event_done_lock();
+	for (datap = &event_done; *datap != NULL; datap = &(*datap)->next)
+		if (params == NULL || (*datap)->params == params)
+			break;
+	data = *datap;
+	if (data != NULL) {
+		*datap = data->next;
+		if (*datap == NULL)
+			event_done_tail = datap;
+	}
+	event_done_unlock();
+	return data;
+}
+
+/* Calls the callbacks of the event reads completed so far */
+static void
+ptp_usb_event_dispatch (void) {
+	struct ptp_event_cb_data *data;
+
+	while ((data = ptp_usb_event_pop (NULL)) != NULL) {
+		data->cb(data->params, data->code, &data->event, data->user_data);
+		free(data);
+	}
 }
 
 uint16_t
@@ -1819,7 +3412,8 @@ ptp_usb_event_async (PTPParams* params, PTPEventCbFn cb, void *user_data) {
 	struct libusb_transfer *t;
 	int ret;
 
-	if (params == NULL) {
+	if (params == NULL || ptp_trace_replaying (params) ||
+	    ((PTP_USB *) params->data)->ptpip) {
 		return PTP_ERROR_BADPARAM;
 	}
 
@@ -1860,8 +3454,148 @@ ptp_usb_event_async (PTPParams* params, PTPEventCbFn cb, void *user_data) {
  * Can be used to drive asynchronous event detection.
  */
 int LIBMTP_Handle_Events_Timeout_Completed(struct timeval *tv, int *completed) {
+	int ret;
+
 	/* Pass NULL for context as libmtp always uses the default context */
-	return libusb_handle_events_timeout_completed(libmtp_libusb_context, tv, completed);
+	ret = libusb_handle_events_timeout_completed(libmtp_libusb_context, tv, completed);
+	/* Now that libusb is done, tell about events read and hotplugged devices */
+	ptp_usb_event_dispatch();
+	if (hotplug_listening)
+		hotplug_dispatch();
+	return ret;
+}
+
+static LIBMTP_pollfd_added_cb_fn pollfd_added_cb = NULL;
+static LIBMTP_pollfd_removed_cb_fn pollfd_removed_cb = NULL;
+static void *pollfd_user_data = NULL;
+
+static void LIBUSB_CALL pollfd_added(int fd, short events, void *user_data)
+{
+	if (pollfd_added_cb != NULL)
+		pollfd_added_cb(fd, events, pollfd_user_data);
+}
+
+static void LIBUSB_CALL pollfd_removed(int fd, void *user_data)
+{
+	if (pollfd_removed_cb != NULL)
+		pollfd_removed_cb(fd, pollfd_user_data);
+}
+
+static void free_pollfds(const struct libusb_pollfd **usbfds)
+{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000104)
+	libusb_free_pollfds(usbfds);
+#else
+	/* Older libusb leaves it to free() */
+	free(usbfds);
+#endif
+}
+
+/**
+ * Get the file descriptors to watch for events, so that the events of
+ * all devices can be handled from an existing poll(), select() or
+ * epoll loop instead of calling LIBMTP_Handle_Events_Timeout_Completed()
+ * in a thread. Whenever one of them is ready, call
+ * LIBMTP_Handle_Ready_Events(). The set of descriptors changes when
+ * devices are opened and closed, use LIBMTP_Set_Pollfd_Notifiers() to
+ * follow it.
+ * @param fds returns a newly allocated array of descriptors, which the
+ *        caller must free after use.
+ * @param count returns the number of descriptors in the array.
+ * @return LIBMTP_ERROR_NONE on success, LIBMTP_ERROR_USB_LAYER if
+ *         this is not supported on the platform.
+ * @see LIBMTP_Get_Next_Timeout()
+ */
+LIBMTP_error_number_t LIBMTP_Get_Pollfds(LIBMTP_pollfd_t **fds, int *count)
+{
+	const struct libusb_pollfd **usbfds;
+	LIBMTP_error_number_t init_usb_ret;
+	int i, n;
+
+	*fds = NULL;
+	*count = 0;
+	init_usb_ret = init_usb();
+	if (init_usb_ret != LIBMTP_ERROR_NONE)
+		return init_usb_ret;
+
+	usbfds = libusb_get_pollfds(libmtp_libusb_context);
+	if (usbfds == NULL) {
+		LIBMTP_ERROR("LIBMTP: libusb can not be polled on this platform\n");
+		return LIBMTP_ERROR_USB_LAYER;
+	}
+	for (n = 0; usbfds[n] != NULL; n++)
+		;
+	if (n != 0) {
+		*fds = (LIBMTP_pollfd_t *) malloc(n * sizeof(LIBMTP_pollfd_t));
+		if (*fds == NULL) {
+			free_pollfds(usbfds);
+			return LIBMTP_ERROR_MEMORY_ALLOCATION;
+		}
+		for (i = 0; i < n; i++) {
+			(*fds)[i].fd = usbfds[i]->fd;
+			(*fds)[i].events = usbfds[i]->events;
+		}
+	}
+	*count = n;
+	free_pollfds(usbfds);
+	return LIBMTP_ERROR_NONE;
+}
+
+/**
+ * Get told when file descriptors are to be watched or no longer
+ * watched, see LIBMTP_Get_Pollfds(). The callbacks are called from
+ * within libmtp calls, such as while opening or releasing a device.
+ * Pass NULL for both to stop.
+ * @param added called when a descriptor is to be watched.
+ * @param removed called when a descriptor is no longer to be watched.
+ * @param user_data passed on to the callbacks.
+ */
+void LIBMTP_Set_Pollfd_Notifiers(LIBMTP_pollfd_added_cb_fn added,
+				 LIBMTP_pollfd_removed_cb_fn removed,
+				 void *user_data)
+{
+	if (init_usb() != LIBMTP_ERROR_NONE)
+		return;
+	pollfd_added_cb = added;
+	pollfd_removed_cb = removed;
+	pollfd_user_data = user_data;
+	if (added != NULL || removed != NULL)
+		libusb_set_pollfd_notifiers(libmtp_libusb_context,
+					    pollfd_added, pollfd_removed, NULL);
+	else
+		libusb_set_pollfd_notifiers(libmtp_libusb_context,
+					    NULL, NULL, NULL);
+}
+
+/**
+ * Get the longest time the loop watching the descriptors of
+ * LIBMTP_Get_Pollfds() may sleep before calling
+ * LIBMTP_Handle_Ready_Events() anyway, for the timeouts of pending
+ * transfers.
+ * @param tv returns the time left, if any.
+ * @return 1 if tv was set, 0 if there is nothing to time out (or the
+ *         descriptors take care of it), a negative value on error.
+ */
+int LIBMTP_Get_Next_Timeout(struct timeval *tv)
+{
+	if (init_usb() != LIBMTP_ERROR_NONE)
+		return LIBUSB_ERROR_OTHER;
+	return libusb_get_next_timeout(libmtp_libusb_context, tv);
+}
+
+/**
+ * Handle whatever events are pending without blocking, for when one
+ * of the descriptors of LIBMTP_Get_Pollfds() became ready or the
+ * timeout of LIBMTP_Get_Next_Timeout() passed. This completes
+ * transfers such as those of LIBMTP_Read_Event_Async() and delivers
+ * hotplug events, like LIBMTP_Handle_Events_Timeout_Completed() does.
+ * @return 0 on success, a negative libusb error code on failure.
+ */
+int LIBMTP_Handle_Ready_Events(void)
+{
+	struct timeval tv = { 0, 0 };
+
+	return LIBMTP_Handle_Events_Timeout_Completed(&tv, NULL);
 }
 
 uint16_t
@@ -1925,6 +3659,8 @@ static int init_ptp_usb(PTPParams* params, PTP_USB* ptp_usb, libusb_device* dev)
   params->cancelreq_func=ptp_usb_control_cancel_request;
   params->devstatreq_func=ptp_usb_control_device_status_request;
   params->data=ptp_usb;
+  // The transfer functions trace to the ring before libmtp sets this
+  ptp_usb->params=params;
   params->transaction_id=0;
   /*
    * This is hardcoded here since we have no devices whatsoever that are BE.
@@ -2061,6 +3797,25 @@ static int init_ptp_usb(PTPParams* params, PTP_USB* ptp_usb, libusb_device* dev)
 
     usleep(1000);
   }
+
+  /*
+   * Record the session for replaying it later without the device.
+   * If this is the second attempt after a reset the trace goes on.
+   */
+  if (getenv("LIBMTP_RECORD_TRACE") != NULL) {
+    PTPTraceDevice tracedev;
+
+    tracedev.vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
+    tracedev.product_id = ptp_usb->rawdevice.device_entry.product_id;
+    tracedev.device_flags = ptp_usb->rawdevice.device_entry.device_flags;
+    tracedev.bcdusb = ptp_usb->bcdusb;
+    tracedev.inep_maxpacket = ptp_usb->inep_maxpacket;
+    tracedev.outep_maxpacket = ptp_usb->outep_maxpacket;
+    if (ptp_trace_record(params, getenv("LIBMTP_RECORD_TRACE"),
+			 &tracedev) != PTP_RC_OK)
+      LIBMTP_ERROR("LIBMTP WARNING: could not record to %s, continuing anyway\n",
+		   getenv("LIBMTP_RECORD_TRACE"));
+  }
   return 0;
 }
 
@@ -2124,6 +3879,7 @@ static void close_usb(PTP_USB* ptp_usb)
      */
     libusb_reset_device (ptp_usb->handle);
   }
+  ptp_usb_drain_buffer_pool(ptp_usb);
   libusb_close(ptp_usb->handle);
 }
 
@@ -2216,6 +3972,118 @@ static int find_interface_and_endpoints(libusb_device *dev,
   return -1;
 }
 
+/**
+ * Sets up a device that is played back from the trace named by
+ * LIBMTP_REPLAY_TRACE instead of talking to USB, see ptp-trace.c.
+ * LIBMTP_REPLAY_TIMED keeps the recorded timing.
+ */
+static LIBMTP_error_number_t configure_replay_device(LIBMTP_raw_device_t *device,
+						     PTPParams *params,
+						     void **usbinfo)
+{
+  PTP_USB *ptp_usb;
+  PTPTraceDevice dev;
+  uint16_t ret;
+
+  ptp_usb = (PTP_USB *) malloc(sizeof(PTP_USB));
+  if (ptp_usb == NULL)
+    return LIBMTP_ERROR_MEMORY_ALLOCATION;
+  memset(ptp_usb, 0, sizeof(PTP_USB));
+  memcpy(&ptp_usb->rawdevice, device, sizeof(LIBMTP_raw_device_t));
+
+  params->data = ptp_usb;
+  params->transaction_id = 0;
+  params->byteorder = PTP_DL_LE;
+  if (ptp_trace_replay(params, getenv("LIBMTP_REPLAY_TRACE"),
+		       getenv("LIBMTP_REPLAY_TIMED") != NULL,
+		       &dev) != PTP_RC_OK) {
+    free(ptp_usb);
+    LIBMTP_ERROR("LIBMTP PANIC: Unable to replay %s\n",
+		 getenv("LIBMTP_REPLAY_TRACE"));
+    return LIBMTP_ERROR_CONNECTING;
+  }
+  ptp_usb->bcdusb = dev.bcdusb;
+  ptp_usb->inep_maxpacket = dev.inep_maxpacket;
+  ptp_usb->outep_maxpacket = dev.outep_maxpacket;
+  ptp_usb->timeout = get_timeout(ptp_usb);
+
+  ret = ptp_opensession(params, 1);
+  if (ret != PTP_RC_SessionAlreadyOpened && ret != PTP_RC_OK) {
+    LIBMTP_ERROR("LIBMTP PANIC: Could not open session in the trace! "
+		 "(Return code %d)\n", ret);
+    ptp_trace_close(params);
+    free(ptp_usb);
+    return LIBMTP_ERROR_CONNECTING;
+  }
+  *usbinfo = (void *) ptp_usb;
+  return LIBMTP_ERROR_NONE;
+}
+
+static int ptpip_update_progress(PTPParams *params, unsigned long bytes)
+{
+  return ptp_usb_update_progress((PTP_USB *) params->data, bytes);
+}
+
+/**
+ * Sets up a device listed in LIBMTP_PTPIP_DEVICES, connecting to it
+ * over TCP instead of USB, see ptpip.c.
+ */
+static LIBMTP_error_number_t configure_ptpip_device(LIBMTP_raw_device_t *device,
+						    PTPParams *params,
+						    void **usbinfo)
+{
+  PTP_USB *ptp_usb;
+  char *address;
+  uint16_t ret;
+
+  address = ptpip_address(device->devnum);
+  if (address == NULL)
+    return LIBMTP_ERROR_NO_DEVICE_ATTACHED;
+  ptp_usb = (PTP_USB *) malloc(sizeof(PTP_USB));
+  if (ptp_usb == NULL) {
+    free(address);
+    return LIBMTP_ERROR_MEMORY_ALLOCATION;
+  }
+  memset(ptp_usb, 0, sizeof(PTP_USB));
+  memcpy(&ptp_usb->rawdevice, device, sizeof(LIBMTP_raw_device_t));
+  ptp_usb->ptpip = 1;
+  ptp_usb->timeout = get_timeout(ptp_usb);
+
+  params->data = ptp_usb;
+  params->transaction_id = 0;
+  params->byteorder = PTP_DL_LE;
+  params->sendreq_func = ptp_ptpip_sendreq;
+  params->senddata_func = ptp_ptpip_senddata;
+  params->getresp_func = ptp_ptpip_getresp;
+  params->getdata_func = ptp_ptpip_getdata;
+  params->cancelreq_func = ptp_ptpip_cancelreq;
+  params->devstatreq_func = NULL;
+  params->event_check = ptp_ptpip_event_check;
+  params->event_wait = ptp_ptpip_event_wait;
+  params->event_check_queue = ptp_ptpip_event_check_queue;
+  params->ptpip_progress = ptpip_update_progress;
+
+  if (ptp_ptpip_connect(params, address) < 0) {
+    LIBMTP_ERROR("LIBMTP PANIC: Unable to connect to %s over PTP/IP\n",
+		 address);
+    free(address);
+    free(ptp_usb);
+    return LIBMTP_ERROR_CONNECTING;
+  }
+  free(address);
+
+  ret = ptp_opensession(params, 1);
+  if (ret != PTP_RC_SessionAlreadyOpened && ret != PTP_RC_OK) {
+    LIBMTP_ERROR("LIBMTP PANIC: Could not open session over PTP/IP! "
+		 "(Return code %d)\n", ret);
+    ptp_ptpip_disconnect(params);
+    free(ptp_usb);
+    return LIBMTP_ERROR_CONNECTING;
+  }
+  *usbinfo = (void *) ptp_usb;
+  return LIBMTP_ERROR_NONE;
+}
+
 /**
  * This function assigns params and usbinfo given a raw device
  * as input.
@@ -2236,6 +4104,11 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
   struct libusb_device_descriptor desc;
   LIBMTP_error_number_t init_usb_ret;
 
+  if (getenv("LIBMTP_REPLAY_TRACE") != NULL)
+    return configure_replay_device(device, params, usbinfo);
+  if (device->bus_location == PTPIP_BUS_LOCATION)
+    return configure_ptpip_device(device, params, usbinfo);
+
   /* See if we can find this raw device again... */
   init_usb_ret = init_usb();
   if (init_usb_ret != LIBMTP_ERROR_NONE)
@@ -2313,6 +4186,11 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
   /* Copy USB version number */
   ptp_usb->bcdusb = desc.bcdUSB;
 
+  /* Pick transfer sizes and depth for the link we got */
+  probe_usb_link(ptp_usb, ldevice);
+  select_usb_transport(ptp_usb);
+  (void) set_usb_device_tuning(ptp_usb, NULL);
+
   /* Attempt to initialize this device */
   if (init_ptp_usb(params, ptp_usb, ldevice) < 0) {
 	  /*初始化ptp usb失败*/
@@ -2380,9 +4258,21 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
 
 void close_device (PTP_USB *ptp_usb, PTPParams *params)
 {
+  struct ptp_event_cb_data *data;
+
   if (ptp_closesession(params)!=PTP_RC_OK)
     LIBMTP_ERROR("ERROR: Could not close session!\n");
-  close_usb(ptp_usb);
+  // A replayed or network device never had a handle to close
+  if (ptp_usb->ptpip)
+    ptp_ptpip_disconnect(params);
+  else if (ptp_usb->handle != NULL)
+    close_usb(ptp_usb);
+  ptp_trace_close(params);
+  // Event reads not delivered yet are cancelled along with the device
+  while ((data = ptp_usb_event_pop(params)) != NULL) {
+    data->cb(params, PTP_ERROR_CANCEL, &data->event, data->user_data);
+    free(data);
+  }
 }
 
 void set_usb_device_timeout(PTP_USB *ptp_usb, int timeout)
@@ -2395,10 +4285,206 @@ void get_usb_device_timeout(PTP_USB *ptp_usb, int *timeout)
   *timeout = ptp_usb->timeout;
 }
 
+/**
+ * Configure the asynchronous bulk transfer pipeline.
+ * @param ptp_usb the USB device to configure.
+ * @param depth the number of transfers to keep in flight, 0 or 1
+ *        means plain synchronous transfers.
+ * @param chunk_size size of each transfer, 0 selects the default.
+ * @return 0 on success, any other value means failure.
+ */
+int set_usb_device_pipelining(PTP_USB *ptp_usb, int depth,
+			      unsigned long chunk_size)
+{
+  unsigned long maxpacket = ptp_usb->inep_maxpacket;
+
+  if (depth < 0)
+    return -1;
+  if (depth > PTP_ASYNC_MAX_DEPTH)
+    depth = PTP_ASYNC_MAX_DEPTH;
+  if (chunk_size == 0)
+    chunk_size = PTP_ASYNC_DEFAULT_CHUNK;
+  if (chunk_size < CONTEXT_BLOCK_SIZE)
+    chunk_size = CONTEXT_BLOCK_SIZE;
+  // Every chunk but the last must be a whole number of packets
+  if (ptp_usb->outep_maxpacket > maxpacket)
+    maxpacket = ptp_usb->outep_maxpacket;
+  if (maxpacket > 0)
+    chunk_size -= chunk_size % maxpacket;
+
+  ptp_usb->async_depth = depth;
+  ptp_usb->async_chunk_size = chunk_size;
+  return 0;
+}
+
+/**
+ * Work out the automatic part of the transfer tuning from the link
+ * speed found by probe_usb_link(). Below SuperSpeed transfers stay
+ * synchronous and in CONTEXT_BLOCK_SIZE chunks, which is what all the
+ * device quirks were worked out with. Faster links get a pipeline of
+ * large chunks, except iRiver devices which need their own block size
+ * alternation and are never that fast anyway.
+ */
+static void usb_auto_tuning(PTP_USB *ptp_usb, int *depth,
+			    unsigned long *chunk_size,
+			    unsigned long *bytes_per_second)
+{
+  uint16_t vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
+  int iriver = (vendor_id == 0x4102 || vendor_id == 0x1006);
+
+  *depth = 0;
+  *chunk_size = PTP_ASYNC_DEFAULT_CHUNK;
+  /* Conservative sustained rates, flash write speed is often the limit */
+  if (ptp_usb->link_speed >= 10000) {
+    *bytes_per_second = 120*1024*1024;
+  } else if (ptp_usb->link_speed >= 5000) {
+    *bytes_per_second = 60*1024*1024;
+  } else if (ptp_usb->link_speed >= 480) {
+    *bytes_per_second = 18*1024*1024;
+  } else if (ptp_usb->link_speed > 0) {
+    *bytes_per_second = 1*1024*1024;
+  } else {
+    /* Then guess_usb_speed() goes by bcdUSB */
+    *bytes_per_second = 0;
+  }
+  if (ptp_usb->link_speed >= 5000 && !iriver) {
+    *depth = (ptp_usb->link_speed >= 10000) ? 16 : 8;
+    /* Enough for the endpoint to burst all the way through */
+    *chunk_size = 0x100000;
+  }
+}
+
+/**
+ * Find out the negotiated link speed and the burst size of the IN
+ * endpoint.
+ */
+static void probe_usb_link(PTP_USB *ptp_usb, libusb_device *ldevice)
+{
+  ptp_usb->link_speed = 0;
+  ptp_usb->inep_maxburst = 1;
+#ifdef LIBUSB_API_VERSION
+  switch (libusb_get_device_speed(ldevice)) {
+  case LIBUSB_SPEED_LOW:
+    ptp_usb->link_speed = 1;
+    break;
+  case LIBUSB_SPEED_FULL:
+    ptp_usb->link_speed = 12;
+    break;
+  case LIBUSB_SPEED_HIGH:
+    ptp_usb->link_speed = 480;
+    break;
+  case LIBUSB_SPEED_SUPER:
+    ptp_usb->link_speed = 5000;
+    break;
+#if LIBUSB_API_VERSION >= 0x01000106
+  case LIBUSB_SPEED_SUPER_PLUS:
+    ptp_usb->link_speed = 10000;
+    break;
+#endif
+  default:
+    break;
+  }
+#if LIBUSB_API_VERSION >= 0x01000102
+  if (ptp_usb->link_speed >= 5000) {
+    struct libusb_config_descriptor *config;
+    int i, j, k;
+
+    if (libusb_get_config_descriptor_by_value(ldevice, ptp_usb->config, &config) != LIBUSB_SUCCESS)
+      return;
+    for (i = 0; i < config->bNumInterfaces; i++) {
+      for (j = 0; j < config->interface[i].num_altsetting; j++) {
+	const struct libusb_interface_descriptor *alt = &config->interface[i].altsetting[j];
+
+	if (alt->bInterfaceNumber != ptp_usb->interface ||
+	    alt->bAlternateSetting != ptp_usb->altsetting)
+	  continue;
+	for (k = 0; k < alt->bNumEndpoints; k++) {
+	  struct libusb_ss_endpoint_companion_descriptor *comp;
+
+	  if (alt->endpoint[k].bEndpointAddress != ptp_usb->inep)
+	    continue;
+	  if (libusb_get_ss_endpoint_companion_descriptor(NULL, &alt->endpoint[k], &comp) == LIBUSB_SUCCESS) {
+	    ptp_usb->inep_maxburst = comp->bMaxBurst + 1;
+	    libusb_free_ss_endpoint_companion_descriptor(comp);
+	  }
+	}
+      }
+    }
+    libusb_free_config_descriptor(config);
+  }
+#endif
+#endif
+  LIBMTP_USB_DEBUG("Link speed %u Mbit/s, IN endpoint burst %d\n",
+		   ptp_usb->link_speed, ptp_usb->inep_maxburst);
+}
+
+/**
+ * Set up the transfer tuning, a value of 0 in a field (or a NULL
+ * tuning) picks it from the link speed. The iRiver block sizes and
+ * the terminating byte of DEVICE_FLAG_NO_ZERO_READS devices are kept
+ * by the transfer code whatever the chunk size.
+ * @param ptp_usb the USB device to configure.
+ * @param tuning the tuning to apply, or NULL for automatic.
+ * @return 0 on success, any other value means failure.
+ */
+int set_usb_device_tuning(PTP_USB *ptp_usb,
+			  LIBMTP_transfer_tuning_t const * const tuning)
+{
+  int depth;
+  unsigned long chunk_size;
+  unsigned long bytes_per_second;
+  unsigned long burst;
+
+  if (tuning != NULL) {
+    if (tuning->depth < 0 || tuning->timeout < 0)
+      return -1;
+    ptp_usb->tuning = *tuning;
+  } else {
+    memset(&ptp_usb->tuning, 0, sizeof(ptp_usb->tuning));
+  }
+
+  usb_auto_tuning(ptp_usb, &depth, &chunk_size, &bytes_per_second);
+  if (ptp_usb->tuning.depth > 0)
+    depth = ptp_usb->tuning.depth;
+  if (ptp_usb->tuning.chunk_size > 0)
+    chunk_size = ptp_usb->tuning.chunk_size;
+  if (ptp_usb->tuning.bytes_per_second > 0)
+    bytes_per_second = ptp_usb->tuning.bytes_per_second;
+
+  // Keep automatic chunks a whole number of bursts
+  burst = (unsigned long) ptp_usb->inep_maxpacket * ptp_usb->inep_maxburst;
+  if (ptp_usb->tuning.chunk_size == 0 && burst > 0 && chunk_size > burst)
+    chunk_size -= chunk_size % burst;
+
+  if (set_usb_device_pipelining(ptp_usb, depth, chunk_size) != 0)
+    return -1;
+  ptp_usb->bytes_per_second = bytes_per_second;
+  ptp_usb->timeout = get_timeout(ptp_usb);
+  return 0;
+}
+
+/**
+ * Get the transfer tuning in effect, with the automatic values
+ * filled in.
+ * @param ptp_usb the USB device.
+ * @param tuning returns the tuning.
+ */
+void get_usb_device_tuning(PTP_USB *ptp_usb, LIBMTP_transfer_tuning_t *tuning)
+{
+  tuning->depth = ptp_usb->async_depth > 1 ? ptp_usb->async_depth : 1;
+  tuning->chunk_size = ptp_usb->async_chunk_size;
+  tuning->timeout = get_timeout(ptp_usb);
+  tuning->bytes_per_second = guess_usb_speed(ptp_usb);
+  tuning->link_speed = ptp_usb->link_speed;
+}
+
 int guess_usb_speed(PTP_USB *ptp_usb)
 {
   int bytes_per_second;
 
+  if (ptp_usb->bytes_per_second > 0)
+    return ptp_usb->bytes_per_second;
+
   /*
    * We don't know the actual speeds so these are rough guesses
    * from the info you can find here:
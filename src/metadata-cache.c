@@ -0,0 +1,692 @@
+/**
+ * \file metadata-cache.c
+ * Persistent on-disk copy of the object metadata cache.
+ *
+ * Reading the metadata of all objects on a large device can take
+ * minutes. Devices opened with LIBMTP_OPEN_PERSISTENT_CACHE keep
+ * a copy of the object cache in a file named after the device serial
+ * number, which replaces the full listing on the next open as long as
+ * the storages still look the same.
+ *
+ * The file is a fixed header followed by four arrays: storages,
+ * objects, object properties and a string table. All records have a
+ * fixed size and use host byte order, so the file can be mapped and
+ * read in place. Strings are referenced by their offset in the
+ * string table plus one, zero meaning no string.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "libmtp.h"
+#include "ptp.h"
+#include "util.h"
+
+#include "metadata-cache.h"
+
+#define CACHE_MAGIC "LIBMTPMC"
+#define CACHE_VERSION 1
+#define CACHE_BYTEORDER 0x01020304U
+
+/* Only these object flags describe data stored in the file */
+#define CACHE_OBJECT_FLAGS (PTPOBJECT_OBJECTINFO_LOADED | \
+			    PTPOBJECT_CANONFLAGS_LOADED | \
+			    PTPOBJECT_MTPPROPLIST_LOADED | \
+			    PTPOBJECT_PARENTOBJECT_LOADED | \
+			    PTPOBJECT_STORAGEID_LOADED)
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder;
+  uint32_t nrofstorages;
+  uint32_t nrofobjects;
+  uint32_t nrofprops;
+  uint32_t stringsize;
+} cache_header_t;
+
+typedef struct {
+  uint32_t id;
+  uint32_t reserved;
+  uint64_t maxcapacity;
+  uint64_t freebytes;
+  uint64_t freeobjects;
+} cache_storage_t;
+
+typedef struct {
+  uint32_t oid;
+  uint32_t flags;
+  uint32_t storage_id;
+  uint32_t parent_id;
+  uint16_t format;
+  uint16_t protection;
+  uint16_t association_type;
+  uint16_t reserved1;
+  uint32_t association_desc;
+  uint32_t sequence;
+  uint32_t canon_flags;
+  uint32_t filename;
+  uint32_t keywords;
+  uint32_t firstprop;
+  uint32_t nrofprops;
+  uint32_t reserved2;
+  uint64_t size;
+  int64_t capturedate;
+  int64_t modificationdate;
+} cache_object_t;
+
+typedef struct {
+  uint16_t property;
+  uint16_t datatype;
+  uint32_t reserved;
+  uint64_t value;
+} cache_prop_t;
+
+/**
+ * Creates a directory, it is fine if it is already there.
+ */
+static int make_dir(const char *path)
+{
+#ifdef __WIN32__
+  if (mkdir(path) == 0 || errno == EEXIST)
+#else
+  if (mkdir(path, 0700) == 0 || errno == EEXIST)
+#endif
+    return 0;
+  return -1;
+}
+
+/**
+ * Returns the path of the cache file for a device, or NULL if the
+ * device cannot be told apart from others (no serial number).
+ * $LIBMTP_CACHE_DIR overrides the default $XDG_CACHE_HOME/libmtp
+ * or $HOME/.cache/libmtp.
+ * @param device the device to get the cache file for.
+ * @param create whether to create missing directories on the way.
+ * @return a newly allocated path, free() it after use.
+ */
+static char *cache_path(LIBMTP_mtpdevice_t *device, int create)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  const char *serial = params->deviceinfo.SerialNumber;
+  const char *dir = getenv("LIBMTP_CACHE_DIR");
+  const char *base = NULL;
+  const char *sub = NULL;
+  char *path;
+  size_t len;
+  char *p;
+
+  if (serial == NULL || serial[0] == '\0')
+    return NULL;
+
+  if (dir == NULL) {
+    base = getenv("XDG_CACHE_HOME");
+    sub = "/libmtp";
+    if (base == NULL || base[0] == '\0') {
+      base = getenv("HOME");
+      sub = "/.cache/libmtp";
+    }
+    if (base == NULL)
+      return NULL;
+  }
+
+  len = strlen(dir ? dir : base) + (sub ? strlen(sub) : 0) +
+    strlen(serial) + sizeof("/.cache");
+  path = malloc(len);
+  if (path == NULL)
+    return NULL;
+
+  if (dir != NULL) {
+    strcpy(path, dir);
+    if (create && make_dir(path) < 0) {
+      free(path);
+      return NULL;
+    }
+  } else {
+    // Create the intermediate directories one at a time
+    strcpy(path, base);
+    p = path + strlen(path);
+    strcpy(p, sub);
+    while (create && (p = strchr(p + 1, '/')) != NULL) {
+      *p = '\0';
+      if (make_dir(path) < 0) {
+	free(path);
+	return NULL;
+      }
+      *p = '/';
+    }
+    if (create && make_dir(path) < 0) {
+      free(path);
+      return NULL;
+    }
+  }
+
+  // The serial number is up to the device, keep it a plain filename
+  p = path + strlen(path);
+  *p++ = '/';
+  for (; *serial != '\0'; serial++) {
+    *p++ = (isalnum((unsigned char) *serial) || *serial == '-') ?
+      *serial : '_';
+  }
+  strcpy(p, ".cache");
+  return path;
+}
+
+/**
+ * Whether a property can be stored in the file. Arrays and 128 bit
+ * values are left out, they are rare and read again on demand.
+ */
+static int storable_prop(MTPProperties const * const prop)
+{
+  switch (prop->datatype) {
+  case PTP_DTC_INT8:
+  case PTP_DTC_UINT8:
+  case PTP_DTC_INT16:
+  case PTP_DTC_UINT16:
+  case PTP_DTC_INT32:
+  case PTP_DTC_UINT32:
+  case PTP_DTC_INT64:
+  case PTP_DTC_UINT64:
+    return 1;
+  case PTP_DTC_STR:
+    return prop->propval.str != NULL;
+  default:
+    return 0;
+  }
+}
+
+static uint64_t pack_prop_value(MTPProperties const * const prop)
+{
+  switch (prop->datatype) {
+  case PTP_DTC_INT8:
+    return (uint64_t) (int64_t) prop->propval.i8;
+  case PTP_DTC_UINT8:
+    return prop->propval.u8;
+  case PTP_DTC_INT16:
+    return (uint64_t) (int64_t) prop->propval.i16;
+  case PTP_DTC_UINT16:
+    return prop->propval.u16;
+  case PTP_DTC_INT32:
+    return (uint64_t) (int64_t) prop->propval.i32;
+  case PTP_DTC_UINT32:
+    return prop->propval.u32;
+  case PTP_DTC_INT64:
+    return (uint64_t) prop->propval.i64;
+  default:
+    return prop->propval.u64;
+  }
+}
+
+static void unpack_prop_value(MTPProperties * const prop, uint64_t value)
+{
+  switch (prop->datatype) {
+  case PTP_DTC_INT8:
+    prop->propval.i8 = (int8_t) value;
+    break;
+  case PTP_DTC_UINT8:
+    prop->propval.u8 = (uint8_t) value;
+    break;
+  case PTP_DTC_INT16:
+    prop->propval.i16 = (int16_t) value;
+    break;
+  case PTP_DTC_UINT16:
+    prop->propval.u16 = (uint16_t) value;
+    break;
+  case PTP_DTC_INT32:
+    prop->propval.i32 = (int32_t) value;
+    break;
+  case PTP_DTC_UINT32:
+    prop->propval.u32 = (uint32_t) value;
+    break;
+  case PTP_DTC_INT64:
+    prop->propval.i64 = (int64_t) value;
+    break;
+  default:
+    prop->propval.u64 = value;
+    break;
+  }
+}
+
+/**
+ * Adds a string to the string table being written.
+ * @return the reference to store, offset plus one or 0 for NULL.
+ */
+static uint32_t put_string(FILE *f, uint64_t *stringsize, const char *str)
+{
+  uint32_t ref;
+  size_t len;
+
+  if (str == NULL)
+    return 0;
+  len = strlen(str) + 1;
+  ref = *stringsize + 1;
+  if (f != NULL)
+    fwrite(str, 1, len, f);
+  *stringsize += len;
+  return ref;
+}
+
+/**
+ * Writes the records of all cached objects. With f == NULL this only
+ * counts properties and string table bytes.
+ */
+static void write_objects(FILE *f, PTPParams *params,
+			  uint32_t *nrofobjects, uint32_t *nrofprops,
+			  uint64_t *stringsize, int strings)
+{
+  uint32_t i, j;
+
+  *nrofobjects = 0;
+  *nrofprops = 0;
+  *stringsize = 0;
+  for (i = 0; i < params->nrofobjects; i++) {
+    PTPObject *ob = params->objects[i];
+    cache_object_t rec;
+
+    if (!(ob->flags & PTPOBJECT_OBJECTINFO_LOADED))
+      continue;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.oid = ob->oid;
+    rec.flags = ob->flags & CACHE_OBJECT_FLAGS;
+    rec.storage_id = PTP_OB_STORAGE(params, ob);
+    rec.parent_id = PTP_OB_PARENT(params, ob);
+    rec.format = PTP_OB_FORMAT(params, ob);
+    rec.protection = ob->ProtectionStatus;
+    rec.association_type = ob->AssociationType;
+    rec.association_desc = PTP_OB_EXT(ob, AssociationDesc);
+    rec.sequence = PTP_OB_EXT(ob, SequenceNumber);
+    rec.canon_flags = ob->canon_flags;
+    rec.size = PTP_OB_SIZE(params, ob);
+    rec.capturedate = (int64_t) PTP_OB_EXT(ob, CaptureDate);
+    rec.modificationdate = (int64_t) ob->ModificationDate;
+    rec.filename = put_string(strings ? f : NULL, stringsize, PTP_OB_NAME(params, ob));
+    rec.keywords = put_string(strings ? f : NULL, stringsize, PTP_OB_EXT(ob, Keywords));
+    rec.firstprop = *nrofprops;
+    for (j = 0; j < ob->nrofmtpprops; j++) {
+      MTPProperties *prop = &ob->mtpprops[j];
+
+      if (!storable_prop(prop) || prop->ObjectHandle != ob->oid)
+	continue;
+      if (prop->datatype == PTP_DTC_STR)
+	put_string(strings ? f : NULL, stringsize, prop->propval.str);
+      rec.nrofprops++;
+    }
+    *nrofprops += rec.nrofprops;
+    (*nrofobjects)++;
+    if (f != NULL && !strings)
+      fwrite(&rec, sizeof(rec), 1, f);
+  }
+}
+
+/**
+ * Writes the property records, with string references laid out the
+ * same way write_objects() puts the strings.
+ */
+static void write_props(FILE *f, PTPParams *params)
+{
+  uint64_t stringsize = 0;
+  uint32_t i, j;
+
+  for (i = 0; i < params->nrofobjects; i++) {
+    PTPObject *ob = params->objects[i];
+
+    if (!(ob->flags & PTPOBJECT_OBJECTINFO_LOADED))
+      continue;
+    put_string(NULL, &stringsize, PTP_OB_NAME(params, ob));
+    put_string(NULL, &stringsize, PTP_OB_EXT(ob, Keywords));
+    for (j = 0; j < ob->nrofmtpprops; j++) {
+      MTPProperties *prop = &ob->mtpprops[j];
+      cache_prop_t rec;
+
+      if (!storable_prop(prop) || prop->ObjectHandle != ob->oid)
+	continue;
+      memset(&rec, 0, sizeof(rec));
+      rec.property = prop->property;
+      rec.datatype = prop->datatype;
+      if (prop->datatype == PTP_DTC_STR)
+	rec.value = put_string(NULL, &stringsize, prop->propval.str);
+      else
+	rec.value = pack_prop_value(prop);
+      fwrite(&rec, sizeof(rec), 1, f);
+    }
+  }
+}
+
+/**
+ * Stores the object cache of a device in its cache file. The file is
+ * written next to the old one and renamed over it when complete.
+ * @param device the device to save the object cache for.
+ * @return 0 on success, -1 on failure.
+ */
+int metadata_cache_save(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_devicestorage_t *storage;
+  cache_header_t header;
+  uint64_t stringsize;
+  char *path;
+  char *tmppath;
+  FILE *f;
+  int ok;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+  header.version = CACHE_VERSION;
+  header.byteorder = CACHE_BYTEORDER;
+  for (storage = device->storage; storage != NULL; storage = storage->next)
+    header.nrofstorages++;
+  write_objects(NULL, params, &header.nrofobjects, &header.nrofprops,
+		&stringsize, 0);
+  // String references are 32 bits, a larger table can't be stored
+  if (stringsize > 0xFFFFFFFFU)
+    return -1;
+  header.stringsize = (uint32_t) stringsize;
+
+  path = cache_path(device, 1);
+  if (path == NULL)
+    return -1;
+  tmppath = malloc(strlen(path) + sizeof(".tmp"));
+  if (tmppath == NULL) {
+    free(path);
+    return -1;
+  }
+  sprintf(tmppath, "%s.tmp", path);
+
+  f = fopen(tmppath, "wb");
+  if (f == NULL) {
+    free(tmppath);
+    free(path);
+    return -1;
+  }
+
+  fwrite(&header, sizeof(header), 1, f);
+
+  for (storage = device->storage; storage != NULL; storage = storage->next) {
+    cache_storage_t rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.id = storage->id;
+    rec.maxcapacity = storage->MaxCapacity;
+    rec.freebytes = storage->FreeSpaceInBytes;
+    rec.freeobjects = storage->FreeSpaceInObjects;
+    fwrite(&rec, sizeof(rec), 1, f);
+  }
+  {
+    uint32_t nrofobjects, nrofprops;
+
+    write_objects(f, params, &nrofobjects, &nrofprops, &stringsize, 0);
+    write_props(f, params);
+    write_objects(f, params, &nrofobjects, &nrofprops, &stringsize, 1);
+  }
+
+  ok = !ferror(f);
+  if (fclose(f) != 0)
+    ok = 0;
+  if (ok && rename(tmppath, path) != 0)
+    ok = 0;
+  if (!ok) {
+    LIBMTP_ERROR("LIBMTP could not write metadata cache %s\n", path);
+    unlink(tmppath);
+  }
+  free(tmppath);
+  free(path);
+  return ok ? 0 : -1;
+}
+
+/**
+ * Checks that the storages of the device match the ones recorded in
+ * the cache file. Any object added or deleted changes the free space,
+ * so this catches most changes made to the device by someone else.
+ */
+static int storages_match(LIBMTP_mtpdevice_t *device,
+			  cache_header_t const * const header,
+			  cache_storage_t const * const recs)
+{
+  LIBMTP_devicestorage_t *storage = device->storage;
+  uint32_t i;
+
+  for (i = 0; i < header->nrofstorages; i++, storage = storage->next) {
+    if (storage == NULL ||
+	storage->id != recs[i].id ||
+	storage->MaxCapacity != recs[i].maxcapacity ||
+	storage->FreeSpaceInBytes != recs[i].freebytes ||
+	storage->FreeSpaceInObjects != recs[i].freeobjects)
+      return 0;
+  }
+  return storage == NULL;
+}
+
+/**
+ * Resolves a string reference into the (already validated) string
+ * table and interns it into the object cache arena.
+ */
+static char *get_string(PTPParams *params, const char *strings,
+			uint32_t const ref)
+{
+  if (ref == 0)
+    return NULL;
+  return ptp_arena_intern(&params->objectarena, strings + ref - 1);
+}
+
+/**
+ * Fills the object cache of a device from its cache file, provided
+ * the file exists, is intact and the storages did not change since it
+ * was written.
+ * @param device the device to load the object cache for.
+ * @return 0 if the object cache was loaded, -1 otherwise.
+ */
+int metadata_cache_load(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  cache_header_t const *header;
+  cache_storage_t const *storages;
+  cache_object_t const *objects;
+  cache_prop_t const *props;
+  const char *strings;
+  unsigned char *data = NULL;
+  size_t size = 0;
+  uint64_t need;
+  struct stat st;
+  char *path;
+  int fd;
+  int mapped = 0;
+  int ret = -1;
+  uint32_t i, j;
+
+  path = cache_path(device, 0);
+  if (path == NULL)
+    return -1;
+  fd = open(path, O_RDONLY);
+  free(path);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(cache_header_t) ||
+      (uint64_t) st.st_size > SIZE_MAX) {
+    close(fd);
+    return -1;
+  }
+  size = st.st_size;
+
+#ifdef HAVE_SYS_MMAN_H
+  data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    data = NULL;
+  } else {
+    mapped = 1;
+  }
+#endif
+  if (data == NULL) {
+    size_t got = 0;
+
+    data = malloc(size);
+    while (data != NULL && got < size) {
+      ssize_t r = read(fd, data + got, size - got);
+
+      if (r <= 0) {
+	free(data);
+	data = NULL;
+	break;
+      }
+      got += r;
+    }
+  }
+  close(fd);
+  if (data == NULL)
+    return -1;
+
+  header = (cache_header_t const *) data;
+  if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) ||
+      header->version != CACHE_VERSION ||
+      header->byteorder != CACHE_BYTEORDER)
+    goto out;
+  // The counts are 32 bits each, so this can't overflow 64 bits
+  need = sizeof(cache_header_t) +
+    (uint64_t) header->nrofstorages * sizeof(cache_storage_t) +
+    (uint64_t) header->nrofobjects * sizeof(cache_object_t) +
+    (uint64_t) header->nrofprops * sizeof(cache_prop_t) +
+    header->stringsize;
+  if (need != (uint64_t) size)
+    goto out;
+  storages = (cache_storage_t const *) (header + 1);
+  objects = (cache_object_t const *) (storages + header->nrofstorages);
+  props = (cache_prop_t const *) (objects + header->nrofobjects);
+  strings = (const char *) (props + header->nrofprops);
+  // Every string reference must end within the table
+  if (header->stringsize != 0 && strings[header->stringsize - 1] != '\0')
+    goto out;
+
+  if (!storages_match(device, header, storages)) {
+    LIBMTP_INFO("Storage changed since the metadata cache was written, "
+		"reading all metadata again.\n");
+    goto out;
+  }
+
+  for (i = 0; i < header->nrofobjects; i++) {
+    cache_object_t const *rec = &objects[i];
+
+    if (rec->filename > header->stringsize ||
+	rec->keywords > header->stringsize ||
+	rec->firstprop > header->nrofprops ||
+	rec->nrofprops > header->nrofprops - rec->firstprop ||
+	rec->nrofprops > SIZE_MAX / sizeof(MTPProperties))
+      goto out;
+    for (j = 0; j < rec->nrofprops; j++) {
+      cache_prop_t const *prop = &props[rec->firstprop + j];
+
+      if (prop->datatype == PTP_DTC_STR &&
+	  (prop->value == 0 || prop->value > header->stringsize))
+	goto out;
+    }
+  }
+
+  for (i = 0; i < header->nrofobjects; i++) {
+    cache_object_t const *rec = &objects[i];
+    PTPObject *ob;
+    char *keywords;
+
+    if (ptp_object_find_or_insert(params, rec->oid, &ob) != PTP_RC_OK) {
+      ptp_objects_clear(params);
+      goto out;
+    }
+    ob->flags = rec->flags | PTPOBJECT_ARENA;
+    PTP_OB_STORAGE(params, ob) = rec->storage_id;
+    PTP_OB_PARENT(params, ob) = rec->parent_id;
+    PTP_OB_FORMAT(params, ob) = rec->format;
+    ob->ProtectionStatus = rec->protection;
+    ob->AssociationType = rec->association_type;
+    PTP_OB_SIZE(params, ob) = rec->size;
+    ob->ModificationDate = (time_t) rec->modificationdate;
+    PTP_OB_NAME(params, ob) = get_string(params, strings, rec->filename);
+    keywords = get_string(params, strings, rec->keywords);
+    // Older caches have a "<null>" placeholder for every object
+    if (keywords != NULL && !strcmp(keywords, "<null>"))
+      keywords = NULL;
+    if ((rec->association_desc != 0 || rec->sequence != 0 ||
+	 rec->capturedate != 0 || keywords != NULL) &&
+	ptp_object_ext(ob) != NULL) {
+      ob->ext->AssociationDesc = rec->association_desc;
+      ob->ext->SequenceNumber = rec->sequence;
+      ob->ext->CaptureDate = (time_t) rec->capturedate;
+      ob->ext->Keywords = keywords;
+    }
+    ob->canon_flags = rec->canon_flags;
+    if (rec->nrofprops != 0) {
+      ob->mtpprops = ptp_arena_alloc(&params->objectarena,
+				     rec->nrofprops * sizeof(MTPProperties));
+      if (ob->mtpprops == NULL) {
+	ptp_objects_clear(params);
+	goto out;
+      }
+      memset(ob->mtpprops, 0, rec->nrofprops * sizeof(MTPProperties));
+      for (j = 0; j < rec->nrofprops; j++) {
+	cache_prop_t const *prec = &props[rec->firstprop + j];
+	MTPProperties *prop = &ob->mtpprops[j];
+
+	prop->ObjectHandle = rec->oid;
+	prop->property = prec->property;
+	prop->datatype = prec->datatype;
+	if (prec->datatype == PTP_DTC_STR)
+	  prop->propval.str = get_string(params, strings, (uint32_t) prec->value);
+	else
+	  unpack_prop_value(prop, prec->value);
+      }
+      ob->nrofmtpprops = rec->nrofprops;
+    }
+    ptp_object_reindex(params, ob);
+  }
+  ret = 0;
+
+ out:
+#ifdef HAVE_SYS_MMAN_H
+  if (mapped)
+    munmap(data, size);
+  else
+#endif
+    free(data);
+  return ret;
+}
+
+/**
+ * Deletes the cache file of a device.
+ * @param device the device to remove the cache file for.
+ * @return 0 on success or if there was no file, -1 on failure.
+ */
+int metadata_cache_remove(LIBMTP_mtpdevice_t *device)
+{
+  char *path = cache_path(device, 0);
+  int ret = 0;
+
+  if (path == NULL)
+    return 0;
+  if (unlink(path) < 0 && errno != ENOENT)
+    ret = -1;
+  free(path);
+  return ret;
+}
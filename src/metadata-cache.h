@@ -0,0 +1,28 @@
+/**
+ * \file metadata-cache.h
+ * Persistent on-disk copy of the object metadata cache.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __MTP__METADATA_CACHE__H
+#define __MTP__METADATA_CACHE__H
+
+int metadata_cache_load(LIBMTP_mtpdevice_t *device);
+int metadata_cache_save(LIBMTP_mtpdevice_t *device);
+int metadata_cache_remove(LIBMTP_mtpdevice_t *device);
+
+#endif //__MTP__METADATA_CACHE__H
@@ -52,6 +52,9 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <errno.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 
 /* Microsoft MTPZ extensions */
@@ -80,6 +83,17 @@ static unsigned char *MTPZ_MODULUS;
 static unsigned char *MTPZ_PRIVATE_KEY;
 static char *MTPZ_CERTIFICATES;
 
+/*
+ * The data above is read once per process, and the key material
+ * derived from it is set up on first use and kept, as every handshake
+ * needs the same.
+ */
+static int mtpz_data_loaded = 0;
+static int mtpz_data_result = -1;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t mtpz_key_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 // Strip the trailing newline from fgets().
 static char *fgets_strip(char * str, int num, FILE * stream)
 {
@@ -116,8 +130,15 @@ static char *hex_to_bytes(char *hex, size_t len)
 
 int mtpz_loaddata()
 {
-	char *home = getenv("HOME");
+	char *home;
 	int ret = -1;
+
+	// LIBMTP_Init() may be called more than once, read the file only once
+	if (mtpz_data_loaded)
+		return mtpz_data_result;
+	mtpz_data_loaded = 1;
+
+	home = getenv("HOME");
 	if (!home)
 	{
 		LIBMTP_ERROR("Unable to determine user's home directory, MTPZ disabled.\n");
@@ -188,6 +209,7 @@ int mtpz_loaddata()
 	}
 	// If all done without errors, drop the fail
 	ret = 0;
+	mtpz_data_result = 0;
 cleanup:
 	fclose(fdata);
 	return ret;
@@ -202,6 +224,7 @@ typedef struct mtpz_rsa_struct
 
 mtpz_rsa_t *mtpz_rsa_init(const unsigned char *modulus, const unsigned char *priv_key, const unsigned char *pub_exp);
 void mtpz_rsa_free(mtpz_rsa_t *);
+static mtpz_rsa_t *mtpz_rsa_get(void);
 int mtpz_rsa_decrypt(int flen, unsigned char *from, int tlen, unsigned char *to, mtpz_rsa_t *rsa);
 int mtpz_rsa_sign(int flen, unsigned char *from, int tlen, unsigned char *to, mtpz_rsa_t *rsa);
 
@@ -247,6 +270,7 @@ unsigned int mtpz_aes_gb9[];
 
 void mtpz_encryption_cipher(unsigned char *data, unsigned int len, char encrypt);
 void mtpz_encryption_cipher_advanced(unsigned char *key, unsigned int key_len, unsigned char *data, unsigned int data_len, char encrypt);
+static void mtpz_encryption_cipher_expanded(unsigned char *expanded, unsigned char *data, unsigned int data_len, char encrypt);
 unsigned char *mtpz_encryption_expand_key(unsigned char *constant, int key_len, int count, int *out_len);
 void mtpz_encryption_expand_key_inner(unsigned char *constant, int key_len, unsigned char **out, int *out_len);
 void mtpz_encryption_inv_mix_columns(unsigned char *expanded, int offset, int rounds);
@@ -269,6 +293,87 @@ static inline uint32_t mtpz_bswap32(uint32_t x)
 
 
 /* MTPZ RSA implementation */
+
+/*
+ * Recover the primes of the modulus from the private exponent, so the
+ * private key operations can use the CRT, which is several times
+ * faster than exponentiating with d. This is the usual randomised
+ * method: with d * e - 1 = 2^s * t, for most bases g one of
+ * g^t, g^2t, ... g^(2^(s-1))t is a square root of 1 mod n other than
+ * 1 and n - 1, and gcd(that - 1, n) is one of the primes.
+ * Returns 0 and p < q with u = p^-1 mod q, as libgcrypt wants them.
+ */
+static int mtpz_rsa_factor(gcry_mpi_t n, gcry_mpi_t e, gcry_mpi_t d,
+			   gcry_mpi_t *p, gcry_mpi_t *q, gcry_mpi_t *u)
+{
+	gcry_mpi_t t = gcry_mpi_new(0);
+	gcry_mpi_t nm1 = gcry_mpi_new(0);
+	gcry_mpi_t g = gcry_mpi_new(0);
+	gcry_mpi_t x = gcry_mpi_new(0);
+	gcry_mpi_t y = gcry_mpi_new(0);
+	gcry_mpi_t r = gcry_mpi_new(0);
+	unsigned int s = 0, i, base;
+	int found = 0;
+
+	gcry_mpi_mul(t, d, e);
+	gcry_mpi_sub_ui(t, t, 1);
+	gcry_mpi_sub_ui(nm1, n, 1);
+	if (gcry_mpi_cmp_ui(t, 0) > 0)
+	{
+		while (!gcry_mpi_test_bit(t, 0))
+		{
+			gcry_mpi_rshift(t, t, 1);
+			s++;
+		}
+	}
+
+	for (base = 2; base < 100 && s && !found; base++)
+	{
+		gcry_mpi_set_ui(g, base);
+		gcry_mpi_powm(x, g, t, n);
+		for (i = 0; i < s; i++)
+		{
+			if (!gcry_mpi_cmp_ui(x, 1) || !gcry_mpi_cmp(x, nm1))
+				break;
+			gcry_mpi_mulm(y, x, x, n);
+			if (!gcry_mpi_cmp_ui(y, 1))
+			{
+				gcry_mpi_sub_ui(x, x, 1);
+				gcry_mpi_gcd(r, x, n);
+				found = 1;
+				break;
+			}
+			gcry_mpi_swap(x, y);
+		}
+	}
+
+	if (found)
+	{
+		*p = r;
+		*q = gcry_mpi_new(0);
+		*u = gcry_mpi_new(0);
+		gcry_mpi_div(*q, NULL, n, *p, 0);
+		if (gcry_mpi_cmp(*p, *q) > 0)
+			gcry_mpi_swap(*p, *q);
+		if (!gcry_mpi_invm(*u, *p, *q))
+		{
+			gcry_mpi_release(*p);
+			gcry_mpi_release(*q);
+			gcry_mpi_release(*u);
+			found = 0;
+		}
+	}
+	else
+		gcry_mpi_release(r);
+
+	gcry_mpi_release(t);
+	gcry_mpi_release(nm1);
+	gcry_mpi_release(g);
+	gcry_mpi_release(x);
+	gcry_mpi_release(y);
+	return found ? 0 : -1;
+}
+
 mtpz_rsa_t *mtpz_rsa_init(const unsigned char *str_modulus, const unsigned char *str_privkey, const unsigned char *str_pubexp)
 {
 	mtpz_rsa_t *rsa = calloc(1, sizeof(mtpz_rsa_t));
@@ -276,12 +381,28 @@ mtpz_rsa_t *mtpz_rsa_init(const unsigned char *str_modulus, const unsigned char
 		return NULL;
 
 	gcry_mpi_t mpi_modulus, mpi_privkey, mpi_pubexp;
+	gcry_mpi_t mpi_p, mpi_q, mpi_u;
 
 	gcry_mpi_scan(&mpi_modulus, GCRYMPI_FMT_HEX, str_modulus, 0, NULL);
 	gcry_mpi_scan(&mpi_privkey, GCRYMPI_FMT_HEX, str_privkey, 0, NULL);
 	gcry_mpi_scan(&mpi_pubexp, GCRYMPI_FMT_HEX, str_pubexp, 0, NULL);
 
-	gcry_sexp_build(&rsa->privkey, NULL, "(private-key (rsa (n %m) (e %m) (d %m)))", mpi_modulus, mpi_pubexp, mpi_privkey);
+	if (mtpz_rsa_factor(mpi_modulus, mpi_pubexp, mpi_privkey, &mpi_p, &mpi_q, &mpi_u) == 0)
+	{
+		gcry_sexp_build(&rsa->privkey, NULL, "(private-key (rsa (n %m) (e %m) (d %m) (p %m) (q %m) (u %m)))",
+				mpi_modulus, mpi_pubexp, mpi_privkey, mpi_p, mpi_q, mpi_u);
+		gcry_mpi_release(mpi_p);
+		gcry_mpi_release(mpi_q);
+		gcry_mpi_release(mpi_u);
+		// Better slow than wrong
+		if (rsa->privkey && gcry_pk_testkey(rsa->privkey) != 0)
+		{
+			gcry_sexp_release(rsa->privkey);
+			rsa->privkey = NULL;
+		}
+	}
+	if (!rsa->privkey)
+		gcry_sexp_build(&rsa->privkey, NULL, "(private-key (rsa (n %m) (e %m) (d %m)))", mpi_modulus, mpi_pubexp, mpi_privkey);
 	gcry_sexp_build(&rsa->pubkey, NULL, "(public-key (rsa (n %m) (e %m)))", mpi_modulus, mpi_pubexp);
 
 	gcry_mpi_release(mpi_modulus);
@@ -295,6 +416,25 @@ void mtpz_rsa_free(mtpz_rsa_t *rsa)
 {
 	gcry_sexp_release(rsa->privkey);
 	gcry_sexp_release(rsa->pubkey);
+	free(rsa);
+}
+
+/* The key of ~/.mtpz-data, set up on first use and then kept. */
+static mtpz_rsa_t *mtpz_rsa_get(void)
+{
+	static mtpz_rsa_t *rsa = NULL;
+	mtpz_rsa_t *ret;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&mtpz_key_lock);
+#endif
+	if (rsa == NULL)
+		rsa = mtpz_rsa_init(MTPZ_MODULUS, MTPZ_PRIVATE_KEY, MTPZ_PUBLIC_EXPONENT);
+	ret = rsa;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&mtpz_key_lock);
+#endif
+	return ret;
 }
 
 int mtpz_rsa_decrypt(int flen, unsigned char *from, int tlen, unsigned char *to, mtpz_rsa_t *rsa)
@@ -552,14 +692,24 @@ unsigned int mtpz_hash_rotate_left(unsigned int x, int n)
 
 void mtpz_encryption_cipher(unsigned char *data, unsigned int len, char encrypt)
 {
-	unsigned char *expanded = NULL;
+	// The schedule of the fixed key, expanded on first use and then kept
+	static unsigned char *expanded = NULL;
 
 	int offset = 0, count = len;
 
 	if ((count & 0x0F) == 0)
 	{
-		int exp_len = 0;
-		expanded = mtpz_encryption_expand_key((unsigned char *)MTPZ_ENCRYPTION_KEY, 16, 10, &exp_len);
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_lock(&mtpz_key_lock);
+#endif
+		if (expanded == NULL)
+		{
+			int exp_len = 0;
+			expanded = mtpz_encryption_expand_key((unsigned char *)MTPZ_ENCRYPTION_KEY, 16, 10, &exp_len);
+		}
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_unlock(&mtpz_key_lock);
+#endif
 
 		if (count != 0)
 		{
@@ -585,6 +735,13 @@ void mtpz_encryption_cipher_advanced(unsigned char *key, unsigned int key_len, u
 	int exp_len;
 	unsigned char *expanded = mtpz_encryption_expand_key(key, key_len, len, &exp_len);
 
+	mtpz_encryption_cipher_expanded(expanded, data, data_len, encrypt);
+	free(expanded);
+}
+
+// Like mtpz_encryption_cipher_advanced(), with the key already expanded.
+static void mtpz_encryption_cipher_expanded(unsigned char *expanded, unsigned char *data, unsigned int data_len, char encrypt)
+{
 	int offset = 0, count = data_len;
 	unsigned char *out = (unsigned char *)malloc(16);
 	unsigned int *out_int = (unsigned int *)out;
@@ -639,7 +796,6 @@ void mtpz_encryption_cipher_advanced(unsigned char *key, unsigned int key_len, u
 
 	free(out);
 	free(dtf);
-	free(expanded);
 }
 
 unsigned char *mtpz_encryption_expand_key(unsigned char *constant, int key_len, int count, int *out_len)
@@ -661,6 +817,7 @@ unsigned char *mtpz_encryption_expand_key(unsigned char *constant, int key_len,
 	i += inner_len;
 	memcpy(back + i, inner, inner_len);
 	i += inner_len;
+	free(inner);
 
 	switch (count)
 	{
@@ -929,11 +1086,16 @@ void mtpz_encryption_encrypt_mac(unsigned char *hash, unsigned int hash_length,
 	unsigned char *loop2 = (unsigned char *)malloc(17);
 	memset(loop2, 0, 17);
 	int i = 0;
+	// Both steps below use the same key schedule
+	int len = (hash_length == 16) ? 10 :
+			  (hash_length == 24) ? 12 : 32;
+	int exp_len;
+	unsigned char *expanded = mtpz_encryption_expand_key(hash, hash_length, len, &exp_len);
 
 	{
 		unsigned char *enc_hash = (unsigned char *)malloc(17);
 		memset(enc_hash, 0, 17);
-		mtpz_encryption_cipher_advanced(hash, hash_length, enc_hash, 16, 1);
+		mtpz_encryption_cipher_expanded(expanded, enc_hash, 16, 1);
 
 		for (i = 0; i < 16; i++)
 			loop1[i] = (unsigned char)((2 * enc_hash[i]) | (enc_hash[i + 1] >> 7));
@@ -951,11 +1113,6 @@ void mtpz_encryption_encrypt_mac(unsigned char *hash, unsigned int hash_length,
 	}
 
 	{
-		int len = 	(hash_length == 16) ? 10 :
-					(hash_length == 24) ? 12 : 32;
-		int exp_len;
-		unsigned char *expanded = mtpz_encryption_expand_key(hash, hash_length, len, &exp_len);
-
 		unsigned char *actual_seed = (unsigned char *)malloc(16);
 		memset(actual_seed, 0, 16);
 
@@ -982,10 +1139,10 @@ void mtpz_encryption_encrypt_mac(unsigned char *hash, unsigned int hash_length,
 
 		mtpz_encryption_encrypt_custom(out, actual_seed, expanded);
 
-		free(expanded);
 		free(actual_seed);
 	}
 
+	free(expanded);
 	free(loop1);
 	free(loop2);
 }
@@ -1547,7 +1704,7 @@ ptp_mtpz_validatehandshakeresponse (PTPParams* params, unsigned char *random, un
 	char *msg_dec = (char *)malloc(128);
 	memset(msg_dec, 0, 128);
 
-	mtpz_rsa_t *rsa = mtpz_rsa_init(MTPZ_MODULUS, MTPZ_PRIVATE_KEY, MTPZ_PUBLIC_EXPONENT);
+	mtpz_rsa_t *rsa = mtpz_rsa_get();
 	if (!rsa)
 	{
 		LIBMTP_INFO ("(MTPZ) Failure - could not instantiate RSA object.\n");
@@ -1562,13 +1719,9 @@ ptp_mtpz_validatehandshakeresponse (PTPParams* params, unsigned char *random, un
 
 		free(message);
 		free(msg_dec);
-		mtpz_rsa_free(rsa);
 		return -1;
 	}
 
-	mtpz_rsa_free(rsa);
-	rsa = NULL;
-
 	char *state = mtpz_hash_init_state();
 	char *hash_key = (char *)malloc(16);
 	char *v10 = mtpz_hash_custom6A5DC(state, msg_dec + 21, 107, 20);
@@ -1739,7 +1892,7 @@ ptp_mtpz_makeapplicationcertificatemessage (unsigned int *out_len, unsigned char
 	free(hash); hash = NULL;
 
 	// Take care of some RSA jazz.
-	mtpz_rsa_t *rsa = mtpz_rsa_init(MTPZ_MODULUS, MTPZ_PRIVATE_KEY, MTPZ_PUBLIC_EXPONENT);
+	mtpz_rsa_t *rsa = mtpz_rsa_get();
 	if (!rsa)
 	{
 		LIBMTP_INFO("(MTPZ) Failure - could not instantiate RSA object.\n");
@@ -1753,7 +1906,6 @@ ptp_mtpz_makeapplicationcertificatemessage (unsigned int *out_len, unsigned char
 	mtpz_rsa_sign(128, (unsigned char *)odata, 128, (unsigned char *)signature, rsa);
 
 	// Free some more things.
-	mtpz_rsa_free(rsa); rsa = NULL;
 	free(odata); odata = NULL;
 
 	// Write the signature + bytes.
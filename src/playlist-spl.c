@@ -61,6 +61,13 @@ typedef struct text_struct {
 } text_t;
 
 
+// The folder resolved for the previous track, consecutive tracks of
+// a playlist mostly live in the same folder
+typedef struct path_memo_struct {
+  char* dir; // Folder path with a trailing '\\', NULL if none yet
+  uint32_t id; // Its folder id
+} path_memo_t;
+
 /**
  * Forward declarations of local (static) functions.
  */
@@ -69,13 +76,12 @@ static void write_from_spl_text_t(LIBMTP_mtpdevice_t *device, const int fd, text
 static void free_spl_text_t(text_t* p);
 static void print_spl_text_t(text_t* p);
 static uint32_t trackno_spl_text_t(text_t* p);
-static void tracks_from_spl_text_t(text_t* p, uint32_t* tracks, LIBMTP_folder_t* folders, LIBMTP_file_t* files);
-static void spl_text_t_from_tracks(text_t** p, uint32_t* tracks, const uint32_t trackno, const uint32_t ver_major, const uint32_t ver_minor, char* dnse, LIBMTP_folder_t* folders, LIBMTP_file_t* files);
+static void tracks_from_spl_text_t(LIBMTP_mtpdevice_t *device, text_t* p, uint32_t* tracks);
+static void spl_text_t_from_tracks(LIBMTP_mtpdevice_t *device, text_t** p, uint32_t* tracks, const uint32_t trackno, const uint32_t ver_major, const uint32_t ver_minor, char* dnse);
 
-static uint32_t discover_id_from_filepath(const char* s, LIBMTP_folder_t* folders, LIBMTP_file_t* files); // TODO add file/dir cached args
-static void discover_filepath_from_id(char** p, uint32_t track, LIBMTP_folder_t* folders, LIBMTP_file_t* files);
-static void find_folder_name(LIBMTP_folder_t* folders, uint32_t* id, char** name);
-static uint32_t find_folder_id(LIBMTP_folder_t* folders, uint32_t parent, char* name);
+static uint32_t discover_id_from_filepath(LIBMTP_mtpdevice_t *device, const char* s, path_memo_t* memo);
+static void discover_filepath_from_id(LIBMTP_mtpdevice_t *device, char** p, uint32_t track, path_memo_t* memo);
+static PTPObject* find_child(PTPParams* params, uint32_t parent, const char* name, const int folder);
 
 static void append_text_t(text_t** t, char* s);
 
@@ -152,17 +158,12 @@ void spl_to_playlist_t(LIBMTP_mtpdevice_t* device, PTPObjectInfo *oi,
   text_t* p = read_into_spl_text_t(device, fd);
   close(fd);
 
-  // FIXME cache these somewhere else so we don't keep calling this!
-  LIBMTP_folder_t *folders;
-  LIBMTP_file_t *files;
-  folders = LIBMTP_Get_Folder_List(device);
-  files = LIBMTP_Get_Filelisting_With_Callback(device, NULL, NULL);
-
-  // convert the playlist listing to track ids
+  // convert the playlist listing to track ids, paths are looked up
+  // in the object cache
   pl->no_tracks = trackno_spl_text_t(p);
   LIBMTP_PLST_DEBUG("%u track%s found\n", pl->no_tracks, pl->no_tracks==1?"":"s");
   pl->tracks = malloc(sizeof(uint32_t)*(pl->no_tracks));
-  tracks_from_spl_text_t(p, pl->tracks, folders, files);
+  tracks_from_spl_text_t(device, p, pl->tracks);
 
   free_spl_text_t(p);
 
@@ -183,10 +184,6 @@ int playlist_t_to_spl(LIBMTP_mtpdevice_t *device,
                       LIBMTP_playlist_t * const pl)
 {
   text_t* t;
-  LIBMTP_folder_t *folders;
-  LIBMTP_file_t *files;
-  folders = LIBMTP_Get_Folder_List(device);
-  files = LIBMTP_Get_Filelisting_With_Callback(device, NULL, NULL);
 
   char tmpname[] = "/tmp/mtp-spl2pl-XXXXXX"; // must be a var since mkstemp modifies it
 
@@ -213,7 +210,7 @@ int playlist_t_to_spl(LIBMTP_mtpdevice_t *device,
   LIBMTP_PLST_DEBUG(".spl version %d.%02d\n", ver_major, ver_minor);
 
   // create the text for the playlist
-  spl_text_t_from_tracks(&t, pl->tracks, pl->no_tracks, ver_major, ver_minor, NULL, folders, files);
+  spl_text_t_from_tracks(device, &t, pl->tracks, pl->no_tracks, ver_major, ver_minor, NULL);
   write_from_spl_text_t(device, fd, t);
   free_spl_text_t(t); // done with the text
 
@@ -550,28 +547,28 @@ static uint32_t trackno_spl_text_t(text_t* p) {
  * Find the track ids for this playlist's files.
  * (ie: \Music\song.mp3 -> 12345)
  *
+ * @param device mtp device pointer
  * @param p the text to search
  * @param tracks returned list of track id's for the playlist_t, must be large
  *               enough to accomodate all the tracks as reported by
  *               trackno_spl_text_t()
- * @param folders the folders list for the device
- * @param fiels the files list for the device
  * @see spl_to_playlist_t()
  */
-static void tracks_from_spl_text_t(text_t* p,
-                                   uint32_t* tracks,
-                                   LIBMTP_folder_t* folders,
-                                   LIBMTP_file_t* files)
+static void tracks_from_spl_text_t(LIBMTP_mtpdevice_t *device,
+                                   text_t* p,
+                                   uint32_t* tracks)
 {
+  path_memo_t memo = { NULL, 0 };
   uint32_t c = 0;
   while(p != NULL) {
     if(p->text[0] == '\\' ) {
-      tracks[c] = discover_id_from_filepath(p->text, folders, files);
+      tracks[c] = discover_id_from_filepath(device, p->text, &memo);
       LIBMTP_PLST_DEBUG("track %d = %s (%u)\n", c+1, p->text, tracks[c]);
       c++;
     }
     p = p->next;
   }
+  free(memo.dir);
 }
 
 
@@ -579,21 +576,20 @@ static void tracks_from_spl_text_t(text_t* p,
  * Find the track names (including path) for this playlist's track ids.
  * (ie: 12345 -> \Music\song.mp3)
  *
+ * @param device mtp device pointer
  * @param p the text to search
  * @param tracks list of track id's to look up
- * @param folders the folders list for the device
- * @param fiels the files list for the device
  * @see playlist_t_to_spl()
  */
-static void spl_text_t_from_tracks(text_t** p,
+static void spl_text_t_from_tracks(LIBMTP_mtpdevice_t *device,
+                                   text_t** p,
                                    uint32_t* tracks,
                                    const uint32_t trackno,
                                    const uint32_t ver_major,
                                    const uint32_t ver_minor,
-                                   char* dnse,
-                                   LIBMTP_folder_t* folders,
-                                   LIBMTP_file_t* files)
+                                   char* dnse)
 {
+  path_memo_t memo = { NULL, 0 };
 
   // HEADER
   text_t* c = NULL;
@@ -610,7 +606,7 @@ static void spl_text_t_from_tracks(text_t** p,
   unsigned int i;
   char* f;
   for(i=0;i<trackno;i++) {
-    discover_filepath_from_id(&f, tracks[i], folders, files);
+    discover_filepath_from_id(device, &f, tracks[i], &memo);
 
     if(f != NULL) {
       append_text_t(&c, f);
@@ -620,6 +616,7 @@ static void spl_text_t_from_tracks(text_t** p,
     else
       LIBMTP_ERROR("failed to find filepath for track=%d\n", tracks[i]);
   }
+  free(memo.dir);
 
   // FOOTER
   append_text_t(&c, "");
@@ -649,20 +646,26 @@ static void spl_text_t_from_tracks(text_t** p,
  * Find the track names (including path) given a fileid
  * (ie: 12345 -> \Music\song.mp3)
  *
+ * The path is built by following the parent links of the object cache,
+ * so each folder costs one lookup.
+ *
+ * @param device mtp device pointer
  * @param p returns the file path (ie: \Music\song.mp3),
  *          (*p) == NULL if the look up fails
  * @param track track id to look up
- * @param folders the folders list for the device
- * @param files the files list for the device
+ * @param memo the folder of the previous track, updated
  * @see spl_text_t_from_tracks()
  */
 
 // returns p = NULL on failure, else the filepath to the track including track name, allocated as a correct length string
-static void discover_filepath_from_id(char** p,
+static void discover_filepath_from_id(LIBMTP_mtpdevice_t *device,
+                                      char** p,
                                       uint32_t track,
-                                      LIBMTP_folder_t* folders,
-                                      LIBMTP_file_t* files)
+                                      path_memo_t* memo)
 {
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObject *ob;
+
   // fill in a string from the right side since we don't know the root till the end
   const int M = 1024;
   char w[M];
@@ -671,32 +674,43 @@ static void discover_filepath_from_id(char** p,
   // in case of failure return NULL string
   *p = NULL;
 
-
   // find the right file
-  while(files != NULL && files->item_id != track) {
-    files = files->next;
-  }
-  // if we didn't find a matching file, abort
-  if(files == NULL)
+  if(ptp_object_want(params, track, PTPOBJECT_OBJECTINFO_LOADED, &ob) != PTP_RC_OK ||
+     PTP_OB_NAME(params, ob) == NULL)
     return;
 
+  // same folder as the last one?
+  if(memo->dir != NULL && memo->id == PTP_OB_PARENT(params, ob)) {
+    *p = malloc(strlen(memo->dir) + strlen(PTP_OB_NAME(params, ob)) + 1);
+    if(*p == NULL)
+      return;
+    strcpy(*p, memo->dir);
+    strcat(*p, PTP_OB_NAME(params, ob));
+    return;
+  }
+
   // stuff the filename into our string
-  // FIXME: check for string overflow before it occurs
-  iw = iw - (strlen(files->filename) +1); // leave room for '\0' at the end
-  strcpy(iw,files->filename);
+  if(strlen(PTP_OB_NAME(params, ob)) + 2 > (size_t) M)
+    return;
+  iw = iw - (strlen(PTP_OB_NAME(params, ob)) +1); // leave room for '\0' at the end
+  strcpy(iw,PTP_OB_NAME(params, ob));
+  char* name = iw;
 
   // next follow the directories to the root
   // prepending folders to the path as we go
-  uint32_t id = files->parent_id;
-  char* f = NULL;
-  while(id != 0) {
-    find_folder_name(folders, &id, &f);
-    if(f == NULL) return; // fail if the next part of the path couldn't be found
-    iw = iw - (strlen(f) +1);
-    // FIXME: check for string overflow before it occurs
-    strcpy(iw, f);
-    iw[strlen(f)] = '\\';
-    free(f);
+  uint32_t parent = PTP_OB_PARENT(params, ob);
+  uint32_t id = parent;
+  while(id != 0 && id != 0xFFFFFFFFU) {
+    PTPObject *folder;
+    if(ptp_object_want(params, id, PTPOBJECT_OBJECTINFO_LOADED, &folder) != PTP_RC_OK ||
+       PTP_OB_NAME(params, folder) == NULL)
+      return; // fail if the next part of the path couldn't be found
+    if((size_t) (iw - w) < strlen(PTP_OB_NAME(params, folder)) + 2)
+      return; // path too long
+    iw = iw - (strlen(PTP_OB_NAME(params, folder)) +1);
+    strcpy(iw, PTP_OB_NAME(params, folder));
+    iw[strlen(PTP_OB_NAME(params, folder))] = '\\';
+    id = PTP_OB_PARENT(params, folder);
   }
 
   // prepend a slash
@@ -705,6 +719,15 @@ static void discover_filepath_from_id(char** p,
 
   // now allocate a string of the right length to be returned
   *p = strdup(iw);
+
+  // and remember the folder for the next track
+  free(memo->dir);
+  memo->dir = malloc(name - iw + 1);
+  if(memo->dir != NULL) {
+    memcpy(memo->dir, iw, name - iw);
+    memo->dir[name - iw] = '\0';
+    memo->id = parent;
+  }
 }
 
 
@@ -712,15 +735,22 @@ static void discover_filepath_from_id(char** p,
  * Find the track id given a track's name (including path)
  * (ie: \Music\song.mp3 -> 12345)
  *
+ * Each part of the path is looked up in the parent/name index of the
+ * object cache, and the folder of the previous track is reused if it
+ * is the same.
+ *
+ * @param device mtp device pointer
  * @param s file path to look up (ie: \Music\song.mp3),
  *          (*p) == NULL if the look up fails
- * @param folders the folders list for the device
- * @param files the files list for the device
+ * @param memo the folder of the previous track, updated
  * @return track id, 0 means failure
  * @see tracks_from_spl_text_t()
  */
-static uint32_t discover_id_from_filepath(const char* s, LIBMTP_folder_t* folders, LIBMTP_file_t* files)
+static uint32_t discover_id_from_filepath(LIBMTP_mtpdevice_t *device, const char* s, path_memo_t* memo)
 {
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObject *ob;
+
   // abort if this isn't a path
   if(s[0] != '\\')
     return 0;
@@ -728,9 +758,20 @@ static uint32_t discover_id_from_filepath(const char* s, LIBMTP_folder_t* folder
   unsigned int i;
   uint32_t id = 0;
   char* sc = strdup(s);
+  if(sc == NULL)
+    return 0;
   char* sci = sc +1; // iterator
   // skip leading slash in path
 
+  // start from the folder of the previous track if it is the same
+  const char* base = strrchr(s, '\\') + 1;
+  size_t dirlen = base - s;
+  if(memo->dir != NULL && strlen(memo->dir) == dirlen &&
+     strncmp(memo->dir, s, dirlen) == 0) {
+    sci = sc + dirlen;
+    id = memo->id;
+  }
+
   // convert all \ to \0
   size_t len = strlen(s);
   for(i=0;i<len;i++) {
@@ -742,21 +783,29 @@ static uint32_t discover_id_from_filepath(const char* s, LIBMTP_folder_t* folder
   // now for each part of the string, find the id
   while(sci != sc + len +1) {
     // if its the last part of the string, its the filename
-    if(sci + strlen(sci) == sc + len) {
-
-      while(files != NULL) {
-        // check parent matches id and name matches sci
-        if( (files->parent_id == id) &&
-            (strcmp(files->filename, sci) == 0) ) { // found it!
-          id = files->item_id;
-          break;
-        }
-        files = files->next;
+    int last = (sci + strlen(sci) == sc + len);
+
+    if(last) {
+      // remember the folder for the next track
+      free(memo->dir);
+      memo->dir = malloc(dirlen + 1);
+      if(memo->dir != NULL) {
+        memcpy(memo->dir, s, dirlen);
+        memo->dir[dirlen] = '\0';
+        memo->id = id;
       }
     }
-    else { // otherwise its part of the directory path
-      id = find_folder_id(folders, id, sci);
+    ob = find_child(params, id, sci, !last);
+    if(ob == NULL) {
+      id = 0;
+      if(!last) {
+        // the folder is not there, so neither is the file
+        free(memo->dir);
+        memo->dir = NULL;
+      }
+      break;
     }
+    id = ob->oid;
 
     // move to next folder/file
     sci += strlen(sci) +1;
@@ -765,67 +814,38 @@ static uint32_t discover_id_from_filepath(const char* s, LIBMTP_folder_t* folder
   // release our copied string
   free(sc);
 
-  // FIXME check that we actually have a file
-
   return id;
 }
 
 
 
 /**
- * Find the folder name given the folder's id.
+ * Find a file or folder given its name and parent id.
  *
- * @param folders the folders list for the device
- * @param id the folder_id to look up, returns the folder's parent folder_id
- * @param name returns the name of the folder or NULL on failure
- * @see discover_filepath_from_id()
+ * @param params the device parameters
+ * @param parent the parent folder id, 0 for the root
+ * @param name the name to look for
+ * @param folder non-zero to look for a folder, zero for a file
+ * @return the object or NULL on failure
+ * @see discover_id_from_filepath()
  */
-static void find_folder_name(LIBMTP_folder_t* folders, uint32_t* id, char** name)
+static PTPObject* find_child(PTPParams* params, uint32_t parent, const char* name, const int folder)
 {
-
-  // FIXME this function is exactly LIBMTP_Find_Folder
-
-  LIBMTP_folder_t* f = LIBMTP_Find_Folder(folders, *id);
-  if(f == NULL) {
-    *name = NULL;
-  }
-  else { // found it!
-    *name = strdup(f->name);
-    *id = f->parent_id;
-  }
-}
-
-
-/**
- * Find the folder id given the folder's name and parent id.
- *
- * @param folders the folders list for the device
- * @param parent the folder's parent's id
- * @param name the name of the folder
- * @return the folder_id or 0 on failure
- * @see discover_filepath_from_id()
- */
-static uint32_t find_folder_id(LIBMTP_folder_t* folders, uint32_t parent, char* name) {
-
-  if(folders == NULL)
-    return 0;
-
-  // found it!
-  else if( (folders->parent_id == parent) &&
-           (strcmp(folders->name, name) == 0) )
-    return folders->folder_id;
-
-  // no luck so far, search both siblings and children
-  else {
-    uint32_t id = 0;
-
-    if(folders->sibling != NULL)
-      id = find_folder_id(folders->sibling, parent, name);
-    if( (id == 0) && (folders->child != NULL) )
-      id = find_folder_id(folders->child, parent, name);
-
-    return id;
+  PTPObject *ob = NULL;
+
+  // the name index gives the first match, which is nearly always it
+  if(ptp_object_find_by_name(params, parent, name, &ob) == PTP_RC_OK &&
+     (PTP_OB_FORMAT(params, ob) == PTP_OFC_Association) == (folder != 0))
+    return ob;
+
+  // a file and a folder of the same name, look through the folder
+  ob = NULL;
+  while((ob = ptp_objects_next_by_parent(params, parent, ob)) != NULL) {
+    if(PTP_OB_NAME(params, ob) != NULL && strcmp(PTP_OB_NAME(params, ob), name) == 0 &&
+       (PTP_OB_FORMAT(params, ob) == PTP_OFC_Association) == (folder != 0))
+      return ob;
   }
+  return NULL;
 }
 
 
@@ -0,0 +1,764 @@
+/**
+ * \file ptp-chdk-lv.c
+ * Streaming of CHDK live view frames, and their conversion to RGBA.
+ *
+ * A stream owns a small ring of frame buffers that are sized by the
+ * first frame and then reused, the frames are read straight into them
+ * through the getbuffunc of the data handler. With threads a fetcher
+ * keeps requesting the next frame while the caller works on the last
+ * one it got. When the caller is slower than the camera the oldest
+ * unclaimed frame is overwritten, so ptp_chdk_lv_next() always hands
+ * out the newest frame there is. Without threads every
+ * ptp_chdk_lv_next() fetches a frame in line.
+ *
+ * The YUV framebuffers of Digic 6 cameras are converted eight or
+ * sixteen pixels at a time with SSE2 or NEON, the older UYVYYY
+ * viewport and the palette bitmap pixel by pixel, the latter through
+ * a table built from the palette of the frame.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+#include "ptp-chdk-lv.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define LV_FREE		0
+#define LV_FETCHING	1
+#define LV_READY	2
+#define LV_TAKEN	3
+
+#define LV_DEFAULT_FRAMES	3
+#define LV_MIN_ALLOC		65536
+
+#define LV_HEADER_LEN		28	/* without bmo_desc_start */
+#define LV_DESC_LEN		36
+#define LV_MAX_WIDTH		8192
+
+/* BT.601 full range, scaled by 512 */
+#define LV_RV			718	/* 1.402 */
+#define LV_GU			176	/* 0.344 */
+#define LV_GV			366	/* 0.714 */
+#define LV_BU			907	/* 1.772 */
+
+struct _PTPChdkLvStream {
+	PTPParams	*params;
+	unsigned	flags;
+	unsigned int	nframes;
+	uint32_t	seq;		/* number of the next frame fetched */
+	uint32_t	dropped;	/* frames fetched but never handed out */
+	uint16_t	error;		/* what stopped the fetcher */
+	PTPChdkLvFrame	frames[PTP_CHDK_LV_MAX_FRAMES];
+#ifdef HAVE_PTHREAD_H
+	int		threaded;
+	int		stop;
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+#endif
+};
+
+static int32_t
+get32 (unsigned char const *p)
+{
+	return (int32_t)(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+/* bytes in one row of a framebuffer, 0 for unknown types */
+static unsigned long
+lv_row_bytes (lv_framebuffer_desc const *fd)
+{
+	switch (fd->fb_type) {
+	case LV_FB_YUV8:
+		return (unsigned long)fd->buffer_width * 3 / 2;
+	case LV_FB_YUV8B:
+	case LV_FB_YUV8C:
+		return (unsigned long)fd->buffer_width * 2;
+	case LV_FB_PAL8:
+	case LV_FB_OPACITY8:
+		return fd->buffer_width;
+	default:
+		return 0;
+	}
+}
+
+/* Reads a framebuffer description, leaving data_start at 0 when the
+ * layer was not sent or does not fit into the frame. */
+static void
+lv_parse_desc (PTPChdkLvFrame *f, int start, lv_framebuffer_desc *fd)
+{
+	unsigned char	*d;
+	unsigned long	row;
+
+	memset (fd, 0, sizeof(*fd));
+	if ((start <= 0) || ((unsigned long)start + LV_DESC_LEN > f->size))
+		return;
+	d = f->data + start;
+	fd->fb_type		= get32 (d);
+	fd->data_start		= get32 (d+4);
+	fd->buffer_width	= get32 (d+8);
+	fd->visible_width	= get32 (d+12);
+	fd->visible_height	= get32 (d+16);
+	fd->margin_left		= get32 (d+20);
+	fd->margin_top		= get32 (d+24);
+	fd->margin_right	= get32 (d+28);
+	fd->margin_bot		= get32 (d+32);
+
+	if ((fd->data_start <= 0) || (fd->visible_width <= 0) ||
+	    (fd->visible_height <= 0) || (fd->buffer_width > LV_MAX_WIDTH) ||
+	    (fd->visible_width > fd->buffer_width) ||
+	    (fd->visible_height > LV_MAX_WIDTH)) {
+		fd->data_start = 0;
+		return;
+	}
+	row = lv_row_bytes (fd);
+	if (!row || ((unsigned long)fd->data_start + row * fd->visible_height > f->size))
+		fd->data_start = 0;
+}
+
+static unsigned long
+lv_palette_len (int type)
+{
+	switch (type) {
+	case 1:
+	case 2:
+	case 4:
+		return 16 * 4;
+	case 3:
+		return 256 * 4;
+	default:
+		return 0;
+	}
+}
+
+static uint16_t
+lv_parse (PTPChdkLvFrame *f)
+{
+	lv_data_header	*h = &f->header;
+	unsigned char	*d = f->data;
+	unsigned long	plen;
+
+	memset (h, 0, sizeof(*h));
+	f->palette = NULL;
+	if (f->size < LV_HEADER_LEN)
+		return PTP_ERROR_IO;
+	h->version_major	= get32 (d);
+	h->version_minor	= get32 (d+4);
+	h->lcd_aspect_ratio	= get32 (d+8);
+	h->palette_type		= get32 (d+12);
+	h->palette_data_start	= get32 (d+16);
+	h->vp_desc_start	= get32 (d+20);
+	h->bm_desc_start	= get32 (d+24);
+	if (h->version_major != LIVE_VIEW_VERSION_MAJOR)
+		return PTP_RC_GeneralError;
+	if ((h->version_minor > 1) && (f->size >= LV_HEADER_LEN + 4))
+		h->bmo_desc_start = get32 (d+28);
+
+	lv_parse_desc (f, h->vp_desc_start, &f->vp);
+	lv_parse_desc (f, h->bm_desc_start, &f->bm);
+	lv_parse_desc (f, h->bmo_desc_start, &f->bmo);
+
+	plen = lv_palette_len (h->palette_type);
+	if (plen && (h->palette_data_start > 0) &&
+	    ((unsigned long)h->palette_data_start + plen <= f->size))
+		f->palette = d + h->palette_data_start;
+	return PTP_RC_OK;
+}
+
+/* nothing is sent with GetDisplayData */
+static uint16_t
+lv_getfunc (PTPParams* params, void* priv,
+	    unsigned long wantlen, unsigned char *data,
+	    unsigned long *gotlen
+) {
+	return PTP_RC_GeneralError;
+}
+
+static unsigned char *
+lv_getbuffunc (PTPParams* params, void* priv,
+	       unsigned long offset, unsigned long wantlen
+) {
+	PTPChdkLvFrame	*f = (PTPChdkLvFrame*)priv;
+
+	if (f->size + offset + wantlen > f->alloc)
+		return NULL;
+	return f->data + f->size + offset;
+}
+
+static uint16_t
+lv_putfunc (PTPParams* params, void* priv,
+	    unsigned long sendlen, unsigned char *data
+) {
+	PTPChdkLvFrame	*f = (PTPChdkLvFrame*)priv;
+
+	/* read straight into place */
+	if (f->data && (data == f->data + f->size)) {
+		f->size += sendlen;
+		return PTP_RC_OK;
+	}
+	if (f->size + sendlen > f->alloc) {
+		unsigned char	*newdata;
+		unsigned long	newalloc = f->alloc ? f->alloc * 2 : LV_MIN_ALLOC;
+
+		if (newalloc < f->size + sendlen)
+			newalloc = f->size + sendlen;
+		newdata = realloc (f->data, newalloc);
+		if (!newdata)
+			return PTP_RC_GeneralError;
+		f->data = newdata;
+		f->alloc = newalloc;
+	}
+	memcpy (f->data + f->size, data, sendlen);
+	f->size += sendlen;
+	return PTP_RC_OK;
+}
+
+static uint16_t
+lv_fetch (PTPChdkLvStream *s, PTPChdkLvFrame *f)
+{
+	PTPDataHandler	handler;
+	uint16_t	ret;
+
+	handler.getfunc = lv_getfunc;
+	handler.putfunc = lv_putfunc;
+	handler.getbuffunc = lv_getbuffunc;
+	handler.priv = f;
+	f->size = 0;
+	ret = ptp_chdk_get_live_data_to_handler (s->params, s->flags, &handler);
+	if (ret != PTP_RC_OK)
+		return ret;
+	return lv_parse (f);
+}
+
+/* A slot to fetch into: a free one, or else the oldest frame not
+ * handed out yet. */
+static PTPChdkLvFrame *
+lv_slot (PTPChdkLvStream *s)
+{
+	PTPChdkLvFrame	*oldest = NULL;
+	unsigned int	i;
+
+	for (i=0;i<s->nframes;i++) {
+		PTPChdkLvFrame	*f = &s->frames[i];
+
+		if (f->state == LV_FREE)
+			return f;
+		if ((f->state == LV_READY) &&
+		    (!oldest || ((int32_t)(f->seq - oldest->seq) < 0)))
+			oldest = f;
+	}
+	if (oldest)
+		s->dropped++;
+	return oldest;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *
+lv_thread (void *arg)
+{
+	PTPChdkLvStream	*s = (PTPChdkLvStream*)arg;
+	PTPChdkLvFrame	*f;
+	uint16_t	ret;
+
+	pthread_mutex_lock (&s->lock);
+	while (!s->stop) {
+		f = lv_slot (s);
+		if (!f) {
+			/* all frames are held by the caller */
+			pthread_cond_wait (&s->cond, &s->lock);
+			continue;
+		}
+		f->state = LV_FETCHING;
+		f->seq = s->seq++;
+		pthread_mutex_unlock (&s->lock);
+
+		ret = lv_fetch (s, f);
+
+		pthread_mutex_lock (&s->lock);
+		if (ret != PTP_RC_OK) {
+			f->state = LV_FREE;
+			s->error = ret;
+			pthread_cond_broadcast (&s->cond);
+			break;
+		}
+		f->state = LV_READY;
+		pthread_cond_broadcast (&s->cond);
+	}
+	pthread_mutex_unlock (&s->lock);
+	return NULL;
+}
+#endif
+
+/**
+ * ptp_chdk_lv_open:
+ * params:	PTPParams*
+ *		flags			- LV_TFR_* layers to transfer
+ *		nframes			- frame buffers to keep, 0 for the default
+ *		ret			- see Return values
+ *
+ * Starts streaming live view frames. The first frame is fetched here,
+ * and the other frame buffers are allocated at its size.
+ *
+ * Return values: Some PTP_RC_* code.
+ * Upon success : PTPChdkLvStream** ret	- the stream
+ **/
+uint16_t
+ptp_chdk_lv_open (PTPParams *params, unsigned flags, unsigned int nframes,
+		  PTPChdkLvStream **ret)
+{
+	PTPChdkLvStream	*s;
+	uint16_t	rc;
+	unsigned int	i;
+
+	*ret = NULL;
+	if (!nframes)
+		nframes = LV_DEFAULT_FRAMES;
+	/* one to fetch into while the caller holds another */
+	if (nframes < 2)
+		nframes = 2;
+	if (nframes > PTP_CHDK_LV_MAX_FRAMES)
+		nframes = PTP_CHDK_LV_MAX_FRAMES;
+
+	s = calloc (1, sizeof(PTPChdkLvStream));
+	if (!s)
+		return PTP_RC_GeneralError;
+	s->params = params;
+	s->flags = flags;
+	s->nframes = nframes;
+
+	rc = lv_fetch (s, &s->frames[0]);
+	if (rc != PTP_RC_OK) {
+		free (s->frames[0].data);
+		free (s);
+		return rc;
+	}
+	s->frames[0].seq = s->seq++;
+	s->frames[0].state = LV_READY;
+	for (i=1;i<nframes;i++) {
+		s->frames[i].data = malloc (s->frames[0].alloc);
+		/* grown while fetching if this failed */
+		if (s->frames[i].data)
+			s->frames[i].alloc = s->frames[0].alloc;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init (&s->lock, NULL) == 0) {
+		if (pthread_cond_init (&s->cond, NULL) != 0)
+			pthread_mutex_destroy (&s->lock);
+		else if (pthread_create (&s->thread, NULL, lv_thread, s) != 0) {
+			pthread_cond_destroy (&s->cond);
+			pthread_mutex_destroy (&s->lock);
+		} else
+			s->threaded = 1;
+	}
+#endif
+	*ret = s;
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_chdk_lv_next:
+ * params:	PTPChdkLvStream*
+ *		frame			- see Return values
+ *
+ * Hands out the newest frame, waiting for one if none came since the
+ * last call. Older frames not handed out yet are given up. The frame
+ * stays valid until it is passed to ptp_chdk_lv_release().
+ *
+ * Return values: Some PTP_RC_* code, the error that stopped the
+ * stream once it stopped.
+ * Upon success : PTPChdkLvFrame** frame	- the frame
+ **/
+uint16_t
+ptp_chdk_lv_next (PTPChdkLvStream *s, PTPChdkLvFrame **frame)
+{
+	PTPChdkLvFrame	*f = NULL;
+	uint16_t	ret;
+	unsigned int	i;
+
+	*frame = NULL;
+#ifdef HAVE_PTHREAD_H
+	if (s->threaded) {
+		pthread_mutex_lock (&s->lock);
+		for (;;) {
+			for (i=0;i<s->nframes;i++) {
+				PTPChdkLvFrame	*g = &s->frames[i];
+
+				if ((g->state == LV_READY) &&
+				    (!f || ((int32_t)(g->seq - f->seq) > 0)))
+					f = g;
+			}
+			if (f || s->error)
+				break;
+			pthread_cond_wait (&s->cond, &s->lock);
+		}
+		if (!f) {
+			ret = s->error;
+			pthread_mutex_unlock (&s->lock);
+			return ret;
+		}
+		for (i=0;i<s->nframes;i++) {
+			if ((s->frames[i].state == LV_READY) && (&s->frames[i] != f)) {
+				s->frames[i].state = LV_FREE;
+				s->dropped++;
+			}
+		}
+		f->state = LV_TAKEN;
+		pthread_cond_broadcast (&s->cond);
+		pthread_mutex_unlock (&s->lock);
+		*frame = f;
+		return PTP_RC_OK;
+	}
+#endif
+	/* only the frame fetched on opening can be waiting */
+	for (i=0;i<s->nframes;i++) {
+		if (s->frames[i].state == LV_READY) {
+			s->frames[i].state = LV_TAKEN;
+			*frame = &s->frames[i];
+			return PTP_RC_OK;
+		}
+	}
+	if (s->error)
+		return s->error;
+	f = lv_slot (s);
+	if (!f)
+		return PTP_RC_GeneralError;
+	f->seq = s->seq++;
+	ret = lv_fetch (s, f);
+	if (ret != PTP_RC_OK) {
+		s->error = ret;
+		return ret;
+	}
+	f->state = LV_TAKEN;
+	*frame = f;
+	return PTP_RC_OK;
+}
+
+/* Gives a frame from ptp_chdk_lv_next() back to the stream. */
+void
+ptp_chdk_lv_release (PTPChdkLvStream *s, PTPChdkLvFrame *frame)
+{
+	if (!frame)
+		return;
+#ifdef HAVE_PTHREAD_H
+	if (s->threaded) {
+		pthread_mutex_lock (&s->lock);
+		frame->state = LV_FREE;
+		pthread_cond_broadcast (&s->cond);
+		pthread_mutex_unlock (&s->lock);
+		return;
+	}
+#endif
+	frame->state = LV_FREE;
+}
+
+/* Number of frames fetched that the caller never got, because newer
+ * ones came before it asked. */
+uint32_t
+ptp_chdk_lv_dropped (PTPChdkLvStream *s)
+{
+	uint32_t	dropped;
+
+#ifdef HAVE_PTHREAD_H
+	if (s->threaded) {
+		pthread_mutex_lock (&s->lock);
+		dropped = s->dropped;
+		pthread_mutex_unlock (&s->lock);
+		return dropped;
+	}
+#endif
+	return s->dropped;
+}
+
+/* Stops the stream, waiting for a frame being fetched, and frees all
+ * its frames, including those not released. */
+void
+ptp_chdk_lv_close (PTPChdkLvStream *s)
+{
+	unsigned int	i;
+
+	if (!s)
+		return;
+#ifdef HAVE_PTHREAD_H
+	if (s->threaded) {
+		pthread_mutex_lock (&s->lock);
+		s->stop = 1;
+		pthread_cond_broadcast (&s->cond);
+		pthread_mutex_unlock (&s->lock);
+		pthread_join (s->thread, NULL);
+		pthread_cond_destroy (&s->cond);
+		pthread_mutex_destroy (&s->lock);
+	}
+#endif
+	for (i=0;i<s->nframes;i++)
+		free (s->frames[i].data);
+	free (s);
+}
+
+static lv_framebuffer_desc const *
+lv_layer (PTPChdkLvFrame const *frame, int layer)
+{
+	lv_framebuffer_desc const	*fd;
+
+	fd = (layer == PTP_CHDK_LV_VIEWPORT) ? &frame->vp : &frame->bm;
+	return fd->data_start ? fd : NULL;
+}
+
+/* The visible size of a layer of a frame, -1 if it was not sent. */
+int
+ptp_chdk_lv_size (PTPChdkLvFrame const *frame, int layer, int *width, int *height)
+{
+	lv_framebuffer_desc const	*fd = lv_layer (frame, layer);
+
+	if (!fd)
+		return -1;
+	*width = fd->visible_width;
+	*height = fd->visible_height;
+	return 0;
+}
+
+static inline unsigned char
+lv_clip (int x)
+{
+	return (x < 0) ? 0 : ((x > 255) ? 255 : x);
+}
+
+/* The vector paths compute the same terms, so all paths agree exactly. */
+static inline void
+lv_yuv_px (unsigned char *o, int y, int u, int v)
+{
+	o[0] = lv_clip (y + ((v * LV_RV) >> 9));
+	o[1] = lv_clip (y - ((u * LV_GU) >> 9) - ((v * LV_GV) >> 9));
+	o[2] = lv_clip (y + ((u * LV_BU) >> 9));
+	o[3] = 0xff;
+}
+
+/* UYVY, two pixels share the signed chroma */
+static void
+lv_uyvy_row (unsigned char const *src, unsigned char *out, int width)
+{
+	int	x = 0;
+
+#if defined(__SSE2__)
+	__m128i	rv = _mm_set1_epi16 (LV_RV);
+	__m128i	gu = _mm_set1_epi16 (LV_GU);
+	__m128i	gv = _mm_set1_epi16 (LV_GV);
+	__m128i	bu = _mm_set1_epi16 (LV_BU);
+	__m128i	a = _mm_set1_epi8 ((char)0xff);
+
+	for (; x+8 <= width; x += 8) {
+		__m128i in = _mm_loadu_si128 ((const __m128i *)(src + 2*x));
+		__m128i y = _mm_srli_epi16 (in, 8);
+		/* U0 V0 U2 V2 ..., sign extended */
+		__m128i c = _mm_srai_epi16 (_mm_slli_epi16 (in, 8), 8);
+		__m128i u, v, r, g, b, rg, ba;
+
+		u = _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (c, _MM_SHUFFLE(2,2,0,0)), _MM_SHUFFLE(2,2,0,0));
+		v = _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (c, _MM_SHUFFLE(3,3,1,1)), _MM_SHUFFLE(3,3,1,1));
+		/* mulhi of x << 7 is (x * k) >> 9 */
+		u = _mm_slli_epi16 (u, 7);
+		v = _mm_slli_epi16 (v, 7);
+		r = _mm_add_epi16 (y, _mm_mulhi_epi16 (v, rv));
+		g = _mm_sub_epi16 (_mm_sub_epi16 (y, _mm_mulhi_epi16 (u, gu)), _mm_mulhi_epi16 (v, gv));
+		b = _mm_add_epi16 (y, _mm_mulhi_epi16 (u, bu));
+		r = _mm_packus_epi16 (r, r);
+		g = _mm_packus_epi16 (g, g);
+		b = _mm_packus_epi16 (b, b);
+		rg = _mm_unpacklo_epi8 (r, g);
+		ba = _mm_unpacklo_epi8 (b, a);
+		_mm_storeu_si128 ((__m128i *)(out + 4*x), _mm_unpacklo_epi16 (rg, ba));
+		_mm_storeu_si128 ((__m128i *)(out + 4*x + 16), _mm_unpackhi_epi16 (rg, ba));
+	}
+#elif defined(__ARM_NEON)
+	for (; x+16 <= width; x += 16) {
+		uint8x8x4_t	in = vld4_u8 (src + 2*x);
+		/* vqdmulh of x << 6 is (x * k) >> 9 */
+		int16x8_t	u = vshlq_n_s16 (vmovl_s8 (vreinterpret_s8_u8 (in.val[0])), 6);
+		int16x8_t	v = vshlq_n_s16 (vmovl_s8 (vreinterpret_s8_u8 (in.val[2])), 6);
+		int16x8_t	r = vqdmulhq_n_s16 (v, LV_RV);
+		int16x8_t	g = vaddq_s16 (vqdmulhq_n_s16 (u, LV_GU), vqdmulhq_n_s16 (v, LV_GV));
+		int16x8_t	b = vqdmulhq_n_s16 (u, LV_BU);
+		int16x8_t	ye = vreinterpretq_s16_u16 (vmovl_u8 (in.val[1]));
+		int16x8_t	yo = vreinterpretq_s16_u16 (vmovl_u8 (in.val[3]));
+		uint8x8x2_t	rz, gz, bz;
+		uint8x8x4_t	o;
+
+		rz = vzip_u8 (vqmovun_s16 (vaddq_s16 (ye, r)), vqmovun_s16 (vaddq_s16 (yo, r)));
+		gz = vzip_u8 (vqmovun_s16 (vsubq_s16 (ye, g)), vqmovun_s16 (vsubq_s16 (yo, g)));
+		bz = vzip_u8 (vqmovun_s16 (vaddq_s16 (ye, b)), vqmovun_s16 (vaddq_s16 (yo, b)));
+		o.val[3] = vdup_n_u8 (0xff);
+		o.val[0] = rz.val[0];
+		o.val[1] = gz.val[0];
+		o.val[2] = bz.val[0];
+		vst4_u8 (out + 4*x, o);
+		o.val[0] = rz.val[1];
+		o.val[1] = gz.val[1];
+		o.val[2] = bz.val[1];
+		vst4_u8 (out + 4*x + 32, o);
+	}
+#endif
+	for (; x+2 <= width; x += 2) {
+		unsigned char const *p = src + 2*x;
+
+		lv_yuv_px (out + 4*x, p[1], (int8_t)p[0], (int8_t)p[2]);
+		lv_yuv_px (out + 4*x + 4, p[3], (int8_t)p[0], (int8_t)p[2]);
+	}
+	if (x < width)
+		lv_yuv_px (out + 4*x, src[2*x+1], (int8_t)src[2*x], (int8_t)src[2*x+2]);
+}
+
+/* UYVYYY, four pixels share the signed chroma */
+static void
+lv_uyvyyy_row (unsigned char const *src, unsigned char *out, int width)
+{
+	int	x, i;
+
+	for (x=0;x<width;x+=4,src+=6) {
+		int	u = (int8_t)src[0];
+		int	v = (int8_t)src[2];
+		static const int yoff[4] = { 1, 3, 4, 5 };
+
+		for (i=0;(i<4)&&(x+i<width);i++)
+			lv_yuv_px (out + 4*(x+i), src[yoff[i]], u, v);
+	}
+}
+
+/* RGBA for each of the 256 pixel values of a paletted bitmap */
+static void
+lv_palette_lut (PTPChdkLvFrame const *frame, unsigned char *lut)
+{
+	unsigned char const	*pal = frame->palette;
+	unsigned int		i;
+
+	for (i=0;i<256;i++) {
+		unsigned char const	*e;
+		unsigned char const	*e2;
+		int			y, u, v, a;
+
+		switch (frame->header.palette_type) {
+		case 1:
+			/* AYUV, the two nibbles index two entries blended */
+			e = pal + 4*(i & 0x0f);
+			e2 = pal + 4*(i >> 4);
+			a = (e[0] + e2[0]) / 2;
+			y = (e[1] + e2[1]) / 2;
+			u = ((int8_t)e[2] + (int8_t)e2[2]) / 2;
+			v = ((int8_t)e[3] + (int8_t)e2[3]) / 2;
+			break;
+		case 3:
+			e = pal + 4*i;
+			v = (int8_t)e[0];
+			u = (int8_t)e[1];
+			y = e[2];
+			a = e[3];
+			break;
+		default:
+			/* 2 and 4, 16 entries of VUYA */
+			e = pal + 4*(i & 0x0f);
+			v = (int8_t)e[0];
+			u = (int8_t)e[1];
+			y = e[2];
+			a = e[3];
+			if (frame->header.palette_type == 4)
+				a = (a & 3) * 85;
+			break;
+		}
+		lv_yuv_px (lut + 4*i, y, u, v);
+		lut[4*i+3] = a;
+	}
+}
+
+/**
+ * ptp_chdk_lv_to_rgba:
+ * params:	PTPChdkLvFrame*
+ *		layer			- PTP_CHDK_LV_VIEWPORT or PTP_CHDK_LV_BITMAP
+ *		rgba			- the image, 4 bytes per pixel
+ *		stride			- bytes from one row of rgba to the next
+ *
+ * Converts the visible part of a layer of a frame, see
+ * ptp_chdk_lv_size(). The viewport is opaque, the bitmap takes its
+ * alpha from the palette or the opacity buffer.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_chdk_lv_to_rgba (PTPChdkLvFrame const *frame, int layer,
+		     unsigned char *rgba, unsigned int stride)
+{
+	lv_framebuffer_desc const	*fd = lv_layer (frame, layer);
+	lv_framebuffer_desc const	*op = NULL;
+	unsigned char const		*src;
+	unsigned long			row;
+	unsigned char			lut[256*4];
+	int				x, y;
+
+	if (!fd)
+		return PTP_RC_GeneralError;
+	if (stride < 4 * (unsigned int)fd->visible_width)
+		return PTP_ERROR_BADPARAM;
+	src = frame->data + fd->data_start;
+	row = lv_row_bytes (fd);
+
+	switch (fd->fb_type) {
+	case LV_FB_YUV8:
+		for (y=0;y<fd->visible_height;y++)
+			lv_uyvyyy_row (src + y*row, rgba + y*stride, fd->visible_width);
+		return PTP_RC_OK;
+	case LV_FB_YUV8B:
+	case LV_FB_YUV8C:
+		if ((layer == PTP_CHDK_LV_BITMAP) && frame->bmo.data_start &&
+		    (frame->bmo.fb_type == LV_FB_OPACITY8) &&
+		    (frame->bmo.visible_width >= fd->visible_width) &&
+		    (frame->bmo.visible_height >= fd->visible_height))
+			op = &frame->bmo;
+		for (y=0;y<fd->visible_height;y++) {
+			unsigned char	*out = rgba + y*stride;
+
+			lv_uyvy_row (src + y*row, out, fd->visible_width);
+			if (op) {
+				unsigned char const *a = frame->data + op->data_start + y*lv_row_bytes (op);
+
+				for (x=0;x<fd->visible_width;x++)
+					out[4*x+3] = a[x];
+			}
+		}
+		return PTP_RC_OK;
+	case LV_FB_PAL8:
+		if (!frame->palette)
+			return PTP_RC_GeneralError;
+		lv_palette_lut (frame, lut);
+		for (y=0;y<fd->visible_height;y++) {
+			unsigned char const	*p = src + y*row;
+			unsigned char		*out = rgba + y*stride;
+
+			for (x=0;x<fd->visible_width;x++)
+				memcpy (out + 4*x, lut + 4*p[x], 4);
+		}
+		return PTP_RC_OK;
+	default:
+		return PTP_RC_OperationNotSupported;
+	}
+}
@@ -0,0 +1,63 @@
+/**
+ * \file ptp-chdk-lv.h
+ * Streaming of CHDK live view frames through a ring of reused frame
+ * buffers, and conversion of the frames to RGBA.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __MTP__PTP_CHDK_LV__H
+#define __MTP__PTP_CHDK_LV__H
+
+#include "ptp.h"
+
+/* most frames a stream keeps, fetched or being fetched */
+#define PTP_CHDK_LV_MAX_FRAMES	8
+
+/* the layers of a frame */
+#define PTP_CHDK_LV_VIEWPORT	0
+#define PTP_CHDK_LV_BITMAP	1
+
+typedef struct _PTPChdkLvFrame PTPChdkLvFrame;
+struct _PTPChdkLvFrame {
+	unsigned char		*data;	/* the frame as sent, header first */
+	unsigned long		size;
+	unsigned long		alloc;
+	uint32_t		seq;	/* frames fetched by the stream before */
+	int			state;	/* private to the stream */
+	lv_data_header		header;
+	/* a data_start of 0 means the layer was not sent */
+	lv_framebuffer_desc	vp;	/* viewport */
+	lv_framebuffer_desc	bm;	/* bitmap overlay */
+	lv_framebuffer_desc	bmo;	/* bitmap opacity, protocol 2.2 */
+	unsigned char		*palette; /* NULL if not sent */
+};
+
+typedef struct _PTPChdkLvStream PTPChdkLvStream;
+
+uint16_t ptp_chdk_lv_open	(PTPParams *params, unsigned flags,
+				 unsigned int nframes, PTPChdkLvStream **ret);
+uint16_t ptp_chdk_lv_next	(PTPChdkLvStream *s, PTPChdkLvFrame **frame);
+void ptp_chdk_lv_release	(PTPChdkLvStream *s, PTPChdkLvFrame *frame);
+uint32_t ptp_chdk_lv_dropped	(PTPChdkLvStream *s);
+void ptp_chdk_lv_close		(PTPChdkLvStream *s);
+
+int ptp_chdk_lv_size		(PTPChdkLvFrame const *frame, int layer,
+				 int *width, int *height);
+uint16_t ptp_chdk_lv_to_rgba	(PTPChdkLvFrame const *frame, int layer,
+				 unsigned char *rgba, unsigned int stride);
+
+#endif //__MTP__PTP_CHDK_LV__H
@@ -0,0 +1,1171 @@
+/**
+ * \file ptp-pack-bench.c
+ * Microbenchmark and fuzz corpus tool for the unpackers in ptp-pack.c.
+ *
+ * The unpackers are static to ptp.c, so ptp.c is included here the same
+ * way ptp-pack.c is included into it. Before that the allocators are
+ * wrapped so that every malloc(), calloc(), realloc() and strdup()
+ * made while unpacking is counted.
+ *
+ * Payloads are synthetic (an Android style property list with one
+ * entry per object and property, a run of ObjectInfo datasets, device
+ * property values and strings) or built from the mtp-detect captures in
+ * the logs directory: the DeviceInfo of each device and a property list
+ * that cycles through its formats and their properties. Each unpacker
+ * is run over its payloads for a fixed time, and the cost per unit
+ * (object, dataset, value or string) is printed as JSON or CSV.
+ *
+ * With -o the payloads are written out as a corpus, one file each, and
+ * with -c such a corpus (or anything a fuzzer made of it) is run once
+ * through the unpacker the file name asks for, which is meant to be
+ * done under valgrind or a sanitizer.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#define _DEFAULT_SOURCE
+#include "config.h"
+#include "ptp.h"
+#include "ptp-ring.h"
+
+/* everything ptp.c includes has to come before the allocators are wrapped */
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_LIMITS_H
+# include <limits.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+#include <time.h>
+#ifdef HAVE_DIRENT_H
+# include <dirent.h>
+#endif
+#ifdef ENABLE_NLS
+# include <libintl.h>
+#endif
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
+static unsigned long nrofallocs = 0;
+
+static void *
+count_malloc (size_t size)
+{
+	nrofallocs++;
+	return malloc (size);
+}
+
+static void *
+count_calloc (size_t nmemb, size_t size)
+{
+	nrofallocs++;
+	return calloc (nmemb, size);
+}
+
+static void *
+count_realloc (void *ptr, size_t size)
+{
+	nrofallocs++;
+	return realloc (ptr, size);
+}
+
+static char *
+count_strdup (const char *s)
+{
+	nrofallocs++;
+	return strdup (s);
+}
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+#define malloc(s)	count_malloc(s)
+#define calloc(n,s)	count_calloc(n,s)
+#define realloc(p,s)	count_realloc(p,s)
+#define strdup(s)	count_strdup(s)
+
+#include "ptp.c"
+
+/* ptp.c calls this, libmtp.c has the real one */
+void
+ptp_nikon_getptpipguid (unsigned char *guid)
+{
+	memset (guid, 0, 16);
+}
+
+#define MAX_PAYLOADS	1024	/* payloads run through an unpacker per round */
+#define MAX_RESULTS	32
+#define MAX_OPS		512
+#define MAX_EVENTS	128
+#define MAX_DEVPROPS	256
+#define MAX_FORMATS	128
+#define MAX_FORMAT_PROPS 64
+#define LOG_OPL_OBJECTS	256	/* objects in the property list of each log */
+#define MAX_CORPUS_SIZE	(1 << 20)
+
+typedef struct {
+	char		name[80];	/* the corpus file name, without .bin */
+	uint16_t	datatype;	/* of the values in a dpv payload */
+	unsigned char	*data;
+	unsigned int	len;
+	unsigned int	alloc;
+	unsigned int	units;		/* objects, datasets, values or strings */
+} payload_t;
+
+typedef unsigned int (*unpack_fn) (PTPParams *params, payload_t *p);
+
+typedef struct {
+	char		name[32];
+	char const	*unit;
+	uint64_t	units;
+	uint64_t	bytes;
+	uint64_t	usecs;
+	uint64_t	allocs;
+} result_t;
+
+typedef struct {
+	uint16_t	code;
+	uint16_t	datatype;
+} format_prop_t;
+
+typedef struct {
+	uint16_t	code;
+	int		nrofprops;
+	format_prop_t	props[MAX_FORMAT_PROPS];
+} format_t;
+
+/* what an mtp-detect capture tells about the device */
+typedef struct {
+	char		name[64];
+	char		manufacturer[128];
+	char		model[128];
+	char		version[128];
+	char		serial[128];
+	char		extdesc[256];
+	uint32_t	extid;
+	uint16_t	ops[MAX_OPS];
+	int		nrofops;
+	uint16_t	events[MAX_EVENTS];
+	int		nrofevents;
+	uint16_t	devprops[MAX_DEVPROPS];
+	int		nrofdevprops;
+	format_t	formats[MAX_FORMATS];
+	int		nrofformats;
+} devinfo_t;
+
+static result_t results[MAX_RESULTS];
+static int nrofresults = 0;
+static uint64_t budget = 100000;	/* usecs per unpacker */
+
+static void
+bench_debug (void *data, const char *format, va_list args)
+{
+}
+
+static uint64_t
+now_usecs (void)
+{
+#ifdef HAVE_SYS_TIME_H
+	struct timeval	tv;
+
+	gettimeofday (&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	return (uint64_t) time (NULL) * 1000000;
+#endif
+}
+
+/* Payloads are built little endian, like params->byteorder below */
+
+static unsigned char *
+grow (payload_t *p, unsigned int n)
+{
+	if (p->len + n > p->alloc) {
+		unsigned int	alloc = p->alloc ? p->alloc : 256;
+		unsigned char	*data;
+
+		while (alloc < p->len + n)
+			alloc *= 2;
+		data = realloc (p->data, alloc);
+		if (data == NULL) {
+			fprintf (stderr, "ptp-pack-bench: out of memory\n");
+			exit (1);
+		}
+		p->data = data;
+		p->alloc = alloc;
+	}
+	p->len += n;
+	return p->data + p->len - n;
+}
+
+static void
+put8 (payload_t *p, uint8_t v)
+{
+	*grow (p, 1) = v;
+}
+
+static void
+put16 (payload_t *p, uint16_t v)
+{
+	unsigned char	*d = grow (p, 2);
+
+	d[0] = v & 0xff;
+	d[1] = v >> 8;
+}
+
+static void
+put32 (payload_t *p, uint32_t v)
+{
+	put16 (p, v & 0xffff);
+	put16 (p, v >> 16);
+}
+
+static void
+put64 (payload_t *p, uint64_t v)
+{
+	put32 (p, v & 0xffffffff);
+	put32 (p, v >> 32);
+}
+
+static void
+put_string (payload_t *p, char const *str)
+{
+	unsigned char	ucs2[PTP_MAXSTRLEN*2];
+	int		n;
+
+	n = ptp_utf8_to_ucs2 (str, strlen (str), ucs2, PTP_MAXSTRLEN - 1);
+	if (n <= 0) {
+		put8 (p, 0);
+		return;
+	}
+	put8 (p, n + 1);
+	memcpy (grow (p, n*2), ucs2, n*2);
+	put16 (p, 0);
+}
+
+static void
+put_array16 (payload_t *p, uint16_t const *v, int n)
+{
+	int	i;
+
+	put32 (p, n);
+	for (i = 0; i < n; i++)
+		put16 (p, v[i]);
+}
+
+static void
+payload_init (payload_t *p, char const *name, uint16_t datatype)
+{
+	memset (p, 0, sizeof(*p));
+	snprintf (p->name, sizeof(p->name), "%.*s", (int) sizeof(p->name) - 1, name);
+	p->datatype = datatype;
+}
+
+static void
+payloads_free (payload_t *p, int n)
+{
+	int	i;
+
+	for (i = 0; i < n; i++) {
+		free (p[i].data);
+		p[i].data = NULL;
+	}
+}
+
+/* One value of an object property, made up from the object number */
+static void
+put_value (payload_t *p, uint16_t prop, uint16_t datatype,
+	   uint16_t format, uint32_t obj)
+{
+	char	str[64];
+
+	switch (datatype) {
+	case PTP_DTC_INT8:
+	case PTP_DTC_UINT8:
+		put8 (p, obj & 0x7f);
+		break;
+	case PTP_DTC_INT16:
+	case PTP_DTC_UINT16:
+		put16 (p, prop == PTP_OPC_ObjectFormat ? format : obj & 0x7fff);
+		break;
+	case PTP_DTC_INT32:
+	case PTP_DTC_UINT32:
+		if (prop == PTP_OPC_StorageID)
+			put32 (p, 0x00010001);
+		else if (prop == PTP_OPC_ParentObject)
+			put32 (p, obj / 32);
+		else
+			put32 (p, obj * 2654435761U);
+		break;
+	case PTP_DTC_INT64:
+	case PTP_DTC_UINT64:
+		put64 (p, (uint64_t) obj * 40961 + 1234);
+		break;
+	case PTP_DTC_INT128:
+	case PTP_DTC_UINT128:
+		put64 (p, (uint64_t) obj * 0x9e3779b97f4a7c15ULL);
+		put64 (p, obj);
+		break;
+	case PTP_DTC_STR:
+		switch (prop) {
+		case PTP_OPC_DateCreated:
+		case PTP_OPC_DateModified:
+		case PTP_OPC_DateAdded:
+			snprintf (str, sizeof(str), "2016%02u%02uT%02u%02u%02u",
+				  obj % 12 + 1, obj % 28 + 1, obj % 24,
+				  obj % 60, (obj / 60) % 60);
+			break;
+		case PTP_OPC_ObjectFileName:
+		case PTP_OPC_Name:
+		case PTP_OPC_DisplayName:
+			/* one in eight is not plain ASCII */
+			if (obj % 8 == 7)
+				snprintf (str, sizeof(str),
+					  "Caf\xc3\xa9 \xe6\x97\xa5\xe6\x9c\xac %06u.mp3", obj);
+			else
+				snprintf (str, sizeof(str), "IMG_20160102_%06u.jpg", obj);
+			break;
+		default:
+			snprintf (str, sizeof(str), "Value %u", obj);
+			break;
+		}
+		put_string (p, str);
+		break;
+	default:
+		/* other types do not show up in the captures */
+		put32 (p, 0);
+		break;
+	}
+}
+
+/*
+ * Builds a property list of nrofobjects objects, the formats taking
+ * turns. Returns the number of entries.
+ */
+static uint32_t
+build_opl (payload_t *p, format_t const *formats, int nrofformats,
+	   uint32_t nrofobjects)
+{
+	uint32_t	entries = 0;
+	uint32_t	obj;
+	unsigned int	countpos;
+
+	countpos = p->len;
+	put32 (p, 0);
+	for (obj = 0; obj < nrofobjects; obj++) {
+		format_t const	*f = &formats[obj % nrofformats];
+		int		i;
+
+		for (i = 0; i < f->nrofprops; i++) {
+			put32 (p, obj + 1);
+			put16 (p, f->props[i].code);
+			put16 (p, f->props[i].datatype);
+			put_value (p, f->props[i].code, f->props[i].datatype,
+				   f->code, obj);
+			entries++;
+		}
+	}
+	p->data[countpos] = entries & 0xff;
+	p->data[countpos+1] = (entries >> 8) & 0xff;
+	p->data[countpos+2] = (entries >> 16) & 0xff;
+	p->data[countpos+3] = entries >> 24;
+	p->units = nrofobjects;
+	return entries;
+}
+
+static void
+build_di (payload_t *p, devinfo_t const *d)
+{
+	uint16_t	formats[MAX_FORMATS];
+	int		i;
+
+	for (i = 0; i < d->nrofformats; i++)
+		formats[i] = d->formats[i].code;
+	put16 (p, 100);
+	put32 (p, d->extid);
+	put16 (p, 100);
+	put_string (p, d->extdesc);
+	put16 (p, 0);
+	put_array16 (p, d->ops, d->nrofops);
+	put_array16 (p, d->events, d->nrofevents);
+	put_array16 (p, d->devprops, d->nrofdevprops);
+	put_array16 (p, NULL, 0);
+	put_array16 (p, formats, d->nrofformats);
+	put_string (p, d->manufacturer);
+	put_string (p, d->model);
+	put_string (p, d->version);
+	put_string (p, d->serial);
+	p->units = 1;
+}
+
+/* The properties an Android phone returns for every object */
+static format_t const android_format = {
+	PTP_OFC_EXIF_JPEG, 10, {
+		{ PTP_OPC_StorageID, PTP_DTC_UINT32 },
+		{ PTP_OPC_ObjectFormat, PTP_DTC_UINT16 },
+		{ PTP_OPC_ProtectionStatus, PTP_DTC_UINT16 },
+		{ PTP_OPC_ObjectSize, PTP_DTC_UINT64 },
+		{ PTP_OPC_ObjectFileName, PTP_DTC_STR },
+		{ PTP_OPC_DateModified, PTP_DTC_STR },
+		{ PTP_OPC_ParentObject, PTP_DTC_UINT32 },
+		{ PTP_OPC_PersistantUniqueObjectIdentifier, PTP_DTC_UINT128 },
+		{ PTP_OPC_Name, PTP_DTC_STR },
+		{ PTP_OPC_DateAdded, PTP_DTC_STR },
+	}
+};
+
+static void
+synthetic_devinfo (devinfo_t *d)
+{
+	static uint16_t const formats[] = {
+		PTP_OFC_Undefined, PTP_OFC_Association, PTP_OFC_Text,
+		PTP_OFC_HTML, PTP_OFC_WAV, PTP_OFC_MP3, PTP_OFC_MPEG,
+		PTP_OFC_EXIF_JPEG, PTP_OFC_PNG, PTP_OFC_MTP_WMA,
+		PTP_OFC_MTP_OGG, PTP_OFC_MTP_AAC, PTP_OFC_MTP_MP4,
+		PTP_OFC_MTP_AbstractAudioVideoPlaylist,
+	};
+	uint16_t	op;
+	unsigned int	i;
+
+	memset (d, 0, sizeof(*d));
+	snprintf (d->name, sizeof(d->name), "synthetic");
+	snprintf (d->manufacturer, sizeof(d->manufacturer), "Google");
+	snprintf (d->model, sizeof(d->model), "Pixel 3a");
+	snprintf (d->version, sizeof(d->version), "1.0");
+	snprintf (d->serial, sizeof(d->serial), "94AX0CP8NM");
+	snprintf (d->extdesc, sizeof(d->extdesc),
+		  "microsoft.com: 1.0; android.com: 1.0;");
+	d->extid = 6;
+	for (op = PTP_OC_GetDeviceInfo; op <= PTP_OC_CopyObject; op++)
+		d->ops[d->nrofops++] = op;
+	for (op = PTP_OC_MTP_GetObjectPropsSupported;
+	     op <= PTP_OC_MTP_SetObjectPropValue; op++)
+		d->ops[d->nrofops++] = op;
+	for (op = PTP_EC_ObjectAdded; op <= PTP_EC_StoreFull; op++)
+		d->events[d->nrofevents++] = op;
+	d->devprops[d->nrofdevprops++] = PTP_DPC_MTP_SynchronizationPartner;
+	d->devprops[d->nrofdevprops++] = PTP_DPC_MTP_DeviceFriendlyName;
+	d->devprops[d->nrofdevprops++] = PTP_DPC_BatteryLevel;
+	for (i = 0; i < sizeof(formats)/sizeof(formats[0]); i++) {
+		d->formats[i] = android_format;
+		d->formats[i].code = formats[i];
+	}
+	d->nrofformats = i;
+}
+
+static uint16_t
+parse_datatype (char const *line)
+{
+	static struct {
+		char const	*name;
+		uint16_t	datatype;
+	} const types[] = {
+		{ "INT8", PTP_DTC_INT8 },	{ "UINT8", PTP_DTC_UINT8 },
+		{ "INT16", PTP_DTC_INT16 },	{ "UINT16", PTP_DTC_UINT16 },
+		{ "INT32", PTP_DTC_INT32 },	{ "UINT32", PTP_DTC_UINT32 },
+		{ "INT64", PTP_DTC_INT64 },	{ "UINT64", PTP_DTC_UINT64 },
+		{ "INT128", PTP_DTC_INT128 },	{ "UINT128", PTP_DTC_UINT128 },
+		{ "STRING", PTP_DTC_STR },
+	};
+	char const	*end = strstr (line, " data type");
+	char const	*start;
+	unsigned int	i;
+
+	if (end == NULL)
+		return PTP_DTC_UNDEF;
+	for (start = end; start > line && start[-1] != ' '; start--)
+		;
+	for (i = 0; i < sizeof(types)/sizeof(types[0]); i++) {
+		if (strlen (types[i].name) == (size_t)(end - start) &&
+		    !strncmp (start, types[i].name, end - start))
+			return types[i].datatype;
+	}
+	return PTP_DTC_UNDEF;
+}
+
+static void
+copy_field (char *dest, size_t size, char const *line, char const *key)
+{
+	size_t	len;
+
+	snprintf (dest, size, "%s", line + strlen (key));
+	len = strlen (dest);
+	while (len > 0 && (dest[len-1] == '\n' || dest[len-1] == '\r'))
+		dest[--len] = '\0';
+}
+
+/*
+ * Reads what there is of the device info, the operations, events and
+ * device properties, and the formats with their object properties from
+ * an mtp-detect capture. Returns 0 if the capture has no formats.
+ */
+static int
+parse_log (char const *path, devinfo_t *d)
+{
+	enum { NONE, INFO, OPS, EVENTS, DEVPROPS, FORMATS } section = NONE;
+	char		line[512];
+	FILE		*f;
+	char const	*base;
+	unsigned int	code;
+	int		i;
+
+	f = fopen (path, "r");
+	if (f == NULL)
+		return 0;
+	memset (d, 0, sizeof(*d));
+	base = strrchr (path, '/');
+	base = base ? base + 1 : path;
+	if (!strncmp (base, "mtp-detect-", 11))
+		base += 11;
+	snprintf (d->name, sizeof(d->name), "%.48s", base);
+	if (strchr (d->name, '.'))
+		*strchr (d->name, '.') = '\0';
+
+	while (fgets (line, sizeof(line), f) != NULL) {
+		if (line[0] != ' ') {
+			if (!strncmp (line, "Device info:", 12))
+				section = INFO;
+			else if (!strncmp (line, "Supported operations:", 21))
+				section = OPS;
+			else if (!strncmp (line, "Events supported:", 17))
+				section = EVENTS;
+			else if (!strncmp (line, "Device Properties Supported:", 28))
+				section = DEVPROPS;
+			else if (!strncmp (line, "Playable File (Object) Types", 28))
+				section = FORMATS;
+			else
+				section = NONE;
+			continue;
+		}
+		switch (section) {
+		case INFO:
+			if (!strncmp (line, "   Manufacturer: ", 17))
+				copy_field (d->manufacturer, sizeof(d->manufacturer), line, "   Manufacturer: ");
+			else if (!strncmp (line, "   Model: ", 10))
+				copy_field (d->model, sizeof(d->model), line, "   Model: ");
+			else if (!strncmp (line, "   Device version: ", 19))
+				copy_field (d->version, sizeof(d->version), line, "   Device version: ");
+			else if (!strncmp (line, "   Serial number: ", 18))
+				copy_field (d->serial, sizeof(d->serial), line, "   Serial number: ");
+			else if (!strncmp (line, "   Vendor extension description: ", 33))
+				copy_field (d->extdesc, sizeof(d->extdesc), line, "   Vendor extension description: ");
+			else if (!strncmp (line, "   Vendor extension ID: ", 24))
+				d->extid = strtoul (line + 24, NULL, 16);
+			break;
+		case OPS:
+			if (sscanf (line, "   %x:", &code) == 1 && d->nrofops < MAX_OPS)
+				d->ops[d->nrofops++] = code;
+			break;
+		case EVENTS:
+			if (sscanf (line, "   0x%x", &code) == 1 && d->nrofevents < MAX_EVENTS)
+				d->events[d->nrofevents++] = code;
+			break;
+		case DEVPROPS:
+			if (sscanf (line, "   0x%x:", &code) == 1 && d->nrofdevprops < MAX_DEVPROPS)
+				d->devprops[d->nrofdevprops++] = code;
+			break;
+		case FORMATS:
+			if (!strncmp (line, "      ", 6)) {
+				format_t	*fmt;
+				uint16_t	datatype;
+
+				if (d->nrofformats == 0 ||
+				    sscanf (line, "      %x:", &code) != 1)
+					break;
+				fmt = &d->formats[d->nrofformats-1];
+				datatype = parse_datatype (line);
+				if (datatype == PTP_DTC_UNDEF ||
+				    fmt->nrofprops == MAX_FORMAT_PROPS)
+					break;
+				fmt->props[fmt->nrofprops].code = code;
+				fmt->props[fmt->nrofprops].datatype = datatype;
+				fmt->nrofprops++;
+			} else if (sscanf (line, "   %x:", &code) == 1 &&
+				   d->nrofformats < MAX_FORMATS) {
+				d->formats[d->nrofformats].code = code;
+				d->formats[d->nrofformats].nrofprops = 0;
+				d->nrofformats++;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	fclose (f);
+	/* formats without properties would make empty objects */
+	while (d->nrofformats > 0 &&
+	       d->formats[d->nrofformats-1].nrofprops == 0)
+		d->nrofformats--;
+	for (i = 0; i < d->nrofformats; i++) {
+		if (d->formats[i].nrofprops == 0)
+			d->formats[i] = d->formats[d->nrofformats-1];
+	}
+	return d->nrofformats > 0;
+}
+
+/* The unpackers, each returns the units it got out of the payload */
+
+static unsigned int
+unpack_opl (PTPParams *params, payload_t *p)
+{
+	MTPProperties	*props = NULL;
+	unsigned int	objects = 0;
+	int		n, i;
+
+	n = ptp_unpack_OPL (params, p->data, &props, p->len);
+	for (i = 0; i < n; i++) {
+		if (i == 0 || props[i].ObjectHandle != props[i-1].ObjectHandle)
+			objects++;
+	}
+	ptp_destroy_object_prop_list (props, n);
+	return objects;
+}
+
+static unsigned int
+unpack_oi (PTPParams *params, payload_t *p)
+{
+	PTPObjectInfo	oi;
+
+	memset (&oi, 0, sizeof(oi));
+	ptp_unpack_OI (params, p->data, &oi, p->len);
+	ptp_free_objectinfo (&oi);
+	return oi.StorageID != 0;
+}
+
+static unsigned int
+unpack_di (PTPParams *params, payload_t *p)
+{
+	PTPDeviceInfo	di;
+	int		ok;
+
+	ok = ptp_unpack_DI (params, p->data, &di, p->len);
+	ptp_free_DI (&di);
+	return ok;
+}
+
+static unsigned int
+unpack_dpv (PTPParams *params, payload_t *p)
+{
+	PTPPropertyValue	value;
+	unsigned int		offset = 0;
+	unsigned int		n = 0;
+
+	while (offset < p->len) {
+		memset (&value, 0, sizeof(value));
+		if (!ptp_unpack_DPV (params, p->data, &offset, p->len,
+				     &value, p->datatype))
+			break;
+		ptp_free_devicepropvalue (p->datatype, &value);
+		n++;
+	}
+	return n;
+}
+
+static unsigned int
+unpack_string (PTPParams *params, payload_t *p)
+{
+	unsigned int	offset = 0;
+	unsigned int	n = 0;
+	uint8_t		len;
+	char		*str;
+
+	while (offset < p->len) {
+		if (!ptp_unpack_string (params, p->data, offset, p->len,
+					&len, &str))
+			break;
+		free (str);
+		offset += len ? len*2 + 1 : 1;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Runs the unpacker over all payloads once to warm up, then in rounds
+ * until the time budget is spent.
+ */
+static void
+bench (PTPParams *params, char const *name, char const *unit,
+       unpack_fn fn, payload_t *p, int n)
+{
+	result_t	*r;
+	uint64_t	units = 0, bytes = 0, rounds = 0;
+	uint64_t	start, elapsed, batch;
+	unsigned long	allocs;
+	int		i;
+
+	if (n == 0 || nrofresults == MAX_RESULTS)
+		return;
+	for (i = 0; i < n; i++) {
+		units += p[i].units;
+		bytes += p[i].len;
+	}
+
+	start = now_usecs ();
+	for (i = 0; i < n; i++) {
+		if (fn (params, &p[i]) != p[i].units)
+			fprintf (stderr, "ptp-pack-bench: %s got %u of %u %ss out of %s\n",
+				 name, fn (params, &p[i]), p[i].units, unit, p[i].name);
+	}
+	elapsed = now_usecs () - start;
+	/* do not look at the clock more than about once a millisecond */
+	batch = elapsed >= 1000 ? 1 : 1000 / (elapsed + 1) + 1;
+
+	allocs = nrofallocs;
+	start = now_usecs ();
+	do {
+		uint64_t	b;
+
+		for (b = 0; b < batch; b++) {
+			for (i = 0; i < n; i++)
+				fn (params, &p[i]);
+		}
+		rounds += batch;
+		elapsed = now_usecs () - start;
+	} while (elapsed < budget);
+
+	r = &results[nrofresults++];
+	memset (r, 0, sizeof(*r));
+	snprintf (r->name, sizeof(r->name), "%s", name);
+	r->unit = unit;
+	r->units = units * rounds;
+	r->bytes = bytes * rounds;
+	r->usecs = elapsed;
+	r->allocs = nrofallocs - allocs;
+	fprintf (stderr, "ptp-pack-bench: %s, %u payloads, %llu rounds\n",
+		 name, n, (unsigned long long) rounds);
+}
+
+static void
+print_json (FILE *out, int utf8, uint32_t entries, int nroflogs)
+{
+	int	i;
+
+	fprintf (out, "{\n  \"strings\": \"%s\",\n", utf8 ? "utf8" : "iconv");
+	fprintf (out, "  \"opl_entries\": %u,\n", entries);
+	fprintf (out, "  \"logs\": %d,\n", nroflogs);
+	fprintf (out, "  \"results\": [");
+	for (i = 0; i < nrofresults; i++) {
+		result_t const	*r = &results[i];
+
+		fprintf (out, "%s\n    {\"name\": \"%s\", \"unit\": \"%s\", "
+			 "\"units\": %llu, \"bytes\": %llu, \"usecs\": %llu, "
+			 "\"ns_per_unit\": %.1f, \"allocs_per_unit\": %.2f, "
+			 "\"mb_per_sec\": %.1f}",
+			 i ? "," : "", r->name, r->unit,
+			 (unsigned long long) r->units,
+			 (unsigned long long) r->bytes,
+			 (unsigned long long) r->usecs,
+			 (double) r->usecs * 1000 / r->units,
+			 (double) r->allocs / r->units,
+			 r->usecs ? (double) r->bytes / r->usecs : 0.0);
+	}
+	fprintf (out, "\n  ]\n}\n");
+}
+
+static void
+print_csv (FILE *out)
+{
+	int	i;
+
+	fprintf (out, "name,unit,units,bytes,usecs,ns_per_unit,allocs_per_unit,mb_per_sec\n");
+	for (i = 0; i < nrofresults; i++) {
+		result_t const	*r = &results[i];
+
+		fprintf (out, "%s,%s,%llu,%llu,%llu,%.1f,%.2f,%.1f\n",
+			 r->name, r->unit,
+			 (unsigned long long) r->units,
+			 (unsigned long long) r->bytes,
+			 (unsigned long long) r->usecs,
+			 (double) r->usecs * 1000 / r->units,
+			 (double) r->allocs / r->units,
+			 r->usecs ? (double) r->bytes / r->usecs : 0.0);
+	}
+}
+
+/* Very large payloads are left out, fuzzers do badly with them */
+static void
+write_corpus (char const *dir, payload_t const *p, int n)
+{
+	char	path[1024];
+	FILE	*f;
+	int	i;
+
+	for (i = 0; i < n; i++) {
+		if (p[i].len > MAX_CORPUS_SIZE)
+			continue;
+		if (i > 0 && !strcmp (p[i].name, p[i-1].name))
+			continue;
+		snprintf (path, sizeof(path), "%s/%s.bin", dir, p[i].name);
+		f = fopen (path, "wb");
+		if (f == NULL) {
+			fprintf (stderr, "ptp-pack-bench: could not write %s: %s\n",
+				 path, strerror (errno));
+			continue;
+		}
+		fwrite (p[i].data, 1, p[i].len, f);
+		fclose (f);
+	}
+}
+
+/* Runs one corpus file through the unpacker its name starts with */
+static int
+replay_file (PTPParams *params, char const *dir, char const *name)
+{
+	static struct {
+		char const	*prefix;
+		unpack_fn	fn;
+	} const unpackers[] = {
+		{ "opl-", unpack_opl },
+		{ "oi-", unpack_oi },
+		{ "di-", unpack_di },
+		{ "dpv-", unpack_dpv },
+		{ "str-", unpack_string },
+	};
+	char		path[1024];
+	payload_t	p;
+	FILE		*f;
+	long		size;
+	unsigned int	i;
+
+	for (i = 0; i < sizeof(unpackers)/sizeof(unpackers[0]); i++) {
+		if (!strncmp (name, unpackers[i].prefix, strlen (unpackers[i].prefix)))
+			break;
+	}
+	if (i == sizeof(unpackers)/sizeof(unpackers[0]))
+		return 0;
+	payload_init (&p, name, 0);
+	/* dpv-<datatype in hex>-... */
+	if (unpackers[i].fn == unpack_dpv)
+		p.datatype = strtoul (name + 4, NULL, 16);
+
+	snprintf (path, sizeof(path), "%s/%s", dir, name);
+	f = fopen (path, "rb");
+	if (f == NULL)
+		return 0;
+	fseek (f, 0, SEEK_END);
+	size = ftell (f);
+	fseek (f, 0, SEEK_SET);
+	/* exactly the size of the file, so that reads past it are caught */
+	p.data = malloc (size ? size : 1);
+	if (p.data == NULL || fread (p.data, 1, size, f) != (size_t) size) {
+		fclose (f);
+		free (p.data);
+		return 0;
+	}
+	fclose (f);
+	p.len = size;
+	printf ("%s: %u\n", name, unpackers[i].fn (params, &p));
+	free (p.data);
+	return 1;
+}
+
+static int
+replay_corpus (PTPParams *params, char const *dir)
+{
+#ifdef HAVE_DIRENT_H
+	DIR		*d;
+	struct dirent	*e;
+	int		n = 0;
+
+	d = opendir (dir);
+	if (d == NULL) {
+		fprintf (stderr, "ptp-pack-bench: could not open %s: %s\n",
+			 dir, strerror (errno));
+		return 1;
+	}
+	while ((e = readdir (d)) != NULL)
+		n += replay_file (params, dir, e->d_name);
+	closedir (d);
+	fprintf (stderr, "ptp-pack-bench: replayed %d files\n", n);
+	return 0;
+#else
+	fprintf (stderr, "ptp-pack-bench: reading directories is not supported here\n");
+	return 1;
+#endif
+}
+
+/*
+ * Parses the captures in dir and builds a DeviceInfo and a property
+ * list payload for each one that lists its formats.
+ */
+static int
+load_logs (char const *dir, payload_t *di, payload_t *opl, uint32_t *entries)
+{
+	int	n = 0;
+#ifdef HAVE_DIRENT_H
+	devinfo_t	*d;
+	DIR		*dh;
+	struct dirent	*e;
+	char		path[1024];
+	char		name[80];
+
+	dh = opendir (dir);
+	if (dh == NULL) {
+		fprintf (stderr, "ptp-pack-bench: could not open %s: %s\n",
+			 dir, strerror (errno));
+		return 0;
+	}
+	d = malloc (sizeof(*d));
+	while (d != NULL && (e = readdir (dh)) != NULL && n < MAX_PAYLOADS) {
+		if (strncmp (e->d_name, "mtp-detect-", 11))
+			continue;
+		snprintf (path, sizeof(path), "%s/%s", dir, e->d_name);
+		if (!parse_log (path, d))
+			continue;
+		snprintf (name, sizeof(name), "di-%s", d->name);
+		payload_init (&di[n], name, 0);
+		build_di (&di[n], d);
+		snprintf (name, sizeof(name), "opl-%s", d->name);
+		payload_init (&opl[n], name, 0);
+		*entries += build_opl (&opl[n], d->formats, d->nrofformats,
+				       LOG_OPL_OBJECTS);
+		n++;
+	}
+	free (d);
+	closedir (dh);
+#else
+	fprintf (stderr, "ptp-pack-bench: reading directories is not supported here\n");
+#endif
+	return n;
+}
+
+static void
+usage (void)
+{
+	fprintf (stderr, "Usage: ptp-pack-bench [-c <dir>] [-f json|csv] [-i] [-l <dir>]\n"
+		 "                      [-n <entries>] [-o <dir>] [-t <msecs>]\n"
+		 "  -c  run the corpus files in dir through the unpackers once and exit\n"
+		 "  -f  output format, default json\n"
+		 "  -i  convert strings with iconv instead of the built in UTF-8 code\n"
+		 "  -l  also use the mtp-detect captures in dir\n"
+		 "  -n  entries in the synthetic property list, default 500000\n"
+		 "  -o  write the payloads to dir as a corpus\n"
+		 "  -t  time spent on each unpacker, default 100\n");
+	exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+	static uint16_t const dpv_types[] = {
+		PTP_DTC_UINT32, PTP_DTC_UINT64, PTP_DTC_UINT128,
+		PTP_DTC_STR, PTP_DTC_AUINT16,
+	};
+	PTPParams	params;
+	payload_t	*set, *logset;
+	char const	*corpus = NULL, *outdir = NULL, *logdir = NULL;
+	char		name[64];
+	uint32_t	entries = 500000, logentries = 0;
+	int		csv = 0, useiconv = 0;
+	int		nroflogs = 0;
+	int		opt, i, j;
+
+	while ((opt = getopt (argc, argv, "c:f:hil:n:o:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			corpus = optarg;
+			break;
+		case 'f':
+			if (!strcmp (optarg, "csv"))
+				csv = 1;
+			else if (strcmp (optarg, "json"))
+				usage ();
+			break;
+		case 'i':
+			useiconv = 1;
+			break;
+		case 'l':
+			logdir = optarg;
+			break;
+		case 'n':
+			entries = strtoul (optarg, NULL, 0);
+			break;
+		case 'o':
+			outdir = optarg;
+			break;
+		case 't':
+			budget = strtoull (optarg, NULL, 0) * 1000;
+			break;
+		default:
+			usage ();
+		}
+	}
+	if (entries < android_format.nrofprops)
+		usage ();
+
+	memset (&params, 0, sizeof(params));
+	params.byteorder = PTP_DL_LE;
+	params.debug_func = bench_debug;
+	params.utf8_strings = 1;
+	params.cd_ucs2_to_locale = (iconv_t) -1;
+	params.cd_locale_to_ucs2 = (iconv_t) -1;
+	if (useiconv) {
+#if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
+		params.utf8_strings = 0;
+		params.cd_ucs2_to_locale = iconv_open ("UTF-8", "UCS-2LE");
+		if (params.cd_ucs2_to_locale == (iconv_t) -1) {
+			fprintf (stderr, "ptp-pack-bench: no UCS-2 to UTF-8 iconv\n");
+			return 1;
+		}
+#else
+		fprintf (stderr, "ptp-pack-bench: built without iconv\n");
+		return 1;
+#endif
+	}
+
+	if (corpus != NULL)
+		return replay_corpus (&params, corpus);
+
+	set = calloc (MAX_PAYLOADS, sizeof(payload_t));
+	logset = calloc (MAX_PAYLOADS, sizeof(payload_t));
+	if (set == NULL || logset == NULL) {
+		fprintf (stderr, "ptp-pack-bench: out of memory\n");
+		return 1;
+	}
+
+	/* a full listing of an Android phone */
+	payload_init (&set[0], "opl-synthetic", 0);
+	build_opl (&set[0], &android_format, 1,
+		   entries / android_format.nrofprops);
+	if (outdir != NULL)
+		write_corpus (outdir, set, 1);
+	bench (&params, "opl", "object", unpack_opl, set, 1);
+	payloads_free (set, 1);
+
+	/* ObjectInfo datasets as the fallback listing gets them */
+	for (i = 0; i < MAX_PAYLOADS; i++) {
+		PTPObjectInfo	oi;
+		unsigned char	*data;
+		char		filename[64];
+
+		memset (&oi, 0, sizeof(oi));
+		oi.StorageID = 0x00010001;
+		oi.ObjectFormat = PTP_OFC_EXIF_JPEG;
+		oi.ObjectCompressedSize = 1234567 + i;
+		oi.ParentObject = i / 32;
+		snprintf (filename, sizeof(filename), i % 8 == 7 ?
+			  "Caf\xc3\xa9 %06u.jpg" : "IMG_20160102_%06u.jpg", i);
+		oi.Filename = filename;
+		oi.ModificationDate = 1451703845 + i;
+		payload_init (&set[i], "oi-synthetic", 0);
+		set[i].len = set[i].alloc = ptp_pack_OI (&params, &oi, &data);
+		set[i].data = data;
+		set[i].units = 1;
+	}
+	if (outdir != NULL)
+		write_corpus (outdir, set, MAX_PAYLOADS);
+	bench (&params, "oi", "object", unpack_oi, set, MAX_PAYLOADS);
+	payloads_free (set, MAX_PAYLOADS);
+
+	{
+		devinfo_t	*d = malloc (sizeof(*d));
+
+		if (d == NULL)
+			return 1;
+		synthetic_devinfo (d);
+		payload_init (&set[0], "di-synthetic", 0);
+		build_di (&set[0], d);
+		free (d);
+	}
+	if (outdir != NULL)
+		write_corpus (outdir, set, 1);
+	bench (&params, "di", "deviceinfo", unpack_di, set, 1);
+	payloads_free (set, 1);
+
+	/* runs of 1024 values of each type */
+	for (i = 0; i < (int) (sizeof(dpv_types)/sizeof(dpv_types[0])); i++) {
+		uint16_t	dt = dpv_types[i];
+		char const	*tname = dt == PTP_DTC_STR ? "str" :
+			dt == PTP_DTC_AUINT16 ? "auint16" :
+			dt == PTP_DTC_UINT128 ? "uint128" :
+			dt == PTP_DTC_UINT64 ? "uint64" : "uint32";
+
+		snprintf (name, sizeof(name), "dpv-%04x-%s", dt, tname);
+		payload_init (&set[0], name, dt);
+		for (j = 0; j < 1024; j++) {
+			if (dt == PTP_DTC_AUINT16) {
+				int	k;
+
+				put32 (&set[0], 32);
+				for (k = 0; k < 32; k++)
+					put16 (&set[0], 0x5000 + k);
+			} else
+				put_value (&set[0], PTP_OPC_Name, dt, 0, j);
+		}
+		set[0].units = 1024;
+		if (outdir != NULL)
+			write_corpus (outdir, set, 1);
+		snprintf (name, sizeof(name), "dpv_%s", tname);
+		bench (&params, name, "value", unpack_dpv, set, 1);
+		payloads_free (set, 1);
+	}
+
+	/* runs of 1024 strings, all ASCII or all not */
+	for (i = 0; i < 2; i++) {
+		payload_init (&set[0], i ? "str-nonascii" : "str-ascii", 0);
+		for (j = 0; j < 1024; j++) {
+			snprintf (name, sizeof(name), i ?
+				  "Caf\xc3\xa9 \xe6\x97\xa5\xe6\x9c\xac %06u.mp3" :
+				  "IMG_20160102_%06u.jpg", j);
+			put_string (&set[0], name);
+		}
+		set[0].units = 1024;
+		if (outdir != NULL)
+			write_corpus (outdir, set, 1);
+		bench (&params, i ? "string_nonascii" : "string_ascii",
+		       "string", unpack_string, set, 1);
+		payloads_free (set, 1);
+	}
+
+	if (logdir != NULL) {
+		nroflogs = load_logs (logdir, set, logset, &logentries);
+		if (outdir != NULL) {
+			write_corpus (outdir, set, nroflogs);
+			write_corpus (outdir, logset, nroflogs);
+		}
+		bench (&params, "di_logs", "deviceinfo", unpack_di, set, nroflogs);
+		bench (&params, "opl_logs", "object", unpack_opl, logset, nroflogs);
+		payloads_free (set, nroflogs);
+		payloads_free (logset, nroflogs);
+	}
+	free (set);
+	free (logset);
+
+	if (csv)
+		print_csv (stdout);
+	else
+		print_json (stdout, !useiconv, entries, nroflogs);
+#if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
+	if (params.cd_ucs2_to_locale != (iconv_t) -1)
+		iconv_close (params.cd_ucs2_to_locale);
+#endif
+	return 0;
+}
@@ -33,6 +33,11 @@
 #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
 #include <iconv.h>
 #endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 static inline uint16_t
 htod16p (PTPParams *params, uint16_t var)
@@ -125,6 +130,97 @@ dtoh64ap (PTPParams *params, const unsigned char *a)
 #define dtoh32(x)	dtoh32p(params,x)
 #define dtoh64(x)	dtoh64p(params,x)
 
+/*
+ * Bulk conversion of device arrays, for the handle lists, storage ids
+ * and references that can run into hundreds of thousands of entries.
+ * The byte order is decided once per array instead of once per
+ * element: a plain copy when device and host agree, which is the
+ * common little endian case, else a vector byte swap where available.
+ */
+static inline int
+ptp_dtoh_needs_swap (PTPParams *params)
+{
+#ifdef WORDS_BIGENDIAN
+	return params->byteorder == PTP_DL_LE;
+#else
+	return params->byteorder != PTP_DL_LE;
+#endif
+}
+
+/* Single values with the byte order decided by the caller, for loops */
+static inline uint32_t
+ptp_dtoh32_swap (int swap, const unsigned char *a)
+{
+	uint32_t v;
+
+	memcpy (&v, a, sizeof(v));
+	if (swap)
+		v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+	return v;
+}
+
+static inline uint16_t
+ptp_dtoh16_swap (int swap, const unsigned char *a)
+{
+	uint16_t v;
+
+	memcpy (&v, a, sizeof(v));
+	if (swap)
+		v = (v >> 8) | (v << 8);
+	return v;
+}
+
+static inline void
+ptp_unpack_uint32_t_block (PTPParams *params, uint32_t *dst, const unsigned char *src, uint32_t n)
+{
+	uint32_t i = 0;
+
+	if (!ptp_dtoh_needs_swap (params)) {
+		memcpy (dst, src, n*sizeof(uint32_t));
+		return;
+	}
+#if defined(__SSE2__)
+	for (; i+4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *)(src + 4*i));
+
+		/* swap the bytes in each half, then the halves */
+		v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+		v = _mm_shufflelo_epi16 (v, _MM_SHUFFLE(2,3,0,1));
+		v = _mm_shufflehi_epi16 (v, _MM_SHUFFLE(2,3,0,1));
+		_mm_storeu_si128 ((__m128i *)(dst + i), v);
+	}
+#elif defined(__ARM_NEON)
+	for (; i+4 <= n; i += 4)
+		vst1q_u32 (dst + i, vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (src + 4*i))));
+#endif
+	for (; i < n; i++)
+		dst[i] = dtoh32a(src + 4*i);
+}
+
+static inline void
+ptp_unpack_uint16_t_block (PTPParams *params, uint16_t *dst, const unsigned char *src, uint32_t n)
+{
+	uint32_t i = 0;
+
+	if (!ptp_dtoh_needs_swap (params)) {
+		memcpy (dst, src, n*sizeof(uint16_t));
+		return;
+	}
+#if defined(__SSE2__)
+	for (; i+8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *)(src + 2*i));
+
+		v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+		_mm_storeu_si128 ((__m128i *)(dst + i), v);
+	}
+#elif defined(__ARM_NEON)
+	for (; i+8 <= n; i += 8)
+		vst1q_u16 (dst + i, vreinterpretq_u16_u8 (vrev16q_u8 (vld1q_u8 (src + 2*i))));
+#endif
+	for (; i < n; i++)
+		dst[i] = dtoh16a(src + 2*i);
+}
+
 
 /*
  * PTP strings ... if the size field is:
@@ -162,6 +258,19 @@ ptp_unpack_string(PTPParams *params, unsigned char* data, uint32_t offset, uint3
 
 	*len = length;
 
+	if (params->utf8_strings) {
+		int n = ptp_ucs2_to_utf8 (&data[offset+1], length,
+					  loclstr, sizeof(loclstr));
+
+		if (n >= 0) {
+			*retstr = malloc (n+1);
+			if (*retstr)
+				memcpy (*retstr, loclstr, n+1);
+			return 1;
+		}
+		/* not valid UTF-16, let the slow path make the best of it */
+	}
+
 	/* copy to string[] to ensure correct alignment for iconv(3) */
 	memcpy(string, &data[offset+1], length * sizeof(string[0]));
 	string[length] = 0x0000U;   /* be paranoid!  add a terminator. */
@@ -214,13 +323,20 @@ ptp_pack_string(PTPParams *params, char *string, unsigned char* data, uint16_t o
 	size_t convlen = strlen(string);
 
 	/* Cannot exceed 255 (PTP_MAXSTRLEN) since it is a single byte, duh ... */
-	memset(ucs2strp, 0, sizeof(ucs2str));  /* XXX: necessary? */
+	if (params->utf8_strings) {
+		int n = ptp_utf8_to_ucs2 (string, convlen,
+					  (unsigned char *) ucs2str, PTP_MAXSTRLEN);
+
+		/* invalid or too long, like a failing iconv */
+		ucs2str[n < 0 ? 0 : n] = 0x0000U;
+	} else
 #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
 	if (params->cd_locale_to_ucs2 != (iconv_t)-1) {
 		size_t nconv;
 		size_t convmax = PTP_MAXSTRLEN * 2; /* Includes the terminator */
 		char *stringp = string;
 
+		memset(ucs2strp, 0, sizeof(ucs2str));  /* XXX: necessary? */
 		nconv = iconv(params->cd_locale_to_ucs2, &stringp, &convlen,
 			&ucs2strp, &convmax);
 		if (nconv == (size_t) -1)
@@ -284,7 +400,7 @@ ptp_get_packed_stringcopy(PTPParams *params, char *string, uint32_t *packed_size
 static inline uint32_t
 ptp_unpack_uint32_t_array(PTPParams *params, unsigned char* data, unsigned int offset, unsigned int datalen, uint32_t **array)
 {
-	uint32_t n, i=0;
+	uint32_t n;
 
 	if (!data)
 		return 0;
@@ -310,8 +426,7 @@ ptp_unpack_uint32_t_array(PTPParams *params, unsigned char* data, unsigned int o
 	*array = malloc (n*sizeof(uint32_t));
 	if (!*array)
 		return 0;
-	for (i=0;i<n;i++)
-		(*array)[i]=dtoh32a(&data[offset+(sizeof(uint32_t)*(i+1))]);
+	ptp_unpack_uint32_t_block (params, *array, &data[offset+sizeof(uint32_t)], n);
 	return n;
 }
 
@@ -332,7 +447,7 @@ ptp_pack_uint32_t_array(PTPParams *params, uint32_t *array, uint32_t arraylen, u
 static inline uint32_t
 ptp_unpack_uint16_t_array(PTPParams *params, unsigned char* data, unsigned int offset, unsigned int datalen, uint16_t **array)
 {
-	uint32_t n, i=0;
+	uint32_t n;
 
 	if (!data)
 		return 0;
@@ -355,8 +470,7 @@ ptp_unpack_uint16_t_array(PTPParams *params, unsigned char* data, unsigned int o
 	*array = malloc (n*sizeof(uint16_t));
 	if (!*array)
 		return 0;
-	for (i=0;i<n;i++)
-		(*array)[i]=dtoh16a(&data[offset+(sizeof(uint16_t)*(i+2))]);
+	ptp_unpack_uint16_t_block (params, *array, &data[offset+sizeof(uint32_t)], n);
 	return n;
 }
 
@@ -1460,6 +1574,8 @@ ptp_unpack_OPL (PTPParams *params, unsigned char* data, MTPProperties **pprops,
 	uint32_t prop_count;
 	MTPProperties *props = NULL;
 	unsigned int offset = 0, i;
+	/* decided once, the header fields are read for every property */
+	const int swap = ptp_dtoh_needs_swap (params);
 
 	if (len < sizeof(uint32_t)) {
 		ptp_debug (params ,"must have at least 4 bytes data, not %d", len);
@@ -1492,15 +1608,15 @@ ptp_unpack_OPL (PTPParams *params, unsigned char* data, MTPProperties **pprops,
 		}
 
 
-		props[i].ObjectHandle = dtoh32a(data);
+		props[i].ObjectHandle = ptp_dtoh32_swap(swap, data);
 		data += sizeof(uint32_t);
 		len -= sizeof(uint32_t);
 
-		props[i].property = dtoh16a(data);
+		props[i].property = ptp_dtoh16_swap(swap, data);
 		data += sizeof(uint16_t);
 		len -= sizeof(uint16_t);
 
-		props[i].datatype = dtoh16a(data);
+		props[i].datatype = ptp_dtoh16_swap(swap, data);
 		data += sizeof(uint16_t);
 		len -= sizeof(uint16_t);
 
@@ -0,0 +1,269 @@
+/**
+ * \file ptp-ring.c
+ * A fixed size in-memory ring of binary transaction events, and the
+ * decoder for its dumps.
+ *
+ * Adding a record is a timestamp and five stores into memory that was
+ * set up with the device, so it can stay on for every chunk of a big
+ * transfer where the formatted USB debug output and hex dumps would
+ * slow it down by an order of magnitude. The ring is written out with
+ * LIBMTP_Dump_Trace_Ring(), or when the device is released if
+ * LIBMTP_TRACE_RING names a file, and turned into readable text with
+ * mtp-ringdump.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+#include "ptp-ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+#include <time.h>
+
+#define PTP_RING_HEADER_LEN	24
+#define PTP_RING_RECORD_LEN	24
+
+static uint16_t
+get16 (unsigned char const *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+get32 (unsigned char const *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+#ifdef ENABLE_TRACE_RING
+
+static void
+put16 (unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void
+put32 (unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = v >> 24;
+}
+
+static uint64_t
+ring_now (void)
+{
+#ifdef HAVE_SYS_TIME_H
+	struct timeval	tv;
+
+	gettimeofday (&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	return (uint64_t)time (NULL) * 1000000;
+#endif
+}
+
+/**
+ * ptp_ring_open:
+ *
+ * Sets up an empty ring for a device, recording starts right away.
+ *
+ * params:	PTPParams*
+ *
+ * Return values: Some PTP_RC_* code.
+ *
+ **/
+uint16_t
+ptp_ring_open (PTPParams *params)
+{
+	PTPRing	*ring = malloc (sizeof(PTPRing));
+
+	if (!ring)
+		return PTP_ERROR_IO;
+	ring->start = ring_now ();
+	ring->head = 0;
+	params->ring = ring;
+	return PTP_RC_OK;
+}
+
+void
+ptp_ring_add (PTPRing *ring, uint16_t type, uint16_t code,
+	      uint32_t transid, uint32_t arg, uint32_t len)
+{
+	PTPRingEntry	*e = &ring->entries[ring->head++ & (PTP_RING_ENTRIES - 1)];
+
+	e->usecs	= ring_now () - ring->start;
+	e->type		= type;
+	e->code		= code;
+	e->transid	= transid;
+	e->arg		= arg;
+	e->len		= len;
+}
+
+/**
+ * ptp_ring_dump:
+ *
+ * Writes the records in the ring to a file, oldest first. The ring is
+ * left as it is, so it can be dumped again later.
+ *
+ * params:	PTPParams*
+ *		const char *path	- file to write
+ *
+ * Return values: Some PTP_RC_* code.
+ *
+ **/
+uint16_t
+ptp_ring_dump (PTPParams *params, const char *path)
+{
+	PTPRing		*ring = (PTPRing *) params->ring;
+	unsigned char	buf[PTP_RING_HEADER_LEN];
+	uint32_t	first, count, i;
+	FILE		*f;
+
+	if (!ring)
+		return PTP_ERROR_BADPARAM;
+	f = fopen (path, "wb");
+	if (!f)
+		return PTP_ERROR_IO;
+	count = ring->head < PTP_RING_ENTRIES ? ring->head : PTP_RING_ENTRIES;
+	first = ring->head - count;
+	memcpy (buf, PTP_RING_MAGIC, 8);
+	put32 (buf + 8, PTP_RING_VERSION);
+	put32 (buf + 12, params->deviceinfo.VendorExtensionID);
+	put32 (buf + 16, count);
+	put32 (buf + 20, first);
+	fwrite (buf, sizeof(buf), 1, f);
+	for (i = 0; i < count; i++) {
+		PTPRingEntry	*e = &ring->entries[(first + i) & (PTP_RING_ENTRIES - 1)];
+		unsigned char	rec[PTP_RING_RECORD_LEN];
+
+		put32 (rec, e->usecs & 0xffffffff);
+		put32 (rec + 4, e->usecs >> 32);
+		put16 (rec + 8, e->type);
+		put16 (rec + 10, e->code);
+		put32 (rec + 12, e->transid);
+		put32 (rec + 16, e->arg);
+		put32 (rec + 20, e->len);
+		fwrite (rec, sizeof(rec), 1, f);
+	}
+	if (fclose (f) != 0)
+		return PTP_ERROR_IO;
+	return PTP_RC_OK;
+}
+
+void
+ptp_ring_close (PTPParams *params)
+{
+	char const	*path = getenv ("LIBMTP_TRACE_RING");
+
+	if (!params->ring)
+		return;
+	if (path != NULL)
+		ptp_ring_dump (params, path);
+	free (params->ring);
+	params->ring = NULL;
+}
+
+#endif /* ENABLE_TRACE_RING */
+
+/**
+ * ptp_ring_decode:
+ * const char *path	- ring dump to read
+ * FILE *out		- where to write the text
+ *
+ * Prints a dump written by ptp_ring_dump() one record per line, with
+ * the operation, response and event names the device would have
+ * shown in the debug output.
+ *
+ * Return values: 0 on success, -1 if this is not a ring dump.
+ **/
+int
+ptp_ring_decode (const char *path, FILE *out)
+{
+	static PTPParams	names;
+	unsigned char		buf[PTP_RING_HEADER_LEN];
+	unsigned char		rec[PTP_RING_RECORD_LEN];
+	uint32_t		count, i;
+	FILE			*f = fopen (path, "rb");
+
+	if (!f)
+		return -1;
+	if (fread (buf, sizeof(buf), 1, f) != 1 ||
+	    memcmp (buf, PTP_RING_MAGIC, 8) ||
+	    get32 (buf + 8) != PTP_RING_VERSION) {
+		fclose (f);
+		return -1;
+	}
+	/* the name lookups only look at the vendor extension */
+	names.deviceinfo.VendorExtensionID = get32 (buf + 12);
+	count = get32 (buf + 16);
+	fprintf (out, "%u records", count);
+	if (get32 (buf + 20))
+		fprintf (out, ", %u older ones were overwritten", get32 (buf + 20));
+	fprintf (out, "\n");
+
+	for (i = 0; i < count && fread (rec, sizeof(rec), 1, f) == 1; i++) {
+		uint64_t	usecs = get32 (rec) | ((uint64_t)get32 (rec + 4) << 32);
+		uint16_t	code = get16 (rec + 10);
+		uint32_t	transid = get32 (rec + 12);
+		uint32_t	arg = get32 (rec + 16);
+		uint32_t	len = get32 (rec + 20);
+		const char	*txt;
+
+		fprintf (out, "%6lu.%06lu ", (unsigned long)(usecs / 1000000),
+			 (unsigned long)(usecs % 1000000));
+		switch (get16 (rec + 8)) {
+		case PTP_RING_REQUEST:
+			fprintf (out, "REQUEST: 0x%04x, %s, transaction %u",
+				 code, ptp_get_opcode_name (&names, code), transid);
+			if (len)
+				fprintf (out, ", param1 0x%08x (%u params)", arg, len);
+			fprintf (out, "\n");
+			break;
+		case PTP_RING_RESPONSE:
+			txt = ptp_strerror (code, names.deviceinfo.VendorExtensionID);
+			fprintf (out, "RESPONSE: 0x%04x, %s, transaction %u\n",
+				 code, txt ? txt : "Unknown", transid);
+			break;
+		case PTP_RING_READ:
+			fprintf (out, "<==USB IN %u bytes\n", len);
+			break;
+		case PTP_RING_WRITE:
+			fprintf (out, "USB OUT==> %u bytes\n", len);
+			break;
+		case PTP_RING_CANCEL:
+			fprintf (out, "CANCEL: transaction %u\n", transid);
+			break;
+		case PTP_RING_EVENT:
+			fprintf (out, "EVENT: 0x%04x, %s, param1 0x%08x\n", code,
+				 ptp_get_event_code_name (&names, code), arg);
+			break;
+		default:
+			fprintf (out, "unknown record type %u\n", get16 (rec + 8));
+			break;
+		}
+	}
+	fclose (f);
+	return 0;
+}
@@ -0,0 +1,96 @@
+/**
+ * \file ptp-ring.h
+ * A fixed size in-memory ring of binary transaction events, for
+ * tracing a session without formatting anything on the hot path.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __MTP__PTP_RING__H
+#define __MTP__PTP_RING__H
+
+#include "ptp.h"
+
+#include <stdio.h>
+
+/*
+ * Dump file layout, all values little endian:
+ *
+ * header:  "MTPRING\0", u32 version, u32 vendor extension id,
+ *          u32 number of records, u32 records lost to wrapping
+ * records: u64 usecs since the ring was set up, u16 type, u16 code,
+ *          u32 transaction id, u32 argument, u32 length
+ *
+ * The code is the operation, response or event code. For REQUEST and
+ * EVENT the argument is the first parameter and the length the number
+ * of parameters, for RESPONSE the argument is the first parameter of
+ * the response, for READ and WRITE the length is the size of the chunk
+ * moved. The oldest records are overwritten once the ring is full.
+ */
+#define PTP_RING_MAGIC		"MTPRING"
+#define PTP_RING_VERSION	1
+
+#define PTP_RING_REQUEST	1
+#define PTP_RING_RESPONSE	2
+#define PTP_RING_READ		3	/* one chunk of received data */
+#define PTP_RING_WRITE		4	/* one chunk of sent data */
+#define PTP_RING_CANCEL		5
+#define PTP_RING_EVENT		6
+
+/* number of records kept, a power of two */
+#define PTP_RING_ENTRIES	4096
+
+typedef struct _PTPRingEntry PTPRingEntry;
+struct _PTPRingEntry {
+	uint64_t	usecs;
+	uint16_t	type;
+	uint16_t	code;
+	uint32_t	transid;
+	uint32_t	arg;
+	uint32_t	len;
+};
+
+typedef struct _PTPRing PTPRing;
+struct _PTPRing {
+	uint64_t	start;
+	uint32_t	head;	/* records ever added */
+	PTPRingEntry	entries[PTP_RING_ENTRIES];
+};
+
+/*
+ * Recording is only compiled in with --enable-trace-ring, otherwise
+ * PTP_RING() expands to nothing at all.
+ */
+#ifdef ENABLE_TRACE_RING
+#define PTP_RING(params, type, code, transid, arg, len) \
+	do { \
+		if ((params)->ring != NULL) \
+			ptp_ring_add ((params)->ring, type, code, transid, \
+				      arg, len); \
+	} while (0)
+
+uint16_t ptp_ring_open		(PTPParams *params);
+void ptp_ring_add		(PTPRing *ring, uint16_t type, uint16_t code,
+				 uint32_t transid, uint32_t arg, uint32_t len);
+uint16_t ptp_ring_dump		(PTPParams *params, const char *path);
+void ptp_ring_close		(PTPParams *params);
+#else
+#define PTP_RING(params, type, code, transid, arg, len) do { } while (0)
+#endif
+
+int ptp_ring_decode		(const char *path, FILE *out);
+
+#endif //__MTP__PTP_RING__H
@@ -0,0 +1,701 @@
+/**
+ * \file ptp-trace.c
+ * Recording of PTP sessions to a trace file and a transport that
+ * replays them without the device.
+ *
+ * Recording hooks in between PTPParams and the real transport, so it
+ * sees exactly what the device sent. Replaying installs IO functions
+ * that serve the recorded answers in order, at memory speed or with
+ * the recorded timing, which makes it possible to profile the parsing
+ * and caching paths on a machine without any device attached.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+#include "ptp-trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+#include <time.h>
+
+#define PTP_TRACE_HEADER_LEN	28
+#define PTP_TRACE_RECORD_LEN	40
+
+typedef struct _PTPTraceRecord PTPTraceRecord;
+struct _PTPTraceRecord {
+	uint8_t		type;
+	uint8_t		nparam;
+	uint16_t	code;
+	uint16_t	ret;
+	uint32_t	transid;
+	uint32_t	delta;
+	uint32_t	param[5];
+	uint32_t	len;
+};
+
+struct _PTPTrace {
+	FILE		*f;
+	int		replay;
+	int		timed;
+	uint64_t	last;		/* usecs of the previous record */
+	/* the transport we record, or what stood there before replay */
+	PTPIOSendReq	sendreq_func;
+	PTPIOSendData	senddata_func;
+	PTPIOGetResp	getresp_func;
+	PTPIOGetData	getdata_func;
+	PTPIOCancelReq	cancelreq_func;
+	PTPIODevStatReq	devstatreq_func;
+	/* replay: the next record, read ahead, and its payload */
+	PTPTraceRecord	next;
+	int		havenext;
+	uint32_t	reqtransid;	/* recorded id of the current request */
+	unsigned char	*payload;
+	uint32_t	payload_alloc;
+};
+typedef struct _PTPTrace PTPTrace;
+
+static uint64_t
+trace_now (void)
+{
+#ifdef HAVE_SYS_TIME_H
+	struct timeval	tv;
+
+	gettimeofday (&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	return (uint64_t)time (NULL) * 1000000;
+#endif
+}
+
+static void
+put16 (unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void
+put32 (unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = v >> 24;
+}
+
+static uint16_t
+get16 (unsigned char const *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+get32 (unsigned char const *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void
+trace_container_params (PTPContainer const *ptp, uint32_t *param)
+{
+	param[0] = ptp->Param1;
+	param[1] = ptp->Param2;
+	param[2] = ptp->Param3;
+	param[3] = ptp->Param4;
+	param[4] = ptp->Param5;
+}
+
+static void
+trace_write (PTPTrace *t, uint8_t type, PTPContainer const *ptp,
+	     uint16_t ret, uint32_t const *param,
+	     unsigned char const *payload, uint32_t len)
+{
+	unsigned char	buf[PTP_TRACE_RECORD_LEN];
+	uint64_t	now = trace_now ();
+	uint64_t	delta = now >= t->last ? now - t->last : 0;
+	unsigned int	i;
+
+	if (!t->f)
+		return;
+	t->last = now;
+	memset (buf, 0, sizeof(buf));
+	buf[0] = type;
+	if (ptp) {
+		buf[1] = ptp->Nparam;
+		put16 (buf + 2, ptp->Code);
+		put32 (buf + 8, ptp->Transaction_ID);
+	}
+	put16 (buf + 4, ret);
+	put32 (buf + 12, delta > 0xffffffffU ? 0xffffffffU : (uint32_t)delta);
+	if (param)
+		for (i=0;i<5;i++)
+			put32 (buf + 16 + 4*i, param[i]);
+	put32 (buf + 36, len);
+	if (fwrite (buf, sizeof(buf), 1, t->f) != 1 ||
+	    (len && fwrite (payload, len, 1, t->f) != 1)) {
+		/* a full disk should not take the session down with it */
+		fclose (t->f);
+		t->f = NULL;
+	}
+}
+
+/* Recording: pass everything on and write down what happened */
+
+static uint16_t
+trace_sendreq (PTPParams* params, PTPContainer* req, int dataphase)
+{
+	PTPTrace	*t = (PTPTrace *) params->trace;
+	uint16_t	ret = t->sendreq_func (params, req, dataphase);
+	uint32_t	param[5];
+
+	trace_container_params (req, param);
+	trace_write (t, PTP_TRACE_REQUEST, req, ret, param, NULL, 0);
+	return ret;
+}
+
+static uint16_t
+trace_senddata (PTPParams* params, PTPContainer* ptp, uint64_t size,
+		PTPDataHandler *handler)
+{
+	PTPTrace	*t = (PTPTrace *) params->trace;
+	uint16_t	ret = t->senddata_func (params, ptp, size, handler);
+	uint32_t	param[5] = { size & 0xffffffffU, size >> 32, 0, 0, 0 };
+
+	trace_write (t, PTP_TRACE_SENDDATA, ptp, ret, param, NULL, 0);
+	return ret;
+}
+
+typedef struct {
+	PTPTrace	*trace;
+	PTPDataHandler	*handler;
+} PTPTraceTee;
+
+static uint16_t
+trace_tee_putfunc (PTPParams* params, void *priv, unsigned long sendlen,
+		   unsigned char *data)
+{
+	PTPTraceTee	*tee = (PTPTraceTee *) priv;
+
+	trace_write (tee->trace, PTP_TRACE_DATA, NULL, PTP_RC_OK, NULL,
+		     data, sendlen);
+	return tee->handler->putfunc (params, tee->handler->priv, sendlen, data);
+}
+
+static unsigned char *
+trace_tee_getbuffunc (PTPParams* params, void *priv, unsigned long offset,
+		      unsigned long wantlen)
+{
+	PTPTraceTee	*tee = (PTPTraceTee *) priv;
+
+	if (!tee->handler->getbuffunc)
+		return NULL;
+	return tee->handler->getbuffunc (params, tee->handler->priv, offset, wantlen);
+}
+
+static uint16_t
+trace_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
+{
+	PTPTrace	*t = (PTPTrace *) params->trace;
+	PTPTraceTee	tee;
+	PTPDataHandler	teehandler;
+	uint16_t	ret;
+
+	tee.trace = t;
+	tee.handler = handler;
+	teehandler.getfunc = handler->getfunc;
+	teehandler.putfunc = trace_tee_putfunc;
+	teehandler.getbuffunc = trace_tee_getbuffunc;
+	teehandler.priv = &tee;
+	ret = t->getdata_func (params, ptp, &teehandler);
+	trace_write (t, PTP_TRACE_GETDATA, ptp, ret, NULL, NULL, 0);
+	return ret;
+}
+
+static uint16_t
+trace_getresp (PTPParams* params, PTPContainer* resp)
+{
+	PTPTrace	*t = (PTPTrace *) params->trace;
+	uint16_t	ret = t->getresp_func (params, resp);
+	uint32_t	param[5];
+
+	trace_container_params (resp, param);
+	trace_write (t, PTP_TRACE_RESPONSE, resp, ret, param, NULL, 0);
+	return ret;
+}
+
+static uint16_t
+trace_cancelreq (PTPParams* params, uint32_t transid)
+{
+	PTPTrace	*t = (PTPTrace *) params->trace;
+	uint16_t	ret = t->cancelreq_func (params, transid);
+	uint32_t	param[5] = { transid, 0, 0, 0, 0 };
+
+	trace_write (t, PTP_TRACE_CANCEL, NULL, ret, param, NULL, 0);
+	return ret;
+}
+
+static uint16_t
+trace_devstatreq (PTPParams* params)
+{
+	PTPTrace	*t = (PTPTrace *) params->trace;
+	uint16_t	ret = t->devstatreq_func (params);
+
+	trace_write (t, PTP_TRACE_DEVSTATUS, NULL, ret, NULL, NULL, 0);
+	return ret;
+}
+
+static void
+trace_hook (PTPParams *params, PTPTrace *t)
+{
+	t->sendreq_func = params->sendreq_func;
+	t->senddata_func = params->senddata_func;
+	t->getresp_func = params->getresp_func;
+	t->getdata_func = params->getdata_func;
+	t->cancelreq_func = params->cancelreq_func;
+	t->devstatreq_func = params->devstatreq_func;
+	params->sendreq_func = trace_sendreq;
+	params->senddata_func = trace_senddata;
+	params->getresp_func = trace_getresp;
+	params->getdata_func = trace_getdata;
+	if (t->cancelreq_func)
+		params->cancelreq_func = trace_cancelreq;
+	if (t->devstatreq_func)
+		params->devstatreq_func = trace_devstatreq;
+}
+
+/**
+ * ptp_trace_record:
+ * params:	PTPParams*
+ *		const char *path	- trace file to write
+ *		PTPTraceDevice *dev	- the device being recorded
+ *
+ * Starts recording everything that goes over the transport installed
+ * in params into a trace file, to be replayed with ptp_trace_replay().
+ * Call it after the transport is set up; calling it again after the
+ * transport has been set up anew hooks in again and keeps recording
+ * into the same file.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_trace_record (PTPParams *params, const char *path, PTPTraceDevice const *dev)
+{
+	PTPTrace	*t = (PTPTrace *) params->trace;
+	unsigned char	buf[PTP_TRACE_HEADER_LEN];
+
+	if (t) {
+		if (t->replay)
+			return PTP_ERROR_BADPARAM;
+		/* the transport was set up again, hook in again */
+		if (params->sendreq_func != trace_sendreq)
+			trace_hook (params, t);
+		return PTP_RC_OK;
+	}
+	t = calloc (1, sizeof(PTPTrace));
+	if (!t)
+		return PTP_RC_GeneralError;
+	t->f = fopen (path, "wb");
+	if (!t->f) {
+		ptp_error (params, "PTP: could not create trace file %s", path);
+		free (t);
+		return PTP_RC_GeneralError;
+	}
+	memset (buf, 0, sizeof(buf));
+	memcpy (buf, PTP_TRACE_MAGIC, 8);
+	put32 (buf + 8, PTP_TRACE_VERSION);
+	put16 (buf + 12, dev->vendor_id);
+	put16 (buf + 14, dev->product_id);
+	put32 (buf + 16, dev->device_flags);
+	put16 (buf + 20, dev->bcdusb);
+	put16 (buf + 22, dev->inep_maxpacket);
+	put16 (buf + 24, dev->outep_maxpacket);
+	if (fwrite (buf, sizeof(buf), 1, t->f) != 1) {
+		fclose (t->f);
+		free (t);
+		return PTP_RC_GeneralError;
+	}
+	t->last = trace_now ();
+	params->trace = t;
+	trace_hook (params, t);
+	return PTP_RC_OK;
+}
+
+/* Replaying: serve the recorded answers in order */
+
+static int
+trace_read_header (FILE *f, PTPTraceDevice *dev)
+{
+	unsigned char	buf[PTP_TRACE_HEADER_LEN];
+
+	if (fread (buf, sizeof(buf), 1, f) != 1)
+		return -1;
+	if (memcmp (buf, PTP_TRACE_MAGIC, 8) || get32 (buf + 8) != PTP_TRACE_VERSION)
+		return -1;
+	dev->vendor_id = get16 (buf + 12);
+	dev->product_id = get16 (buf + 14);
+	dev->device_flags = get32 (buf + 16);
+	dev->bcdusb = get16 (buf + 20);
+	dev->inep_maxpacket = get16 (buf + 22);
+	dev->outep_maxpacket = get16 (buf + 24);
+	return 0;
+}
+
+/**
+ * ptp_trace_read_device:
+ * const char *path	- trace file to read
+ * PTPTraceDevice *dev	- returns the recorded device
+ *
+ * Reads which device a trace was recorded from, so that a replayed
+ * device can be presented like the real one.
+ *
+ * Return values: 0 on success, -1 if this is not a trace file.
+ **/
+int
+ptp_trace_read_device (const char *path, PTPTraceDevice *dev)
+{
+	FILE	*f = fopen (path, "rb");
+	int	ret;
+
+	if (!f)
+		return -1;
+	ret = trace_read_header (f, dev);
+	fclose (f);
+	return ret;
+}
+
+/* Looks at the next record without taking it */
+static PTPTraceRecord *
+trace_peek (PTPTrace *t)
+{
+	unsigned char	buf[PTP_TRACE_RECORD_LEN];
+	PTPTraceRecord	*r = &t->next;
+	unsigned int	i;
+
+	if (t->havenext)
+		return r;
+	if (!t->f || fread (buf, sizeof(buf), 1, t->f) != 1)
+		return NULL;
+	r->type = buf[0];
+	r->nparam = buf[1];
+	r->code = get16 (buf + 2);
+	r->ret = get16 (buf + 4);
+	r->transid = get32 (buf + 8);
+	r->delta = get32 (buf + 12);
+	for (i=0;i<5;i++)
+		r->param[i] = get32 (buf + 16 + 4*i);
+	r->len = get32 (buf + 36);
+	if (r->len > t->payload_alloc) {
+		unsigned char *p = realloc (t->payload, r->len);
+
+		if (!p)
+			return NULL;
+		t->payload = p;
+		t->payload_alloc = r->len;
+	}
+	if (r->len && fread (t->payload, r->len, 1, t->f) != 1)
+		return NULL;
+	t->havenext = 1;
+	return r;
+}
+
+/* Takes the next record, which has to be of the given type */
+static PTPTraceRecord *
+trace_take (PTPParams *params, uint8_t type)
+{
+	PTPTrace	*t = (PTPTrace *) params->trace;
+	PTPTraceRecord	*r = trace_peek (t);
+
+	if (!r) {
+		ptp_error (params, "PTP: trace replay ran out of records");
+		return NULL;
+	}
+	if (r->type != type) {
+		ptp_error (params, "PTP: trace replay expected record type %d, "
+			   "the trace has %d", type, r->type);
+		return NULL;
+	}
+	t->havenext = 0;
+	/* with the recorded timing, take as long as the device did */
+	if (t->timed && r->delta) {
+		uint64_t due = t->last + r->delta;
+#ifdef HAVE_USLEEP
+		uint64_t now = trace_now ();
+
+		if (due > now)
+			usleep (due - now);
+#endif
+		t->last = due;
+	}
+	return r;
+}
+
+static void
+trace_fill_container (PTPParams *params, PTPContainer *ptp,
+		      PTPTraceRecord const *r)
+{
+	ptp->Code = r->code;
+	ptp->SessionID = params->session_id;
+	ptp->Nparam = r->nparam;
+	ptp->Param1 = r->param[0];
+	ptp->Param2 = r->param[1];
+	ptp->Param3 = r->param[2];
+	ptp->Param4 = r->param[3];
+	ptp->Param5 = r->param[4];
+}
+
+static uint16_t
+replay_sendreq (PTPParams* params, PTPContainer* req, int dataphase)
+{
+	PTPTraceRecord	*r = trace_take (params, PTP_TRACE_REQUEST);
+
+	if (!r)
+		return PTP_ERROR_IO;
+	((PTPTrace *) params->trace)->reqtransid = r->transid;
+	if (r->code != req->Code) {
+		ptp_error (params, "PTP: trace replay diverged, operation 0x%04x "
+			   "where the trace has 0x%04x", req->Code, r->code);
+		return PTP_ERROR_IO;
+	}
+	return r->ret;
+}
+
+static uint16_t
+replay_senddata (PTPParams* params, PTPContainer* ptp, uint64_t size,
+		 PTPDataHandler *handler)
+{
+	unsigned char		buf[0x10000];
+	uint64_t		left = size;
+	PTPTraceRecord		*r;
+
+	/* pull the data through like a transport would */
+	while (left > 0) {
+		unsigned long	want = left < sizeof(buf) ? left : sizeof(buf);
+		unsigned long	got = 0;
+		uint16_t	ret;
+
+		ret = handler->getfunc (params, handler->priv, want, buf, &got);
+		if (ret != PTP_RC_OK)
+			return ret;
+		if (got == 0)
+			break;
+		left -= got;
+	}
+	r = trace_take (params, PTP_TRACE_SENDDATA);
+	if (!r)
+		return PTP_ERROR_IO;
+	return r->ret;
+}
+
+static uint16_t
+replay_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
+{
+	PTPTrace	*t = (PTPTrace *) params->trace;
+	uint16_t	ret = PTP_RC_OK;
+	PTPTraceRecord	*r;
+
+	while ((r = trace_peek (t)) != NULL) {
+		if (r->type != PTP_TRACE_DATA) {
+			/* not data, so it must be the end of it */
+			r = trace_take (params, PTP_TRACE_GETDATA);
+			if (!r)
+				return PTP_ERROR_IO;
+			return ret != PTP_RC_OK ? ret : r->ret;
+		}
+		r = trace_take (params, PTP_TRACE_DATA);
+		/* after the handler refused, skip to the end of the data */
+		if (ret == PTP_RC_OK)
+			ret = handler->putfunc (params, handler->priv,
+						r->len, t->payload);
+		if (ret != PTP_RC_OK)
+			ret = PTP_ERROR_IO;
+	}
+	return PTP_ERROR_IO;
+}
+
+static uint16_t
+replay_getresp (PTPParams* params, PTPContainer* resp)
+{
+	PTPTraceRecord	*r = trace_take (params, PTP_TRACE_RESPONSE);
+
+	if (!r)
+		return PTP_ERROR_IO;
+	trace_fill_container (params, resp, r);
+	/*
+	 * The ids we hand out need not start where the recording did, keep
+	 * the distance to the request so stale responses stay stale.
+	 */
+	resp->Transaction_ID = params->transaction_id - 1 -
+		(((PTPTrace *) params->trace)->reqtransid - r->transid);
+	return r->ret;
+}
+
+static uint16_t
+replay_cancelreq (PTPParams* params, uint32_t transid)
+{
+	PTPTraceRecord	*r = trace_take (params, PTP_TRACE_CANCEL);
+
+	return r ? r->ret : PTP_ERROR_IO;
+}
+
+static uint16_t
+replay_devstatreq (PTPParams* params)
+{
+	PTPTraceRecord	*r = trace_take (params, PTP_TRACE_DEVSTATUS);
+
+	return r ? r->ret : PTP_ERROR_IO;
+}
+
+/**
+ * ptp_trace_replay:
+ * params:	PTPParams*
+ *		const char *path	- trace file to replay
+ *		int timed		- keep the recorded timing
+ *		PTPTraceDevice *dev	- returns the recorded device
+ *
+ * Installs a transport in params that plays back a trace written by
+ * ptp_trace_record(). The session has to make the same requests in
+ * the same order as the recorded one; the first request that differs
+ * fails with PTP_ERROR_IO. Without timed the answers come back at
+ * memory speed.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_trace_replay (PTPParams *params, const char *path, int timed,
+		  PTPTraceDevice *dev)
+{
+	PTPTrace	*t;
+
+	if (params->trace)
+		return PTP_ERROR_BADPARAM;
+	t = calloc (1, sizeof(PTPTrace));
+	if (!t)
+		return PTP_RC_GeneralError;
+	t->f = fopen (path, "rb");
+	if (!t->f) {
+		ptp_error (params, "PTP: could not open trace file %s", path);
+		free (t);
+		return PTP_RC_GeneralError;
+	}
+	if (trace_read_header (t->f, dev) != 0) {
+		ptp_error (params, "PTP: %s is not a trace file", path);
+		fclose (t->f);
+		free (t);
+		return PTP_RC_GeneralError;
+	}
+	t->replay = 1;
+	t->timed = timed;
+	t->last = trace_now ();
+	params->trace = t;
+	params->sendreq_func = replay_sendreq;
+	params->senddata_func = replay_senddata;
+	params->getresp_func = replay_getresp;
+	params->getdata_func = replay_getdata;
+	params->cancelreq_func = replay_cancelreq;
+	params->devstatreq_func = replay_devstatreq;
+	return PTP_RC_OK;
+}
+
+int
+ptp_trace_replaying (PTPParams *params)
+{
+	return params->trace && ((PTPTrace *) params->trace)->replay;
+}
+
+/**
+ * ptp_trace_record_event:
+ * params:	PTPParams*
+ *		PTPContainer *event	- event read from the transport
+ *		uint16_t ret		- what reading it returned
+ *
+ * Events are read by the transport directly rather than through
+ * params, so it hands them in here to be recorded.
+ *
+ * Return values: ret, passed through.
+ **/
+uint16_t
+ptp_trace_record_event (PTPParams *params, PTPContainer *event, uint16_t ret)
+{
+	PTPTrace	*t = (PTPTrace *) params->trace;
+	uint32_t	param[5];
+
+	if (!t || t->replay)
+		return ret;
+	trace_container_params (event, param);
+	trace_write (t, PTP_TRACE_EVENT, event, ret, param, NULL, 0);
+	return ret;
+}
+
+/**
+ * ptp_trace_replay_event:
+ * params:	PTPParams*
+ *		PTPContainer *event	- returns the recorded event
+ *
+ * Serves the next event of the trace if that is what comes next,
+ * else reports a timeout as a device with nothing to say would.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_trace_replay_event (PTPParams *params, PTPContainer *event)
+{
+	PTPTrace	*t = (PTPTrace *) params->trace;
+	PTPTraceRecord	*r = trace_peek (t);
+
+	if (!r || r->type != PTP_TRACE_EVENT)
+		return PTP_ERROR_TIMEOUT;
+	r = trace_take (params, PTP_TRACE_EVENT);
+	trace_fill_container (params, event, r);
+	event->Transaction_ID = r->transid;
+	return r->ret;
+}
+
+/**
+ * ptp_trace_close:
+ * params:	PTPParams*
+ *
+ * Ends recording or replaying and closes the trace file. Recording
+ * leaves the transport that was hooked into in place.
+ **/
+void
+ptp_trace_close (PTPParams *params)
+{
+	PTPTrace	*t = (PTPTrace *) params->trace;
+
+	if (!t)
+		return;
+	if (!t->replay && params->sendreq_func == trace_sendreq) {
+		params->sendreq_func = t->sendreq_func;
+		params->senddata_func = t->senddata_func;
+		params->getresp_func = t->getresp_func;
+		params->getdata_func = t->getdata_func;
+		params->cancelreq_func = t->cancelreq_func;
+		params->devstatreq_func = t->devstatreq_func;
+	}
+	if (t->f)
+		fclose (t->f);
+	free (t->payload);
+	free (t);
+	params->trace = NULL;
+}
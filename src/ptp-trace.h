@@ -0,0 +1,76 @@
+/**
+ * \file ptp-trace.h
+ * Recording of PTP sessions to a trace file and a transport that
+ * replays them without the device.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __MTP__PTP_TRACE__H
+#define __MTP__PTP_TRACE__H
+
+#include "ptp.h"
+
+/*
+ * Trace file layout, all values little endian:
+ *
+ * header:  "MTPTRACE", u32 version, u16 vendor id, u16 product id,
+ *          u32 device flags, u16 bcdUSB, u16 IN and u16 OUT endpoint
+ *          max packet size, u16 reserved
+ * records: u8 type, u8 nparam, u16 code, u16 return value,
+ *          u16 reserved, u32 transaction id, u32 usecs since the
+ *          previous record, 5 x u32 params, u32 payload length,
+ *          payload
+ *
+ * A transaction is a REQUEST, then for a data phase SENDDATA or any
+ * number of DATA records closed by GETDATA, then RESPONSE. Only the
+ * length of sent data is kept, received data is kept in full. Traces
+ * of made up devices can be written in the same format.
+ */
+#define PTP_TRACE_MAGIC		"MTPTRACE"
+#define PTP_TRACE_VERSION	1
+
+#define PTP_TRACE_REQUEST	1
+#define PTP_TRACE_SENDDATA	2
+#define PTP_TRACE_DATA		3	/* one chunk of received data */
+#define PTP_TRACE_GETDATA	4	/* end of the received data */
+#define PTP_TRACE_RESPONSE	5
+#define PTP_TRACE_EVENT		6
+#define PTP_TRACE_CANCEL	7
+#define PTP_TRACE_DEVSTATUS	8
+
+typedef struct _PTPTraceDevice PTPTraceDevice;
+struct _PTPTraceDevice {
+	uint16_t	vendor_id;
+	uint16_t	product_id;
+	uint32_t	device_flags;
+	uint16_t	bcdusb;
+	uint16_t	inep_maxpacket;
+	uint16_t	outep_maxpacket;
+};
+
+uint16_t ptp_trace_record	(PTPParams *params, const char *path,
+				 PTPTraceDevice const *dev);
+uint16_t ptp_trace_replay	(PTPParams *params, const char *path,
+				 int timed, PTPTraceDevice *dev);
+int ptp_trace_read_device	(const char *path, PTPTraceDevice *dev);
+int ptp_trace_replaying		(PTPParams *params);
+uint16_t ptp_trace_record_event	(PTPParams *params, PTPContainer *event,
+				 uint16_t ret);
+uint16_t ptp_trace_replay_event	(PTPParams *params, PTPContainer *event);
+void ptp_trace_close		(PTPParams *params);
+
+#endif //__MTP__PTP_TRACE__H
@@ -25,6 +25,7 @@
 #define _DEFAULT_SOURCE
 #include "config.h"
 #include "ptp.h"
+#include "ptp-ring.h"
 
 #ifdef HAVE_LIBXML2
 # include <libxml/parser.h>
@@ -37,6 +38,13 @@
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+#include <time.h>
 
 #ifdef ENABLE_NLS
 #  include <libintl.h>
@@ -120,12 +128,554 @@ ptp_error (PTPParams *params, const char *format, ...)
         va_end (args);
 }
 
+/* UCS-2 <-> UTF-8 */
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+# define PTP_UCS2_SSE2
+#elif defined(__ARM_NEON) && defined(__BYTE_ORDER__) && \
+	(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+# include <arm_neon.h>
+# define PTP_UCS2_NEON
+#endif
+
+/**
+ * ptp_ucs2_to_utf8:
+ * src:		little endian UTF-16 as it comes from the device
+ * srclen:	number of 16 bit units in src
+ * dest:	buffer for the UTF-8 result, terminated with a 0
+ * destlen:	size of dest, 3 times srclen plus 1 is always enough
+ *
+ * Converts until the first 0 unit or srclen units. This is what the
+ * iconv UTF-16LE to UTF-8 converter does, for the common case of a
+ * UTF-8 locale; runs of ASCII are converted 8 units at a time.
+ *
+ * Return values: the length of dest without the 0, or -1 if src is
+ * not valid UTF-16 or dest is too short.
+ **/
+int
+ptp_ucs2_to_utf8 (const unsigned char *src, unsigned int srclen,
+		  char *dest, unsigned int destlen)
+{
+	unsigned int	i = 0, o = 0;
+
+	if (destlen == 0)
+		return -1;
+	destlen--;	/* room for the 0 */
+	while (i < srclen) {
+		uint32_t c;
+
+#if defined(PTP_UCS2_SSE2)
+		while (i + 8 <= srclen && o + 8 <= destlen) {
+			__m128i v = _mm_loadu_si128 ((const __m128i *)(src + 2*i));
+			__m128i hi = _mm_and_si128 (v, _mm_set1_epi16 ((short)0xff80));
+
+			/* anything but ASCII, 0 included, takes the slow path */
+			if (_mm_movemask_epi8 (_mm_cmpeq_epi16 (hi, _mm_setzero_si128 ())) != 0xffff ||
+			    _mm_movemask_epi8 (_mm_cmpeq_epi16 (v, _mm_setzero_si128 ())) != 0)
+				break;
+			_mm_storel_epi64 ((__m128i *)(dest + o), _mm_packus_epi16 (v, v));
+			i += 8;
+			o += 8;
+		}
+#elif defined(PTP_UCS2_NEON)
+		while (i + 8 <= srclen && o + 8 <= destlen) {
+			uint16x8_t v = vld1q_u16 ((const uint16_t *)(src + 2*i));
+			uint16x8_t bad = vorrq_u16 (vandq_u16 (v, vdupq_n_u16 (0xff80)),
+						    vceqq_u16 (v, vdupq_n_u16 (0)));
+			uint64x2_t b = vreinterpretq_u64_u16 (bad);
+
+			if (vgetq_lane_u64 (b, 0) | vgetq_lane_u64 (b, 1))
+				break;
+			vst1_u8 ((uint8_t *)(dest + o), vmovn_u16 (v));
+			i += 8;
+			o += 8;
+		}
+#endif
+		if (i >= srclen)
+			break;
+		c = src[2*i] | (src[2*i+1] << 8);
+		i++;
+		if (c == 0)
+			break;
+		if (c < 0x80) {
+			if (o + 1 > destlen)
+				return -1;
+			dest[o++] = c;
+			continue;
+		}
+		if (c >= 0xd800 && c <= 0xdfff) {
+			uint32_t c2;
+
+			/* a high surrogate has to be followed by a low one */
+			if (c >= 0xdc00 || i >= srclen)
+				return -1;
+			c2 = src[2*i] | (src[2*i+1] << 8);
+			if (c2 < 0xdc00 || c2 > 0xdfff)
+				return -1;
+			i++;
+			c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+		}
+		if (c < 0x800) {
+			if (o + 2 > destlen)
+				return -1;
+			dest[o++] = 0xc0 | (c >> 6);
+		} else if (c < 0x10000) {
+			if (o + 3 > destlen)
+				return -1;
+			dest[o++] = 0xe0 | (c >> 12);
+			dest[o++] = 0x80 | ((c >> 6) & 0x3f);
+		} else {
+			if (o + 4 > destlen)
+				return -1;
+			dest[o++] = 0xf0 | (c >> 18);
+			dest[o++] = 0x80 | ((c >> 12) & 0x3f);
+			dest[o++] = 0x80 | ((c >> 6) & 0x3f);
+		}
+		dest[o++] = 0x80 | (c & 0x3f);
+	}
+	dest[o] = '\0';
+	return o;
+}
+
+/**
+ * ptp_utf8_to_ucs2:
+ * src:		UTF-8 string
+ * srclen:	length of src in bytes, without the terminating 0
+ * dest:	buffer for little endian UTF-16, as the device wants it
+ * destlen:	size of dest in 16 bit units
+ *
+ * The reverse of ptp_ucs2_to_utf8(). No terminator is added.
+ *
+ * Return values: the number of units written, or -1 if src is not
+ * valid UTF-8 or does not fit.
+ **/
+int
+ptp_utf8_to_ucs2 (const char *src, unsigned int srclen,
+		  unsigned char *dest, unsigned int destlen)
+{
+	const unsigned char	*s = (const unsigned char *) src;
+	unsigned int		i = 0, o = 0;
+
+	while (i < srclen) {
+		uint32_t	c;
+		unsigned int	n, k;
+
+#if defined(PTP_UCS2_SSE2)
+		while (i + 16 <= srclen && o + 16 <= destlen) {
+			__m128i v = _mm_loadu_si128 ((const __m128i *)(s + i));
+
+			if (_mm_movemask_epi8 (v) != 0)
+				break;
+			_mm_storeu_si128 ((__m128i *)(dest + 2*o),
+					  _mm_unpacklo_epi8 (v, _mm_setzero_si128 ()));
+			_mm_storeu_si128 ((__m128i *)(dest + 2*o + 16),
+					  _mm_unpackhi_epi8 (v, _mm_setzero_si128 ()));
+			i += 16;
+			o += 16;
+		}
+#elif defined(PTP_UCS2_NEON)
+		while (i + 8 <= srclen && o + 8 <= destlen) {
+			uint8x8_t v = vld1_u8 (s + i);
+
+			if (vget_lane_u64 (vreinterpret_u64_u8 (vand_u8 (v, vdup_n_u8 (0x80))), 0))
+				break;
+			vst1q_u16 ((uint16_t *)(dest + 2*o), vmovl_u8 (v));
+			i += 8;
+			o += 8;
+		}
+#endif
+		if (i >= srclen)
+			break;
+		c = s[i++];
+		if (c < 0x80) {
+			n = 0;
+		} else if (c >= 0xc2 && c < 0xe0) {
+			n = 1;
+			c &= 0x1f;
+		} else if (c >= 0xe0 && c < 0xf0) {
+			n = 2;
+			c &= 0x0f;
+		} else if (c >= 0xf0 && c < 0xf5) {
+			n = 3;
+			c &= 0x07;
+		} else
+			return -1;
+		if (i + n > srclen)
+			return -1;
+		for (k = 0; k < n; k++) {
+			if ((s[i] & 0xc0) != 0x80)
+				return -1;
+			c = (c << 6) | (s[i++] & 0x3f);
+		}
+		/* no overlong forms, surrogates or values past U+10FFFF */
+		if ((n == 2 && c < 0x800) || (n == 3 && c < 0x10000) ||
+		    (c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff)
+			return -1;
+		if (c >= 0x10000) {
+			if (o + 2 > destlen)
+				return -1;
+			c -= 0x10000;
+			htole16a (dest + 2*o, 0xd800 | (c >> 10));
+			htole16a (dest + 2*o + 2, 0xdc00 | (c & 0x3ff));
+			o += 2;
+		} else {
+			if (o + 1 > destlen)
+				return -1;
+			htole16a (dest + 2*o, c);
+			o++;
+		}
+	}
+	return o;
+}
+
 /* Pack / unpack functions */
 
 #include "ptp-pack.c"
 
 /* major PTP functions */
 
+/**
+ * ptp_init_transaction_lock:
+ * params:	PTPParams*
+ *
+ * Sets up the per device lock that serialises ptp_transaction_new(),
+ * so that several threads may issue operations on the same device
+ * without interleaving their request, data and response phases.
+ * The lock is recursive and is freed with ptp_free_params(). Without
+ * pthreads this does nothing and transactions are not serialised.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_init_transaction_lock (PTPParams *params)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		*lock;
+	pthread_mutexattr_t	attr;
+
+	if (params->transaction_lock)
+		return PTP_RC_OK;
+	lock = malloc (sizeof(pthread_mutex_t));
+	if (!lock)
+		return PTP_RC_GeneralError;
+	pthread_mutexattr_init (&attr);
+	pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (pthread_mutex_init (lock, &attr)) {
+		pthread_mutexattr_destroy (&attr);
+		free (lock);
+		return PTP_RC_GeneralError;
+	}
+	pthread_mutexattr_destroy (&attr);
+	params->transaction_lock = lock;
+#endif
+	return PTP_RC_OK;
+}
+
+static void
+ptp_free_transaction_lock (PTPParams *params)
+{
+#ifdef HAVE_PTHREAD_H
+	if (params->transaction_lock) {
+		pthread_mutex_destroy (params->transaction_lock);
+		free (params->transaction_lock);
+		params->transaction_lock = NULL;
+	}
+#endif
+}
+
+static void
+ptp_lock (PTPParams *params)
+{
+#ifdef HAVE_PTHREAD_H
+	if (params->transaction_lock)
+		pthread_mutex_lock (params->transaction_lock);
+#endif
+}
+
+static void
+ptp_unlock (PTPParams *params)
+{
+#ifdef HAVE_PTHREAD_H
+	if (params->transaction_lock)
+		pthread_mutex_unlock (params->transaction_lock);
+#endif
+}
+
+static uint64_t
+ptp_stats_now (void)
+{
+#ifdef HAVE_SYS_TIME_H
+	struct timeval	tv;
+
+	gettimeofday (&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	return (uint64_t)time (NULL) * 1000000;
+#endif
+}
+
+static unsigned int
+ptp_stats_bucket (uint64_t usecs)
+{
+	unsigned int	bucket = 0;
+
+	while (usecs > 1 && bucket < PTP_STATS_BUCKETS - 1) {
+		usecs >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+static PTPOpStats *
+ptp_stats_op (PTPStats *stats, uint16_t opcode)
+{
+	PTPOpStats	*ops;
+	unsigned int	i;
+
+	for (i=0;i<stats->nrofops;i++)
+		if (stats->ops[i].opcode == opcode)
+			return &stats->ops[i];
+	ops = realloc (stats->ops, (stats->nrofops+1)*sizeof(PTPOpStats));
+	if (!ops)
+		return NULL;
+	stats->ops = ops;
+	memset (&ops[stats->nrofops], 0, sizeof(PTPOpStats));
+	ops[stats->nrofops].opcode = opcode;
+	return &ops[stats->nrofops++];
+}
+
+/**
+ * ptp_init_stats:
+ * params:	PTPParams*
+ *
+ * Starts collecting per operation statistics on this device, or
+ * clears what has been collected so far. Until this is called, the
+ * transaction path does no more than a NULL check for them.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_init_stats (PTPParams *params)
+{
+	uint16_t	ret = PTP_RC_OK;
+
+	ptp_lock (params);
+	if (!params->stats) {
+		params->stats = calloc (1, sizeof(PTPStats));
+		if (!params->stats)
+			ret = PTP_RC_GeneralError;
+	} else {
+		free (params->stats->ops);
+		memset (params->stats, 0, sizeof(PTPStats));
+	}
+	ptp_unlock (params);
+	return ret;
+}
+
+static void
+ptp_free_stats (PTPParams *params)
+{
+	if (params->stats) {
+		free (params->stats->ops);
+		free (params->stats);
+		params->stats = NULL;
+	}
+}
+
+/**
+ * ptp_get_stats:
+ * params:	PTPParams*
+ *		PTPOpStats **ops	- returns a copy of the statistics
+ *		unsigned int *nrofops	- returns the number of operations
+ *
+ * Gets a consistent snapshot of the statistics collected since
+ * ptp_init_stats(), one entry per operation code seen. The caller
+ * frees the array.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_get_stats (PTPParams *params, PTPOpStats **ops, unsigned int *nrofops)
+{
+	uint16_t	ret = PTP_RC_OK;
+
+	*ops = NULL;
+	*nrofops = 0;
+	ptp_lock (params);
+	if (!params->stats) {
+		ret = PTP_ERROR_BADPARAM;
+	} else if (params->stats->nrofops) {
+		*ops = malloc (params->stats->nrofops*sizeof(PTPOpStats));
+		if (*ops) {
+			memcpy (*ops, params->stats->ops,
+				params->stats->nrofops*sizeof(PTPOpStats));
+			*nrofops = params->stats->nrofops;
+		} else
+			ret = PTP_RC_GeneralError;
+	}
+	ptp_unlock (params);
+	return ret;
+}
+
+/* Called by the transport as the first data packet arrives. */
+void
+ptp_stats_first_byte (PTPParams *params)
+{
+	if (params->stats && !params->stats->first_byte)
+		params->stats->first_byte = ptp_stats_now ();
+}
+
+void
+ptp_stats_bytes_in (PTPParams *params, uint64_t bytes)
+{
+	if (params->stats)
+		params->stats->bytes_in += bytes;
+}
+
+void
+ptp_stats_retry (PTPParams *params)
+{
+	if (params->stats)
+		params->stats->retries++;
+}
+
+static void
+ptp_stats_begin (PTPParams *params)
+{
+	PTPStats	*stats = params->stats;
+
+	stats->start = ptp_stats_now ();
+	stats->data_start = 0;
+	stats->first_byte = 0;
+	stats->data_end = 0;
+	stats->bytes_in = 0;
+	stats->retries = 0;
+}
+
+static void
+ptp_stats_end (PTPParams *params, uint16_t opcode, uint16_t flags,
+	       uint64_t sendlen, uint16_t ret)
+{
+	PTPStats	*stats = params->stats;
+	PTPOpStats	*op = ptp_stats_op (stats, opcode);
+	uint64_t	end = ptp_stats_now ();
+	uint64_t	data_start;
+
+	if (!op)
+		return;
+	op->count++;
+	if (ret == PTP_ERROR_CANCEL)
+		op->cancels++;
+	else if (ret != PTP_RC_OK)
+		op->errors++;
+	op->retries += stats->retries;
+	op->bytes_in += stats->bytes_in;
+	if ((flags&PTP_DP_DATA_MASK) == PTP_DP_SENDDATA && ret == PTP_RC_OK)
+		op->bytes_out += sendlen;
+	/* the clock may step, so only count what makes sense */
+	if (stats->first_byte >= stats->start) {
+		op->first_byte_usecs += stats->first_byte - stats->start;
+		op->first_byte_hist[ptp_stats_bucket (stats->first_byte - stats->start)]++;
+	}
+	/* a read starts with its first packet, a write as the request is out */
+	data_start = stats->data_start;
+	if ((flags&PTP_DP_DATA_MASK) == PTP_DP_GETDATA &&
+	    stats->first_byte && stats->first_byte <= stats->data_end)
+		data_start = stats->first_byte;
+	if (stats->data_end && data_start && stats->data_end >= data_start) {
+		op->data_usecs += stats->data_end - data_start;
+		op->data_hist[ptp_stats_bucket (stats->data_end - data_start)]++;
+	}
+	if (end >= stats->start)
+		op->total_usecs += end - stats->start;
+}
+
+static uint16_t
+_ptp_transaction (PTPParams* params, PTPContainer* ptp,
+		  uint16_t flags, uint64_t sendlen,
+		  PTPDataHandler *handler);
+
+/* Whether an operation may need the device to have authenticated us,
+ * anything but what is used to open a session and describe the device. */
+static int
+ptp_needs_authentication (uint16_t code)
+{
+	switch (code) {
+	case PTP_OC_GetDeviceInfo:
+	case PTP_OC_OpenSession:
+	case PTP_OC_CloseSession:
+	case PTP_OC_GetStorageIDs:
+	case PTP_OC_GetStorageInfo:
+	case PTP_OC_GetDevicePropDesc:
+	case PTP_OC_GetDevicePropValue:
+	case PTP_OC_SetDevicePropValue:
+	case PTP_OC_ResetDevice:
+	case PTP_OC_MTP_GetObjectPropsSupported:
+	case PTP_OC_MTP_GetObjectPropDesc:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+/* operations whose data phase is object data, fed to params->tee_func */
+int
+ptp_carries_object_data (uint16_t opcode)
+{
+	switch (opcode) {
+	case PTP_OC_GetObject:
+	case PTP_OC_GetPartialObject:
+	case PTP_OC_SendObject:
+	case PTP_OC_ANDROID_GetPartialObject64:
+	case PTP_OC_ANDROID_SendPartialObject:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* the transports pass no params to the handlers, so keep them here */
+typedef struct {
+	PTPParams	*params;
+	PTPDataHandler	*handler;
+} PTPTeePrivate;
+
+static uint16_t
+ptp_tee_getfunc (PTPParams* params, void* priv, unsigned long wantlen,
+		 unsigned char *data, unsigned long *gotlen)
+{
+	PTPTeePrivate	*tee = (PTPTeePrivate *) priv;
+	uint16_t	ret;
+
+	ret = tee->handler->getfunc (params, tee->handler->priv, wantlen, data, gotlen);
+	if (ret == PTP_RC_OK && *gotlen > 0)
+		tee->params->tee_func (tee->params->tee_priv, data, *gotlen);
+	return ret;
+}
+
+static uint16_t
+ptp_tee_putfunc (PTPParams* params, void* priv, unsigned long sendlen,
+		 unsigned char *data)
+{
+	PTPTeePrivate	*tee = (PTPTeePrivate *) priv;
+
+	tee->params->tee_func (tee->params->tee_priv, data, sendlen);
+	return tee->handler->putfunc (params, tee->handler->priv, sendlen, data);
+}
+
+static unsigned char *
+ptp_tee_getbuffunc (PTPParams* params, void* priv, unsigned long offset,
+		    unsigned long wantlen)
+{
+	PTPTeePrivate	*tee = (PTPTeePrivate *) priv;
+
+	/* reading in place stays possible, putfunc sees the data anyway */
+	if (tee->handler->getbuffunc == NULL)
+		return NULL;
+	return tee->handler->getbuffunc (params, tee->handler->priv, offset, wantlen);
+}
+
 /**
  * ptp_transaction:
  * params:	PTPParams*
@@ -150,6 +700,13 @@ ptp_error (PTPParams *params, const char *format, ...)
  * being retreived the appropriate amount of memory is being allocated
  * (the caller should handle that!).
  *
+ * Transactions on the same params are serialised on the transaction
+ * lock set up by ptp_init_transaction_lock(), if any.
+ *
+ * If params->authenticate is set, it is called once before the first
+ * operation that is not part of opening the session, see
+ * ptp_needs_authentication().
+ *
  * Return values: Some PTP_RC_* code.
  * Upon success PTPContainer* ptp contains PTP Response Phase container with
  * all fields filled in.
@@ -158,6 +715,49 @@ uint16_t
 ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
 		     uint16_t flags, uint64_t sendlen,
 		     PTPDataHandler *handler
+) {
+	uint16_t	ret;
+	PTPDataHandler	tee;
+	PTPTeePrivate	teepriv;
+
+	if ((params==NULL) || (ptp==NULL))
+		return PTP_ERROR_BADPARAM;
+	if (params->tee_func && handler && ptp_carries_object_data (ptp->Code)) {
+		teepriv.params	= params;
+		teepriv.handler	= handler;
+		tee.getfunc	= handler->getfunc ? ptp_tee_getfunc : NULL;
+		tee.putfunc	= handler->putfunc ? ptp_tee_putfunc : NULL;
+		tee.getbuffunc	= ptp_tee_getbuffunc;
+		tee.priv	= &teepriv;
+		handler		= &tee;
+	}
+
+	ptp_lock (params);
+	if (params->authenticate && ptp_needs_authentication (ptp->Code)) {
+		uint16_t (*authenticate)(PTPParams *) = params->authenticate;
+
+		/* only once, its own transactions come through here too */
+		params->authenticate = NULL;
+		authenticate (params);
+	}
+	if (params->stats) {
+		uint16_t opcode = ptp->Code;
+
+		ptp_stats_begin (params);
+		ret = _ptp_transaction (params, ptp, flags, sendlen, handler);
+		ptp_stats_end (params, opcode, flags, sendlen, ret);
+	} else
+		ret = _ptp_transaction (params, ptp, flags, sendlen, handler);
+	PTP_RING(params, PTP_RING_RESPONSE, ret, ptp->Transaction_ID,
+		 ptp->Param1, ptp->Nparam);
+	ptp_unlock (params);
+	return ret;
+}
+
+static uint16_t
+_ptp_transaction (PTPParams* params, PTPContainer* ptp,
+		  uint16_t flags, uint64_t sendlen,
+		  PTPDataHandler *handler
 ) {
 	int 		tries;
 	uint16_t	cmd;
@@ -169,22 +769,32 @@ ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
 	ptp->Transaction_ID=params->transaction_id++;
 	ptp->SessionID=params->session_id;
 	/* send request */
+	PTP_RING(params, PTP_RING_REQUEST, ptp->Code, ptp->Transaction_ID,
+		 ptp->Param1, ptp->Nparam);
 	CHECK_PTP_RC(params->sendreq_func (params, ptp, flags));
+	if (params->stats)
+		params->stats->data_start = ptp_stats_now ();
 	/* is there a dataphase? */
 	switch (flags&PTP_DP_DATA_MASK) {
 	case PTP_DP_SENDDATA:
 		{
 			uint16_t ret = params->senddata_func(params, ptp, sendlen, handler);
-			if (ret == PTP_ERROR_CANCEL)
+			if (ret == PTP_ERROR_CANCEL) {
+				PTP_RING(params, PTP_RING_CANCEL, cmd,
+					 params->transaction_id-1, 0, 0);
 				CHECK_PTP_RC(params->cancelreq_func(params, params->transaction_id-1));
+			}
 			CHECK_PTP_RC(ret);
 		}
 		break;
 	case PTP_DP_GETDATA:
 		{
 			uint16_t ret = params->getdata_func(params, ptp, handler);
-			if (ret == PTP_ERROR_CANCEL)
+			if (ret == PTP_ERROR_CANCEL) {
+				PTP_RING(params, PTP_RING_CANCEL, cmd,
+					 params->transaction_id-1, 0, 0);
 				CHECK_PTP_RC(params->cancelreq_func(params, params->transaction_id-1));
+			}
 			CHECK_PTP_RC(ret);
 		}
 		break;
@@ -193,13 +803,18 @@ ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
 	default:
 		return PTP_ERROR_BADPARAM;
 	}
+	if (params->stats && (flags&PTP_DP_DATA_MASK) != PTP_DP_NODATA)
+		params->stats->data_end = ptp_stats_now ();
 	tries = 3;
 	while (tries--) {
 		uint16_t ret;
 		/* get response */
 		ret = params->getresp_func(params, ptp);
+		/* without a data phase the response is the first byte back */
+		ptp_stats_first_byte (params);
 		if (ret == PTP_ERROR_RESP_EXPECTED) {
 			ptp_debug (params,"PTP: response expected but not got, retrying.");
+			ptp_stats_retry (params);
 			tries++;
 			continue;
 		}
@@ -210,6 +825,7 @@ ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
 			if (cmd == PTP_OC_CloseSession)
 				break;
 			tries++;
+			ptp_stats_retry (params);
 			ptp_debug (params,
 				"PTP: Sequence number mismatch %d vs expected %d, suspecting old reply.",
 				ptp->Transaction_ID, params->transaction_id-1
@@ -237,6 +853,7 @@ ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
 typedef struct {
 	unsigned char	*data;
 	unsigned long	size, curoff;
+	unsigned long	alloc;	/* allocated size of data when receiving */
 } PTPMemHandlerPrivate;
 
 static uint16_t
@@ -261,12 +878,21 @@ memory_putfunc(PTPParams* params, void* private,
 ) {
 	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)private;
 
-	if (priv->curoff + sendlen > priv->size) {
-		priv->data = realloc (priv->data, priv->curoff+sendlen);
-		if (!priv->data)
+	if (priv->curoff + sendlen > priv->alloc) {
+		unsigned char	*newdata;
+		unsigned long	newalloc = priv->alloc * 2;
+
+		/* grow geometrically, the data phase comes in many chunks */
+		if (newalloc < priv->curoff + sendlen)
+			newalloc = priv->curoff + sendlen;
+		newdata = realloc (priv->data, newalloc);
+		if (!newdata)
 			return PTP_RC_GeneralError;
-		priv->size = priv->curoff + sendlen;
+		priv->data = newdata;
+		priv->alloc = newalloc;
 	}
+	if (priv->curoff + sendlen > priv->size)
+		priv->size = priv->curoff + sendlen;
 	memcpy (priv->data + priv->curoff, data, sendlen);
 	priv->curoff += sendlen;
 	return PTP_RC_OK;
@@ -283,9 +909,11 @@ ptp_init_recv_memory_handler(PTPDataHandler *handler)
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->getbuffunc = NULL;
 	priv->data = NULL;
 	priv->size = 0;
 	priv->curoff = 0;
+	priv->alloc = 0;
 	return PTP_RC_OK;
 }
 
@@ -303,9 +931,11 @@ ptp_init_send_memory_handler(PTPDataHandler *handler,
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->getbuffunc = NULL;
 	priv->data = data;
 	priv->size = len;
 	priv->curoff = 0;
+	priv->alloc = len;
 	return PTP_RC_OK;
 }
 
@@ -375,6 +1005,7 @@ ptp_init_fd_handler(PTPDataHandler *handler, int fd)
 	handler->priv = priv;
 	handler->getfunc = fd_getfunc;
 	handler->putfunc = fd_putfunc;
+	handler->getbuffunc = NULL;
 	priv->fd = fd;
 	return PTP_RC_OK;
 }
@@ -387,6 +1018,23 @@ ptp_exit_fd_handler (PTPDataHandler *handler)
 	return PTP_RC_OK;
 }
 
+/**
+ * ptp_handler_fd:
+ * params:	PTPDataHandler*	- a data handler
+ *
+ * Lets a transport that can move file data without copying it find
+ * out whether a handler reads from a file.
+ *
+ * Return values: the file descriptor the handler reads from, or -1.
+ **/
+int
+ptp_handler_fd (PTPDataHandler *handler)
+{
+	if (handler == NULL || handler->getfunc != fd_getfunc)
+		return -1;
+	return ((PTPFDHandlerPrivate*)handler->priv)->fd;
+}
+
 /* Old style transaction, based on memory */
 /* A note on memory management:
  * If called with the flag PTP_DP_GETDATA, this function will internally
@@ -442,6 +1090,33 @@ ptp_transaction (PTPParams* params, PTPContainer* ptp,
 	return ret;
 }
 
+/* Receiving transaction into a buffer owned by the caller, which is
+ * grown as needed and handed back (possibly moved) for the next call,
+ * so that a run of small transfers does not allocate for each one.
+ * On error the buffer is kept and *recvlen is 0.
+ */
+static uint16_t
+ptp_transaction_reuse (PTPParams* params, PTPContainer* ptp,
+		unsigned char **buf, unsigned long *alloc, unsigned int *recvlen
+) {
+	PTPDataHandler		handler;
+	PTPMemHandlerPrivate	*priv;
+	uint16_t		ret;
+
+	*recvlen = 0;
+	CHECK_PTP_RC(ptp_init_recv_memory_handler (&handler));
+	priv = (PTPMemHandlerPrivate*)handler.priv;
+	priv->data = *buf;
+	priv->alloc = *buf ? *alloc : 0;
+	ret = ptp_transaction_new (params, ptp, PTP_DP_GETDATA, 0, &handler);
+	*buf = priv->data;
+	*alloc = priv->alloc;
+	if (ret == PTP_RC_OK)
+		*recvlen = priv->size;
+	free (priv);
+	return ret;
+}
+
 
 /**
  * PTP operation functions
@@ -1490,9 +2165,7 @@ ptp_free_params (PTPParams *params)
 
 	free (params->cameraname);
 	free (params->wifi_profiles);
-	for (i=0;i<params->nrofobjects;i++)
-		ptp_free_object (&params->objects[i]);
-	free (params->objects);
+	ptp_objects_clear (params);
 	free (params->storageids.Storage);
 	free (params->events);
 	for (i=0;i<params->nrofcanon_props;i++) {
@@ -1502,11 +2175,27 @@ ptp_free_params (PTPParams *params)
 	free (params->canon_props);
 	free (params->backlogentries);
 
-	for (i=0;i<params->nrofdeviceproperties;i++)
+	for (i=0;i<params->nrofdeviceproperties;i++) {
 		ptp_free_devicepropdesc (&params->deviceproperties[i].desc);
+		if (params->deviceproperties[i].valuetime)
+			ptp_free_devicepropvalue (params->deviceproperties[i].valuetype,
+						  &params->deviceproperties[i].value);
+	}
 	free (params->deviceproperties);
 
+	for (i=0;i<(unsigned int)params->nrofobjectformats;i++) {
+		unsigned int j;
+
+		for (j=0;j<params->objectformats[i].nrofpds;j++)
+			ptp_free_objectpropdesc (&params->objectformats[i].pds[j].opd);
+		free (params->objectformats[i].pds);
+		free (params->objectformats[i].props);
+	}
+	free (params->objectformats);
+
 	ptp_free_DI (&params->deviceinfo);
+	ptp_free_stats (params);
+	ptp_free_transaction_lock (params);
 }
 
 /**
@@ -1926,6 +2615,30 @@ ptp_getthumb (PTPParams* params, uint32_t handle, unsigned char** object, unsign
 	return ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, object, len);
 }
 
+/**
+ * ptp_getthumb_reuse:
+ * params:	PTPParams*
+ *		handle			- Object handle
+ *		buf			- pointer to a reusable data area
+ *		alloc			- allocated size of buf
+ *		len			- returns the thumb size
+ *
+ * Get thumb for object 'handle' into the caller's buffer 'buf', which
+ * is grown (and 'alloc' updated) if it is too small. The buffer stays
+ * owned by the caller, also on error.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_getthumb_reuse (PTPParams* params, uint32_t handle, unsigned char** buf,
+		    unsigned long *alloc, unsigned int *len)
+{
+	PTPContainer ptp;
+
+	PTP_CNT_INIT(ptp, PTP_OC_GetThumb, handle);
+	return ptp_transaction_reuse(params, &ptp, buf, alloc, len);
+}
+
 /**
  * ptp_nikon_getlargethumb:
  * params:	PTPParams*
@@ -1998,24 +2711,62 @@ ptp_deleteobject (PTPParams* params, uint32_t handle, uint32_t ofc)
 	CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_NODATA, 0, NULL, NULL));
 	/* If the object is cached and could be removed, cleanse cache. */
 	ptp_remove_object_from_cache(params, handle);
+	/* The device drops it from any playlist or album referencing it. */
+	params->objectreferences_gen++;
 	return PTP_RC_OK;
 }
 
 /**
- * ptp_moveobject:
+ * ptp_deleteobjects:
  * params:	PTPParams*
- *		handle			- source ObjectHandle
- *		storage			- destination StorageID
- *		parent			- destination parent ObjectHandle
+ *		handles			- object handles
+ *		n			- number of handles
+ *		done			- see Return values
  *
- * Move an object to a new location under the specified parent.
- * Note that unlike most calls, 0 must be passed for the parent if the destination
- * is the Storage root.
+ * Deletes the objects one after the other, stopping at the first
+ * that fails. The cache is cleansed of the deleted objects once in
+ * the end, keeping the order of the objects left.
  *
  * Return values: Some PTP_RC_* code.
+ * Upon return : unsigned int* done	- number of handles deleted
  **/
 uint16_t
-ptp_moveobject (PTPParams* params, uint32_t handle, uint32_t storage, uint32_t parent)
+ptp_deleteobjects (PTPParams* params, uint32_t const *handles, unsigned int n,
+		   unsigned int *done)
+{
+	PTPContainer	ptp;
+	uint16_t	ret = PTP_RC_OK;
+	unsigned int	i;
+
+	for (i=0;i<n;i++) {
+		PTP_CNT_INIT(ptp, PTP_OC_DeleteObject, handles[i], 0);
+		ret = ptp_transaction(params, &ptp, PTP_DP_NODATA, 0, NULL, NULL);
+		if (ret != PTP_RC_OK)
+			break;
+	}
+	*done = i;
+	if (i) {
+		ptp_remove_objects_from_cache(params, handles, i);
+		params->objectreferences_gen++;
+	}
+	return ret;
+}
+
+/**
+ * ptp_moveobject:
+ * params:	PTPParams*
+ *		handle			- source ObjectHandle
+ *		storage			- destination StorageID
+ *		parent			- destination parent ObjectHandle
+ *
+ * Move an object to a new location under the specified parent.
+ * Note that unlike most calls, 0 must be passed for the parent if the destination
+ * is the Storage root.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_moveobject (PTPParams* params, uint32_t handle, uint32_t storage, uint32_t parent)
 {
 	PTPContainer ptp;
 
@@ -2026,6 +2777,41 @@ ptp_moveobject (PTPParams* params, uint32_t handle, uint32_t storage, uint32_t p
 	return PTP_RC_OK;
 }
 
+/**
+ * ptp_moveobjects:
+ * params:	PTPParams*
+ *		handles			- source ObjectHandles
+ *		n			- number of handles
+ *		storage			- destination StorageID
+ *		parent			- destination parent ObjectHandle
+ *		done			- see Return values
+ *
+ * Moves the objects under the specified parent one after the other,
+ * stopping at the first that fails, like ptp_deleteobjects().
+ *
+ * Return values: Some PTP_RC_* code.
+ * Upon return : unsigned int* done	- number of handles moved
+ **/
+uint16_t
+ptp_moveobjects (PTPParams* params, uint32_t const *handles, unsigned int n,
+		 uint32_t storage, uint32_t parent, unsigned int *done)
+{
+	PTPContainer	ptp;
+	uint16_t	ret = PTP_RC_OK;
+	unsigned int	i;
+
+	for (i=0;i<n;i++) {
+		PTP_CNT_INIT(ptp, PTP_OC_MoveObject, handles[i], storage, parent);
+		ret = ptp_transaction(params, &ptp, PTP_DP_NODATA, 0, NULL, NULL);
+		if (ret != PTP_RC_OK)
+			break;
+	}
+	*done = i;
+	if (i)
+		ptp_remove_objects_from_cache(params, handles, i);
+	return ret;
+}
+
 /**
  * ptp_copyobject:
  * params:	PTPParams*
@@ -2225,6 +3011,169 @@ ptp_getdevicepropvalue (PTPParams* params, uint16_t propcode,
 	return ret;
 }
 
+/* Returns the cache entry of propcode, adding an empty one if asked to */
+static PTPDeviceProperty *
+ptp_find_deviceprop (PTPParams* params, uint16_t propcode, int add)
+{
+	PTPDeviceProperty	*props;
+	unsigned int		i;
+
+	for (i=0;i<params->nrofdeviceproperties;i++)
+		if (params->deviceproperties[i].desc.DevicePropertyCode == propcode)
+			return &params->deviceproperties[i];
+	if (!add)
+		return NULL;
+	props = realloc(params->deviceproperties,(i+1)*sizeof(params->deviceproperties[0]));
+	if (!props)
+		return NULL;
+	params->deviceproperties = props;
+	memset(&props[i],0,sizeof(props[0]));
+	props[i].desc.DevicePropertyCode = propcode;
+	params->nrofdeviceproperties++;
+	return &props[i];
+}
+
+/**
+ * ptp_getdevicepropvalue_cached:
+ *
+ * Like ptp_getdevicepropvalue(), but answers from the device property
+ * cache while the value read last is younger than the cache time of
+ * the property. A PTP_EC_DevicePropChanged event or
+ * ptp_invalidate_deviceprop() makes it stale.
+ *
+ * params:	PTPParams*
+ *      uint16_t propcode
+ *      PTPPropertyValue *value	- a copy to be freed by the caller
+ *      uint16_t datatype
+ *
+ * Return values: Some PTP_RC_* code.
+ *
+ **/
+uint16_t
+ptp_getdevicepropvalue_cached (PTPParams* params, uint16_t propcode,
+			PTPPropertyValue* value, uint16_t datatype)
+{
+	PTPDeviceProperty	*prop;
+	PTPPropertyValue	fresh;
+	time_t			now;
+	int			cachetime;
+
+	prop = ptp_find_deviceprop (params, propcode, 1);
+	if (!prop)
+		return ptp_getdevicepropvalue (params, propcode, value, datatype);
+	cachetime = prop->cachetime ? prop->cachetime : params->cachetime;
+	time(&now);
+	if (	prop->valuetime && (prop->valuetype == datatype) &&
+		(now >= prop->valuetime) && (prop->valuetime + cachetime > now)
+	) {
+		duplicate_PropertyValue (&prop->value, value, datatype);
+		return PTP_RC_OK;
+	}
+
+	memset (&fresh, 0, sizeof(fresh));
+	CHECK_PTP_RC(ptp_getdevicepropvalue (params, propcode, &fresh, datatype));
+	/* the transaction may have handled events, look the entry up again */
+	prop = ptp_find_deviceprop (params, propcode, 0);
+	if (!prop) {
+		*value = fresh;
+		return PTP_RC_OK;
+	}
+	if (prop->valuetime)
+		ptp_free_devicepropvalue (prop->valuetype, &prop->value);
+	prop->value = fresh;
+	prop->valuetype = datatype;
+	prop->valuetime = now ? now : 1;
+	duplicate_PropertyValue (&prop->value, value, datatype);
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_set_deviceprop_cachetime:
+ *
+ * Sets how long ptp_getdevicepropvalue_cached() keeps propcode for,
+ * or with propcode 0 the default of all properties.
+ *
+ * params:	PTPParams*
+ *      uint16_t propcode	- 0 for the default of all properties
+ *      int seconds		- 0 = the default, < 0 = never cache
+ *
+ * Return values: Some PTP_RC_* code.
+ *
+ **/
+uint16_t
+ptp_set_deviceprop_cachetime (PTPParams* params, uint16_t propcode, int seconds)
+{
+	PTPDeviceProperty	*prop;
+
+	if (!propcode) {
+		params->cachetime = seconds;
+		return PTP_RC_OK;
+	}
+	prop = ptp_find_deviceprop (params, propcode, 1);
+	if (!prop)
+		return PTP_RC_GeneralError;
+	prop->cachetime = seconds;
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_invalidate_deviceprop:
+ *
+ * Marks the cached description and value of propcode stale, so the
+ * next query goes to the device.
+ *
+ * params:	PTPParams*
+ *      uint16_t propcode
+ *
+ **/
+void
+ptp_invalidate_deviceprop (PTPParams* params, uint16_t propcode)
+{
+	PTPDeviceProperty	*prop = ptp_find_deviceprop (params, propcode, 0);
+
+	if (!prop)
+		return;
+	prop->timestamp = 0;
+	if (prop->valuetime) {
+		ptp_free_devicepropvalue (prop->valuetype, &prop->value);
+		prop->valuetime = 0;
+	}
+}
+
+/**
+ * ptp_refresh_deviceprop:
+ *
+ * Reads the description of propcode from the device again and keeps
+ * its current value for ptp_getdevicepropvalue_cached(), so several
+ * properties can be brought up to date back to back, e.g. at a time
+ * when the session is idle.
+ *
+ * params:	PTPParams*
+ *      uint16_t propcode
+ *
+ * Return values: Some PTP_RC_* code.
+ *
+ **/
+uint16_t
+ptp_refresh_deviceprop (PTPParams* params, uint16_t propcode)
+{
+	PTPDeviceProperty	*prop;
+	PTPDevicePropDesc	dpd;
+
+	ptp_invalidate_deviceprop (params, propcode);
+	CHECK_PTP_RC(ptp_generic_getdevicepropdesc (params, propcode, &dpd));
+	prop = ptp_find_deviceprop (params, propcode, 1);
+	if (prop) {
+		duplicate_PropertyValue (&dpd.CurrentValue, &prop->value, dpd.DataType);
+		prop->valuetype = dpd.DataType;
+		time(&prop->valuetime);
+		if (!prop->valuetime)
+			prop->valuetime = 1;
+	}
+	ptp_free_devicepropdesc (&dpd);
+	return PTP_RC_OK;
+}
+
 uint16_t
 ptp_setdevicepropvalue (PTPParams* params, uint16_t propcode,
 			PTPPropertyValue *value, uint16_t datatype)
@@ -2643,7 +3592,7 @@ ptp_add_event (PTPParams *params, PTPContainer *evt)
 /* FIXME: incomplete ... needs storage mode retrieval support too (storage == 0xffffffff) */
 static uint16_t
 ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle) {
-	unsigned int	k, i, j, last, changed;
+	unsigned int	k, i;
 	PTPCANONFolderEntry *tmp = NULL;
 	unsigned int	nroftmp = 0;
 	uint16_t	ret;
@@ -2667,8 +3616,6 @@ ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle) {
 		storageids.Storage = malloc(sizeof(storageids.Storage[0]));
 		storageids.Storage[0] = storage;
 	}
-	last = changed = 0;
-
 	for (k=0;k<storageids.n;k++) {
 		if ((storageids.Storage[k] & 0xffff) == 0) {
 			ptp_debug (params, "reading directory, storage 0x%08x skipped (invalid)", storageids.Storage[k]);
@@ -2685,73 +3632,53 @@ ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle) {
 		}
 		/* convert read entries into objectinfos */
 		for (i=0;i<nroftmp;i++) {
-			PTPObject	*newobs;
-
-			ob = NULL;
-			for (j=0;j<params->nrofobjects;j++) {
-				if (params->objects[(last+j)%params->nrofobjects].oid == tmp[i].ObjectHandle)  {
-					ob = &params->objects[(last+j)%params->nrofobjects];
-					break;
-				}
-			}
-			if (j == params->nrofobjects) {
-				ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d,j=%d)", tmp[i].ObjectHandle, params->nrofobjects,j);
-				newobs = realloc (params->objects,sizeof(PTPObject)*(params->nrofobjects+1));
-				if (!newobs) {
+			if (ptp_object_find (params, tmp[i].ObjectHandle, &ob) != PTP_RC_OK) {
+				ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d)", tmp[i].ObjectHandle, params->nrofobjects);
+				if (ptp_object_find_or_insert (params, tmp[i].ObjectHandle, &ob) != PTP_RC_OK) {
 					free (tmp);
 					free (storageids.Storage);
 					return PTP_RC_GeneralError;
 				}
-				params->objects = newobs;
-				memset (&params->objects[params->nrofobjects],0,sizeof(params->objects[params->nrofobjects]));
-				params->objects[params->nrofobjects].oid   = tmp[i].ObjectHandle;
-				params->objects[params->nrofobjects].flags = 0;
 
-				params->objects[params->nrofobjects].oi.StorageID = storageids.Storage[k];
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_STORAGEID_LOADED;
+				PTP_OB_STORAGE(params, ob) = storageids.Storage[k];
+				ob->flags |= PTPOBJECT_STORAGEID_LOADED;
 				if (handle == 0xffffffff)
-					params->objects[params->nrofobjects].oi.ParentObject = 0;
+					PTP_OB_PARENT(params, ob) = 0;
 				else
-					params->objects[params->nrofobjects].oi.ParentObject = handle;
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_PARENTOBJECT_LOADED;
-				params->objects[params->nrofobjects].oi.Filename = strdup(tmp[i].Filename);
-				params->objects[params->nrofobjects].oi.ObjectFormat = tmp[i].ObjectFormatCode;
+					PTP_OB_PARENT(params, ob) = handle;
+				ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
+				PTP_OB_NAME(params, ob) = strdup(tmp[i].Filename);
+				PTP_OB_FORMAT(params, ob) = tmp[i].ObjectFormatCode;
 
 				ptp_debug (params, "   flags %x", tmp[i].Flags);
 				if (tmp[i].Flags & 0x1)
-					params->objects[params->nrofobjects].oi.ProtectionStatus = PTP_PS_ReadOnly;
+					ob->ProtectionStatus = PTP_PS_ReadOnly;
 				else
-					params->objects[params->nrofobjects].oi.ProtectionStatus = PTP_PS_NoProtection;
-				params->objects[params->nrofobjects].canon_flags = tmp[i].Flags;
-				params->objects[params->nrofobjects].oi.ObjectCompressedSize = tmp[i].ObjectSize;
-				params->objects[params->nrofobjects].oi.CaptureDate = tmp[i].Time;
-				params->objects[params->nrofobjects].oi.ModificationDate = tmp[i].Time;
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_OBJECTINFO_LOADED;
-
-				/*debug_objectinfo(params, tmp[i].ObjectHandle, &params->objects[params->nrofobjects].oi);*/
-				last = params->nrofobjects;
-				params->nrofobjects++;
-				changed = 1;
+					ob->ProtectionStatus = PTP_PS_NoProtection;
+				ob->canon_flags = tmp[i].Flags;
+				PTP_OB_SIZE(params, ob) = tmp[i].ObjectSize;
+				if (tmp[i].Time && ptp_object_ext (ob))
+					ob->ext->CaptureDate = tmp[i].Time;
+				ob->ModificationDate = tmp[i].Time;
+				ob->flags |= PTPOBJECT_OBJECTINFO_LOADED;
+
+				/*debug_objectinfo(params, tmp[i].ObjectHandle, &ob->oi);*/
 			} else {
-				ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d,j=%d)", tmp[i].ObjectHandle, params->nrofobjects,j);
-				ob = &params->objects[(last+j)%params->nrofobjects];
-				/* for speeding up search */
-				last = (last+j)%params->nrofobjects;
+				ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d)", tmp[i].ObjectHandle, params->nrofobjects);
 				if (handle != PTP_HANDLER_SPECIAL) {
-					ob->oi.ParentObject = handle;
+					PTP_OB_PARENT(params, ob) = handle;
 					ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
 				}
 				if (storageids.Storage[k] != PTP_HANDLER_SPECIAL) {
-					ob->oi.StorageID = storageids.Storage[k];
+					PTP_OB_STORAGE(params, ob) = storageids.Storage[k];
 					ob->flags |= PTPOBJECT_STORAGEID_LOADED;
 				}
 			}
+			ptp_object_reindex (params, ob);
 		}
 		free (tmp);
 	}
-	if (changed) ptp_objects_sort (params);
 
-	/* Do not cache ob, it might be reallocated and have a new address */
 	if (handle != 0xffffffff) {
 		ret = ptp_object_want (params, handle, PTPOBJECT_OBJECTINFO_LOADED, &ob);
 		if (ret == PTP_RC_OK)
@@ -2763,10 +3690,9 @@ ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle) {
 
 uint16_t
 ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle) {
-	unsigned int		i, changed, last;
+	unsigned int		i;
 	uint16_t		ret;
 	uint32_t		xhandle = handle;
-	PTPObject		*newobs;
 	PTPObjectHandles	handles;
 
 	ptp_debug (params, "(storage=0x%08x, handle=0x%08x)", storage, handle);
@@ -2792,7 +3718,7 @@ ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle) {
 		ret = ptp_object_want (params, handle, PTPOBJECT_OBJECTINFO_LOADED, &ob);
 		if (ret != PTP_RC_OK)
 			return ret;
-		if (ob->oi.ObjectFormat != PTP_OFC_Association)
+		if (PTP_OB_FORMAT(params, ob) != PTP_OFC_Association)
 			return PTP_RC_GeneralError;
 		if (ob->flags & PTPOBJECT_DIRECTORY_LOADED) return PTP_RC_OK;
 		ob->flags |= PTPOBJECT_DIRECTORY_LOADED;
@@ -2809,61 +3735,43 @@ ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle) {
 		if (ret != PTP_RC_OK || !numoifs)
 			goto fallback;
 
-		last = changed = 0;
 		for (i=0;i<numoifs;i++) {
 			PTPObject	*ob;
-			unsigned int	j;
 
-			ob = NULL;
-			for (j=0;j<params->nrofobjects;j++) {
-				if (params->objects[(last+j)%params->nrofobjects].oid == oifs[i].ObjectHandle)  {
-					ob = &params->objects[(last+j)%params->nrofobjects];
-					break;
-				}
-			}
-			if (j == params->nrofobjects) {
-				ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d,j=%d)", oifs[i].ObjectHandle, params->nrofobjects,j);
-				newobs = realloc (params->objects,sizeof(PTPObject)*(params->nrofobjects+1));
-				if (!newobs) {
+			if (ptp_object_find (params, oifs[i].ObjectHandle, &ob) != PTP_RC_OK) {
+				ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d)", oifs[i].ObjectHandle, params->nrofobjects);
+				if (ptp_object_find_or_insert (params, oifs[i].ObjectHandle, &ob) != PTP_RC_OK) {
 					free (oifs);
 					return PTP_RC_GeneralError;
 				}
-				params->objects = newobs;
-				memset (&params->objects[params->nrofobjects],0,sizeof(params->objects[params->nrofobjects]));
-				params->objects[params->nrofobjects].oid = oifs[i].ObjectHandle;
-				params->objects[params->nrofobjects].flags = 0;
-				ob = &params->objects[params->nrofobjects];
-				params->nrofobjects++;
-				changed = 1;
 			} else {
-				ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d,j=%d)", oifs[i].ObjectHandle, params->nrofobjects,j);
-				ob = &params->objects[(last+j)%params->nrofobjects];
-				/* for speeding up search */
-				last = (last+j)%params->nrofobjects;
+				ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d)", oifs[i].ObjectHandle, params->nrofobjects);
 			}
 
-			ob->oi.StorageID 		= oifs[i].StorageID;
-			ob->oi.ObjectFormat 		= oifs[i].ObjectFormat;
-			ob->oi.ProtectionStatus 	= oifs[i].ProtectionStatus;
-			ob->oi.ObjectCompressedSize	= oifs[i].ObjectCompressedSize64;
-			ob->oi.ParentObject		= oifs[i].ParentObject;
+			PTP_OB_STORAGE(params, ob) 		= oifs[i].StorageID;
+			PTP_OB_FORMAT(params, ob) 		= oifs[i].ObjectFormat;
+			ob->ProtectionStatus 	= oifs[i].ProtectionStatus;
+			PTP_OB_SIZE(params, ob)	= oifs[i].ObjectCompressedSize64;
+			PTP_OB_PARENT(params, ob)		= oifs[i].ParentObject;
 
 			/* bad iOS, returns StorageID instead of 0x0 */
-			if (ob->oi.ParentObject == oifs[i].StorageID) {
+			if (PTP_OB_PARENT(params, ob) == oifs[i].StorageID) {
 				ptp_debug (params, "objectid 0x%08x aka %s has parent %08x, rewriting to 0", oifs[i].ObjectHandle, oifs[i].Filename, oifs[i].ParentObject);
-				ob->oi.ParentObject = 0;
+				PTP_OB_PARENT(params, ob) = 0;
 			}
 
-			ob->oi.AssociationType		= oifs[i].AssociationType;
-			ob->oi.AssociationDesc		= oifs[i].AssociationDesc;
-			ob->oi.SequenceNumber		= oifs[i].SequenceNumber;
-			ob->oi.Filename			= oifs[i].Filename; /* hand over memory ownership */
-			ob->oi.ModificationDate		= oifs[i].ModificationDate;
+			ob->AssociationType		= oifs[i].AssociationType;
+			if ((oifs[i].AssociationDesc || oifs[i].SequenceNumber) && ptp_object_ext (ob)) {
+				ob->ext->AssociationDesc	= oifs[i].AssociationDesc;
+				ob->ext->SequenceNumber		= oifs[i].SequenceNumber;
+			}
+			PTP_OB_NAME(params, ob)			= oifs[i].Filename; /* hand over memory ownership */
+			ob->ModificationDate		= oifs[i].ModificationDate;
 			/* FIXME: most of it ... but not the image sizes */
 			ob->flags			|= PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_STORAGEID_LOADED|PTPOBJECT_PARENTOBJECT_LOADED;
+			ptp_object_reindex (params, ob);
 		}
 		free (oifs);
-		if (changed) ptp_objects_sort (params);
 		return PTP_RC_OK;
 	}
 fallback:
@@ -2883,60 +3791,44 @@ fallback:
 	}
 	if (ret != PTP_RC_OK)
 		return ret;
-	last = changed = 0;
 	for (i=0;i<handles.n;i++) {
 		PTPObject	*ob;
-		unsigned int	j;
 
-		ob = NULL;
-		for (j=0;j<params->nrofobjects;j++) {
-			if (params->objects[(last+j)%params->nrofobjects].oid == handles.Handler[i])  {
-				ob = &params->objects[(last+j)%params->nrofobjects];
-				break;
+		if (ptp_object_find (params, handles.Handler[i], &ob) != PTP_RC_OK) {
+			ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d)", handles.Handler[i], params->nrofobjects);
+			if (ptp_object_find_or_insert (params, handles.Handler[i], &ob) != PTP_RC_OK) {
+				free (handles.Handler);
+				return PTP_RC_GeneralError;
 			}
-		}
-		if (j == params->nrofobjects) {
-			ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d,j=%d)", handles.Handler[i], params->nrofobjects,j);
-			newobs = realloc (params->objects,sizeof(PTPObject)*(params->nrofobjects+1));
-			if (!newobs) return PTP_RC_GeneralError;
-			params->objects = newobs;
-			memset (&params->objects[params->nrofobjects],0,sizeof(params->objects[params->nrofobjects]));
-			params->objects[params->nrofobjects].oid = handles.Handler[i];
-			params->objects[params->nrofobjects].flags = 0;
 			/* root directory list files might return all files, so avoid tagging it */
 			if (handle != PTP_HANDLER_SPECIAL && handle) {
 				ptp_debug (params, "  parenthandle 0x%08x", handle);
 				if (handles.Handler[i] == handle) { /* EOS bug where oid == parent(oid) */
-					params->objects[params->nrofobjects].oi.ParentObject = 0;
+					PTP_OB_PARENT(params, ob) = 0;
 				} else {
-					params->objects[params->nrofobjects].oi.ParentObject = handle;
+					PTP_OB_PARENT(params, ob) = handle;
 				}
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_PARENTOBJECT_LOADED;
+				ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
 			}
 			if (storage != PTP_HANDLER_SPECIAL) {
 				ptp_debug (params, "  storage 0x%08x", storage);
-				params->objects[params->nrofobjects].oi.StorageID = storage;
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_STORAGEID_LOADED;
+				PTP_OB_STORAGE(params, ob) = storage;
+				ob->flags |= PTPOBJECT_STORAGEID_LOADED;
 			}
-			params->nrofobjects++;
-			changed = 1;
 		} else {
-			ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d,j=%d)", handles.Handler[i], params->nrofobjects,j);
-			ob = &params->objects[(last+j)%params->nrofobjects];
-			/* for speeding up search */
-			last = (last+j)%params->nrofobjects;
+			ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d)", handles.Handler[i], params->nrofobjects);
 			if (handle != PTP_HANDLER_SPECIAL) {
-				ob->oi.ParentObject = handle;
+				PTP_OB_PARENT(params, ob) = handle;
 				ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
 			}
 			if (storage != PTP_HANDLER_SPECIAL) {
-				ob->oi.StorageID = storage;
+				PTP_OB_STORAGE(params, ob) = storage;
 				ob->flags |= PTPOBJECT_STORAGEID_LOADED;
 			}
 		}
+		ptp_object_reindex (params, ob);
 	}
 	free (handles.Handler);
-	if (changed) ptp_objects_sort (params);
 	return PTP_RC_OK;
 }
 
@@ -2946,21 +3838,12 @@ handle_event_internal (PTPParams *params, PTPContainer *event)
 {
 	/* handle some PTP stack internal events */
 	switch (event->Code) {
-	case PTP_EC_DevicePropChanged: {
-		unsigned int i;
-
+	case PTP_EC_DevicePropChanged:
 		/* mark the property for a forced refresh on the next query */
-		for (i=0;i<params->nrofdeviceproperties;i++)
-			if (params->deviceproperties[i].desc.DevicePropertyCode == event->Param1) {
-				params->deviceproperties[i].timestamp = 0;
-				break;
-			}
+		ptp_invalidate_deviceprop (params, event->Param1);
 		break;
-	}
 	case PTP_EC_StoreAdded:
 	case PTP_EC_StoreRemoved: {
-		unsigned int i;
-
 		/* FIXME: if we just remove 1 out of many storages, we do not need to invalidate/reload the entire tree? */
 
 		/* refetch storage IDs and also invalidate whole object tree */
@@ -2971,11 +3854,7 @@ handle_event_internal (PTPParams *params, PTPContainer *event)
 
 		/* free object storage as it might be associated with the storage ids */
 		/* FIXME: enhance and just delete the ones from the storage */
-		for (i=0;i<params->nrofobjects;i++)
-			ptp_free_object (&params->objects[i]);
-		free (params->objects);
-		params->objects 		= NULL;
-		params->nrofobjects 		= 0;
+		ptp_objects_clear (params);
 
 		params->storagechanged		= 1;
 		/* mirror what we do in camera_init, fetch root directory entries. */
@@ -4802,6 +5681,113 @@ ptp_mtp_getobjectpropdesc (
 	return PTP_RC_OK;
 }
 
+/*
+ * The object format cache.
+ *
+ * What a device supports for an object format does not change during
+ * a session, so the supported properties and the property descriptions
+ * of every format are asked for once and kept in params->objectformats.
+ */
+static MTPObjectFormat *
+_ptp_objectformat (PTPParams *params, uint16_t ofc)
+{
+	MTPObjectFormat	*of;
+	int		i;
+
+	for (i=0;i<params->nrofobjectformats;i++)
+		if (params->objectformats[i].ofc == ofc)
+			return &params->objectformats[i];
+	of = realloc (params->objectformats, (params->nrofobjectformats+1)*sizeof(MTPObjectFormat));
+	if (!of)
+		return NULL;
+	params->objectformats = of;
+	of = &params->objectformats[params->nrofobjectformats++];
+	memset (of, 0, sizeof(*of));
+	of->ofc = ofc;
+	return of;
+}
+
+/**
+ * ptp_mtp_getobjectpropssupported_cached:
+ *
+ * Like ptp_mtp_getobjectpropssupported(), but only asks the device the
+ * first time for every object format. The caller gets its own copy of
+ * the array and has to free() it.
+ *
+ * params:	PTPParams*
+ *	uint16_t ofc	- object format code
+ *
+ * Return values: Some PTP_RC_* code.
+ *
+ **/
+uint16_t
+ptp_mtp_getobjectpropssupported_cached (PTPParams* params, uint16_t ofc,
+		 uint32_t *propnum, uint16_t **props
+) {
+	MTPObjectFormat	*of = _ptp_objectformat (params, ofc);
+
+	*propnum = 0;
+	*props = NULL;
+	if (!of)
+		return ptp_mtp_getobjectpropssupported (params, ofc, propnum, props);
+	if (!of->propsloaded) {
+		CHECK_PTP_RC(ptp_mtp_getobjectpropssupported (params, ofc, &of->nrofprops, &of->props));
+		of->propsloaded = 1;
+	}
+	if (!of->nrofprops)
+		return PTP_RC_OK;
+	*props = malloc (of->nrofprops*sizeof(uint16_t));
+	if (!*props)
+		return PTP_RC_GeneralError;
+	memcpy (*props, of->props, of->nrofprops*sizeof(uint16_t));
+	*propnum = of->nrofprops;
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_mtp_getobjectpropdesc_cached:
+ *
+ * Like ptp_mtp_getobjectpropdesc(), but every description is only asked
+ * for once per session. opd is filled with a shallow copy: its enum
+ * values and strings belong to the cache and stay valid until
+ * ptp_free_params(), so it must NOT be given to
+ * ptp_free_objectpropdesc().
+ *
+ * params:	PTPParams*
+ *	uint16_t opc	- object property code
+ *	uint16_t ofc	- object format code
+ *
+ * Return values: Some PTP_RC_* code.
+ *
+ **/
+uint16_t
+ptp_mtp_getobjectpropdesc_cached (
+	PTPParams* params, uint16_t opc, uint16_t ofc, PTPObjectPropDesc *opd
+) {
+	MTPObjectFormat	*of = _ptp_objectformat (params, ofc);
+	MTPPropertyDesc	*pds;
+	unsigned int	i;
+
+	if (!of)
+		return PTP_RC_GeneralError;
+	for (i=0;i<of->nrofpds;i++) {
+		if (of->pds[i].opc == opc) {
+			*opd = of->pds[i].opd;
+			return PTP_RC_OK;
+		}
+	}
+
+	pds = realloc (of->pds, (of->nrofpds+1)*sizeof(MTPPropertyDesc));
+	if (!pds)
+		return PTP_RC_GeneralError;
+	of->pds = pds;
+	memset (&pds[of->nrofpds], 0, sizeof(MTPPropertyDesc));
+	pds[of->nrofpds].opc = opc;
+	CHECK_PTP_RC(ptp_mtp_getobjectpropdesc (params, opc, ofc, &pds[of->nrofpds].opd));
+	*opd = pds[of->nrofpds++].opd;
+	return PTP_RC_OK;
+}
+
 /**
  * ptp_mtp_getobjectpropvalue:
  *
@@ -4834,6 +5820,50 @@ ptp_mtp_getobjectpropvalue (
 	return ret;
 }
 
+/**
+ * ptp_mtp_getobjectpropvalue_bytes:
+ *
+ * This gets an AUINT8 object property, such as the representative
+ * sample data, as plain bytes into the caller's buffer 'buf', which
+ * is grown (and 'alloc' updated) if it is too small, instead of
+ * unpacking one PTPPropertyValue per byte.
+ *
+ * params:	PTPParams*
+ *	uint32_t objectid	- object handle
+ *	uint16_t opc		- object prop code
+ *	unsigned char **buf	- reusable data area
+ *	unsigned long *alloc	- allocated size of buf
+ *	unsigned int *len	- returns the number of bytes
+ *
+ * Return values: Some PTP_RC_* code.
+ *
+ **/
+uint16_t
+ptp_mtp_getobjectpropvalue_bytes (
+	PTPParams* params, uint32_t oid, uint16_t opc,
+	unsigned char **buf, unsigned long *alloc, unsigned int *len
+) {
+	PTPContainer	ptp;
+	unsigned int	size;
+	uint32_t	count;
+
+	*len = 0;
+	PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjectPropValue, oid, opc);
+	CHECK_PTP_RC(ptp_transaction_reuse(params, &ptp, buf, alloc, &size));
+	if (size < sizeof(uint32_t)) {
+		ptp_debug (params, "ptp_mtp_getobjectpropvalue_bytes: short array");
+		return PTP_RC_GeneralError;
+	}
+	count = dtoh32a(*buf);
+	if (count > size - sizeof(uint32_t)) {
+		ptp_debug (params, "ptp_mtp_getobjectpropvalue_bytes: array count %u exceeds data size %u", count, size);
+		return PTP_RC_GeneralError;
+	}
+	memmove (*buf, *buf + sizeof(uint32_t), count);
+	*len = count;
+	return PTP_RC_OK;
+}
+
 /**
  * ptp_mtp_setobjectpropvalue:
  *
@@ -4896,33 +5926,380 @@ ptp_mtp_setobjectreferences (PTPParams* params, uint32_t handle, uint32_t* ohArr
 	size = ptp_pack_uint32_t_array(params, ohArray, arraylen, &data);
 	ret = ptp_transaction(params, &ptp, PTP_DP_SENDDATA, size, &data, NULL);
 	free(data);
+	/* the device may well have dropped some, read them back when needed */
+	ptp_object_forget_references (params, handle);
 	return ret;
 }
 
-uint16_t
-ptp_mtp_getobjectproplist_generic (PTPParams* params, uint32_t handle, uint32_t formats, uint32_t properties, uint32_t propertygroups, uint32_t level, MTPProperties **props, int *nrofprops)
+/**
+ * ptp_object_forget_references:
+ *
+ * Drop the cached references of an object, e.g. on an
+ * ObjectReferencesChanged event.
+ *
+ * params:	PTPParams*
+ *	uint32_t handle		- object handle
+ **/
+void
+ptp_object_forget_references (PTPParams* params, uint32_t handle)
 {
-	PTPContainer	ptp;
-	unsigned char	*data = NULL;
-	unsigned int	size;
+	PTPObject	*ob;
 
-	PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjPropList, handle, formats, properties, propertygroups, level);
-	CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data, &size));
-	*nrofprops = ptp_unpack_OPL(params, data, props, size);
-	free(data);
-	return PTP_RC_OK;
+	if (ptp_object_find (params, handle, &ob) != PTP_RC_OK)
+		return;
+	free (ob->references);
+	ob->references = NULL;
+	ob->nrofreferences = 0;
+	ob->flags &= ~PTPOBJECT_REFERENCES_LOADED;
 }
 
+/**
+ * ptp_mtp_loadobjectreferences:
+ *
+ * Read the references of a number of cached objects into the object
+ * cache in one pass, receiving all of them into the same buffer.
+ * Objects not in the cache or with their references already loaded
+ * are skipped.
+ *
+ * params:	PTPParams*
+ *	uint32_t *handles	- object handles
+ *	uint32_t nrofhandles	- number of handles
+ *
+ * Return values: PTP_RC_OK, or the PTP_RC_* code of the last failure.
+ **/
 uint16_t
-ptp_mtp_getobjectproplist_level (PTPParams* params, uint32_t handle, uint32_t level, MTPProperties **props, int *nrofprops)
+ptp_mtp_loadobjectreferences (PTPParams* params, uint32_t const *handles, uint32_t nrofhandles)
 {
-	return ptp_mtp_getobjectproplist_generic (params, handle,
-		     0x00000000U,  /* 0x00000000U should be "all formats" */
-		     0xFFFFFFFFU,  /* 0xFFFFFFFFU should be "all properties" */
-		     0,
-		     level,
-		     props,
-		     nrofprops
+	unsigned char	*buf = NULL;
+	unsigned long	alloc = 0;
+	uint16_t	ret = PTP_RC_OK;
+	uint32_t	i;
+
+	for (i=0;i<nrofhandles;i++) {
+		PTPContainer	ptp;
+		PTPObject	*ob;
+		unsigned int	size;
+		uint32_t	*refs = NULL;
+		uint32_t	nrofrefs = 0;
+		uint16_t	rc;
+
+		if (ptp_object_find (params, handles[i], &ob) != PTP_RC_OK)
+			continue;
+		if ((ob->flags & PTPOBJECT_REFERENCES_LOADED) &&
+		    (ob->referencesgen == params->objectreferences_gen))
+			continue;
+		PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjectReferences, handles[i]);
+		rc = ptp_transaction_reuse (params, &ptp, &buf, &alloc, &size);
+		if (rc != PTP_RC_OK) {
+			ret = rc;
+			if (rc == PTP_ERROR_IO)
+				break;
+			continue;
+		}
+		/* Sandisk Sansa skips the DATA phase, see above */
+		if (size)
+			nrofrefs = ptp_unpack_uint32_t_array(params, buf, 0, size, &refs);
+		if (!nrofrefs)
+			refs = NULL;
+		/* look it up again, the cache may have changed meanwhile */
+		if (ptp_object_find (params, handles[i], &ob) != PTP_RC_OK) {
+			free (refs);
+			continue;
+		}
+		free (ob->references);
+		ob->references = refs;
+		ob->nrofreferences = nrofrefs;
+		ob->referencesgen = params->objectreferences_gen;
+		ob->flags |= PTPOBJECT_REFERENCES_LOADED;
+	}
+	free (buf);
+	return ret;
+}
+
+/**
+ * ptp_mtp_getobjectreferences_cached:
+ *
+ * Like ptp_mtp_getobjectreferences(), but the references of objects in
+ * the object cache are kept there and only read from the device once.
+ * The caller owns the returned array.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_mtp_getobjectreferences_cached (PTPParams* params, uint32_t handle, uint32_t** ohArray, uint32_t* arraylen)
+{
+	PTPObject	*ob;
+
+	CHECK_PTP_RC(ptp_mtp_loadobjectreferences (params, &handle, 1));
+	if ((ptp_object_find (params, handle, &ob) != PTP_RC_OK) ||
+	    !(ob->flags & PTPOBJECT_REFERENCES_LOADED))
+		return ptp_mtp_getobjectreferences (params, handle, ohArray, arraylen);
+	*arraylen = 0;
+	*ohArray = NULL;
+	if (ob->nrofreferences) {
+		*ohArray = malloc (ob->nrofreferences * sizeof(uint32_t));
+		if (!*ohArray)
+			return PTP_RC_GeneralError;
+		memcpy (*ohArray, ob->references, ob->nrofreferences * sizeof(uint32_t));
+		*arraylen = ob->nrofreferences;
+	}
+	return PTP_RC_OK;
+}
+
+uint16_t
+ptp_mtp_getobjectproplist_generic (PTPParams* params, uint32_t handle, uint32_t formats, uint32_t properties, uint32_t propertygroups, uint32_t level, MTPProperties **props, int *nrofprops)
+{
+	PTPContainer	ptp;
+	unsigned char	*data = NULL;
+	unsigned int	size;
+
+	PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjPropList, handle, formats, properties, propertygroups, level);
+	CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data, &size));
+	*nrofprops = ptp_unpack_OPL(params, data, props, size);
+	free(data);
+	return PTP_RC_OK;
+}
+
+/*
+ * Streaming GetObjPropList. Instead of collecting the whole, possibly
+ * multi-megabyte, response and unpacking it afterwards, the properties
+ * are decoded while the data arrives and passed to a callback in the
+ * order the device sent them. Only the start of a property split over
+ * two chunks is carried over to the next one.
+ */
+#define PTP_OPL_CARRY_STEP	1024
+
+typedef struct {
+	PTPParams	*params;	/* the transports do not all pass it on */
+	PTPOPLFunc	func;
+	void		*priv;
+	unsigned char	*carry;		/* undecoded tail of the last chunk */
+	unsigned long	carrylen, carryalloc;
+	int		gotcount;
+	int		broken;		/* hit a property we cannot decode */
+	uint32_t	count;		/* properties announced by the device */
+	uint32_t	done;		/* properties decoded so far */
+} PTPOPLHandlerPrivate;
+
+/*
+ * The most bytes the property at the start of data can legally take,
+ * as far as the len bytes there tell, or 0 if that is not known yet.
+ */
+static uint64_t
+_opl_prop_maxlen (PTPParams *params, unsigned char *data, unsigned long len)
+{
+	uint64_t	elem;
+
+	if (len < 8)
+		return 0;
+	switch (dtoh16a(data + 6)) {
+	case PTP_DTC_INT8:
+	case PTP_DTC_UINT8:	return 8 + 1;
+	case PTP_DTC_INT16:
+	case PTP_DTC_UINT16:	return 8 + 2;
+	case PTP_DTC_INT32:
+	case PTP_DTC_UINT32:	return 8 + 4;
+	case PTP_DTC_INT64:
+	case PTP_DTC_UINT64:	return 8 + 8;
+	case PTP_DTC_INT128:
+	case PTP_DTC_UINT128:	return 8 + 16;
+	case PTP_DTC_STR:	return 8 + 1 + PTP_MAXSTRLEN * 2;
+	case PTP_DTC_AINT8:
+	case PTP_DTC_AUINT8:	elem = 1; break;
+	case PTP_DTC_AINT16:
+	case PTP_DTC_AUINT16:	elem = 2; break;
+	case PTP_DTC_AINT32:
+	case PTP_DTC_AUINT32:	elem = 4; break;
+	case PTP_DTC_AINT64:
+	case PTP_DTC_AUINT64:	elem = 8; break;
+	default:		return 8;	/* never decodes */
+	}
+	if (len < 12)
+		return 0;
+	return 8 + 4 + dtoh32a(data + 8) * elem;
+}
+
+/* the carried property should have decoded by now, so it never will */
+static int
+_opl_carry_broken (PTPParams *params, PTPOPLHandlerPrivate *priv)
+{
+	uint64_t	maxlen = _opl_prop_maxlen (params, priv->carry, priv->carrylen);
+
+	if (!maxlen || priv->carrylen < maxlen)
+		return 0;
+	ptp_debug (params, "undecodable MTP OPL property %d (of %d), ignoring the rest", priv->done, priv->count);
+	priv->broken	= 1;
+	priv->carrylen	= 0;
+	return 1;
+}
+
+static uint16_t
+_opl_decode (PTPParams *params, PTPOPLHandlerPrivate *priv, unsigned char **data, unsigned long *len)
+{
+	unsigned char	*cur = *data;
+	unsigned long	left = *len;
+	uint16_t	ret = PTP_RC_OK;
+	int		swap = ptp_dtoh_needs_swap (params);
+
+	if (!priv->gotcount && (left >= sizeof(uint32_t))) {
+		priv->count = dtoh32a(cur);
+		priv->gotcount = 1;
+		cur += sizeof(uint32_t);
+		left -= sizeof(uint32_t);
+		ptp_debug (params ,"Streaming MTP OPL (prop_count %d)", priv->count);
+	}
+	while (priv->gotcount && (priv->done < priv->count) && (left > 8)) {
+		MTPProperties	prop;
+		unsigned int	offset = 0;
+
+		memset (&prop, 0, sizeof(prop));
+		prop.ObjectHandle	= ptp_dtoh32_swap(swap, cur);
+		prop.property		= ptp_dtoh16_swap(swap, cur + 4);
+		prop.datatype		= ptp_dtoh16_swap(swap, cur + 6);
+		/* not all of it here yet, or garbage, which we see at the end */
+		if (	!ptp_unpack_DPV(params, cur + 8, &offset, left - 8, &prop.propval, prop.datatype) ||
+			(offset > left - 8)
+		) {
+			ptp_destroy_object_prop (&prop);
+			break;
+		}
+		cur += 8 + offset;
+		left -= 8 + offset;
+		priv->done++;
+		ret = priv->func (params, priv->priv, &prop);
+		if (ret != PTP_RC_OK)
+			break;
+	}
+	*data = cur;
+	*len = left;
+	return ret;
+}
+
+static uint16_t
+_opl_carry (PTPOPLHandlerPrivate *priv, unsigned long len)
+{
+	unsigned char	*newcarry;
+	unsigned long	newalloc = priv->carryalloc ? priv->carryalloc : PTP_OPL_CARRY_STEP;
+
+	if (len <= priv->carryalloc)
+		return PTP_RC_OK;
+	while (newalloc < len)
+		newalloc *= 2;
+	newcarry = realloc (priv->carry, newalloc);
+	if (!newcarry)
+		return PTP_RC_GeneralError;
+	priv->carry		= newcarry;
+	priv->carryalloc	= newalloc;
+	return PTP_RC_OK;
+}
+
+static uint16_t
+opl_putfunc (PTPParams* params, void* private,
+	     unsigned long sendlen, unsigned char *data
+) {
+	PTPOPLHandlerPrivate	*priv = (PTPOPLHandlerPrivate*)private;
+	unsigned char		*cur;
+	unsigned long		left;
+
+	params = priv->params;
+	/* trailing bytes after the last announced property are ignored */
+	if (priv->broken || (priv->gotcount && (priv->done == priv->count))) {
+		priv->carrylen = 0;
+		return PTP_RC_OK;
+	}
+
+	/* complete the carried over property with the start of this chunk */
+	while (priv->carrylen && sendlen) {
+		uint64_t	maxlen = _opl_prop_maxlen (params, priv->carry, priv->carrylen);
+		unsigned long	n = PTP_OPL_CARRY_STEP;
+
+		/* with its size known, take the rest of the property at once */
+		if (maxlen)
+			n = (maxlen - priv->carrylen < sendlen) ? maxlen - priv->carrylen : sendlen;
+		if (n > sendlen)
+			n = sendlen;
+		CHECK_PTP_RC(_opl_carry (priv, priv->carrylen + n));
+		memcpy (priv->carry + priv->carrylen, data, n);
+		priv->carrylen += n;
+		cur = priv->carry;
+		left = priv->carrylen;
+		CHECK_PTP_RC(_opl_decode (params, priv, &cur, &left));
+		if (left <= n) {
+			/* the undecoded rest starts inside this chunk */
+			data += n - left;
+			sendlen -= n - left;
+			priv->carrylen = 0;
+		} else {
+			if (cur != priv->carry)
+				memmove (priv->carry, cur, left);
+			priv->carrylen = left;
+			data += n;
+			sendlen -= n;
+			if (_opl_carry_broken (params, priv))
+				return PTP_RC_OK;
+		}
+	}
+	if (!sendlen)
+		return PTP_RC_OK;
+
+	cur = data;
+	left = sendlen;
+	CHECK_PTP_RC(_opl_decode (params, priv, &cur, &left));
+	if (left && !(priv->gotcount && (priv->done == priv->count))) {
+		CHECK_PTP_RC(_opl_carry (priv, left));
+		memcpy (priv->carry, cur, left);
+		priv->carrylen = left;
+		(void) _opl_carry_broken (params, priv);
+	}
+	return PTP_RC_OK;
+}
+
+static uint16_t
+opl_getfunc (PTPParams* params, void* private,
+	     unsigned long wantlen, unsigned char *data,
+	     unsigned long *gotlen
+) {
+	return PTP_RC_GeneralError;
+}
+
+uint16_t
+ptp_mtp_getobjectproplist_stream (PTPParams* params, uint32_t handle, uint32_t formats, uint32_t properties, uint32_t propertygroups, uint32_t level, PTPOPLFunc func, void *priv)
+{
+	PTPContainer		ptp;
+	PTPDataHandler		handler;
+	PTPOPLHandlerPrivate	oplpriv;
+	uint16_t		ret;
+
+	memset (&oplpriv, 0, sizeof(oplpriv));
+	oplpriv.params	= params;
+	oplpriv.func	= func;
+	oplpriv.priv	= priv;
+	handler.getfunc		= opl_getfunc;
+	handler.putfunc		= opl_putfunc;
+	handler.getbuffunc	= NULL;
+	handler.priv		= &oplpriv;
+
+	PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjPropList, handle, formats, properties, propertygroups, level);
+	ret = ptp_transaction_new (params, &ptp, PTP_DP_GETDATA, 0, &handler);
+	free (oplpriv.carry);
+	if ((ret == PTP_RC_OK) && (oplpriv.done < oplpriv.count)) {
+		ptp_debug (params ,"short MTP Object Property List at property %d (of %d)", oplpriv.done, oplpriv.count);
+		ptp_debug (params ,"device probably needs DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST_ALL");
+		ptp_debug (params ,"or even DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST");
+	}
+	return ret;
+}
+
+uint16_t
+ptp_mtp_getobjectproplist_level (PTPParams* params, uint32_t handle, uint32_t level, MTPProperties **props, int *nrofprops)
+{
+	return ptp_mtp_getobjectproplist_generic (params, handle,
+		     0x00000000U,  /* 0x00000000U should be "all formats" */
+		     0xFFFFFFFFU,  /* 0xFFFFFFFFU should be "all properties" */
+		     0,
+		     level,
+		     props,
+		     nrofprops
 	);
 }
 
@@ -5219,6 +6596,15 @@ ptp_chdk_get_live_data(PTPParams* params, unsigned flags, unsigned char **data,
 	return PTP_RC_OK;
 }
 
+uint16_t
+ptp_chdk_get_live_data_to_handler(PTPParams* params, unsigned flags, PTPDataHandler *handler)
+{
+	PTPContainer ptp;
+
+	PTP_CNT_INIT(ptp, PTP_OC_CHDK, PTP_CHDK_GetDisplayData, flags);
+	return ptp_transaction_new(params, &ptp, PTP_DP_GETDATA, 0, handler);
+}
+
 uint16_t
 ptp_chdk_call_function(PTPParams* params, int *args, int size, int *ret)
 {
@@ -5244,7 +6630,7 @@ ptp_chdk_parse_live_data (PTPParams* params, unsigned char *data, unsigned int d
 	if (data_size < (header->vp_desc_start + sizeof (*vpd)) || data_size < (header->bm_desc_start + sizeof (*bmd)))
 		return PTP_ERROR_IO;
 	ptp_unpack_chdk_lv_framebuffer_desc (params, data+header->vp_desc_start, vpd);
-	ptp_unpack_chdk_lv_framebuffer_desc (params, data+header->vp_desc_start, bmd);
+	ptp_unpack_chdk_lv_framebuffer_desc (params, data+header->bm_desc_start, bmd);
 
 	/* The buffer_width field corresponds to the number of Y values in a row,
 	 * so the actual number of bytes would be either one and a half times
@@ -5288,6 +6674,33 @@ ptp_android_getpartialobject64 (PTPParams* params, uint32_t handle, uint64_t off
 	return ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, object, len);
 }
 
+/**
+ * ptp_android_getpartialobject64_to_handler:
+ * params:	PTPParams*
+ *		handle			- Object handle
+ *		offset			- Offset into object
+ *		maxbytes		- Maximum of bytes to read
+ *		handler			- a ptp data handler
+ *
+ * Get object 'handle' from device and send the data to the
+ * data handler. Start from offset and read at most maxbytes.
+ *
+ * This is a 64bit offset version of ptp_getpartialobject_to_handler.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_android_getpartialobject64_to_handler (PTPParams* params, uint32_t handle,
+				uint64_t offset, uint32_t maxbytes,
+				PTPDataHandler *handler)
+{
+	PTPContainer ptp;
+
+	/* casts due to varargs otherwise pushing 64bit values on the stack */
+	PTP_CNT_INIT(ptp, PTP_OC_ANDROID_GetPartialObject64, handle, ((uint32_t)offset & 0xFFFFFFFF), (uint32_t)(offset >> 32), maxbytes);
+	return ptp_transaction_new(params, &ptp, PTP_DP_GETDATA, 0, handler);
+}
+
 uint16_t
 ptp_android_sendpartialobject (PTPParams* params, uint32_t handle, uint64_t offset,
 				unsigned char* object,	uint32_t len)
@@ -5428,14 +6841,26 @@ ptp_free_objectinfo (PTPObjectInfo *oi)
 }
 
 void
-ptp_free_object (PTPObject *ob)
+ptp_free_object (PTPParams *params, PTPObject *ob)
 {
 	unsigned int i;
 	if (!ob) return;
 
-	ptp_free_objectinfo (&ob->oi);
+	free (PTP_OB_NAME(params, ob));
+	PTP_OB_NAME(params, ob) = NULL;
+	if (ob->ext) {
+		free (ob->ext->Keywords);
+		free (ob->ext);
+		ob->ext = NULL;
+	}
 	for (i=0;i<ob->nrofmtpprops;i++)
 		ptp_destroy_object_prop(&ob->mtpprops[i]);
+	free (ob->mtpprops);
+	ob->mtpprops = NULL;
+	ob->nrofmtpprops = 0;
+	free (ob->references);
+	ob->references = NULL;
+	ob->nrofreferences = 0;
 	ob->flags = 0;
 }
 
@@ -8818,29 +10243,657 @@ ptp_find_object_prop_in_cache(PTPParams *params, uint32_t const handle, uint32_t
 	return NULL;
 }
 
+/*
+ * The object cache.
+ *
+ * Every PTPObject is allocated on its own, so pointers to it stay valid
+ * until it is removed from the cache. params->objects is a dense, by
+ * default unordered array of the object pointers used for iterating,
+ * and params->objecthash an open addressing hash table with linear
+ * probing on the object id. Lookups, inserts and removals are O(1).
+ *
+ * The fields scans compare live in params->obcols, one array per field
+ * in the order of params->objects, and move along with the pointers
+ * whenever an object changes places there.
+ */
+#define PTP_OBJECTHASH_MINSIZE	64
+
+static inline unsigned int
+_ob_hash (uint32_t oid, unsigned int mask)
+{
+	uint32_t	h = oid * 0x9e3779b1U;
+
+	return (h ^ (h >> 16)) & mask;
+}
+
+/* Slot of handle in the hash table, or the empty slot it would go to */
+static unsigned int
+_ob_hash_slot (PTPParams *params, uint32_t handle)
+{
+	unsigned int	mask = params->objecthash_size - 1;
+	unsigned int	h = _ob_hash (handle, mask);
+
+	while (params->objecthash[h] && (params->objecthash[h]->oid != handle))
+		h = (h + 1) & mask;
+	return h;
+}
+
+static uint16_t
+_ob_hash_resize (PTPParams *params, unsigned int newsize)
+{
+	PTPObject	**newhash;
+	unsigned int	i, mask = newsize - 1;
+
+	newhash = calloc (newsize, sizeof(PTPObject*));
+	if (!newhash)
+		return PTP_RC_GeneralError;
+	for (i=0;i<params->nrofobjects;i++) {
+		unsigned int h = _ob_hash (params->objects[i]->oid, mask);
+
+		while (newhash[h])
+			h = (h + 1) & mask;
+		newhash[h] = params->objects[i];
+	}
+	free (params->objecthash);
+	params->objecthash	= newhash;
+	params->objecthash_size	= newsize;
+	return PTP_RC_OK;
+}
+
+/* Grows (or for NULL columns allocates) all columns to n entries. On
+ * failure the columns grown so far keep their new size. */
+static uint16_t
+_ob_cols_realloc (PTPObjectColumns *cols, unsigned int n)
+{
+	void	*p;
+
+	if (!(p = realloc (cols->oid, sizeof(cols->oid[0])*n)))
+		return PTP_RC_GeneralError;
+	cols->oid = p;
+	if (!(p = realloc (cols->parent, sizeof(cols->parent[0])*n)))
+		return PTP_RC_GeneralError;
+	cols->parent = p;
+	if (!(p = realloc (cols->storage, sizeof(cols->storage[0])*n)))
+		return PTP_RC_GeneralError;
+	cols->storage = p;
+	if (!(p = realloc (cols->format, sizeof(cols->format[0])*n)))
+		return PTP_RC_GeneralError;
+	cols->format = p;
+	if (!(p = realloc (cols->size, sizeof(cols->size[0])*n)))
+		return PTP_RC_GeneralError;
+	cols->size = p;
+	if (!(p = realloc (cols->name, sizeof(cols->name[0])*n)))
+		return PTP_RC_GeneralError;
+	cols->name = p;
+	return PTP_RC_OK;
+}
+
+static void
+_ob_cols_free (PTPObjectColumns *cols)
+{
+	free (cols->oid);
+	free (cols->parent);
+	free (cols->storage);
+	free (cols->format);
+	free (cols->size);
+	free (cols->name);
+	memset (cols, 0, sizeof(*cols));
+}
+
+/* Copies entry from of the columns src to entry to of dest */
+static inline void
+_ob_cols_copy (PTPObjectColumns *dest, unsigned int to,
+	       PTPObjectColumns const *src, unsigned int from)
+{
+	dest->oid[to]		= src->oid[from];
+	dest->parent[to]	= src->parent[from];
+	dest->storage[to]	= src->storage[from];
+	dest->format[to]	= src->format[from];
+	dest->size[to]		= src->size[from];
+	dest->name[to]		= src->name[from];
+}
+
+/*
+ * Secondary indexes over the object cache, on the parent, the storage
+ * and a hash of the filename. Each is a chained hash table whose chains
+ * run through the objects, and every object remembers the key it was
+ * filed under, so ptp_object_reindex() can move it after the fields
+ * changed. Lookups check the current fields, an object whose fields
+ * changed behind the index's back is just not found until it is
+ * reindexed. If the tables could not be grown, the lookups fall back
+ * to scanning params->objects.
+ */
+static uint32_t
+_ix_strhash (const char *s)
+{
+	uint32_t	h = 2166136261U;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619U;
+	return h;
+}
+
+static int
+_ix_matches (PTPParams *params, PTPObject *ob, int ix, uint32_t key)
+{
+	switch (ix) {
+	case PTP_OBJECTINDEX_PARENT:
+		return (ob->flags & (PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_PARENTOBJECT_LOADED)) &&
+			(PTP_OB_PARENT(params, ob) == key);
+	case PTP_OBJECTINDEX_STORAGE:
+		return (ob->flags & (PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_STORAGEID_LOADED)) &&
+			(PTP_OB_STORAGE(params, ob) == key);
+	case PTP_OBJECTINDEX_NAME:
+		return PTP_OB_NAME(params, ob) && (_ix_strhash (PTP_OB_NAME(params, ob)) == key);
+	}
+	return 0;
+}
+
+static void
+_ix_unlink (PTPParams *params, PTPObject *ob, int ix)
+{
+	if (!(ob->ixflags & (1<<ix)))
+		return;
+	if (ob->ixprev[ix])
+		ob->ixprev[ix]->ixnext[ix] = ob->ixnext[ix];
+	else
+		params->objectindex[ix][_ob_hash (ob->ixkey[ix], params->objectindex_size - 1)] = ob->ixnext[ix];
+	if (ob->ixnext[ix])
+		ob->ixnext[ix]->ixprev[ix] = ob->ixprev[ix];
+	ob->ixnext[ix] = ob->ixprev[ix] = NULL;
+	ob->ixflags &= ~(1<<ix);
+}
+
+static void
+_ix_link (PTPParams *params, PTPObject *ob, int ix, uint32_t key)
+{
+	PTPObject	**head = &params->objectindex[ix][_ob_hash (key, params->objectindex_size - 1)];
+
+	ob->ixkey[ix]	= key;
+	ob->ixprev[ix]	= NULL;
+	ob->ixnext[ix]	= *head;
+	if (*head)
+		(*head)->ixprev[ix] = ob;
+	*head = ob;
+	ob->ixflags |= 1<<ix;
+}
+
+static void
+_ix_free (PTPParams *params)
+{
+	unsigned int	i;
+	int		ix;
+
+	for (i=0;i<params->nrofobjects;i++) {
+		PTPObject *ob = params->objects[i];
+
+		ob->ixflags = 0;
+		for (ix=0;ix<PTP_OBJECTINDEX_MAX;ix++)
+			ob->ixnext[ix] = ob->ixprev[ix] = NULL;
+	}
+	for (ix=0;ix<PTP_OBJECTINDEX_MAX;ix++) {
+		free (params->objectindex[ix]);
+		params->objectindex[ix] = NULL;
+	}
+	params->objectindex_size = 0;
+}
+
+static uint16_t
+_ix_resize (PTPParams *params, unsigned int newsize)
+{
+	PTPObject	**newtabs[PTP_OBJECTINDEX_MAX];
+	unsigned int	i, oldsize = params->objectindex_size;
+	int		ix;
+
+	for (ix=0;ix<PTP_OBJECTINDEX_MAX;ix++) {
+		newtabs[ix] = calloc (newsize, sizeof(PTPObject*));
+		if (!newtabs[ix]) {
+			while (ix--)
+				free (newtabs[ix]);
+			return PTP_RC_GeneralError;
+		}
+	}
+	for (ix=0;ix<PTP_OBJECTINDEX_MAX;ix++) {
+		free (params->objectindex[ix]);
+		params->objectindex[ix] = newtabs[ix];
+	}
+	params->objectindex_size = newsize;
+	if (!oldsize)
+		return PTP_RC_OK;
+	for (i=0;i<params->nrofobjects;i++) {
+		PTPObject	*ob = params->objects[i];
+		unsigned int	filed = ob->ixflags;
+
+		ob->ixflags = 0;
+		for (ix=0;ix<PTP_OBJECTINDEX_MAX;ix++)
+			if (filed & (1<<ix))
+				_ix_link (params, ob, ix, ob->ixkey[ix]);
+	}
+	return PTP_RC_OK;
+}
+
+/* Files ob under its current parent, storage and filename. Has to be
+ * called whenever one of these changes on a cached object. */
+void
+ptp_object_reindex (PTPParams *params, PTPObject *ob)
+{
+	int	ix;
+
+	if (params->objectindex_broken)
+		return;
+	if (params->objectindex_size) {
+		for (ix=0;ix<PTP_OBJECTINDEX_MAX;ix++)
+			_ix_unlink (params, ob, ix);
+	}
+	if (params->nrofobjects > params->objectindex_size) {
+		unsigned int newsize = params->objectindex_size ? params->objectindex_size * 2 : PTP_OBJECTHASH_MINSIZE;
+
+		while (newsize < params->nrofobjects)
+			newsize *= 2;
+		if (_ix_resize (params, newsize) != PTP_RC_OK) {
+			ptp_debug (params, "ptp_object_reindex: out of memory, falling back to linear lookups");
+			_ix_free (params);
+			params->objectindex_broken = 1;
+			return;
+		}
+	}
+	if (ob->flags & (PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_PARENTOBJECT_LOADED))
+		_ix_link (params, ob, PTP_OBJECTINDEX_PARENT, PTP_OB_PARENT(params, ob));
+	if (ob->flags & (PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_STORAGEID_LOADED))
+		_ix_link (params, ob, PTP_OBJECTINDEX_STORAGE, PTP_OB_STORAGE(params, ob));
+	if (PTP_OB_NAME(params, ob))
+		_ix_link (params, ob, PTP_OBJECTINDEX_NAME, _ix_strhash (PTP_OB_NAME(params, ob)));
+}
+
+static PTPObject *
+_ix_next (PTPParams *params, int ix, uint32_t key, PTPObject *prev)
+{
+	PTPObject	*ob;
+
+	if (params->objectindex_broken || !params->objectindex_size) {
+		unsigned int i;
+
+		for (i = prev ? prev->objindex + 1 : 0; i<params->nrofobjects; i++)
+			if (_ix_matches (params, params->objects[i], ix, key))
+				return params->objects[i];
+		return NULL;
+	}
+	if (prev)
+		ob = prev->ixnext[ix];
+	else
+		ob = params->objectindex[ix][_ob_hash (key, params->objectindex_size - 1)];
+	for (; ob; ob = ob->ixnext[ix])
+		if ((ob->ixkey[ix] == key) && _ix_matches (params, ob, ix, key))
+			return ob;
+	return NULL;
+}
+
+/* Iterates the cached objects in folder parent (0 for the root), start
+ * with prev = NULL. The cache must not be modified while iterating. */
+PTPObject *
+ptp_objects_next_by_parent (PTPParams *params, uint32_t parent, PTPObject *prev)
+{
+	return _ix_next (params, PTP_OBJECTINDEX_PARENT, parent, prev);
+}
+
+/* Iterates the cached objects on storage, like ptp_objects_next_by_parent(). */
+PTPObject *
+ptp_objects_next_by_storage (PTPParams *params, uint32_t storage, PTPObject *prev)
+{
+	return _ix_next (params, PTP_OBJECTINDEX_STORAGE, storage, prev);
+}
+
+/* Finds a cached object named name in folder parent, or anywhere if
+ * parent is PTP_HANDLER_SPECIAL. */
+uint16_t
+ptp_object_find_by_name (PTPParams *params, uint32_t parent, const char *name, PTPObject **retob)
+{
+	uint32_t	key = _ix_strhash (name);
+	PTPObject	*ob = NULL;
+
+	*retob = NULL;
+	while ((ob = _ix_next (params, PTP_OBJECTINDEX_NAME, key, ob))) {
+		if (strcmp (PTP_OB_NAME(params, ob), name))
+			continue;
+		if ((parent != PTP_HANDLER_SPECIAL) &&
+		    !_ix_matches (params, ob, PTP_OBJECTINDEX_PARENT, parent))
+			continue;
+		*retob = ob;
+		return PTP_RC_OK;
+	}
+	return PTP_RC_GeneralError;
+}
+
+/*
+ * The object cache arena.
+ *
+ * Strings and property arrays of objects loaded in bulk are bump
+ * allocated from a list of chunks instead of one heap block each, and
+ * equal strings (artists, albums, genres, ...) are stored only once.
+ * Nothing in the arena is freed individually, the whole arena goes
+ * with ptp_arena_clear(). Objects with such data are flagged
+ * PTPOBJECT_ARENA, their strings are released with
+ * ptp_object_free_string().
+ */
+#define PTP_ARENA_MINCHUNK	(16*1024)
+#define PTP_ARENA_MAXCHUNK	(4*1024*1024)
+#define PTP_ARENA_ALIGN		8
+
+static uint16_t
+_arena_add_chunk (PTPArena *arena, size_t want)
+{
+	PTPArenaChunk	*chunk, **newsorted;
+	size_t		size = arena->chunks ? arena->chunks->size * 2 : PTP_ARENA_MINCHUNK;
+	unsigned int	i;
+
+	if (size > PTP_ARENA_MAXCHUNK)
+		size = PTP_ARENA_MAXCHUNK;
+	if (size < want)
+		size = want;
+	newsorted = realloc (arena->sorted, sizeof(PTPArenaChunk*)*(arena->nrofchunks + 1));
+	if (!newsorted)
+		return PTP_RC_GeneralError;
+	arena->sorted = newsorted;
+	chunk = malloc (sizeof(PTPArenaChunk) + size);
+	if (!chunk)
+		return PTP_RC_GeneralError;
+	chunk->size	= size;
+	chunk->used	= 0;
+	chunk->next	= arena->chunks;
+	arena->chunks	= chunk;
+
+	for (i=arena->nrofchunks;i && (arena->sorted[i-1] > chunk);i--)
+		arena->sorted[i] = arena->sorted[i-1];
+	arena->sorted[i] = chunk;
+	arena->nrofchunks++;
+	return PTP_RC_OK;
+}
+
+void *
+ptp_arena_alloc (PTPArena *arena, size_t size)
+{
+	PTPArenaChunk	*chunk = arena->chunks;
+	void		*ptr;
+
+	size = (size + PTP_ARENA_ALIGN - 1) & ~(size_t)(PTP_ARENA_ALIGN - 1);
+	if (!chunk || (chunk->size - chunk->used < size)) {
+		if (_arena_add_chunk (arena, size) != PTP_RC_OK)
+			return NULL;
+		chunk = arena->chunks;
+	}
+	ptr = (unsigned char*)(chunk + 1) + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
+
+static uint16_t
+_arena_strings_resize (PTPArena *arena, unsigned int newsize)
+{
+	char		**newstrings;
+	unsigned int	i, mask = newsize - 1;
+
+	newstrings = calloc (newsize, sizeof(char*));
+	if (!newstrings)
+		return PTP_RC_GeneralError;
+	for (i=0;i<arena->strings_size;i++) {
+		unsigned int h;
+
+		if (!arena->strings[i])
+			continue;
+		h = _ix_strhash (arena->strings[i]) & mask;
+		while (newstrings[h])
+			h = (h + 1) & mask;
+		newstrings[h] = arena->strings[i];
+	}
+	free (arena->strings);
+	arena->strings		= newstrings;
+	arena->strings_size	= newsize;
+	return PTP_RC_OK;
+}
+
+/* Returns the arena copy of str, the same one for equal strings. The
+ * result must not be modified or freed. */
+char *
+ptp_arena_intern (PTPArena *arena, const char *str)
+{
+	unsigned int	h, mask;
+	size_t		len;
+	char		*copy;
+
+	if ((arena->nrofstrings + 1) * 2 > arena->strings_size) {
+		unsigned int newsize = arena->strings_size ? arena->strings_size * 2 : 256;
+
+		if (_arena_strings_resize (arena, newsize) != PTP_RC_OK)
+			return NULL;
+	}
+	mask = arena->strings_size - 1;
+	h = _ix_strhash (str) & mask;
+	while (arena->strings[h]) {
+		if (!strcmp (arena->strings[h], str))
+			return arena->strings[h];
+		h = (h + 1) & mask;
+	}
+	len = strlen (str) + 1;
+	copy = ptp_arena_alloc (arena, len);
+	if (!copy)
+		return NULL;
+	memcpy (copy, str, len);
+	arena->strings[h] = copy;
+	arena->nrofstrings++;
+	return copy;
+}
+
+/* Whether ptr points into one of the arena chunks. */
+int
+ptp_arena_owns (PTPArena *arena, const void *ptr)
+{
+	unsigned int	lo = 0, hi = arena->nrofchunks;
+	const unsigned char *p = ptr;
+
+	while (lo < hi) {
+		unsigned int		mid = (lo + hi) / 2;
+		const unsigned char	*start = (const unsigned char*)(arena->sorted[mid] + 1);
+
+		if (p < start)
+			hi = mid;
+		else if (p >= start + arena->sorted[mid]->size)
+			lo = mid + 1;
+		else
+			return 1;
+	}
+	return 0;
+}
+
+void
+ptp_arena_clear (PTPArena *arena)
+{
+	while (arena->chunks) {
+		PTPArenaChunk *next = arena->chunks->next;
+
+		free (arena->chunks);
+		arena->chunks = next;
+	}
+	free (arena->sorted);
+	free (arena->strings);
+	memset (arena, 0, sizeof(*arena));
+}
+
+/* Frees a string of a cached object unless it lives in the arena. */
+void
+ptp_object_free_string (PTPParams *params, PTPObject *ob, char *str)
+{
+	if (!str)
+		return;
+	if ((ob->flags & PTPOBJECT_ARENA) && ptp_arena_owns (&params->objectarena, str))
+		return;
+	free (str);
+}
+
+/* The time in a PTP date string like DateModified, 0 if there is none. */
+time_t
+ptp_object_parse_time (const char *str)
+{
+	return ptp_unpack_PTPTIME (str);
+}
+
+/* ptp_free_object() for objects which may have data in the arena. */
+static void
+_ob_free_arena_object (PTPParams *params, PTPObject *ob)
+{
+	PTPArena	*arena = &params->objectarena;
+	unsigned int	i;
+
+	ptp_object_free_string (params, ob, PTP_OB_NAME(params, ob));
+	PTP_OB_NAME(params, ob) = NULL;
+	if (ob->ext) {
+		ptp_object_free_string (params, ob, ob->ext->Keywords);
+		free (ob->ext);
+		ob->ext = NULL;
+	}
+	for (i=0;i<ob->nrofmtpprops;i++) {
+		MTPProperties *prop = &ob->mtpprops[i];
+
+		if (prop->datatype == PTP_DTC_STR) {
+			ptp_object_free_string (params, ob, prop->propval.str);
+		} else if ((prop->datatype & PTP_DTC_ARRAY_MASK) && prop->propval.a.v &&
+			   !ptp_arena_owns (arena, prop->propval.a.v)) {
+			free (prop->propval.a.v);
+		}
+	}
+	if (ob->mtpprops && !ptp_arena_owns (arena, ob->mtpprops))
+		free (ob->mtpprops);
+	ob->mtpprops = NULL;
+	ob->nrofmtpprops = 0;
+	free (ob->references);
+	ob->references = NULL;
+	ob->nrofreferences = 0;
+	ob->flags = 0;
+}
+
+/* The recency list of the object cache, only reordered on lookups
+ * while the cache is bounded. */
+static void
+_ob_lru_unlink (PTPParams *params, PTPObject *ob)
+{
+	if (ob->lruprev)
+		ob->lruprev->lrunext = ob->lrunext;
+	else
+		params->objects_lruhead = ob->lrunext;
+	if (ob->lrunext)
+		ob->lrunext->lruprev = ob->lruprev;
+	else
+		params->objects_lrutail = ob->lruprev;
+	ob->lrunext = ob->lruprev = NULL;
+}
+
+static void
+_ob_lru_push (PTPParams *params, PTPObject *ob)
+{
+	ob->lruprev = NULL;
+	ob->lrunext = params->objects_lruhead;
+	if (ob->lrunext)
+		ob->lrunext->lruprev = ob;
+	else
+		params->objects_lrutail = ob;
+	params->objects_lruhead = ob;
+}
+
+/* Takes an object out of the hash, the indexes and the recency list
+ * and frees it, leaving its slot in the dense array to the caller. */
+static void
+_ob_unlink_free (PTPParams *params, PTPObject *ob)
+{
+	unsigned int	i, j, k, mask;
+
+	/* backward shift deletion, so no probe sequence gets interrupted */
+	mask = params->objecthash_size - 1;
+	i = _ob_hash_slot (params, ob->oid);
+	params->objecthash[i] = NULL;
+	j = i;
+	while (1) {
+		j = (j + 1) & mask;
+		if (!params->objecthash[j])
+			break;
+		k = _ob_hash (params->objecthash[j]->oid, mask);
+		/* leave it if its home slot k lies cyclically in (i,j] */
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+			continue;
+		params->objecthash[i] = params->objecthash[j];
+		params->objecthash[j] = NULL;
+		i = j;
+	}
+
+	if (params->objectindex_size) {
+		int ix;
+
+		for (ix=0;ix<PTP_OBJECTINDEX_MAX;ix++)
+			_ix_unlink (params, ob, ix);
+	}
+
+	_ob_lru_unlink (params, ob);
+
+	/* remove object from object info cache */
+	if (ob->flags & PTPOBJECT_ARENA)
+		_ob_free_arena_object (params, ob);
+	else
+		ptp_free_object (params, ob);
+	free (ob);
+}
+
 uint16_t
 ptp_remove_object_from_cache(PTPParams *params, uint32_t handle)
 {
-	unsigned int i;
-	PTPObject	*ob;
+	PTPObject	*ob, *last;
+	unsigned int	slot;
 
 	CHECK_PTP_RC(ptp_object_find (params, handle, &ob));
-	i = ob-params->objects;
-	/* remove object from object info cache */
-	ptp_free_object (ob);
 
-	if (i < params->nrofobjects-1)
-		memmove (ob,ob+1,(params->nrofobjects-1-i)*sizeof(PTPObject));
-	params->nrofobjects--;
-	/* We use less memory than before so this shouldn't fail */
-	params->objects = realloc(params->objects, sizeof(PTPObject)*params->nrofobjects);
+	slot = ob->objindex;
+	_ob_unlink_free (params, ob);
+
+	/* move the last object into the hole in the dense array */
+	last = params->objects[--params->nrofobjects];
+	params->objects[slot] = last;
+	_ob_cols_copy (&params->obcols, slot, &params->obcols, last->objindex);
+	last->objindex = slot;
 	return PTP_RC_OK;
 }
 
+/* Removes many objects from the cache, closing the holes they leave
+ * in the dense array in one pass in the end. Unlike repeated calls of
+ * ptp_remove_object_from_cache() this keeps the order of the objects
+ * left. Handles that are not cached are skipped. */
+void
+ptp_remove_objects_from_cache(PTPParams *params, uint32_t const *handles,
+			      unsigned int n)
+{
+	PTPObject	*ob;
+	unsigned int	i, j, removed = 0;
+
+	for (i=0;i<n;i++) {
+		if (ptp_object_find (params, handles[i], &ob) != PTP_RC_OK)
+			continue;
+		params->objects[ob->objindex] = NULL;
+		_ob_unlink_free (params, ob);
+		removed++;
+	}
+	if (!removed)
+		return;
+	for (i=0,j=0;i<params->nrofobjects;i++) {
+		if (!params->objects[i])
+			continue;
+		params->objects[j] = params->objects[i];
+		_ob_cols_copy (&params->obcols, j, &params->obcols, i);
+		params->objects[j]->objindex = j;
+		j++;
+	}
+	params->nrofobjects = j;
+}
+
 static int _cmp_ob (const void *a, const void *b)
 {
-	PTPObject *oa = (PTPObject*)a;
-	PTPObject *ob = (PTPObject*)b;
+	PTPObject *oa = *(PTPObject**)a;
+	PTPObject *ob = *(PTPObject**)b;
 
 	/* Do not subtract the oids and return ...
 	 * the unsigned int -> int conversion will overflow in cases
@@ -8850,86 +10903,217 @@ static int _cmp_ob (const void *a, const void *b)
 	return 0;
 }
 
+/* Orders the iteration array by object id, lookups do not need it.
+ * Left alone if there is no memory for the reordered columns. */
 void
 ptp_objects_sort (PTPParams *params)
 {
-	qsort (params->objects, params->nrofobjects, sizeof(PTPObject), _cmp_ob);
+	PTPObjectColumns	cols;
+	unsigned int		i;
+
+	if (!params->nrofobjects)
+		return;
+	memset (&cols, 0, sizeof(cols));
+	if (_ob_cols_realloc (&cols, params->objects_alloc) != PTP_RC_OK) {
+		_ob_cols_free (&cols);
+		return;
+	}
+	qsort (params->objects, params->nrofobjects, sizeof(PTPObject*), _cmp_ob);
+	for (i=0;i<params->nrofobjects;i++) {
+		_ob_cols_copy (&cols, i, &params->obcols, params->objects[i]->objindex);
+		params->objects[i]->objindex = i;
+	}
+	_ob_cols_free (&params->obcols);
+	params->obcols = cols;
 }
 
-/* Binary search in objects. Needs "objects" to be a sorted by objectid list!  */
+/* Drops all objects from the cache. */
+void
+ptp_objects_clear (PTPParams *params)
+{
+	unsigned int	i;
+	int		ix;
+
+	for (i=0;i<params->nrofobjects;i++) {
+		if (params->objects[i]->flags & PTPOBJECT_ARENA)
+			_ob_free_arena_object (params, params->objects[i]);
+		else
+			ptp_free_object (params, params->objects[i]);
+		free (params->objects[i]);
+	}
+	ptp_arena_clear (&params->objectarena);
+	for (ix=0;ix<PTP_OBJECTINDEX_MAX;ix++) {
+		free (params->objectindex[ix]);
+		params->objectindex[ix] = NULL;
+	}
+	params->objectindex_size	= 0;
+	params->objectindex_broken	= 0;
+	free (params->objects);
+	free (params->objecthash);
+	_ob_cols_free (&params->obcols);
+	params->objects		= NULL;
+	params->nrofobjects	= 0;
+	params->objects_alloc	= 0;
+	params->objecthash	= NULL;
+	params->objecthash_size	= 0;
+	params->objects_lruhead	= NULL;
+	params->objects_lrutail	= NULL;
+}
+
+/* Bounds the cache to max objects, dropping the least recently used
+ * ones if there are more already. 0 removes the bound. */
+void
+ptp_objects_set_limit (PTPParams *params, unsigned int max)
+{
+	params->objects_max = max;
+	while (max && (params->nrofobjects > max))
+		ptp_remove_object_from_cache (params, params->objects_lrutail->oid);
+}
+
+/* Hash lookup in objects. */
 uint16_t
 ptp_object_find (PTPParams *params, uint32_t handle, PTPObject **retob)
 {
-	PTPObject	tmpob;
-
-	tmpob.oid = handle;
-	*retob = bsearch (&tmpob, params->objects, params->nrofobjects, sizeof(tmpob), _cmp_ob);
+	*retob = NULL;
+	if (!params->nrofobjects)
+		return PTP_RC_GeneralError;
+	*retob = params->objecthash[_ob_hash_slot (params, handle)];
 	if (!*retob)
 		return PTP_RC_GeneralError;
+	if (params->objects_max && (params->objects_lruhead != *retob)) {
+		_ob_lru_unlink (params, *retob);
+		_ob_lru_push (params, *retob);
+	}
 	return PTP_RC_OK;
 }
 
-/* Binary search in objects + insert of not found. Needs "objects" to be a sorted by objectid list!  */
+/* Hash lookup in objects + insert of not found. */
 uint16_t
 ptp_object_find_or_insert (PTPParams *params, uint32_t handle, PTPObject **retob)
 {
-	unsigned int 	begin, end, cursor;
-	unsigned int	insertat;
-	PTPObject	*newobs;
+	PTPObject	*ob;
 
 	if (!handle) return PTP_RC_GeneralError;
-	*retob = NULL;
-	if (!params->nrofobjects) {
-		params->objects = calloc(1,sizeof(PTPObject));
-		params->nrofobjects = 1;
-		params->objects[0].oid = handle;
-		*retob = &params->objects[0];
+	if (ptp_object_find (params, handle, retob) == PTP_RC_OK)
 		return PTP_RC_OK;
+
+	/* make room in a bounded cache, the oldest objects go first */
+	while (params->objects_max && (params->nrofobjects >= params->objects_max))
+		ptp_remove_object_from_cache (params, params->objects_lrutail->oid);
+
+	/* keep the hash table at most half full */
+	if ((params->nrofobjects + 1) * 2 > params->objecthash_size) {
+		unsigned int newsize = params->objecthash_size ? params->objecthash_size * 2 : PTP_OBJECTHASH_MINSIZE;
+
+		CHECK_PTP_RC(_ob_hash_resize (params, newsize));
 	}
-	begin = 0;
-	end = params->nrofobjects-1;
-	/*ptp_debug (params, "searching %08x, total=%d", handle, params->nrofobjects);*/
-	while (1) {
-		cursor = (end-begin)/2+begin;
-		/*ptp_debug (params, "ob %d: %08x [%d-%d]", cursor, params->objects[cursor].oid, begin, end);*/
-		if (params->objects[cursor].oid == handle) {
-			*retob = &params->objects[cursor];
-			return PTP_RC_OK;
-		}
-		if (params->objects[cursor].oid < handle)
-			begin = cursor;
-		else
-			end = cursor;
-		if ((end - begin) <= 1)
-			break;
+	if (params->nrofobjects == params->objects_alloc) {
+		unsigned int	newalloc = params->objects_alloc ? params->objects_alloc * 2 : PTP_OBJECTHASH_MINSIZE;
+		PTPObject	**newobs;
+
+		newobs = realloc (params->objects, sizeof(PTPObject*)*newalloc);
+		if (!newobs) return PTP_RC_GeneralError;
+		params->objects		= newobs;
+		CHECK_PTP_RC(_ob_cols_realloc (&params->obcols, newalloc));
+		params->objects_alloc	= newalloc;
 	}
-	if (params->objects[begin].oid == handle) {
-		*retob = &params->objects[begin];
-		return PTP_RC_OK;
+	ob = calloc (1, sizeof(PTPObject));
+	if (!ob) return PTP_RC_GeneralError;
+	ob->oid		= handle;
+	ob->objindex	= params->nrofobjects;
+	params->obcols.oid[ob->objindex]	= handle;
+	params->obcols.parent[ob->objindex]	= 0;
+	params->obcols.storage[ob->objindex]	= 0;
+	params->obcols.format[ob->objindex]	= 0;
+	params->obcols.size[ob->objindex]	= 0;
+	params->obcols.name[ob->objindex]	= NULL;
+	params->objects[params->nrofobjects++] = ob;
+	params->objecthash[_ob_hash_slot (params, handle)] = ob;
+	_ob_lru_push (params, ob);
+	*retob = ob;
+	return PTP_RC_OK;
+}
+
+/* The rarely set fields of ob, allocated zeroed on first use. NULL if
+ * out of memory. */
+PTPObjectExt *
+ptp_object_ext (PTPObject *ob)
+{
+	if (!ob->ext)
+		ob->ext = calloc (1, sizeof(PTPObjectExt));
+	return ob->ext;
+}
+
+/* Stores the objectinfo oi in the cached object ob. The strings of oi
+ * are handed over, oi->Filename and oi->Keywords are NULL afterwards.
+ * The caller reindexes ob. */
+void
+ptp_object_set_objectinfo (PTPParams *params, PTPObject *ob, PTPObjectInfo *oi)
+{
+	ptp_object_free_string (params, ob, PTP_OB_NAME(params, ob));
+	PTP_OB_PARENT(params, ob)	= oi->ParentObject;
+	PTP_OB_STORAGE(params, ob)	= oi->StorageID;
+	PTP_OB_FORMAT(params, ob)	= oi->ObjectFormat;
+	PTP_OB_SIZE(params, ob)		= oi->ObjectCompressedSize;
+	PTP_OB_NAME(params, ob)		= oi->Filename;
+	ob->ProtectionStatus		= oi->ProtectionStatus;
+	ob->AssociationType		= oi->AssociationType;
+	ob->ModificationDate		= oi->ModificationDate;
+	if (ob->ext) {
+		ptp_object_free_string (params, ob, ob->ext->Keywords);
+		ob->ext->Keywords = NULL;
 	}
-	if (params->objects[end].oid == handle) {
-		*retob = &params->objects[end];
-		return PTP_RC_OK;
+	if ((ob->ext || oi->ThumbFormat || oi->ThumbCompressedSize ||
+	     oi->ThumbPixWidth || oi->ThumbPixHeight || oi->ImagePixWidth ||
+	     oi->ImagePixHeight || oi->ImageBitDepth || oi->AssociationDesc ||
+	     oi->SequenceNumber || oi->CaptureDate || oi->Keywords) &&
+	    ptp_object_ext (ob)) {
+		PTPObjectExt *ext = ob->ext;
+
+		ext->ThumbFormat		= oi->ThumbFormat;
+		ext->ThumbCompressedSize	= oi->ThumbCompressedSize;
+		ext->ThumbPixWidth		= oi->ThumbPixWidth;
+		ext->ThumbPixHeight		= oi->ThumbPixHeight;
+		ext->ImagePixWidth		= oi->ImagePixWidth;
+		ext->ImagePixHeight		= oi->ImagePixHeight;
+		ext->ImageBitDepth		= oi->ImageBitDepth;
+		ext->AssociationDesc		= oi->AssociationDesc;
+		ext->SequenceNumber		= oi->SequenceNumber;
+		ext->CaptureDate		= oi->CaptureDate;
+		ext->Keywords			= oi->Keywords;
+		oi->Keywords = NULL;
+	}
+	free (oi->Keywords);
+	oi->Filename = oi->Keywords = NULL;
+}
+
+/* Fills oi from the cached object ob. The strings still belong to ob,
+ * oi must not be freed. */
+void
+ptp_object_get_objectinfo (PTPParams *params, PTPObject *ob, PTPObjectInfo *oi)
+{
+	memset (oi, 0, sizeof(*oi));
+	oi->ParentObject		= PTP_OB_PARENT(params, ob);
+	oi->StorageID			= PTP_OB_STORAGE(params, ob);
+	oi->ObjectFormat		= PTP_OB_FORMAT(params, ob);
+	oi->ObjectCompressedSize	= PTP_OB_SIZE(params, ob);
+	oi->Filename			= PTP_OB_NAME(params, ob);
+	oi->ProtectionStatus		= ob->ProtectionStatus;
+	oi->AssociationType		= ob->AssociationType;
+	oi->ModificationDate		= ob->ModificationDate;
+	if (ob->ext) {
+		oi->ThumbFormat		= ob->ext->ThumbFormat;
+		oi->ThumbCompressedSize	= ob->ext->ThumbCompressedSize;
+		oi->ThumbPixWidth	= ob->ext->ThumbPixWidth;
+		oi->ThumbPixHeight	= ob->ext->ThumbPixHeight;
+		oi->ImagePixWidth	= ob->ext->ImagePixWidth;
+		oi->ImagePixHeight	= ob->ext->ImagePixHeight;
+		oi->ImageBitDepth	= ob->ext->ImageBitDepth;
+		oi->AssociationDesc	= ob->ext->AssociationDesc;
+		oi->SequenceNumber	= ob->ext->SequenceNumber;
+		oi->CaptureDate		= ob->ext->CaptureDate;
+		oi->Keywords		= ob->ext->Keywords;
 	}
-	if ((begin == 0) && (handle < params->objects[0].oid)) {
-		insertat=begin;
-	} else {
-		if ((end == params->nrofobjects-1) && (handle > params->objects[end].oid))
-			insertat=end+1;
-		else
-			insertat=begin+1;
-	}
-	/*ptp_debug (params, "inserting oid %x at [%x,%x], begin=%d, end=%d, insertat=%d\n", handle, params->objects[begin].oid, params->objects[end].oid, begin, end, insertat);*/
-	newobs = realloc (params->objects, sizeof(PTPObject)*(params->nrofobjects+1));
-	if (!newobs) return PTP_RC_GeneralError;
-	params->objects = newobs;
-	if (insertat<params->nrofobjects)
-		memmove (&params->objects[insertat+1],&params->objects[insertat],(params->nrofobjects-insertat)*sizeof(PTPObject));
-	memset(&params->objects[insertat],0,sizeof(PTPObject));
-	params->objects[insertat].oid = handle;
-	*retob = &params->objects[insertat];
-	params->nrofobjects++;
-	return PTP_RC_OK;
 }
 
 uint16_t
@@ -8957,37 +11141,40 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 #define X (PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_STORAGEID_LOADED|PTPOBJECT_PARENTOBJECT_LOADED)
 	if ((want & X) && ((ob->flags & X) != X)) {
 		uint32_t	saveparent = 0;
+		PTPObjectInfo	oi;
 
 		/* One EOS issue, where getobjecthandles(root) returns obs without root flag. */
 		if (ob->flags & PTPOBJECT_PARENTOBJECT_LOADED)
-			saveparent = ob->oi.ParentObject;
+			saveparent = PTP_OB_PARENT(params, ob);
 
-		ret = ptp_getobjectinfo (params, handle, &ob->oi);
+		memset (&oi, 0, sizeof(oi));
+		ret = ptp_getobjectinfo (params, handle, &oi);
 		if (ret != PTP_RC_OK) {
 			/* kill it from the internal list ... */
 			ptp_remove_object_from_cache(params, handle);
 			return ret;
 		}
-		if (!ob->oi.Filename) ob->oi.Filename=strdup("<none>");
+		if (!oi.Filename) oi.Filename=strdup("<none>");
+		ptp_object_set_objectinfo (params, ob, &oi);
 		if (ob->flags & PTPOBJECT_PARENTOBJECT_LOADED) {
-			if (ob->oi.ParentObject != saveparent)
-				ptp_debug (params, "saved parent %08x is not the same as read via getobjectinfo %08x", ob->oi.ParentObject, saveparent);
-			ob->oi.ParentObject = saveparent;
+			if (PTP_OB_PARENT(params, ob) != saveparent)
+				ptp_debug (params, "saved parent %08x is not the same as read via getobjectinfo %08x", PTP_OB_PARENT(params, ob), saveparent);
+			PTP_OB_PARENT(params, ob) = saveparent;
 		}
 
 		/* Second EOS issue, 0x20000000 has 0x20000000 as parent */
-		if (ob->oi.ParentObject == handle)
-			ob->oi.ParentObject = 0;
+		if (PTP_OB_PARENT(params, ob) == handle)
+			PTP_OB_PARENT(params, ob) = 0;
 
 		/* Detect if the file is larger than 4GB ... indicator is size 0xffffffff ...
 		 * In that case explicitly request the MTP object proplist to get the right size */
-		if (ob->oi.ObjectCompressedSize == 0xffffffffUL) {
+		if (PTP_OB_SIZE(params, ob) == 0xffffffffUL) {
 			uint64_t	newsize;
 			if (	(params->deviceinfo.VendorExtensionID == PTP_VENDOR_NIKON)	&&
 				ptp_operation_issupported(params,PTP_OC_NIKON_GetObjectSize)	&&
 				(PTP_RC_OK == ptp_nikon_getobjectsize(params, handle, &newsize))
 			) {
-				ob->oi.ObjectCompressedSize = newsize;
+				PTP_OB_SIZE(params, ob) = newsize;
 				goto read64bit;
 			}
 			/* more methods like e.g. for Canon */
@@ -8998,12 +11185,12 @@ read64bit:		;
 		}
 
 		/* Apple iOS X does that for the root folder. */
-		if ((ob->oi.ParentObject == ob->oi.StorageID)) {
+		if ((PTP_OB_PARENT(params, ob) == PTP_OB_STORAGE(params, ob))) {
 			PTPObject *parentob;
 
-			if (ptp_object_find (params, ob->oi.ParentObject, &parentob) != PTP_RC_OK) {
-				ptp_debug (params, "parent %08x of %s has same id as storage id. and no object found ... rewriting to 0.", ob->oi.ParentObject, ob->oi.Filename);
-				ob->oi.ParentObject = 0;
+			if (ptp_object_find (params, PTP_OB_PARENT(params, ob), &parentob) != PTP_RC_OK) {
+				ptp_debug (params, "parent %08x of %s has same id as storage id. and no object found ... rewriting to 0.", PTP_OB_PARENT(params, ob), PTP_OB_NAME(params, ob));
+				PTP_OB_PARENT(params, ob) = 0;
 			}
 		}
 
@@ -9014,8 +11201,8 @@ read64bit:		;
 			uint32_t            numents = 0;
 
 			ret = ptp_canon_getobjectinfo(params,
-				ob->oi.StorageID,0,
-				ob->oi.ParentObject,handle,
+				PTP_OB_STORAGE(params, ob),0,
+				PTP_OB_PARENT(params, ob),handle,
 				&ents,&numents
 			);
 			if ((ret == PTP_RC_OK) && (numents >= 1))
@@ -9061,47 +11248,49 @@ read64bit:		;
 
 				switch (prop->property) {
 				case PTP_OPC_StorageID:
-					ob->oi.StorageID = prop->propval.u32;
+					PTP_OB_STORAGE(params, ob) = prop->propval.u32;
 					break;
 				case PTP_OPC_ObjectFormat:
-					ob->oi.ObjectFormat = prop->propval.u16;
+					PTP_OB_FORMAT(params, ob) = prop->propval.u16;
 					break;
 				case PTP_OPC_ProtectionStatus:
-					ob->oi.ProtectionStatus = prop->propval.u16;
+					ob->ProtectionStatus = prop->propval.u16;
 					break;
 				case PTP_OPC_ObjectSize:
 					if (prop->datatype == PTP_DTC_UINT64) {
-						ob->oi.ObjectCompressedSize = prop->propval.u64;
+						PTP_OB_SIZE(params, ob) = prop->propval.u64;
 					} else if (prop->datatype == PTP_DTC_UINT32) {
-						ob->oi.ObjectCompressedSize = prop->propval.u32;
+						PTP_OB_SIZE(params, ob) = prop->propval.u32;
 					}
 					break;
 				case PTP_OPC_AssociationType:
-					ob->oi.AssociationType = prop->propval.u16;
+					ob->AssociationType = prop->propval.u16;
 					break;
 				case PTP_OPC_AssociationDesc:
-					ob->oi.AssociationDesc = prop->propval.u32;
+					if (ptp_object_ext (ob))
+						ob->ext->AssociationDesc = prop->propval.u32;
 					break;
 				case PTP_OPC_ObjectFileName:
 					if (prop->propval.str) {
-						free(ob->oi.Filename);
-						ob->oi.Filename = strdup(prop->propval.str);
+						ptp_object_free_string(params, ob, PTP_OB_NAME(params, ob));
+						PTP_OB_NAME(params, ob) = strdup(prop->propval.str);
 					}
 					break;
 				case PTP_OPC_DateCreated:
-					ob->oi.CaptureDate = ptp_unpack_PTPTIME(prop->propval.str);
+					if (ptp_object_ext (ob))
+						ob->ext->CaptureDate = ptp_unpack_PTPTIME(prop->propval.str);
 					break;
 				case PTP_OPC_DateModified:
-					ob->oi.ModificationDate = ptp_unpack_PTPTIME(prop->propval.str);
+					ob->ModificationDate = ptp_unpack_PTPTIME(prop->propval.str);
 					break;
 				case PTP_OPC_Keywords:
-					if (prop->propval.str) {
-						free(ob->oi.Keywords);
-						ob->oi.Keywords = strdup(prop->propval.str);
+					if (prop->propval.str && ptp_object_ext (ob)) {
+						ptp_object_free_string(params, ob, ob->ext->Keywords);
+						ob->ext->Keywords = strdup(prop->propval.str);
 					}
 					break;
 				case PTP_OPC_ParentObject:
-					ob->oi.ParentObject = prop->propval.u32;
+					PTP_OB_PARENT(params, ob) = prop->propval.u32;
 					break;
 				}
 			}
@@ -9204,6 +11393,7 @@ read64bit:		;
 		ob->flags |= PTPOBJECT_MTPPROPLIST_LOADED;
 fallback:	;
 	}
+	ptp_object_reindex (params, ob);
 	if ((ob->flags & want) == want)
 		return PTP_RC_OK;
 	ptp_debug (params, "ptp_object_want: oid 0x%08x, want flags %x, have only %x?", handle, want, ob->flags);
@@ -3522,9 +3522,19 @@ typedef uint16_t (* PTPDataGetFunc)	(PTPParams* params, void*priv,
 typedef uint16_t (* PTPDataPutFunc)	(PTPParams* params, void*priv,
 					unsigned long sendlen,
 	                                unsigned char *data);
+/*
+ * Optional for receiving handlers: return where wantlen bytes, starting
+ * offset bytes past the data already put, can be stored in place, or
+ * NULL if they cannot. The transport then reads straight into that
+ * memory and calls putfunc with the same pointer.
+ */
+typedef unsigned char *(* PTPDataGetBufFunc)	(PTPParams* params, void*priv,
+					unsigned long offset,
+					unsigned long wantlen);
 typedef struct _PTPDataHandler {
 	PTPDataGetFunc		getfunc;
 	PTPDataPutFunc		putfunc;
+	PTPDataGetBufFunc	getbuffunc;
 	void			*priv;
 } PTPDataHandler;
 
@@ -3563,19 +3573,111 @@ struct _PTPObject {
 #define PTPOBJECT_DIRECTORY_LOADED	(1<<3)
 #define PTPOBJECT_PARENTOBJECT_LOADED	(1<<4)
 #define PTPOBJECT_STORAGEID_LOADED	(1<<5)
-
-	PTPObjectInfo	oi;
+#define PTPOBJECT_ARENA			(1<<6)	/* strings may live in params->objectarena */
+#define PTPOBJECT_REFERENCES_LOADED	(1<<7)
+
+	/* The object id, parent, storage, format, size and filename are
+	 * kept in params->obcols, read them with the PTP_OB_* macros.
+	 * The objectinfo fields MTP devices leave empty are in ext, which
+	 * is only allocated if one of them is set, see ptp_object_ext(). */
+	uint16_t		ProtectionStatus;
+	uint16_t		AssociationType;
+	time_t			ModificationDate;
+	struct _PTPObjectExt	*ext;
 	uint32_t	canon_flags;
 	MTPProperties	*mtpprops;
 	unsigned int	nrofmtpprops;
+
+	/* MTP object references, valid with PTPOBJECT_REFERENCES_LOADED
+	 * while referencesgen matches params->objectreferences_gen */
+	uint32_t	*references;
+	uint32_t	nrofreferences;
+	unsigned int	referencesgen;
+
+	unsigned int	objindex;	/* position in params->objects */
+
+	/* links of the secondary indexes, see ptp_object_reindex() */
+#define PTP_OBJECTINDEX_PARENT	0
+#define PTP_OBJECTINDEX_STORAGE	1
+#define PTP_OBJECTINDEX_NAME	2
+#define PTP_OBJECTINDEX_MAX	3
+	unsigned int		ixflags;
+	uint32_t		ixkey[PTP_OBJECTINDEX_MAX];
+	struct _PTPObject	*ixnext[PTP_OBJECTINDEX_MAX];
+	struct _PTPObject	*ixprev[PTP_OBJECTINDEX_MAX];
+
+	/* recency list, most recently used first, see params->objects_max */
+	struct _PTPObject	*lrunext;
+	struct _PTPObject	*lruprev;
 };
 typedef struct _PTPObject PTPObject;
 
+/* The rarely set objectinfo fields of a cached object */
+struct _PTPObjectExt {
+	uint16_t	ThumbFormat;
+	uint32_t	ThumbCompressedSize;
+	uint32_t	ThumbPixWidth;
+	uint32_t	ThumbPixHeight;
+	uint32_t	ImagePixWidth;
+	uint32_t	ImagePixHeight;
+	uint32_t	ImageBitDepth;
+	uint32_t	AssociationDesc;
+	uint32_t	SequenceNumber;
+	time_t		CaptureDate;
+	char		*Keywords;
+};
+typedef struct _PTPObjectExt PTPObjectExt;
+
+/* The fields of the cached objects that listings and lookups scan, one
+ * array per field, parallel to params->objects and indexed by objindex,
+ * so that a scan touches only the fields it compares. */
+struct _PTPObjectColumns {
+	uint32_t	*oid;
+	uint32_t	*parent;	/* ParentObject */
+	uint32_t	*storage;	/* StorageID */
+	uint16_t	*format;	/* ObjectFormat */
+	uint64_t	*size;		/* ObjectCompressedSize */
+	char		**name;		/* Filename */
+};
+typedef struct _PTPObjectColumns PTPObjectColumns;
+
+/* The column fields of a cached object, as lvalues */
+#define PTP_OB_PARENT(params,ob)	((params)->obcols.parent[(ob)->objindex])
+#define PTP_OB_STORAGE(params,ob)	((params)->obcols.storage[(ob)->objindex])
+#define PTP_OB_FORMAT(params,ob)	((params)->obcols.format[(ob)->objindex])
+#define PTP_OB_SIZE(params,ob)		((params)->obcols.size[(ob)->objindex])
+#define PTP_OB_NAME(params,ob)		((params)->obcols.name[(ob)->objindex])
+/* A field of ob->ext, 0 if there is none */
+#define PTP_OB_EXT(ob,field)		((ob)->ext ? (ob)->ext->field : 0)
+
+/* Bump allocator with string interning for the object cache */
+typedef struct _PTPArenaChunk PTPArenaChunk;
+struct _PTPArenaChunk {
+	PTPArenaChunk	*next;
+	size_t		size;
+	size_t		used;
+};
+
+struct _PTPArena {
+	PTPArenaChunk	*chunks;	/* newest first */
+	PTPArenaChunk	**sorted;	/* by address, for ptp_arena_owns() */
+	unsigned int	nrofchunks;
+	char		**strings;	/* interned strings, open addressing */
+	unsigned int	strings_size;
+	unsigned int	nrofstrings;
+};
+typedef struct _PTPArena PTPArena;
+
 /* The Device Property Cache */
 struct _PTPDeviceProperty {
 	time_t			timestamp;
 	PTPDevicePropDesc	desc;
 	PTPPropertyValue	value;
+	/* when value was read, 0 if it was not or is stale */
+	time_t			valuetime;
+	uint16_t		valuetype;
+	/* seconds to cache this one, 0 = params->cachetime, < 0 = never */
+	int			cachetime;
 };
 typedef struct _PTPDeviceProperty PTPDeviceProperty;
 
@@ -3589,9 +3691,48 @@ struct _MTPObjectFormat {
 	uint16_t	ofc;
 	unsigned int	nrofpds;
 	MTPPropertyDesc	*pds;
+	/* result of GetObjectPropsSupported, once propsloaded is set */
+	int		propsloaded;
+	uint32_t	nrofprops;
+	uint16_t	*props;
 };
 typedef struct _MTPObjectFormat MTPObjectFormat;
 
+/* Per operation statistics, see ptp_init_stats(). Latencies are
+ * kept in log2 microsecond buckets: bucket i counts values from 2^i
+ * up to 2^(i+1) usecs, the last one everything beyond. */
+#define PTP_STATS_BUCKETS	24
+
+struct _PTPOpStats {
+	uint16_t	opcode;
+	uint32_t	count;
+	uint32_t	errors;
+	uint32_t	retries;
+	uint32_t	cancels;
+	uint64_t	bytes_in;
+	uint64_t	bytes_out;
+	/* sums in usecs, divide by count for the mean */
+	uint64_t	first_byte_usecs;	/* request to first data/response */
+	uint64_t	data_usecs;		/* data phase */
+	uint64_t	total_usecs;
+	uint32_t	first_byte_hist[PTP_STATS_BUCKETS];
+	uint32_t	data_hist[PTP_STATS_BUCKETS];
+};
+typedef struct _PTPOpStats PTPOpStats;
+
+struct _PTPStats {
+	PTPOpStats	*ops;
+	unsigned int	nrofops;
+	/* the transaction in progress, filled in along the way */
+	uint64_t	start;
+	uint64_t	data_start;
+	uint64_t	first_byte;
+	uint64_t	data_end;
+	uint64_t	bytes_in;
+	uint32_t	retries;
+};
+typedef struct _PTPStats PTPStats;
+
 /* Transaction data phase description, internal flags to sendreq / transaction driver. */
 #define PTP_DP_NODATA           0x0000  /* no data phase */
 #define PTP_DP_SENDDATA         0x0001  /* sending data */
@@ -3629,6 +3770,25 @@ struct _PTPParams {
 	/* ptp session ID */
 	uint32_t	session_id;
 
+	/* serialises ptp_transaction_new(), see ptp_init_transaction_lock() */
+	void		*transaction_lock;
+	/* per operation statistics, NULL unless collecting */
+	PTPStats	*stats;
+	/* session being recorded or replayed, see ptp-trace.c */
+	void		*trace;
+	/* binary event ring, see ptp-ring.c */
+	void		*ring;
+	/* sees all object data moved while set, see ptp_transaction_new() */
+	void		(*tee_func)(void *priv, unsigned char const *data,
+				    unsigned long len);
+	void		*tee_priv;
+	/* authentication put off until the first operation that needs
+	 * it, see ptp_transaction_new() */
+	uint16_t	(*authenticate)(PTPParams *params);
+	/* told of every chunk a PTP/IP transfer moves, nonzero cancels
+	 * the transfer, see ptpip.c */
+	int		(*ptpip_progress)(PTPParams *params, unsigned long bytes);
+
 	/* used for open capture */
 	uint32_t	opencapture_transid;
 
@@ -3640,8 +3800,31 @@ struct _PTPParams {
 	MTPObjectFormat	*objectformats;
 
 	/* PTP: internal structures used by ptp driver */
-	PTPObject	*objects;
+	/* The object cache. Objects are allocated individually and do not
+	 * move, objects[] lists them in no particular order and objecthash
+	 * is an open addressing table on the object id for lookups. */
+	PTPObject	**objects;
+	PTPObjectColumns obcols;	/* objects_alloc entries each */
 	unsigned int	nrofobjects;
+	unsigned int	objects_alloc;
+	PTPObject	**objecthash;
+	unsigned int	objecthash_size;
+	/* If objects_max is set, the least recently used objects are
+	 * dropped to keep at most that many in the cache. */
+	unsigned int	objects_max;
+	PTPObject	*objects_lruhead;
+	PTPObject	*objects_lrutail;
+	/* Bumped whenever an object is deleted, as the device drops it
+	 * from all references, see ptp_mtp_getobjectreferences_cached(). */
+	unsigned int	objectreferences_gen;
+	/* Chained hash tables on parent, storage and filename hash,
+	 * linked through the objects themselves. */
+	PTPObject	**objectindex[PTP_OBJECTINDEX_MAX];
+	unsigned int	objectindex_size;
+	int		objectindex_broken;
+	/* Filenames, property strings and property arrays of objects
+	 * flagged PTPOBJECT_ARENA, freed as a whole with the cache. */
+	PTPArena	objectarena;
 
 	PTPDeviceInfo	deviceinfo;
 
@@ -3696,6 +3879,11 @@ struct _PTPParams {
 	uint8_t		cameraguid[16];
 	uint32_t	eventpipeid;
 	char		*cameraname;
+	/* connected to ptp_ptpip_serve() over a unix socket */
+	int		ptpip_local;
+	/* left of a data packet by a cancelled read, skipped before
+	 * the next packet header on cmdfd */
+	uint32_t	ptpip_unread;
 
 	/* Olympus UMS wrapping related data */
 	PTPDeviceInfo	outer_deviceinfo;
@@ -3708,6 +3896,8 @@ struct _PTPParams {
 	iconv_t	cd_locale_to_ucs2;
 	iconv_t cd_ucs2_to_locale;
 #endif
+	/* strings are UTF-8 on our side, convert without iconv */
+	int		utf8_strings;
 
 	/* IO: Sometimes the response packet get send in the dataphase
 	 * too. This only happens for a Samsung player now.
@@ -3748,6 +3938,10 @@ uint16_t ptp_ptpip_getdata	(PTPParams* params, PTPContainer* ptp,
 uint16_t ptp_ptpip_event_wait	(PTPParams* params, PTPContainer* event);
 uint16_t ptp_ptpip_event_check	(PTPParams* params, PTPContainer* event);
 uint16_t ptp_ptpip_event_check_queue	(PTPParams* params, PTPContainer* event);
+uint16_t ptp_ptpip_cancelreq	(PTPParams* params, uint32_t transaction_id);
+void     ptp_ptpip_disconnect	(PTPParams* params);
+int      ptp_ptpip_serve	(PTPParams* params, const char *path,
+				 PTPIOGetResp event_check);
 
 int      ptp_fujiptpip_connect	(PTPParams* params, const char *port);
 int      ptp_fujiptpip_init_event (PTPParams* params, const char *address);
@@ -3773,6 +3967,8 @@ uint16_t ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
                 uint16_t flags, uint64_t sendlen,
                 PTPDataHandler *handler
 );
+int ptp_handler_fd (PTPDataHandler *handler);
+int ptp_carries_object_data (uint16_t opcode);
 uint16_t ptp_transaction (PTPParams* params, PTPContainer* ptp,
                 uint16_t flags, uint64_t sendlen,
                 unsigned char **data, unsigned int *recvlen
@@ -3850,12 +4046,20 @@ uint16_t ptp_getpartialobject_to_handler (PTPParams* params, uint32_t handle, ui
 
 uint16_t ptp_getthumb		(PTPParams *params, uint32_t handle,
 				unsigned char** object, unsigned int *len);
+uint16_t ptp_getthumb_reuse	(PTPParams *params, uint32_t handle,
+				unsigned char** buf, unsigned long *alloc,
+				unsigned int *len);
 
 uint16_t ptp_deleteobject	(PTPParams* params, uint32_t handle,
 				uint32_t ofc);
+uint16_t ptp_deleteobjects	(PTPParams* params, uint32_t const *handles,
+				unsigned int n, unsigned int *done);
 
 uint16_t ptp_moveobject		(PTPParams* params, uint32_t handle,
 				uint32_t storage, uint32_t parent);
+uint16_t ptp_moveobjects	(PTPParams* params, uint32_t const *handles,
+				unsigned int n, uint32_t storage,
+				uint32_t parent, unsigned int *done);
 
 uint16_t ptp_copyobject		(PTPParams* params, uint32_t handle,
 				uint32_t storage, uint32_t parent);
@@ -3903,6 +4107,12 @@ uint16_t ptp_generic_getdevicepropdesc (PTPParams *params, uint16_t propcode,
 				PTPDevicePropDesc *dpd);
 uint16_t ptp_getdevicepropvalue	(PTPParams* params, uint16_t propcode,
 				PTPPropertyValue* value, uint16_t datatype);
+uint16_t ptp_getdevicepropvalue_cached (PTPParams* params, uint16_t propcode,
+				PTPPropertyValue* value, uint16_t datatype);
+uint16_t ptp_set_deviceprop_cachetime (PTPParams* params, uint16_t propcode,
+				int seconds);
+void     ptp_invalidate_deviceprop (PTPParams* params, uint16_t propcode);
+uint16_t ptp_refresh_deviceprop (PTPParams* params, uint16_t propcode);
 uint16_t ptp_setdevicepropvalue (PTPParams* params, uint16_t propcode,
                         	PTPPropertyValue* value, uint16_t datatype);
 uint16_t ptp_generic_setdevicepropvalue (PTPParams* params, uint16_t propcode,
@@ -3928,14 +4138,27 @@ int ptp_get_one_eos_event (PTPParams *params, PTPCanon_changes_entry *entry);
 /* Microsoft MTP extensions */
 uint16_t ptp_mtp_getobjectpropdesc (PTPParams* params, uint16_t opc, uint16_t ofc,
 				PTPObjectPropDesc *objectpropertydesc);
+uint16_t ptp_mtp_getobjectpropdesc_cached (PTPParams* params, uint16_t opc, uint16_t ofc,
+				PTPObjectPropDesc *objectpropertydesc);
+uint16_t ptp_mtp_getobjectpropssupported_cached (PTPParams* params, uint16_t ofc,
+				uint32_t *propnum, uint16_t **props);
 uint16_t ptp_mtp_getobjectpropvalue (PTPParams* params, uint32_t oid, uint16_t opc,
 				PTPPropertyValue *value, uint16_t datatype);
+uint16_t ptp_mtp_getobjectpropvalue_bytes (PTPParams* params, uint32_t oid, uint16_t opc,
+				unsigned char **buf, unsigned long *alloc, unsigned int *len);
 uint16_t ptp_mtp_setobjectpropvalue (PTPParams* params, uint32_t oid, uint16_t opc,
 				PTPPropertyValue *value, uint16_t datatype);
 uint16_t ptp_mtp_getobjectreferences (PTPParams* params, uint32_t handle, uint32_t** ohArray, uint32_t* arraylen);
 uint16_t ptp_mtp_setobjectreferences (PTPParams* params, uint32_t handle, uint32_t* ohArray, uint32_t arraylen);
+uint16_t ptp_mtp_getobjectreferences_cached (PTPParams* params, uint32_t handle, uint32_t** ohArray, uint32_t* arraylen);
+uint16_t ptp_mtp_loadobjectreferences (PTPParams* params, uint32_t const *handles, uint32_t nrofhandles);
+void ptp_object_forget_references (PTPParams* params, uint32_t handle);
 uint16_t ptp_mtp_getobjectproplist_generic (PTPParams* params, uint32_t handle, uint32_t formats, uint32_t properties, uint32_t propertygroups, uint32_t level, MTPProperties **props, int *nrofprops);
 uint16_t ptp_mtp_getobjectproplist_level (PTPParams* params, uint32_t handle, uint32_t level, MTPProperties **props, int *nrofprops);
+/* Gets one decoded property of a streamed object property list, the
+ * callback owns prop->propval afterwards. */
+typedef uint16_t (* PTPOPLFunc)(PTPParams* params, void *priv, MTPProperties *prop);
+uint16_t ptp_mtp_getobjectproplist_stream (PTPParams* params, uint32_t handle, uint32_t formats, uint32_t properties, uint32_t propertygroups, uint32_t level, PTPOPLFunc func, void *priv);
 uint16_t ptp_mtp_getobjectproplist (PTPParams* params, uint32_t handle, MTPProperties **props, int *nrofprops);
 uint16_t ptp_mtp_getobjectproplist_single (PTPParams* params, uint32_t handle, MTPProperties **props, int *nrofprops);
 uint16_t ptp_mtp_sendobjectproplist (PTPParams* params, uint32_t* store, uint32_t* parenthandle, uint32_t* handle,
@@ -4536,6 +4759,9 @@ uint16_t ptp_mtp_getobjectpropssupported (PTPParams* params, uint16_t ofc, uint3
 uint16_t ptp_android_getpartialobject64	(PTPParams* params, uint32_t handle, uint64_t offset,
 					uint32_t maxbytes, unsigned char** object,
 					uint32_t *len);
+uint16_t ptp_android_getpartialobject64_to_handler (PTPParams* params, uint32_t handle,
+					uint64_t offset, uint32_t maxbytes,
+					PTPDataHandler *handler);
 #define ptp_android_begineditobject(params,handle) ptp_generic_no_data (params, PTP_OC_ANDROID_BeginEditObject, 1, handle)
 #define ptp_android_truncate(params,handle,offset) ptp_generic_no_data (params, PTP_OC_ANDROID_TruncateObject, 3, handle, (offset & 0xFFFFFFFF), (offset >> 32))
 uint16_t ptp_android_sendpartialobject (PTPParams *params, uint32_t handle,
@@ -4567,16 +4793,28 @@ ptp_operation_issupported(PTPParams* params, uint16_t operation)
 int ptp_event_issupported	(PTPParams* params, uint16_t event);
 int ptp_property_issupported	(PTPParams* params, uint16_t property);
 
+uint16_t ptp_init_transaction_lock	(PTPParams *params);
+uint16_t ptp_init_stats		(PTPParams *params);
+uint16_t ptp_get_stats		(PTPParams *params, PTPOpStats **ops,
+				 unsigned int *nrofops);
+/* for the transports, each is a no-op unless collecting */
+void ptp_stats_first_byte	(PTPParams *params);
+void ptp_stats_bytes_in		(PTPParams *params, uint64_t bytes);
+void ptp_stats_retry		(PTPParams *params);
 void ptp_free_params		(PTPParams *params);
 void ptp_free_objectpropdesc	(PTPObjectPropDesc*);
 void ptp_free_devicepropdesc	(PTPDevicePropDesc*);
 void ptp_free_devicepropvalue	(uint16_t, PTPPropertyValue*);
 void ptp_free_objectinfo	(PTPObjectInfo *oi);
-void ptp_free_object		(PTPObject *oi);
+void ptp_free_object		(PTPParams *params, PTPObject *ob);
 
 const char *ptp_strerror	(uint16_t ret, uint16_t vendor);
 void ptp_debug			(PTPParams *params, const char *format, ...);
 void ptp_error			(PTPParams *params, const char *format, ...);
+int ptp_ucs2_to_utf8		(const unsigned char *src, unsigned int srclen,
+				 char *dest, unsigned int destlen);
+int ptp_utf8_to_ucs2		(const char *src, unsigned int srclen,
+				 unsigned char *dest, unsigned int destlen);
 
 
 const char* ptp_get_property_description(PTPParams* params, uint16_t dpc);
@@ -4594,11 +4832,27 @@ void ptp_destroy_object_prop(MTPProperties *prop);
 void ptp_destroy_object_prop_list(MTPProperties *props, int nrofprops);
 MTPProperties *ptp_find_object_prop_in_cache(PTPParams *params, uint32_t const handle, uint32_t const attribute_id);
 uint16_t ptp_remove_object_from_cache(PTPParams *params, uint32_t handle);
+void ptp_remove_objects_from_cache(PTPParams *params, uint32_t const *handles, unsigned int n);
 uint16_t ptp_add_object_to_cache(PTPParams *params, uint32_t handle);
 uint16_t ptp_object_want (PTPParams *, uint32_t handle, unsigned int want, PTPObject**retob);
 void ptp_objects_sort (PTPParams *);
+void ptp_objects_clear (PTPParams *);
+void ptp_objects_set_limit (PTPParams *params, unsigned int max);
 uint16_t ptp_object_find (PTPParams *params, uint32_t handle, PTPObject **retob);
 uint16_t ptp_object_find_or_insert (PTPParams *params, uint32_t handle, PTPObject **retob);
+void ptp_object_reindex (PTPParams *params, PTPObject *ob);
+PTPObjectExt *ptp_object_ext (PTPObject *ob);
+void ptp_object_set_objectinfo (PTPParams *params, PTPObject *ob, PTPObjectInfo *oi);
+void ptp_object_get_objectinfo (PTPParams *params, PTPObject *ob, PTPObjectInfo *oi);
+void *ptp_arena_alloc (PTPArena *arena, size_t size);
+char *ptp_arena_intern (PTPArena *arena, const char *str);
+int ptp_arena_owns (PTPArena *arena, const void *ptr);
+void ptp_arena_clear (PTPArena *arena);
+void ptp_object_free_string (PTPParams *params, PTPObject *ob, char *str);
+time_t ptp_object_parse_time (const char *str);
+PTPObject *ptp_objects_next_by_parent (PTPParams *params, uint32_t parent, PTPObject *prev);
+PTPObject *ptp_objects_next_by_storage (PTPParams *params, uint32_t storage, PTPObject *prev);
+uint16_t ptp_object_find_by_name (PTPParams *params, uint32_t parent, const char *name, PTPObject **retob);
 uint16_t ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle);
 /* ptpip.c */
 void ptp_nikon_getptpipguid (unsigned char* guid);
@@ -4661,6 +4915,7 @@ uint16_t ptp_chdk_get_script_status(PTPParams* params, unsigned *status);
 uint16_t ptp_chdk_write_script_msg(PTPParams* params, char *data, unsigned size, int target_script_id, int *status);
 uint16_t ptp_chdk_read_script_msg(PTPParams* params, ptp_chdk_script_msg **msg);
 uint16_t ptp_chdk_get_live_data(PTPParams* params, unsigned flags, unsigned char **data, unsigned int *data_size);
+uint16_t ptp_chdk_get_live_data_to_handler(PTPParams* params, unsigned flags, PTPDataHandler *handler);
 uint16_t ptp_chdk_parse_live_data (PTPParams* params, unsigned char *data, unsigned int data_size,
 				   lv_data_header *header, lv_framebuffer_desc *vpd, lv_framebuffer_desc *bmd);
 uint16_t ptp_chdk_call_function(PTPParams* params, int *args, int size, int *ret);
@@ -0,0 +1,1968 @@
+/**
+ * \file ptpip.c
+ * PTP/IP transport, talking PTP to a device over two TCP connections
+ * instead of USB.
+ *
+ * The command connection carries requests, data and responses, the
+ * event connection events and the out of band cancel. Data goes out
+ * as one START_DATA packet and then DATA packets of up to PTPIP_CHUNK
+ * bytes, the last one an END_DATA packet, with every packet header
+ * sent in the same system call as its payload. Uploads from a file are
+ * moved with sendfile() where there is one, so the data never passes
+ * through user space.
+ *
+ * Packets are matched to the transaction by their transaction ID, and
+ * whatever is left of a cancelled transaction is skipped when the next
+ * one reads from the connection, so cancelling returns at once.
+ *
+ * The same protocol over a unix socket lets several programs share one
+ * open device, see ptp_ptpip_serve().
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+#include "ptp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <sys/uio.h>
+#endif
+#ifdef HAVE_SYS_UN_H
+# include <sys/un.h>
+#endif
+#ifdef HAVE_NETINET_IN_H
+# include <netinet/in.h>
+#endif
+#ifdef HAVE_NETINET_TCP_H
+# include <netinet/tcp.h>
+#endif
+#ifdef HAVE_NETDB_H
+# include <netdb.h>
+#endif
+#ifdef HAVE_POLL_H
+# include <poll.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#define PTPIP_PORT		"15740"
+/*
+ * The data phase field of a request. A device works out for itself if
+ * it sends data back, ptp_ptpip_serve() can not, so local connections
+ * say so with the value the standard leaves as "unknown".
+ */
+#define PTPIP_DATAPHASE_NONE_OR_IN	1
+#define PTPIP_DATAPHASE_OUT		2
+#define PTPIP_DATAPHASE_IN		3
+#define PTPIP_VERSION		0x00010000
+#define PTPIP_HDR_LEN		8
+/* payload of one data packet, which is also what is read at a time */
+#define PTPIP_CHUNK		0x100000
+/* socket buffers asked for, the kernel may cap them */
+#define PTPIP_SOCKBUF		0x400000
+/* seconds a read or write may stall before the transfer gives up */
+#define PTPIP_TIMEOUT		20
+
+#ifdef HAVE_SYS_SOCKET_H
+
+static void
+put16 (unsigned char *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void
+put32 (unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = v >> 24;
+}
+
+static void
+put64 (unsigned char *p, uint64_t v)
+{
+	put32 (p, v & 0xffffffff);
+	put32 (p + 4, v >> 32);
+}
+
+static uint16_t
+get16 (unsigned char const *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+get32 (unsigned char const *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t
+get64 (unsigned char const *p)
+{
+	return get32 (p) | ((uint64_t)get32 (p + 4) << 32);
+}
+
+/* Linux only, elsewhere every packet simply goes out as it is sent */
+#ifndef MSG_MORE
+#define MSG_MORE	0
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+/*
+ * Sends all of an I/O vector, resuming partial sends in the middle of
+ * it. With more set the kernel holds the data back for what follows.
+ */
+static uint16_t
+ptpip_sendv (int fd, struct iovec *iov, int iovcnt, int more)
+{
+	while (iovcnt > 0) {
+		struct msghdr	msg;
+		ssize_t		sent;
+
+		memset (&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		sent = sendmsg (fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ?
+				PTP_ERROR_TIMEOUT : PTP_ERROR_IO;
+		}
+		while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+			sent -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+	return PTP_RC_OK;
+}
+
+static uint16_t
+ptpip_send (int fd, unsigned char *data, size_t len, int more)
+{
+	struct iovec	iov;
+
+	iov.iov_base = data;
+	iov.iov_len = len;
+	return ptpip_sendv (fd, &iov, 1, more);
+}
+
+static uint16_t
+ptpip_recv (int fd, unsigned char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t	got = recv (fd, data, len, 0);
+
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ?
+				PTP_ERROR_TIMEOUT : PTP_ERROR_IO;
+		}
+		if (got == 0)
+			return PTP_ERROR_NODEVICE;
+		data += got;
+		len -= got;
+	}
+	return PTP_RC_OK;
+}
+
+static uint16_t
+ptpip_skip (int fd, uint64_t len)
+{
+	unsigned char	buf[4096];
+
+	while (len > 0) {
+		size_t		n = (len < sizeof(buf)) ? len : sizeof(buf);
+		uint16_t	ret = ptpip_recv (fd, buf, n);
+
+		if (ret != PTP_RC_OK)
+			return ret;
+		len -= n;
+	}
+	return PTP_RC_OK;
+}
+
+/* reads a packet header, len returns the length of the body */
+static uint16_t
+ptpip_read_header (PTPParams *params, int fd, uint32_t *len, uint32_t *type)
+{
+	unsigned char	hdr[PTPIP_HDR_LEN];
+	uint16_t	ret;
+
+	/* the rest of a data packet ptp_ptpip_getdata() gave up on */
+	if (fd == params->cmdfd && params->ptpip_unread > 0) {
+		ret = ptpip_skip (fd, params->ptpip_unread);
+		if (ret != PTP_RC_OK)
+			return ret;
+		params->ptpip_unread = 0;
+	}
+	ret = ptpip_recv (fd, hdr, sizeof(hdr));
+	if (ret != PTP_RC_OK)
+		return ret;
+	*len = get32 (hdr);
+	*type = get32 (hdr + 4);
+	if (*len < PTPIP_HDR_LEN) {
+		ptp_error (params, "PTP/IP: bad packet length %u", *len);
+		return PTP_ERROR_IO;
+	}
+	*len -= PTPIP_HDR_LEN;
+	return PTP_RC_OK;
+}
+
+/* reads up to size bytes of a body and drops the rest */
+static uint16_t
+ptpip_read_body (int fd, uint32_t len, unsigned char *data, uint32_t size)
+{
+	uint32_t	n = (len < size) ? len : size;
+	uint16_t	ret;
+
+	ret = ptpip_recv (fd, data, n);
+	if (ret != PTP_RC_OK)
+		return ret;
+	return ptpip_skip (fd, len - n);
+}
+
+static uint16_t
+ptpip_send_packet (int fd, uint32_t type, unsigned char *body, uint32_t len)
+{
+	unsigned char	hdr[PTPIP_HDR_LEN];
+	struct iovec	iov[2];
+
+	put32 (hdr, PTPIP_HDR_LEN + len);
+	put32 (hdr + 4, type);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = body;
+	iov[1].iov_len = len;
+	return ptpip_sendv (fd, iov, len ? 2 : 1, 0);
+}
+
+static int
+ptpip_progress (PTPParams *params, unsigned long bytes)
+{
+	if (params->ptpip_progress == NULL)
+		return 0;
+	return params->ptpip_progress (params, bytes);
+}
+
+/**
+ * ptp_ptpip_sendreq:
+ * params:	PTPParams*
+ *		PTPContainer* req	- the request to send
+ *		int dataphase		- the data phase that follows
+ *
+ * Sends a request over the command connection.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_ptpip_sendreq (PTPParams* params, PTPContainer* req, int dataphase)
+{
+	unsigned char	request[PTPIP_HDR_LEN + 10 + 5 * 4];
+	uint32_t	param[5];
+	unsigned int	i;
+
+	if (req->Nparam > 5)
+		return PTP_ERROR_BADPARAM;
+	param[0] = req->Param1;
+	param[1] = req->Param2;
+	param[2] = req->Param3;
+	param[3] = req->Param4;
+	param[4] = req->Param5;
+	put32 (request, PTPIP_HDR_LEN + 10 + req->Nparam * 4);
+	put32 (request + 4, PTPIP_CMD_REQUEST);
+	/* 1 for no data or data from the device, 2 for data to it */
+	if ((dataphase & PTP_DP_DATA_MASK) == PTP_DP_SENDDATA)
+		put32 (request + 8, PTPIP_DATAPHASE_OUT);
+	else if ((dataphase & PTP_DP_DATA_MASK) == PTP_DP_GETDATA &&
+		 params->ptpip_local)
+		put32 (request + 8, PTPIP_DATAPHASE_IN);
+	else
+		put32 (request + 8, PTPIP_DATAPHASE_NONE_OR_IN);
+	put16 (request + 12, req->Code);
+	put32 (request + 14, req->Transaction_ID);
+	for (i = 0; i < req->Nparam; i++)
+		put32 (request + 18 + i * 4, param[i]);
+	return ptpip_send (params->cmdfd, request,
+			   PTPIP_HDR_LEN + 10 + req->Nparam * 4, 0);
+}
+
+#ifdef HAVE_SYS_SENDFILE_H
+/* -1 if nothing could be sent this way, so the caller may copy instead */
+static int
+ptpip_sendfile (int sock, int fd, uint32_t len)
+{
+	uint32_t	done = 0;
+
+	while (done < len) {
+		ssize_t	sent = sendfile (sock, fd, NULL, len - done);
+
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return done ? -2 : -1;
+		done += sent;
+	}
+	return 0;
+}
+#endif
+
+/**
+ * ptp_ptpip_senddata:
+ * params:	PTPParams*
+ *		PTPContainer* ptp	- the request the data belongs to
+ *		uint64_t size		- number of bytes to send
+ *		PTPDataHandler* handler	- where the data comes from
+ *
+ * Sends the data phase of a transaction. If the handler reads from a
+ * file and the system has sendfile() the data is sent straight from
+ * the file.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_ptpip_senddata (PTPParams* params, PTPContainer* ptp,
+		    uint64_t size, PTPDataHandler *handler)
+{
+	unsigned char	start[12];
+	unsigned char	hdr[PTPIP_HDR_LEN + 4];
+	unsigned char	*buf = NULL;
+	struct iovec	iov[2];
+	uint64_t	left = size;
+	int		fd = -1;
+	int		hdr_sent;
+	uint16_t	ret;
+
+	put32 (start, ptp->Transaction_ID);
+	put64 (start + 4, size);
+	ret = ptpip_send_packet (params->cmdfd, PTPIP_START_DATA_PACKET,
+				 start, sizeof(start));
+	if (ret != PTP_RC_OK)
+		return ret;
+	/* the start packet stands in for the container header on USB */
+	if (ptpip_progress (params, sizeof(start)))
+		goto cancel;
+#ifdef HAVE_SYS_SENDFILE_H
+	fd = ptp_handler_fd (handler);
+#endif
+
+	do {
+		uint32_t	chunk = (left < PTPIP_CHUNK) ? left : PTPIP_CHUNK;
+		int		last = (left == chunk);
+
+		put32 (hdr, sizeof(hdr) + chunk);
+		put32 (hdr + 4, last ? PTPIP_END_DATA_PACKET : PTPIP_DATA_PACKET);
+		put32 (hdr + 8, ptp->Transaction_ID);
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = sizeof(hdr);
+
+		hdr_sent = 0;
+#ifdef HAVE_SYS_SENDFILE_H
+		if (fd >= 0 && chunk > 0) {
+			int	err;
+
+			/* the header is held back to go out with the payload */
+			ret = ptpip_sendv (params->cmdfd, iov, 1, 1);
+			if (ret != PTP_RC_OK)
+				break;
+			hdr_sent = 1;
+			err = ptpip_sendfile (params->cmdfd, fd, chunk);
+			if (err == -2) {
+				ptp_error (params, "PTP/IP: could not send file data");
+				ret = PTP_ERROR_IO;
+				break;
+			}
+			/* not a file sendfile() takes, copy from here on */
+			if (err == -1)
+				fd = -1;
+		}
+#endif
+		if (fd < 0) {
+			uint32_t	filled = 0;
+
+			if (buf == NULL) {
+				buf = malloc (chunk ? chunk : 1);
+				if (buf == NULL) {
+					ret = PTP_RC_GeneralError;
+					break;
+				}
+			}
+			while (filled < chunk) {
+				unsigned long	got = 0;
+
+				ret = handler->getfunc (params, handler->priv,
+							chunk - filled,
+							buf + filled, &got);
+				if (ret != PTP_RC_OK)
+					break;
+				if (got == 0) {
+					ret = PTP_ERROR_IO;
+					break;
+				}
+				filled += got;
+			}
+			if (ret != PTP_RC_OK)
+				break;
+			iov[1].iov_base = buf;
+			iov[1].iov_len = chunk;
+			ret = ptpip_sendv (params->cmdfd, iov + hdr_sent,
+					   2 - hdr_sent, !last);
+			if (ret != PTP_RC_OK)
+				break;
+		}
+		left -= chunk;
+		if (ptpip_progress (params, chunk) && left > 0)
+			goto cancel;
+	} while (left > 0);
+
+	free (buf);
+	return ret;
+
+cancel:
+	/* close the data phase early, the device fails the transaction */
+	free (buf);
+	put32 (hdr, ptp->Transaction_ID);
+	(void) ptpip_send_packet (params->cmdfd, PTPIP_END_DATA_PACKET, hdr, 4);
+	return PTP_ERROR_CANCEL;
+}
+
+/* the body of a response or event: code, transaction ID, parameters */
+static void
+ptpip_parse_container (PTPParams *params, unsigned char const *body,
+		       uint32_t len, PTPContainer *ptp)
+{
+	unsigned int	n = (len - 6) / 4;
+
+	memset (ptp, 0, sizeof(PTPContainer));
+	ptp->Code = get16 (body);
+	ptp->SessionID = params->session_id;
+	ptp->Transaction_ID = get32 (body + 2);
+	ptp->Nparam = (n > 5) ? 5 : n;
+	if (n > 0) ptp->Param1 = get32 (body + 6);
+	if (n > 1) ptp->Param2 = get32 (body + 10);
+	if (n > 2) ptp->Param3 = get32 (body + 14);
+	if (n > 3) ptp->Param4 = get32 (body + 18);
+	if (n > 4) ptp->Param5 = get32 (body + 22);
+}
+
+/**
+ * ptp_ptpip_getdata:
+ * params:	PTPParams*
+ *		PTPContainer* ptp	- the request the data belongs to
+ *		PTPDataHandler* handler	- where the data goes
+ *
+ * Receives the data phase of a transaction, a PTPIP_CHUNK at a time.
+ * Data left over from earlier transactions is skipped. If the device
+ * answers with a response instead of data, that is what is returned.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_ptpip_getdata (PTPParams* params, PTPContainer* ptp,
+		   PTPDataHandler *handler)
+{
+	unsigned char	body[6 + 5 * 4];
+	unsigned char	*buf = NULL;
+	uint32_t	bufsize = 0;
+	uint32_t	len, type;
+	int		giveup = 0;
+	uint16_t	ret;
+
+	for (;;) {
+		ret = ptpip_read_header (params, params->cmdfd, &len, &type);
+		if (ret != PTP_RC_OK)
+			break;
+
+		if (type == PTPIP_CMD_RESPONSE) {
+			PTPContainer	resp;
+
+			if (len < 6) {
+				ret = PTP_ERROR_IO;
+				break;
+			}
+			ret = ptpip_read_body (params->cmdfd, len, body, sizeof(body));
+			if (ret != PTP_RC_OK)
+				break;
+			ptpip_parse_container (params, body, len, &resp);
+			/* the answer to a cancelled transaction */
+			if (resp.Transaction_ID < ptp->Transaction_ID)
+				continue;
+			*ptp = resp;
+			ret = (resp.Code == PTP_RC_OK) ? PTP_ERROR_DATA_EXPECTED : resp.Code;
+			break;
+		}
+		if (type != PTPIP_START_DATA_PACKET && type != PTPIP_DATA_PACKET &&
+		    type != PTPIP_END_DATA_PACKET) {
+			ptp_debug (params, "PTP/IP: skipping packet of type %u", type);
+			ret = ptpip_skip (params->cmdfd, len);
+			if (ret != PTP_RC_OK)
+				break;
+			continue;
+		}
+		if (len < 4) {
+			ret = PTP_ERROR_IO;
+			break;
+		}
+		ret = ptpip_recv (params->cmdfd, body, 4);
+		if (ret != PTP_RC_OK)
+			break;
+		len -= 4;
+		if (get32 (body) != ptp->Transaction_ID) {
+			ret = ptpip_skip (params->cmdfd, len);
+			if (ret != PTP_RC_OK)
+				break;
+			continue;
+		}
+
+		if (type == PTPIP_START_DATA_PACKET) {
+			uint64_t	total;
+
+			if (len < 8) {
+				ret = PTP_ERROR_IO;
+				break;
+			}
+			ret = ptpip_read_body (params->cmdfd, len, body, 8);
+			if (ret != PTP_RC_OK)
+				break;
+			total = get64 (body);
+			bufsize = (total < PTPIP_CHUNK) ? total : PTPIP_CHUNK;
+			if (ptpip_progress (params, 12)) {
+				ret = PTP_ERROR_CANCEL;
+				break;
+			}
+			continue;
+		}
+
+		while (len > 0) {
+			uint32_t	n = (len < PTPIP_CHUNK) ? len : PTPIP_CHUNK;
+
+			/* sized by the start packet, unless that fell short */
+			if (buf == NULL || n > bufsize) {
+				unsigned char	*tmp;
+
+				if (n > bufsize)
+					bufsize = n;
+				tmp = realloc (buf, bufsize);
+				if (tmp == NULL) {
+					ret = PTP_RC_GeneralError;
+					giveup = 1;
+					break;
+				}
+				buf = tmp;
+			}
+			ret = ptpip_recv (params->cmdfd, buf, n);
+			if (ret != PTP_RC_OK)
+				break;
+			len -= n;
+			ret = handler->putfunc (params, handler->priv, n, buf);
+			if (ret != PTP_RC_OK) {
+				giveup = 1;
+				break;
+			}
+			if (ptpip_progress (params, n)) {
+				ret = PTP_ERROR_CANCEL;
+				break;
+			}
+		}
+		/*
+		 * Returning at once, the rest of this packet must not be
+		 * taken for the next header, ptpip_read_header() skips it.
+		 */
+		if (giveup || ret == PTP_ERROR_CANCEL)
+			params->ptpip_unread = len;
+		if (ret != PTP_RC_OK || type == PTPIP_END_DATA_PACKET)
+			break;
+	}
+	free (buf);
+	/*
+	 * What the device still sends is skipped by the next transaction,
+	 * cancel it so that is not much.
+	 */
+	if (giveup)
+		(void) ptp_ptpip_cancelreq (params, ptp->Transaction_ID);
+	return ret;
+}
+
+/**
+ * ptp_ptpip_getresp:
+ * params:	PTPParams*
+ *		PTPContainer* resp	- returns the response
+ *
+ * Receives a response, skipping data left over from a cancelled
+ * transaction.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_ptpip_getresp (PTPParams* params, PTPContainer* resp)
+{
+	unsigned char	body[6 + 5 * 4];
+	uint32_t	len, type;
+	uint16_t	ret;
+
+	for (;;) {
+		ret = ptpip_read_header (params, params->cmdfd, &len, &type);
+		if (ret != PTP_RC_OK)
+			return ret;
+		if (type != PTPIP_CMD_RESPONSE) {
+			ret = ptpip_skip (params->cmdfd, len);
+			if (ret != PTP_RC_OK)
+				return ret;
+			continue;
+		}
+		if (len < 6)
+			return PTP_ERROR_IO;
+		ret = ptpip_read_body (params->cmdfd, len, body, sizeof(body));
+		if (ret != PTP_RC_OK)
+			return ret;
+		/* earlier responses are sorted out by the caller */
+		ptpip_parse_container (params, body, len, resp);
+		return PTP_RC_OK;
+	}
+}
+
+/**
+ * ptp_ptpip_cancelreq:
+ * params:	PTPParams*
+ *		uint32_t transaction_id	- the transaction to cancel
+ *
+ * Asks the device to cancel a transaction. This goes over the event
+ * connection, as the command connection may be full of data.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_ptpip_cancelreq (PTPParams* params, uint32_t transaction_id)
+{
+	unsigned char	body[4];
+
+	put32 (body, transaction_id);
+	return ptpip_send_packet (params->evtfd, PTPIP_CANCEL_TRANSACTION,
+				  body, sizeof(body));
+}
+
+static uint16_t
+ptpip_event (PTPParams* params, PTPContainer* event, int timeout)
+{
+	unsigned char	body[6 + 5 * 4];
+	uint32_t	len, type;
+	uint16_t	ret;
+
+	for (;;) {
+#ifdef HAVE_POLL_H
+		struct pollfd	pfd;
+		int		n;
+
+		pfd.fd = params->evtfd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		n = poll (&pfd, 1, timeout);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return PTP_ERROR_IO;
+		if (n == 0)
+			return PTP_ERROR_TIMEOUT;
+#endif
+		ret = ptpip_read_header (params, params->evtfd, &len, &type);
+		if (ret != PTP_RC_OK)
+			return ret;
+		if (type == PTPIP_EVENT && len >= 6) {
+			ret = ptpip_read_body (params->evtfd, len, body, sizeof(body));
+			if (ret != PTP_RC_OK)
+				return ret;
+			ptpip_parse_container (params, body, len, event);
+			return PTP_RC_OK;
+		}
+		ret = ptpip_skip (params->evtfd, len);
+		if (ret != PTP_RC_OK)
+			return ret;
+		/* the device checks we are still there */
+		if (type == PTPIP_PING) {
+			ret = ptpip_send_packet (params->evtfd, PTPIP_PONG, NULL, 0);
+			if (ret != PTP_RC_OK)
+				return ret;
+		}
+	}
+}
+
+/**
+ * ptp_ptpip_event_check:
+ * params:	PTPParams*
+ *		PTPContainer* event	- returns the event
+ *
+ * Returns an event if there is one, without waiting.
+ *
+ * Return values: Some PTP_RC_* code, PTP_ERROR_TIMEOUT if there is
+ * no event.
+ **/
+uint16_t
+ptp_ptpip_event_check (PTPParams* params, PTPContainer* event)
+{
+	return ptpip_event (params, event, 0);
+}
+
+uint16_t
+ptp_ptpip_event_check_queue (PTPParams* params, PTPContainer* event)
+{
+	return ptpip_event (params, event, 0);
+}
+
+/**
+ * ptp_ptpip_event_wait:
+ * params:	PTPParams*
+ *		PTPContainer* event	- returns the event
+ *
+ * Waits for the next event.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_ptpip_event_wait (PTPParams* params, PTPContainer* event)
+{
+	return ptpip_event (params, event, -1);
+}
+
+static int
+ptpip_open_socket (PTPParams *params, struct addrinfo *ai)
+{
+	struct timeval	tv;
+	int		size = PTPIP_SOCKBUF;
+	int		one = 1;
+	int		fd;
+
+	for (; ai != NULL; ai = ai->ai_next) {
+		fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		/* before connecting, so the window scale is chosen to fit */
+		(void) setsockopt (fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		(void) setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		/* requests and cancels are small and waited for */
+		(void) setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		/* notice devices that drop off the network */
+		(void) setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+		tv.tv_sec = PTPIP_TIMEOUT;
+		tv.tv_usec = 0;
+		(void) setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		(void) setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect (fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			return fd;
+		close (fd);
+	}
+	ptp_error (params, "PTP/IP: could not connect: %s", strerror (errno));
+	return -1;
+}
+
+/* the initiator GUID, derived from the host name so devices that pair
+ * with initiators recognise us next time */
+static void
+ptpip_initiator_guid (uint8_t *guid)
+{
+	char		host[256];
+	uint32_t	h = 2166136261U;
+	unsigned int	i;
+
+	memset (host, 0, sizeof(host));
+	if (gethostname (host, sizeof(host) - 1) != 0)
+		strcpy (host, "libmtp");
+	for (i = 0; i < 16; i++) {
+		unsigned char const *p;
+
+		for (p = (unsigned char const *)host; *p; p++)
+			h = (h ^ *p) * 16777619U;
+		h = (h ^ i) * 16777619U;
+		guid[i] = h >> 24;
+	}
+}
+
+/* opens both connections to an address and does the init handshake */
+static int
+ptpip_handshake (PTPParams* params, const char *address, struct addrinfo *ai)
+{
+	static const char	name[] = "libmtp";
+	unsigned char		init[16 + 2 * sizeof(name) + 4];
+	unsigned char		ack[4 + 16 + 2 * 64 + 4];
+	uint32_t		len, type;
+	unsigned int		i;
+
+	params->cmdfd = ptpip_open_socket (params, ai);
+	if (params->cmdfd < 0)
+		goto fail;
+	ptpip_initiator_guid (init);
+	for (i = 0; i < sizeof(name); i++)
+		put16 (init + 16 + 2 * i, (unsigned char)name[i]);
+	put32 (init + 16 + 2 * sizeof(name), PTPIP_VERSION);
+	if (ptpip_send_packet (params->cmdfd, PTPIP_INIT_COMMAND_REQUEST,
+			       init, sizeof(init)) != PTP_RC_OK)
+		goto fail;
+	if (ptpip_read_header (params, params->cmdfd, &len, &type) != PTP_RC_OK)
+		goto fail;
+	memset (ack, 0, sizeof(ack));
+	if (ptpip_read_body (params->cmdfd, len, ack, sizeof(ack)) != PTP_RC_OK)
+		goto fail;
+	if (type == PTPIP_INIT_FAIL) {
+		ptp_error (params, "PTP/IP: %s refused the connection, reason %u",
+			   address, get32 (ack));
+		goto fail;
+	}
+	if (type != PTPIP_INIT_COMMAND_ACK || len < 20) {
+		ptp_error (params, "PTP/IP: unexpected answer of type %u", type);
+		goto fail;
+	}
+	params->eventpipeid = get32 (ack);
+	memcpy (params->cameraguid, ack + 4, 16);
+	/* the name is UCS-2, keep what is plain ASCII */
+	free (params->cameraname);
+	params->cameraname = malloc (64 + 1);
+	if (params->cameraname != NULL) {
+		for (i = 0; i < 64 && 20 + 2 * i + 1 < len; i++) {
+			uint16_t	c = get16 (ack + 20 + 2 * i);
+
+			if (c == 0)
+				break;
+			params->cameraname[i] = (c < 0x80) ? c : '?';
+		}
+		params->cameraname[i] = '\0';
+	}
+
+	params->evtfd = ptpip_open_socket (params, ai);
+	if (params->evtfd < 0)
+		goto fail;
+	put32 (ack, params->eventpipeid);
+	if (ptpip_send_packet (params->evtfd, PTPIP_INIT_EVENT_REQUEST,
+			       ack, 4) != PTP_RC_OK)
+		goto fail;
+	if (ptpip_read_header (params, params->evtfd, &len, &type) != PTP_RC_OK ||
+	    ptpip_skip (params->evtfd, len) != PTP_RC_OK)
+		goto fail;
+	if (type != PTPIP_INIT_EVENT_ACK) {
+		ptp_error (params, "PTP/IP: event connection refused, type %u", type);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	ptp_ptpip_disconnect (params);
+	return -1;
+}
+
+#ifdef HAVE_SYS_UN_H
+/* a ptp_ptpip_serve() on this machine, listening on a unix socket */
+static int
+ptpip_connect_local (PTPParams* params, const char *path)
+{
+	struct sockaddr_un	addr;
+	struct addrinfo		ai;
+
+	if (strlen (path) >= sizeof(addr.sun_path)) {
+		ptp_error (params, "PTP/IP: socket path %s is too long", path);
+		return -1;
+	}
+	memset (&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
+	memset (&ai, 0, sizeof(ai));
+	ai.ai_family = AF_UNIX;
+	ai.ai_socktype = SOCK_STREAM;
+	ai.ai_addr = (struct sockaddr *) &addr;
+	ai.ai_addrlen = sizeof(addr);
+	params->ptpip_local = 1;
+	return ptpip_handshake (params, path, &ai);
+}
+#endif
+
+/**
+ * ptp_ptpip_connect:
+ * params:	PTPParams*
+ *		const char *address	- "host", "host:port", "[v6 address]:port"
+ *					  or "unix:path" for ptp_ptpip_serve()
+ *
+ * Opens the command and event connections to a PTP/IP device. The
+ * name the device gives is put in params->cameraname.
+ *
+ * Return values: 0 on success, -1 on failure.
+ **/
+int
+ptp_ptpip_connect (PTPParams* params, const char *address)
+{
+	struct addrinfo		hints, *res = NULL;
+	char			*host, *port, *p;
+	int			err;
+
+	params->cmdfd = -1;
+	params->evtfd = -1;
+	params->ptpip_local = 0;
+#ifdef HAVE_SYS_UN_H
+	if (!strncmp (address, "unix:", 5))
+		return ptpip_connect_local (params, address + 5);
+#endif
+	host = strdup (address);
+	if (host == NULL)
+		return -1;
+	port = NULL;
+	if (host[0] == '[' && (p = strchr (host, ']')) != NULL) {
+		*p = '\0';
+		if (p[1] == ':')
+			port = p + 2;
+		memmove (host, host + 1, strlen (host + 1) + 1);
+	} else if ((p = strchr (host, ':')) != NULL && strchr (p + 1, ':') == NULL) {
+		/* more than one colon makes it a plain IPv6 address */
+		*p = '\0';
+		port = p + 1;
+	}
+	memset (&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo (host, (port && *port) ? port : PTPIP_PORT, &hints, &res);
+	free (host);
+	if (err != 0) {
+		ptp_error (params, "PTP/IP: could not resolve %s: %s",
+			   address, gai_strerror (err));
+		return -1;
+	}
+
+	err = ptpip_handshake (params, address, res);
+	freeaddrinfo (res);
+	return err;
+}
+
+/**
+ * ptp_ptpip_disconnect:
+ * params:	PTPParams*
+ *
+ * Closes the connections opened by ptp_ptpip_connect().
+ **/
+void
+ptp_ptpip_disconnect (PTPParams* params)
+{
+	if (params->cmdfd >= 0)
+		close (params->cmdfd);
+	if (params->evtfd >= 0)
+		close (params->evtfd);
+	params->cmdfd = -1;
+	params->evtfd = -1;
+	params->ptpip_unread = 0;
+}
+
+#if defined(HAVE_SYS_UN_H) && defined(HAVE_PTHREAD_H)
+
+/*
+ * The responder side: ptp_ptpip_serve() owns the session to a device
+ * and lets any number of local clients use it at the same time, each
+ * one connecting over a unix socket as if the daemon were a PTP/IP
+ * device. Their transactions are run one at a time with fresh
+ * transaction IDs. Those that move no object data go before object
+ * transfers that are still waiting, so listing does not wait behind
+ * a big download. Answers to the listing operations are kept, so the
+ * next client to open the device gets them from memory. Anything that
+ * may change the objects on the device drops them again.
+ */
+
+/* listing answers kept, in bytes */
+#define PTPIP_SERVE_CACHE	0x4000000
+
+typedef struct _PTPIPServer PTPIPServer;
+typedef struct _PTPIPClient PTPIPClient;
+typedef struct _PTPIPAnswer PTPIPAnswer;
+
+struct _PTPIPAnswer {
+	PTPContainer	req;	/* code and parameters asked for */
+	PTPContainer	resp;
+	unsigned char	*data;
+	unsigned long	len;
+	int		keep;	/* not changed by changes to the objects */
+	PTPIPAnswer	*next;
+};
+
+struct _PTPIPClient {
+	PTPIPServer	*server;
+	int		cmdfd;
+	int		evtfd;		/* -1 until the event connection is up */
+	uint32_t	id;		/* the connection number of the handshake */
+	uint32_t	cancel;		/* transaction ID the client cancelled + 1 */
+	int		refs;		/* the threads of both connections */
+	PTPIPClient	*next;
+};
+
+struct _PTPIPServer {
+	PTPParams	*params;
+	PTPIOGetResp	event_check;	/* must time out, stop is polled */
+	pthread_mutex_t	lock;		/* all of the below */
+	pthread_cond_t	cond;
+	int		stop;
+	int		threads;	/* connection threads still running */
+	int		busy;		/* a transaction is on the device */
+	unsigned int	interactive;	/* waiting ones that move no object data */
+	PTPIPClient	*clients;
+	uint32_t	nextid;
+	PTPIPAnswer	*answers;	/* oldest first */
+	unsigned long	answersize;
+};
+
+/* connection thread arguments */
+typedef struct {
+	PTPIPServer	*server;
+	int		fd;
+} PTPIPAccepted;
+
+/* answers that are kept, the first ones for as long as the session */
+static int
+ptpip_serve_cacheable (uint16_t code, int *keep)
+{
+	*keep = 0;
+	switch (code) {
+	case PTP_OC_GetDeviceInfo:
+	case PTP_OC_MTP_GetObjectPropsSupported:
+	case PTP_OC_MTP_GetObjectPropDesc:
+		*keep = 1;
+		return 1;
+	case PTP_OC_GetStorageIDs:
+	case PTP_OC_GetStorageInfo:
+	case PTP_OC_GetObjectHandles:
+	case PTP_OC_GetObjectInfo:
+	case PTP_OC_MTP_GetObjPropList:
+	case PTP_OC_MTP_GetObjectReferences:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* operations known not to change anything on the device */
+static int
+ptpip_serve_readonly (uint16_t code)
+{
+	int	keep;
+
+	if (ptpip_serve_cacheable (code, &keep))
+		return 1;
+	switch (code) {
+	case PTP_OC_GetNumObjects:
+	case PTP_OC_GetObject:
+	case PTP_OC_GetThumb:
+	case PTP_OC_GetDevicePropDesc:
+	case PTP_OC_GetDevicePropValue:
+	case PTP_OC_GetPartialObject:
+	case PTP_OC_MTP_GetObjectPropValue:
+	case PTP_OC_ANDROID_GetPartialObject64:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int
+ptpip_serve_same (PTPContainer const *a, PTPContainer const *b)
+{
+	return a->Code == b->Code && a->Nparam == b->Nparam &&
+	       a->Param1 == b->Param1 && a->Param2 == b->Param2 &&
+	       a->Param3 == b->Param3 && a->Param4 == b->Param4 &&
+	       a->Param5 == b->Param5;
+}
+
+/* drops the answers that may be out of date, all of them if all is set */
+static void
+ptpip_serve_forget (PTPIPServer *server, int all)
+{
+	PTPIPAnswer	**p = &server->answers;
+
+	while (*p != NULL) {
+		PTPIPAnswer	*a = *p;
+
+		if (a->keep && !all) {
+			p = &a->next;
+			continue;
+		}
+		*p = a->next;
+		server->answersize -= a->len;
+		free (a->data);
+		free (a);
+	}
+}
+
+/* called with the lock held, takes the data */
+static void
+ptpip_serve_remember (PTPIPServer *server, PTPContainer const *req,
+		      PTPContainer const *resp, unsigned char *data,
+		      unsigned long len, int keep)
+{
+	PTPIPAnswer	*a, **p;
+
+	if (len > PTPIP_SERVE_CACHE) {
+		free (data);
+		return;
+	}
+	/* the oldest make room */
+	while (server->answers != NULL &&
+	       server->answersize + len > PTPIP_SERVE_CACHE) {
+		a = server->answers;
+		server->answers = a->next;
+		server->answersize -= a->len;
+		free (a->data);
+		free (a);
+	}
+	a = malloc (sizeof(PTPIPAnswer));
+	if (a == NULL) {
+		free (data);
+		return;
+	}
+	a->req = *req;
+	a->resp = *resp;
+	a->data = data;
+	a->len = len;
+	a->keep = keep;
+	a->next = NULL;
+	for (p = &server->answers; *p != NULL; p = &(*p)->next)
+		;
+	*p = a;
+	server->answersize += len;
+}
+
+/* waits for the device, letting what moves no object data go first */
+static void
+ptpip_serve_begin (PTPIPServer *server, uint16_t code)
+{
+	int	bulk = ptp_carries_object_data (code);
+
+	pthread_mutex_lock (&server->lock);
+	if (!bulk)
+		server->interactive++;
+	while (server->busy || (bulk && server->interactive > 0))
+		pthread_cond_wait (&server->cond, &server->lock);
+	if (!bulk)
+		server->interactive--;
+	server->busy = 1;
+	pthread_mutex_unlock (&server->lock);
+}
+
+static void
+ptpip_serve_end (PTPIPServer *server)
+{
+	pthread_mutex_lock (&server->lock);
+	server->busy = 0;
+	pthread_cond_broadcast (&server->cond);
+	pthread_mutex_unlock (&server->lock);
+}
+
+static void
+ptpip_serve_release (PTPIPClient *client)
+{
+	PTPIPServer	*server = client->server;
+	PTPIPClient	**p;
+
+	pthread_mutex_lock (&server->lock);
+	if (--client->refs > 0) {
+		/* wake the other connection's thread */
+		shutdown (client->cmdfd, SHUT_RDWR);
+		if (client->evtfd >= 0)
+			shutdown (client->evtfd, SHUT_RDWR);
+		pthread_mutex_unlock (&server->lock);
+		return;
+	}
+	for (p = &server->clients; *p != NULL; p = &(*p)->next)
+		if (*p == client) {
+			*p = client->next;
+			break;
+		}
+	pthread_mutex_unlock (&server->lock);
+	close (client->cmdfd);
+	if (client->evtfd >= 0)
+		close (client->evtfd);
+	free (client);
+}
+
+static uint16_t
+ptpip_serve_respond (int fd, uint16_t code, uint32_t transid,
+		     PTPContainer const *resp)
+{
+	unsigned char	body[6 + 5 * 4];
+	uint32_t	param[5];
+	unsigned int	i, n = resp ? resp->Nparam : 0;
+
+	if (n > 5)
+		n = 5;
+	if (resp) {
+		param[0] = resp->Param1;
+		param[1] = resp->Param2;
+		param[2] = resp->Param3;
+		param[3] = resp->Param4;
+		param[4] = resp->Param5;
+	}
+	put16 (body, code);
+	put32 (body + 2, transid);
+	for (i = 0; i < n; i++)
+		put32 (body + 6 + 4 * i, param[i]);
+	return ptpip_send_packet (fd, PTPIP_CMD_RESPONSE, body, 6 + 4 * n);
+}
+
+static uint16_t
+ptpip_serve_start_data (int fd, uint32_t transid, uint64_t total)
+{
+	unsigned char	start[12];
+
+	put32 (start, transid);
+	put64 (start + 4, total);
+	return ptpip_send_packet (fd, PTPIP_START_DATA_PACKET, start,
+				  sizeof(start));
+}
+
+static uint16_t
+ptpip_serve_data (int fd, uint32_t type, uint32_t transid,
+		  unsigned char *data, unsigned long len)
+{
+	unsigned char	hdr[PTPIP_HDR_LEN + 4];
+	struct iovec	iov[2];
+
+	put32 (hdr, sizeof(hdr) + len);
+	put32 (hdr + 4, type);
+	put32 (hdr + 8, transid);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = data;
+	iov[1].iov_len = len;
+	return ptpip_sendv (fd, iov, len ? 2 : 1, 0);
+}
+
+/* a whole data phase from memory */
+static uint16_t
+ptpip_serve_answer (int fd, uint32_t transid, unsigned char *data,
+		    unsigned long len)
+{
+	unsigned long	done = 0;
+	uint16_t	ret;
+
+	ret = ptpip_serve_start_data (fd, transid, len);
+	while (ret == PTP_RC_OK) {
+		unsigned long	chunk = (len - done < PTPIP_CHUNK) ? len - done : PTPIP_CHUNK;
+		int		last = (done + chunk == len);
+
+		ret = ptpip_serve_data (fd, last ? PTPIP_END_DATA_PACKET :
+					PTPIP_DATA_PACKET, transid,
+					data + done, chunk);
+		done += chunk;
+		if (last)
+			break;
+	}
+	return ret;
+}
+
+/* where a transaction of a client moves its data */
+typedef struct {
+	PTPIPClient	*client;
+	uint32_t	transid;	/* the client's */
+	int		started;	/* the start packet went out */
+	uint32_t	left;		/* of the data packet being read */
+	int		ended;		/* the end packet came in */
+	unsigned char	*copy;		/* of the data, for keeping the answer */
+	unsigned long	len;
+	unsigned long	size;
+} PTPIPServeData;
+
+static int
+ptpip_serve_cancelled (PTPIPServeData *d)
+{
+	PTPIPServer	*server = d->client->server;
+	int		cancelled;
+
+	pthread_mutex_lock (&server->lock);
+	cancelled = (d->client->cancel == d->transid + 1);
+	pthread_mutex_unlock (&server->lock);
+	return cancelled;
+}
+
+/* data from the device, passed on to the client as it comes */
+static uint16_t
+ptpip_serve_putfunc (PTPParams* params, void* priv,
+		     unsigned long sendlen, unsigned char *data)
+{
+	PTPIPServeData	*d = (PTPIPServeData *) priv;
+	uint16_t	ret;
+
+	if (ptpip_serve_cancelled (d))
+		return PTP_ERROR_CANCEL;
+	if (!d->started) {
+		/* the length is not known yet, the client does not need it */
+		ret = ptpip_serve_start_data (d->client->cmdfd, d->transid,
+					      0xffffffffffffffffULL);
+		if (ret != PTP_RC_OK)
+			return ret;
+		d->started = 1;
+	}
+	while (sendlen > 0) {
+		unsigned long	chunk = (sendlen < PTPIP_CHUNK) ? sendlen : PTPIP_CHUNK;
+
+		ret = ptpip_serve_data (d->client->cmdfd, PTPIP_DATA_PACKET,
+					d->transid, data, chunk);
+		if (ret != PTP_RC_OK)
+			return ret;
+		if (d->size && d->len + chunk <= PTPIP_SERVE_CACHE) {
+			if (d->len + chunk > d->size) {
+				unsigned long	size = d->size;
+				unsigned char	*tmp;
+
+				while (d->len + chunk > size)
+					size *= 2;
+				tmp = realloc (d->copy, size);
+				if (tmp == NULL) {
+					free (d->copy);
+					d->copy = NULL;
+					d->size = 0;
+				} else {
+					d->copy = tmp;
+					d->size = size;
+				}
+			}
+			if (d->copy != NULL)
+				memcpy (d->copy + d->len, data, chunk);
+		} else if (d->size) {
+			/* too big to keep */
+			free (d->copy);
+			d->copy = NULL;
+			d->size = 0;
+		}
+		d->len += chunk;
+		data += chunk;
+		sendlen -= chunk;
+	}
+	return PTP_RC_OK;
+}
+
+/* data from the client, read from its data packets as the device takes it */
+static uint16_t
+ptpip_serve_getfunc (PTPParams* params, void* priv,
+		     unsigned long wantlen, unsigned char *data,
+		     unsigned long *gotlen)
+{
+	PTPIPServeData	*d = (PTPIPServeData *) priv;
+	unsigned char	body[4];
+	uint32_t	len, type;
+	uint16_t	ret;
+
+	/* not all transports pass the params on */
+	params = d->client->server->params;
+	*gotlen = 0;
+	if (ptpip_serve_cancelled (d))
+		return PTP_ERROR_CANCEL;
+	while (d->left == 0) {
+		if (d->ended)
+			/* the client sent less than it said */
+			return PTP_ERROR_IO;
+		ret = ptpip_read_header (params, d->client->cmdfd, &len, &type);
+		if (ret != PTP_RC_OK)
+			return ret;
+		if ((type != PTPIP_DATA_PACKET && type != PTPIP_END_DATA_PACKET) ||
+		    len < 4)
+			return PTP_ERROR_IO;
+		ret = ptpip_recv (d->client->cmdfd, body, 4);
+		if (ret != PTP_RC_OK)
+			return ret;
+		d->left = len - 4;
+		d->ended = (type == PTPIP_END_DATA_PACKET);
+	}
+	if (wantlen > d->left)
+		wantlen = d->left;
+	ret = ptpip_recv (d->client->cmdfd, data, wantlen);
+	if (ret != PTP_RC_OK)
+		return ret;
+	d->left -= wantlen;
+	*gotlen = wantlen;
+	return PTP_RC_OK;
+}
+
+/* reads what is left of the client's data phase after a failure */
+static uint16_t
+ptpip_serve_drain (PTPIPServeData *d)
+{
+	PTPParams	*params = d->client->server->params;
+
+	while (!d->ended || d->left > 0) {
+		unsigned char	buf[4096];
+		unsigned long	got;
+		uint16_t	ret;
+
+		ret = ptpip_serve_getfunc (params, d, sizeof(buf), buf, &got);
+		if (ret == PTP_ERROR_CANCEL) {
+			/* the client closes the data phase itself */
+			if (d->left > 0 && ptpip_skip (d->client->cmdfd, d->left) != PTP_RC_OK)
+				return PTP_ERROR_IO;
+			d->left = 0;
+			d->ended = 1;
+			continue;
+		}
+		if (ret != PTP_RC_OK)
+			return ret;
+	}
+	return PTP_RC_OK;
+}
+
+/* runs one request of a client on the device */
+static uint16_t
+ptpip_serve_request (PTPIPClient *client, PTPContainer *req, uint32_t phase)
+{
+	PTPIPServer	*server = client->server;
+	PTPParams	*params = server->params;
+	PTPIPServeData	d;
+	PTPDataHandler	handler;
+	PTPContainer	ptp = *req;
+	PTPIPAnswer	*a;
+	uint64_t	total = 0;
+	uint16_t	flags = PTP_DP_NODATA;
+	uint16_t	ret;
+	int		keep = 0;
+	int		cacheable = 0;
+
+	/* the daemon holds the one session there is */
+	if (req->Code == PTP_OC_OpenSession || req->Code == PTP_OC_CloseSession)
+		return ptpip_serve_respond (client->cmdfd, PTP_RC_OK,
+					    req->Transaction_ID, NULL);
+
+	memset (&d, 0, sizeof(d));
+	d.client = client;
+	d.transid = req->Transaction_ID;
+	if (phase == PTPIP_DATAPHASE_OUT) {
+		unsigned char	start[12];
+		uint32_t	len, type;
+
+		ret = ptpip_read_header (params, client->cmdfd, &len, &type);
+		if (ret != PTP_RC_OK)
+			return ret;
+		if (type != PTPIP_START_DATA_PACKET || len < 12)
+			return PTP_ERROR_IO;
+		ret = ptpip_read_body (client->cmdfd, len, start, sizeof(start));
+		if (ret != PTP_RC_OK)
+			return ret;
+		total = get64 (start + 4);
+		flags = PTP_DP_SENDDATA;
+	} else if (phase == PTPIP_DATAPHASE_IN) {
+		flags = PTP_DP_GETDATA;
+		cacheable = ptpip_serve_cacheable (req->Code, &keep);
+	}
+
+	if (cacheable) {
+		unsigned char	*data = NULL;
+		unsigned long	len = 0;
+		PTPContainer	resp;
+		int		found = 0;
+
+		pthread_mutex_lock (&server->lock);
+		for (a = server->answers; a != NULL; a = a->next)
+			if (ptpip_serve_same (&a->req, req))
+				break;
+		if (a != NULL) {
+			/* copied, it may be dropped while it is sent */
+			data = malloc (a->len ? a->len : 1);
+			if (data != NULL) {
+				memcpy (data, a->data, a->len);
+				len = a->len;
+				resp = a->resp;
+				found = 1;
+			}
+		}
+		pthread_mutex_unlock (&server->lock);
+		if (found) {
+			ret = ptpip_serve_answer (client->cmdfd, req->Transaction_ID,
+						  data, len);
+			free (data);
+			if (ret != PTP_RC_OK)
+				return ret;
+			return ptpip_serve_respond (client->cmdfd, resp.Code,
+						    req->Transaction_ID, &resp);
+		}
+		d.size = 4096;
+		d.copy = malloc (d.size);
+		if (d.copy == NULL)
+			d.size = 0;
+	}
+
+	handler.getfunc = ptpip_serve_getfunc;
+	handler.putfunc = ptpip_serve_putfunc;
+	handler.getbuffunc = NULL;
+	handler.priv = &d;
+
+	ptpip_serve_begin (server, req->Code);
+	if (!ptpip_serve_readonly (req->Code)) {
+		pthread_mutex_lock (&server->lock);
+		ptpip_serve_forget (server, 0);
+		pthread_mutex_unlock (&server->lock);
+	}
+	ret = ptp_transaction_new (params, &ptp, flags, total, &handler);
+	if (!ptpip_serve_readonly (req->Code)) {
+		/* and what was read while it ran */
+		pthread_mutex_lock (&server->lock);
+		ptpip_serve_forget (server, 0);
+		pthread_mutex_unlock (&server->lock);
+	}
+	/* kept before the next transaction can change it on the device */
+	if (ret == PTP_RC_OK && d.copy != NULL) {
+		pthread_mutex_lock (&server->lock);
+		ptpip_serve_remember (server, req, &ptp, d.copy, d.len, keep);
+		pthread_mutex_unlock (&server->lock);
+		d.copy = NULL;
+	}
+	ptpip_serve_end (server);
+
+	if (flags == PTP_DP_SENDDATA && ptpip_serve_drain (&d) != PTP_RC_OK) {
+		free (d.copy);
+		return PTP_ERROR_IO;
+	}
+	if (flags == PTP_DP_GETDATA) {
+		uint16_t	sent;
+
+		if (d.started)
+			sent = ptpip_serve_data (client->cmdfd, PTPIP_END_DATA_PACKET,
+						 d.transid, NULL, 0);
+		else if (ret == PTP_RC_OK)
+			sent = ptpip_serve_answer (client->cmdfd, d.transid, NULL, 0);
+		else
+			sent = PTP_RC_OK;
+		if (sent != PTP_RC_OK) {
+			free (d.copy);
+			return sent;
+		}
+	}
+	free (d.copy);
+	/* errors of our own are only ever seen as a general error */
+	if (ret == PTP_RC_OK)
+		return ptpip_serve_respond (client->cmdfd, PTP_RC_OK,
+					    req->Transaction_ID, &ptp);
+	return ptpip_serve_respond (client->cmdfd,
+				    (ret & 0xff00) == 0x0200 ? PTP_RC_GeneralError : ret,
+				    req->Transaction_ID, NULL);
+}
+
+/* the command connection of a client, until it goes away */
+static void
+ptpip_serve_commands (PTPIPClient *client)
+{
+	PTPParams	*params = client->server->params;
+	unsigned char	body[10 + 5 * 4];
+
+	for (;;) {
+		PTPContainer	req;
+		uint32_t	len, type, n;
+
+		if (ptpip_read_header (params, client->cmdfd, &len, &type) != PTP_RC_OK)
+			break;
+		if (type != PTPIP_CMD_REQUEST || len < 10) {
+			if (ptpip_skip (client->cmdfd, len) != PTP_RC_OK)
+				break;
+			continue;
+		}
+		if (ptpip_read_body (client->cmdfd, len, body, sizeof(body)) != PTP_RC_OK)
+			break;
+		n = (len - 10) / 4;
+		memset (&req, 0, sizeof(req));
+		req.Code = get16 (body + 4);
+		req.Transaction_ID = get32 (body + 6);
+		req.Nparam = (n > 5) ? 5 : n;
+		if (n > 0) req.Param1 = get32 (body + 10);
+		if (n > 1) req.Param2 = get32 (body + 14);
+		if (n > 2) req.Param3 = get32 (body + 18);
+		if (n > 3) req.Param4 = get32 (body + 22);
+		if (n > 4) req.Param5 = get32 (body + 26);
+		if (ptpip_serve_request (client, &req, get32 (body)) != PTP_RC_OK)
+			break;
+	}
+}
+
+/* the event connection of a client, it only ever sends cancels */
+static void
+ptpip_serve_events (PTPIPClient *client)
+{
+	PTPIPServer	*server = client->server;
+	unsigned char	body[4];
+
+	for (;;) {
+		uint32_t	len, type;
+
+		if (ptpip_read_header (server->params, client->evtfd, &len, &type) != PTP_RC_OK)
+			break;
+		if (type == PTPIP_CANCEL_TRANSACTION && len >= 4) {
+			if (ptpip_read_body (client->evtfd, len, body, 4) != PTP_RC_OK)
+				break;
+			pthread_mutex_lock (&server->lock);
+			client->cancel = get32 (body) + 1;
+			pthread_mutex_unlock (&server->lock);
+			continue;
+		}
+		if (ptpip_skip (client->evtfd, len) != PTP_RC_OK)
+			break;
+	}
+}
+
+static void *
+ptpip_serve_connection (void *arg)
+{
+	PTPIPAccepted	*acc = (PTPIPAccepted *) arg;
+	PTPIPServer	*server = acc->server;
+	PTPIPClient	*client = NULL, *c;
+	int		fd = acc->fd;
+	unsigned char	buf[4 + 16 + 2 * 64 + 4];
+	uint32_t	len, type;
+	unsigned int	i;
+
+	free (acc);
+	memset (buf, 0, sizeof(buf));
+	if (ptpip_read_header (server->params, fd, &len, &type) != PTP_RC_OK ||
+	    ptpip_read_body (fd, len, buf, sizeof(buf)) != PTP_RC_OK) {
+		close (fd);
+		goto done;
+	}
+
+	if (type == PTPIP_INIT_COMMAND_REQUEST) {
+		static const char	name[] = "libmtp daemon";
+
+		client = calloc (1, sizeof(PTPIPClient));
+		if (client == NULL) {
+			close (fd);
+			goto done;
+		}
+		client->server = server;
+		client->cmdfd = fd;
+		client->evtfd = -1;
+		client->refs = 1;
+		pthread_mutex_lock (&server->lock);
+		client->id = ++server->nextid;
+		client->next = server->clients;
+		server->clients = client;
+		pthread_mutex_unlock (&server->lock);
+
+		memset (buf, 0, sizeof(buf));
+		put32 (buf, client->id);
+		ptpip_initiator_guid (buf + 4);
+		for (i = 0; i < sizeof(name); i++)
+			put16 (buf + 20 + 2 * i, (unsigned char)name[i]);
+		put32 (buf + 20 + 2 * sizeof(name), PTPIP_VERSION);
+		if (ptpip_send_packet (fd, PTPIP_INIT_COMMAND_ACK, buf,
+				       20 + 2 * sizeof(name) + 4) == PTP_RC_OK)
+			ptpip_serve_commands (client);
+		ptpip_serve_release (client);
+	} else if (type == PTPIP_INIT_EVENT_REQUEST && len >= 4) {
+		pthread_mutex_lock (&server->lock);
+		for (c = server->clients; c != NULL; c = c->next)
+			if (c->id == get32 (buf) && c->evtfd < 0)
+				break;
+		if (c != NULL) {
+			c->evtfd = fd;
+			c->refs++;
+		}
+		pthread_mutex_unlock (&server->lock);
+		if (c == NULL) {
+			put32 (buf, 0);
+			(void) ptpip_send_packet (fd, PTPIP_INIT_FAIL, buf, 4);
+			close (fd);
+			goto done;
+		}
+		if (ptpip_send_packet (fd, PTPIP_INIT_EVENT_ACK, NULL, 0) == PTP_RC_OK)
+			ptpip_serve_events (c);
+		ptpip_serve_release (c);
+	} else
+		close (fd);
+
+done:
+	pthread_mutex_lock (&server->lock);
+	server->threads--;
+	pthread_cond_broadcast (&server->cond);
+	pthread_mutex_unlock (&server->lock);
+	return NULL;
+}
+
+/* passes the events of the device on to every client */
+static void *
+ptpip_serve_device_events (void *arg)
+{
+	PTPIPServer	*server = (PTPIPServer *) arg;
+	unsigned char	body[6 + 3 * 4];
+
+	for (;;) {
+		PTPContainer	event;
+		PTPIPClient	*c;
+		uint16_t	ret;
+
+		pthread_mutex_lock (&server->lock);
+		if (server->stop) {
+			pthread_mutex_unlock (&server->lock);
+			break;
+		}
+		pthread_mutex_unlock (&server->lock);
+
+		memset (&event, 0, sizeof(event));
+		/* the device is not ours alone, take turns with the clients */
+		ptpip_serve_begin (server, PTP_OC_Undefined);
+		ret = server->event_check (server->params, &event);
+		ptpip_serve_end (server);
+		if (ret == PTP_ERROR_NODEVICE)
+			break;
+		if (ret != PTP_RC_OK) {
+			/* no interrupt endpoint or nothing happened */
+#ifdef HAVE_UNISTD_H
+			usleep (100000);
+#endif
+			continue;
+		}
+		put16 (body, event.Code);
+		put32 (body + 2, event.Transaction_ID);
+		put32 (body + 6, event.Param1);
+		put32 (body + 10, event.Param2);
+		put32 (body + 14, event.Param3);
+		pthread_mutex_lock (&server->lock);
+		/* the clients refresh themselves, so must the answers */
+		if (event.Code != PTP_EC_DevicePropChanged)
+			ptpip_serve_forget (server, 0);
+		for (c = server->clients; c != NULL; c = c->next)
+			if (c->evtfd >= 0)
+				(void) ptpip_send_packet (c->evtfd, PTPIP_EVENT,
+							  body, sizeof(body));
+		pthread_mutex_unlock (&server->lock);
+	}
+	return NULL;
+}
+
+/**
+ * ptp_ptpip_serve:
+ * params:	PTPParams*
+ *		const char *path	- unix socket to listen on
+ *		PTPIOGetResp event_check - waits a little for the next event
+ *					  of the device, the clients wait
+ *					  meanwhile
+ *
+ * Lets local clients share the open session of a device. They connect
+ * with ptp_ptpip_connect() to "unix:path", see above for how their
+ * transactions are run. Events of the device go to every client.
+ * This serves until it is interrupted by a signal, a socket left at
+ * the path is replaced.
+ *
+ * Return values: 0 when interrupted, -1 on failure.
+ **/
+int
+ptp_ptpip_serve (PTPParams* params, const char *path, PTPIOGetResp event_check)
+{
+	struct sockaddr_un	addr;
+	struct timeval		tv;
+	PTPIPServer		server;
+	int			size = PTPIP_SOCKBUF;
+	PTPIPClient		*c;
+	pthread_t		events;
+	int			have_events = 0;
+	int			ret = 0;
+	int			fd;
+
+	if (strlen (path) >= sizeof(addr.sun_path)) {
+		ptp_error (params, "PTP/IP: socket path %s is too long", path);
+		return -1;
+	}
+	memset (&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
+	fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	(void) unlink (path);
+	if (bind (fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen (fd, 8) < 0) {
+		ptp_error (params, "PTP/IP: could not listen on %s: %s",
+			   path, strerror (errno));
+		close (fd);
+		return -1;
+	}
+
+	memset (&server, 0, sizeof(server));
+	server.params = params;
+	server.event_check = event_check;
+	if (pthread_mutex_init (&server.lock, NULL) != 0) {
+		close (fd);
+		return -1;
+	}
+	if (pthread_cond_init (&server.cond, NULL) != 0) {
+		pthread_mutex_destroy (&server.lock);
+		close (fd);
+		return -1;
+	}
+	if (event_check != NULL &&
+	    pthread_create (&events, NULL, ptpip_serve_device_events, &server) == 0)
+		have_events = 1;
+
+	for (;;) {
+		PTPIPAccepted	*acc;
+		pthread_t	thread;
+		int		cfd = accept (fd, NULL, NULL);
+
+		if (cfd < 0) {
+			if (errno != EINTR)
+				ret = -1;
+			break;
+		}
+		acc = malloc (sizeof(PTPIPAccepted));
+		if (acc == NULL) {
+			close (cfd);
+			continue;
+		}
+		/* a client that stops reading must not hold up the others */
+		tv.tv_sec = PTPIP_TIMEOUT;
+		tv.tv_usec = 0;
+		(void) setsockopt (cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		(void) setsockopt (cfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		acc->server = &server;
+		acc->fd = cfd;
+		pthread_mutex_lock (&server.lock);
+		server.threads++;
+		pthread_mutex_unlock (&server.lock);
+		if (pthread_create (&thread, NULL, ptpip_serve_connection, acc) != 0) {
+			pthread_mutex_lock (&server.lock);
+			server.threads--;
+			pthread_mutex_unlock (&server.lock);
+			free (acc);
+			close (cfd);
+			continue;
+		}
+		pthread_detach (thread);
+	}
+	close (fd);
+	(void) unlink (path);
+
+	/* hang up on everybody and wait for their threads */
+	pthread_mutex_lock (&server.lock);
+	server.stop = 1;
+	for (c = server.clients; c != NULL; c = c->next) {
+		shutdown (c->cmdfd, SHUT_RDWR);
+		if (c->evtfd >= 0)
+			shutdown (c->evtfd, SHUT_RDWR);
+	}
+	while (server.threads > 0)
+		pthread_cond_wait (&server.cond, &server.lock);
+	ptpip_serve_forget (&server, 1);
+	pthread_mutex_unlock (&server.lock);
+	if (have_events)
+		pthread_join (events, NULL);
+	pthread_cond_destroy (&server.cond);
+	pthread_mutex_destroy (&server.lock);
+	return ret;
+}
+
+#else /* HAVE_SYS_UN_H && HAVE_PTHREAD_H */
+
+int
+ptp_ptpip_serve (PTPParams* params, const char *path, PTPIOGetResp event_check)
+{
+	ptp_error (params, "PTP/IP: sharing a device needs unix sockets and threads");
+	return -1;
+}
+
+#endif /* HAVE_SYS_UN_H && HAVE_PTHREAD_H */
+
+#else /* HAVE_SYS_SOCKET_H */
+
+int
+ptp_ptpip_connect (PTPParams* params, const char *address)
+{
+	params->cmdfd = -1;
+	params->evtfd = -1;
+	ptp_error (params, "PTP/IP: no sockets on this system");
+	return -1;
+}
+
+void
+ptp_ptpip_disconnect (PTPParams* params)
+{
+}
+
+uint16_t
+ptp_ptpip_sendreq (PTPParams* params, PTPContainer* req, int dataphase)
+{
+	return PTP_ERROR_IO;
+}
+
+uint16_t
+ptp_ptpip_senddata (PTPParams* params, PTPContainer* ptp,
+		    uint64_t size, PTPDataHandler *handler)
+{
+	return PTP_ERROR_IO;
+}
+
+uint16_t
+ptp_ptpip_getdata (PTPParams* params, PTPContainer* ptp,
+		   PTPDataHandler *handler)
+{
+	return PTP_ERROR_IO;
+}
+
+uint16_t
+ptp_ptpip_getresp (PTPParams* params, PTPContainer* resp)
+{
+	return PTP_ERROR_IO;
+}
+
+uint16_t
+ptp_ptpip_cancelreq (PTPParams* params, uint32_t transaction_id)
+{
+	return PTP_ERROR_IO;
+}
+
+uint16_t
+ptp_ptpip_event_check (PTPParams* params, PTPContainer* event)
+{
+	return PTP_ERROR_IO;
+}
+
+uint16_t
+ptp_ptpip_event_check_queue (PTPParams* params, PTPContainer* event)
+{
+	return PTP_ERROR_IO;
+}
+
+uint16_t
+ptp_ptpip_event_wait (PTPParams* params, PTPContainer* event)
+{
+	return PTP_ERROR_IO;
+}
+
+int
+ptp_ptpip_serve (PTPParams* params, const char *path, PTPIOGetResp event_check)
+{
+	ptp_error (params, "PTP/IP: no sockets on this system");
+	return -1;
+}
+
+#endif /* HAVE_SYS_SOCKET_H */
@@ -77,20 +77,31 @@ int ucs2_strlen(uint16_t const * const unicstr)
 char *utf16_to_utf8(LIBMTP_mtpdevice_t *device, const uint16_t *unicstr)
 {
   char loclstr[STRING_BUFFER_LENGTH*3+1]; // UTF-8 encoding is max 3 bytes per UCS2 char.
+  PTPParams *params = (PTPParams *) device->params;
 
   loclstr[0]='\0';
+  if (params->utf8_strings) {
+    int len = ucs2_strlen(unicstr);
+
+    if (len > STRING_BUFFER_LENGTH)
+      len = STRING_BUFFER_LENGTH;
+    if (ptp_ucs2_to_utf8((const unsigned char *) unicstr, len,
+			 loclstr, sizeof(loclstr)) < 0)
+      loclstr[0] = '\0';
+  }
   #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
-  PTPParams *params = (PTPParams *) device->params;
-  char *stringp = (char *) unicstr;
-  char *locp = loclstr;
-  size_t nconv;
-  size_t convlen = (ucs2_strlen(unicstr)+1) * sizeof(uint16_t); // UCS-2 is 16 bit wide, include terminator
-  size_t convmax = STRING_BUFFER_LENGTH*3;
-  /* Do the conversion.  */
-  nconv = iconv(params->cd_ucs2_to_locale, &stringp, &convlen, &locp, &convmax);
-  if (nconv == (size_t) -1) {
-    // Return partial string anyway.
-    *locp = '\0';
+  else {
+    char *stringp = (char *) unicstr;
+    char *locp = loclstr;
+    size_t nconv;
+    size_t convlen = (ucs2_strlen(unicstr)+1) * sizeof(uint16_t); // UCS-2 is 16 bit wide, include terminator
+    size_t convmax = STRING_BUFFER_LENGTH*3;
+    /* Do the conversion.  */
+    nconv = iconv(params->cd_ucs2_to_locale, &stringp, &convlen, &locp, &convmax);
+    if (nconv == (size_t) -1) {
+      // Return partial string anyway.
+      *locp = '\0';
+    }
   }
   #endif
   loclstr[STRING_BUFFER_LENGTH*3] = '\0';
@@ -114,17 +125,29 @@ uint16_t *utf8_to_utf16(LIBMTP_mtpdevice_t *device, const char *localstr)
   char unicstr[(STRING_BUFFER_LENGTH+1)*2]; // UCS2 encoding is 2 bytes per UTF-8 char.
   char *unip = unicstr;
   size_t nconv = 0;
+  PTPParams *params = (PTPParams *) device->params;
 
   unicstr[0]='\0';
   unicstr[1]='\0';
 
+  if (params->utf8_strings) {
+    int len = ptp_utf8_to_ucs2(localstr, strlen(localstr),
+			       (unsigned char *) unicstr, STRING_BUFFER_LENGTH);
+
+    if (len < 0)
+      len = 0;
+    unip = unicstr + len * 2;
+    unip[0] = '\0';
+    unip[1] = '\0';
+  }
   #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
-  PTPParams *params = (PTPParams *) device->params;
-  char *stringp = (char *) localstr; // cast away "const"
-  size_t convlen = strlen(localstr)+1; // utf8 bytes, include terminator
-  size_t convmax = STRING_BUFFER_LENGTH*2;
-  /* Do the conversion.  */
-  nconv = iconv(params->cd_locale_to_ucs2, &stringp, &convlen, &unip, &convmax);
+  else {
+    char *stringp = (char *) localstr; // cast away "const"
+    size_t convlen = strlen(localstr)+1; // utf8 bytes, include terminator
+    size_t convmax = STRING_BUFFER_LENGTH*2;
+    /* Do the conversion.  */
+    nconv = iconv(params->cd_locale_to_ucs2, &stringp, &convlen, &unip, &convmax);
+  }
   #endif
   
   if (nconv == (size_t) -1) {